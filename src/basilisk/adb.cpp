@@ -33,6 +33,8 @@
 #include "prefs.h"
 #include "video.h"
 #include "adb.h"
+#include "snapshot.h"
+#include "replay_esp32.h"
 
 #ifdef POWERPC_ROM
 #include "thunks.h"
@@ -48,25 +50,50 @@
 
 // Global variables
 // Mouse and keyboard state - in internal SRAM for fast access during ADB interrupt
-DRAM_ATTR static int mouse_x = 0, mouse_y = 0;							// Mouse position
+// The input thread (ADBMouseMoved() etc.) and ADBInterrupt() on the CPU
+// thread share mouse_xy and the event buffer without a lock: mouse_xy
+// holds x and y in one word, so both are read and written with a single
+// atomic access (relative motion is added up with a compare-and-swap and
+// taken with an exchange), and the event buffer has one writer and one reader.
+DRAM_ATTR static uint32 mouse_xy = 0;							// Mouse position, x << 16 | y
 static int old_mouse_x = 0, old_mouse_y = 0;
 static bool mouse_button[3] = {false, false, false};			// Mouse button states
 static bool old_mouse_button[3] = {false, false, false};
 static bool relative_mouse = false;
 
+static inline uint32 pack_mouse(int x, int y)
+{
+	return ((uint32)(uint16)x << 16) | (uint16)y;
+}
+
+static inline void unpack_mouse(uint32 xy, int &x, int &y)
+{
+	x = (int16)(xy >> 16);
+	y = (int16)xy;
+}
+
 // Key states matrix - accessed frequently during ADB processing
 DRAM_ATTR static uint8 key_states[16];				// Key states (Mac keycodes)
 #define MATRIX(code) (key_states[code >> 3] & (1 << (~code & 7)))
 
-// Keyboard event buffer (Mac keycodes with up/down flag)
-const int KEY_BUFFER_SIZE = 16;
-DRAM_ATTR static uint8 key_buffer[KEY_BUFFER_SIZE];
-static unsigned int key_read_ptr = 0, key_write_ptr = 0;
-
-// O2S: Button event buffer (Mac button with up/down flag) -> avoid to loose tap on a trackpad
-const int BUTTON_BUFFER_SIZE = 32;
-DRAM_ATTR static uint8 button_buffer[BUTTON_BUFFER_SIZE];
-static unsigned int button_read_ptr = 0, button_write_ptr = 0;
+// Keyboard and button event buffer, in the order the events happened.
+// The input thread fills an entry and then publishes it with a release
+// store of event_write_ptr; ADBInterrupt() frees it the same way with
+// event_read_ptr. When full, new events are dropped, never the queued ones.
+enum {
+	EVENT_KEY,			// code = Mac keycode, 0x80 set for key up
+	EVENT_BUTTON		// code = mouse button, 0x80 set for button up
+};
+
+struct adb_event {
+	uint8 type;
+	uint8 code;
+	int16 x, y;			// Button: mouse position (absolute) or motion since the last event (relative)
+};
+
+const uint32 EVENT_BUFFER_SIZE = 64;	// Power of 2
+DRAM_ATTR static adb_event event_buffer[EVENT_BUFFER_SIZE];
+static uint32 event_read_ptr = 0, event_write_ptr = 0;	// Free-running, index modulo EVENT_BUFFER_SIZE
 
 static uint8 mouse_reg_3[2] = {0x63, 0x01};	// Mouse ADB register 3
 
@@ -75,9 +102,6 @@ static uint8 key_reg_3[2] = {0x62, 0x05};	// Keyboard ADB register 3
 
 static uint8 m_keyboard_type = 0x05;
 
-// ADB mouse motion lock (for platforms that use separate input thread)
-static B2_mutex *mouse_lock;
-
 
 /*
  *  Initialize ADB emulation
@@ -85,7 +109,6 @@ static B2_mutex *mouse_lock;
 
 void ADBInit(void)
 {
-	mouse_lock = B2_create_mutex();
 	m_keyboard_type = (uint8)PrefsFindInt32("keyboardtype");
 	key_reg_3[1] = m_keyboard_type;
 }
@@ -97,11 +120,34 @@ void ADBInit(void)
 
 void ADBExit(void)
 {
-	if (mouse_lock) {
-		B2_delete_mutex(mouse_lock);
-		mouse_lock = NULL;
+}
+
+
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the keyboard and mouse state; keys and buttons that
+ *  were held when the snapshot was taken are released after a restore
+ *  (Caps Lock excepted, it locks)
+ */
+
+bool ADBSnapshot(void)
+{
+	if (!SnapshotVar(mouse_xy) || !SnapshotVar(old_mouse_x) || !SnapshotVar(old_mouse_y)
+	 || !SnapshotVar(mouse_button) || !SnapshotVar(old_mouse_button) || !SnapshotVar(relative_mouse)
+	 || !SnapshotVar(key_states) || !SnapshotVar(mouse_reg_3) || !SnapshotVar(key_reg_2) || !SnapshotVar(key_reg_3))
+		return false;
+	if (SnapshotRestoring()) {
+		event_read_ptr = event_write_ptr = 0;
+		for (int code = 0; code < 128; code++)
+			if (code != 0x39 && MATRIX(code))
+				ADBKeyUp(code);
+		for (int button = 0; button < 3; button++)
+			if (mouse_button[button])
+				ADBMouseUp(button);
 	}
+	return true;
 }
+#endif
 
 
 /*
@@ -215,6 +261,11 @@ void ADBOp(uint8 op, uint8 *data)
 						reg2hi &= ~0x20;
 					if (MATRIX(0x75))	// Delete
 						reg2hi &= ~0x40;
+#if REPLAY
+					uint16 keys = ReplayInput(REPLAY_ADB_KEYS, (reg2hi << 8) | reg2lo);
+					reg2hi = keys >> 8;
+					reg2lo = keys & 0xff;
+#endif
 					data[0] = 2;
 					data[1] = reg2hi;
 					data[2] = reg2lo;
@@ -239,36 +290,76 @@ void ADBOp(uint8 op, uint8 *data)
 
 
 /*
- *  Mouse was moved (x/y are absolute or relative, depending on ADBSetRelMouseMode())
+ *  Queue keyboard or button event for ADBInterrupt() (input thread only)
  */
 
-void ADBMouseMoved(int x, int y)
+static void queue_event(uint8 type, uint8 code)
 {
-	B2_lock_mutex(mouse_lock);
-	if (relative_mouse) {
-		mouse_x += x; mouse_y += y;
-	} else {
-		mouse_x = x; mouse_y = y;
+	uint32 w = event_write_ptr;
+	if (w - __atomic_load_n(&event_read_ptr, __ATOMIC_ACQUIRE) >= EVENT_BUFFER_SIZE) {
+		D(bug("ADB event buffer full, event %d/%02x dropped\n", type, code));
+		return;
+	}
+
+	adb_event &e = event_buffer[w % EVENT_BUFFER_SIZE];
+	e.type = type;
+	e.code = code;
+	if (type == EVENT_BUTTON) {
+
+		// Tie the button to where the mouse was at the time
+		uint32 xy;
+		if (__atomic_load_n(&relative_mouse, __ATOMIC_RELAXED))
+			xy = __atomic_exchange_n(&mouse_xy, 0, __ATOMIC_RELAXED);
+		else
+			xy = __atomic_load_n(&mouse_xy, __ATOMIC_RELAXED);
+		e.x = (int16)(xy >> 16);
+		e.y = (int16)xy;
 	}
-	B2_unlock_mutex(mouse_lock);
+	__atomic_store_n(&event_write_ptr, w + 1, __ATOMIC_RELEASE);
+
 	SetInterruptFlag(INTFLAG_ADB);
 	TriggerInterrupt();
 }
 
 
+/*
+ *  Mouse was moved (x/y are absolute or relative, depending on ADBSetRelMouseMode())
+ */
+
+static void add_mouse_motion(int x, int y)
+{
+	// Add to the motion not taken yet, held at the 16-bit limits
+	uint32 old_xy = __atomic_load_n(&mouse_xy, __ATOMIC_RELAXED);
+	uint32 new_xy;
+	do {
+		int mx, my;
+		unpack_mouse(old_xy, mx, my);
+		mx += x;
+		my += y;
+		mx = mx > 32767 ? 32767 : (mx < -32768 ? -32768 : mx);
+		my = my > 32767 ? 32767 : (my < -32768 ? -32768 : my);
+		new_xy = pack_mouse(mx, my);
+	} while (!__atomic_compare_exchange_n(&mouse_xy, &old_xy, new_xy, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void ADBMouseMoved(int x, int y)
+{
+	// No interrupt of its own: however many moves come in, the next 60Hz
+	// ADB interrupt takes them together
+	if (__atomic_load_n(&relative_mouse, __ATOMIC_RELAXED))
+		add_mouse_motion(x, y);
+	else
+		__atomic_store_n(&mouse_xy, pack_mouse(x, y), __ATOMIC_RELAXED);
+}
+
+
 /*
  *  Mouse button pressed
  */
 
 void ADBMouseDown(int button)
 {
-    // O2S: Add button to buffer
-    button_buffer[button_write_ptr] = button;
-    button_write_ptr = (button_write_ptr + 1) % BUTTON_BUFFER_SIZE;
-
-    // O2S: mouse_button[button] = true;
-	SetInterruptFlag(INTFLAG_ADB);
-	TriggerInterrupt();
+	queue_event(EVENT_BUTTON, button);
 }
 
 
@@ -278,13 +369,7 @@ void ADBMouseDown(int button)
 
 void ADBMouseUp(int button)
 {
-    // O2S: Add button to buffer
-    button_buffer[button_write_ptr] = button | 0x80;
-    button_write_ptr = (button_write_ptr + 1) % BUTTON_BUFFER_SIZE;
-
-    // O2S: mouse_button[button] = false;
-	SetInterruptFlag(INTFLAG_ADB);
-	TriggerInterrupt();
+	queue_event(EVENT_BUTTON, button | 0x80);
 }
 
 
@@ -294,10 +379,10 @@ void ADBMouseUp(int button)
 
 void ADBSetRelMouseMode(bool relative)
 {
-	if (relative_mouse != relative) {
-		relative_mouse = relative;
-		mouse_x = mouse_y = 0;
-    }
+	if (__atomic_load_n(&relative_mouse, __ATOMIC_RELAXED) != relative) {
+		__atomic_store_n(&mouse_xy, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&relative_mouse, relative, __ATOMIC_RELAXED);
+	}
 }
 
 
@@ -307,16 +392,11 @@ void ADBSetRelMouseMode(bool relative)
 
 void ADBKeyDown(int code)
 {
-	// Add keycode to buffer
-	key_buffer[key_write_ptr] = code;
-	key_write_ptr = (key_write_ptr + 1) % KEY_BUFFER_SIZE;
-
 	// Set key in matrix
 	key_states[code >> 3] |= (1 << (~code & 7));
 
-	// Trigger interrupt
-	SetInterruptFlag(INTFLAG_ADB);
-	TriggerInterrupt();
+	// Add keycode to buffer, trigger interrupt
+	queue_event(EVENT_KEY, code);
 }
 
 
@@ -326,16 +406,11 @@ void ADBKeyDown(int code)
 
 void ADBKeyUp(int code)
 {
-	// Add keycode to buffer
-	key_buffer[key_write_ptr] = code | 0x80;	// Key-up flag
-	key_write_ptr = (key_write_ptr + 1) % KEY_BUFFER_SIZE;
-
 	// Clear key in matrix
 	key_states[code >> 3] &= ~(1 << (~code & 7));
 
-	// Trigger interrupt
-	SetInterruptFlag(INTFLAG_ADB);
-	TriggerInterrupt();
+	// Add keycode to buffer (with key-up flag), trigger interrupt
+	queue_event(EVENT_KEY, code | 0x80);
 }
 
 
@@ -377,169 +452,228 @@ uint8 ADBGetKeyboardLEDs(void)
 
 
 /*
- *  ADB interrupt function (executed as part of 60Hz interrupt)
+ *  Send mouse packet with relative motion dx/dy (-64..63) and the current
+ *  button states to the mouse ADB handler
  */
 
-void ADBInterrupt(void)
+static void mouse_talk(uint32 adb_base, int dx, int dy)
 {
 	M68kRegisters r;
+	uint32 tmp_data = adb_base + 0x163;	// Temporary storage for faked ADB data
+	uint32 mouse_base = adb_base + 16;
 
-	// Return if ADB is not initialized
-	uint32 adb_base = ReadMacInt32(0xcf8);
-	if (!adb_base || adb_base == 0xffffffff)
+	if (mouse_reg_3[1] == 4) {
+		// Extended mouse protocol
+		WriteMacInt8(tmp_data, 3);
+		WriteMacInt8(tmp_data + 1, (dy & 0x7f) | (mouse_button[0] ? 0 : 0x80));
+		WriteMacInt8(tmp_data + 2, (dx & 0x7f) | (mouse_button[1] ? 0 : 0x80));
+		WriteMacInt8(tmp_data + 3, ((dy >> 3) & 0x70) | ((dx >> 7) & 0x07) | (mouse_button[2] ? 0x08 : 0x88));
+	} else {
+		// 100/200 dpi mode
+		WriteMacInt8(tmp_data, 2);
+		WriteMacInt8(tmp_data + 1, (dy & 0x7f) | (mouse_button[0] ? 0 : 0x80));
+		WriteMacInt8(tmp_data + 2, (dx & 0x7f) | (mouse_button[1] ? 0 : 0x80));
+	}
+	r.a[0] = tmp_data;
+	r.a[1] = ReadMacInt32(mouse_base);
+	r.a[2] = ReadMacInt32(mouse_base + 4);
+	r.a[3] = adb_base;
+	r.d[0] = (mouse_reg_3[0] << 4) | 0x0c;	// Talk 0
+	Execute68k(r.a[1], &r);
+
+	old_mouse_button[0] = mouse_button[0];
+	old_mouse_button[1] = mouse_button[1];
+	old_mouse_button[2] = mouse_button[2];
+}
+
+
+/*
+ *  Clamp motion to what one packet holds, signed 7 bits (-64 to +63)
+ */
+
+static inline int packet_delta(int d)
+{
+	return d > 63 ? 63 : (d < -64 ? -64 : d);
+}
+
+
+/*
+ *  Send relative mouse motion, one packet per interrupt; what doesn't fit
+ *  is put back and goes out with the next one
+ */
+
+static void mouse_move_relative(uint32 adb_base, int mx, int my)
+{
+	int dx = packet_delta(mx);
+	int dy = packet_delta(my);
+	if (dx == 0 && dy == 0)
 		return;
-	uint32 tmp_data = adb_base + 0x163;	// Temporary storage for faked ADB data
+	mouse_talk(adb_base, dx, dy);
+	if (dx != mx || dy != my)
+		add_mouse_motion(mx - dx, my - dy);
+}
 
-	// Get mouse state
-	B2_lock_mutex(mouse_lock);
-	int mx = mouse_x;
-	int my = mouse_y;
-	if (relative_mouse)
-		mouse_x = mouse_y = 0;
-	B2_unlock_mutex(mouse_lock);
 
-	uint32 key_base = adb_base + 4;
-	uint32 mouse_base = adb_base + 16;
+/*
+ *  Change a button in relative mode, mx/my = motion before the change.
+ *  The last packet of the motion carries the new button state, so a click
+ *  costs no extra packet; only motion beyond one packet goes out first.
+ */
 
-	if (relative_mouse) {
-        while (mx != 0 || my != 0 || button_read_ptr != button_write_ptr) {
-            if (button_read_ptr != button_write_ptr) {
-                // Read button event
-                uint8 button = button_buffer[button_read_ptr];
-                button_read_ptr = (button_read_ptr + 1) % BUTTON_BUFFER_SIZE;
-                mouse_button[button & 0x3] = (button & 0x80) ? false : true;
-            }
-            
-            // Clamp movement to signed 7-bit range (-64 to +63)
-            // This ensures we don't lose movement when accumulation exceeds one packet
-            int dx = mx;
-            int dy = my;
-            if (dx > 63) {
-                dx = 63;
-            } else if (dx < -64) {
-                dx = -64;
-            }
-            if (dy > 63) {
-                dy = 63;
-            } else if (dy < -64) {
-                dy = -64;
-            }
-            
-            // Call mouse ADB handler with clamped values
-            if (mouse_reg_3[1] == 4) {
-                // Extended mouse protocol
-                WriteMacInt8(tmp_data, 3);
-                WriteMacInt8(tmp_data + 1, (dy & 0x7f) | (mouse_button[0] ? 0 : 0x80));
-                WriteMacInt8(tmp_data + 2, (dx & 0x7f) | (mouse_button[1] ? 0 : 0x80));
-                WriteMacInt8(tmp_data + 3, ((dy >> 3) & 0x70) | ((dx >> 7) & 0x07) | (mouse_button[2] ? 0x08 : 0x88));
-            } else {
-                // 100/200 dpi mode
-                WriteMacInt8(tmp_data, 2);
-                WriteMacInt8(tmp_data + 1, (dy & 0x7f) | (mouse_button[0] ? 0 : 0x80));
-                WriteMacInt8(tmp_data + 2, (dx & 0x7f) | (mouse_button[1] ? 0 : 0x80));
-            }
-            r.a[0] = tmp_data;
-            r.a[1] = ReadMacInt32(mouse_base);
-            r.a[2] = ReadMacInt32(mouse_base + 4);
-            r.a[3] = adb_base;
-            r.d[0] = (mouse_reg_3[0] << 4) | 0x0c;    // Talk 0
-            Execute68k(r.a[1], &r);
-
-            old_mouse_button[0] = mouse_button[0];
-            old_mouse_button[1] = mouse_button[1];
-            old_mouse_button[2] = mouse_button[2];
-            
-            // Subtract only what was sent, preserving remainder for next iteration
-            mx -= dx;
-            my -= dy;
-        }
+static void mouse_button_relative(uint32 adb_base, int mx, int my, int button, bool down)
+{
+	while (mx != packet_delta(mx) || my != packet_delta(my)) {
+		int dx = packet_delta(mx);
+		int dy = packet_delta(my);
+		mouse_talk(adb_base, dx, dy);
+		mx -= dx;
+		my -= dy;
+	}
+	mouse_button[button] = down;
+	if (mx != 0 || my != 0 || mouse_button[button] != old_mouse_button[button])
+		mouse_talk(adb_base, mx, my);
+}
 
-	} else {
 
-		// Update mouse position (absolute)
-		if (mx != old_mouse_x || my != old_mouse_y) {
+/*
+ *  Move mouse to absolute position
+ */
+
+static void mouse_move_absolute(uint32 adb_base, int mx, int my)
+{
+	if (mx == old_mouse_x && my == old_mouse_y)
+		return;
+
 #ifdef POWERPC_ROM
-			static const uint8 proc_template[] = {
-				0x2f, 0x08,		// move.l a0,-(sp)
-				0x2f, 0x00,		// move.l d0,-(sp)
-				0x2f, 0x01,		// move.l d1,-(sp)
-				0x70, 0x01,		// moveq #1,d0 (MoveTo)
-				0xaa, 0xdb,		// CursorDeviceDispatch
-				M68K_RTS >> 8, M68K_RTS & 0xff
-			};
-			BUILD_SHEEPSHAVER_PROCEDURE(proc);
-			r.a[0] = ReadMacInt32(mouse_base + 4);
-			r.d[0] = mx;
-			r.d[1] = my;
-			Execute68k(proc, &r);
+	static const uint8 proc_template[] = {
+		0x2f, 0x08,		// move.l a0,-(sp)
+		0x2f, 0x00,		// move.l d0,-(sp)
+		0x2f, 0x01,		// move.l d1,-(sp)
+		0x70, 0x01,		// moveq #1,d0 (MoveTo)
+		0xaa, 0xdb,		// CursorDeviceDispatch
+		M68K_RTS >> 8, M68K_RTS & 0xff
+	};
+	BUILD_SHEEPSHAVER_PROCEDURE(proc);
+	M68kRegisters r;
+	r.a[0] = ReadMacInt32(adb_base + 16 + 4);
+	r.d[0] = mx;
+	r.d[1] = my;
+	Execute68k(proc, &r);
 #else
-			WriteMacInt16(0x82a, mx);
-			WriteMacInt16(0x828, my);
-			WriteMacInt16(0x82e, mx);
-			WriteMacInt16(0x82c, my);
-			WriteMacInt8(0x8ce, ReadMacInt8(0x8cf));	// CrsrCouple -> CrsrNew
+	WriteMacInt16(0x82a, mx);
+	WriteMacInt16(0x828, my);
+	WriteMacInt16(0x82e, mx);
+	WriteMacInt16(0x82c, my);
+	WriteMacInt8(0x8ce, ReadMacInt8(0x8cf));	// CrsrCouple -> CrsrNew
 #endif
-			old_mouse_x = mx;
-			old_mouse_y = my;
-		}
+	old_mouse_x = mx;
+	old_mouse_y = my;
+}
+
 
-        // O2S: Process accumulated button events
-        while (button_read_ptr != button_write_ptr) {
-            // Read button event
-            uint8 button = button_buffer[button_read_ptr];
-            button_read_ptr = (button_read_ptr + 1) % BUTTON_BUFFER_SIZE;
-            mouse_button[button & 0x3] = (button & 0x80) ? false : true;
-
-            if (mouse_button[0] != old_mouse_button[0] || mouse_button[1] != old_mouse_button[1] || mouse_button[2] != old_mouse_button[2]) {
-                uint32 mouse_base = adb_base + 16;
-
-                // Call mouse ADB handler
-                if (mouse_reg_3[1] == 4) {
-                    // Extended mouse protocol
-                    WriteMacInt8(tmp_data, 3);
-                    WriteMacInt8(tmp_data + 1, mouse_button[0] ? 0 : 0x80);
-                    WriteMacInt8(tmp_data + 2, mouse_button[1] ? 0 : 0x80);
-                    WriteMacInt8(tmp_data + 3, mouse_button[2] ? 0x08 : 0x88);
-                } else {
-                    // 100/200 dpi mode
-                    WriteMacInt8(tmp_data, 2);
-                    WriteMacInt8(tmp_data + 1, mouse_button[0] ? 0 : 0x80);
-                    WriteMacInt8(tmp_data + 2, mouse_button[1] ? 0 : 0x80);
-                }
-                r.a[0] = tmp_data;
-                r.a[1] = ReadMacInt32(mouse_base);
-                r.a[2] = ReadMacInt32(mouse_base + 4);
-                r.a[3] = adb_base;
-                r.d[0] = (mouse_reg_3[0] << 4) | 0x0c;    // Talk 0
-                Execute68k(r.a[1], &r);
-
-                old_mouse_button[0] = mouse_button[0];
-                old_mouse_button[1] = mouse_button[1];
-                old_mouse_button[2] = mouse_button[2];
-            }
-        }
+/*
+ *  Take the next queued event for ADBInterrupt(); false if there is none
+ *  (a replay says what there was)
+ */
 
+static bool take_event(adb_event &e)
+{
+	bool live = event_read_ptr != __atomic_load_n(&event_write_ptr, __ATOMIC_ACQUIRE);
+	if (live) {
+		e = event_buffer[event_read_ptr % EVENT_BUFFER_SIZE];
+		__atomic_store_n(&event_read_ptr, event_read_ptr + 1, __ATOMIC_RELEASE);
 	}
+#if REPLAY
+	uint64 v = live ? ((uint64)(e.type + 1) << 40) | ((uint64)e.code << 32) | ((uint32)(uint16)e.x << 16) | (uint16)e.y : 0;
+	v = ReplayInput(REPLAY_ADB_EVENT, v);
+	live = v != 0;
+	e.type = (uint8)((v >> 40) - 1);
+	e.code = (uint8)(v >> 32);
+	e.x = (int16)(v >> 16);
+	e.y = (int16)v;
+#endif
+	return live;
+}
 
-	// Process accumulated keyboard events
-	while (key_read_ptr != key_write_ptr) {
 
-		// Read keyboard event
-		uint8 mac_code = key_buffer[key_read_ptr];
-		key_read_ptr = (key_read_ptr + 1) % KEY_BUFFER_SIZE;
+/*
+ *  Mouse position, or motion since it was last taken
+ */
 
-		// Call keyboard ADB handler
-		WriteMacInt8(tmp_data, 2);
-		WriteMacInt8(tmp_data + 1, mac_code);
-		WriteMacInt8(tmp_data + 2, mac_code == 0x7f ? 0x7f : 0xff);	// Power key is special
-		r.a[0] = tmp_data;
-		r.a[1] = ReadMacInt32(key_base);
-		r.a[2] = ReadMacInt32(key_base + 4);
-		r.a[3] = adb_base;
-		r.d[0] = (key_reg_3[0] << 4) | 0x0c;	// Talk 0
-		Execute68k(r.a[1], &r);
+static void take_mouse(bool relative, int &mx, int &my)
+{
+	uint32 xy;
+	if (relative)
+		xy = __atomic_exchange_n(&mouse_xy, 0, __ATOMIC_RELAXED);
+	else
+		xy = __atomic_load_n(&mouse_xy, __ATOMIC_RELAXED);
+#if REPLAY
+	xy = (uint32)ReplayInput(REPLAY_ADB_MOUSE, xy);
+#endif
+	unpack_mouse(xy, mx, my);
+}
+
+
+/*
+ *  ADB interrupt function (executed as part of 60Hz interrupt)
+ */
+
+void ADBInterrupt(void)
+{
+	M68kRegisters r;
+
+	// Return if ADB is not initialized
+	uint32 adb_base = ReadMacInt32(0xcf8);
+	if (!adb_base || adb_base == 0xffffffff)
+		return;
+	uint32 tmp_data = adb_base + 0x163;	// Temporary storage for faked ADB data
+	uint32 key_base = adb_base + 4;
+	bool relative = __atomic_load_n(&relative_mouse, __ATOMIC_RELAXED);
+
+	// Deliver queued keyboard and button events in order; a button event
+	// first brings the mouse to where it was when the button changed
+	uint32 queued = __atomic_load_n(&event_write_ptr, __ATOMIC_ACQUIRE) - event_read_ptr;
+#if REPLAY
+	uint64 v = ReplayInput(REPLAY_ADB, queued | (relative << 8));
+	queued = v & 0xff;
+	relative = (v >> 8) & 1;
+#endif
+	adb_event e;
+	while (queued-- > 0 && take_event(e)) {
+		if (e.type == EVENT_BUTTON) {
+			bool down = (e.code & 0x80) ? false : true;
+			if (relative) {
+				mouse_button_relative(adb_base, e.x, e.y, e.code & 0x3, down);
+			} else {
+				mouse_move_absolute(adb_base, e.x, e.y);
+				mouse_button[e.code & 0x3] = down;
+				if (mouse_button[0] != old_mouse_button[0] || mouse_button[1] != old_mouse_button[1] || mouse_button[2] != old_mouse_button[2])
+					mouse_talk(adb_base, 0, 0);
+			}
+
+		} else {
+
+			// Call keyboard ADB handler
+			WriteMacInt8(tmp_data, 2);
+			WriteMacInt8(tmp_data + 1, e.code);
+			WriteMacInt8(tmp_data + 2, e.code == 0x7f ? 0x7f : 0xff);	// Power key is special
+			r.a[0] = tmp_data;
+			r.a[1] = ReadMacInt32(key_base);
+			r.a[2] = ReadMacInt32(key_base + 4);
+			r.a[3] = adb_base;
+			r.d[0] = (key_reg_3[0] << 4) | 0x0c;	// Talk 0
+			Execute68k(r.a[1], &r);
+		}
 	}
 
+	// Motion since the last event
+	int mx, my;
+	take_mouse(relative, mx, my);
+	if (relative)
+		mouse_move_relative(adb_base, mx, my);
+	else
+		mouse_move_absolute(adb_base, mx, my);
+
 	// Clear temporary data
 	WriteMacInt32(tmp_data, 0);
 	WriteMacInt32(tmp_data + 4, 0);
@@ -33,6 +33,7 @@
 #include "audio_defs.h"
 #include "user_strings.h"
 #include "cdrom.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -67,6 +68,46 @@ void AudioReset(void)
 }
 
 
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the Sound Manager side of the driver; the host stream
+ *  is set up again as the last Open() had left it
+ */
+
+bool AudioSnapshot(void)
+{
+	audio_status status = AudioStatus;
+	bool main_mute = audio_get_main_mute(), speaker_mute = audio_get_speaker_mute();
+	uint32 main_volume = audio_get_main_volume(), speaker_volume = audio_get_speaker_volume();
+	if (!SnapshotVar(status) || !SnapshotVar(audio_data) || !SnapshotVar(open_count)
+	 || !SnapshotVar(main_mute) || !SnapshotVar(main_volume) || !SnapshotVar(speaker_mute) || !SnapshotVar(speaker_volume)
+	 || !SnapshotVar(SoundInSource) || !SnapshotVar(SoundInPlaythrough) || !SnapshotVar(SoundInGain))
+		return false;
+	if (!SnapshotRestoring())
+		return true;
+
+	for (unsigned i = 0; i < audio_sample_rates.size(); i++)
+		if (audio_sample_rates[i] == status.sample_rate)
+			audio_set_sample_rate(i);
+	for (unsigned i = 0; i < audio_sample_sizes.size(); i++)
+		if (audio_sample_sizes[i] == status.sample_size)
+			audio_set_sample_size(i);
+	for (unsigned i = 0; i < audio_channel_counts.size(); i++)
+		if (audio_channel_counts[i] == status.channels)
+			audio_set_channels(i);
+	AudioStatus.mixer = status.mixer;
+	AudioStatus.num_sources = status.num_sources;
+	audio_set_main_mute(main_mute);
+	audio_set_main_volume(main_volume);
+	audio_set_speaker_mute(speaker_mute);
+	audio_set_speaker_volume(speaker_volume);
+	if (open_count)
+		audio_enter_stream();
+	return true;
+}
+#endif
+
+
 /*
  *  Get audio info
  */
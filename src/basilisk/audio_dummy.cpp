@@ -100,14 +100,17 @@ void AudioInterrupt(void)
 
 bool audio_set_sample_rate(int index)
 {
+	return false;
 }
 
 bool audio_set_sample_size(int index)
 {
+	return false;
 }
 
 bool audio_set_channels(int index)
 {
+	return false;
 }
 
 
@@ -0,0 +1,712 @@
+/*
+ *  audio_esp32.cpp - Audio output through the Tab5 speaker
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The Apple Mixer renders all Sound Manager channels into blocks of
+ *  audio_frames_per_block frames in the format advertised here. The audio
+ *  task on Core 0 asks for the next block (INTFLAG_AUDIO) whenever the
+ *  sample ring has room for one; AudioInterrupt() on the 68k thread then
+ *  fetches it with GetSourceData() and appends it to the ring. The ring has
+ *  one writer and one reader and needs no lock.
+ *
+ *  The audio task drains the ring in short blocks into M5.Speaker, which
+ *  brings up the codec and amplifier and owns the I2S DMA. It keeps one
+ *  block playing and one queued (double buffering), so a late 68k only
+ *  costs ring fill, not a gap.
+ *
+ *  The mixer runs in any of the advertised formats (8/16-bit, mono/stereo,
+ *  the classic 11127/22254.5 Hz rates as well as 11025/22050/44100 Hz), so
+ *  old software that sets its own rate is not resampled twice. The task
+ *  converts to 16-bit stereo at the I2S rate with a converter specialised
+ *  per input format and a 16.16 fixed-point linear interpolator, and
+ *  M5.Speaker only forwards the result to the DMA unchanged.
+ *
+ *  CD audio from .cue images (CD_AUDIO) is already 44.1 kHz 16-bit stereo:
+ *  the task copies it from the CD ring (cdaudio_esp32.cpp) into a speaker
+ *  channel of its own, which M5.Speaker mixes with the Mac sound.
+ */
+
+#include "sysdeps.h"
+
+#include <M5Unified.h>
+#include <esp_heap_caps.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "prefs.h"
+#include "audio.h"
+#include "audio_defs.h"
+#include "log_esp32.h"
+#include "cdaudio_esp32.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+// Sizes: a mixer block is 23 ms at 22050 Hz; the ring holds four of them
+// and output starts once two are in, which leaves ~45 ms for the 68k to
+// answer an INTFLAG_AUDIO before the speaker runs dry
+#define AUDIO_FRAMES_PER_BLOCK  512
+#define AUDIO_RING_BLOCKS       4
+#define AUDIO_PRIME_BLOCKS      2
+#define AUDIO_RING_SIZE         (AUDIO_RING_BLOCKS * AUDIO_FRAMES_PER_BLOCK * 4)  // Bytes, room for 16-bit stereo
+#define AUDIO_OUT_FRAMES        512     // Frames per block handed to M5.Speaker (11.6 ms at 44100 Hz)
+#define AUDIO_OUT_BUFFERS       3       // One playing, one queued, one being filled
+#define AUDIO_SPEAKER_CHANNEL   0
+#define AUDIO_SPEAKER_RATE      44100   // I2S rate; the converter output is already at it
+
+// Mac sample rates (16.16 fixed point) besides the plain 11025/22050/44100 Hz
+#define AUDIO_RATE_22254        0x56ee8ba3  // 22254.54 Hz, the original Mac sound hardware rate
+#define AUDIO_RATE_11127        0x2b7745d1  // 11127.27 Hz, half of it
+#define AUDIO_VOLUME_MAX        192     // M5.Speaker volume at full Mac volume
+
+#define AUDIO_TASK_STACK_SIZE   4096
+#define AUDIO_TASK_PRIORITY     2       // Above video and input, it only runs briefly
+#define AUDIO_TASK_CORE         0
+#define AUDIO_IDLE_TIMEOUT_MS   100     // Backstop wake-up while no stream is open
+
+#if AUDIO_NATIVE_SOUNDS
+// Built-in sounds, rendered once into PSRAM and mixed in by M5.Speaker on
+// a channel of their own
+#define SOUND_RATE              22050
+#define SOUND_CHANNEL           1
+#define SOUND_CHIME_MS          1800
+#define SOUND_BEEP_MS           160
+
+enum {
+    SOUND_CHIME = 1,
+    SOUND_BEEP = 2
+};
+#endif
+
+// Sample ring (Mac format, as the mixer delivers it); free-running byte
+// counts, ring_write advanced by AudioInterrupt(), ring_read by the task
+DRAM_ATTR static uint8 ring[AUDIO_RING_SIZE];
+static uint32 ring_write = 0;
+static uint32 ring_read = 0;
+static uint32 frame_bytes = 4;              // Bytes per frame in AudioStatus format
+
+// Resampler state, step and phase are 16.16 fixed point source frames per
+// output frame; the output is interpolated between prev and cur
+struct resampler {
+    uint32 step;
+    uint32 phase;
+    int32 prev_l, prev_r;
+    int32 cur_l, cur_r;
+};
+static resampler rs;
+
+// Converts up to out_frames frames into dest and returns the number made,
+// less than out_frames when the ring runs out of source frames
+typedef int (*convert_func)(int16 *dest, int out_frames, uint32 &pos, uint32 avail);
+static convert_func convert_frames = NULL;
+
+static int16 out_buffer[AUDIO_OUT_BUFFERS][AUDIO_OUT_FRAMES * 2];
+static int out_next = 0;
+
+static TaskHandle_t audio_task_handle = NULL;
+static volatile bool audio_task_running = false;
+static volatile bool stream_open = false;   // Between audio_enter_stream() and audio_exit_stream()
+static volatile bool irq_pending = false;   // INTFLAG_AUDIO raised, block not delivered yet
+static bool primed = false;                 // Output running (ring was filled to AUDIO_PRIME_BLOCKS)
+
+// Statistics (reset by Audio_report_stats)
+static volatile uint32 audio_underruns = 0;
+static volatile uint32 audio_overflows = 0;
+static volatile uint32 audio_blocks = 0;
+
+#if AUDIO_NATIVE_SOUNDS
+static volatile uint32 sound_requests = 0;  // SOUND_* bits, taken by the audio task
+static int16 *chime_pcm = NULL;
+static int16 *beep_pcm = NULL;
+#endif
+
+// Volume state (8.8 fixed point per channel, left in the upper 16 bits)
+static bool main_mute = false;
+static bool speaker_mute = false;
+static uint32 main_volume = 0x01000100;
+static uint32 speaker_volume = 0x01000100;
+
+
+/*
+ *  Apply Mac volume and mute to the speaker
+ */
+
+static void update_volume(void)
+{
+    if (!audio_open) {
+        return;
+    }
+    uint32 main_level = ((main_volume >> 16) + (main_volume & 0xffff)) / 2;
+    uint32 speaker_level = ((speaker_volume >> 16) + (speaker_volume & 0xffff)) / 2;
+    uint32 level = (main_level * speaker_level) >> 8;
+    if (level > 0x100) {
+        level = 0x100;
+    }
+    if (main_mute || speaker_mute) {
+        level = 0;
+    }
+    M5.Speaker.setVolume((uint8)((level * AUDIO_VOLUME_MAX) >> 8));
+}
+
+
+/*
+ *  Format converters: Mac sample format to 16-bit host order stereo at the
+ *  I2S rate. One instance per sample size and channel count, so the inner
+ *  loop has no format branches; the ring size is a multiple of every frame
+ *  size, so a frame never wraps around the end of the ring.
+ */
+
+template <int BITS, int CHANNELS>
+static inline void read_frame(uint32 pos, int32 &l, int32 &r)
+{
+    const uint8 *p = ring + (pos & (AUDIO_RING_SIZE - 1));
+    if (BITS == 8) {
+        // 8-bit samples are offset binary ('raw ')
+        l = (int32)(int8)(p[0] ^ 0x80) << 8;
+        r = CHANNELS == 2 ? (int32)(int8)(p[1] ^ 0x80) << 8 : l;
+    } else {
+        // 16-bit samples are big-endian two's complement ('twos')
+        l = (int16)((p[0] << 8) | p[1]);
+        r = CHANNELS == 2 ? (int16)((p[2] << 8) | p[3]) : l;
+    }
+}
+
+template <int BITS, int CHANNELS>
+static int convert(int16 *dest, int out_frames, uint32 &pos, uint32 avail)
+{
+    const uint32 fb = BITS / 8 * CHANNELS;
+    uint32 step = rs.step;
+    uint32 phase = rs.phase;
+    int32 prev_l = rs.prev_l, prev_r = rs.prev_r;
+    int32 cur_l = rs.cur_l, cur_r = rs.cur_r;
+    int n = 0;
+
+    while (n < out_frames) {
+        // Step to the source frame pair around the output position
+        while (phase >= 0x10000) {
+            if (avail == 0) {
+                goto done;
+            }
+            prev_l = cur_l;
+            prev_r = cur_r;
+            read_frame<BITS, CHANNELS>(pos, cur_l, cur_r);
+            pos += fb;
+            avail--;
+            phase -= 0x10000;
+        }
+        int32 frac = phase >> 1;    // 15 bits, keeps the product in range
+        *dest++ = (int16)(prev_l + (((cur_l - prev_l) * frac) >> 15));
+        *dest++ = (int16)(prev_r + (((cur_r - prev_r) * frac) >> 15));
+        phase += step;
+        n++;
+    }
+
+done:
+    rs.phase = phase;
+    rs.prev_l = prev_l;
+    rs.prev_r = prev_r;
+    rs.cur_l = cur_l;
+    rs.cur_r = cur_r;
+    return n;
+}
+
+// Pick the converter and step for the current AudioStatus format
+static void update_format(void)
+{
+    static const convert_func converters[2][2] = {
+        { convert<8, 1>, convert<8, 2> },
+        { convert<16, 1>, convert<16, 2> }
+    };
+    bool wide = AudioStatus.sample_size == 16;
+    bool stereo = AudioStatus.channels == 2;
+    convert_frames = converters[wide][stereo];
+    frame_bytes = (wide ? 2 : 1) * (stereo ? 2 : 1);
+    rs.step = (uint32)((uint64)AudioStatus.sample_rate / AUDIO_SPEAKER_RATE);
+}
+
+// Start a stream from silence
+static void reset_resampler(void)
+{
+    rs.phase = 0x10000;
+    rs.prev_l = rs.prev_r = 0;
+    rs.cur_l = rs.cur_r = 0;
+}
+
+
+#if AUDIO_NATIVE_SOUNDS
+/*
+ *  Built-in sounds: a chord of decaying partials for the startup chime and
+ *  a short square-ish tone like the ROM's Simple Beep. Rendered in the
+ *  audio task at first use
+ */
+
+struct partial {
+    float freq;         // Hz
+    float level;
+    float decay;        // 1/e time [s]
+};
+
+static int16 *render_sound(const partial *partials, int count, int ms)
+{
+    int frames = SOUND_RATE * ms / 1000;
+    int16 *pcm = (int16 *)heap_caps_malloc(frames * sizeof(int16), MALLOC_CAP_SPIRAM);
+    if (pcm == NULL) {
+        Serial.println("[AUDIO] WARNING: no PSRAM for built-in sound");
+        return NULL;
+    }
+    const int attack = SOUND_RATE / 200;    // 5 ms, avoids a click
+    for (int i = 0; i < frames; i++) {
+        float t = (float)i / SOUND_RATE;
+        float v = 0.0f;
+        for (int p = 0; p < count; p++) {
+            v += partials[p].level * expf(-t / partials[p].decay) * sinf(2.0f * (float)M_PI * partials[p].freq * t);
+        }
+        if (i < attack) {
+            v *= (float)i / attack;
+        }
+        int32 sample = (int32)(v * 32767.0f);
+        pcm[i] = (int16)(sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample);
+    }
+    return pcm;
+}
+
+static void play_sounds(uint32 requests)
+{
+    if (requests & SOUND_CHIME) {
+        // C major chord, fundamentals with a soft octave each
+        static const partial chime[] = {
+            { 261.63f, 0.20f, 0.70f }, { 523.25f, 0.06f, 0.40f },
+            { 329.63f, 0.18f, 0.65f }, { 659.26f, 0.05f, 0.35f },
+            { 392.00f, 0.18f, 0.60f }, { 783.99f, 0.05f, 0.30f },
+            { 523.25f, 0.14f, 0.55f }, { 130.81f, 0.10f, 0.90f }
+        };
+        if (chime_pcm == NULL) {
+            chime_pcm = render_sound(chime, sizeof(chime) / sizeof(chime[0]), SOUND_CHIME_MS);
+        }
+        if (chime_pcm) {
+            M5.Speaker.playRaw(chime_pcm, SOUND_RATE * SOUND_CHIME_MS / 1000, SOUND_RATE, false,
+                               1, SOUND_CHANNEL, true);
+        }
+    }
+    if (requests & SOUND_BEEP) {
+        // Odd harmonics of a 1 kHz tone
+        static const partial beep[] = {
+            { 1000.0f, 0.40f, 0.08f }, { 3000.0f, 0.13f, 0.06f }, { 5000.0f, 0.08f, 0.04f }
+        };
+        if (beep_pcm == NULL) {
+            beep_pcm = render_sound(beep, sizeof(beep) / sizeof(beep[0]), SOUND_BEEP_MS);
+        }
+        if (beep_pcm) {
+            M5.Speaker.playRaw(beep_pcm, SOUND_RATE * SOUND_BEEP_MS / 1000, SOUND_RATE, false,
+                               1, SOUND_CHANNEL, true);
+        }
+    }
+}
+
+static bool request_sound(uint32 sound)
+{
+    if (!audio_open || main_mute || speaker_mute) {
+        return false;
+    }
+    __atomic_or_fetch(&sound_requests, sound, __ATOMIC_RELEASE);
+    xTaskNotifyGive(audio_task_handle);
+    return true;
+}
+
+
+/*
+ *  Play the startup chime (on reset, instead of the ROM's ASC chime)
+ */
+
+void PlayStartupSound(void)
+{
+    request_sound(SOUND_CHIME);
+}
+
+
+/*
+ *  SysBeep() replacement, returns false if Mac OS has to beep
+ */
+
+bool AudioSysBeep(void)
+{
+    return request_sound(SOUND_BEEP);
+}
+#endif
+
+
+#if CD_AUDIO
+#define AUDIO_CD_CHANNEL        2
+
+static int16 cd_buffer[AUDIO_OUT_BUFFERS][AUDIO_OUT_FRAMES * 2];
+static int cd_next = 0;
+
+// Keep one block of CD audio playing and one queued, like the Mac stream
+static void play_cd(void)
+{
+    if (!CDAudioActive() || M5.Speaker.isPlaying(AUDIO_CD_CHANNEL) >= 2) {
+        return;
+    }
+    int16 *out = cd_buffer[cd_next];
+    int frames = CDAudioRead(out, AUDIO_OUT_FRAMES);
+    if (frames > 0) {
+        cd_next = (cd_next + 1) % AUDIO_OUT_BUFFERS;
+        M5.Speaker.playRaw(out, frames * 2, AUDIO_SPEAKER_RATE, true, 1, AUDIO_CD_CHANNEL, false);
+    }
+}
+
+void AudioCDStarted(void)
+{
+    if (audio_task_handle) {
+        xTaskNotifyGive(audio_task_handle);
+    }
+}
+#endif
+
+
+/*
+ *  Audio task: request mixer blocks, feed the speaker
+ */
+
+static void audioTask(void *param)
+{
+    UNUSED(param);
+    Serial.printf("[AUDIO] Audio task started on Core %d\n", xPortGetCoreID());
+
+    while (audio_task_running) {
+#if AUDIO_NATIVE_SOUNDS
+        uint32 requests = __atomic_exchange_n(&sound_requests, 0, __ATOMIC_ACQUIRE);
+        if (requests) {
+            play_sounds(requests);
+        }
+#endif
+#if CD_AUDIO
+        play_cd();
+#endif
+        bool streaming = stream_open && AudioStatus.num_sources > 0;
+        if (!streaming) {
+            // Nothing to play; drop leftovers and sleep until a stream opens
+            ring_read = __atomic_load_n(&ring_write, __ATOMIC_ACQUIRE);
+            primed = false;
+            reset_resampler();
+#if CD_AUDIO
+            if (CDAudioActive()) {
+                // The CD channel needs feeding every few ms
+                ulTaskNotifyTake(pdTRUE, 1);
+                continue;
+            }
+#endif
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(AUDIO_IDLE_TIMEOUT_MS));
+            continue;
+        }
+
+        uint32 fill = __atomic_load_n(&ring_write, __ATOMIC_ACQUIRE) - ring_read;
+        uint32 block = AUDIO_FRAMES_PER_BLOCK * frame_bytes;
+
+        // Ask the 68k for the next mixer block while the ring holds less
+        // than AUDIO_RING_BLOCKS of them (more fit in 8-bit or mono, but
+        // would only add latency)
+        if (!__atomic_load_n(&irq_pending, __ATOMIC_ACQUIRE) && fill + block <= AUDIO_RING_BLOCKS * block) {
+            __atomic_store_n(&irq_pending, true, __ATOMIC_RELAXED);
+            SetInterruptFlag(INTFLAG_AUDIO);
+            TriggerInterrupt();
+        }
+
+        // Start output once there is a cushion
+        if (!primed) {
+            if (fill < AUDIO_PRIME_BLOCKS * block) {
+                vTaskDelay(1);
+                continue;
+            }
+            primed = true;
+        }
+
+        // Keep one block playing and one queued
+        if (M5.Speaker.isPlaying(AUDIO_SPEAKER_CHANNEL) >= 2) {
+            vTaskDelay(1);
+            continue;
+        }
+
+        int16 *out = out_buffer[out_next];
+        out_next = (out_next + 1) % AUDIO_OUT_BUFFERS;
+        uint32 pos = ring_read;
+        int frames = convert_frames(out, AUDIO_OUT_FRAMES, pos, fill / frame_bytes);
+        __atomic_store_n(&ring_read, pos, __ATOMIC_RELEASE);
+        if (frames < AUDIO_OUT_FRAMES) {
+            // Ran dry: play what is there, pad with silence, and build up
+            // the cushion again before continuing
+            audio_underruns++;
+            memset(out + frames * 2, 0, (AUDIO_OUT_FRAMES - frames) * 4);
+            primed = false;
+        }
+
+        M5.Speaker.playRaw(out, AUDIO_OUT_FRAMES * 2, AUDIO_SPEAKER_RATE, true,
+                           1, AUDIO_SPEAKER_CHANNEL, false);
+    }
+
+    Serial.println("[AUDIO] Audio task exiting");
+    vTaskDelete(NULL);
+}
+
+
+/*
+ *  Initialization
+ */
+
+void AudioInit(void)
+{
+    // Init audio status and feature flags
+    AudioStatus.sample_rate = 22050 << 16;
+    AudioStatus.sample_size = 16;
+    AudioStatus.channels = 2;
+    AudioStatus.mixer = 0;
+    AudioStatus.num_sources = 0;
+    audio_component_flags = cmpWantsRegisterMessage | kStereoOut | k16BitOut | k8BitRawOut;
+    audio_frames_per_block = AUDIO_FRAMES_PER_BLOCK;
+    update_format();
+    reset_resampler();
+
+    // Any format the converters take; 22050 Hz 16-bit stereo is the
+    // default, it keeps the blocks (and the mixer's work) small
+    audio_sample_rates.push_back(AUDIO_RATE_11127);
+    audio_sample_rates.push_back(11025 << 16);
+    audio_sample_rates.push_back(AUDIO_RATE_22254);
+    audio_sample_rates.push_back(22050 << 16);
+    audio_sample_rates.push_back(44100 << 16);
+    audio_sample_sizes.push_back(8);
+    audio_sample_sizes.push_back(16);
+    audio_channel_counts.push_back(1);
+    audio_channel_counts.push_back(2);
+
+    // Sound disabled in prefs? Then do nothing
+    if (PrefsFindBool("nosound")) {
+        return;
+    }
+
+    auto spk_cfg = M5.Speaker.config();
+    spk_cfg.sample_rate = AUDIO_SPEAKER_RATE;
+    spk_cfg.stereo = true;
+    spk_cfg.dma_buf_len = 256;      // 4 x 256 frames = 23 ms of DMA
+    spk_cfg.dma_buf_count = 4;
+    spk_cfg.task_pinned_core = AUDIO_TASK_CORE;
+    M5.Speaker.config(spk_cfg);
+    if (!M5.Speaker.begin()) {
+        Serial.println("[AUDIO] WARNING: speaker not available, no sound");
+        return;
+    }
+
+    audio_task_running = true;
+    if (xTaskCreatePinnedToCore(audioTask, "AudioTask", AUDIO_TASK_STACK_SIZE, NULL,
+                                AUDIO_TASK_PRIORITY, &audio_task_handle,
+                                PrefsFindTaskCore("audio", AUDIO_TASK_CORE)) != pdPASS) {
+        Serial.println("[AUDIO] WARNING: audio task not started, no sound");
+        audio_task_running = false;
+        M5.Speaker.end();
+        return;
+    }
+
+    audio_open = true;
+    update_volume();
+    Serial.printf("[AUDIO] Speaker open: %d Hz I2S, mixer at %d Hz by default, %d-frame blocks, %d KB ring\n",
+                  AUDIO_SPEAKER_RATE, AudioStatus.sample_rate >> 16, AUDIO_FRAMES_PER_BLOCK, AUDIO_RING_SIZE / 1024);
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void AudioExit(void)
+{
+    if (audio_task_running) {
+        audio_task_running = false;
+        xTaskNotifyGive(audio_task_handle);
+        vTaskDelay(pdMS_TO_TICKS(AUDIO_IDLE_TIMEOUT_MS + 20));
+        audio_task_handle = NULL;
+    }
+    if (audio_open) {
+        M5.Speaker.stop();
+        M5.Speaker.end();
+        audio_open = false;
+    }
+}
+
+
+/*
+ *  First source added, start audio stream
+ */
+
+void audio_enter_stream()
+{
+    stream_open = true;
+    if (audio_task_handle) {
+        xTaskNotifyGive(audio_task_handle);
+    }
+}
+
+
+/*
+ *  Last source removed, stop audio stream
+ */
+
+void audio_exit_stream()
+{
+    stream_open = false;
+}
+
+
+/*
+ *  MacOS audio interrupt, read next data block
+ */
+
+void AudioInterrupt(void)
+{
+    D(bug("AudioInterrupt\n"));
+
+    // Get data from apple mixer
+    uint32 apple_stream_info = 0;
+    if (AudioStatus.mixer) {
+        M68kRegisters r;
+        r.a[0] = audio_data + adatStreamInfo;
+        r.a[1] = AudioStatus.mixer;
+        Execute68k(audio_data + adatGetSourceData, &r);
+        D(bug(" GetSourceData() returns %08lx\n", r.d[0]));
+        apple_stream_info = ReadMacInt32(audio_data + adatStreamInfo);
+    } else {
+        WriteMacInt32(audio_data + adatStreamInfo, 0);
+    }
+
+    // Append it to the ring
+    if (apple_stream_info) {
+        uint32 size = ReadMacInt32(apple_stream_info + scd_sampleCount) * frame_bytes;
+        uint32 space = AUDIO_RING_SIZE - (ring_write - __atomic_load_n(&ring_read, __ATOMIC_ACQUIRE));
+        if (size > space) {
+            audio_overflows++;
+            size = space - space % frame_bytes;
+        }
+        uint32 src = ReadMacInt32(apple_stream_info + scd_buffer);
+        uint32 pos = ring_write % AUDIO_RING_SIZE;
+        uint32 first = size < AUDIO_RING_SIZE - pos ? size : AUDIO_RING_SIZE - pos;
+        Mac2Host_memcpy(ring + pos, src, first);
+        if (first < size) {
+            Mac2Host_memcpy(ring, src + first, size - first);
+        }
+        __atomic_store_n(&ring_write, ring_write + size, __ATOMIC_RELEASE);
+        audio_blocks++;
+    }
+
+    // Let the audio task ask again
+    __atomic_store_n(&irq_pending, false, __ATOMIC_RELEASE);
+    D(bug("AudioInterrupt done\n"));
+}
+
+
+/*
+ *  Set sampling parameters
+ *  "index" is an index into the audio_sample_rates[] etc. vectors
+ *  It is guaranteed that AudioStatus.num_sources == 0
+ */
+
+bool audio_set_sample_rate(int index)
+{
+    if (index < 0 || index >= (int)audio_sample_rates.size()) {
+        return false;
+    }
+    AudioStatus.sample_rate = audio_sample_rates[index];
+    update_format();
+    return true;
+}
+
+bool audio_set_sample_size(int index)
+{
+    if (index < 0 || index >= (int)audio_sample_sizes.size()) {
+        return false;
+    }
+    AudioStatus.sample_size = audio_sample_sizes[index];
+    update_format();
+    return true;
+}
+
+bool audio_set_channels(int index)
+{
+    if (index < 0 || index >= (int)audio_channel_counts.size()) {
+        return false;
+    }
+    AudioStatus.channels = audio_channel_counts[index];
+    update_format();
+    return true;
+}
+
+
+/*
+ *  Get/set volume controls (volume values received/returned have the left channel
+ *  volume in the upper 16 bits and the right channel volume in the lower 16 bits;
+ *  both volumes are 8.8 fixed point values with 0x0100 meaning "maximum volume"))
+ */
+
+bool audio_get_main_mute(void)
+{
+    return main_mute;
+}
+
+uint32 audio_get_main_volume(void)
+{
+    return main_volume;
+}
+
+bool audio_get_speaker_mute(void)
+{
+    return speaker_mute;
+}
+
+uint32 audio_get_speaker_volume(void)
+{
+    return speaker_volume;
+}
+
+void audio_set_main_mute(bool mute)
+{
+    main_mute = mute;
+    update_volume();
+}
+
+void audio_set_main_volume(uint32 vol)
+{
+    main_volume = vol;
+    update_volume();
+}
+
+void audio_set_speaker_mute(bool mute)
+{
+    speaker_mute = mute;
+    update_volume();
+}
+
+void audio_set_speaker_volume(uint32 vol)
+{
+    speaker_volume = vol;
+    update_volume();
+}
+
+
+/*
+ *  Print and reset audio statistics - called from the perf report
+ */
+
+void Audio_report_stats(void)
+{
+    if (!audio_open || (!stream_open && audio_underruns == 0 && audio_overflows == 0)) {
+        return;
+    }
+    uint32 fill = __atomic_load_n(&ring_write, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring_read, __ATOMIC_ACQUIRE);
+    LOG_PRINTF("[AUDIO] blocks=%u underruns=%u overflows=%u ring=%u%% sources=%d\n",
+               audio_blocks, audio_underruns, audio_overflows,
+               fill * 100 / AUDIO_RING_SIZE, AudioStatus.num_sources);
+    audio_blocks = 0;
+    audio_underruns = 0;
+    audio_overflows = 0;
+}
@@ -8,17 +8,35 @@
  *  - Hard disk image selection
  *  - CD-ROM ISO selection
  *  - RAM size selection (4/8/12/16 MB)
- *  - Settings persistence to SD card
+ *  - Disk overlay mode and PSRAM preloading of the disk image
+ *  - 68040 or 68030 (without FPU) CPU
+ *  - Resuming a suspended machine (snapshot.h), the default when there is one
+ *  - Image lists from the media catalog (media_catalog_esp32.cpp), which
+ *    includes subdirectories and puts recently used images first
+ *  - Settings persistence to SD card, with a binary copy in NVS that is
+ *    read instead of parsing the file while the file is unchanged
+ *
+ *  The screens are composed in a full-screen canvas, but after the first
+ *  frame only the parts whose state changed (list rows, radio groups,
+ *  buttons, the countdown) are redrawn, and only those rectangles are
+ *  copied to the display. The canvas is freed before BootGUI_Run()
+ *  returns, so its 1.8 MB of PSRAM is back before the emulator allocates.
  */
 
 #include <Arduino.h>
 #include <M5Unified.h>
 #include <M5GFX.h>
-#include <SD.h>
+#include <Preferences.h>
+#include <esp_heap_caps.h>
+#include "sd_esp32.h"
 #include <vector>
 #include <string>
+#include <climits>
 
 #include "boot_gui.h"
+#include "snapshot.h"
+#include "media_catalog_esp32.h"
+#include "usb_msc_esp32.h"
 
 // ============================================================================
 // Classic Mac Color Palette
@@ -102,15 +120,42 @@ static char selected_disk_path[BOOT_GUI_MAX_PATH] = "";
 static char selected_cdrom_path[BOOT_GUI_MAX_PATH] = "";
 static int selected_ram_mb = 8;  // Default 8MB
 static bool skip_gui = false;    // If true, skip boot GUI and go straight to emulator
+static int overlay_mode = BOOT_GUI_OVERLAY_OFF;
+static bool preload_disk = false; // Copy the disk image into spare PSRAM
+static int cpu_type = 4;         // 68040 with FPU, or 3 = 68030 without
+static bool resume_snapshot = false; // Resume the machine from the SD card snapshot
 
 static const char* SETTINGS_FILE = "/basilisk_settings.txt";
 
+// Binary copy of the settings in NVS; fields are only ever appended, with
+// size telling how many an older blob has
+#define SETTINGS_NVS_NAMESPACE  "basilisk"
+#define SETTINGS_NVS_KEY        "settings"
+#define SETTINGS_VERSION        1
+
+struct settings_blob {
+    uint16_t version;               // SETTINGS_VERSION
+    uint16_t size;                  // sizeof(settings_blob) when written
+    uint32_t file_size;             // SETTINGS_FILE this copy matches, to
+    uint32_t file_time;             // notice edits made on a computer
+    char disk[BOOT_GUI_MAX_PATH];
+    char cdrom[BOOT_GUI_MAX_PATH];
+    int32_t ram_mb;
+    uint8_t skip_gui;
+    uint8_t overlay;
+    uint8_t preload;
+    uint8_t cpu;                    // cpu_type, 0 (older blobs) = 68040
+};
+
 // ============================================================================
 // File Lists
 // ============================================================================
 
+// Paths from the media catalog, and what the lists show for them
 static std::vector<std::string> disk_files;
 static std::vector<std::string> cdrom_files;
+static std::vector<std::string> disk_labels;
+static std::vector<std::string> cdrom_labels;
 
 static int disk_selection_index = 0;
 static int cdrom_selection_index = 0;  // 0 = None
@@ -124,39 +169,53 @@ static int cdrom_scroll_offset = 0;
 static M5Canvas* canvas = nullptr;
 static bool gui_initialized = false;
 
+// Canvas areas drawn since the last flushDirty(), the only ones copied to
+// the display
+#define DIRTY_MAX       8
+
+struct dirty_rect {
+    int x, y, w, h;
+};
+
+static dirty_rect dirty_rects[DIRTY_MAX];
+static int dirty_count = 0;
+
 // ============================================================================
 // Forward Declarations
 // ============================================================================
 
 static void loadSettings(void);
 static void saveSettings(void);
-static void scanDiskFiles(void);
-static void scanCDROMFiles(void);
+static void populateFileLists(void);
+static void recordMediaUse(void);
 static void drawDesktopPattern(void);
 static void drawWindow(int x, int y, int w, int h, const char* title);
 static void drawButton(int x, int y, int w, int h, const char* label, bool pressed);
 static void drawListBox(int x, int y, int w, int h, const std::vector<std::string>& items, 
                         int selected, int scroll_offset, bool include_none);
+static void drawListRow(int x, int y, int w, int h, const std::vector<std::string>& items,
+                        int item_index, int selected, int scroll_offset, bool include_none);
 static void drawRadioButton(int x, int y, const char* label, bool selected);
 static void drawHappyMac(int x, int y, int scale);
 static bool isPointInRect(int px, int py, int rx, int ry, int rw, int rh);
 static void runCountdownScreen(void);
 static void runSettingsScreen(void);
+#if USB_MSC
+static void runUsbDiskScreen(void);
+#endif
 
 // ============================================================================
 // Settings Load/Save
 // ============================================================================
 
-static void loadSettings(void)
+static bool validRAMSize(int mb)
+{
+    return mb == 4 || mb == 8 || mb == 12 || mb == 16 || mb == 20;
+}
+
+// Parse the settings file (Arduino String per line, slow on a full card)
+static void loadSettingsFile(File& file)
 {
-    Serial.println("[BOOT_GUI] Loading settings...");
-    
-    File file = SD.open(SETTINGS_FILE, FILE_READ);
-    if (!file) {
-        Serial.println("[BOOT_GUI] No settings file found, using defaults");
-        return;
-    }
-    
     while (file.available()) {
         String line = file.readStringUntil('\n');
         line.trim();
@@ -179,25 +238,118 @@ static void loadSettings(void)
             Serial.printf("[BOOT_GUI] Loaded cdrom: %s\n", selected_cdrom_path);
         } else if (key == "ramsize") {
             selected_ram_mb = value.toInt();
-            if (selected_ram_mb != 4 && selected_ram_mb != 8 && 
-                selected_ram_mb != 12 && selected_ram_mb != 16) {
+            if (!validRAMSize(selected_ram_mb)) {
                 selected_ram_mb = 8;  // Default to 8MB if invalid
             }
             Serial.printf("[BOOT_GUI] Loaded RAM: %d MB\n", selected_ram_mb);
+        } else if (key == "overlay") {
+            if (value == "on" || value == "yes") {
+                overlay_mode = BOOT_GUI_OVERLAY_ON;
+            } else if (value == "discard") {
+                overlay_mode = BOOT_GUI_OVERLAY_DISCARD;
+            } else {
+                overlay_mode = BOOT_GUI_OVERLAY_OFF;
+            }
+            Serial.printf("[BOOT_GUI] Loaded overlay: %s\n", value.c_str());
+        } else if (key == "preload") {
+            preload_disk = (value == "on" || value == "yes");
+            Serial.printf("[BOOT_GUI] Loaded preload: %s\n", preload_disk ? "on" : "off");
+        } else if (key == "cpu") {
+            cpu_type = (value == "68030" || value == "3") ? 3 : 4;
+            Serial.printf("[BOOT_GUI] Loaded cpu: 680%d0\n", cpu_type);
         } else if (key == "skip_gui") {
             skip_gui = (value == "yes" || value == "true" || value == "1");
             Serial.printf("[BOOT_GUI] Loaded skip_gui: %s\n", skip_gui ? "yes" : "no");
         }
     }
+}
+
+// The NVS copy, if it exists and was made from the file as it is now
+static bool loadSettingsBlob(uint32_t file_size, uint32_t file_time)
+{
+    settings_blob blob;
+    memset(&blob, 0, sizeof(blob));
+    
+    Preferences nvs;
+    if (!nvs.begin(SETTINGS_NVS_NAMESPACE, true)) {
+        return false;
+    }
+    size_t got = nvs.getBytes(SETTINGS_NVS_KEY, &blob, sizeof(blob));
+    nvs.end();
+    
+    if (got < sizeof(blob) || blob.version != SETTINGS_VERSION || blob.size != sizeof(blob) ||
+        blob.file_size != file_size || blob.file_time != file_time) {
+        return false;
+    }
+    blob.disk[BOOT_GUI_MAX_PATH - 1] = 0;
+    blob.cdrom[BOOT_GUI_MAX_PATH - 1] = 0;
+    strcpy(selected_disk_path, blob.disk);
+    strcpy(selected_cdrom_path, blob.cdrom);
+    selected_ram_mb = validRAMSize(blob.ram_mb) ? blob.ram_mb : 8;
+    skip_gui = blob.skip_gui != 0;
+    overlay_mode = blob.overlay <= BOOT_GUI_OVERLAY_DISCARD ? blob.overlay : BOOT_GUI_OVERLAY_OFF;
+    preload_disk = blob.preload != 0;
+    cpu_type = blob.cpu == 3 ? 3 : 4;
+    Serial.printf("[BOOT_GUI] Settings from NVS: disk=%s, cdrom=%s, ram=%dMB\n",
+                  selected_disk_path, selected_cdrom_path, selected_ram_mb);
+    return true;
+}
+
+static void saveSettingsBlob(uint32_t file_size, uint32_t file_time, int overlay)
+{
+    settings_blob blob;
+    memset(&blob, 0, sizeof(blob));
+    blob.version = SETTINGS_VERSION;
+    blob.size = sizeof(blob);
+    blob.file_size = file_size;
+    blob.file_time = file_time;
+    strncpy(blob.disk, selected_disk_path, BOOT_GUI_MAX_PATH - 1);
+    strncpy(blob.cdrom, selected_cdrom_path, BOOT_GUI_MAX_PATH - 1);
+    blob.ram_mb = selected_ram_mb;
+    blob.skip_gui = skip_gui;
+    blob.overlay = overlay;
+    blob.preload = preload_disk;
+    blob.cpu = cpu_type;
+    
+    Preferences nvs;
+    if (!nvs.begin(SETTINGS_NVS_NAMESPACE, false) ||
+        nvs.putBytes(SETTINGS_NVS_KEY, &blob, sizeof(blob)) != sizeof(blob)) {
+        Serial.println("[BOOT_GUI] WARNING: Cannot store settings in NVS");
+    }
+    nvs.end();
+}
+
+static void loadSettings(void)
+{
+    Serial.println("[BOOT_GUI] Loading settings...");
     
+    // The file stays the one to edit; only its size and date are looked at
+    // while the NVS copy matches them
+    File file = SDCardFS().open(SETTINGS_FILE, FILE_READ);
+    uint32_t file_size = file ? (uint32_t)file.size() : 0;
+    uint32_t file_time = file ? (uint32_t)file.getLastWrite() : 0;
+    
+    if (loadSettingsBlob(file_size, file_time)) {
+        if (file) {
+            file.close();
+        }
+        return;
+    }
+    if (!file) {
+        Serial.println("[BOOT_GUI] No settings file found, using defaults");
+        return;
+    }
+    
+    loadSettingsFile(file);
     file.close();
+    saveSettingsBlob(file_size, file_time, overlay_mode);
 }
 
 static void saveSettings(void)
 {
     Serial.println("[BOOT_GUI] Saving settings...");
     
-    File file = SD.open(SETTINGS_FILE, FILE_WRITE);
+    File file = SDCardFS().open(SETTINGS_FILE, FILE_WRITE);
     if (!file) {
         Serial.println("[BOOT_GUI] ERROR: Cannot open settings file for writing");
         return;
@@ -207,65 +359,68 @@ static void saveSettings(void)
     file.printf("cdrom=%s\n", selected_cdrom_path);
     file.printf("ramsize=%d\n", selected_ram_mb);
     file.printf("skip_gui=%s\n", skip_gui ? "yes" : "no");
-    
+    // Discarding is one-shot; later boots keep the new overlay
+    file.printf("overlay=%s\n", overlay_mode == BOOT_GUI_OVERLAY_OFF ? "off" : "on");
+    file.printf("preload=%s\n", preload_disk ? "on" : "off");
+    file.printf("cpu=680%d0\n", cpu_type);
     file.close();
+    
+    // The NVS copy holds what was just written, stamped with the file
+    file = SDCardFS().open(SETTINGS_FILE, FILE_READ);
+    if (file) {
+        saveSettingsBlob((uint32_t)file.size(), (uint32_t)file.getLastWrite(),
+                         overlay_mode == BOOT_GUI_OVERLAY_OFF ? BOOT_GUI_OVERLAY_OFF : BOOT_GUI_OVERLAY_ON);
+        file.close();
+    }
     Serial.println("[BOOT_GUI] Settings saved");
 }
 
 // ============================================================================
-// File Scanning
+// File Lists
 // ============================================================================
 
-static bool hasExtension(const char* filename, const char* ext)
+// List label: the path, and the volume name if it says more than the file name
+static std::string mediaLabel(const media_entry* e)
 {
-    const char* dot = strrchr(filename, '.');
-    if (!dot) {
-        return false;
+    std::string label = e->path.c_str() + 1;
+    if (!e->volume.empty()) {
+        const char* name = strrchr(e->path.c_str(), '/') + 1;
+        const char* dot = strrchr(name, '.');
+        size_t len = dot ? (size_t)(dot - name) : strlen(name);
+        if (e->volume.size() != len || strncasecmp(e->volume.c_str(), name, len) != 0) {
+            label += " (" + e->volume + ")";
+        }
     }
-    return strcasecmp(dot, ext) == 0;
+    return label;
 }
 
-static void scanDiskFiles(void)
+static void fillFileList(int type, std::vector<std::string>& files, std::vector<std::string>& labels)
 {
-    Serial.println("[BOOT_GUI] Scanning for disk images...");
-    disk_files.clear();
-    
-    File root = SD.open("/");
-    if (!root) {
-        Serial.println("[BOOT_GUI] ERROR: Cannot open SD root");
-        return;
-    }
-    
-    while (true) {
-        File entry = root.openNextFile();
-        if (!entry) {
-            break;
-        }
-        
-        if (!entry.isDirectory()) {
-            const char* name = entry.name();
-            // Skip hidden files (starting with '.')
-            if (name[0] == '.') {
-                entry.close();
-                continue;
-            }
-            if (hasExtension(name, ".dsk") || hasExtension(name, ".img")) {
-                // Store with leading slash for full path
-                std::string path = "/";
-                path += name;
-                disk_files.push_back(path);
-                Serial.printf("[BOOT_GUI] Found disk: %s\n", path.c_str());
-            }
-        }
-        entry.close();
-        
-        if (disk_files.size() >= BOOT_GUI_MAX_FILES) {
-            break;
-        }
+    std::vector<const media_entry*> list;
+    MediaCatalogList(type, list);
+    files.clear();
+    labels.clear();
+    for (size_t i = 0; i < list.size() && files.size() < BOOT_GUI_MAX_FILES; i++) {
+        files.push_back(list[i]->path);
+        labels.push_back(mediaLabel(list[i]));
     }
-    root.close();
-    
-    Serial.printf("[BOOT_GUI] Found %d disk images\n", disk_files.size());
+}
+
+// The images this boot uses move to the top of the lists
+static void recordMediaUse(void)
+{
+    MediaCatalogUse(selected_disk_path);
+    MediaCatalogUse(selected_cdrom_path);
+    MediaCatalogSave();
+}
+
+// Fill the lists from the media catalog, recently used images first
+static void populateFileLists(void)
+{
+    fillFileList(MEDIA_DISK, disk_files, disk_labels);
+    fillFileList(MEDIA_CDROM, cdrom_files, cdrom_labels);
+    Serial.printf("[BOOT_GUI] %d disk images, %d CD-ROM images\n",
+                  (int)disk_files.size(), (int)cdrom_files.size());
     
     // Find index of currently selected disk
     disk_selection_index = 0;
@@ -275,48 +430,6 @@ static void scanDiskFiles(void)
             break;
         }
     }
-}
-
-static void scanCDROMFiles(void)
-{
-    Serial.println("[BOOT_GUI] Scanning for CD-ROM images...");
-    cdrom_files.clear();
-    
-    File root = SD.open("/");
-    if (!root) {
-        Serial.println("[BOOT_GUI] ERROR: Cannot open SD root");
-        return;
-    }
-    
-    while (true) {
-        File entry = root.openNextFile();
-        if (!entry) {
-            break;
-        }
-        
-        if (!entry.isDirectory()) {
-            const char* name = entry.name();
-            // Skip hidden files (starting with '.')
-            if (name[0] == '.') {
-                entry.close();
-                continue;
-            }
-            if (hasExtension(name, ".iso")) {
-                std::string path = "/";
-                path += name;
-                cdrom_files.push_back(path);
-                Serial.printf("[BOOT_GUI] Found CD-ROM: %s\n", path.c_str());
-            }
-        }
-        entry.close();
-        
-        if (cdrom_files.size() >= BOOT_GUI_MAX_FILES) {
-            break;
-        }
-    }
-    root.close();
-    
-    Serial.printf("[BOOT_GUI] Found %d CD-ROM images\n", cdrom_files.size());
     
     // Find index of currently selected CD-ROM (0 = None)
     cdrom_selection_index = 0;
@@ -330,6 +443,83 @@ static void scanCDROMFiles(void)
     }
 }
 
+// ============================================================================
+// Dirty Rectangles
+// ============================================================================
+
+static inline long rectArea(const dirty_rect& r)
+{
+    return (long)r.w * r.h;
+}
+
+static dirty_rect rectUnion(const dirty_rect& a, const dirty_rect& b)
+{
+    int x0 = min(a.x, b.x);
+    int y0 = min(a.y, b.y);
+    int x1 = max(a.x + a.w, b.x + b.w);
+    int y1 = max(a.y + a.h, b.y + b.h);
+    return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Note a canvas area for the next flushDirty(); with the list full, the
+// rectangle that grows least takes it in
+static void markDirty(int x, int y, int w, int h)
+{
+    dirty_rect r = { x, y, w, h };
+    if (dirty_count < DIRTY_MAX) {
+        dirty_rects[dirty_count++] = r;
+        return;
+    }
+    int best = 0;
+    long best_growth = LONG_MAX;
+    for (int i = 0; i < dirty_count; i++) {
+        long growth = rectArea(rectUnion(dirty_rects[i], r)) - rectArea(dirty_rects[i]);
+        if (growth < best_growth) {
+            best_growth = growth;
+            best = i;
+        }
+    }
+    dirty_rects[best] = rectUnion(dirty_rects[best], r);
+}
+
+// Copy the dirty areas of the canvas to the display
+static void flushDirty(void)
+{
+    if (dirty_count == 0) {
+        return;
+    }
+    M5.Display.startWrite();
+    for (int i = 0; i < dirty_count; i++) {
+        const dirty_rect& r = dirty_rects[i];
+        M5.Display.setClipRect(r.x, r.y, r.w, r.h);
+        canvas->pushSprite(0, 0);
+    }
+    M5.Display.clearClipRect();
+    M5.Display.endWrite();
+    dirty_count = 0;
+}
+
+// Free the canvas; the emulator allocates its RAM right after the GUI
+static void releaseCanvas(void)
+{
+    if (!canvas) {
+        return;
+    }
+    canvas->deleteSprite();
+    delete canvas;
+    canvas = nullptr;
+    dirty_count = 0;
+    
+    // The lists aren't needed either, only the selected paths
+    std::vector<std::string>().swap(disk_files);
+    std::vector<std::string>().swap(cdrom_files);
+    std::vector<std::string>().swap(disk_labels);
+    std::vector<std::string>().swap(cdrom_labels);
+    
+    Serial.printf("[BOOT_GUI] Canvas released, largest PSRAM block %u KB\n",
+                  (unsigned)(heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024));
+}
+
 // ============================================================================
 // Drawing Functions - Desktop Pattern
 // ============================================================================
@@ -427,89 +617,104 @@ static void drawButton(int x, int y, int w, int h, const char* label, bool press
     canvas->setTextSize(text_size);
     canvas->setTextDatum(MC_DATUM);
     canvas->drawString(label, x + w / 2, y + h / 2);
+    markDirty(x, y, w, h);
 }
 
 // ============================================================================
 // Drawing Functions - List Box
 // ============================================================================
 
-static void drawListBox(int x, int y, int w, int h, const std::vector<std::string>& items,
-                        int selected, int scroll_offset, bool include_none)
+static inline int listVisibleRows(int h)
+{
+    return (h - 6) / LIST_ITEM_HEIGHT;
+}
+
+static inline int listTotalItems(const std::vector<std::string>& items, bool include_none)
+{
+    return items.size() + (include_none ? 1 : 0);
+}
+
+static void drawListFrame(int x, int y, int w, int h)
 {
-    // Background
-    canvas->fillRect(x, y, w, h, MAC_WHITE);
-    
     // Thick border for visibility
     canvas->drawRect(x, y, w, h, MAC_BLACK);
     canvas->drawRect(x + 1, y + 1, w - 2, h - 2, MAC_BLACK);
     canvas->drawRect(x + 2, y + 2, w - 4, h - 4, MAC_BLACK);
-    
-    // Calculate visible items
-    int visible_count = (h - 6) / LIST_ITEM_HEIGHT;
-    int total_items = items.size();
-    if (include_none) {
-        total_items++;
-    }
-    
-    // Draw items - larger text for touch screen
-    canvas->setTextSize(2);
-    canvas->setTextDatum(ML_DATUM);
-    
-    for (int i = 0; i < visible_count && (i + scroll_offset) < total_items; i++) {
-        int item_index = i + scroll_offset;
-        int item_y = y + 3 + i * LIST_ITEM_HEIGHT;
-        
-        const char* item_text;
-        if (include_none && item_index == 0) {
-            item_text = "(None)";
-        } else {
-            int file_index = item_index;
-            if (include_none) {
-                file_index--;
-            }
-            if (file_index >= 0 && file_index < (int)items.size()) {
-                // Show just the filename, not the full path
-                const char* path = items[file_index].c_str();
-                item_text = path;
-                if (path[0] == '/') {
-                    item_text = path + 1;  // Skip leading slash
-                }
-            } else {
-                continue;
-            }
-        }
-        
-        // Check if this item is selected
-        if (item_index == selected) {
-            // Selected item - inverted with padding
-            canvas->fillRect(x + 3, item_y, w - 6, LIST_ITEM_HEIGHT, MAC_BLACK);
-            canvas->setTextColor(MAC_WHITE);
-        } else {
-            canvas->setTextColor(MAC_BLACK);
-        }
-        
-        // Draw text (truncate if too long)
-        char truncated[32];
-        strncpy(truncated, item_text, 28);
-        truncated[28] = '\0';
-        if (strlen(item_text) > 28) {
-            strcat(truncated, "...");
-        }
-        
-        canvas->drawString(truncated, x + 6, item_y + LIST_ITEM_HEIGHT / 2);
-    }
-    
-    // Draw scroll indicators if needed
+}
+
+static void drawScrollIndicators(int x, int y, int w, int h, int total_items, int scroll_offset)
+{
     if (scroll_offset > 0) {
         // Up arrow indicator
         canvas->fillTriangle(x + w - 12, y + 8, x + w - 8, y + 4, x + w - 4, y + 8, MAC_BLACK);
     }
-    if (scroll_offset + visible_count < total_items) {
+    if (scroll_offset + listVisibleRows(h) < total_items) {
         // Down arrow indicator
         canvas->fillTriangle(x + w - 12, h + y - 8, x + w - 8, h + y - 4, x + w - 4, h + y - 8, MAC_BLACK);
     }
 }
 
+static void drawListBox(int x, int y, int w, int h, const std::vector<std::string>& items,
+                        int selected, int scroll_offset, bool include_none)
+{
+    // Background
+    canvas->fillRect(x, y, w, h, MAC_WHITE);
+    drawListFrame(x, y, w, h);
+    markDirty(x, y, w, h);
+    
+    int total_items = listTotalItems(items, include_none);
+    for (int i = scroll_offset; i < total_items; i++) {
+        drawListRow(x, y, w, h, items, i, selected, scroll_offset, include_none);
+    }
+    drawScrollIndicators(x, y, w, h, total_items, scroll_offset);
+}
+
+// One item of a list box, if it is scrolled into view; redrawn on its own
+// when the selection moves
+static void drawListRow(int x, int y, int w, int h, const std::vector<std::string>& items,
+                        int item_index, int selected, int scroll_offset, bool include_none)
+{
+    int row = item_index - scroll_offset;
+    int total_items = listTotalItems(items, include_none);
+    if (item_index < 0 || item_index >= total_items || row < 0 || row >= listVisibleRows(h)) {
+        return;
+    }
+    int item_y = y + 3 + row * LIST_ITEM_HEIGHT;
+    
+    const char* item_text;
+    if (include_none && item_index == 0) {
+        item_text = "(None)";
+    } else {
+        // Show just the filename, not the full path
+        const char* path = items[include_none ? item_index - 1 : item_index].c_str();
+        item_text = path;
+        if (path[0] == '/') {
+            item_text = path + 1;  // Skip leading slash
+        }
+    }
+    
+    // Selected item - inverted with padding
+    bool is_selected = item_index == selected;
+    canvas->fillRect(x + 3, item_y, w - 6, LIST_ITEM_HEIGHT, is_selected ? MAC_BLACK : MAC_WHITE);
+    canvas->setTextColor(is_selected ? MAC_WHITE : MAC_BLACK);
+    
+    // Draw text (truncate if too long) - larger text for touch screen
+    char truncated[32];
+    strncpy(truncated, item_text, 28);
+    truncated[28] = '\0';
+    if (strlen(item_text) > 28) {
+        strcat(truncated, "...");
+    }
+    canvas->setTextSize(2);
+    canvas->setTextDatum(ML_DATUM);
+    canvas->drawString(truncated, x + 6, item_y + LIST_ITEM_HEIGHT / 2);
+    
+    // The last row reaches into the border, and the arrows sit on the first and last
+    drawListFrame(x, y, w, h);
+    drawScrollIndicators(x, y, w, h, total_items, scroll_offset);
+    markDirty(x + 3, item_y, w - 6, min(LIST_ITEM_HEIGHT, y + h - item_y));
+}
+
 // ============================================================================
 // Drawing Functions - Radio Button
 // ============================================================================
@@ -538,6 +743,7 @@ static void drawRadioButton(int x, int y, const char* label, bool selected)
     canvas->setTextSize(2);
     canvas->setTextDatum(ML_DATUM);
     canvas->drawString(label, x + RADIO_SIZE + 10, cy);
+    markDirty(x, y, RADIO_SIZE + 10 + canvas->textWidth(label), RADIO_SIZE + 1);
 }
 
 // ============================================================================
@@ -596,6 +802,36 @@ static void runCountdownScreen(void)
     bool button_touch_started = false;  // Track if touch started in button
     bool settings_requested = false;
     
+    // Draw the parts that don't change - simple gray background
+    canvas->fillScreen(MAC_LIGHT_GRAY);
+    markDirty(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    
+    // Draw title
+    canvas->setTextColor(MAC_BLACK);
+    canvas->setTextSize(4);
+    canvas->setTextDatum(MC_DATUM);
+    canvas->drawString("BasiliskII", SCREEN_WIDTH / 2, 100);
+    
+    // Draw settings info
+    canvas->setTextSize(2);
+    if (strlen(selected_disk_path) > 0) {
+        const char* disk_name = selected_disk_path;
+        if (disk_name[0] == '/') {
+            disk_name++;
+        }
+        char info[64];
+        sprintf(info, "Disk: %s", disk_name);
+        canvas->drawString(info, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2);
+        
+        sprintf(info, "RAM: %d MB", selected_ram_mb);
+        canvas->drawString(info, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2 + 40);
+    }
+    
+    // What the canvas shows, -1 = not drawn yet
+    int drawn_countdown = -1;
+    int drawn_pressed = -1;
+    int countdown_y = SCREEN_HEIGHT / 2 - 80;
+    
     while (countdown > 0 && !settings_requested) {
         // Handle touch input FIRST (before drawing, so M5.update() is fresh)
         M5.update();
@@ -632,41 +868,27 @@ static void runCountdownScreen(void)
             button_pressed = isPointInRect(touch.x, touch.y, btn_x, btn_y, btn_w, btn_h);
         }
         
-        // Draw screen - simple gray background
-        canvas->fillScreen(MAC_LIGHT_GRAY);
-        
-        // Draw title
-        canvas->setTextColor(MAC_BLACK);
-        canvas->setTextSize(4);
-        canvas->setTextDatum(MC_DATUM);
-        canvas->drawString("BasiliskII", SCREEN_WIDTH / 2, 100);
-        
-        // Draw countdown text - large
-        char countdown_text[32];
-        sprintf(countdown_text, "Starting in %d...", countdown);
-        canvas->setTextSize(4);
-        canvas->drawString(countdown_text, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2 - 80);
-        
-        // Draw settings info
-        canvas->setTextSize(2);
-        if (strlen(selected_disk_path) > 0) {
-            const char* disk_name = selected_disk_path;
-            if (disk_name[0] == '/') {
-                disk_name++;
-            }
-            char info[64];
-            sprintf(info, "Disk: %s", disk_name);
-            canvas->drawString(info, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2);
-            
-            sprintf(info, "RAM: %d MB", selected_ram_mb);
-            canvas->drawString(info, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2 + 40);
+        // Draw countdown text - large, over a cleared band
+        if (countdown != drawn_countdown) {
+            char countdown_text[32];
+            sprintf(countdown_text, resume_snapshot ? "Resuming in %d..." : "Starting in %d...", countdown);
+            canvas->fillRect(0, countdown_y - 24, SCREEN_WIDTH, 48, MAC_LIGHT_GRAY);
+            canvas->setTextColor(MAC_BLACK);
+            canvas->setTextSize(4);
+            canvas->setTextDatum(MC_DATUM);
+            canvas->drawString(countdown_text, SCREEN_WIDTH / 2, countdown_y);
+            markDirty(0, countdown_y - 24, SCREEN_WIDTH, 48);
+            drawn_countdown = countdown;
         }
         
         // Draw button - huge at bottom
-        drawButton(btn_x, btn_y, btn_w, btn_h, "Change Settings", button_pressed);
+        if ((int)button_pressed != drawn_pressed) {
+            drawButton(btn_x, btn_y, btn_w, btn_h, "Change Settings", button_pressed);
+            drawn_pressed = button_pressed;
+        }
         
-        // Push to display
-        canvas->pushSprite(0, 0);
+        // Push the changes to the display
+        flushDirty();
         
         // Update countdown
         if (millis() - last_second >= 1000) {
@@ -689,8 +911,12 @@ static void runCountdownScreen(void)
 static void runSettingsScreen(void)
 {
     Serial.println("[BOOT_GUI] Showing settings screen...");
-    Serial.printf("[BOOT_GUI] Found %d disk files, %d CD-ROM files\n", 
-                  (int)disk_files.size(), (int)cdrom_files.size());
+    
+    // Pick up images added or changed since the catalog was saved
+    if (!MediaCatalogScanned()) {
+        MediaCatalogScan();
+        populateFileLists();
+    }
     
     // Full-screen layout - no window, just content areas
     int content_x = SCREEN_MARGIN;
@@ -709,12 +935,34 @@ static void runSettingsScreen(void)
     int ram_y = list_y + list_h + 30;
     int ram_x = content_x;
     
+    // Overlay radio buttons - below RAM
+    int overlay_y = ram_y + RADIO_SIZE + 25;
+    
     // Boot button - BIG and at bottom of screen
     int boot_btn_w = 400;
     int boot_btn_h = 80;
     int boot_btn_x = (SCREEN_WIDTH - boot_btn_w) / 2;
     int boot_btn_y = SCREEN_HEIGHT - boot_btn_h - SCREEN_MARGIN;
     
+    // PSRAM preload toggle - left of the Boot button
+    int preload_x = ram_x;
+    int preload_y = boot_btn_y + (boot_btn_h - RADIO_SIZE) / 2;
+    int preload_w = boot_btn_x - preload_x - 20;
+    
+    // 68030 toggle - right of the Boot button
+    int cpu_x = boot_btn_x + boot_btn_w + 20;
+    int cpu_y = preload_y;
+    int cpu_w = SCREEN_WIDTH - SCREEN_MARGIN - cpu_x;
+    
+#if USB_MSC
+    // USB disk mode button - top right, level with the title
+    int usb_btn_w = 200;
+    int usb_btn_h = 44;
+    int usb_btn_x = SCREEN_WIDTH - SCREEN_MARGIN - usb_btn_w;
+    int usb_btn_y = SCREEN_MARGIN - 10;
+    bool touch_in_usb_btn = false;
+#endif
+    
     // Debug: Print layout info
     Serial.printf("[BOOT_GUI] Layout: list_y=%d, list_h=%d, item_height=%d\n", list_y, list_h, LIST_ITEM_HEIGHT);
     Serial.printf("[BOOT_GUI] Disk list: x=%d-%d, y=%d-%d\n", disk_list_x, disk_list_x + list_w, list_y, list_y + list_h);
@@ -741,7 +989,59 @@ static void runSettingsScreen(void)
     bool touch_in_cdrom_list = false;
     bool touch_in_boot_btn = false;
     
+    // RAM and overlay radio buttons - spread across screen for easy touch
+    static const int ram_choices[] = { 4, 8, 12, 16, 20 };
+    static const char* const ram_labels[] = { "4 MB", "8 MB", "12 MB", "16 MB", "20 MB" };
+    static const char* const overlay_labels[] = { "Off", "On", "Discard" };
+    int radio_start_x = ram_x + 120;
+    int radio_gap = (SCREEN_WIDTH - radio_start_x - SCREEN_MARGIN) / 5;
+    int radio_hit_w = radio_gap - 10;  // Hit area width
+    int radio_hit_h = RADIO_SIZE + 20;  // Hit area height
+    
+    // What the canvas shows, -1 = not drawn yet; each frame redraws only
+    // what changed
+    int drawn_disk = -1;
+    int drawn_cdrom = -1;
+    int drawn_ram_mb = -1;
+    int drawn_overlay = -1;
+    int drawn_preload = -1;
+    int drawn_cpu = -1;
+    int drawn_boot_pressed = -1;
+    bool drawn_static = false;     // Background, title and labels
+    
     while (!should_boot) {
+        // Draw the parts that don't change - simple gray background; again
+        // when coming back from another screen
+        if (!drawn_static) {
+            canvas->fillScreen(MAC_LIGHT_GRAY);
+            markDirty(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+            
+            // Draw title
+            canvas->setTextColor(MAC_BLACK);
+            canvas->setTextSize(3);
+            canvas->setTextDatum(TC_DATUM);
+            canvas->drawString("Boot Settings", SCREEN_WIDTH / 2, SCREEN_MARGIN);
+            
+            // Draw the labels - larger for touch screen
+            canvas->setTextSize(2);
+            canvas->setTextDatum(TL_DATUM);
+            canvas->drawString("Hard Disk:", disk_list_x, content_y);
+            canvas->drawString("CD-ROM:", cdrom_list_x, content_y);
+            canvas->drawString("Memory:", ram_x, ram_y + 10);
+            
+            // Overlay radio buttons: writes to the image, to <image>.ovl, or to
+            // an emptied <image>.ovl
+            canvas->drawString("Overlay:", ram_x, overlay_y + 10);
+            
+#if USB_MSC
+            drawButton(usb_btn_x, usb_btn_y, usb_btn_w, usb_btn_h, "USB Disk", false);
+#endif
+            
+            drawn_disk = drawn_cdrom = drawn_ram_mb = drawn_overlay = -1;
+            drawn_preload = drawn_cpu = drawn_boot_pressed = -1;
+            drawn_static = true;
+        }
+        
         // Handle touch input FIRST (before drawing)
         M5.update();
         auto touch = M5.Touch.getDetail();
@@ -758,6 +1058,9 @@ static void runSettingsScreen(void)
                 boot_touch_started = true;
                 boot_pressed = true;
             }
+#if USB_MSC
+            touch_in_usb_btn = isPointInRect(touch_start_x, touch_start_y, usb_btn_x, usb_btn_y, usb_btn_w, usb_btn_h);
+#endif
             
             Serial.printf("[BOOT_GUI] Touch start at (%d, %d) disk=%d cdrom=%d boot=%d\n", 
                           touch_start_x, touch_start_y, touch_in_disk_list, touch_in_cdrom_list, touch_in_boot_btn);
@@ -770,6 +1073,7 @@ static void runSettingsScreen(void)
             // Check Boot button
             if (boot_touch_started) {
                 should_boot = true;
+                resume_snapshot = false;    // Settings were changed, boot afresh
                 Serial.println("[BOOT_GUI] Boot button pressed");
             }
             
@@ -808,27 +1112,42 @@ static void runSettingsScreen(void)
             }
             
             // Check RAM radio buttons (use saved start position)
-            // Use same layout calculation as drawing
-            int radio_start_x = ram_x + 120;
-            int radio_gap = (SCREEN_WIDTH - radio_start_x - SCREEN_MARGIN) / 4;
-            int radio_y_hit = ram_y;
-            int radio_hit_w = radio_gap - 10;  // Hit area width
-            int radio_hit_h = RADIO_SIZE + 20;  // Hit area height
+            for (int i = 0; i < 5; i++) {
+                if (isPointInRect(touch_start_x, touch_start_y, radio_start_x + radio_gap * i, ram_y, radio_hit_w, radio_hit_h)) {
+                    selected_ram_mb = ram_choices[i];
+                    Serial.printf("[BOOT_GUI] Selected RAM: %d MB\n", selected_ram_mb);
+                }
+            }
+            
+            // Check overlay radio buttons (same columns as RAM)
+            for (int mode = BOOT_GUI_OVERLAY_OFF; mode <= BOOT_GUI_OVERLAY_DISCARD; mode++) {
+                if (isPointInRect(touch_start_x, touch_start_y, radio_start_x + radio_gap * mode, overlay_y, radio_hit_w, radio_hit_h)) {
+                    overlay_mode = mode;
+                    Serial.printf("[BOOT_GUI] Selected overlay mode: %d\n", mode);
+                }
+            }
             
-            if (isPointInRect(touch_start_x, touch_start_y, radio_start_x, radio_y_hit, radio_hit_w, radio_hit_h)) {
-                selected_ram_mb = 4;
-                Serial.println("[BOOT_GUI] Selected RAM: 4 MB");
-            } else if (isPointInRect(touch_start_x, touch_start_y, radio_start_x + radio_gap, radio_y_hit, radio_hit_w, radio_hit_h)) {
-                selected_ram_mb = 8;
-                Serial.println("[BOOT_GUI] Selected RAM: 8 MB");
-            } else if (isPointInRect(touch_start_x, touch_start_y, radio_start_x + radio_gap * 2, radio_y_hit, radio_hit_w, radio_hit_h)) {
-                selected_ram_mb = 12;
-                Serial.println("[BOOT_GUI] Selected RAM: 12 MB");
-            } else if (isPointInRect(touch_start_x, touch_start_y, radio_start_x + radio_gap * 3, radio_y_hit, radio_hit_w, radio_hit_h)) {
-                selected_ram_mb = 16;
-                Serial.println("[BOOT_GUI] Selected RAM: 16 MB");
+            // Check PSRAM preload toggle
+            if (isPointInRect(touch_start_x, touch_start_y, preload_x, preload_y - 10, preload_w, radio_hit_h)) {
+                preload_disk = !preload_disk;
+                Serial.printf("[BOOT_GUI] Preload into PSRAM: %s\n", preload_disk ? "on" : "off");
             }
             
+            // Check 68030 toggle
+            if (isPointInRect(touch_start_x, touch_start_y, cpu_x, cpu_y - 10, cpu_w, radio_hit_h)) {
+                cpu_type = cpu_type == 3 ? 4 : 3;
+                Serial.printf("[BOOT_GUI] CPU: 680%d0\n", cpu_type);
+            }
+            
+#if USB_MSC
+            // Check USB Disk button: only comes back if cancelled
+            if (touch_in_usb_btn) {
+                runUsbDiskScreen();
+                drawn_static = false;
+                touch_in_usb_btn = false;
+            }
+#endif
+            
             // Reset touch state
             touch_in_disk_list = false;
             touch_in_cdrom_list = false;
@@ -842,48 +1161,66 @@ static void runSettingsScreen(void)
             boot_pressed = isPointInRect(touch.x, touch.y, boot_btn_x, boot_btn_y, boot_btn_w, boot_btn_h);
         }
         
-        // Draw screen - simple gray background
-        canvas->fillScreen(MAC_LIGHT_GRAY);
-        
-        // Draw title
-        canvas->setTextColor(MAC_BLACK);
-        canvas->setTextSize(3);
-        canvas->setTextDatum(TC_DATUM);
-        canvas->drawString("Boot Settings", SCREEN_WIDTH / 2, SCREEN_MARGIN);
-        
-        // Draw "Hard Disk:" label
-        canvas->setTextSize(2);
-        canvas->setTextDatum(TL_DATUM);
-        canvas->drawString("Hard Disk:", disk_list_x, content_y);
+        // Draw disk list, then only the rows the selection moves between
+        if (drawn_disk < 0) {
+            drawListBox(disk_list_x, list_y, list_w, list_h, disk_labels,
+                        disk_selection_index, disk_scroll_offset, false);
+        } else if (disk_selection_index != drawn_disk) {
+            drawListRow(disk_list_x, list_y, list_w, list_h, disk_labels, drawn_disk,
+                        disk_selection_index, disk_scroll_offset, false);
+            drawListRow(disk_list_x, list_y, list_w, list_h, disk_labels, disk_selection_index,
+                        disk_selection_index, disk_scroll_offset, false);
+        }
+        drawn_disk = disk_selection_index;
         
-        // Draw disk list
-        drawListBox(disk_list_x, list_y, list_w, list_h, disk_files, 
-                    disk_selection_index, disk_scroll_offset, false);
+        // Draw CD-ROM list
+        if (drawn_cdrom < 0) {
+            drawListBox(cdrom_list_x, list_y, list_w, list_h, cdrom_labels,
+                        cdrom_selection_index, cdrom_scroll_offset, true);
+        } else if (cdrom_selection_index != drawn_cdrom) {
+            drawListRow(cdrom_list_x, list_y, list_w, list_h, cdrom_labels, drawn_cdrom,
+                        cdrom_selection_index, cdrom_scroll_offset, true);
+            drawListRow(cdrom_list_x, list_y, list_w, list_h, cdrom_labels, cdrom_selection_index,
+                        cdrom_selection_index, cdrom_scroll_offset, true);
+        }
+        drawn_cdrom = cdrom_selection_index;
         
-        // Draw "CD-ROM:" label
-        canvas->drawString("CD-ROM:", cdrom_list_x, content_y);
+        // Draw RAM radio buttons
+        if (selected_ram_mb != drawn_ram_mb) {
+            for (int i = 0; i < 5; i++) {
+                drawRadioButton(radio_start_x + radio_gap * i, ram_y, ram_labels[i], selected_ram_mb == ram_choices[i]);
+            }
+            drawn_ram_mb = selected_ram_mb;
+        }
         
-        // Draw CD-ROM list
-        drawListBox(cdrom_list_x, list_y, list_w, list_h, cdrom_files,
-                    cdrom_selection_index, cdrom_scroll_offset, true);
+        // Draw overlay radio buttons
+        if (overlay_mode != drawn_overlay) {
+            for (int mode = BOOT_GUI_OVERLAY_OFF; mode <= BOOT_GUI_OVERLAY_DISCARD; mode++) {
+                drawRadioButton(radio_start_x + radio_gap * mode, overlay_y, overlay_labels[mode], overlay_mode == mode);
+            }
+            drawn_overlay = overlay_mode;
+        }
         
-        // Draw "Memory:" label - larger for touch screen
-        canvas->setTextSize(2);
-        canvas->drawString("Memory:", ram_x, ram_y + 10);
+        // Draw PSRAM preload toggle
+        if ((int)preload_disk != drawn_preload) {
+            drawRadioButton(preload_x, preload_y, "Disk in PSRAM", preload_disk);
+            drawn_preload = preload_disk;
+        }
         
-        // Draw RAM radio buttons - spread across screen for easy touch
-        int radio_start_x = ram_x + 120;
-        int radio_gap = (SCREEN_WIDTH - radio_start_x - SCREEN_MARGIN) / 4;
-        drawRadioButton(radio_start_x, ram_y, "4 MB", selected_ram_mb == 4);
-        drawRadioButton(radio_start_x + radio_gap, ram_y, "8 MB", selected_ram_mb == 8);
-        drawRadioButton(radio_start_x + radio_gap * 2, ram_y, "12 MB", selected_ram_mb == 12);
-        drawRadioButton(radio_start_x + radio_gap * 3, ram_y, "16 MB", selected_ram_mb == 16);
+        // Draw 68030 toggle (off = 68040 with FPU)
+        if (cpu_type != drawn_cpu) {
+            drawRadioButton(cpu_x, cpu_y, "68030, no FPU", cpu_type == 3);
+            drawn_cpu = cpu_type;
+        }
         
         // Draw Boot button
-        drawButton(boot_btn_x, boot_btn_y, boot_btn_w, boot_btn_h, "Boot", boot_pressed);
+        if ((int)boot_pressed != drawn_boot_pressed) {
+            drawButton(boot_btn_x, boot_btn_y, boot_btn_w, boot_btn_h, "Boot", boot_pressed);
+            drawn_boot_pressed = boot_pressed;
+        }
         
-        // Push to display
-        canvas->pushSprite(0, 0);
+        // Push the changes to the display
+        flushDirty();
         
         delay(16);  // ~60 FPS
     }
@@ -892,6 +1229,130 @@ static void runSettingsScreen(void)
     saveSettings();
 }
 
+#if USB_MSC
+// ============================================================================
+// USB Disk Screen
+// ============================================================================
+
+// Draw the status line of the USB disk screen from the transfer counters
+static void drawUsbDiskStatus(int y, const usb_msc_stats &stats, uint32_t kb_per_s)
+{
+    char line[96];
+    if (stats.ejected) {
+        snprintf(line, sizeof(line), "Ejected by the computer - tap Restart");
+    } else {
+        snprintf(line, sizeof(line), "Read %u MB  Written %u MB  %u KB/s  Errors %u",
+                 (unsigned)(stats.read_bytes >> 20), (unsigned)(stats.write_bytes >> 20),
+                 (unsigned)kb_per_s, (unsigned)stats.errors);
+    }
+    canvas->fillRect(0, y, SCREEN_WIDTH, 30, MAC_LIGHT_GRAY);
+    canvas->setTextColor(MAC_BLACK);
+    canvas->setTextSize(2);
+    canvas->setTextDatum(TC_DATUM);
+    canvas->drawString(line, SCREEN_WIDTH / 2, y);
+    markDirty(0, y, SCREEN_WIDTH, 30);
+}
+
+/*
+ *  Offer the whole card or the selected disk image as a USB drive. Returns
+ *  if cancelled; once serving, the computer owns the sectors behind FATFS'
+ *  back, so the only way out is a restart.
+ */
+static void runUsbDiskScreen(void)
+{
+    Serial.println("[BOOT_GUI] Showing USB disk screen...");
+    
+    int btn_w = 600;
+    int btn_h = 80;
+    int btn_x = (SCREEN_WIDTH - btn_w) / 2;
+    int card_btn_y = 200;
+    int disk_btn_y = card_btn_y + btn_h + 40;
+    int back_btn_y = SCREEN_HEIGHT - btn_h - SCREEN_MARGIN;
+    bool have_disk = selected_disk_path[0] != '\0';
+    
+    canvas->fillScreen(MAC_LIGHT_GRAY);
+    markDirty(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    canvas->setTextColor(MAC_BLACK);
+    canvas->setTextSize(3);
+    canvas->setTextDatum(TC_DATUM);
+    canvas->drawString("USB Disk", SCREEN_WIDTH / 2, SCREEN_MARGIN);
+    canvas->setTextSize(2);
+    canvas->drawString("Connect the Type-C port to a computer", SCREEN_WIDTH / 2, SCREEN_MARGIN + TITLE_BAR_HEIGHT);
+    drawButton(btn_x, card_btn_y, btn_w, btn_h, "Whole SD Card", false);
+    if (have_disk) {
+        drawButton(btn_x, disk_btn_y, btn_w, btn_h, "Selected Disk Image", false);
+    }
+    drawButton(btn_x, back_btn_y, btn_w, btn_h, "Back", false);
+    flushDirty();
+    
+    // Wait for a choice
+    const char *path = NULL;
+    for (;;) {
+        M5.update();
+        auto touch = M5.Touch.getDetail();
+        if (touch.wasReleased()) {
+            if (isPointInRect(touch.x, touch.y, btn_x, back_btn_y, btn_w, btn_h)) {
+                return;
+            }
+            if (isPointInRect(touch.x, touch.y, btn_x, card_btn_y, btn_w, btn_h)) {
+                break;
+            }
+            if (have_disk && isPointInRect(touch.x, touch.y, btn_x, disk_btn_y, btn_w, btn_h)) {
+                path = selected_disk_path;
+                break;
+            }
+        }
+        delay(16);
+    }
+    
+    // Last use of the file system until the restart
+    saveSettings();
+    
+    canvas->fillRect(0, card_btn_y, SCREEN_WIDTH, back_btn_y + btn_h - card_btn_y, MAC_LIGHT_GRAY);
+    markDirty(0, card_btn_y, SCREEN_WIDTH, back_btn_y + btn_h - card_btn_y);
+    canvas->setTextColor(MAC_BLACK);
+    canvas->setTextSize(2);
+    canvas->setTextDatum(TC_DATUM);
+    bool serving = UsbMscStart(path);
+    if (serving) {
+        canvas->drawString(path ? path : "Serving the whole SD card", SCREEN_WIDTH / 2, card_btn_y);
+    } else {
+        canvas->drawString("Couldn't start the USB disk (needs the SDMMC card path)", SCREEN_WIDTH / 2, card_btn_y);
+    }
+    drawButton(btn_x, back_btn_y, btn_w, btn_h, "Restart", false);
+    flushDirty();
+    
+    // Show the transfer counters until Restart is tapped
+    int status_y = card_btn_y + 60;
+    usb_msc_stats last = {};
+    uint32_t last_ms = millis();
+    for (;;) {
+        M5.update();
+        auto touch = M5.Touch.getDetail();
+        if (touch.wasReleased() && isPointInRect(touch.x, touch.y, btn_x, back_btn_y, btn_w, btn_h)) {
+            break;
+        }
+        if (serving && millis() - last_ms >= 1000) {
+            usb_msc_stats stats;
+            UsbMscGetStats(stats);
+            uint32_t now = millis();
+            uint64_t moved = stats.read_bytes + stats.write_bytes - last.read_bytes - last.write_bytes;
+            drawUsbDiskStatus(status_y, stats, (uint32_t)(moved * 1000 / 1024 / (now - last_ms)));
+            flushDirty();
+            last = stats;
+            last_ms = now;
+        }
+        delay(16);
+    }
+    
+    if (serving) {
+        UsbMscStop();
+    }
+    Serial.println("[BOOT_GUI] USB disk mode done, restarting");
+    ESP.restart();
+}
+#endif
+
 // ============================================================================
 // Public API
 // ============================================================================
@@ -922,14 +1383,22 @@ bool BootGUI_Init(void)
     }
     
     canvas->setColorDepth(16);
-    canvas->createSprite(SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (!canvas->createSprite(SCREEN_WIDTH, SCREEN_HEIGHT)) {
+        Serial.println("[BOOT_GUI] ERROR: No PSRAM for the canvas");
+        delete canvas;
+        canvas = nullptr;
+        return false;
+    }
     
     // Load saved settings
     loadSettings();
     
-    // Scan for disk files
-    scanDiskFiles();
-    scanCDROMFiles();
+    // Disk and CD-ROM lists from the media catalog; the card is only
+    // walked here if there is none, otherwise when the settings open
+    if (!MediaCatalogLoad()) {
+        MediaCatalogScan();
+    }
+    populateFileLists();
     
     // If no disk is selected but we found some, select the first one
     if (strlen(selected_disk_path) == 0 && disk_files.size() > 0) {
@@ -950,18 +1419,27 @@ void BootGUI_Run(void)
         return;
     }
     
+#if MAC_SNAPSHOT
+    resume_snapshot = SnapshotAvailable();
+    if (resume_snapshot) {
+        Serial.println("[BOOT_GUI] Suspended machine found, resuming unless settings are opened");
+    }
+#endif
+    
     // Check if we should skip the GUI
     if (skip_gui) {
         Serial.println("[BOOT_GUI] skip_gui=yes, skipping boot GUI");
         Serial.printf("[BOOT_GUI] Using saved settings: disk=%s, ram=%dMB\n", 
                       selected_disk_path, selected_ram_mb);
         
-        // Cleanup canvas since we won't use it
-        if (canvas) {
-            canvas->deleteSprite();
-            delete canvas;
-            canvas = nullptr;
+        // overlay=discard is consumed by this boot
+        if (overlay_mode == BOOT_GUI_OVERLAY_DISCARD) {
+            saveSettings();
         }
+        recordMediaUse();
+        
+        // Cleanup canvas since we won't use it
+        releaseCanvas();
         return;
     }
     
@@ -970,12 +1448,14 @@ void BootGUI_Run(void)
     // Run countdown screen (may transition to settings screen)
     runCountdownScreen();
     
-    // Cleanup canvas
-    if (canvas) {
-        canvas->deleteSprite();
-        delete canvas;
-        canvas = nullptr;
+    // overlay=discard is consumed by this boot
+    if (overlay_mode == BOOT_GUI_OVERLAY_DISCARD) {
+        saveSettings();
     }
+    recordMediaUse();
+    
+    // Cleanup canvas
+    releaseCanvas();
     
     Serial.println("[BOOT_GUI] Boot GUI complete, proceeding to emulator");
 }
@@ -999,3 +1479,27 @@ int BootGUI_GetRAMSizeMB(void)
 {
     return selected_ram_mb;
 }
+
+int BootGUI_GetOverlayMode(void)
+{
+    // A resumed machine needs its overlay as it left it
+    if (resume_snapshot && overlay_mode == BOOT_GUI_OVERLAY_DISCARD) {
+        return BOOT_GUI_OVERLAY_ON;
+    }
+    return overlay_mode;
+}
+
+bool BootGUI_GetPreload(void)
+{
+    return preload_disk;
+}
+
+int BootGUI_GetCPUType(void)
+{
+    return cpu_type;
+}
+
+bool BootGUI_GetResume(void)
+{
+    return resume_snapshot;
+}
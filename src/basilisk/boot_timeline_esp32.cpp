@@ -0,0 +1,155 @@
+/*
+ *  boot_timeline_esp32.cpp - Boot phases timed from power-on
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  From power-on to a usable Finder the boot goes through the SD card, the
+ *  Boot GUI, the boot stages (ROM load and patching among them), then the
+ *  68k: first frame, drivers installed, boot volume mounted, and finally
+ *  the Finder asking for its first event. Each phase gets its start and
+ *  end on the esp_timer clock, which runs from when the app starts (the
+ *  ROM bootloader's part isn't counted), and the Finder's first
+ *  WaitNextEvent prints them as a chart:
+ *
+ *    [BOOT] sd              412       61 |###                                     |
+ *    [BOOT] gui             473     3015 |  ##########################            |
+ *
+ *  The timeline lives in RTC memory, which a reset leaves alone, so a
+ *  start that hung or crashed before the Finder is reported on the next
+ *  one along with how far it got.
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "boot_timeline_esp32.h"
+
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#if BOOT_TIMELINE
+
+#define BOOT_TIMELINE_MAGIC     0x42544c31  // "BTL1"
+#define BOOT_CHART_WIDTH        40          // Columns of the bar chart
+
+struct boot_timeline {
+    uint32 magic;
+    uint32 starts;                      // Since power-on
+    bool finished;                      // Got to the Finder
+    uint32 begin_us[BOOT_PHASES];       // 0 = not reached
+    uint32 end_us[BOOT_PHASES];
+};
+
+static const char *const phase_names[BOOT_PHASES] = {
+    "sd", "gui", "init", "loadrom", "patchrom", "cpu", "frame", "drivers", "mount", "finder"
+};
+
+RTC_NOINIT_ATTR static boot_timeline timeline;
+
+bool boot_timeline_pending = false;
+
+static uint32 now_us(void)
+{
+    // Never 0, that means not reached
+    return (uint32)esp_timer_get_time() | 1;
+}
+
+void BootPhaseBegin(int phase)
+{
+    if (timeline.begin_us[phase] == 0) {
+        timeline.begin_us[phase] = now_us();
+    }
+}
+
+void BootPhaseEnd(int phase)
+{
+    if (timeline.end_us[phase] == 0) {
+        timeline.end_us[phase] = now_us();
+    }
+}
+
+void BootMark(int phase)
+{
+    if (timeline.begin_us[phase] == 0) {
+        timeline.begin_us[phase] = timeline.end_us[phase] = now_us();
+    }
+}
+
+static void report(const boot_timeline &t)
+{
+    uint32 total_us = 1;
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        total_us = t.begin_us[i] > total_us ? t.begin_us[i] : total_us;
+        total_us = t.end_us[i] > total_us ? t.end_us[i] : total_us;
+    }
+
+    Serial.printf("[BOOT] %-10s %8s %8s  0 ms%*u ms\n", "Phase", "Start ms", "Time ms", BOOT_CHART_WIDTH - 4,
+                  (unsigned)(total_us / 1000));
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        uint32 begin = t.begin_us[i];
+        if (begin == 0) {
+            Serial.printf("[BOOT] %-10s        -        -\n", phase_names[i]);
+            continue;
+        }
+        // One that never ended runs to the last thing that happened
+        uint32 end = t.end_us[i] ? t.end_us[i] : total_us;
+        uint32 first = (uint64)begin * BOOT_CHART_WIDTH / total_us;
+        uint32 last = (uint64)end * BOOT_CHART_WIDTH / total_us;
+        char bar[BOOT_CHART_WIDTH + 1];
+        for (int c = 0; c < BOOT_CHART_WIDTH; c++) {
+            bar[c] = (uint32)c < first || (uint32)c > last ? ' ' : '#';
+        }
+        if (end == begin) {
+            bar[first < BOOT_CHART_WIDTH ? first : BOOT_CHART_WIDTH - 1] = '*';
+        }
+        bar[BOOT_CHART_WIDTH] = 0;
+        if (t.end_us[i]) {
+            Serial.printf("[BOOT] %-10s %8u %8u |%s|\n", phase_names[i], (unsigned)(begin / 1000),
+                          (unsigned)((end - begin) / 1000), bar);
+        } else {
+            Serial.printf("[BOOT] %-10s %8u %8s |%s|\n", phase_names[i], (unsigned)(begin / 1000), "open", bar);
+        }
+    }
+}
+
+void BootTimelineReport(void)
+{
+    report(timeline);
+}
+
+void BootTimelineInit(void)
+{
+    // Power-on leaves RTC memory undefined, a reset keeps it
+    uint32 starts = 0;
+    if (timeline.magic == BOOT_TIMELINE_MAGIC) {
+        starts = timeline.starts;
+        if (!timeline.finished) {
+            Serial.printf("[BOOT] The last start didn't get to the Finder (reset reason %d):\n",
+                          (int)esp_reset_reason());
+            report(timeline);
+        }
+    }
+    memset(&timeline, 0, sizeof(timeline));
+    timeline.magic = BOOT_TIMELINE_MAGIC;
+    timeline.starts = starts + 1;
+    boot_timeline_pending = true;
+}
+
+void BootTimelineWaitNextEvent(void)
+{
+    // CurApName, a Pascal string
+    static const char finder[] = "\006Finder";
+    for (int i = 0; i < (int)sizeof(finder) - 1; i++) {
+        if (ReadMacInt8(0x910 + i) != (uint8)finder[i]) {
+            return;
+        }
+    }
+    boot_timeline_pending = false;
+    BootMark(BOOT_PHASE_FINDER);
+    timeline.finished = true;
+    Serial.printf("[BOOT] Finder ready after %u ms (start %u since power-on)\n",
+                  (unsigned)(timeline.begin_us[BOOT_PHASE_FINDER] / 1000), (unsigned)timeline.starts);
+    report(timeline);
+}
+
+#endif // BOOT_TIMELINE
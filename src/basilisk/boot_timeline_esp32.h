@@ -0,0 +1,58 @@
+/*
+ *  boot_timeline_esp32.h - Boot phases timed from power-on
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef BOOT_TIMELINE_ESP32_H
+#define BOOT_TIMELINE_ESP32_H
+
+#ifndef BOOT_TIMELINE
+#define BOOT_TIMELINE 0
+#endif
+
+#if BOOT_TIMELINE
+
+// In the order they normally happen
+enum {
+    BOOT_PHASE_SD,          // initSDCard()
+    BOOT_PHASE_GUI,         // BootGUI_Run(), countdown included
+    BOOT_PHASE_INIT,        // InitEmulator(), the boot stages
+    BOOT_PHASE_ROM,         // LoadROM()
+    BOOT_PHASE_PATCH,       // PatchROM()
+    BOOT_PHASE_CPU,         // Start680x0() (or a resume)
+    BOOT_PHASE_FRAME,       // First frame on the display
+    BOOT_PHASE_DRIVERS,     // M68K_EMUL_OP_INSTALL_DRIVERS
+    BOOT_PHASE_MOUNT,       // First volume mounted (diskEvent posted)
+    BOOT_PHASE_FINDER,      // The Finder's first WaitNextEvent
+    BOOT_PHASES
+};
+
+extern bool boot_timeline_pending;     // The Finder hasn't called WaitNextEvent yet
+
+// First thing in setup(): reports a start that never got to the Finder
+extern void BootTimelineInit(void);
+
+// A phase starts or ends (first time only, any task)
+extern void BootPhaseBegin(int phase);
+extern void BootPhaseEnd(int phase);
+
+// A phase that is a moment
+extern void BootMark(int phase);
+
+// Print the phases as a chart
+extern void BootTimelineReport(void);
+
+extern void BootTimelineWaitNextEvent(void);
+
+// op_illg(): an A-line trap; _WaitNextEvent (A860, flags masked) ends the boot
+static inline void BootTimelineALine(uint16 opcode)
+{
+    if (boot_timeline_pending && (opcode & 0x0bff) == 0x0860) {
+        BootTimelineWaitNextEvent();
+    }
+}
+
+#endif
+
+#endif /* BOOT_TIMELINE_ESP32_H */
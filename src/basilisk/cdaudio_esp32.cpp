@@ -0,0 +1,784 @@
+/*
+ *  cdaudio_esp32.cpp - BIN/CUE CD images and their audio tracks
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A .cue sheet is parsed once at mount into a track table: the data track
+ *  is read by sys_esp32.cpp (through the block cache, as 2048-byte blocks
+ *  cut out of the raw sectors), the audio tracks are Red Book sectors of
+ *  588 16-bit stereo frames at 44.1 kHz, exactly what the speaker plays.
+ *
+ *  The CPU thread never touches the card for audio. SysCDPlay() and
+ *  friends post a request, the reader task on Core 0 streams sectors from
+ *  the BIN file into a PSRAM ring with its own read-only File, and the
+ *  audio task drains the ring into a speaker channel of its own. The
+ *  position Mac OS polls is the sector the audio task is playing.
+ *
+ *  The supported subset of the CUE format is what disc rippers write:
+ *  FILE "name" BINARY (one or several), TRACK nn MODE1/2048, MODE1/2352,
+ *  MODE2/2352 or AUDIO, INDEX 00/01 and PREGAP; the first track must be
+ *  the data track. Gaps that aren't in the files play as silence.
+ */
+
+#include "sysdeps.h"
+
+#include <FS.h>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "prefs.h"
+#include "sd_esp32.h"
+#include "log_esp32.h"
+#include "perf_esp32.h"
+#include "cdaudio_esp32.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#if CD_AUDIO
+
+#define CUE_MAX_TRACKS      99
+#define CUE_MAX_FILES       16
+#define CUE_MAX_BYTES       16384       // Larger files aren't CD sheets
+#define CUE_PATH_MAX        256
+
+#define CD_SECTOR_BYTES     2352        // One audio sector, 1/75 s
+#define CD_FRAME_BYTES      4           // 16-bit stereo
+#define CD_RING_BYTES       (256 * 1024)    // 1.5 s of audio (a power of two)
+#define CD_READ_SECTORS     16          // Per card read, 213 ms of audio
+#define CD_MSF_OFFSET       150         // LBA 0 is at 00:02:00
+
+#define CD_READER_STACK     4096
+#define CD_READER_PRIORITY  1
+#define CD_READER_CORE      0
+#define CD_READER_POLL_MS   20          // Refill period while playing
+
+struct cue_track {
+    uint8 number;
+    uint8 control;          // Q subchannel control: 0x04 data, 0x00 audio
+    int file;               // Index into cue_sheet::files
+    uint32 sector_size;     // Bytes per sector in the file
+    uint32 data_offset;     // User data within a sector
+    int32 index0;           // File sector of INDEX 00, -1 = none
+    int32 index1;           // File sector of INDEX 01, -1 = not seen yet
+    uint32 pregap;          // PREGAP sectors, not in the file
+    uint32 file_lba;        // Disc LBA of sector 0 of its file
+    uint32 first;           // Disc LBAs of its sectors in the file: [first, end)
+    uint32 end;
+    uint32 start;           // Disc LBA of INDEX 01
+};
+
+struct cue_sheet {
+    int ntracks;
+    int nfiles;
+    uint32 leadout;         // Disc LBA after the last track
+    cue_track tracks[CUE_MAX_TRACKS];
+    char files[CUE_MAX_FILES][CUE_PATH_MAX];
+    uint64 file_bytes[CUE_MAX_FILES];
+};
+
+// Status codes of the SCSI "read sub-channel" audio status, as cdrom.cpp expects them
+enum {
+    CD_STATUS_PLAYING = 0x11,
+    CD_STATUS_PAUSED = 0x12,
+    CD_STATUS_DONE = 0x13,
+    CD_STATUS_NONE = 0x15
+};
+
+// Requests from the CPU thread, under cd_lock
+static portMUX_TYPE cd_lock = portMUX_INITIALIZER_UNLOCKED;
+static cue_sheet *req_cue = NULL;       // Image to play, NULL = stopped
+static uint32 req_start, req_end;       // Disc LBAs
+static uint32 req_gen = 0;              // Bumped by every play, seek and stop
+static uint8 play_status = CD_STATUS_NONE;
+static bool reader_done = false;        // The reader reached req_end of req_gen
+
+// Reader task
+static TaskHandle_t reader_handle = NULL;
+static cue_sheet *reader_cue = NULL;    // Image the reader uses, CueClose() waits for it
+static File reader_file;
+static int reader_file_index = -1;
+
+// Ring of raw audio sectors. Free running byte counters: the reader
+// advances ring_write, the audio task ring_read; a restart makes
+// ring_flush the new start, skipping whatever was still queued. Ring byte
+// base_pos holds the start of sector base_lba.
+static uint8 *ring = NULL;
+static uint32 ring_write = 0;
+static uint32 ring_read = 0;
+static uint32 ring_flush = 0;
+static uint32 base_lba = 0;
+static uint32 base_pos = 0;
+
+static uint8 volume_left = 0xff, volume_right = 0xff;
+
+static perf_counter *perf_underruns = NULL;  // "cdaudio.underruns", empty ring while playing
+
+
+/*
+ *  MSF <-> LBA
+ */
+
+static inline uint32 msf_to_lba(uint8 m, uint8 s, uint8 f)
+{
+    uint32 frames = (m * 60 + s) * 75 + f;
+    return frames > CD_MSF_OFFSET ? frames - CD_MSF_OFFSET : 0;
+}
+
+static inline void frames_to_msf(uint32 frames, uint8 *msf)
+{
+    msf[0] = frames / (60 * 75);
+    msf[1] = (frames / 75) % 60;
+    msf[2] = frames % 75;
+}
+
+static inline void lba_to_msf(uint32 lba, uint8 *msf)
+{
+    frames_to_msf(lba + CD_MSF_OFFSET, msf);
+}
+
+
+/*
+ *  CUE sheet parsing
+ */
+
+// Next whitespace-separated or quoted token, NULL at the end of the line
+static char *next_token(char *&p)
+{
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == 0) {
+        return NULL;
+    }
+    char *start;
+    if (*p == '"') {
+        start = ++p;
+        while (*p && *p != '"') {
+            p++;
+        }
+    } else {
+        start = p;
+        while (*p && *p != ' ' && *p != '\t') {
+            p++;
+        }
+    }
+    if (*p) {
+        *p++ = 0;
+    }
+    return start;
+}
+
+static bool parse_msf(const char *s, uint32 &frames)
+{
+    unsigned m, sec, f;
+    if (!s || sscanf(s, "%u:%u:%u", &m, &sec, &f) != 3 || sec >= 60 || f >= 75) {
+        return false;
+    }
+    frames = (m * 60 + sec) * 75 + f;
+    return true;
+}
+
+static bool parse_track_mode(const char *mode, cue_track &t)
+{
+    if (!mode) {
+        return false;
+    }
+    t.control = 0x04;
+    if (strcasecmp(mode, "MODE1/2048") == 0) {
+        t.sector_size = 2048;
+        t.data_offset = 0;
+    } else if (strcasecmp(mode, "MODE1/2352") == 0) {
+        t.sector_size = 2352;
+        t.data_offset = 16;         // Sync and header
+    } else if (strcasecmp(mode, "MODE2/2352") == 0) {
+        t.sector_size = 2352;
+        t.data_offset = 24;         // Sync, header and XA subheader (Form 1)
+    } else if (strcasecmp(mode, "AUDIO") == 0) {
+        t.control = 0x00;
+        t.sector_size = CD_SECTOR_BYTES;
+        t.data_offset = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// FILE names are relative to the directory of the sheet
+static void resolve_path(const char *cue_path, const char *name, char *out)
+{
+    const char *slash = strrchr(cue_path, '/');
+    if (name[0] == '/' || !slash) {
+        snprintf(out, CUE_PATH_MAX, "%s", name);
+    } else {
+        snprintf(out, CUE_PATH_MAX, "%.*s/%s", (int)(slash - cue_path), cue_path, name);
+    }
+}
+
+static bool parse_sheet(cue_sheet *cue, const char *path, char *text)
+{
+    int line_no = 0;
+    char *p = text;
+    while (*p) {
+        char *line = p;
+        while (*p && *p != '\n' && *p != '\r') {
+            p++;
+        }
+        if (*p) {
+            *p++ = 0;
+        }
+        line_no++;
+
+        char *q = line;
+        char *cmd = next_token(q);
+        if (!cmd) {
+            continue;
+        }
+        cue_track *t = cue->ntracks ? &cue->tracks[cue->ntracks - 1] : NULL;
+        if (strcasecmp(cmd, "FILE") == 0) {
+            char *name = next_token(q);
+            char *type = next_token(q);
+            if (!name || !type || strcasecmp(type, "BINARY") != 0 || cue->nfiles == CUE_MAX_FILES) {
+                LOG_PRINTF("[CUE] %s:%d: unsupported FILE\n", path, line_no);
+                return false;
+            }
+            resolve_path(path, name, cue->files[cue->nfiles++]);
+        } else if (strcasecmp(cmd, "TRACK") == 0) {
+            char *num = next_token(q);
+            if (cue->nfiles == 0 || !num || cue->ntracks == CUE_MAX_TRACKS) {
+                LOG_PRINTF("[CUE] %s:%d: TRACK without FILE\n", path, line_no);
+                return false;
+            }
+            t = &cue->tracks[cue->ntracks++];
+            memset(t, 0, sizeof(*t));
+            t->number = atoi(num);
+            t->file = cue->nfiles - 1;
+            t->index0 = -1;
+            t->index1 = -1;
+            if (!parse_track_mode(next_token(q), *t)) {
+                LOG_PRINTF("[CUE] %s:%d: unsupported track mode\n", path, line_no);
+                return false;
+            }
+        } else if (strcasecmp(cmd, "INDEX") == 0) {
+            char *num = next_token(q);
+            uint32 frames;
+            if (!t || !num || !parse_msf(next_token(q), frames)) {
+                LOG_PRINTF("[CUE] %s:%d: bad INDEX\n", path, line_no);
+                return false;
+            }
+            if (t->file != cue->nfiles - 1) {
+                // Track starting in one file and continuing in the next
+                LOG_PRINTF("[CUE] %s:%d: track spans files\n", path, line_no);
+                return false;
+            }
+            if (atoi(num) == 0) {
+                t->index0 = frames;
+            } else if (atoi(num) == 1) {
+                t->index1 = frames;
+            }
+        } else if (strcasecmp(cmd, "PREGAP") == 0) {
+            uint32 frames;
+            if (!t || !parse_msf(next_token(q), frames)) {
+                LOG_PRINTF("[CUE] %s:%d: bad PREGAP\n", path, line_no);
+                return false;
+            }
+            t->pregap = frames;
+        }
+        // CATALOG, TITLE, PERFORMER, REM, FLAGS, POSTGAP... don't matter here
+    }
+    return cue->ntracks > 0;
+}
+
+// Disc layout: each file follows the previous one, PREGAPs are inserted
+static bool layout_sheet(cue_sheet *cue)
+{
+    for (int f = 0; f < cue->nfiles; f++) {
+        File file = SDCardFS().open(cue->files[f], FILE_READ);
+        if (!file) {
+            LOG_PRINTF("[CUE] Can't open %s\n", cue->files[f]);
+            return false;
+        }
+        cue->file_bytes[f] = file.size();
+        file.close();
+    }
+
+    uint32 lba = 0;
+    for (int i = 0; i < cue->ntracks; i++) {
+        cue_track &t = cue->tracks[i];
+        if (t.index1 < 0) {
+            LOG_PRINTF("[CUE] Track %d has no INDEX 01\n", t.number);
+            return false;
+        }
+        bool new_file = i == 0 || t.file != cue->tracks[i - 1].file;
+        if (!new_file && t.sector_size != cue->tracks[i - 1].sector_size) {
+            LOG_PRINTF("[CUE] Track %d: mixed sector sizes in one file\n", t.number);
+            return false;
+        }
+        if (i > 0 && new_file) {
+            lba = cue->tracks[i - 1].end;
+        }
+        lba += t.pregap;
+        t.file_lba = lba;
+        t.first = new_file ? lba : lba + (t.index0 >= 0 ? t.index0 : t.index1);
+        t.start = lba + t.index1;
+        t.end = lba + (uint32)(cue->file_bytes[t.file] / t.sector_size);
+        if (i > 0 && !new_file) {
+            cue->tracks[i - 1].end = t.first - t.pregap;
+        }
+    }
+    for (int i = 0; i < cue->ntracks; i++) {
+        const cue_track &t = cue->tracks[i];
+        if (t.start >= t.end || t.first > t.start) {
+            LOG_PRINTF("[CUE] Track %d lies outside %s\n", t.number, cue->files[t.file]);
+            return false;
+        }
+    }
+    cue->leadout = cue->tracks[cue->ntracks - 1].end;
+    return true;
+}
+
+static void reader_task(void *param);
+
+/*
+ *  Parse a sheet when its image is mounted
+ */
+cue_sheet *CueOpen(const char *path)
+{
+    File f = SDCardFS().open(path, FILE_READ);
+    if (!f) {
+        return NULL;
+    }
+    size_t size = f.size();
+    char *text = size < CUE_MAX_BYTES ? (char *)malloc(size + 1) : NULL;
+    cue_sheet *cue = (cue_sheet *)ps_malloc(sizeof(cue_sheet));
+    bool ok = text && cue && f.read((uint8 *)text, size) == size;
+    f.close();
+    if (ok) {
+        text[size] = 0;
+        memset(cue, 0, sizeof(cue_sheet));
+        ok = parse_sheet(cue, path, text) && layout_sheet(cue);
+    }
+    free(text);
+    if (!ok) {
+        LOG_PRINTF("[CUE] %s is not a usable CUE sheet\n", path);
+        free(cue);
+        return NULL;
+    }
+
+    // The ring and its reader live from the first sheet on
+    if (!ring) {
+        perf_underruns = PerfCounter("cdaudio.underruns");
+        ring = (uint8 *)ps_malloc(CD_RING_BYTES);
+        if (ring && xTaskCreatePinnedToCore(reader_task, "CDAudio", CD_READER_STACK, NULL,
+                                            CD_READER_PRIORITY, &reader_handle,
+                                            PrefsFindTaskCore("cdaudio", CD_READER_CORE)) != pdPASS) {
+            reader_handle = NULL;
+        }
+        if (!reader_handle) {
+            LOG_PRINTF("[CUE] WARNING: no CD audio reader, audio tracks won't play\n");
+        }
+    }
+
+    int audio_tracks = 0;
+    for (int i = 0; i < cue->ntracks; i++) {
+        audio_tracks += cue->tracks[i].control == 0x00;
+    }
+    LOG_PRINTF("[CUE] %s: %d tracks (%d audio) in %d files, %u sectors\n",
+               path, cue->ntracks, audio_tracks, cue->nfiles, (unsigned)cue->leadout);
+    return cue;
+}
+
+void CueClose(cue_sheet *cue)
+{
+    if (!cue) {
+        return;
+    }
+    CDAudioStop(cue);
+    // The reader drops the image (and its File) on its next pass
+    while (__atomic_load_n(&reader_cue, __ATOMIC_ACQUIRE) == cue) {
+        vTaskDelay(1);
+    }
+    free(cue);
+}
+
+bool CueDataTrack(const cue_sheet *cue, cue_data_track &track)
+{
+    const cue_track &t = cue->tracks[0];
+    if (t.control != 0x04) {
+        return false;
+    }
+    track.file = cue->files[t.file];
+    track.offset = (uint64)t.index1 * t.sector_size;
+    track.sector_size = t.sector_size;
+    track.data_offset = t.data_offset;
+    track.sectors = t.end - t.start;
+    return true;
+}
+
+
+/*
+ *  Table of contents in the SCSI "read TOC" format
+ */
+bool CueReadTOC(const cue_sheet *cue, uint8 *toc)
+{
+    int n = cue->ntracks;
+    int length = 2 + (n + 1) * 8;
+    toc[0] = length >> 8;
+    toc[1] = length;
+    toc[2] = cue->tracks[0].number;
+    toc[3] = cue->tracks[n - 1].number;
+    uint8 *p = toc + 4;
+    for (int i = 0; i <= n; i++, p += 8) {
+        const cue_track *t = &cue->tracks[i < n ? i : n - 1];
+        p[0] = 0;
+        p[1] = 0x10 | t->control;       // ADR 1: Q subchannel encodes position
+        p[2] = i < n ? t->number : 0xaa;
+        p[3] = 0;
+        p[4] = 0;
+        lba_to_msf(i < n ? t->start : cue->leadout, p + 5);
+    }
+    return true;
+}
+
+
+/*
+ *  Reader task: fill the ring from the BIN files
+ */
+
+// Track whose file sectors hold lba, NULL in a gap
+static const cue_track *track_at(const cue_sheet *cue, uint32 lba)
+{
+    for (int i = 0; i < cue->ntracks; i++) {
+        const cue_track &t = cue->tracks[i];
+        if (lba >= t.first && lba < t.end) {
+            return &t;
+        }
+    }
+    return NULL;
+}
+
+static void ring_put(const uint8 *src, uint32 pos, uint32 n)
+{
+    uint32 at = pos & (CD_RING_BYTES - 1);
+    uint32 first = n < CD_RING_BYTES - at ? n : CD_RING_BYTES - at;
+    if (src) {
+        memcpy(ring + at, src, first);
+        memcpy(ring, src + first, n - first);
+    } else {
+        memset(ring + at, 0, first);
+        memset(ring, 0, n - first);
+    }
+}
+
+static size_t ring_read_file(uint32 pos, uint32 n)
+{
+    uint32 at = pos & (CD_RING_BYTES - 1);
+    uint32 first = n < CD_RING_BYTES - at ? n : CD_RING_BYTES - at;
+    size_t got = reader_file.read(ring + at, first);
+    if (got == first && first < n) {
+        got += reader_file.read(ring, n - first);
+    }
+    return got;
+}
+
+// Append up to n sectors from lba at ring byte pos, the number appended
+static uint32 read_sectors(const cue_sheet *cue, uint32 lba, uint32 n, uint32 pos)
+{
+    const cue_track *t = track_at(cue, lba);
+    if (!t || t->control != 0x00) {
+        // Pregap or data track: silence up to the next audio
+        for (int i = 0; i < cue->ntracks; i++) {
+            const cue_track &next = cue->tracks[i];
+            if (next.first > lba && next.first - lba < n) {
+                n = next.first - lba;
+            }
+        }
+        if (t && t->end - lba < n) {
+            n = t->end - lba;
+        }
+        ring_put(NULL, pos, n * CD_SECTOR_BYTES);
+        return n;
+    }
+
+    if (t->end - lba < n) {
+        n = t->end - lba;
+    }
+    if (reader_file_index != t->file) {
+        reader_file.close();
+        reader_file = SDCardFS().open(cue->files[t->file], FILE_READ);
+        reader_file_index = reader_file ? t->file : -1;
+    }
+    uint32 bytes = n * CD_SECTOR_BYTES;
+    size_t got = 0;
+    if (reader_file && reader_file.seek((uint64)(lba - t->file_lba) * CD_SECTOR_BYTES)) {
+        got = ring_read_file(pos, bytes);
+    }
+    if (got < bytes) {
+        // Unreadable: keep the timing, play silence
+        ring_put(NULL, pos + got, bytes - got);
+    }
+    return n;
+}
+
+static void reader_task(void *param)
+{
+    UNUSED(param);
+    uint32 gen = 0;
+    cue_sheet *cue = NULL;
+    uint32 lba = 0, end = 0;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CD_READER_POLL_MS));
+
+        portENTER_CRITICAL(&cd_lock);
+        bool restart = gen != req_gen;
+        if (restart) {
+            gen = req_gen;
+            if (cue != req_cue) {
+                cue = req_cue;
+                reader_file.close();
+                reader_file_index = -1;
+            }
+            lba = req_start;
+            end = req_end;
+        }
+        portEXIT_CRITICAL(&cd_lock);
+
+        if (restart) {
+            // Start over at the new position, dropping what is queued
+            uint32 w = ring_write;
+            base_lba = lba;
+            base_pos = w;
+            __atomic_store_n(&ring_flush, w, __ATOMIC_RELEASE);
+            __atomic_store_n(&reader_cue, cue, __ATOMIC_RELEASE);
+        }
+
+        while (cue && lba < end && gen == __atomic_load_n(&req_gen, __ATOMIC_RELAXED)) {
+            uint32 r = __atomic_load_n(&ring_read, __ATOMIC_ACQUIRE);
+            uint32 flush = __atomic_load_n(&ring_flush, __ATOMIC_RELAXED);
+            if ((int32)(flush - r) > 0) {
+                r = flush;
+            }
+            uint32 space = CD_RING_BYTES - (ring_write - r);
+            uint32 n = space / CD_SECTOR_BYTES;
+            if (n == 0) {
+                break;
+            }
+            if (n > CD_READ_SECTORS) {
+                n = CD_READ_SECTORS;
+            }
+            if (n > end - lba) {
+                n = end - lba;
+            }
+            n = read_sectors(cue, lba, n, ring_write);
+            lba += n;
+            __atomic_store_n(&ring_write, ring_write + n * CD_SECTOR_BYTES, __ATOMIC_RELEASE);
+        }
+
+        if (cue && lba >= end) {
+            portENTER_CRITICAL(&cd_lock);
+            if (gen == req_gen) {
+                reader_done = true;
+            }
+            portEXIT_CRITICAL(&cd_lock);
+        }
+    }
+}
+
+
+/*
+ *  Control, from the CPU thread
+ */
+
+static void request(cue_sheet *cue, uint32 start, uint32 end, uint8 status)
+{
+    portENTER_CRITICAL(&cd_lock);
+    req_cue = cue;
+    req_start = start;
+    req_end = end;
+    req_gen++;
+    reader_done = false;
+    play_status = status;
+    portEXIT_CRITICAL(&cd_lock);
+    if (reader_handle) {
+        xTaskNotifyGive(reader_handle);
+    }
+    if (status == CD_STATUS_PLAYING) {
+        AudioCDStarted();
+    }
+}
+
+bool CDAudioPlay(cue_sheet *cue, uint8 start_m, uint8 start_s, uint8 start_f,
+                 uint8 end_m, uint8 end_s, uint8 end_f)
+{
+    uint32 start = msf_to_lba(start_m, start_s, start_f);
+    uint32 end = msf_to_lba(end_m, end_s, end_f);
+    if (end > cue->leadout) {
+        end = cue->leadout;
+    }
+    if (!reader_handle || start >= end) {
+        return false;
+    }
+    D(bug("CD play %u-%u\n", (unsigned)start, (unsigned)end));
+    request(cue, start, end, CD_STATUS_PLAYING);
+    return true;
+}
+
+bool CDAudioPause(cue_sheet *cue)
+{
+    bool ok = false;
+    portENTER_CRITICAL(&cd_lock);
+    if (req_cue == cue && play_status == CD_STATUS_PLAYING) {
+        play_status = CD_STATUS_PAUSED;
+        ok = true;
+    }
+    portEXIT_CRITICAL(&cd_lock);
+    return ok;
+}
+
+bool CDAudioResume(cue_sheet *cue)
+{
+    bool ok = false;
+    portENTER_CRITICAL(&cd_lock);
+    if (req_cue == cue && play_status == CD_STATUS_PAUSED) {
+        play_status = CD_STATUS_PLAYING;
+        ok = true;
+    }
+    portEXIT_CRITICAL(&cd_lock);
+    if (ok) {
+        AudioCDStarted();
+    }
+    return ok;
+}
+
+bool CDAudioStop(cue_sheet *cue)
+{
+    if (req_cue == cue) {
+        request(NULL, 0, 0, CD_STATUS_NONE);
+    }
+    return true;
+}
+
+// No fast-forward sound: scanning moves the play position
+bool CDAudioScan(cue_sheet *cue, uint8 start_m, uint8 start_s, uint8 start_f, bool reverse)
+{
+    UNUSED(reverse);
+    uint32 start = msf_to_lba(start_m, start_s, start_f);
+    uint32 end = req_cue == cue ? req_end : cue->leadout;
+    if (!reader_handle || start >= end) {
+        return false;
+    }
+    request(cue, start, end, CD_STATUS_PLAYING);
+    return true;
+}
+
+void CDAudioSetVolume(uint8 left, uint8 right)
+{
+    volume_left = left;
+    volume_right = right;
+}
+
+void CDAudioGetVolume(uint8 &left, uint8 &right)
+{
+    left = volume_left;
+    right = volume_right;
+}
+
+// Sector being played
+static uint32 current_lba(void)
+{
+    uint32 r = __atomic_load_n(&ring_read, __ATOMIC_ACQUIRE);
+    uint32 flush = __atomic_load_n(&ring_flush, __ATOMIC_ACQUIRE);
+    if ((int32)(flush - r) > 0) {
+        r = flush;
+    }
+    return base_lba + (r - base_pos) / CD_SECTOR_BYTES;
+}
+
+/*
+ *  Current position in the SCSI "read sub-channel" format
+ */
+bool CDAudioGetPosition(cue_sheet *cue, uint8 *pos)
+{
+    uint8 status = req_cue == cue ? play_status : CD_STATUS_NONE;
+    uint32 lba = req_cue == cue ? current_lba() : 0;
+    if (lba >= cue->leadout) {
+        lba = cue->leadout - 1;
+    }
+
+    // Past the sectors of a track is the pregap of the next one
+    int i = 0;
+    while (i + 1 < cue->ntracks && lba >= cue->tracks[i].end) {
+        i++;
+    }
+    const cue_track &t = cue->tracks[i];
+    bool pregap = lba < t.start;
+
+    memset(pos, 0, 16);
+    pos[1] = status;
+    pos[3] = 12;                        // Sub-channel data length
+    pos[4] = 0x01;                      // Current position data
+    pos[5] = 0x10 | t.control;
+    pos[6] = t.number;
+    pos[7] = pregap ? 0 : 1;
+    lba_to_msf(lba, pos + 9);
+    frames_to_msf(pregap ? t.start - lba : lba - t.start, pos + 13);
+    return true;
+}
+
+
+/*
+ *  Audio task side
+ */
+
+bool CDAudioActive(void)
+{
+    return __atomic_load_n(&play_status, __ATOMIC_RELAXED) == CD_STATUS_PLAYING;
+}
+
+static inline int16 scale(int16 s, uint8 volume)
+{
+    return volume == 0xff ? s : (int16)((s * (volume + 1)) >> 8);
+}
+
+int CDAudioRead(int16 *dest, int frames)
+{
+    if (!CDAudioActive()) {
+        return 0;
+    }
+    bool done = __atomic_load_n(&reader_done, __ATOMIC_ACQUIRE);
+    uint32 r = ring_read;
+    uint32 flush = __atomic_load_n(&ring_flush, __ATOMIC_ACQUIRE);
+    if ((int32)(flush - r) > 0) {
+        r = flush;
+    }
+    uint32 avail = (__atomic_load_n(&ring_write, __ATOMIC_ACQUIRE) - r) / CD_FRAME_BYTES;
+    if ((uint32)frames > avail) {
+        frames = avail;
+    }
+
+    // Sectors are little-endian 16-bit stereo frames, like the host
+    for (int i = 0; i < frames; i++) {
+        const int16 *s = (const int16 *)(ring + ((r + i * CD_FRAME_BYTES) & (CD_RING_BYTES - 1)));
+        dest[i * 2] = scale(s[0], volume_left);
+        dest[i * 2 + 1] = scale(s[1], volume_right);
+    }
+    __atomic_store_n(&ring_read, r + frames * CD_FRAME_BYTES, __ATOMIC_RELEASE);
+
+    if (frames == 0) {
+        if (done) {
+            // Played to the end
+            portENTER_CRITICAL(&cd_lock);
+            if (reader_done && play_status == CD_STATUS_PLAYING) {
+                play_status = CD_STATUS_DONE;
+            }
+            portEXIT_CRITICAL(&cd_lock);
+        } else {
+            PerfAdd(perf_underruns, 1);
+        }
+    }
+    return frames;
+}
+
+#endif
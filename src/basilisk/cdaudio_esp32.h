@@ -0,0 +1,63 @@
+/*
+ *  cdaudio_esp32.h - BIN/CUE CD images and their audio tracks
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef CDAUDIO_ESP32_H
+#define CDAUDIO_ESP32_H
+
+#ifndef CD_AUDIO
+#define CD_AUDIO 0
+#endif
+
+#if CD_AUDIO
+
+struct cue_sheet;
+
+// Parse a .cue file once, when the image is mounted; NULL if it can't be used
+extern cue_sheet *CueOpen(const char *path);
+
+// Stop playback from the image and free it
+extern void CueClose(cue_sheet *cue);
+
+// Where sys_esp32.cpp finds the 2048-byte blocks of the first (data) track
+struct cue_data_track {
+    const char *file;       // Its BIN file
+    uint64 offset;          // Byte offset of its first sector in the file
+    uint32 sector_size;     // Bytes per sector in the file (2048 or 2352)
+    uint32 data_offset;     // User data within a sector (0, 16 for MODE1, 24 for MODE2)
+    uint32 sectors;
+};
+extern bool CueDataTrack(const cue_sheet *cue, cue_data_track &track);
+
+/*
+ *  SysCDReadTOC() and friends for a CUE image, from the CPU thread. They
+ *  only post the request: a reader task on Core 0 streams the audio
+ *  sectors from the card into a PSRAM ring, and the audio task plays it.
+ *  One image plays at a time, starting another one stops it.
+ */
+extern bool CueReadTOC(const cue_sheet *cue, uint8 *toc);
+extern bool CDAudioGetPosition(cue_sheet *cue, uint8 *pos);
+extern bool CDAudioPlay(cue_sheet *cue, uint8 start_m, uint8 start_s, uint8 start_f,
+                        uint8 end_m, uint8 end_s, uint8 end_f);
+extern bool CDAudioPause(cue_sheet *cue);
+extern bool CDAudioResume(cue_sheet *cue);
+extern bool CDAudioStop(cue_sheet *cue);
+extern bool CDAudioScan(cue_sheet *cue, uint8 start_m, uint8 start_s, uint8 start_f, bool reverse);
+extern void CDAudioSetVolume(uint8 left, uint8 right);
+extern void CDAudioGetVolume(uint8 &left, uint8 &right);
+
+/*
+ *  Audio task side: true while a track plays (the task keeps polling), and
+ *  up to frames 44.1 kHz 16-bit stereo frames of it, the number copied
+ */
+extern bool CDAudioActive(void);
+extern int CDAudioRead(int16 *dest, int frames);
+
+// Implemented in audio_esp32.cpp: wake the audio task, playback started
+extern void AudioCDStarted(void);
+
+#endif
+
+#endif // CDAUDIO_ESP32_H
@@ -44,6 +44,8 @@ using std::vector;
 #include "sys.h"
 #include "prefs.h"
 #include "cdrom.h"
+#include "snapshot.h"
+#include "replay_esp32.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -191,34 +193,53 @@ static drive_vec::iterator get_drive_info(int num, uint16 driverRefNum)
  *  Find HFS partition, set info->start_byte (0 = no HFS partition)
  */
 
+const int PARTITION_MAP_BLOCKS = 64;	// Blocks searched for the partition map
+
+// Partition map block for an Apple HFS partition? Then set start_byte
+static bool hfs_partition_entry(const uint8 *map, cdrom_drive_info &info)
+{
+	uint16 sig = (map[0] << 8) | map[1];
+	if (sig != 0x504d || strncmp((const char *)(map + 48), "Apple_HFS", 32) != 0)
+		return false;
+	info.start_byte = (loff_t)((map[8] << 24) | (map[9] << 16) | (map[10] << 8) | map[11]) << 9;
+#if DEBUG
+	uint32 num_blocks = (map[12] << 24) | (map[13] << 16) | (map[14] << 8) | map[15];
+	D(bug(" HFS partition found at %d, %d blocks\n", info.start_byte, num_blocks));
+#endif
+	return true;
+}
+
 static void find_hfs_partition(cdrom_drive_info &info)
 {
 	info.start_byte = 0;
-	uint8 *map = new uint8[512];
 	D(bug("Looking for HFS partitions on CD-ROM...\n"));
-	
-	// Search first 64 blocks for HFS partition
-	for (int i=0; i<64; i++) {
-		if (Sys_read(info.fh, map, i * 512, 512) != 512)
-			break;
-		D(bug(" block %d, signature '%c%c' (%02x%02x)\n", i, map[0], map[1], map[0], map[1]));
-		
-		// Not a partition map block? Then look at next block
-		uint16 sig = (map[0] << 8) | map[1];
-		if (sig != 0x504d)
-			continue;
-		
-		// Partition map block found, Apple HFS partition?
-		if (strcmp((char *)(map + 48), "Apple_HFS") == 0) {
-			info.start_byte = (loff_t)((map[8] << 24) | (map[9] << 16) | (map[10] << 8) | map[11]) << 9;
-#if DEBUG
-			uint32 num_blocks = (map[12] << 24) | (map[13] << 16) | (map[14] << 8) | map[15];
-			D(bug(" HFS partition found at %d, %d blocks\n", info.start_byte, num_blocks));
-#endif
+
+	// Where it was last time: check just that entry, or that there is
+	// still no driver descriptor and partition map in blocks 0 and 1
+	int last = Sys_hfs_partition_block(info.fh);
+	if (last >= 0) {
+		uint8 block[1024];
+		if (last > 0 && Sys_read(info.fh, block, last * 512, 512) == 512 && hfs_partition_entry(block, info))
+			return;
+		if (last == 0 && Sys_read(info.fh, block, 0, 1024) == 1024
+		 && ((block[0] << 8) | block[1]) != 0x4552 && ((block[512] << 8) | block[513]) != 0x504d)
+			return;
+	}
+
+	// Search first 64 blocks for HFS partition, read in one go
+	uint8 *map = new uint8[PARTITION_MAP_BLOCKS * 512];
+	int blocks = Sys_read(info.fh, map, 0, PARTITION_MAP_BLOCKS * 512) / 512;
+	int found = 0;
+	for (int i=0; i<blocks; i++) {
+		D(bug(" block %d, signature '%c%c' (%02x%02x)\n", i, map[i * 512], map[i * 512 + 1], map[i * 512], map[i * 512 + 1]));
+		if (hfs_partition_entry(map + i * 512, info)) {
+			found = i;
 			break;
 		}
 	}
 	delete[] map;
+	if (blocks > 0)
+		Sys_set_hfs_partition_block(info.fh, found);
 }
 
 
@@ -360,6 +381,35 @@ void CDROMExit(void)
 }
 
 
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the driver state (the drives come from the prefs, which
+ *  the snapshot was checked against); a disc moved aside by a driver
+ *  Eject() refuses the snapshot, its handle wouldn't survive
+ */
+
+bool CDROMSnapshot(void)
+{
+	uint32 count = drives.size();
+	if (!SnapshotVar(count) || count != drives.size() || !SnapshotVar(acc_run_called))
+		return false;
+	if (!SnapshotRestoring() && !remount_map.empty())
+		return false;
+	drive_vec::iterator info, end = drives.end();
+	for (info = drives.begin(); info != end; ++info) {
+		if (!SnapshotVar(info->num) || !SnapshotVar(info->block_size) || !SnapshotVar(info->twok_offset)
+		 || !SnapshotVar(info->start_byte) || !SnapshotVar(info->to_be_mounted) || !SnapshotVar(info->mount_non_hfs)
+		 || !SnapshotVar(info->toc) || !SnapshotVar(info->lead_out) || !SnapshotVar(info->stop_at) || !SnapshotVar(info->start_at)
+		 || !SnapshotVar(info->play_mode) || !SnapshotVar(info->play_order) || !SnapshotVar(info->repeat)
+		 || !SnapshotVar(info->power_mode) || !SnapshotVar(info->status) || !SnapshotVar(info->init_null)
+		 || !SnapshotVar(info->driver_reference_number))
+			return false;
+	}
+	return true;
+}
+#endif
+
+
 /*
  *  Disk was inserted, flag for mounting
  */
@@ -581,6 +631,62 @@ int16 CDROMOpen(uint32 pb, uint32 dce)
  *  Driver Prime() routine
  */
 
+#if SYS_ASYNC_IO
+// Asynchronous Prime() in progress (the Device Manager hands the driver one
+// request at a time)
+static struct {
+	sys_async_req io;
+	uint32 pb, dce;
+	loff_t position;
+	bool busy;
+} async_prime;
+
+/*
+ *  Complete a finished asynchronous Prime() through IODone, which also
+ *  starts the next queued request
+ */
+
+static void complete_async_prime(void)
+{
+	if (!async_prime.busy)
+		return;
+#if REPLAY
+	if (!ReplayIODone(&async_prime.io.done))
+#else
+	if (!__atomic_load_n(&async_prime.io.done, __ATOMIC_ACQUIRE))
+#endif
+		return;
+	async_prime.busy = false;
+
+	uint32 pb = async_prime.pb, dce = async_prime.dce;
+	size_t actual = async_prime.io.actual;
+	int16 result = noErr;
+
+	// Filled on Core 0 after the copies were last refreshed
+	ram_copy_host_write(Host2MacAddr((uint8 *)async_prime.io.buffer));
+	if (actual != async_prime.io.length) {
+
+		// Read error, tried to read HFS root block? Fake it (see CDROMPrime())
+		if (async_prime.io.length == 0x200 && async_prime.position == 0x400) {
+			memset(async_prime.io.buffer, 0, 0x200);
+			actual = 0x200;
+		} else
+			result = readErr;
+	}
+	if (result == noErr) {
+		WriteMacInt32(pb + ioActCount, actual);
+		WriteMacInt32(dce + dCtlPosition, ReadMacInt32(dce + dCtlPosition) + actual);
+		FlushCodeCache(async_prime.io.buffer, actual);
+	}
+
+	M68kRegisters r;
+	r.d[0] = (uint32)(int32)result;
+	r.a[0] = pb;
+	r.a[1] = dce;
+	Execute68k(ReadMacInt32(0x8fc), &r);	// JIODone
+}
+#endif
+
 int16 CDROMPrime(uint32 pb, uint32 dce)
 {
 	WriteMacInt32(pb + ioActCount, 0);
@@ -600,6 +706,28 @@ int16 CDROMPrime(uint32 pb, uint32 dce)
 		return paramErr;
 	info->twok_offset = (position + info->start_byte) & 0x7ff;
 	
+#if SYS_ASYNC_IO
+	// Asynchronous read: start the transfer and return with the request
+	// pending (IOReturn leaves ioResult alone for d0 > 0)
+	uint16 trap = ReadMacInt16(pb + ioTrap);
+	if ((trap & (1 << asyncTrpBit)) && !(trap & (1 << noQueueBit)) && !async_prime.busy) {
+		if ((trap & 0xff) != aRdCmd)
+			return wPrErr;
+		async_prime.io.fh = info->fh;
+		async_prime.io.buffer = buffer;
+		async_prime.io.offset = position + info->start_byte;
+		async_prime.io.length = length;
+		async_prime.io.write = false;
+		async_prime.pb = pb;
+		async_prime.dce = dce;
+		async_prime.position = position;
+		async_prime.busy = true;
+		if (Sys_async_submit(&async_prime.io))
+			return 1;
+		async_prime.busy = false;
+	}
+#endif
+	
 	size_t actual = 0;
 	if ((ReadMacInt16(pb + ioTrap) & 0xff) == aRdCmd) {
 		
@@ -1284,11 +1412,16 @@ int16 CDROMStatus(uint32 pb, uint32 dce)
 
 
 /*
- *  Driver interrupt routine (1Hz) - check for volumes to be mounted
+ *  Driver interrupt routine (1Hz and INTFLAG_DISK) - complete asynchronous
+ *  I/O, check for volumes to be mounted
  */
 
 void CDROMInterrupt(void)
 {
+#if SYS_ASYNC_IO
+	complete_async_prime();
+#endif
+	
 	if (!acc_run_called)
 		return;
 	
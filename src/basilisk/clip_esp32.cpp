@@ -0,0 +1,549 @@
+/*
+ *  clip_esp32.cpp - Clipboard bridge over Wi-Fi
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The Mac scrap is served on a TCP port ("clipport", 6067 by default)
+ *  once Wi-Fi is up. The protocol is line based; every request gets an
+ *  "OK ..." or "ERR ..." line back:
+ *    INFO                  "OK TEXT <bytes> PICT <bytes> SEQ <n>"
+ *    GET TEXT              "OK <bytes>", then the text as UTF-8 with LF
+ *    GET PICT              "OK <bytes>", then the PICT data as is
+ *    PUT TEXT <bytes>      followed by UTF-8 text; pasted on the Mac next
+ *    PUT PICT <bytes>      followed by PICT data
+ *  so "printf 'GET TEXT\n' | nc tab5 6067" prints the Mac's clipboard.
+ *
+ *  The 68k waits on PutScrap() every time an application writes the
+ *  clipboard, so it only copies the raw scrap into PSRAM. MacRoman/CR to
+ *  UTF-8/LF conversion (and back) runs in the clipboard task on Core 0,
+ *  and only when a client asks for it. Data put by a client is handed to
+ *  the Scrap Manager from the next GetScrap(), i.e. when an application
+ *  pastes or checks the clipboard.
+ */
+
+#include "sysdeps.h"
+
+#include <stdarg.h>
+#include <Arduino.h>
+#include <WiFi.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "macos_util.h"
+#include "prefs.h"
+#include "clip.h"
+#include "emul_op.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define CLIP_MAX_SCRAP          (1024 * 1024)   // Larger scraps are not mirrored
+#define CLIP_CLIENT_TIMEOUT_S   30              // Idle client connections are closed
+#define CLIP_LINE_MAX           64
+
+#define CLIP_TASK_STACK_SIZE    4096
+#define CLIP_TASK_PRIORITY      1
+#define CLIP_TASK_CORE          0
+
+// Low-memory global bumped by ZeroScrap()
+#define LM_SCRAP_COUNT          0x968
+
+enum {
+    SLOT_TEXT,
+    SLOT_PICT,
+    SLOT_COUNT
+};
+
+// Raw scrap data of one type, in PSRAM
+struct clip_slot {
+    uint8 *data;
+    uint32 length;
+    uint32 capacity;
+};
+
+static const uint32 slot_types[SLOT_COUNT] = {
+    FOURCC('T','E','X','T'),
+    FOURCC('P','I','C','T')
+};
+
+static SemaphoreHandle_t clip_lock = NULL;
+
+// Mac -> client: the current Mac scrap (written by PutScrap())
+static clip_slot mac_scrap[SLOT_COUNT];
+static uint16 mac_scrap_count = 0xffff;    // ScrapCount of the data in mac_scrap
+static uint32 mac_scrap_seq = 0;           // Bumped on every Mac clipboard change
+
+// Client -> Mac: converted data waiting for the next GetScrap()
+static clip_slot host_scrap;
+static uint32 host_scrap_type = 0;
+static volatile bool host_scrap_pending = false;
+
+static int listen_socket = -1;
+static TaskHandle_t clip_task_handle = NULL;
+static volatile bool clip_task_running = false;
+
+// Unicode for MacRoman 0x80..0xff
+static const uint16 macroman_to_unicode[128] = {
+    0x00c4, 0x00c5, 0x00c7, 0x00c9, 0x00d1, 0x00d6, 0x00dc, 0x00e1,
+    0x00e0, 0x00e2, 0x00e4, 0x00e3, 0x00e5, 0x00e7, 0x00e9, 0x00e8,
+    0x00ea, 0x00eb, 0x00ed, 0x00ec, 0x00ee, 0x00ef, 0x00f1, 0x00f3,
+    0x00f2, 0x00f4, 0x00f6, 0x00f5, 0x00fa, 0x00f9, 0x00fb, 0x00fc,
+    0x2020, 0x00b0, 0x00a2, 0x00a3, 0x00a7, 0x2022, 0x00b6, 0x00df,
+    0x00ae, 0x00a9, 0x2122, 0x00b4, 0x00a8, 0x2260, 0x00c6, 0x00d8,
+    0x221e, 0x00b1, 0x2264, 0x2265, 0x00a5, 0x00b5, 0x2202, 0x2211,
+    0x220f, 0x03c0, 0x222b, 0x00aa, 0x00ba, 0x03a9, 0x00e6, 0x00f8,
+    0x00bf, 0x00a1, 0x00ac, 0x221a, 0x0192, 0x2248, 0x2206, 0x00ab,
+    0x00bb, 0x2026, 0x00a0, 0x00c0, 0x00c3, 0x00d5, 0x0152, 0x0153,
+    0x2013, 0x2014, 0x201c, 0x201d, 0x2018, 0x2019, 0x00f7, 0x25ca,
+    0x00ff, 0x0178, 0x2044, 0x20ac, 0x2039, 0x203a, 0xfb01, 0xfb02,
+    0x2021, 0x00b7, 0x201a, 0x201e, 0x2030, 0x00c2, 0x00ca, 0x00c1,
+    0x00cb, 0x00c8, 0x00cd, 0x00ce, 0x00cf, 0x00cc, 0x00d3, 0x00d4,
+    0xf8ff, 0x00d2, 0x00da, 0x00db, 0x00d9, 0x0131, 0x02c6, 0x02dc,
+    0x00af, 0x02d8, 0x02d9, 0x02da, 0x00b8, 0x02dd, 0x02db, 0x02c7
+};
+
+
+/*
+ *  Buffer helpers
+ */
+
+static bool slot_reserve(clip_slot &s, uint32 length)
+{
+    if (length <= s.capacity) {
+        return true;
+    }
+    uint32 capacity = (length + 4095) & ~4095;
+    uint8 *data = (uint8 *)ps_realloc(s.data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    s.data = data;
+    s.capacity = capacity;
+    return true;
+}
+
+static int slot_index(uint32 type)
+{
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        if (slot_types[i] == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ *  Text conversion (clipboard task only)
+ */
+
+// MacRoman with CR line ends to UTF-8 with LF, returns the output length
+static uint32 macroman_to_utf8(const uint8 *src, uint32 length, uint8 *dst)
+{
+    uint8 *d = dst;
+    for (uint32 i = 0; i < length; i++) {
+        uint8 c = src[i];
+        if (c < 0x80) {
+            *d++ = (c == '\r') ? '\n' : c;
+            continue;
+        }
+        uint16 u = macroman_to_unicode[c - 0x80];
+        if (u < 0x800) {
+            *d++ = 0xc0 | (u >> 6);
+            *d++ = 0x80 | (u & 0x3f);
+        } else {
+            *d++ = 0xe0 | (u >> 12);
+            *d++ = 0x80 | ((u >> 6) & 0x3f);
+            *d++ = 0x80 | (u & 0x3f);
+        }
+    }
+    return d - dst;
+}
+
+static uint8 unicode_to_macroman(uint32 u)
+{
+    for (int i = 0; i < 128; i++) {
+        if (macroman_to_unicode[i] == u) {
+            return 0x80 + i;
+        }
+    }
+    return '?';
+}
+
+// UTF-8 with LF or CRLF line ends to MacRoman with CR, in place (the
+// output is never longer than the input), returns the output length
+static uint32 utf8_to_macroman(uint8 *buf, uint32 length)
+{
+    uint32 i = 0, n = 0;
+    while (i < length) {
+        uint8 c = buf[i];
+        if (c < 0x80) {
+            i++;
+            if (c == '\r' && i < length && buf[i] == '\n') {
+                i++;
+            }
+            buf[n++] = (c == '\n') ? '\r' : c;
+            continue;
+        }
+        int extra = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc0) ? 1 : 0;
+        uint32 u = c & (0x3f >> extra);
+        i++;
+        for (int k = 0; k < extra && i < length && (buf[i] & 0xc0) == 0x80; k++, i++) {
+            u = (u << 6) | (buf[i] & 0x3f);
+        }
+        buf[n++] = (extra == 0) ? '?' : unicode_to_macroman(u);
+    }
+    return n;
+}
+
+
+/*
+ *  Client connection handling (clipboard task)
+ */
+
+static bool send_all(int sock, const void *data, uint32 length)
+{
+    const uint8 *p = (const uint8 *)data;
+    while (length > 0) {
+        int n = send(sock, p, length, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int sock, void *data, uint32 length)
+{
+    uint8 *p = (uint8 *)data;
+    while (length > 0) {
+        int n = recv(sock, p, length, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool recv_line(int sock, char *line, int size)
+{
+    int n = 0;
+    for (;;) {
+        char c;
+        if (recv(sock, &c, 1, 0) != 1) {
+            return false;
+        }
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && n < size - 1) {
+            line[n++] = c;
+        }
+    }
+    line[n] = 0;
+    return true;
+}
+
+static bool send_reply(int sock, const char *fmt, ...)
+{
+    char line[CLIP_LINE_MAX];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line) - 1, fmt, args);
+    va_end(args);
+    strcat(line, "\n");
+    return send_all(sock, line, strlen(line));
+}
+
+// Send the Mac's scrap of the given slot, converting text on the way
+static bool serve_get(int sock, int slot, clip_slot &scratch, clip_slot &out)
+{
+    // Copy out under the lock, so PutScrap() never waits for a conversion
+    xSemaphoreTake(clip_lock, portMAX_DELAY);
+    uint32 length = mac_scrap[slot].length;
+    bool ok = slot_reserve(scratch, length);
+    if (ok) {
+        memcpy(scratch.data, mac_scrap[slot].data, length);
+    }
+    xSemaphoreGive(clip_lock);
+    if (!ok) {
+        return send_reply(sock, "ERR no memory");
+    }
+
+    const uint8 *data = scratch.data;
+    if (slot == SLOT_TEXT) {
+        if (!slot_reserve(out, length * 3)) {
+            return send_reply(sock, "ERR no memory");
+        }
+        length = macroman_to_utf8(scratch.data, length, out.data);
+        data = out.data;
+    }
+    return send_reply(sock, "OK %u", (unsigned)length) && send_all(sock, data, length);
+}
+
+// Receive data for the Mac's scrap and queue it for the next GetScrap()
+static bool serve_put(int sock, int slot, uint32 length, clip_slot &scratch)
+{
+    if (length > CLIP_MAX_SCRAP || !slot_reserve(scratch, length)) {
+        return false;   // Can't skip the data reliably, so drop the connection
+    }
+    if (!recv_all(sock, scratch.data, length)) {
+        return false;
+    }
+    if (slot == SLOT_TEXT) {
+        length = utf8_to_macroman(scratch.data, length);
+    }
+
+    xSemaphoreTake(clip_lock, portMAX_DELAY);
+    bool ok = slot_reserve(host_scrap, length);
+    if (ok) {
+        memcpy(host_scrap.data, scratch.data, length);
+        host_scrap.length = length;
+        host_scrap_type = slot_types[slot];
+        host_scrap_pending = true;
+    }
+    xSemaphoreGive(clip_lock);
+    D(bug("[CLIP] client put %u bytes of %s\n", (unsigned)length, slot == SLOT_TEXT ? "TEXT" : "PICT"));
+    return ok ? send_reply(sock, "OK") : send_reply(sock, "ERR no memory");
+}
+
+static void serve_client(int sock, clip_slot &scratch, clip_slot &out)
+{
+    char line[CLIP_LINE_MAX];
+    while (clip_task_running && recv_line(sock, line, sizeof(line))) {
+        char type[5] = "";
+        unsigned length = 0;
+        bool ok;
+        if (strcmp(line, "INFO") == 0) {
+            xSemaphoreTake(clip_lock, portMAX_DELAY);
+            uint32 text = mac_scrap[SLOT_TEXT].length;
+            uint32 pict = mac_scrap[SLOT_PICT].length;
+            uint32 seq = mac_scrap_seq;
+            xSemaphoreGive(clip_lock);
+            ok = send_reply(sock, "OK TEXT %u PICT %u SEQ %u", (unsigned)text, (unsigned)pict, (unsigned)seq);
+        } else if (sscanf(line, "GET %4s", type) == 1 &&
+                   slot_index(FOURCC(type[0], type[1], type[2], type[3])) >= 0) {
+            ok = serve_get(sock, slot_index(FOURCC(type[0], type[1], type[2], type[3])), scratch, out);
+        } else if (sscanf(line, "PUT %4s %u", type, &length) == 2 &&
+                   slot_index(FOURCC(type[0], type[1], type[2], type[3])) >= 0) {
+            ok = serve_put(sock, slot_index(FOURCC(type[0], type[1], type[2], type[3])), length, scratch);
+        } else {
+            ok = send_reply(sock, "ERR unknown request");
+        }
+        if (!ok) {
+            break;
+        }
+    }
+}
+
+static void clipTask(void *param)
+{
+    UNUSED(param);
+
+    // Conversion buffers, grown on demand and kept for the next client
+    clip_slot scratch = {NULL, 0, 0};
+    clip_slot out = {NULL, 0, 0};
+
+    while (clip_task_running) {
+        int sock = accept(listen_socket, NULL, NULL);
+        if (sock < 0) {
+            if (clip_task_running) {
+                vTaskDelay(pdMS_TO_TICKS(100));
+            }
+            continue;
+        }
+        struct timeval tv = {CLIP_CLIENT_TIMEOUT_S, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        serve_client(sock, scratch, out);
+        close(sock);
+    }
+
+    free(scratch.data);
+    free(out.data);
+    vTaskDelete(NULL);
+}
+
+
+/*
+ *  Initialization
+ */
+
+void ClipInit(void)
+{
+    int port = PrefsFindInt32("clipport");
+    if (port <= 0) {
+        return;
+    }
+    if (WiFi.status() != WL_CONNECTED) {
+        D(bug("[CLIP] no Wi-Fi, clipboard bridge off\n"));
+        return;
+    }
+
+    clip_lock = xSemaphoreCreateMutex();
+    if (clip_lock == NULL) {
+        Serial.println("[CLIP] WARNING: no mutex, clipboard bridge off");
+        return;
+    }
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) {
+        Serial.println("[CLIP] WARNING: no TCP socket, clipboard bridge off");
+        return;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    int on = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listen_socket, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listen_socket, 1) < 0) {
+        Serial.printf("[CLIP] WARNING: can't listen on TCP port %d, clipboard bridge off\n", port);
+        close(listen_socket);
+        listen_socket = -1;
+        return;
+    }
+
+    clip_task_running = true;
+    if (xTaskCreatePinnedToCore(clipTask, "ClipTask", CLIP_TASK_STACK_SIZE, NULL,
+                                CLIP_TASK_PRIORITY, &clip_task_handle,
+                                PrefsFindTaskCore("clip", CLIP_TASK_CORE)) != pdPASS) {
+        Serial.println("[CLIP] WARNING: clipboard task not started, clipboard bridge off");
+        clip_task_running = false;
+        close(listen_socket);
+        listen_socket = -1;
+        return;
+    }
+
+    Serial.printf("[CLIP] Clipboard on %s, TCP port %d\n", WiFi.localIP().toString().c_str(), port);
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void ClipExit(void)
+{
+    if (clip_task_running) {
+        clip_task_running = false;
+        shutdown(listen_socket, SHUT_RDWR);     // Ends the accept() in the task
+        vTaskDelay(pdMS_TO_TICKS(50));
+        clip_task_handle = NULL;
+    }
+    if (listen_socket >= 0) {
+        close(listen_socket);
+        listen_socket = -1;
+    }
+}
+
+
+/*
+ *  Mac application reads clipboard
+ */
+
+void GetScrap(void **handle, uint32 type, int32 offset)
+{
+    D(bug("GetScrap handle %p, type %08x, offset %d\n", handle, type, offset));
+    UNUSED(handle);
+    UNUSED(type);
+    UNUSED(offset);
+    if (!host_scrap_pending) {
+        return;
+    }
+
+    // Copy the client's data into the Mac heap
+    xSemaphoreTake(clip_lock, portMAX_DELAY);
+    M68kRegisters r;
+    r.d[0] = host_scrap.length;
+    Execute68kTrap(0xa71e, &r);         // NewPtrSysClear()
+    uint32 scrap_area = r.a[0];
+    uint32 scrap_type = host_scrap_type;
+    uint32 scrap_length = host_scrap.length;
+    if (scrap_area) {
+        Host2Mac_memcpy(scrap_area, host_scrap.data, scrap_length);
+    }
+    host_scrap_pending = false;
+    xSemaphoreGive(clip_lock);
+    if (scrap_area == 0) {
+        return;
+    }
+
+    // Replace the scrap with it
+    static const uint8 proc[] = {
+        0x59, 0x8f,                     // subq.l   #4,sp
+        0xa9, 0xfc,                     // ZeroScrap()
+        0x2f, 0x3c, 0, 0, 0, 0,         // move.l   #length,-(sp)
+        0x2f, 0x3c, 0, 0, 0, 0,         // move.l   #type,-(sp)
+        0x2f, 0x3c, 0, 0, 0, 0,         // move.l   #outbuf,-(sp)
+        0xa9, 0xfe,                     // PutScrap()
+        0x58, 0x8f,                     // addq.l   #4,sp
+        M68K_RTS >> 8, M68K_RTS & 0xff
+    };
+    r.d[0] = sizeof(proc);
+    Execute68kTrap(0xa71e, &r);         // NewPtrSysClear()
+    uint32 proc_area = r.a[0];
+    if (proc_area) {
+        Host2Mac_memcpy(proc_area, proc, sizeof(proc));
+        WriteMacInt32(proc_area + 6, scrap_length);
+        WriteMacInt32(proc_area + 12, scrap_type);
+        WriteMacInt32(proc_area + 18, scrap_area);
+        Execute68k(proc_area, &r);   // Our PutScrap() records it like any other
+        r.a[0] = proc_area;
+        Execute68kTrap(0xa01f, &r);     // DisposePtr()
+    }
+    r.a[0] = scrap_area;
+    Execute68kTrap(0xa01f, &r);         // DisposePtr()
+}
+
+
+/*
+ *  ZeroScrap() is called before a Mac application writes to the clipboard; clears out the previous contents
+ */
+
+void ZeroScrap()
+{
+    D(bug("ZeroScrap\n"));
+}
+
+
+/*
+ *  Mac application wrote to clipboard
+ */
+
+void PutScrap(uint32 type, void *scrap, int32 length)
+{
+    D(bug("PutScrap type %08lx, data %p, length %ld\n", type, scrap, length));
+    if (clip_lock == NULL || length <= 0 || length > CLIP_MAX_SCRAP) {
+        return;
+    }
+    int slot = slot_index(type);
+    if (slot < 0) {
+        return;
+    }
+
+    // Only a copy here; conversion waits until a client asks for it
+    xSemaphoreTake(clip_lock, portMAX_DELAY);
+    uint16 count = ReadMacInt16(LM_SCRAP_COUNT);
+    if (count != mac_scrap_count) {
+        // ZeroScrap() since the last call, the other types are stale
+        for (int i = 0; i < SLOT_COUNT; i++) {
+            mac_scrap[i].length = 0;
+        }
+        mac_scrap_count = count;
+        mac_scrap_seq++;
+    }
+    if (slot_reserve(mac_scrap[slot], length)) {
+        memcpy(mac_scrap[slot].data, scrap, length);
+        mac_scrap[slot].length = length;
+    }
+    xSemaphoreGive(clip_lock);
+}
@@ -41,6 +41,9 @@ using std::vector;
 #include "sys.h"
 #include "prefs.h"
 #include "disk.h"
+#include "snapshot.h"
+#include "replay_esp32.h"
+#include "boot_timeline_esp32.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -124,31 +127,50 @@ static drive_vec::iterator get_drive_info(int num)
  *  (0 = no partition map or HFS partition found, assume flat disk image)
  */
 
+const int PARTITION_MAP_BLOCKS = 64;	// Blocks searched for the partition map
+
+// Partition map block for an Apple HFS partition? Then set start_byte/num_blocks
+static bool hfs_partition_entry(const uint8 *map, disk_drive_info &info)
+{
+	uint16 sig = (map[0] << 8) | map[1];
+	if (sig != 0x504d || strncmp((const char *)(map + 48), "Apple_HFS", 32) != 0)
+		return false;
+	info.start_byte = (loff_t)((map[8] << 24) | (map[9] << 16) | (map[10] << 8) | map[11]) << 9;
+	info.num_blocks = (map[12] << 24) | (map[13] << 16) | (map[14] << 8) | map[15];
+	D(bug(" HFS partition found at %d, %d blocks\n", info.start_byte, info.num_blocks));
+	return true;
+}
+
 static void find_hfs_partition(disk_drive_info &info)
 {
 	info.start_byte = 0;
 	info.num_blocks = 0;
-	uint8 *map = new uint8[512];
 
-	// Search first 64 blocks for HFS partition
-	for (int i=0; i<64; i++) {
-		if (Sys_read(info.fh, map, i * 512, 512) != 512)
-			break;
-
-		// Not a partition map block? Then look at next block
-		uint16 sig = (map[0] << 8) | map[1];
-		if (sig != 0x504d)
-			continue;
+	// Where it was last time: check just that entry, or that there is
+	// still no driver descriptor and partition map in blocks 0 and 1
+	int last = Sys_hfs_partition_block(info.fh);
+	if (last >= 0) {
+		uint8 block[1024];
+		if (last > 0 && Sys_read(info.fh, block, last * 512, 512) == 512 && hfs_partition_entry(block, info))
+			return;
+		if (last == 0 && Sys_read(info.fh, block, 0, 1024) == 1024
+		 && ((block[0] << 8) | block[1]) != 0x4552 && ((block[512] << 8) | block[513]) != 0x504d)
+			return;
+	}
 
-		// Partition map block found, Apple HFS partition?
-		if (strcmp((char *)(map + 48), "Apple_HFS") == 0) {
-			info.start_byte = (loff_t)((map[8] << 24) | (map[9] << 16) | (map[10] << 8) | map[11]) << 9;
-			info.num_blocks = (map[12] << 24) | (map[13] << 16) | (map[14] << 8) | map[15];
-			D(bug(" HFS partition found at %d, %d blocks\n", info.start_byte, info.num_blocks));
+	// Search first 64 blocks for HFS partition, read in one go
+	uint8 *map = new uint8[PARTITION_MAP_BLOCKS * 512];
+	int blocks = Sys_read(info.fh, map, 0, PARTITION_MAP_BLOCKS * 512) / 512;
+	int found = 0;
+	for (int i=0; i<blocks; i++) {
+		if (hfs_partition_entry(map + i * 512, info)) {
+			found = i;
 			break;
 		}
 	}
 	delete[] map;
+	if (blocks > 0)
+		Sys_set_hfs_partition_block(info.fh, found);
 }
 
 
@@ -202,6 +224,28 @@ void DiskExit(void)
 }
 
 
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the driver state (the drives come from the prefs, which
+ *  the snapshot was checked against)
+ */
+
+bool DiskSnapshot(void)
+{
+	uint32 count = drives.size();
+	if (!SnapshotVar(count) || count != drives.size() || !SnapshotVar(acc_run_called))
+		return false;
+	drive_vec::iterator info, end = drives.end();
+	for (info = drives.begin(); info != end; ++info) {
+		if (!SnapshotVar(info->num) || !SnapshotVar(info->start_byte) || !SnapshotVar(info->num_blocks)
+		 || !SnapshotVar(info->to_be_mounted) || !SnapshotVar(info->status))
+			return false;
+	}
+	return true;
+}
+#endif
+
+
 /*
  *  Disk was inserted, flag for mounting
  */
@@ -219,6 +263,7 @@ bool DiskMountVolume(void *fh)
 			find_hfs_partition(*info);
 			if (info->start_byte == 0)
 				info->num_blocks = uint32(SysGetFileSize(info->fh) / 512);
+			Sys_set_hfs_volume(info->fh, info->start_byte);
 			WriteMacInt16(info->status + dsDriveSize, info->num_blocks & 0xffff);
 			WriteMacInt16(info->status + dsDriveS1, info->num_blocks >> 16);
 			info->to_be_mounted = true;
@@ -255,6 +300,9 @@ static void mount_mountable_volumes(void)
 			r.a[0] = 7;	// diskEvent
 			Execute68kTrap(0xa02f, &r);		// PostEvent()
 			info->to_be_mounted = false;
+#if BOOT_TIMELINE
+			BootMark(BOOT_PHASE_MOUNT);
+#endif
 		}
 	}
 }
@@ -328,6 +376,55 @@ int16 DiskOpen(uint32 pb, uint32 dce)
  *  Driver Prime() routine
  */
 
+#if SYS_ASYNC_IO
+// Asynchronous Prime() in progress (the Device Manager hands the driver one
+// request at a time)
+static struct {
+	sys_async_req io;
+	uint32 pb, dce;
+	bool busy;
+} async_prime;
+
+/*
+ *  Complete a finished asynchronous Prime() through IODone, which also
+ *  starts the next queued request
+ */
+
+static void complete_async_prime(void)
+{
+	if (!async_prime.busy)
+		return;
+#if REPLAY
+	if (!ReplayIODone(&async_prime.io.done))
+#else
+	if (!__atomic_load_n(&async_prime.io.done, __ATOMIC_ACQUIRE))
+#endif
+		return;
+	async_prime.busy = false;
+
+	uint32 pb = async_prime.pb, dce = async_prime.dce;
+	size_t actual = async_prime.io.actual;
+	int16 result = noErr;
+	if (actual != async_prime.io.length)
+		result = async_prime.io.write ? writErr : readErr;
+	else {
+		WriteMacInt32(pb + ioActCount, actual);
+		WriteMacInt32(dce + dCtlPosition, ReadMacInt32(dce + dCtlPosition) + actual);
+	}
+	if (!async_prime.io.write && actual > 0) {
+		// Filled on Core 0 after the copies were last refreshed
+		ram_copy_host_write(Host2MacAddr((uint8 *)async_prime.io.buffer));
+		FlushCodeCache(async_prime.io.buffer, actual);
+	}
+
+	M68kRegisters r;
+	r.d[0] = (uint32)(int32)result;
+	r.a[0] = pb;
+	r.a[1] = dce;
+	Execute68k(ReadMacInt32(0x8fc), &r);	// JIODone
+}
+#endif
+
 int16 DiskPrime(uint32 pb, uint32 dce)
 {
 	WriteMacInt32(pb + ioActCount, 0);
@@ -348,6 +445,28 @@ int16 DiskPrime(uint32 pb, uint32 dce)
 	if ((length & 0x1ff) || (position & 0x1ff))
 		return paramErr;
 
+#if SYS_ASYNC_IO
+	// Asynchronous call: start the transfer and return with the request
+	// pending (IOReturn leaves ioResult alone for d0 > 0)
+	uint16 trap = ReadMacInt16(pb + ioTrap);
+	if ((trap & (1 << asyncTrpBit)) && !(trap & (1 << noQueueBit)) && !async_prime.busy) {
+		bool write = (trap & 0xff) != aRdCmd;
+		if (write && info->read_only)
+			return wPrErr;
+		async_prime.io.fh = info->fh;
+		async_prime.io.buffer = buffer;
+		async_prime.io.offset = position + info->start_byte;
+		async_prime.io.length = length;
+		async_prime.io.write = write;
+		async_prime.pb = pb;
+		async_prime.dce = dce;
+		async_prime.busy = true;
+		if (Sys_async_submit(&async_prime.io))
+			return 1;
+		async_prime.busy = false;
+	}
+#endif
+
 	size_t actual = 0;
 	if ((ReadMacInt16(pb + ioTrap) & 0xff) == aRdCmd) {
 
@@ -552,11 +671,16 @@ int16 DiskStatus(uint32 pb, uint32 dce)
 
 
 /*
- *  Driver interrupt routine (1Hz) - check for volumes to be mounted
+ *  Driver interrupt routine (1Hz and INTFLAG_DISK) - complete asynchronous
+ *  I/O, check for volumes to be mounted
  */
 
 void DiskInterrupt(void)
 {
+#if SYS_ASYNC_IO
+	complete_async_prime();
+#endif
+
 	if (!acc_run_called)
 		return;
 
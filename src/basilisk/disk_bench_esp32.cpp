@@ -0,0 +1,231 @@
+/*
+ *  disk_bench_esp32.cpp - Sys_read()/Sys_write() benchmark
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Times the disk layer the Mac drivers use, on the first "disk" image as
+ *  it sits on the card: sequential and random reads and writes of 512 B,
+ *  4 KB, 32 KB and 128 KB, each once through the block cache (started
+ *  cold) and once straight to the card, then a replay of the image's boot
+ *  trace in recorded order. Throughput includes the write-back of cached
+ *  writes; latencies are per request. The numbers are a baseline for the
+ *  SD bus mode, cache size and read-ahead, and a card that can't keep up
+ *  is reported as such.
+ *
+ *  Writes put back the data just read from the same place, so the image
+ *  is left as it was; read-only images get the read tests only.
+ */
+
+#include "sysdeps.h"
+#include "prefs.h"
+#include "sys.h"
+#include "disk_bench_esp32.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define BENCH_MAX_REQUESTS      1024            // Requests per test, at most
+#define BENCH_READ_BYTES        (4 * 1024 * 1024)   // Per read test, at most
+#define BENCH_WRITE_BYTES       (1024 * 1024)   // Per write test (the saved data), at most
+#define BENCH_MAX_REQUEST       (128 * 1024)
+#define BENCH_LINE_SIZE         4096            // Boot trace block size (sys_esp32.cpp's CACHE_LINE_SIZE)
+
+// Below these the card holds Mac OS up (direct sequential 128 KB reads,
+// direct random 4 KB read p99)
+#define BENCH_MIN_SEQ_KBS       2048
+#define BENCH_MAX_RANDOM_US     20000
+
+static const uint32 bench_sizes[] = { 512, 4096, 32768, 131072 };
+
+static uint32 latency_us[BENCH_MAX_REQUESTS];
+static uint32 bench_seed;
+
+static uint32 bench_random(void)
+{
+    bench_seed = bench_seed * 1664525 + 1013904223;
+    return bench_seed;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Where request i of a test goes
+static loff_t request_offset(bool random, int i, uint32 size, loff_t disk_size)
+{
+    if (!random) {
+        return (loff_t)i * size;
+    }
+    uint64 slots = (uint64)disk_size / size;
+    uint64 r = ((uint64)bench_random() << 32) | bench_random();
+    return (loff_t)(r % slots) * size;
+}
+
+/*
+ *  Print one test: throughput over total_us, latency percentiles; returns
+ *  the p99 latency
+ */
+static uint32 report(const char *mode, const char *test, uint32 size, int n, uint64 total_us)
+{
+    qsort(latency_us, n, sizeof(latency_us[0]), compare_u32);
+    uint32 kbs = total_us ? (uint32)((uint64)n * size * 1000000 / 1024 / total_us) : 0;
+    uint32 p99 = latency_us[n * 99 / 100];
+    Serial.printf("[DISK BENCH] %-6s %-10s %6u B  %4d req  %6u KB/s  p50 %6u us  p99 %6u us  max %6u us\n",
+                  mode, test, (unsigned)size, n, (unsigned)kbs,
+                  (unsigned)latency_us[n / 2], (unsigned)p99, (unsigned)latency_us[n - 1]);
+    return p99;
+}
+
+/*
+ *  Read test; returns the throughput in KB/s, *p99 the latency
+ */
+static uint32 read_test(void *fh, bool cached, bool random, uint32 size, loff_t disk_size,
+                        uint8 *buffer, uint32 *p99)
+{
+    int n = BENCH_READ_BYTES / size;
+    if (n > BENCH_MAX_REQUESTS) n = BENCH_MAX_REQUESTS;
+    if ((loff_t)n * size > disk_size) n = disk_size / size;
+    if (n <= 0) return 0;
+
+    Sys_set_cached(fh, cached);
+    bench_seed = size;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < n; i++) {
+        loff_t offset = request_offset(random, i, size, disk_size);
+        int64_t t = esp_timer_get_time();
+        Sys_read(fh, buffer, offset, size);
+        latency_us[i] = (uint32)(esp_timer_get_time() - t);
+    }
+    uint64 total = esp_timer_get_time() - start;
+    *p99 = report(cached ? "cached" : "direct", random ? "rand-read" : "seq-read", size, n, total);
+    return total ? (uint32)((uint64)n * size * 1000000 / 1024 / total) : 0;
+}
+
+/*
+ *  Write test: the data is read first (straight from the card), then
+ *  written back unchanged; the cached run includes its write-back
+ */
+static void write_test(void *fh, bool cached, bool random, uint32 size, loff_t disk_size, uint8 *saved)
+{
+    int n = BENCH_WRITE_BYTES / size;
+    if (n > BENCH_MAX_REQUESTS) n = BENCH_MAX_REQUESTS;
+    if ((loff_t)n * size > disk_size) n = disk_size / size;
+    if (n <= 0) return;
+    static loff_t offsets[BENCH_MAX_REQUESTS];
+
+    Sys_set_cached(fh, false);
+    bench_seed = size * 3;
+    for (int i = 0; i < n; i++) {
+        offsets[i] = request_offset(random, i, size, disk_size);
+        if (Sys_read(fh, saved + i * size, offsets[i], size) != size) {
+            Serial.printf("[DISK BENCH] Read at %lld failed, write test skipped\n", (long long)offsets[i]);
+            return;
+        }
+    }
+
+    Sys_set_cached(fh, cached);
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < n; i++) {
+        int64_t t = esp_timer_get_time();
+        Sys_write(fh, saved + i * size, offsets[i], size);
+        latency_us[i] = (uint32)(esp_timer_get_time() - t);
+    }
+    Sys_set_cached(fh, cached);     // Writes the cached lines back
+    uint64 total = esp_timer_get_time() - start;
+    report(cached ? "cached" : "direct", random ? "rand-write" : "seq-write", size, n, total);
+}
+
+/*
+ *  Read the boot trace's runs in the order Mac OS read them
+ */
+static void trace_test(void *fh, bool cached, const uint32 *runs, int nruns, loff_t disk_size, uint8 *buffer)
+{
+    Sys_set_cached(fh, cached);
+    uint64 bytes = 0;
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < nruns; i++) {
+        loff_t offset = (loff_t)runs[i * 2] * BENCH_LINE_SIZE;
+        loff_t end = offset + (loff_t)runs[i * 2 + 1] * BENCH_LINE_SIZE;
+        if (end > disk_size) end = disk_size;
+        while (offset < end) {
+            size_t n = end - offset < BENCH_MAX_REQUEST ? (size_t)(end - offset) : BENCH_MAX_REQUEST;
+            bytes += Sys_read(fh, buffer, offset, n);
+            offset += n;
+        }
+    }
+    uint64 total = esp_timer_get_time() - start;
+    Serial.printf("[DISK BENCH] %-6s boot trace: %d runs, %u KB in %u ms, %u KB/s\n",
+                  cached ? "cached" : "direct", nruns, (unsigned)(bytes / 1024), (unsigned)(total / 1000),
+                  total ? (unsigned)(bytes * 1000000 / 1024 / total) : 0);
+}
+
+void DiskBenchRun(void)
+{
+    const char *path = PrefsFindString("disk", 0);
+    if (!path) {
+        Serial.println("[DISK BENCH] No disk image configured");
+        return;
+    }
+    void *fh = Sys_open(path, false, false);
+    if (!fh) {
+        Serial.printf("[DISK BENCH] Cannot open %s\n", path);
+        return;
+    }
+    loff_t disk_size = SysGetFileSize(fh);
+    bool writable = !SysIsReadOnly(fh);
+    uint8 *buffer = (uint8 *)ps_malloc(BENCH_MAX_REQUEST);
+    uint8 *saved = writable ? (uint8 *)ps_malloc(BENCH_WRITE_BYTES) : NULL;
+    if (!buffer || (writable && !saved)) {
+        Serial.println("[DISK BENCH] Not enough PSRAM");
+        free(buffer);
+        free(saved);
+        Sys_close(fh);
+        return;
+    }
+
+    Serial.printf("[DISK BENCH] %s: %lld KB%s\n", path, (long long)(disk_size / 1024),
+                  writable ? "" : ", read-only (no write tests)");
+    int64_t bench_start = esp_timer_get_time();
+
+    uint32 seq_kbs = 0, random_p99 = 0;
+    for (int cached = 1; cached >= 0; cached--) {
+        for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+            uint32 size = bench_sizes[s];
+            uint32 p99 = 0;
+            uint32 kbs = read_test(fh, cached, false, size, disk_size, buffer, &p99);
+            if (!cached && size == BENCH_MAX_REQUEST) seq_kbs = kbs;
+            read_test(fh, cached, true, size, disk_size, buffer, &p99);
+            if (!cached && size == 4096) random_p99 = p99;
+            if (writable) {
+                write_test(fh, cached, false, size, disk_size, saved);
+                write_test(fh, cached, true, size, disk_size, saved);
+            }
+            vTaskDelay(1);
+        }
+    }
+
+    int nruns;
+    uint32 *runs = Sys_load_boot_trace(fh, &nruns);
+    if (runs) {
+        trace_test(fh, true, runs, nruns, disk_size, buffer);
+        trace_test(fh, false, runs, nruns, disk_size, buffer);
+        free(runs);
+    } else {
+        Serial.printf("[DISK BENCH] No boot trace for %s yet (boot once to record it)\n", path);
+    }
+
+    if (seq_kbs < BENCH_MIN_SEQ_KBS || random_p99 > BENCH_MAX_RANDOM_US) {
+        Serial.printf("[DISK BENCH] WARNING: this card is too slow (%u KB/s sequential, %u us random 4 KB p99; "
+                      "want %u KB/s, %u us)\n", (unsigned)seq_kbs, (unsigned)random_p99,
+                      BENCH_MIN_SEQ_KBS, BENCH_MAX_RANDOM_US);
+    }
+    Serial.printf("[DISK BENCH] done in %u ms\n", (unsigned)((esp_timer_get_time() - bench_start) / 1000));
+
+    Sys_set_cached(fh, true);
+    free(buffer);
+    free(saved);
+    Sys_close(fh);
+}
@@ -0,0 +1,22 @@
+/*
+ *  disk_bench_esp32.h - Sys_read()/Sys_write() benchmark
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef DISK_BENCH_ESP32_H
+#define DISK_BENCH_ESP32_H
+
+#ifndef DISK_BENCH
+#define DISK_BENCH 0
+#endif
+
+/*
+ *  Measure sequential and random reads and writes of 512 B to 128 KB,
+ *  through the block cache and straight to the card, and replay the image's
+ *  boot trace, on the first "disk" image. Call before the disk drivers open
+ *  it; prints "[DISK BENCH]" lines.
+ */
+extern void DiskBenchRun(void);
+
+#endif /* DISK_BENCH_ESP32_H */
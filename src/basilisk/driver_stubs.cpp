@@ -11,133 +11,53 @@
 #include "cpu_emulation.h"
 #include "main.h"
 #include "macos_util.h"
-#include "scsi.h"
-#include "serial.h"
-#include "ether.h"
-#include "audio.h"
 #include "user_strings.h"
+#include "esp_timer.h"
+#include "replay_esp32.h"
+
+#if TIMER_EMULATED_CYCLES && !USE_CYCLE_STATS
+#error "TIMER_EMULATED_CYCLES needs USE_CYCLE_STATS=1"
+#endif
+#ifndef EMULATED_CPU_MHZ
+#define EMULATED_CPU_MHZ 33     // Quadra 650
+#endif
+
+// Unix time the Mac clock starts from instead of the system clock, 0 = use
+// the system clock (the host build sets one, so that its runs repeat)
+#ifndef TIMER_START_DATE
+#define TIMER_START_DATE 0
+#endif
 
 /*
  * Global tick inhibit flag (referenced by emul_op.cpp)
  */
 bool tick_inhibit = false;
 
-/*
- * SCSI driver stubs
- */
-
-int16 SCSIReset(void) { return noErr; }
-int16 SCSIGet(void) { return noErr; }
-int16 SCSISelect(int id) { (void)id; return noErr; }
-int16 SCSICmd(int len, uint8 *cmd) { (void)len; (void)cmd; return noErr; }
-int16 SCSIRead(uint32 tib) { (void)tib; return noErr; }
-int16 SCSIWrite(uint32 tib) { (void)tib; return noErr; }
-int16 SCSIComplete(uint32 stat, uint32 msg, uint32 ticks) { (void)stat; (void)msg; (void)ticks; return noErr; }
-uint16 SCSIStat(void) { return 0; }  // Return 0 = bus free
-int16 SCSIMsgIn(void) { return 0; }
-int16 SCSIMsgOut(void) { return noErr; }
-int16 SCSIMgrBusy(void) { return 0; }  // Return 0 = not busy
-
-/*
- * Serial driver stubs
- */
-
-// Dummy serial port object
-class DummySERDPort : public SERDPort {
-public:
-    DummySERDPort() : SERDPort() {}
-    virtual ~DummySERDPort() {}
-    
-    virtual int16 open(uint16 config) { (void)config; return noErr; }
-    virtual int16 prime_in(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-    virtual int16 prime_out(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-    virtual int16 control(uint32 pb, uint32 dce, uint16 code) { (void)pb; (void)dce; (void)code; return noErr; }
-    virtual int16 status(uint32 pb, uint32 dce, uint16 code) { (void)pb; (void)dce; (void)code; return noErr; }
-    virtual int16 close(void) { return noErr; }
-};
-
-// Create dummy port instances
-static DummySERDPort dummy_port_a;
-static DummySERDPort dummy_port_b;
-
-// The serial port instance (referenced by serial_dummy.cpp)
-SERDPort *the_serd_port[2] = { &dummy_port_a, &dummy_port_b };
-
-void SerialInit(void) {}
-void SerialExit(void) {}
-int16 SerialOpen(uint32 pb, uint32 dce, int port) { (void)pb; (void)dce; (void)port; return noErr; }
-int16 SerialPrime(uint32 pb, uint32 dce, int port) { (void)pb; (void)dce; (void)port; return noErr; }
-int16 SerialControl(uint32 pb, uint32 dce, int port) { (void)pb; (void)dce; (void)port; return noErr; }
-int16 SerialStatus(uint32 pb, uint32 dce, int port) { (void)pb; (void)dce; (void)port; return noErr; }
-int16 SerialClose(uint32 pb, uint32 dce, int port) { (void)pb; (void)dce; (void)port; return noErr; }
-void SerialInterrupt(void) {}
-
-/*
- * Ethernet driver stubs
- */
-
-void EtherInit(void) {}
-void EtherExit(void) {}
-void EtherReset(void) {}
-void EtherInterrupt(void) {}
-int16 EtherOpen(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-int16 EtherControl(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-void EtherReadPacket(uint32 &src, uint32 &dest, uint32 &len, uint32 &remaining) {
-    (void)src; (void)dest; (void)len; (void)remaining;
-}
-
-/*
- * Audio driver stubs
- */
-
-#include <vector>
-
-uint32 audio_component_flags = 0;
-bool audio_open = false;
-std::vector<uint32> audio_sample_rates;
-std::vector<uint16> audio_sample_sizes;
-std::vector<uint8> audio_channel_counts;
-
-// Audio status structure - defined in audio.h as struct audio_status
-struct audio_status AudioStatus = { 0, 0, 0, 0, 0 };
-
-void AudioInit(void) {
-    audio_open = false;
-    audio_sample_rates.clear();
-    audio_sample_rates.push_back(22050 << 16);  // 16.16 fixed point
-    audio_sample_rates.push_back(44100 << 16);
-    audio_sample_sizes.clear();
-    audio_sample_sizes.push_back(8);
-    audio_sample_sizes.push_back(16);
-    audio_channel_counts.clear();
-    audio_channel_counts.push_back(1);
-    audio_channel_counts.push_back(2);
-    AudioStatus.sample_rate = 44100 << 16;
-    AudioStatus.sample_size = 16;
-    AudioStatus.channels = 2;
-    AudioStatus.mixer = 0;
-    AudioStatus.num_sources = 0;
-}
-void AudioExit(void) { audio_open = false; }
-void AudioReset(void) { audio_open = false; }
-void AudioInterrupt(void) {}
-int32 AudioDispatch(uint32 params, uint32 ti) { (void)params; (void)ti; return noErr; }
-int16 SoundInOpen(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-int16 SoundInPrime(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-int16 SoundInControl(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-int16 SoundInStatus(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-int16 SoundInClose(uint32 pb, uint32 dce) { (void)pb; (void)dce; return noErr; }
-
 /*
  * Timer functions - ESP32 implementation
  */
 
 // Get current time in microseconds
+// With TIMER_EMULATED_CYCLES the Time Manager follows the estimated 68040
+// cycle count instead of the host clock, so timed tasks keep their spacing
+// relative to emulated work when the emulator runs slower or faster than
+// a real EMULATED_CPU_MHZ machine
+#if USE_CYCLE_STATS && TIMER_EMULATED_CYCLES
 void timer_current_time(uint64 &time) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    time = (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+    time = Get68kCycles() / EMULATED_CPU_MHZ;
+#if REPLAY
+    time = ReplayInput(REPLAY_TIMER, time);
+#endif
 }
+#else
+// Same monotonic clock that the PRECISE_TIMING wakeup timer runs on
+void timer_current_time(uint64 &time) {
+    time = (uint64)esp_timer_get_time();
+#if REPLAY
+    time = ReplayInput(REPLAY_TIMER, time);
+#endif
+}
+#endif
 
 // Build date/time as base for Mac clock
 // ESP32 doesn't have RTC, so we use build time as the starting point
@@ -185,12 +105,16 @@ static time_t get_build_timestamp(void) {
     return build_time;
 }
 
-// Return current date/time as Mac seconds since 1904
-uint32 TimerDateTime(void) {
+// Current date/time as Mac seconds since 1904
+static uint32 host_date_time(void) {
     // Mac epoch is Jan 1, 1904
     // Unix epoch is Jan 1, 1970
     // Difference is 2082844800 seconds
     
+#if TIMER_START_DATE
+    return (uint32)(TIMER_START_DATE + millis() / 1000 + 2082844800UL);
+#endif
+    
     // Get time from ESP32 - if not set via NTP, use build time as base
     time_t t = time(NULL);
     
@@ -213,11 +137,23 @@ uint32 TimerDateTime(void) {
     return (uint32)(t + 2082844800UL);
 }
 
+// Return current date/time as Mac seconds since 1904
+uint32 TimerDateTime(void) {
+#if REPLAY
+    return (uint32)ReplayInput(REPLAY_DATE, host_date_time());
+#else
+    return host_date_time();
+#endif
+}
+
 // Return microsecond counter (split into hi/lo 32-bit parts)
+// On the monotonic clock the Time Manager uses; the time of day jumps
+// when it is set
 void Microseconds(uint32 &hi, uint32 &lo) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64 us = (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+    uint64 us = (uint64)esp_timer_get_time();
+#if REPLAY
+    us = ReplayInput(REPLAY_MICROS, us);
+#endif
     hi = (uint32)(us >> 32);
     lo = (uint32)(us & 0xFFFFFFFF);
 }
@@ -259,26 +195,6 @@ int32 timer_host2mac_time(uint64 hosttime) {
     }
 }
 
-/*
- * Clipboard driver stubs
- */
-
-void ClipInit(void) {}
-void ClipExit(void) {}
-void GetScrap(void **handle, uint32 type, int32 offset) { 
-    (void)handle; (void)type; (void)offset;
-}
-void PutScrap(uint32 type, void *data, int32 length) {
-    (void)type; (void)data; (void)length;
-}
-
-/*
- * SCSI Init/Exit stubs
- */
-
-void SCSIInit(void) {}
-void SCSIExit(void) {}
-
 /*
  * User string lookup
  */
@@ -0,0 +1,246 @@
+/*
+ *  dskz_esp32.cpp - Chunked disk image (.dskz) backend for ESP32
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Serves a disk image stored as fixed-size chunks (see dskz_format.h):
+ *  absent chunks read as zeros, raw chunks are passed through, and LZ4
+ *  chunks are decompressed into a one-chunk buffer. Sequential reads
+ *  arrive through the block cache read-ahead, so most decompression runs
+ *  on the Core 0 disk I/O task. Writes to absent or compressed chunks
+ *  copy the chunk to the end of the file first.
+ *
+ *  The caller serialises access (sys_esp32.cpp holds io_lock).
+ */
+
+#include "sysdeps.h"
+#include "dskz_esp32.h"
+#include "dskz_format.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+struct dskz_image {
+    dskz_backing b;
+    dskz_header hdr;
+    dskz_chunk *index;      // chunk_count entries, PSRAM
+    uint8 *chunk_buf;       // Decompressed chunk "cached", PSRAM
+    uint8 *stored_buf;      // Compressed chunk as read, PSRAM
+    int32 cached;           // Chunk in chunk_buf, -1 = none
+    uint64 file_size;
+    bool read_only;
+};
+
+static void free_image(dskz_image *img)
+{
+    free(img->index);
+    free(img->chunk_buf);
+    free(img->stored_buf);
+    delete img;
+}
+
+/*
+ *  Open an image and load its index
+ */
+dskz_image *DSKZOpen(const dskz_backing *backing, uint64 file_size, bool read_only, bool *is_dskz)
+{
+    *is_dskz = false;
+    
+    dskz_header hdr;
+    if (file_size < DSKZ_HEADER_SIZE ||
+        backing->read(backing->ctx, (uint8 *)&hdr, 0, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, DSKZ_MAGIC, sizeof(hdr.magic)) != 0) {
+        return NULL;
+    }
+    *is_dskz = true;
+    
+    uint32 cs = hdr.chunk_size;
+    uint64 index_bytes = (uint64)hdr.chunk_count * sizeof(dskz_chunk);
+    if (hdr.version != DSKZ_VERSION || cs < DSKZ_MIN_CHUNK || cs > DSKZ_MAX_CHUNK || (cs & (cs - 1)) ||
+        hdr.chunk_count != (hdr.logical_size + cs - 1) / cs ||
+        hdr.index_offset < DSKZ_HEADER_SIZE || hdr.index_offset + index_bytes > file_size) {
+        Serial.println("[DSKZ] ERROR: bad header");
+        return NULL;
+    }
+    
+    dskz_image *img = new dskz_image;
+    img->b = *backing;
+    img->hdr = hdr;
+    img->index = (dskz_chunk *)ps_malloc(index_bytes);
+    img->chunk_buf = (uint8 *)ps_malloc(cs);
+    img->stored_buf = (uint8 *)ps_malloc(cs);
+    img->cached = -1;
+    img->file_size = file_size;
+    img->read_only = read_only;
+    if (!img->index || !img->chunk_buf || !img->stored_buf) {
+        Serial.println("[DSKZ] ERROR: out of memory");
+        free_image(img);
+        return NULL;
+    }
+    
+    if (backing->read(backing->ctx, (uint8 *)img->index, hdr.index_offset, index_bytes) != index_bytes) {
+        Serial.println("[DSKZ] ERROR: cannot read index");
+        free_image(img);
+        return NULL;
+    }
+    
+    uint32 counts[3] = {0, 0, 0};
+    for (uint32 i = 0; i < hdr.chunk_count; i++) {
+        const dskz_chunk *c = &img->index[i];
+        bool ok;
+        switch (c->type) {
+            case DSKZ_CHUNK_ZERO:
+                ok = true;
+                break;
+            case DSKZ_CHUNK_RAW:
+                ok = c->length == cs && c->offset + cs <= file_size;
+                break;
+            case DSKZ_CHUNK_LZ4:
+                ok = c->length > 0 && c->length <= cs && c->offset + c->length <= file_size;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            Serial.printf("[DSKZ] ERROR: bad index entry %u\n", i);
+            free_image(img);
+            return NULL;
+        }
+        counts[c->type]++;
+    }
+    
+    Serial.printf("[DSKZ] %llu KB in %u x %u KB chunks: %u zero, %u raw, %u lz4\n",
+                  (unsigned long long)(hdr.logical_size / 1024), hdr.chunk_count, cs / 1024,
+                  counts[DSKZ_CHUNK_ZERO], counts[DSKZ_CHUNK_RAW], counts[DSKZ_CHUNK_LZ4]);
+    return img;
+}
+
+void DSKZClose(dskz_image *img)
+{
+    if (img) free_image(img);
+}
+
+uint64 DSKZSize(dskz_image *img)
+{
+    return img->hdr.logical_size;
+}
+
+/*
+ *  Make chunk_buf hold chunk i
+ */
+static bool load_chunk(dskz_image *img, uint32 i)
+{
+    if (img->cached == (int32)i) return true;
+    
+    const dskz_chunk *c = &img->index[i];
+    uint32 cs = img->hdr.chunk_size;
+    img->cached = -1;
+    switch (c->type) {
+        case DSKZ_CHUNK_ZERO:
+            memset(img->chunk_buf, 0, cs);
+            break;
+        case DSKZ_CHUNK_RAW:
+            if (img->b.read(img->b.ctx, img->chunk_buf, c->offset, cs) != cs) return false;
+            break;
+        case DSKZ_CHUNK_LZ4: {
+            if (img->b.read(img->b.ctx, img->stored_buf, c->offset, c->length) != c->length) return false;
+            int n = dskz_lz4_decompress(img->stored_buf, c->length, img->chunk_buf, cs);
+            if (n < 0) {
+                Serial.printf("[DSKZ] ERROR: chunk %u is corrupt\n", i);
+                return false;
+            }
+            if ((uint32)n < cs) memset(img->chunk_buf + n, 0, cs - n);
+            break;
+        }
+    }
+    img->cached = i;
+    return true;
+}
+
+/*
+ *  Read bytes of the disk
+ */
+size_t DSKZRead(dskz_image *img, uint8 *dst, uint64 offset, size_t length)
+{
+    uint64 size = img->hdr.logical_size;
+    if (offset >= size) return 0;
+    if (offset + length > size) length = size - offset;
+    
+    uint32 cs = img->hdr.chunk_size;
+    size_t done = 0;
+    while (done < length) {
+        uint32 i = (uint32)(offset / cs);
+        uint32 in_chunk = (uint32)(offset % cs);
+        size_t n = cs - in_chunk;
+        if (n > length - done) n = length - done;
+        
+        const dskz_chunk *c = &img->index[i];
+        if (c->type == DSKZ_CHUNK_ZERO) {
+            memset(dst, 0, n);
+        } else if (c->type == DSKZ_CHUNK_RAW) {
+            if (img->b.read(img->b.ctx, dst, c->offset + in_chunk, n) != n) break;
+        } else {
+            if (!load_chunk(img, i)) break;
+            memcpy(dst, img->chunk_buf + in_chunk, n);
+        }
+        dst += n;
+        offset += n;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ *  Turn chunk i into a raw chunk at the end of the log
+ */
+static bool copy_on_write(dskz_image *img, uint32 i)
+{
+    uint32 cs = img->hdr.chunk_size;
+    if (!load_chunk(img, i)) return false;
+    
+    // Chunk data, then the header with the new log end, then the index
+    // entry: until the entry is written the old chunk stays in use
+    uint64 pos = (img->hdr.log_end + 511) & ~(uint64)511;
+    if (img->b.write(img->b.ctx, img->chunk_buf, pos, cs) != cs) return false;
+    if (pos + cs > img->file_size) img->file_size = pos + cs;
+    
+    img->hdr.log_end = pos + cs;
+    if (img->b.write(img->b.ctx, (const uint8 *)&img->hdr, 0, sizeof(img->hdr)) != sizeof(img->hdr)) return false;
+    
+    dskz_chunk c;
+    c.offset = pos;
+    c.length = cs;
+    c.type = DSKZ_CHUNK_RAW;
+    if (img->b.write(img->b.ctx, (const uint8 *)&c, img->hdr.index_offset + (uint64)i * sizeof(c), sizeof(c)) != sizeof(c)) return false;
+    img->index[i] = c;
+    
+    // Raw chunks are read and written in place from now on
+    img->cached = -1;
+    D(bug("[DSKZ] chunk %u copied to %llu\n", i, (unsigned long long)pos));
+    return true;
+}
+
+/*
+ *  Write bytes of the disk
+ */
+size_t DSKZWrite(dskz_image *img, const uint8 *src, uint64 offset, size_t length)
+{
+    if (img->read_only || offset + length > img->hdr.logical_size) return 0;
+    
+    uint32 cs = img->hdr.chunk_size;
+    size_t done = 0;
+    while (done < length) {
+        uint32 i = (uint32)(offset / cs);
+        uint32 in_chunk = (uint32)(offset % cs);
+        size_t n = cs - in_chunk;
+        if (n > length - done) n = length - done;
+        
+        if (img->index[i].type != DSKZ_CHUNK_RAW && !copy_on_write(img, i)) break;
+        if (img->b.write(img->b.ctx, src, img->index[i].offset + in_chunk, n) != n) break;
+        src += n;
+        offset += n;
+        done += n;
+    }
+    return done;
+}
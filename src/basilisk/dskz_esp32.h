@@ -0,0 +1,31 @@
+/*
+ *  dskz_esp32.h - Chunked disk image (.dskz) backend for ESP32
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef DSKZ_ESP32_H
+#define DSKZ_ESP32_H
+
+// Byte access to the file holding the image (sys_esp32.cpp)
+struct dskz_backing {
+    size_t (*read)(void *ctx, uint8 *dst, uint64 offset, size_t length);
+    size_t (*write)(void *ctx, const uint8 *src, uint64 offset, size_t length);
+    void *ctx;
+};
+
+struct dskz_image;
+
+// Open an image; *is_dskz tells a damaged .dskz (NULL, true) from a plain
+// image (NULL, false)
+extern dskz_image *DSKZOpen(const dskz_backing *backing, uint64 file_size, bool read_only, bool *is_dskz);
+extern void DSKZClose(dskz_image *img);
+
+// Size of the disk the image holds
+extern uint64 DSKZSize(dskz_image *img);
+
+// Transfer bytes of the disk, returns the count transferred
+extern size_t DSKZRead(dskz_image *img, uint8 *dst, uint64 offset, size_t length);
+extern size_t DSKZWrite(dskz_image *img, const uint8 *src, uint64 offset, size_t length);
+
+#endif /* DSKZ_ESP32_H */
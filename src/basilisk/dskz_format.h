@@ -0,0 +1,115 @@
+/*
+ *  dskz_format.h - Chunked disk image format (.dskz), shared by the
+ *  emulator (dskz_esp32.cpp) and the converter (tools/dskz/dskz.c)
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A .dskz file holds a disk image as fixed-size chunks:
+ *
+ *    header      64 bytes at offset 0 (dskz_header)
+ *    index       chunk_count dskz_chunk entries at index_offset
+ *    data        stored chunks, then the copy-on-write log up to log_end
+ *
+ *  A chunk is either absent (all zeros, nothing stored), stored raw, or
+ *  LZ4 block-compressed. Writes never modify a compressed or absent chunk
+ *  in place: the whole chunk is appended raw at log_end, then the header
+ *  (new log_end) and its index entry are updated, in that order, so an
+ *  interrupted write loses at most the new chunk. Raw chunks are written
+ *  in place. All fields are little-endian.
+ */
+
+#ifndef DSKZ_FORMAT_H
+#define DSKZ_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define DSKZ_MAGIC          "B2DSKZ\r\n"
+#define DSKZ_VERSION        1
+#define DSKZ_HEADER_SIZE    64
+#define DSKZ_MIN_CHUNK      4096
+#define DSKZ_MAX_CHUNK      (1024 * 1024)
+
+enum {
+    DSKZ_CHUNK_ZERO = 0,    // Not stored, reads as zeros
+    DSKZ_CHUNK_RAW = 1,     // chunk_size bytes at offset
+    DSKZ_CHUNK_LZ4 = 2      // LZ4 block of length bytes at offset
+};
+
+struct dskz_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;    // Power of 2, DSKZ_MIN_CHUNK..DSKZ_MAX_CHUNK
+    uint64_t logical_size;  // Size of the disk image
+    uint32_t chunk_count;
+    uint32_t reserved0;
+    uint64_t index_offset;
+    uint64_t log_end;       // Next free byte for copy-on-write chunks
+    uint8_t reserved[16];
+};
+
+struct dskz_chunk {
+    uint64_t offset;
+    uint32_t length;        // Stored bytes (chunk_size for raw chunks)
+    uint32_t type;
+};
+
+typedef char dskz_header_size_check[sizeof(struct dskz_header) == DSKZ_HEADER_SIZE ? 1 : -1];
+typedef char dskz_chunk_size_check[sizeof(struct dskz_chunk) == 16 ? 1 : -1];
+
+/*
+ *  Decompress an LZ4 block; returns the decompressed size or -1 if the
+ *  block is corrupt or would not fit in dst
+ */
+static inline int dskz_lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dst, *oend = dst + dst_cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        // Literals
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip >= iend) break;  // The last sequence has no match
+
+        // Match
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t len = token & 15;
+        if (len == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += 4;
+        if (len > (size_t)(oend - op)) return -1;
+        const uint8_t *m = op - off;
+        if (off >= len) {
+            memcpy(op, m, len);
+            op += len;
+        } else {
+            while (len--) *op++ = *m++;     // Overlapping run
+        }
+    }
+    return (int)(op - dst);
+}
+
+#endif /* DSKZ_FORMAT_H */
@@ -41,6 +41,8 @@
 #include "ether.h"
 #include "extfs.h"
 #include "emul_op.h"
+#include "boot_timeline_esp32.h"
+#include "qd_accel_esp32.h"
 
 #ifdef ENABLE_MON
 #include "mon.h"
@@ -51,7 +53,63 @@
 
 extern bool tick_inhibit;
 
+#if !AUDIO_NATIVE_SOUNDS
 void PlayStartupSound();
+#endif
+
+#if NATIVE_BLOCK_MOVE
+/*
+ *  Host address of a BlockMove() range that lies wholly in RAM, ROM (as
+ *  source only) or a frame buffer in Mac layout, NULL otherwise
+ */
+
+static uint8 *block_move_host(uint32 addr, uint32 size, bool write, bool *frame)
+{
+	*frame = false;
+	if (addr - RAMBaseMac < RAMSize && size <= RAMSize - (addr - RAMBaseMac)) {
+		if (write)
+			ram_copy_host_write(addr - RAMBaseMac);
+		return RAMBaseHost + (addr - RAMBaseMac);
+	}
+	if (!write && addr - ROMBaseMac < ROMSize && size <= ROMSize - (addr - ROMBaseMac))
+		return ROMBaseHost + (addr - ROMBaseMac);
+	if (MacFrameLayout == FLAYOUT_DIRECT && addr - MacFrameBaseMac < MacFrameSize
+	 && size <= MacFrameSize - (addr - MacFrameBaseMac)) {
+		*frame = true;
+		return MacFrameBaseHost + (addr - MacFrameBaseMac);
+	}
+	return NULL;
+}
+
+/*
+ *  BlockMove()/BlockMoveData() as one host memmove, returns false if the
+ *  68k version has to do it (other address spaces, 24-bit mode)
+ */
+
+static bool native_block_move(uint32 src, uint32 dest, uint32 size)
+{
+	// A count of zero or less moves nothing
+	if (int32(size) <= 0)
+		return true;
+	if (TwentyFourBitAddressing)
+		return false;
+
+	bool src_frame, dest_frame;
+	uint8 *from = block_move_host(src, size, false, &src_frame);
+	uint8 *to = block_move_host(dest, size, true, &dest_frame);
+	if (from == NULL || to == NULL)
+		return false;
+	memmove(to, from, size);
+
+	// The screen changes once for the whole range; moves into RAM always
+	// drop stale decoded code, as some programs load code with BlockMoveData()
+	if (dest_frame)
+		VideoMarkDirtyRange(VIDEO_PAGE_OFFSET(dest - MacFrameBaseMac), size);
+	else
+		FlushCodeCache(to, size);
+	return true;
+}
+#endif
 
 /*
  *  Execute EMUL_OP opcode (called by 68k emulator or Illegal Instruction trap handler)
@@ -91,7 +149,7 @@ void EmulOp(uint16 opcode, M68kRegisters *r)
 			TimerReset();
 			EtherReset();
 			AudioReset();
-#ifdef USE_SDL_AUDIO
+#if defined(USE_SDL_AUDIO) || AUDIO_NATIVE_SOUNDS
 			PlayStartupSound();
 #endif
 			// Create BootGlobs at top of memory
@@ -240,6 +298,9 @@ void EmulOp(uint16 opcode, M68kRegisters *r)
 		case M68K_EMUL_OP_INSTALL_DRIVERS: {// Patch to install our own drivers during startup
 			// Install drivers
 			D(bug("InstallDrivers\n"));
+#if BOOT_TIMELINE
+			BootMark(BOOT_PHASE_DRIVERS);
+#endif
 			InstallDrivers(r->a[0]);
 
 			// Install PutScrap() patch
@@ -486,6 +547,13 @@ void EmulOp(uint16 opcode, M68kRegisters *r)
 				}
 			}
 
+			if (InterruptFlags & INTFLAG_DISK) {
+				ClearInterruptFlag(INTFLAG_DISK);
+				SonyInterrupt();
+				DiskInterrupt();
+				CDROMInterrupt();
+			}
+
 			if (InterruptFlags & INTFLAG_SERIAL) {
 				ClearInterruptFlag(INTFLAG_SERIAL);
 				SerialInterrupt();
@@ -579,6 +647,34 @@ void EmulOp(uint16 opcode, M68kRegisters *r)
 			r->a[0] = ReadMacInt32(0x2b6);
 			break;
 
+#if VIDEO_CURSOR_OVERLAY
+		case M68K_EMUL_OP_CURSOR:		// QuickDraw cursor vector replacements
+			VideoCursorOp(r);
+			break;
+#endif
+
+#if AUDIO_NATIVE_SOUNDS
+		case M68K_EMUL_OP_SYSBEEP:		// SysBeep() replacement
+			r->d[0] = AudioSysBeep() ? 1 : 0;
+			break;
+#endif
+
+#if NATIVE_BLOCK_MOVE
+		case M68K_EMUL_OP_NATIVE_BLOCK_MOVE:	// BlockMove()/BlockMoveData() replacement
+			if (native_block_move(r->a[0], r->a[1], r->d[0])) {
+				r->d[0] = 0;	// noErr
+				r->d[2] = 0;
+			} else
+				r->d[2] = 1;	// Chain to the 68k BlockMove()
+			break;
+#endif
+
+#if QD_ACCEL
+		case M68K_EMUL_OP_QD_ACCEL:		// CopyBits()/FillRect()/EraseRect() replacements
+			r->d[0] = QDAccelOp(r->d[0], r) ? 1 : 0;
+			break;
+#endif
+
 		case M68K_EMUL_OP_SUSPEND: {
 			printf("*** Suspend\n");
 			printf("d0 %08x d1 %08x d2 %08x d3 %08x\n"
@@ -614,3 +710,78 @@ void EmulOp(uint16 opcode, M68kRegisters *r)
 			break;
 	}
 }
+
+
+/*
+ *  EmulOps called by m68k_emulop() without copying the registers. Each
+ *  does what its case in EmulOp() does; they are the ones Mac OS calls
+ *  thousands of times a second (Time Manager, Microseconds(), ADBOp(),
+ *  BlockMove())
+ */
+
+emulop_direct_func EmulOpDirect[EMULOP_DIRECT_COUNT];
+
+static void direct_adbop(uint32 *d, uint32 *a)
+{
+	ADBOp(d[0], Mac2HostAddr(ReadMacInt32(a[0])));
+}
+
+static void direct_instime(uint32 *d, uint32 *a)
+{
+	d[0] = InsTime(a[0], d[1]);
+}
+
+static void direct_rmvtime(uint32 *d, uint32 *a)
+{
+	d[0] = RmvTime(a[0]);
+}
+
+static void direct_primetime(uint32 *d, uint32 *a)
+{
+	d[0] = PrimeTime(a[0], d[0]);
+}
+
+static void direct_microseconds(uint32 *d, uint32 *a)
+{
+	Microseconds(a[0], d[0]);
+}
+
+static void direct_block_move(uint32 *d, uint32 *a)
+{
+	UNUSED(d);
+	FlushCodeCache(Mac2HostAddr(a[0]), a[1]);
+}
+
+static void direct_idle_time(uint32 *d, uint32 *a)
+{
+	UNUSED(d);
+	if (ReadMacInt32(0x14c) == 0)
+		idle_wait();
+	a[0] = ReadMacInt32(0x2b6);
+}
+
+#if NATIVE_BLOCK_MOVE
+static void direct_native_block_move(uint32 *d, uint32 *a)
+{
+	if (native_block_move(a[0], a[1], d[0])) {
+		d[0] = 0;	// noErr
+		d[2] = 0;
+	} else
+		d[2] = 1;	// Chain to the 68k BlockMove()
+}
+#endif
+
+void EmulOpDirectInit(void)
+{
+	memset(EmulOpDirect, 0, sizeof(EmulOpDirect));
+	EmulOpDirect[M68K_EMUL_OP_ADBOP - M68K_EXEC_RETURN] = direct_adbop;
+	EmulOpDirect[M68K_EMUL_OP_INSTIME - M68K_EXEC_RETURN] = direct_instime;
+	EmulOpDirect[M68K_EMUL_OP_RMVTIME - M68K_EXEC_RETURN] = direct_rmvtime;
+	EmulOpDirect[M68K_EMUL_OP_PRIMETIME - M68K_EXEC_RETURN] = direct_primetime;
+	EmulOpDirect[M68K_EMUL_OP_MICROSECONDS - M68K_EXEC_RETURN] = direct_microseconds;
+	EmulOpDirect[M68K_EMUL_OP_BLOCK_MOVE - M68K_EXEC_RETURN] = direct_block_move;
+	EmulOpDirect[M68K_EMUL_OP_IDLE_TIME - M68K_EXEC_RETURN] = direct_idle_time;
+#if NATIVE_BLOCK_MOVE
+	EmulOpDirect[M68K_EMUL_OP_NATIVE_BLOCK_MOVE - M68K_EXEC_RETURN] = direct_native_block_move;
+#endif
+}
@@ -0,0 +1,462 @@
+/*
+ *  ether_esp32.cpp - Ethernet over Wi-Fi (ESP32-C6 co-processor)
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The Tab5's Wi-Fi is on the ESP32-C6, reached from the P4 over SDIO
+ *  (esp-hosted, behind the Arduino WiFi class). A Wi-Fi station can't put
+ *  foreign MAC addresses on the air, so Ethernet frames from the .ENET
+ *  driver travel inside UDP datagrams, in the format of Basilisk II's
+ *  "udptunnel" mode: the Mac's Ethernet address is 'B2' plus its IPv4
+ *  address, frames to such an address go to that host, broadcasts and
+ *  multicasts (AppleTalk) to the subnet broadcast address. Any Basilisk II
+ *  or SheepShaver with udptunnel on the same LAN and port can be reached.
+ *
+ *  Received frames are written straight into a ring of packet slots in Mac
+ *  RAM by the receive task on Core 0; EtherInterrupt() on the 68k thread
+ *  hands each slot to the protocol handler and frees it. The ring has one
+ *  writer and one reader, so there is no lock, no malloc and no copy
+ *  between the socket and the handler's ReadPacket().
+ */
+
+#include "sysdeps.h"
+
+#include <WiFi.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "macos_util.h"
+#include "prefs.h"
+#include "ether.h"
+#include "ether_defs.h"
+#include "snapshot.h"
+#include "log_esp32.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+// Tab5 SDIO lines to the ESP32-C6
+#define WIFI_SDIO_CLK           12
+#define WIFI_SDIO_CMD           13
+#define WIFI_SDIO_D0            11
+#define WIFI_SDIO_D1            10
+#define WIFI_SDIO_D2            9
+#define WIFI_SDIO_D3            8
+#define WIFI_SDIO_RST           15
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+
+#define ETHER_MAX_PROTOCOLS     8
+#define ETHER_SLOTS             16      // Receive ring, a power of two
+#define ETHER_SLOT_SIZE         1516    // Largest frame, as in EthernetPacket
+#define ETHER_MIN_FRAME         14
+
+#define ETHER_TASK_STACK_SIZE   4096
+#define ETHER_TASK_PRIORITY     1
+#define ETHER_TASK_CORE         0
+
+// Attached protocol handlers (protocol type 0 = 802.3 length field)
+struct ether_protocol {
+    uint16 type;
+    uint32 handler;                     // Mac address, 0 = free entry
+};
+static ether_protocol protocols[ETHER_MAX_PROTOCOLS];
+
+// Receive ring: ETHER_SLOTS slots of ETHER_SLOT_SIZE bytes in the Mac
+// system heap (allocated on the first AttachPH, task time); free-running
+// counts, rx_write advanced by the receive task, rx_read by EtherInterrupt()
+static uint32 rx_pool = 0;              // Mac address of the slots, 0 = none (yet)
+static uint16 rx_length[ETHER_SLOTS];
+static uint32 rx_write = 0;
+static uint32 rx_read = 0;
+
+static int udp_socket = -1;
+static uint16 udp_port;
+static uint32 broadcast_ip;             // Subnet broadcast, network order
+static TaskHandle_t rx_task_handle = NULL;
+static volatile bool rx_task_running = false;
+
+static uint8 tx_packet[ETHER_SLOT_SIZE];
+
+// Statistics (reset by Ether_report_stats)
+static volatile uint32 ether_rx_frames = 0;
+static volatile uint32 ether_rx_drops = 0;
+static volatile uint32 ether_tx_frames = 0;
+static volatile uint32 ether_tx_errors = 0;
+
+
+/*
+ *  Receive task: read datagrams into the next free slot
+ */
+
+static void etherRxTask(void *param)
+{
+    UNUSED(param);
+    Serial.printf("[ETHER] Receive task started on Core %d\n", xPortGetCoreID());
+
+    static uint8 discard[ETHER_SLOT_SIZE];
+    while (rx_task_running) {
+        // Slot to receive into, or the discard buffer if there is none (no
+        // pool yet, or EtherInterrupt() is behind); the datagram must be
+        // read in any case
+        uint8 *dest = discard;
+        uint32 pool = __atomic_load_n(&rx_pool, __ATOMIC_ACQUIRE);
+        uint32 slot = rx_write % ETHER_SLOTS;
+        bool have_slot = pool && rx_write - __atomic_load_n(&rx_read, __ATOMIC_ACQUIRE) < ETHER_SLOTS;
+        if (have_slot) {
+            dest = Mac2HostAddr(pool + slot * ETHER_SLOT_SIZE);
+        }
+
+        int len = recv(udp_socket, dest, ETHER_SLOT_SIZE, 0);
+        if (len < 0) {
+            if (rx_task_running) {
+                vTaskDelay(pdMS_TO_TICKS(10));
+            }
+            continue;
+        }
+
+        // Drop runts, our own broadcasts and anything that arrived without
+        // a slot (or while the pool was being taken away by a reset)
+        if (len < ETHER_MIN_FRAME || memcmp(dest + 6, ether_addr, 6) == 0) {
+            continue;
+        }
+        if (!have_slot || __atomic_load_n(&rx_pool, __ATOMIC_ACQUIRE) != pool) {
+            ether_rx_drops++;
+            continue;
+        }
+
+        rx_length[slot] = len;
+        __atomic_store_n(&rx_write, rx_write + 1, __ATOMIC_RELEASE);
+        ether_rx_frames++;
+        SetInterruptFlag(INTFLAG_ETHER);
+        TriggerInterrupt();
+    }
+
+    Serial.println("[ETHER] Receive task exiting");
+    vTaskDelete(NULL);
+}
+
+
+/*
+ *  Initialization
+ */
+
+bool ether_init(void)
+{
+    const char *ssid = PrefsFindString("wifissid");
+    if (ssid == NULL || ssid[0] == 0) {
+        return false;
+    }
+    const char *password = PrefsFindString("wifipass");
+
+    // Join the network through the C6
+    Serial.printf("[ETHER] Connecting to \"%s\"...\n", ssid);
+    WiFi.setPins(WIFI_SDIO_CLK, WIFI_SDIO_CMD, WIFI_SDIO_D0, WIFI_SDIO_D1,
+                 WIFI_SDIO_D2, WIFI_SDIO_D3, WIFI_SDIO_RST);
+    WiFi.mode(WIFI_STA);
+    WiFi.setSleep(false);       // Power save adds ~100 ms to every received frame
+    WiFi.begin(ssid, password ? password : "");
+    uint32 start = millis();
+    while (WiFi.status() != WL_CONNECTED) {
+        if (millis() - start > WIFI_CONNECT_TIMEOUT_MS) {
+            Serial.println("[ETHER] WARNING: Wi-Fi not connected, no network");
+            WiFi.disconnect(true);
+            return false;
+        }
+        delay(100);
+    }
+    IPAddress ip = WiFi.localIP();
+    IPAddress mask = WiFi.subnetMask();
+    broadcast_ip = (uint32)ip | ~(uint32)mask;
+
+    // UDP socket for the tunnel
+    udp_port = PrefsFindInt32("udpport");
+    udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_socket < 0) {
+        Serial.println("[ETHER] WARNING: no UDP socket, no network");
+        WiFi.disconnect(true);
+        return false;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(udp_port);
+    int on = 1;
+    setsockopt(udp_socket, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    if (bind(udp_socket, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        Serial.printf("[ETHER] WARNING: can't bind UDP port %d, no network\n", udp_port);
+        close(udp_socket);
+        udp_socket = -1;
+        WiFi.disconnect(true);
+        return false;
+    }
+
+    // Ethernet address from the IP address, as udptunnel peers expect
+    ether_addr[0] = 'B';
+    ether_addr[1] = '2';
+    ether_addr[2] = ip[0];
+    ether_addr[3] = ip[1];
+    ether_addr[4] = ip[2];
+    ether_addr[5] = ip[3];
+
+    memset(protocols, 0, sizeof(protocols));
+    rx_task_running = true;
+    if (xTaskCreatePinnedToCore(etherRxTask, "EtherRx", ETHER_TASK_STACK_SIZE, NULL,
+                                ETHER_TASK_PRIORITY, &rx_task_handle,
+                                PrefsFindTaskCore("ether", ETHER_TASK_CORE)) != pdPASS) {
+        Serial.println("[ETHER] WARNING: receive task not started, no network");
+        rx_task_running = false;
+        close(udp_socket);
+        udp_socket = -1;
+        WiFi.disconnect(true);
+        return false;
+    }
+
+    Serial.printf("[ETHER] %s on \"%s\", UDP port %d, Ethernet address B2:%02x:%02x:%02x:%02x\n",
+                  ip.toString().c_str(), ssid, udp_port, ip[0], ip[1], ip[2], ip[3]);
+    return true;
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void ether_exit(void)
+{
+    if (rx_task_running) {
+        rx_task_running = false;
+        shutdown(udp_socket, SHUT_RDWR);    // Ends the recv() in the task
+        vTaskDelay(pdMS_TO_TICKS(50));
+        rx_task_handle = NULL;
+    }
+    if (udp_socket >= 0) {
+        close(udp_socket);
+        udp_socket = -1;
+    }
+    WiFi.disconnect(true);
+}
+
+
+/*
+ *  Reset
+ */
+
+void ether_reset(void)
+{
+    // The pool was in the Mac heap, which is gone now; the receive task
+    // sees the change and drops what it is reading
+    __atomic_store_n(&rx_pool, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rx_read, __atomic_load_n(&rx_write, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    memset(protocols, 0, sizeof(protocols));
+}
+
+
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the attached protocols and the receive pool (the pool
+ *  is in Mac RAM); frames queued at the time of the snapshot are dropped
+ */
+
+bool EtherSnapshot(void)
+{
+    uint32 pool = __atomic_load_n(&rx_pool, __ATOMIC_ACQUIRE);
+    if (!SnapshotVar(ether_data) || !SnapshotVar(ether_addr) || !SnapshotVar(protocols) || !SnapshotVar(pool)) {
+        return false;
+    }
+    if (SnapshotRestoring()) {
+        __atomic_store_n(&rx_read, __atomic_load_n(&rx_write, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        __atomic_store_n(&rx_pool, pool, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+#endif
+
+
+/*
+ *  Add/remove multicast address (all multicasts go to the subnet broadcast)
+ */
+
+int16 ether_add_multicast(uint32 pb)
+{
+    UNUSED(pb);
+    return noErr;
+}
+
+int16 ether_del_multicast(uint32 pb)
+{
+    UNUSED(pb);
+    return noErr;
+}
+
+
+/*
+ *  Attach protocol handler
+ */
+
+int16 ether_attach_ph(uint16 type, uint32 handler)
+{
+    // Receive slots in the system heap, allocated here because this runs
+    // at task time (EtherInterrupt() can't call the Memory Manager)
+    if (rx_pool == 0) {
+        M68kRegisters r;
+        r.d[0] = ETHER_SLOTS * ETHER_SLOT_SIZE;
+        Execute68kTrap(0xa71e, &r);     // NewPtrSysClear()
+        if (r.a[0] == 0) {
+            return memFullErr;
+        }
+        D(bug("[ETHER] receive slots at %08x\n", r.a[0]));
+        __atomic_store_n(&rx_read, __atomic_load_n(&rx_write, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        __atomic_store_n(&rx_pool, r.a[0], __ATOMIC_RELEASE);
+    }
+
+    ether_protocol *free_entry = NULL;
+    for (int i = 0; i < ETHER_MAX_PROTOCOLS; i++) {
+        if (protocols[i].handler && protocols[i].type == type) {
+            return lapProtErr;
+        }
+        if (protocols[i].handler == 0 && free_entry == NULL) {
+            free_entry = &protocols[i];
+        }
+    }
+    if (free_entry == NULL) {
+        return lapProtErr;
+    }
+    free_entry->type = type;
+    free_entry->handler = handler;
+    return noErr;
+}
+
+
+/*
+ *  Detach protocol handler
+ */
+
+int16 ether_detach_ph(uint16 type)
+{
+    for (int i = 0; i < ETHER_MAX_PROTOCOLS; i++) {
+        if (protocols[i].handler && protocols[i].type == type) {
+            protocols[i].handler = 0;
+            return noErr;
+        }
+    }
+    return lapProtErr;
+}
+
+
+/*
+ *  Transmit raw Ethernet packet
+ */
+
+int16 ether_write(uint32 wds)
+{
+    int len = ether_wds_to_buffer(wds, tx_packet);
+
+    // Destination host from the Ethernet address
+    uint32 dest_ip;
+    if (tx_packet[0] == 'B' && tx_packet[1] == '2') {
+        dest_ip = htonl((tx_packet[2] << 24) | (tx_packet[3] << 16) | (tx_packet[4] << 8) | tx_packet[5]);
+    } else if (tx_packet[0] & 1) {
+        dest_ip = broadcast_ip;         // Broadcast or multicast
+    } else {
+        return eMultiErr;               // Not a tunnel peer
+    }
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = dest_ip;
+    sa.sin_port = htons(udp_port);
+    if (sendto(udp_socket, tx_packet, len, MSG_DONTWAIT, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        ether_tx_errors++;
+        return excessCollsns;
+    }
+    ether_tx_frames++;
+    return noErr;
+}
+
+
+/*
+ *  UDP thread (ether.cpp's own udptunnel mode is not used, see above)
+ */
+
+bool ether_start_udp_thread(int socket_fd)
+{
+    UNUSED(socket_fd);
+    return false;
+}
+
+void ether_stop_udp_thread(void)
+{
+}
+
+
+/*
+ *  Ethernet interrupt - hand received frames to the protocol handlers
+ */
+
+void EtherInterrupt(void)
+{
+    D(bug("EtherIRQ\n"));
+    uint32 pool = __atomic_load_n(&rx_pool, __ATOMIC_ACQUIRE);
+    if (pool == 0 || ether_data == 0) {
+        return;
+    }
+
+    uint32 end = __atomic_load_n(&rx_write, __ATOMIC_ACQUIRE);
+    while (rx_read != end) {
+        uint32 slot = rx_read % ETHER_SLOTS;
+        uint32 packet = pool + slot * ETHER_SLOT_SIZE;
+        uint32 length = rx_length[slot];
+        const uint8 *p = Mac2HostAddr(packet);
+
+        // Only frames to us, broadcasts and multicasts
+        if (memcmp(p, ether_addr, 6) == 0 || (p[0] & 1)) {
+            uint16 type = (p[12] << 8) | p[13];
+            uint16 search_type = type <= 1500 ? 0 : type;
+            uint32 handler = 0;
+            for (int i = 0; i < ETHER_MAX_PROTOCOLS; i++) {
+                if (protocols[i].handler && protocols[i].type == search_type) {
+                    handler = protocols[i].handler;
+                    break;
+                }
+            }
+            if (handler) {
+                // Copy header to RHA and call the protocol handler, which
+                // reads the rest from the slot with ReadPacket/ReadRest
+                Mac2Mac_memcpy(ether_data + ed_RHA, packet, 14);
+                M68kRegisters r;
+                r.d[0] = type;                              // Packet type
+                r.d[1] = length - 14;                       // Remaining packet length (without header, for ReadPacket)
+                r.a[0] = packet + 14;                       // Pointer to packet (Mac address, for ReadPacket)
+                r.a[3] = ether_data + ed_RHA + 14;          // Pointer behind header in RHA
+                r.a[4] = ether_data + ed_ReadPacket;        // Pointer to ReadPacket/ReadRest routines
+                D(bug(" calling protocol handler %08x, type %04x, length %d\n", handler, type, length));
+                Execute68k(handler, &r);
+            }
+        }
+
+        __atomic_store_n(&rx_read, rx_read + 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ *  Print and reset network statistics - called from the perf report
+ */
+
+void Ether_report_stats(void)
+{
+    if (udp_socket < 0 || (ether_rx_frames == 0 && ether_tx_frames == 0 && ether_rx_drops == 0)) {
+        return;
+    }
+    LOG_PRINTF("[ETHER] rx=%u tx=%u rx_drops=%u tx_errors=%u rssi=%d\n",
+               ether_rx_frames, ether_tx_frames, ether_rx_drops, ether_tx_errors, (int)WiFi.RSSI());
+    ether_rx_frames = 0;
+    ether_tx_frames = 0;
+    ether_rx_drops = 0;
+    ether_tx_errors = 0;
+}
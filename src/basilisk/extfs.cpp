@@ -0,0 +1,2227 @@
+/*
+ *  extfs.cpp - MacOS file system for native file system access
+ *
+ *  Basilisk II (C) 1997-2008 Christian Bauer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  SEE ALSO
+ *    Guide to the File System Manager (from FSM 1.2 SDK)
+ *
+ *  TODO
+ *    LockRng
+ *    UnlockRng
+ *    (CatSearch)
+ *    (MakeFSSpec)
+ *    (GetVolMountInfoSize)
+ *    (GetVolMountInfo)
+ *    (GetForeignPrivs)
+ *    (SetForeignPrivs)
+ *
+ *  The host side (directory listings, Finder info, resource forks) is
+ *  reached through the extfs_* functions of extfs.h; paths handed to them
+ *  are host paths built from the "extfs" prefs item.
+ */
+
+#include "sysdeps.h"
+
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "cpu_emulation.h"
+#include "emul_op.h"
+#include "main.h"
+#include "disk.h"
+#include "prefs.h"
+#include "macos_util.h"
+#include "extfs.h"
+#include "extfs_defs.h"
+#include "snapshot.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// File system global data and 68k routines
+enum {
+	fsCommProcStub = 0,
+	fsHFSProcStub = 6,
+	fsDrvStatus = 12,
+	fsFSD = 42,
+	fsVMI = 238,
+	fsReturn = 246,
+	fsPB = 310,
+	fsAllocateVCB = 390,
+	fsAddNewVCB = 414,
+	fsDisposeVCB = 438,
+	fsDetermineVol = 462,
+	fsResolveWDCB = 486,
+	fsGetDefaultVol = 510,
+	fsSetDefaultVol = 534,
+	fsAllocateFCB = 558,
+	fsReleaseFCB = 582,
+	fsIndexFCB = 606,
+	fsResolveFCB = 630,
+	fsAdjustEOF = 654,
+	fsAllocateWDCB = 678,
+	fsReleaseWDCB = 702,
+	fsCheckWDRefNum = 726,
+	SIZEOF_fsdat = 750
+};
+
+static uint32 fs_data = 0;		// Mac address of global data
+
+
+// File system and volume name
+static char FS_NAME[32], VOLUME_NAME[32];
+
+// This directory is our root (read from prefs)
+static char RootPath[MAX_PATH_LENGTH];
+static bool ready = false;
+static time_t root_mtime;
+
+// File system ID/media type
+const int16 MY_FSID = EMULATOR_ID_2;
+const uint32 MY_MEDIA_TYPE = EMULATOR_ID_4;
+
+// CNID of root and root's parent
+const uint32 ROOT_ID = 2;
+const uint32 ROOT_PARENT_ID = 1;
+
+// File system stack size
+const int STACK_SIZE = 0x10000;
+
+// Allocation block and clump size as reported to MacOS (these are of course
+// not the real values and have no meaning on the host OS)
+const int AL_BLOCK_SIZE = 0x4000;
+const int CLUMP_SIZE = 0x4000;
+
+// Drive number of our pseudo-drive
+static int drive_number;
+
+
+// Disk/drive icon (32x32 icon followed by its mask), drawn in ExtFSInit()
+static uint8 ExtFSIcon[256];
+
+
+// These objects are used to map CNIDs to path names
+struct FSItem {
+	FSItem *next_id;		// Next FSItem with the same CNID hash
+	FSItem *next_name;		// Next FSItem with the same name hash
+	uint32 id;				// CNID of this file/dir
+	uint32 parent_id;		// CNID of parent file/dir
+	FSItem *parent;			// Pointer to parent
+	char *name;				// Object name (host side)
+	char guest_name[32];	// Object name (guest side, C string)
+};
+
+const int FSITEM_HASH_SIZE = 1024;		// Buckets of the CNID and name tables
+
+static FSItem *fs_item_by_id[FSITEM_HASH_SIZE];
+static FSItem *fs_item_by_name[FSITEM_HASH_SIZE];
+static FSItem *root_item = NULL;
+static uint32 next_cnid = fsUsrCNID;	// Next available CNID
+
+#if MAC_SNAPSHOT
+// Number of forks open through fs_open(); their fds don't survive a snapshot
+static int open_forks = 0;
+#endif
+
+// Full path of the last object found by get_path_for_fsitem() / get_item_and_path()
+static char full_path[MAX_PATH_LENGTH];
+
+
+/*
+ *  Hash the CNID of an FSItem
+ */
+
+static inline uint32 id_hash(uint32 id)
+{
+	return (id * 2654435761u) >> 22;
+}
+
+
+/*
+ *  Hash the parent CNID and case-folded guest name of an FSItem
+ */
+
+static uint32 name_hash(uint32 parent_id, const char *guest_name)
+{
+	uint32 h = parent_id * 31;
+	for (const uint8 *p = (const uint8 *)guest_name; *p; p++) {
+		uint8 c = *p;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		h = h * 33 + c;
+	}
+	return h & (FSITEM_HASH_SIZE - 1);
+}
+
+
+/*
+ *  Compare two guest names like the File Manager does (case-insensitive)
+ */
+
+static bool guest_name_equal(const char *a, const char *b)
+{
+	for (;;) {
+		uint8 ca = *a++, cb = *b++;
+		if (ca >= 'a' && ca <= 'z')
+			ca -= 'a' - 'A';
+		if (cb >= 'a' && cb <= 'z')
+			cb -= 'a' - 'A';
+		if (ca != cb)
+			return false;
+		if (ca == 0)
+			return true;
+	}
+}
+
+
+/*
+ *  Create a new FSItem and link it into the lookup tables
+ */
+
+static FSItem *new_fsitem(FSItem *parent, uint32 id, const char *name)
+{
+	FSItem *p = (FSItem *)psram_malloc(sizeof(FSItem));
+	char *host_name = (char *)psram_malloc(strlen(name) + 1);
+	if (p == NULL || host_name == NULL) {
+		free(p);
+		free(host_name);
+		return NULL;
+	}
+	strcpy(host_name, name);
+	p->id = id;
+	p->parent = parent;
+	p->parent_id = parent ? parent->id : 0;
+	p->name = host_name;
+	strncpy(p->guest_name, host_encoding_to_macroman(name), 31);
+	p->guest_name[31] = 0;
+
+	uint32 h = id_hash(id);
+	p->next_id = fs_item_by_id[h];
+	fs_item_by_id[h] = p;
+	h = name_hash(p->parent_id, p->guest_name);
+	p->next_name = fs_item_by_name[h];
+	fs_item_by_name[h] = p;
+	return p;
+}
+
+
+/*
+ *  Unlink an FSItem from the name table (before its name or parent changes)
+ */
+
+static void unlink_fsitem_name(FSItem *item)
+{
+	FSItem **pp = &fs_item_by_name[name_hash(item->parent_id, item->guest_name)];
+	while (*pp) {
+		if (*pp == item) {
+			*pp = item->next_name;
+			return;
+		}
+		pp = &(*pp)->next_name;
+	}
+}
+
+
+/*
+ *  Give an FSItem a new host name and/or parent, keeping its CNID
+ */
+
+static bool move_fsitem(FSItem *item, FSItem *parent, const char *name)
+{
+	char *host_name = (char *)psram_malloc(strlen(name) + 1);
+	if (host_name == NULL)
+		return false;
+	strcpy(host_name, name);
+	unlink_fsitem_name(item);
+	free(item->name);
+	item->name = host_name;
+	item->parent = parent;
+	item->parent_id = parent->id;
+	strncpy(item->guest_name, host_encoding_to_macroman(name), 31);
+	item->guest_name[31] = 0;
+	uint32 h = name_hash(item->parent_id, item->guest_name);
+	item->next_name = fs_item_by_name[h];
+	fs_item_by_name[h] = item;
+	return true;
+}
+
+
+/*
+ *  Find FSItem for given CNID
+ */
+
+static FSItem *find_fsitem_by_id(uint32 cnid)
+{
+	for (FSItem *p = fs_item_by_id[id_hash(cnid)]; p; p = p->next_id)
+		if (p->id == cnid)
+			return p;
+	return NULL;
+}
+
+
+/*
+ *  Find FSItem for given host name and parent, construct new FSItem if not found
+ */
+
+static FSItem *find_fsitem(const char *name, FSItem *parent)
+{
+	const char *guest_name = host_encoding_to_macroman(name);
+	char guest[32];
+	strncpy(guest, guest_name, 31);
+	guest[31] = 0;
+	for (FSItem *p = fs_item_by_name[name_hash(parent->id, guest)]; p; p = p->next_name)
+		if (p->parent == parent && strcmp(p->name, name) == 0)
+			return p;
+
+	// Not found, construct new FSItem
+	return new_fsitem(parent, next_cnid++, name);
+}
+
+
+/*
+ *  Get full path (->full_path) for given FSItem
+ */
+
+static void get_path_for_fsitem(FSItem *p)
+{
+	if (p->id == ROOT_PARENT_ID) {
+		full_path[0] = 0;
+	} else if (p->id == ROOT_ID) {
+		strncpy(full_path, RootPath, MAX_PATH_LENGTH-1);
+		full_path[MAX_PATH_LENGTH-1] = 0;
+	} else {
+		get_path_for_fsitem(p->parent);
+		add_path_component(full_path, p->name);
+	}
+}
+
+
+/*
+ *  Find FSItem for given guest name and parent: known items first, then
+ *  the host directory listing, else a new item for a host name made up
+ *  from the guest name (for objects about to be created)
+ */
+
+static FSItem *find_fsitem_guest(const char *guest_name, FSItem *parent)
+{
+	if (parent->id == ROOT_PARENT_ID)
+		return guest_name_equal(guest_name, root_item->guest_name) ? root_item : NULL;
+
+	for (FSItem *p = fs_item_by_name[name_hash(parent->id, guest_name)]; p; p = p->next_name)
+		if (p->parent == parent && guest_name_equal(p->guest_name, guest_name))
+			return p;
+
+	get_path_for_fsitem(parent);
+	int count = extfs_dir_count(full_path);
+	for (int i = 0; i < count; i++) {
+		const char *name = extfs_dir_entry(full_path, i);
+		if (name == NULL)
+			break;
+		char guest[32];
+		strncpy(guest, host_encoding_to_macroman(name), 31);
+		guest[31] = 0;
+		if (guest_name_equal(guest, guest_name))
+			return find_fsitem(name, parent);
+	}
+
+	return find_fsitem(macroman_to_host_encoding(guest_name), parent);
+}
+
+
+/*
+ *  Free all FSItems
+ */
+
+static void free_fsitems(void)
+{
+	for (int i = 0; i < FSITEM_HASH_SIZE; i++) {
+		FSItem *p = fs_item_by_id[i];
+		while (p) {
+			FSItem *next = p->next_id;
+			free(p->name);
+			free(p);
+			p = next;
+		}
+		fs_item_by_id[i] = NULL;
+		fs_item_by_name[i] = NULL;
+	}
+	root_item = NULL;
+}
+
+
+/*
+ *  String handling functions
+ */
+
+// Copy pascal string
+static void pstrcpy(char *dst, const char *src)
+{
+	int size = *dst++ = *src++;
+	while (size--)
+		*dst++ = *src++;
+}
+
+// Convert C string to pascal string
+static void cstr2pstr(char *dst, const char *src)
+{
+	*dst++ = strlen(src);
+	char c;
+	while ((c = *src++) != 0) {
+		// Note: we are converting host ':' characters to Mac '/' characters here
+		// '/' is not a path separator as this function is only used on object names
+		if (c == ':')
+			c = '/';
+		*dst++ = c;
+	}
+}
+
+
+/*
+ *  Convert errno to MacOS error code
+ */
+
+static int16 errno2oserr(void)
+{
+	D(bug(" errno %08x\n", errno));
+	switch (errno) {
+		case 0:
+			return noErr;
+		case ENOENT:
+		case EISDIR:
+			return fnfErr;
+		case EACCES:
+		case EPERM:
+			return permErr;
+		case EEXIST:
+			return dupFNErr;
+		case EBUSY:
+		case ENOTEMPTY:
+			return fBsyErr;
+		case ENOSPC:
+			return dskFulErr;
+		case EROFS:
+			return wPrErr;
+		case EMFILE:
+			return tmfoErr;
+		case ENOMEM:
+			return -108;
+		case EIO:
+		default:
+			return ioErr;
+	}
+}
+
+
+/*
+ *  Draw the volume icon: a folder with a card slot on its front
+ */
+
+static void make_icon(void)
+{
+	uint8 *icon = ExtFSIcon, *mask = ExtFSIcon + 128;
+	memset(ExtFSIcon, 0, sizeof(ExtFSIcon));
+	for (int y = 0; y < 32; y++) {
+		int x0, x1;				// Outline of this row
+		if (y < 5)
+			continue;
+		else if (y < 8)
+			x0 = 1, x1 = 13;	// Tab
+		else if (y < 28)
+			x0 = 1, x1 = 30;	// Body
+		else
+			continue;
+		for (int x = x0; x <= x1; x++) {
+			uint8 bit = 0x80 >> (x & 7);
+			mask[y * 4 + x / 8] |= bit;
+			bool edge = x == x0 || x == x1 || y == 5 || y == 27 || (y == 8 && x > 13);
+			bool slot = y >= 17 && y <= 19 && x >= 9 && x <= 22;
+			if (edge || slot)
+				icon[y * 4 + x / 8] |= bit;
+		}
+	}
+}
+
+
+/*
+ *  Initialization
+ */
+
+void ExtFSInit(void)
+{
+	// System specific initialization
+	extfs_init();
+
+	// Get root path from prefs, no shared folder means no ExtFS volume
+	const char *extfs = PrefsFindString("extfs");
+	if (extfs == NULL || extfs[0] == 0)
+		return;
+	strncpy(RootPath, extfs, MAX_PATH_LENGTH-1);
+	RootPath[MAX_PATH_LENGTH-1] = 0;
+	size_t len = strlen(RootPath);
+	while (len > 1 && RootPath[len-1] == '/')
+		RootPath[--len] = 0;
+
+	extfs_stat_info st;
+	if (!extfs_stat(RootPath, &st) || !st.is_dir) {
+		printf("WARNING: Shared folder %s not found, disabling ExtFS\n", RootPath);
+		return;
+	}
+	root_mtime = st.mtime;
+
+	// File system and volume name (the last component of the root path)
+	cstr2pstr(FS_NAME, "Basilisk II Shared Folder");
+	const char *vol = strrchr(RootPath, '/');
+	vol = (vol && vol[1]) ? vol + 1 : RootPath;
+	char vol_name[28];
+	strncpy(vol_name, host_encoding_to_macroman(vol), 27);
+	vol_name[27] = 0;
+	cstr2pstr(VOLUME_NAME, vol_name);
+
+	// Create root's parent FSItem and root FSItem
+	FSItem *p = new_fsitem(NULL, ROOT_PARENT_ID, "");
+	if (p == NULL)
+		return;
+	root_item = new_fsitem(p, ROOT_ID, vol_name);
+	if (root_item == NULL)
+		return;
+	strcpy(root_item->guest_name, vol_name);
+
+	make_icon();
+	ready = true;
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void ExtFSExit(void)
+{
+	// Delete all FSItems
+	free_fsitems();
+	ready = false;
+
+	// System specific deinitialization
+	extfs_exit();
+}
+
+
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the CNID mapping (refused while forks are open)
+ */
+
+bool ExtFSSnapshot(void)
+{
+	bool was_ready = ready;
+	if (!SnapshotVar(was_ready) || was_ready != ready)
+		return false;
+	if (!ready)
+		return true;
+	if (!SnapshotRestoring() && open_forks > 0) {
+		printf("WARNING: ExtFS has %d open forks, no snapshot\n", open_forks);
+		return false;
+	}
+	if (!SnapshotVar(fs_data) || !SnapshotVar(drive_number) || !SnapshotVar(next_cnid))
+		return false;
+
+	if (!SnapshotRestoring()) {
+		uint32 count = 0;
+		for (int i = 0; i < FSITEM_HASH_SIZE; i++)
+			for (FSItem *p = fs_item_by_id[i]; p; p = p->next_id)
+				count++;
+		if (!SnapshotVar(count))
+			return false;
+		for (int i = 0; i < FSITEM_HASH_SIZE; i++) {
+			for (FSItem *p = fs_item_by_id[i]; p; p = p->next_id) {
+				uint16 len = strlen(p->name);
+				if (!SnapshotVar(p->id) || !SnapshotVar(p->parent_id) || !SnapshotVar(p->guest_name)
+				 || !SnapshotVar(len) || !SnapshotData(p->name, len))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Items first, parents linked once they all exist
+	uint32 count;
+	if (!SnapshotVar(count))
+		return false;
+	free_fsitems();
+	for (uint32 n = 0; n < count; n++) {
+		uint32 id, parent_id;
+		char guest_name[32], name[MAX_PATH_LENGTH];
+		uint16 len;
+		if (!SnapshotVar(id) || !SnapshotVar(parent_id) || !SnapshotVar(guest_name)
+		 || !SnapshotVar(len) || len >= MAX_PATH_LENGTH || !SnapshotData(name, len))
+			return false;
+		name[len] = 0;
+		FSItem *p = new_fsitem(NULL, id, name);
+		if (p == NULL)
+			return false;
+		unlink_fsitem_name(p);
+		p->parent_id = parent_id;
+		memcpy(p->guest_name, guest_name, sizeof(p->guest_name));
+		p->guest_name[31] = 0;
+		uint32 h = name_hash(p->parent_id, p->guest_name);
+		p->next_name = fs_item_by_name[h];
+		fs_item_by_name[h] = p;
+	}
+	for (int i = 0; i < FSITEM_HASH_SIZE; i++)
+		for (FSItem *p = fs_item_by_id[i]; p; p = p->next_id)
+			if (p->id != ROOT_PARENT_ID && (p->parent = find_fsitem_by_id(p->parent_id)) == NULL)
+				return false;
+	root_item = find_fsitem_by_id(ROOT_ID);
+	return root_item != NULL;
+}
+#endif
+
+
+/*
+ *  Build 68k glue to a File System Manager utility routine (Pascal
+ *  calling convention): push the result word and the arguments, given as
+ *  register push opcodes, call _FSMgr with the selector in d0 and return
+ *  the result in d0
+ */
+
+static void make_fsm_glue(uint32 p, uint16 selector, const uint16 *pushes, int count)
+{
+	WriteMacInt16(p, 0x4267); p += 2;				// clr.w -(sp)
+	for (int i = 0; i < count; i++) {
+		WriteMacInt16(p, pushes[i]); p += 2;
+	}
+	WriteMacInt16(p, 0x7000 | selector); p += 2;	// moveq #selector,d0
+	WriteMacInt16(p, 0xa824); p += 2;				// FSMgr
+	WriteMacInt16(p, 0x301f); p += 2;				// move.w (sp)+,d0
+	WriteMacInt16(p, M68K_RTS);
+}
+
+#define PUSH_A(n) (0x2f08 + (n))		// move.l an,-(sp)
+#define PUSH_DL(n) (0x2f00 + (n))		// move.l dn,-(sp)
+#define PUSH_DW(n) (0x3f00 + (n))		// move.w dn,-(sp)
+
+
+/*
+ *  Install file system
+ */
+
+void InstallExtFS(void)
+{
+	int num_blocks = 0xffff;	// Fake number of blocks of our drive
+	M68kRegisters r;
+
+	D(bug("InstallExtFS\n"));
+	if (!ready)
+		return;
+
+	// FSM present?
+	r.d[0] = gestaltFSAttr;
+	Execute68kTrap(0xa1ad, &r);	// Gestalt()
+	D(bug("FSAttr %d, %08x\n", r.d[0], r.a[0]));
+	if ((r.d[0] & 0xffff) || !(r.a[0] & (1 << gestaltHasFileSystemManager))) {
+		printf("WARNING: No FSM present, disabling ExtFS\n");
+		return;
+	}
+
+	// Yes, version >=1.2?
+	r.d[0] = gestaltFSMVersion;
+	Execute68kTrap(0xa1ad, &r);	// Gestalt()
+	D(bug("FSMVersion %d, %08x\n", r.d[0], r.a[0]));
+	if ((r.d[0] & 0xffff) || (r.a[0] < 0x0120)) {
+		printf("WARNING: FSM <1.2 found, disabling ExtFS\n");
+		return;
+	}
+
+	D(bug("FSM present\n"));
+
+	// Yes, allocate file system stack
+	r.d[0] = STACK_SIZE;
+	Execute68kTrap(0xa71e, &r);		// NewPtrSysClear()
+	if (r.a[0] == 0)
+		return;
+	uint32 fs_stack = r.a[0];
+
+	// Allocate memory for our data structures and 68k code
+	r.d[0] = SIZEOF_fsdat;
+	Execute68kTrap(0xa71e, &r);		// NewPtrSysClear()
+	if (r.a[0] == 0)
+		return;
+	fs_data = r.a[0];
+
+	// Set up 68k code fragments
+	uint32 p = fs_data + fsCommProcStub;
+	WriteMacInt16(p, M68K_EMUL_OP_EXTFS_COMM); p += 2;
+	WriteMacInt16(p, M68K_RTD); p += 2;
+	WriteMacInt16(p, 10);
+
+	p = fs_data + fsHFSProcStub;
+	WriteMacInt16(p, M68K_EMUL_OP_EXTFS_HFS); p += 2;
+	WriteMacInt16(p, M68K_RTD); p += 2;
+	WriteMacInt16(p, 16);
+
+	static const uint16 allocate_vcb[] = {PUSH_A(0), PUSH_A(1), PUSH_DW(0)};
+	make_fsm_glue(fs_data + fsAllocateVCB, 6, allocate_vcb, 3);
+	static const uint16 add_new_vcb[] = {PUSH_DW(0), PUSH_A(0), PUSH_A(1)};
+	make_fsm_glue(fs_data + fsAddNewVCB, 7, add_new_vcb, 3);
+	static const uint16 dispose_vcb[] = {PUSH_A(0)};
+	make_fsm_glue(fs_data + fsDisposeVCB, 8, dispose_vcb, 1);
+	static const uint16 determine_vol[] = {PUSH_A(0), PUSH_A(1), PUSH_A(2), PUSH_A(3), PUSH_A(4)};
+	make_fsm_glue(fs_data + fsDetermineVol, 0x1d, determine_vol, 5);
+	static const uint16 resolve_wdcb[] = {PUSH_DL(0), PUSH_DW(1), PUSH_DW(2), PUSH_A(0)};
+	make_fsm_glue(fs_data + fsResolveWDCB, 0x0e, resolve_wdcb, 4);
+	static const uint16 get_default_vol[] = {PUSH_A(0)};
+	make_fsm_glue(fs_data + fsGetDefaultVol, 0x12, get_default_vol, 1);
+	static const uint16 set_default_vol[] = {PUSH_DL(0), PUSH_DL(1), PUSH_DW(2)};
+	make_fsm_glue(fs_data + fsSetDefaultVol, 0x11, set_default_vol, 3);
+	static const uint16 allocate_fcb[] = {PUSH_A(0), PUSH_A(1)};
+	make_fsm_glue(fs_data + fsAllocateFCB, 0x00, allocate_fcb, 2);
+	static const uint16 release_fcb[] = {PUSH_DW(0)};
+	make_fsm_glue(fs_data + fsReleaseFCB, 0x01, release_fcb, 1);
+	static const uint16 index_fcb[] = {PUSH_A(0), PUSH_A(1), PUSH_A(2)};
+	make_fsm_glue(fs_data + fsIndexFCB, 0x04, index_fcb, 3);
+	static const uint16 resolve_fcb[] = {PUSH_DW(0), PUSH_A(0)};
+	make_fsm_glue(fs_data + fsResolveFCB, 0x05, resolve_fcb, 2);
+	static const uint16 adjust_eof[] = {PUSH_DW(0)};
+	make_fsm_glue(fs_data + fsAdjustEOF, 0x10, adjust_eof, 1);
+	static const uint16 allocate_wdcb[] = {PUSH_A(0)};
+	make_fsm_glue(fs_data + fsAllocateWDCB, 0x0c, allocate_wdcb, 1);
+	static const uint16 release_wdcb[] = {PUSH_DW(0)};
+	make_fsm_glue(fs_data + fsReleaseWDCB, 0x0d, release_wdcb, 1);
+	static const uint16 check_wdrefnum[] = {PUSH_DW(0)};
+	make_fsm_glue(fs_data + fsCheckWDRefNum, 0x13, check_wdrefnum, 1);
+
+	// Set up drive status
+	WriteMacInt8(fs_data + fsDrvStatus + dsDiskInPlace, 8);	// Fixed disk
+	WriteMacInt8(fs_data + fsDrvStatus + dsInstalled, 1);
+	WriteMacInt16(fs_data + fsDrvStatus + dsQType, hard20);
+	WriteMacInt16(fs_data + fsDrvStatus + dsDriveSize, num_blocks & 0xffff);
+	WriteMacInt16(fs_data + fsDrvStatus + dsDriveS1, num_blocks >> 16);
+	WriteMacInt16(fs_data + fsDrvStatus + dsQFSID, MY_FSID);
+
+	// Add drive to drive queue
+	drive_number = FindFreeDriveNumber(1);
+	D(bug(" adding drive %d\n", drive_number));
+	r.d[0] = (drive_number << 16) | (DiskRefNum & 0xffff);
+	r.a[0] = fs_data + fsDrvStatus + dsQLink;
+	Execute68kTrap(0xa04e, &r);	// AddDrive()
+
+	// Init FSDRec and install file system
+	D(bug(" installing file system\n"));
+	WriteMacInt16(fs_data + fsFSD + fsdLength, SIZEOF_FSDRec);
+	WriteMacInt16(fs_data + fsFSD + fsdVersion, fsdVersion1);
+	WriteMacInt16(fs_data + fsFSD + fileSystemFSID, MY_FSID);
+	Host2Mac_memcpy(fs_data + fsFSD + fileSystemName, FS_NAME, 32);
+	WriteMacInt32(fs_data + fsFSD + fileSystemCommProc, fs_data + fsCommProcStub);
+	WriteMacInt32(fs_data + fsFSD + fsdHFSCI + compInterfProc, fs_data + fsHFSProcStub);
+	WriteMacInt32(fs_data + fsFSD + fsdHFSCI + stackTop, fs_stack + STACK_SIZE);
+	WriteMacInt32(fs_data + fsFSD + fsdHFSCI + stackSize, STACK_SIZE);
+	WriteMacInt32(fs_data + fsFSD + fsdHFSCI + idSector, (uint32)-1);
+	r.a[0] = fs_data + fsFSD;
+	r.d[0] = 0;					// InstallFS
+	Execute68kTrap(0xa0ac, &r);	// FSMDispatch()
+	D(bug(" InstallFS() returned %d\n", r.d[0]));
+	if (r.d[0] & 0xffff) {
+		printf("WARNING: InstallFS() failed (%d), disabling ExtFS\n", (int16)r.d[0]);
+		return;
+	}
+
+	// Enable HFS component
+	D(bug(" enabling HFS component\n"));
+	WriteMacInt32(fs_data + fsFSD + fsdHFSCI + compInterfMask, ReadMacInt32(fs_data + fsFSD + fsdHFSCI + compInterfMask) | (fsmComponentEnableMask | hfsCIResourceLoadedMask | hfsCIDoesHFSMask));
+	r.a[0] = fs_data + fsFSD;
+	r.d[3] = SIZEOF_FSDRec;
+	r.d[4] = MY_FSID;
+	r.d[0] = 5;					// SetFSInfo
+	Execute68kTrap(0xa0ac, &r);	// FSMDispatch()
+	D(bug(" SetFSInfo() returned %d\n", r.d[0]));
+
+	// Mount volume
+	D(bug(" mounting volume\n"));
+	WriteMacInt32(fs_data + fsPB + ioBuffer, fs_data + fsVMI);
+	WriteMacInt16(fs_data + fsVMI + vmiLength, SIZEOF_VolumeMountInfoHeader);
+	WriteMacInt32(fs_data + fsVMI + vmiMedia, MY_MEDIA_TYPE);
+	r.a[0] = fs_data + fsPB;
+	r.d[0] = 0x41;				// PBVolumeMount
+	Execute68kTrap(0xa260, &r);	// HFSDispatch()
+	D(bug(" PBVolumeMount() returned %d\n", r.d[0]));
+}
+
+
+/*
+ *  FS communications function
+ */
+
+int16 ExtFSComm(uint16 message, uint32 paramBlock, uint32 globalsPtr)
+{
+	D(bug("ExtFSComm(%d, %08lx, %08lx)\n", message, paramBlock, globalsPtr));
+
+	switch (message) {
+		case ffsNopMessage:
+		case ffsLoadMessage:
+		case ffsUnloadMessage:
+			return noErr;
+
+		case ffsGetIconMessage: {		// Get disk/drive icon
+			if (ReadMacInt8(paramBlock + iconType) == kLargeIcon && ReadMacInt32(paramBlock + requestSize) >= sizeof(ExtFSIcon)) {
+				Host2Mac_memcpy(ReadMacInt32(paramBlock + iconBufferPtr), ExtFSIcon, sizeof(ExtFSIcon));
+				WriteMacInt32(paramBlock + actualSize, sizeof(ExtFSIcon));
+				return noErr;
+			} else
+				return paramErr;
+		}
+
+		case ffsIDDiskMessage: {		// Check if volume is handled by our FS
+			if ((int16)ReadMacInt16(paramBlock + ioVRefNum) == drive_number)
+				return noErr;
+			else
+				return extFSErr;
+		}
+
+		case ffsIDVolMountMessage: {	// Check if volume can be mounted by our FS
+			if (ReadMacInt32(ReadMacInt32(paramBlock + ioBuffer) + vmiMedia) == MY_MEDIA_TYPE)
+				return noErr;
+			else
+				return extFSErr;
+		}
+
+		default:
+			return fsmUnknownFSMMessageErr;
+	}
+}
+
+
+/*
+ *  Get current directory specified by given ParamBlock/dirID
+ */
+
+static int16 get_current_dir(uint32 pb, uint32 dirID, uint32 &current_dir, bool no_vol_name = false)
+{
+	M68kRegisters r;
+	int16 result;
+
+	// Determine volume
+	D(bug("  determining volume, dirID %d\n", dirID));
+	r.a[0] = pb;
+	r.a[1] = fs_data + fsReturn;
+	r.a[2] = fs_data + fsReturn + 2;
+	r.a[3] = fs_data + fsReturn + 4;
+	r.a[4] = fs_data + fsReturn + 6;
+	uint32 name_ptr = 0;
+	if (no_vol_name) {
+		name_ptr = ReadMacInt32(pb + ioNamePtr);
+		WriteMacInt32(pb + ioNamePtr, 0);
+	}
+	Execute68k(fs_data + fsDetermineVol, &r);
+	if (no_vol_name)
+		WriteMacInt32(pb + ioNamePtr, name_ptr);
+	int16 status = ReadMacInt16(fs_data + fsReturn);
+	D(bug("  UTDetermineVol() returned %d, status %d\n", r.d[0], status));
+	result = (int16)(r.d[0] & 0xffff);
+
+	if (result == noErr) {
+		switch (status) {
+			case dtmvFullPathname:	// Determined by full pathname
+				current_dir = ROOT_PARENT_ID;
+				break;
+
+			case dtmvVRefNum:		// Determined by refNum or by drive number
+			case dtmvDriveNum:
+				current_dir = dirID ? dirID : ROOT_ID;
+				break;
+
+			case dtmvWDRefNum:		// Determined by working directory refNum
+				if (dirID)
+					current_dir = dirID;
+				else {
+					D(bug("  resolving WDCB\n"));
+					r.d[0] = 0;
+					r.d[1] = 0;
+					r.d[2] = ReadMacInt16(pb + ioVRefNum);
+					r.a[0] = fs_data + fsReturn;
+					Execute68k(fs_data + fsResolveWDCB, &r);
+					uint32 wdcb = ReadMacInt32(fs_data + fsReturn);
+					D(bug("  UTResolveWDCB() returned %d, dirID %d\n", r.d[0], ReadMacInt32(wdcb + wdDirID)));
+					result = (int16)(r.d[0] & 0xffff);
+					if (result == noErr)
+						current_dir = ReadMacInt32(wdcb + wdDirID);
+				}
+				break;
+
+			case dtmvDefault:		// Determined by default volume
+				if (dirID)
+					current_dir = dirID;
+				else {
+					uint32 wdpb = fs_data + fsReturn;
+					WriteMacInt32(wdpb + ioNamePtr, 0);
+					D(bug("  getting default volume\n"));
+					r.a[0] = wdpb;
+					Execute68k(fs_data + fsGetDefaultVol, &r);
+					D(bug("  UTGetDefaultVol() returned %d, dirID %d\n", r.d[0], ReadMacInt32(wdpb + ioWDDirID)));
+					result = (int16)(r.d[0] & 0xffff);
+					if (result == noErr)
+						current_dir = ReadMacInt32(wdpb + ioWDDirID);
+				}
+				break;
+
+			default:
+				result = paramErr;
+				break;
+		}
+	}
+	return result;
+}
+
+
+/*
+ *  Get path and FSItem of an object specified by ParamBlock/dirID and
+ *  ioNamePtr (-> full_path). Path names are parsed here: a leading colon
+ *  makes them relative, every further colon goes up one directory, and a
+ *  path without leading colon starts with the volume name.
+ */
+
+static int16 get_item_and_path(uint32 pb, uint32 dirID, FSItem *&item, bool no_vol_name = false)
+{
+	// Find FSItem for parent directory
+	int16 result;
+	uint32 current_dir;
+	if ((result = get_current_dir(pb, dirID, current_dir, no_vol_name)) != noErr)
+		return result;
+	D(bug("  current dir %08x\n", current_dir));
+	FSItem *p = find_fsitem_by_id(current_dir);
+	if (p == NULL)
+		return dirNFErr;
+
+	// Start parsing
+	uint32 name_ptr = ReadMacInt32(pb + ioNamePtr);
+	if (no_vol_name || name_ptr == 0 || ReadMacInt8(name_ptr) == 0) {
+		item = p;
+		get_path_for_fsitem(item);
+		return noErr;
+	}
+	char name[256];
+	int len = ReadMacInt8(name_ptr);
+	Mac2Host_memcpy(name, name_ptr + 1, len);
+	name[len] = 0;
+	D(bug("  path name %s\n", name));
+
+	int i = 0;
+	if (name[0] == ':')
+		i++;				// Relative path name
+	else if (current_dir != ROOT_PARENT_ID && strchr(name, ':'))
+		p = find_fsitem_by_id(ROOT_PARENT_ID);	// Full path name
+	while (i < len) {
+
+		// One or more colons go up in the hierarchy
+		if (name[i] == ':') {
+			if (p->parent == NULL || p->id == ROOT_ID)
+				return bdNamErr;
+			p = p->parent;
+			i++;
+			continue;
+		}
+
+		// Get next component
+		char component[32];
+		int n = 0;
+		while (i < len && name[i] != ':') {
+			if (n >= 31)
+				return bdNamErr;
+			component[n++] = name[i++];
+		}
+		component[n] = 0;
+		bool last = i >= len || i == len - 1;
+		if (i < len)
+			i++;			// Skip delimiter
+
+		// Find or create item
+		FSItem *q = find_fsitem_guest(component, p);
+		if (q == NULL)
+			return p->id == ROOT_PARENT_ID ? nsvErr : memFullErr;
+		if (!last) {
+			extfs_stat_info st;
+			get_path_for_fsitem(q);
+			if (!extfs_stat(full_path, &st) || !st.is_dir)
+				return dirNFErr;
+		}
+		p = q;
+	}
+
+	item = p;
+	get_path_for_fsitem(item);
+	return noErr;
+}
+
+
+/*
+ *  Find FCB for given file RefNum
+ */
+
+static uint32 find_fcb(int16 refNum)
+{
+	D(bug("  finding FCB\n"));
+	M68kRegisters r;
+	r.d[0] = refNum;
+	r.a[0] = fs_data + fsReturn;
+	Execute68k(fs_data + fsResolveFCB, &r);
+	uint32 fcb = ReadMacInt32(fs_data + fsReturn);
+	D(bug("  UTResolveFCB() returned %d, fcb %08lx\n", r.d[0], fcb));
+	if (r.d[0] & 0xffff)
+		return 0;
+	else
+		return fcb;
+}
+
+
+/*
+ *  HFS interface functions
+ */
+
+// Check if volume belongs to our FS
+static int16 fs_mount_vol(uint32 pb)
+{
+	D(bug(" fs_mount_vol(%08lx), vRefNum %d\n", pb, ReadMacInt16(pb + ioVRefNum)));
+	if ((int16)ReadMacInt16(pb + ioVRefNum) == drive_number)
+		return noErr;
+	else
+		return extFSErr;
+}
+
+// Mount volume
+static int16 fs_volume_mount(uint32 pb)
+{
+	D(bug(" fs_volume_mount(%08lx)\n", pb));
+	M68kRegisters r;
+
+	// Create new VCB
+	D(bug("  creating VCB\n"));
+	r.a[0] = fs_data + fsReturn;
+	r.a[1] = fs_data + fsReturn + 2;
+	r.d[0] = 0;
+	Execute68k(fs_data + fsAllocateVCB, &r);
+	uint32 vcb = ReadMacInt32(fs_data + fsReturn + 2);
+	D(bug("  UTAllocateVCB() returned %d, vcb %08lx, size %d\n", r.d[0], vcb, ReadMacInt16(fs_data + fsReturn)));
+	if (r.d[0] & 0xffff)
+		return (int16)r.d[0];
+
+	// Init VCB
+	WriteMacInt16(vcb + vcbSigWord, 0x4244);
+	WriteMacInt32(vcb + vcbCrDate, TimeToMacTime(root_mtime));
+	WriteMacInt32(vcb + vcbLsMod, TimeToMacTime(root_mtime));
+	WriteMacInt32(vcb + vcbVolBkUp, 0);
+	WriteMacInt16(vcb + vcbNmFls, 1);			//!!
+	WriteMacInt16(vcb + vcbNmRtDirs, 1);		//!!
+	WriteMacInt16(vcb + vcbNmAlBlks, 0xffff);	//!!
+	WriteMacInt32(vcb + vcbAlBlkSiz, AL_BLOCK_SIZE);
+	WriteMacInt32(vcb + vcbClpSiz, CLUMP_SIZE);
+	WriteMacInt32(vcb + vcbNxtCNID, next_cnid);
+	WriteMacInt16(vcb + vcbFreeBks, 0xffff);	//!!
+	Host2Mac_memcpy(vcb + vcbVN, VOLUME_NAME, 28);
+	WriteMacInt16(vcb + vcbFSID, MY_FSID);
+	WriteMacInt32(vcb + vcbFilCnt, 1);			//!!
+	WriteMacInt32(vcb + vcbDirCnt, 1);			//!!
+
+	// Add VCB to VCB queue
+	D(bug("  adding VCB to queue\n"));
+	r.d[0] = drive_number;
+	r.a[0] = fs_data + fsReturn;
+	r.a[1] = vcb;
+	Execute68k(fs_data + fsAddNewVCB, &r);
+	int16 vRefNum = (int16)ReadMacInt16(fs_data + fsReturn);
+	D(bug("  UTAddNewVCB() returned %d, vRefNum %d\n", r.d[0], vRefNum));
+	if (r.d[0] & 0xffff)
+		return (int16)r.d[0];
+
+	// Post diskInsertEvent
+	D(bug("  posting diskInsertEvent\n"));
+	r.d[0] = drive_number;
+	r.a[0] = 7;	// diskEvent
+	Execute68kTrap(0xa02f, &r);		// PostEvent()
+
+	// Return volume RefNum
+	WriteMacInt16(pb + ioVRefNum, vRefNum);
+	return noErr;
+}
+
+// Unmount volume
+static int16 fs_unmount_vol(uint32 vcb)
+{
+	D(bug(" fs_unmount_vol(%08lx), vRefNum %d\n", vcb, ReadMacInt16(vcb + vcbVRefNum)));
+	M68kRegisters r;
+
+	// Remove and free VCB
+	D(bug("  freeing VCB\n"));
+	r.a[0] = vcb;
+	Execute68k(fs_data + fsDisposeVCB, &r);
+	D(bug("  UTDisposeVCB() returned %d\n", r.d[0]));
+	return (int16)r.d[0];
+}
+
+// Get information about a volume (HVolumeParam)
+static int16 fs_get_vol_info(uint32 pb, bool hfs, uint32 vcb)
+{
+	D(bug(" fs_get_vol_info(%08lx)\n", pb));
+
+	// Free space on the card, in our fake allocation blocks
+	uint64 free_blocks = extfs_free_bytes() / AL_BLOCK_SIZE;
+	if (free_blocks > 0xffff)
+		free_blocks = 0xffff;
+	int root_files = extfs_dir_count(RootPath);
+	if (root_files < 0)
+		root_files = 0;
+
+	// Set parameters
+	if (ReadMacInt32(pb + ioNamePtr))
+		pstrcpy((char *)Mac2HostAddr(ReadMacInt32(pb + ioNamePtr)), VOLUME_NAME);
+	WriteMacInt16(pb + ioVRefNum, ReadMacInt16(vcb + vcbVRefNum));
+	WriteMacInt32(pb + ioVCrDate, TimeToMacTime(root_mtime));
+	WriteMacInt32(pb + ioVLsMod, TimeToMacTime(root_mtime));
+	WriteMacInt16(pb + ioVAtrb, 0);
+	WriteMacInt16(pb + ioVNmFls, root_files);
+	WriteMacInt16(pb + ioVBitMap, 0);
+	WriteMacInt16(pb + ioAllocPtr, 0);
+	WriteMacInt16(pb + ioVNmAlBlks, 0xffff);	//!!
+	WriteMacInt32(pb + ioVAlBlkSiz, AL_BLOCK_SIZE);
+	WriteMacInt32(pb + ioVClpSiz, CLUMP_SIZE);
+	WriteMacInt16(pb + ioAlBlSt, 0);
+	WriteMacInt32(pb + ioVNxtCNID, next_cnid);
+	WriteMacInt16(pb + ioVFrBlk, free_blocks);
+	if (hfs) {
+		WriteMacInt16(pb + ioVDrvInfo, drive_number);
+		WriteMacInt16(pb + ioVDRefNum, ReadMacInt16(fs_data + fsDrvStatus + dsQRefNum));
+		WriteMacInt16(pb + ioVFSID, MY_FSID);
+		WriteMacInt32(pb + ioVBkUp, 0);
+		WriteMacInt16(pb + ioVSeqNum, 0);
+		WriteMacInt32(pb + ioVWrCnt, 0);
+		WriteMacInt32(pb + ioVFilCnt, 1);			//!!
+		WriteMacInt32(pb + ioVDirCnt, 1);			//!!
+		Mac_memset(pb + ioVFndrInfo, 0, 32);
+	}
+	return noErr;
+}
+
+// Change volume information (HVolumeParam)
+static int16 fs_set_vol_info(uint32 pb)
+{
+	D(bug(" fs_set_vol_info(%08lx)\n", pb));
+
+	//!! times
+	return noErr;
+}
+
+// Get volume parameter block
+static int16 fs_get_vol_parms(uint32 pb)
+{
+	D(bug(" fs_get_vol_parms(%08lx)\n", pb));
+
+	// Return parameter block
+	uint32 actual = ReadMacInt32(pb + ioReqCount);
+	if (actual > SIZEOF_GetVolParmsInfoBuffer)
+		actual = SIZEOF_GetVolParmsInfoBuffer;
+	WriteMacInt32(pb + ioActCount, actual);
+	uint32 p = ReadMacInt32(pb + ioBuffer);
+	if (actual > vMVersion) WriteMacInt16(p + vMVersion, 2);
+	if (actual > vMAttrib) WriteMacInt32(p + vMAttrib, kNoMiniFndr | kNoVNEdit | kNoLclSync | kTrshOffLine | kNoSwitchTo | kNoBootBlks | kNoSysDir | kHasExtFSVol);
+	if (actual > vMLocalHand) WriteMacInt32(p + vMLocalHand, 0);
+	if (actual > vMServerAdr) WriteMacInt32(p + vMServerAdr, 0);
+	if (actual > vMVolumeGrade) WriteMacInt32(p + vMVolumeGrade, 0);
+	if (actual > vMForeignPrivID) WriteMacInt16(p + vMForeignPrivID, 0);
+	return noErr;
+}
+
+// Get default volume (WDParam)
+static int16 fs_get_vol(uint32 pb)
+{
+	D(bug(" fs_get_vol(%08lx)\n", pb));
+	M68kRegisters r;
+
+	// Getting default volume
+	D(bug("  getting default volume\n"));
+	r.a[0] = pb;
+	Execute68k(fs_data + fsGetDefaultVol, &r);
+	D(bug("  UTGetDefaultVol() returned %d\n", r.d[0]));
+	return (int16)r.d[0];
+}
+
+// Set default volume (WDParam)
+static int16 fs_set_vol(uint32 pb, bool hfs, uint32 vcb)
+{
+	D(bug(" fs_set_vol(%08lx), vRefNum %d, name %.31s, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt32(pb + ioWDDirID)));
+	M68kRegisters r;
+
+	// Determine parameters
+	uint32 dirID;
+	int16 refNum;
+	if (hfs) {
+
+		// Find FSItem for given dir
+		FSItem *fs_item;
+		int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioWDDirID), fs_item);
+		if (result != noErr)
+			return result;
+
+		// Is it a directory?
+		extfs_stat_info st;
+		if (!extfs_stat(full_path, &st))
+			return dirNFErr;
+		if (!st.is_dir)
+			return dirNFErr;
+
+		// Get dirID and refNum
+		dirID = fs_item->id;
+		refNum = ReadMacInt16(vcb + vcbVRefNum);
+
+	} else {
+
+		// Is the given vRefNum a working directory number?
+		D(bug("  checking for WDRefNum\n"));
+		r.d[0] = ReadMacInt16(pb + ioVRefNum);
+		Execute68k(fs_data + fsCheckWDRefNum, &r);
+		D(bug("  UTCheckWDRefNum() returned %d\n", r.d[0]));
+		if (r.d[0] & 0xffff) {
+			// Volume refNum
+			dirID = ROOT_ID;
+			refNum = ReadMacInt16(vcb + vcbVRefNum);
+		} else {
+			// WD refNum
+			dirID = 0;
+			refNum = ReadMacInt16(pb + ioVRefNum);
+		}
+	}
+
+	// Setting default volume
+	D(bug("  setting default volume\n"));
+	r.d[0] = 0;
+	r.d[1] = dirID;
+	r.d[2] = refNum;
+	Execute68k(fs_data + fsSetDefaultVol, &r);
+	D(bug("  UTSetDefaultVol() returned %d\n", r.d[0]));
+	return (int16)r.d[0];
+}
+
+// Query file attributes (HFileParam)
+static int16 fs_get_file_info(uint32 pb, bool hfs, uint32 dirID)
+{
+	D(bug(" fs_get_file_info(%08lx), vRefNum %d, name %.31s, idx %d, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt16(pb + ioFDirIndex), dirID));
+
+	FSItem *fs_item;
+	int16 dir_index = ReadMacInt16(pb + ioFDirIndex);
+	extfs_stat_info st;
+	if (dir_index <= 0) {		// Query item specified by ioDirID and ioNamePtr
+
+		// Find FSItem for given file
+		int16 result = get_item_and_path(pb, dirID, fs_item);
+		if (result != noErr)
+			return result;
+		if (!extfs_stat(full_path, &st))
+			return errno2oserr();
+		if (st.is_dir)
+			return fnfErr;
+
+	} else {					// Query item in directory specified by ioDirID by index
+
+		// Find FSItem for parent directory
+		int16 result;
+		uint32 current_dir;
+		if ((result = get_current_dir(pb, dirID, current_dir, true)) != noErr)
+			return result;
+		FSItem *p = find_fsitem_by_id(current_dir);
+		if (p == NULL)
+			return dirNFErr;
+		get_path_for_fsitem(p);
+		char dir_path[MAX_PATH_LENGTH];
+		strcpy(dir_path, full_path);
+
+		// Look for nth file in directory (directories don't count here)
+		int count = extfs_dir_count(dir_path);
+		int files = 0;
+		for (int i = 0; ; i++) {
+			if (i >= count)
+				return fnfErr;
+			const char *name = extfs_dir_entry(dir_path, i);
+			if (name == NULL)
+				return fnfErr;
+			fs_item = find_fsitem(name, p);
+			if (fs_item == NULL)
+				return memFullErr;
+			get_path_for_fsitem(fs_item);
+			if (!extfs_stat(full_path, &st))
+				return errno2oserr();
+			if (!st.is_dir && ++files == dir_index)
+				break;
+		}
+	}
+
+	// Fill in struct from fs_item and stats
+	if (ReadMacInt32(pb + ioNamePtr))
+		cstr2pstr((char *)Mac2HostAddr(ReadMacInt32(pb + ioNamePtr)), fs_item->guest_name);
+	WriteMacInt16(pb + ioFRefNum, 0);
+	WriteMacInt8(pb + ioFlAttrib, st.read_only ? faLocked : 0);
+	WriteMacInt32(pb + ioDirID, fs_item->id);
+	WriteMacInt32(pb + ioFlCrDat, TimeToMacTime(st.mtime));
+	WriteMacInt32(pb + ioFlMdDat, TimeToMacTime(st.mtime));
+
+	get_finfo(full_path, pb + ioFlFndrInfo, hfs ? pb + ioFlXFndrInfo : 0, false);
+
+	WriteMacInt16(pb + ioFlStBlk, 0);
+	WriteMacInt32(pb + ioFlLgLen, st.size);
+	WriteMacInt32(pb + ioFlPyLen, (st.size | (AL_BLOCK_SIZE - 1)) + 1);
+	WriteMacInt16(pb + ioFlRStBlk, 0);
+	uint32 rf_size = get_rfork_size(full_path);
+	WriteMacInt32(pb + ioFlRLgLen, rf_size);
+	WriteMacInt32(pb + ioFlRPyLen, (rf_size | (AL_BLOCK_SIZE - 1)) + 1);
+
+	if (hfs) {
+		WriteMacInt32(pb + ioFlBkDat, 0);
+		WriteMacInt32(pb + ioFlParID, fs_item->parent_id);
+		WriteMacInt32(pb + ioFlClpSiz, 0);
+	}
+	return noErr;
+}
+
+// Set file attributes (HFileParam)
+static int16 fs_set_file_info(uint32 pb, bool hfs, uint32 dirID)
+{
+	D(bug(" fs_set_file_info(%08lx), vRefNum %d, name %.31s, idx %d, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt16(pb + ioFDirIndex), dirID));
+
+	// Find FSItem for given file/dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, dirID, fs_item);
+	if (result != noErr)
+		return result;
+
+	// Get stats
+	extfs_stat_info st;
+	if (!extfs_stat(full_path, &st))
+		return errno2oserr();
+	if (st.is_dir)
+		return fnfErr;
+
+	// Set Finder info
+	set_finfo(full_path, pb + ioFlFndrInfo, hfs ? pb + ioFlXFndrInfo : 0, false);
+
+	//!! times
+	return noErr;
+}
+
+// Query file/directory attributes
+static int16 fs_get_cat_info(uint32 pb)
+{
+	D(bug(" fs_get_cat_info(%08lx), vRefNum %d, name %.31s, idx %d, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt16(pb + ioFDirIndex), ReadMacInt32(pb + ioDirID)));
+
+	FSItem *fs_item;
+	int16 dir_index = ReadMacInt16(pb + ioFDirIndex);
+	extfs_stat_info st;
+	if (dir_index < 0) {			// Query directory specified by ioDirID
+
+		// Find FSItem for directory
+		fs_item = find_fsitem_by_id(ReadMacInt32(pb + ioDrDirID));
+		if (fs_item == NULL)
+			return dirNFErr;
+		get_path_for_fsitem(fs_item);
+
+	} else if (dir_index == 0) {	// Query item specified by ioDirID and ioNamePtr
+
+		// Find FSItem for given file/dir
+		int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioDirID), fs_item);
+		if (result != noErr)
+			return result;
+
+	} else {						// Query item in directory specified by ioDirID by index
+
+		// Find FSItem for parent directory
+		int16 result;
+		uint32 current_dir;
+		if ((result = get_current_dir(pb, ReadMacInt32(pb + ioDirID), current_dir, true)) != noErr)
+			return result;
+		FSItem *p = find_fsitem_by_id(current_dir);
+		if (p == NULL)
+			return dirNFErr;
+		get_path_for_fsitem(p);
+
+		// Look for nth item in directory (the host side keeps the listing)
+		const char *name = extfs_dir_entry(full_path, dir_index - 1);
+		if (name == NULL)
+			return fnfErr;
+		fs_item = find_fsitem(name, p);
+		if (fs_item == NULL)
+			return memFullErr;
+		get_path_for_fsitem(fs_item);
+	}
+
+	// Get stats
+	if (fs_item->id == ROOT_ID) {
+		st.is_dir = true;
+		st.read_only = false;
+		st.size = 0;
+		st.mtime = root_mtime;
+	} else if (!extfs_stat(full_path, &st))
+		return errno2oserr();
+	if (dir_index == -1 && !st.is_dir)
+		return dirNFErr;
+
+	// Fill in struct from fs_item and stats
+	if (ReadMacInt32(pb + ioNamePtr))
+		cstr2pstr((char *)Mac2HostAddr(ReadMacInt32(pb + ioNamePtr)), fs_item->guest_name);
+	WriteMacInt16(pb + ioFRefNum, 0);
+	WriteMacInt8(pb + ioFlAttrib, (st.is_dir ? faIsDir : 0) | (st.read_only ? faLocked : 0));
+	WriteMacInt8(pb + ioACUser, 0);
+	WriteMacInt32(pb + ioDirID, fs_item->id);
+	WriteMacInt32(pb + ioFlParID, fs_item->parent_id);
+	WriteMacInt32(pb + ioFlCrDat, TimeToMacTime(st.mtime));
+	WriteMacInt32(pb + ioFlMdDat, TimeToMacTime(st.mtime));
+	WriteMacInt32(pb + ioFlBkDat, 0);
+
+	get_finfo(full_path, pb + ioFlFndrInfo, pb + ioFlXFndrInfo, st.is_dir);
+
+	if (st.is_dir) {
+
+		// Determine number of files in directory (excluding invisible files)
+		int count = extfs_dir_count(full_path);
+		WriteMacInt16(pb + ioDrNmFls, count < 0 ? 0 : count);
+	} else {
+		WriteMacInt16(pb + ioFlStBlk, 0);
+		WriteMacInt32(pb + ioFlLgLen, st.size);
+		WriteMacInt32(pb + ioFlPyLen, (st.size | (AL_BLOCK_SIZE - 1)) + 1);
+		WriteMacInt16(pb + ioFlRStBlk, 0);
+		uint32 rf_size = get_rfork_size(full_path);
+		WriteMacInt32(pb + ioFlRLgLen, rf_size);
+		WriteMacInt32(pb + ioFlRPyLen, (rf_size | (AL_BLOCK_SIZE - 1)) + 1);
+		WriteMacInt32(pb + ioFlClpSiz, 0);
+	}
+	return noErr;
+}
+
+// Set file/directory attributes
+static int16 fs_set_cat_info(uint32 pb)
+{
+	D(bug(" fs_set_cat_info(%08lx), vRefNum %d, name %.31s, idx %d, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt16(pb + ioFDirIndex), ReadMacInt32(pb + ioDirID)));
+
+	// Find FSItem for given file/dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioDirID), fs_item);
+	if (result != noErr)
+		return result;
+
+	// Get stats
+	extfs_stat_info st;
+	if (fs_item->id == ROOT_ID)
+		st.is_dir = true;
+	else if (!extfs_stat(full_path, &st))
+		return errno2oserr();
+
+	// Set Finder info
+	set_finfo(full_path, pb + ioFlFndrInfo, pb + ioFlXFndrInfo, st.is_dir);
+
+	//!! times
+	return noErr;
+}
+
+// Open file
+static int16 fs_open(uint32 pb, uint32 dirID, uint32 vcb, bool resource_fork)
+{
+	D(bug(" fs_open(%08lx), %s, vRefNum %d, name %.31s, dirID %d, perm %d\n", pb, resource_fork ? "rsrc" : "data", ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), dirID, ReadMacInt8(pb + ioPermssn)));
+	M68kRegisters r;
+
+	// Find FSItem for given file
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, dirID, fs_item);
+	if (result != noErr)
+		return result;
+
+	// Convert ioPermssn to open() flag
+	extfs_stat_info st;
+	if (!extfs_stat(full_path, &st))
+		return errno2oserr();
+	if (st.is_dir)
+		return fnfErr;
+	bool write_ok = !st.read_only;
+	int flag = 0;
+	switch (ReadMacInt8(pb + ioPermssn)) {
+		case fsCurPerm:		// Whatever is currently allowed
+			if (write_ok)
+				flag = O_RDWR;
+			else
+				flag = O_RDONLY;
+			break;
+		case fsRdPerm:		// Exclusive read
+			flag = O_RDONLY;
+			break;
+		case fsWrPerm:		// Exclusive write
+			flag = O_WRONLY;
+			break;
+		case fsRdWrPerm:	// Exclusive read/write
+		case fsRdWrShPerm:	// Shared read/write
+		default:
+			flag = O_RDWR;
+			break;
+	}
+	if (flag != O_RDONLY && !write_ok)
+		return permErr;
+
+	// Try to open the file
+	int fd;
+	uint32 size;
+	if (resource_fork) {
+		fd = open_rfork(full_path, flag);
+		size = get_rfork_size(full_path);
+	} else {
+		fd = extfs_open(full_path, flag);
+		size = st.size;
+	}
+	if (fd < 0)
+		return errno2oserr();
+
+	// File open, allocate FCB
+	D(bug("  allocating FCB\n"));
+	r.a[0] = pb + ioRefNum;
+	r.a[1] = fs_data + fsReturn;
+	Execute68k(fs_data + fsAllocateFCB, &r);
+	uint32 fcb = ReadMacInt32(fs_data + fsReturn);
+	D(bug("  UTAllocateFCB() returned %d, fRefNum %d, fcb %08lx\n", r.d[0], ReadMacInt16(pb + ioRefNum), fcb));
+	if (r.d[0] & 0xffff) {
+		if (resource_fork)
+			close_rfork(full_path, fd);
+		else
+			extfs_close(fd);
+		return (int16)r.d[0];
+	}
+
+	// Initialize FCB, fd is stored in fcbCatPos
+	WriteMacInt32(fcb + fcbFlNm, fs_item->id);
+	WriteMacInt8(fcb + fcbFlags, ((flag == O_WRONLY || flag == O_RDWR) ? fcbWriteMask : 0) | (resource_fork ? fcbResourceMask : 0) | (write_ok ? 0 : fcbFileLockedMask));
+	WriteMacInt32(fcb + fcbEOF, size);
+	WriteMacInt32(fcb + fcbPLen, (size | (AL_BLOCK_SIZE - 1)) + 1);
+	WriteMacInt32(fcb + fcbCrPs, 0);
+	WriteMacInt32(fcb + fcbVPtr, vcb);
+	WriteMacInt32(fcb + fcbClmpSize, CLUMP_SIZE);
+
+	get_finfo(full_path, fs_data + fsPB, 0, false);
+	WriteMacInt32(fcb + fcbFType, ReadMacInt32(fs_data + fsPB + fdType));
+
+	WriteMacInt32(fcb + fcbCatPos, fd);
+	WriteMacInt32(fcb + fcbDirID, fs_item->parent_id);
+	cstr2pstr((char *)Mac2HostAddr(fcb + fcbCName), fs_item->guest_name);
+#if MAC_SNAPSHOT
+	open_forks++;
+#endif
+	return noErr;
+}
+
+// Close file
+static int16 fs_close(uint32 pb)
+{
+	D(bug(" fs_close(%08lx), refNum %d\n", pb, ReadMacInt16(pb + ioRefNum)));
+	M68kRegisters r;
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Close file
+	if (ReadMacInt8(fcb + fcbFlags) & fcbResourceMask) {
+		FSItem *item = find_fsitem_by_id(ReadMacInt32(fcb + fcbFlNm));
+		if (item) {
+			get_path_for_fsitem(item);
+			close_rfork(full_path, fd);
+		}
+	} else
+		extfs_close(fd);
+	WriteMacInt32(fcb + fcbCatPos, (uint32)-1);
+#if MAC_SNAPSHOT
+	open_forks--;
+#endif
+
+	// Release FCB
+	D(bug("  releasing FCB\n"));
+	r.d[0] = ReadMacInt16(pb + ioRefNum);
+	Execute68k(fs_data + fsReleaseFCB, &r);
+	D(bug("  UTReleaseFCB() returned %d\n", r.d[0]));
+	return (int16)r.d[0];
+}
+
+// Query information about FCB (FCBPBRec)
+static int16 fs_get_fcb_info(uint32 pb, uint32 vcb)
+{
+	D(bug(" fs_get_fcb_info(%08lx), vRefNum %d, refNum %d, idx %d\n", pb, ReadMacInt16(pb + ioVRefNum), ReadMacInt16(pb + ioRefNum), ReadMacInt16(pb + ioFCBIndx)));
+	M68kRegisters r;
+
+	uint32 fcb = 0;
+	if (ReadMacInt16(pb + ioFCBIndx) == 0) {	// Get information about single file
+
+		// Find FCB for file
+		fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+
+	} else {					// Get information about file specified by index
+
+		// Find FCB by index
+		WriteMacInt16(pb + ioRefNum, 0);
+		for (int i=0; i<(int)ReadMacInt16(pb + ioFCBIndx); i++) {
+			D(bug("  indexing FCBs\n"));
+			r.a[0] = vcb;
+			r.a[1] = pb + ioRefNum;
+			r.a[2] = fs_data + fsReturn;
+			Execute68k(fs_data + fsIndexFCB, &r);
+			fcb = ReadMacInt32(fs_data + fsReturn);
+			D(bug("  UTIndexFCB() returned %d, fcb %p\n", r.d[0], fcb));
+			if (r.d[0] & 0xffff)
+				return (int16)r.d[0];
+		}
+	}
+	if (fcb == 0)
+		return rfNumErr;
+
+	// Copy information from FCB
+	if (ReadMacInt32(pb + ioNamePtr))
+		pstrcpy((char *)Mac2HostAddr(ReadMacInt32(pb + ioNamePtr)), (char *)Mac2HostAddr(fcb + fcbCName));
+	WriteMacInt32(pb + ioFCBFlNm, ReadMacInt32(fcb + fcbFlNm));
+	WriteMacInt8(pb + ioFCBFlags, ReadMacInt8(fcb + fcbFlags));
+	WriteMacInt16(pb + ioFCBStBlk, ReadMacInt16(fcb + fcbSBlk));
+	WriteMacInt32(pb + ioFCBEOF, ReadMacInt32(fcb + fcbEOF));
+	WriteMacInt32(pb + ioFCBPLen, ReadMacInt32(fcb + fcbPLen));
+	WriteMacInt32(pb + ioFCBCrPs, ReadMacInt32(fcb + fcbCrPs));
+	WriteMacInt16(pb + ioFCBVRefNum, ReadMacInt16(ReadMacInt32(fcb + fcbVPtr) + vcbVRefNum));
+	WriteMacInt32(pb + ioFCBClpSiz, ReadMacInt32(fcb + fcbClmpSize));
+	WriteMacInt32(pb + ioFCBParID, ReadMacInt32(fcb + fcbDirID));
+	return noErr;
+}
+
+// Obtain logical size of an open file
+static int16 fs_get_eof(uint32 pb)
+{
+	D(bug(" fs_get_eof(%08lx), refNum %d\n", pb, ReadMacInt16(pb + ioRefNum)));
+	M68kRegisters r;
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Get file size
+	off_t size = extfs_lseek(fd, 0, SEEK_END);
+	if (size < 0)
+		return errno2oserr();
+
+	// Adjust FCBs
+	WriteMacInt32(fcb + fcbEOF, size);
+	WriteMacInt32(fcb + fcbPLen, (size | (AL_BLOCK_SIZE - 1)) + 1);
+	WriteMacInt32(pb + ioMisc, size);
+	D(bug("  adjusting FCBs\n"));
+	r.d[0] = ReadMacInt16(pb + ioRefNum);
+	Execute68k(fs_data + fsAdjustEOF, &r);
+	D(bug("  UTAdjustEOF() returned %d\n", r.d[0]));
+	return noErr;
+}
+
+// Truncate file
+static int16 fs_set_eof(uint32 pb)
+{
+	D(bug(" fs_set_eof(%08lx), refNum %d, size %d\n", pb, ReadMacInt16(pb + ioRefNum), ReadMacInt32(pb + ioMisc)));
+	M68kRegisters r;
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Truncate file
+	uint32 size = ReadMacInt32(pb + ioMisc);
+	if (!extfs_ftruncate(fd, size))
+		return errno2oserr();
+
+	// Adjust FCBs
+	WriteMacInt32(fcb + fcbEOF, size);
+	WriteMacInt32(fcb + fcbPLen, (size | (AL_BLOCK_SIZE - 1)) + 1);
+	D(bug("  adjusting FCBs\n"));
+	r.d[0] = ReadMacInt16(pb + ioRefNum);
+	Execute68k(fs_data + fsAdjustEOF, &r);
+	D(bug("  UTAdjustEOF() returned %d\n", r.d[0]));
+	return noErr;
+}
+
+// Query current file position
+static int16 fs_get_fpos(uint32 pb)
+{
+	D(bug(" fs_get_fpos(%08lx), refNum %d\n", pb, ReadMacInt16(pb + ioRefNum)));
+
+	WriteMacInt32(pb + ioReqCount, 0);
+	WriteMacInt32(pb + ioActCount, 0);
+	WriteMacInt16(pb + ioPosMode, 0);
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Get file position
+	off_t pos = extfs_lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return errno2oserr();
+	WriteMacInt32(fcb + fcbCrPs, pos);
+	WriteMacInt32(pb + ioPosOffset, pos);
+	return noErr;
+}
+
+// Set current file position
+static int16 fs_set_fpos(uint32 pb)
+{
+	D(bug(" fs_set_fpos(%08lx), refNum %d, posMode %d, offset %d\n", pb, ReadMacInt16(pb + ioRefNum), ReadMacInt16(pb + ioPosMode), ReadMacInt32(pb + ioPosOffset)));
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Set file position
+	switch (ReadMacInt16(pb + ioPosMode) & 3) {
+		case fsAtMark:
+			break;
+		case fsFromStart:
+			if (extfs_lseek(fd, (int32)ReadMacInt32(pb + ioPosOffset), SEEK_SET) < 0)
+				return posErr;
+			break;
+		case fsFromLEOF:
+			if (extfs_lseek(fd, (int32)ReadMacInt32(pb + ioPosOffset), SEEK_END) < 0)
+				return posErr;
+			break;
+		case fsFromMark:
+			if (extfs_lseek(fd, (int32)ReadMacInt32(pb + ioPosOffset), SEEK_CUR) < 0)
+				return posErr;
+			break;
+	}
+
+	// Update FCB position
+	off_t pos = extfs_lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return errno2oserr();
+	WriteMacInt32(fcb + fcbCrPs, pos);
+	WriteMacInt32(pb + ioPosOffset, pos);
+	return noErr;
+}
+
+// Position the file for a read or write call (IOParam)
+static bool seek_for_io(uint32 pb, int fd)
+{
+	switch (ReadMacInt16(pb + ioPosMode) & 3) {
+		case fsFromStart:
+			return extfs_lseek(fd, (int32)ReadMacInt32(pb + ioPosOffset), SEEK_SET) >= 0;
+		case fsFromLEOF:
+			return extfs_lseek(fd, (int32)ReadMacInt32(pb + ioPosOffset), SEEK_END) >= 0;
+		case fsFromMark:
+			return extfs_lseek(fd, (int32)ReadMacInt32(pb + ioPosOffset), SEEK_CUR) >= 0;
+	}
+	return true;
+}
+
+// Read from file
+static int16 fs_read(uint32 pb)
+{
+	D(bug(" fs_read(%08lx), refNum %d, buffer %p, count %d, posMode %d, posOffset %d\n", pb, ReadMacInt16(pb + ioRefNum), ReadMacInt32(pb + ioBuffer), ReadMacInt32(pb + ioReqCount), ReadMacInt16(pb + ioPosMode), ReadMacInt32(pb + ioPosOffset)));
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Seek
+	if (!seek_for_io(pb, fd))
+		return posErr;
+
+	// Read (the buffer may receive code, like a driver read)
+	uint32 count = ReadMacInt32(pb + ioReqCount);
+	uint8 *buffer = Mac2HostAddr(ReadMacInt32(pb + ioBuffer));
+	ssize_t actual = extfs_read(fd, buffer, count);
+	int16 read_err = errno2oserr();
+	D(bug("  actual %d\n", actual));
+	WriteMacInt32(pb + ioActCount, actual >= 0 ? actual : 0);
+	if (actual > 0)
+		FlushCodeCache(buffer, actual);
+	off_t pos = extfs_lseek(fd, 0, SEEK_CUR);
+	WriteMacInt32(fcb + fcbCrPs, pos);
+	WriteMacInt32(pb + ioPosOffset, pos);
+	if (actual != (ssize_t)count)
+		return actual < 0 ? read_err : eofErr;
+	else
+		return noErr;
+}
+
+// Write to file
+static int16 fs_write(uint32 pb)
+{
+	D(bug(" fs_write(%08lx), refNum %d, buffer %p, count %d, posMode %d, posOffset %d\n", pb, ReadMacInt16(pb + ioRefNum), ReadMacInt32(pb + ioBuffer), ReadMacInt32(pb + ioReqCount), ReadMacInt16(pb + ioPosMode), ReadMacInt32(pb + ioPosOffset)));
+
+	// Find FCB and fd for file
+	uint32 fcb = find_fcb(ReadMacInt16(pb + ioRefNum));
+	if (fcb == 0)
+		return rfNumErr;
+	if (ReadMacInt32(fcb + fcbFlNm) == 0)
+		return fnOpnErr;
+	int fd = ReadMacInt32(fcb + fcbCatPos);
+
+	// Seek
+	if (!seek_for_io(pb, fd))
+		return posErr;
+
+	// Write
+	ssize_t actual = extfs_write(fd, Mac2HostAddr(ReadMacInt32(pb + ioBuffer)), ReadMacInt32(pb + ioReqCount));
+	int16 write_err = errno2oserr();
+	D(bug("  actual %d\n", actual));
+	WriteMacInt32(pb + ioActCount, actual >= 0 ? actual : 0);
+	off_t pos = extfs_lseek(fd, 0, SEEK_CUR);
+	WriteMacInt32(fcb + fcbCrPs, pos);
+	WriteMacInt32(pb + ioPosOffset, pos);
+	if (pos > (off_t)ReadMacInt32(fcb + fcbEOF)) {
+		WriteMacInt32(fcb + fcbEOF, pos);
+		WriteMacInt32(fcb + fcbPLen, (pos | (AL_BLOCK_SIZE - 1)) + 1);
+		M68kRegisters r;
+		r.d[0] = ReadMacInt16(pb + ioRefNum);
+		Execute68k(fs_data + fsAdjustEOF, &r);
+	}
+	if (actual != (ssize_t)ReadMacInt32(pb + ioReqCount))
+		return write_err != noErr ? write_err : dskFulErr;
+	else
+		return noErr;
+}
+
+// Create file
+static int16 fs_create(uint32 pb, uint32 dirID)
+{
+	D(bug(" fs_create(%08lx), vRefNum %d, name %.31s, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), dirID));
+
+	// Find FSItem for given file
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, dirID, fs_item);
+	if (result != noErr)
+		return result;
+
+	// Does the file already exist?
+	extfs_stat_info st;
+	if (extfs_stat(full_path, &st))
+		return dupFNErr;
+
+	// Create file
+	if (!extfs_create(full_path, false))
+		return errno2oserr();
+	return noErr;
+}
+
+// Create directory
+static int16 fs_dir_create(uint32 pb)
+{
+	D(bug(" fs_dir_create(%08lx), vRefNum %d, name %.31s, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt32(pb + ioDirID)));
+
+	// Find FSItem for given directory
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioDirID), fs_item);
+	if (result != noErr)
+		return result;
+
+	// Does the directory already exist?
+	extfs_stat_info st;
+	if (extfs_stat(full_path, &st))
+		return dupFNErr;
+
+	// Create directory
+	if (!extfs_create(full_path, true))
+		return errno2oserr();
+
+	// Return directory ID
+	WriteMacInt32(pb + ioDirID, fs_item->id);
+	return noErr;
+}
+
+// Delete file/directory
+static int16 fs_delete(uint32 pb, uint32 dirID)
+{
+	D(bug(" fs_delete(%08lx), vRefNum %d, name %.31s, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), dirID));
+
+	// Find FSItem for given file/dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, dirID, fs_item);
+	if (result != noErr)
+		return result;
+	if (fs_item->id == ROOT_ID)
+		return fBsyErr;
+
+	// Delete file
+	if (!extfs_remove(full_path))
+		return errno2oserr();
+	return noErr;
+}
+
+// Rename file/directory
+static int16 fs_rename(uint32 pb, uint32 dirID)
+{
+	D(bug(" fs_rename(%08lx), vRefNum %d, name %.31s, dirID %d, new name %.31s\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), dirID, Mac2HostAddr(ReadMacInt32(pb + ioMisc) + 1)));
+
+	// Find path of given file/dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, dirID, fs_item);
+	if (result != noErr)
+		return result;
+	if (fs_item->id == ROOT_ID)
+		return noErr;		// Volume renames are not passed on
+	extfs_stat_info st;
+	if (!extfs_stat(full_path, &st))
+		return errno2oserr();
+
+	// Save path of existing item
+	char old_path[MAX_PATH_LENGTH];
+	strcpy(old_path, full_path);
+
+	// Find path for new name
+	uint32 new_name = ReadMacInt32(pb + ioMisc);
+	if (new_name == 0 || ReadMacInt8(new_name) == 0 || ReadMacInt8(new_name) > 31)
+		return bdNamErr;
+	char name[32];
+	Mac2Host_memcpy(name, new_name + 1, ReadMacInt8(new_name));
+	name[ReadMacInt8(new_name)] = 0;
+	if (strchr(name, ':'))
+		return bdNamErr;
+	char new_host_name[256];
+	strncpy(new_host_name, macroman_to_host_encoding(name), 255);
+	new_host_name[255] = 0;
+	get_path_for_fsitem(fs_item->parent);
+	add_path_component(full_path, new_host_name);
+	D(bug("  new path %s\n", full_path));
+
+	// Does the new name already exist (other than by a change of case)?
+	extfs_stat_info new_st;
+	if (strcasecmp(old_path, full_path) && extfs_stat(full_path, &new_st))
+		return dupFNErr;
+
+	// Rename item and keep its CNID
+	if (!extfs_rename(old_path, full_path))
+		return errno2oserr();
+	move_fsitem(fs_item, fs_item->parent, new_host_name);
+	return noErr;
+}
+
+// Move file/directory (CMovePBRec)
+static int16 fs_cat_move(uint32 pb)
+{
+	D(bug(" fs_cat_move(%08lx), vRefNum %d, name %.31s, dirID %d, new name %.31s, new dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt32(pb + ioDirID), Mac2HostAddr(ReadMacInt32(pb + ioNewName) + 1), ReadMacInt32(pb + ioNewDirID)));
+
+	// Find path of given file/dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioDirID), fs_item);
+	if (result != noErr)
+		return result;
+	if (fs_item->id == ROOT_ID)
+		return paramErr;
+	extfs_stat_info st;
+	if (!extfs_stat(full_path, &st))
+		return errno2oserr();
+
+	// Save path of existing item
+	char old_path[MAX_PATH_LENGTH];
+	strcpy(old_path, full_path);
+
+	// Find path for new directory
+	Mac2Mac_memcpy(fs_data + fsPB, pb, SIZEOF_IOParam);
+	WriteMacInt32(fs_data + fsPB + ioNamePtr, ReadMacInt32(pb + ioNewName));
+	FSItem *new_dir_item;
+	result = get_item_and_path(fs_data + fsPB, ReadMacInt32(pb + ioNewDirID), new_dir_item);
+	if (result != noErr)
+		return result;
+	if (!extfs_stat(full_path, &st) || !st.is_dir)
+		return dirNFErr;
+
+	// A directory can't be moved into itself or one of its subdirectories
+	for (FSItem *p = new_dir_item; p; p = p->parent)
+		if (p == fs_item)
+			return -122;	// badMovErr
+
+	// Append old file/dir name
+	add_path_component(full_path, fs_item->name);
+	D(bug("  new path %s\n", full_path));
+
+	// Does the new name already exist?
+	extfs_stat_info new_st;
+	if (extfs_stat(full_path, &new_st))
+		return dupFNErr;
+
+	// Move item and keep its CNID
+	if (!extfs_rename(old_path, full_path))
+		return errno2oserr();
+	char host_name[256];
+	strncpy(host_name, fs_item->name, 255);
+	host_name[255] = 0;
+	move_fsitem(fs_item, new_dir_item, host_name);
+	return noErr;
+}
+
+// Open working directory (WDParam)
+static int16 fs_open_wd(uint32 pb)
+{
+	D(bug(" fs_open_wd(%08lx), vRefNum %d, name %.31s, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt32(pb + ioWDDirID)));
+	M68kRegisters r;
+
+	// Find FSItem for given dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioWDDirID), fs_item, true);
+	if (result != noErr)
+		return result;
+
+	// Is it a directory?
+	extfs_stat_info st;
+	if (fs_item->id != ROOT_ID && (!extfs_stat(full_path, &st) || !st.is_dir))
+		return dirNFErr;
+
+	// Allocate WDCB
+	D(bug("  allocating WDCB\n"));
+	r.a[0] = pb;
+	WriteMacInt32(pb + ioWDDirID, fs_item->id);
+	Execute68k(fs_data + fsAllocateWDCB, &r);
+	D(bug("  UTAllocateWDCB returned %d, refNum is %d\n", r.d[0], ReadMacInt16(pb + ioVRefNum)));
+	return (int16)r.d[0];
+}
+
+// Close working directory (WDParam)
+static int16 fs_close_wd(uint32 pb)
+{
+	D(bug(" fs_close_wd(%08lx), vRefNum %d\n", pb, ReadMacInt16(pb + ioVRefNum)));
+	M68kRegisters r;
+
+	// Release WDCB
+	D(bug("  releasing WDCB\n"));
+	r.d[0] = ReadMacInt16(pb + ioVRefNum);
+	Execute68k(fs_data + fsReleaseWDCB, &r);
+	D(bug("  UTReleaseWDCB returned %d\n", r.d[0]));
+	return (int16)r.d[0];
+}
+
+// Query information about working directory (WDParam)
+static int16 fs_get_wd_info(uint32 pb, uint32 vcb)
+{
+	D(bug(" fs_get_wd_info(%08lx), vRefNum %d, idx %d, procID %d\n", pb, ReadMacInt16(pb + ioVRefNum), ReadMacInt16(pb + ioWDIndex), ReadMacInt32(pb + ioWDProcID)));
+	M68kRegisters r;
+
+	// Querying volume?
+	if (ReadMacInt16(pb + ioWDIndex) == 0 && ReadMacInt16(pb + ioVRefNum) == ReadMacInt16(vcb + vcbVRefNum)) {
+		WriteMacInt32(pb + ioWDProcID, 0);
+		WriteMacInt16(pb + ioWDVRefNum, ReadMacInt16(vcb + vcbVRefNum));
+		if (ReadMacInt32(pb + ioNamePtr))
+			Mac2Mac_memcpy(ReadMacInt32(pb + ioNamePtr), vcb + vcbVN, 28);
+		WriteMacInt32(pb + ioWDDirID, ROOT_ID);
+		return noErr;
+	}
+
+	// Resolve WDCB
+	D(bug("  resolving WDCB\n"));
+	r.d[0] = ReadMacInt32(pb + ioWDProcID);
+	r.d[1] = ReadMacInt16(pb + ioWDIndex);
+	r.d[2] = ReadMacInt16(pb + ioVRefNum);
+	r.a[0] = fs_data + fsReturn;
+	Execute68k(fs_data + fsResolveWDCB, &r);
+	uint32 wdcb = ReadMacInt32(fs_data + fsReturn);
+	D(bug("  UTResolveWDCB() returned %d, dirID %d\n", r.d[0], ReadMacInt32(wdcb + wdDirID)));
+	if (r.d[0] & 0xffff)
+		return (int16)r.d[0];
+
+	// Return information
+	WriteMacInt32(pb + ioWDProcID, ReadMacInt32(wdcb + wdProcID));
+	WriteMacInt16(pb + ioWDVRefNum, ReadMacInt16(ReadMacInt32(wdcb + wdVCBPtr) + vcbVRefNum));
+	if (ReadMacInt32(pb + ioNamePtr))
+		Mac2Mac_memcpy(ReadMacInt32(pb + ioNamePtr), ReadMacInt32(wdcb + wdVCBPtr) + vcbVN, 28);
+	WriteMacInt32(pb + ioWDDirID, ReadMacInt32(wdcb + wdDirID));
+	return noErr;
+}
+
+// Create FSSpec for file/directory (FSSpec goes to ioMisc)
+static int16 fs_make_fsspec(uint32 pb, uint32 vcb)
+{
+	D(bug(" fs_make_fsspec(%08lx), vRefNum %d, name %.31s, dirID %d\n", pb, ReadMacInt16(pb + ioVRefNum), Mac2HostAddr(ReadMacInt32(pb + ioNamePtr) + 1), ReadMacInt32(pb + ioDirID)));
+
+	// Find FSItem for given file/dir
+	FSItem *fs_item;
+	int16 result = get_item_and_path(pb, ReadMacInt32(pb + ioDirID), fs_item);
+	if (result != noErr)
+		return result;
+
+	// Fill in FSSpec (vRefNum, parID, name)
+	uint32 fsspec = ReadMacInt32(pb + ioMisc);
+	WriteMacInt16(fsspec, ReadMacInt16(vcb + vcbVRefNum));
+	WriteMacInt32(fsspec + 2, fs_item->parent_id);
+	cstr2pstr((char *)Mac2HostAddr(fsspec + 6), fs_item->guest_name);
+
+	// Does the object exist?
+	extfs_stat_info st;
+	if (fs_item->id != ROOT_ID && !extfs_stat(full_path, &st))
+		return fnfErr;
+	return noErr;
+}
+
+
+/*
+ *  HFS interface function
+ */
+
+int16 ExtFSHFS(uint32 vcb, uint16 selectCode, uint32 paramBlock, uint32 globalsPtr, int16 fsid)
+{
+	uint16 trapWord = selectCode & 0xf0ff;
+	bool hfs = selectCode & kHFSMask;
+	switch (trapWord) {
+		case kFSMOpen:
+			return fs_open(paramBlock, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0, vcb, false);
+
+		case kFSMClose:
+			return fs_close(paramBlock);
+
+		case kFSMRead:
+			return fs_read(paramBlock);
+
+		case kFSMWrite:
+			return fs_write(paramBlock);
+
+		case kFSMGetVolInfo:
+			return fs_get_vol_info(paramBlock, hfs, vcb);
+
+		case kFSMCreate:
+			return fs_create(paramBlock, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0);
+
+		case kFSMDelete:
+			return fs_delete(paramBlock, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0);
+
+		case kFSMOpenRF:
+			return fs_open(paramBlock, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0, vcb, true);
+
+		case kFSMRename:
+			return fs_rename(paramBlock, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0);
+
+		case kFSMGetFileInfo:
+			return fs_get_file_info(paramBlock, hfs, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0);
+
+		case kFSMSetFileInfo:
+			return fs_set_file_info(paramBlock, hfs, hfs ? ReadMacInt32(paramBlock + ioDirID) : 0);
+
+		case kFSMUnmountVol:
+			return fs_unmount_vol(vcb);
+
+		case kFSMMountVol:
+			return fs_mount_vol(paramBlock);
+
+		case kFSMAllocate:
+			D(bug(" allocate\n"));
+			WriteMacInt32(paramBlock + ioActCount, ReadMacInt32(paramBlock + ioReqCount));
+			return noErr;
+
+		case kFSMGetEOF:
+			return fs_get_eof(paramBlock);
+
+		case kFSMSetEOF:
+			return fs_set_eof(paramBlock);
+
+		case kFSMGetVol:
+			return fs_get_vol(paramBlock);
+
+		case kFSMSetVol:
+			return fs_set_vol(paramBlock, hfs, vcb);
+
+		case kFSMEject:
+			D(bug(" eject\n"));
+			return noErr;
+
+		case kFSMGetFPos:
+			return fs_get_fpos(paramBlock);
+
+		case kFSMOffline:
+			D(bug(" offline\n"));
+			return noErr;
+
+		case kFSMSetFilLock:
+			return noErr;	//!!
+
+		case kFSMRstFilLock:
+			return noErr;	//!!
+
+		case kFSMSetFPos:
+			return fs_set_fpos(paramBlock);
+
+		case kFSMOpenWD:
+			return fs_open_wd(paramBlock);
+
+		case kFSMCloseWD:
+			return fs_close_wd(paramBlock);
+
+		case kFSMCatMove:
+			return fs_cat_move(paramBlock);
+
+		case kFSMDirCreate:
+			return fs_dir_create(paramBlock);
+
+		case kFSMGetWDInfo:
+			return fs_get_wd_info(paramBlock, vcb);
+
+		case kFSMGetFCBInfo:
+			return fs_get_fcb_info(paramBlock, vcb);
+
+		case kFSMGetCatInfo:
+			return fs_get_cat_info(paramBlock);
+
+		case kFSMSetCatInfo:
+			return fs_set_cat_info(paramBlock);
+
+		case kFSMSetVolInfo:
+			return fs_set_vol_info(paramBlock);
+
+		case kFSMGetVolParms:
+			return fs_get_vol_parms(paramBlock);
+
+		case kFSMVolumeMount:
+			return fs_volume_mount(paramBlock);
+
+		case kFSMFlushVol:
+		case kFSMFlushFile:
+			D(bug(" flush_vol/flush_file\n"));
+			return noErr;
+
+		case kFSMOpenDF:
+			return fs_open(paramBlock, ReadMacInt32(paramBlock + ioDirID), vcb, false);
+
+		case kFSMMakeFSSpec:
+			return fs_make_fsspec(paramBlock, vcb);
+
+		default:
+			D(bug("ExtFSHFS(%08lx, %04x, %08lx, %08lx, %d)\n", vcb, selectCode, paramBlock, globalsPtr, fsid));
+			return paramErr;
+	}
+}
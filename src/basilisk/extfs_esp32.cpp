@@ -0,0 +1,1159 @@
+/*
+ *  extfs_esp32.cpp - MacOS file system for access to a folder on the SD card
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The "extfs" folder (card-relative path) shows up as a Mac volume.
+ *  Directory listings are read in one pass with f_readdir(), which returns
+ *  size, date and attributes with every name, and are kept sorted in PSRAM
+ *  (the last EXTFS_LISTINGS directories), so Finder browsing and the
+ *  File Manager's indexed GetCatInfo calls don't go back to the card.
+ *  Changes made through ExtFS update the cached listings in place.
+ *
+ *  Finder info and resource forks live in AppleDouble "._<name>" sidecar
+ *  files next to the data fork, as written by Mac OS X on FAT volumes.
+ *  The sidecar header is only read the first time the Finder info or fork
+ *  size of a file is needed, and the resource fork itself only when it is
+ *  opened. Sidecars are created on the first change of Finder info or the
+ *  first write to a resource fork. Files without sidecar get a type and
+ *  creator from their extension.
+ *
+ *  FAT can't hold all Mac file names: illegal characters and all bytes
+ *  >= 0x80 (MacRoman) are stored as "%XX".
+ */
+
+#include "sysdeps.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+
+#include "cpu_emulation.h"
+#include "extfs.h"
+#include "extfs_defs.h"
+#include "sd_esp32.h"
+
+#include "ff.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define EXTFS_LISTINGS      16      // Directory listings cached in PSRAM
+#define EXTFS_MAX_FDS       8       // Forks open at the same time
+#define FREE_SPACE_MS       5000    // Free space is recounted at most this often
+
+// AppleDouble sidecar layout (all values big-endian)
+#define AD_MAGIC            0x00051607
+#define AD_VERSION          0x00020000
+#define AD_HEADER_SIZE      26      // Magic, version, filler, entry count
+#define AD_ENTRY_SIZE       12      // ID, offset, length
+#define AD_MAX_ENTRIES      16
+#define AD_RFORK_ID         2
+#define AD_FINFO_ID         9
+#define AD_FINFO_SIZE       32      // FInfo + FXInfo
+
+// Our sidecars: header, Finder info, resource fork (last, so it can grow)
+#define AD_OUR_FINFO        (AD_HEADER_SIZE + 2 * AD_ENTRY_SIZE)
+#define AD_OUR_RFORK        (AD_OUR_FINFO + AD_FINFO_SIZE)
+
+// Entry flags
+enum {
+    ENTRY_DIR = 1,
+    ENTRY_READ_ONLY = 2,
+    ENTRY_SIDECAR = 4,          // "._<name>" exists
+    ENTRY_INFO = 8,             // finfo and rfork_* are valid
+    ENTRY_RFORK_LAST = 16       // Resource fork ends the sidecar
+};
+
+struct extfs_entry {
+    uint32 name;                // Offset of the host name in the name pool
+    uint32 size;                // Data fork length
+    time_t mtime;
+    uint8 flags;
+    uint8 finfo[AD_FINFO_SIZE]; // FInfo + FXInfo
+    uint32 finfo_offset;        // In the sidecar, 0 = none
+    uint32 rfork_offset;        // In the sidecar, 0 = none
+    uint32 rfork_length;
+};
+
+struct extfs_listing {
+    char *path;                 // Directory (card-relative), NULL = free slot
+    extfs_entry *entries;       // Visible entries, sorted by name
+    int count, capacity;
+    char *names;                // Name pool
+    uint32 names_used, names_capacity;
+    uint32 last_use;
+};
+
+struct extfs_fd {
+    bool used;
+    bool rfork;
+    bool header_dirty;          // Resource fork length changed
+    int fd;                     // Host fd, -1 = sidecar not created yet
+    uint32 base;                // Fork start in the host file
+    uint32 pos, size;
+    char path[MAX_PATH_LENGTH]; // Data fork path
+};
+
+static extfs_listing listings[EXTFS_LISTINGS];
+static uint32 listing_clock = 0;
+static extfs_fd fds[EXTFS_MAX_FDS];
+
+static uint64 free_bytes = 0;
+static uint32 free_bytes_time = 0;
+static bool free_bytes_valid = false;
+
+// Default Finder types by extension
+struct ext2type {
+    const char *ext;
+    uint32 type;
+    uint32 creator;
+};
+
+static const ext2type e2t_translation[] = {
+    {".txt",  FOURCC('T','E','X','T'), FOURCC('t','t','x','t')},
+    {".text", FOURCC('T','E','X','T'), FOURCC('t','t','x','t')},
+    {".c",    FOURCC('T','E','X','T'), FOURCC('t','t','x','t')},
+    {".h",    FOURCC('T','E','X','T'), FOURCC('t','t','x','t')},
+    {".htm",  FOURCC('T','E','X','T'), FOURCC('M','O','S','S')},
+    {".html", FOURCC('T','E','X','T'), FOURCC('M','O','S','S')},
+    {".rtf",  FOURCC('T','E','X','T'), FOURCC('M','S','W','D')},
+    {".hqx",  FOURCC('T','E','X','T'), FOURCC('S','I','T','x')},
+    {".sit",  FOURCC('S','I','T','!'), FOURCC('S','I','T','x')},
+    {".sea",  FOURCC('A','P','P','L'), FOURCC('a','u','s','t')},
+    {".bin",  FOURCC('B','I','N','A'), FOURCC('S','I','T','x')},
+    {".cpt",  FOURCC('P','A','C','T'), FOURCC('C','P','C','T')},
+    {".zip",  FOURCC('Z','I','P',' '), FOURCC('S','I','T','x')},
+    {".gz",   FOURCC('G','z','i','p'), FOURCC('S','I','T','x')},
+    {".img",  FOURCC('r','o','h','d'), FOURCC('d','d','s','k')},
+    {".dsk",  FOURCC('r','o','h','d'), FOURCC('d','d','s','k')},
+    {".image",FOURCC('r','o','h','d'), FOURCC('d','d','s','k')},
+    {".jpg",  FOURCC('J','P','E','G'), FOURCC('o','g','l','e')},
+    {".jpeg", FOURCC('J','P','E','G'), FOURCC('o','g','l','e')},
+    {".gif",  FOURCC('G','I','F','f'), FOURCC('o','g','l','e')},
+    {".png",  FOURCC('P','N','G','f'), FOURCC('o','g','l','e')},
+    {".bmp",  FOURCC('B','M','P','p'), FOURCC('o','g','l','e')},
+    {".tif",  FOURCC('T','I','F','F'), FOURCC('o','g','l','e')},
+    {".tiff", FOURCC('T','I','F','F'), FOURCC('o','g','l','e')},
+    {".pict", FOURCC('P','I','C','T'), FOURCC('o','g','l','e')},
+    {".pdf",  FOURCC('P','D','F',' '), FOURCC('C','A','R','O')},
+    {".mov",  FOURCC('M','o','o','V'), FOURCC('T','V','O','D')},
+    {".mp3",  FOURCC('M','P','G','3'), FOURCC('T','V','O','D')},
+    {".wav",  FOURCC('W','A','V','E'), FOURCC('T','V','O','D')},
+    {".aif",  FOURCC('A','I','F','F'), FOURCC('T','V','O','D')},
+    {".aiff", FOURCC('A','I','F','F'), FOURCC('T','V','O','D')},
+    {".mid",  FOURCC('M','i','d','i'), FOURCC('T','V','O','D')},
+    {NULL, 0, 0}
+};
+
+static inline uint32 get_be32(const uint8 *p)
+{
+    return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+static inline void put_be32(uint8 *p, uint32 v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/*
+ *  Path helpers: VFS path of a card path, sidecar path of a data fork
+ */
+static void vfs_path(char *out, const char *path)
+{
+    snprintf(out, MAX_PATH_LENGTH, "%s%s", SD_MOUNT_POINT, path);
+}
+
+static void sidecar_path(char *out, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path) : 0;
+    snprintf(out, MAX_PATH_LENGTH, "%s%.*s/._%s", SD_MOUNT_POINT, dir_len, path, slash ? slash + 1 : path);
+}
+
+// Split a path into directory and name ("/a/b" -> "/a", "b"; "/a" -> "/", "a")
+static const char *split_path(const char *path, char *dir)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, "/");
+        return path;
+    }
+    int len = slash - path;
+    if (len == 0) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, path, len);
+        dir[len] = 0;
+    }
+    return slash + 1;
+}
+
+static bool is_sub_path(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return strncasecmp(path, dir, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
+
+// ============================================================================
+// Directory listings
+// ============================================================================
+
+static const char *sort_names;
+
+static int entry_compare(const void *a, const void *b)
+{
+    return strcasecmp(sort_names + ((const extfs_entry *)a)->name,
+                      sort_names + ((const extfs_entry *)b)->name);
+}
+
+static void free_listing(extfs_listing *l)
+{
+    free(l->path);
+    free(l->entries);
+    free(l->names);
+    memset(l, 0, sizeof(*l));
+}
+
+// Append a name to the pool, returns its offset or -1
+static int listing_add_name(extfs_listing *l, const char *name)
+{
+    uint32 len = strlen(name) + 1;
+    if (l->names_used + len > l->names_capacity) {
+        uint32 capacity = l->names_capacity ? l->names_capacity * 2 : 4096;
+        while (capacity < l->names_used + len) capacity *= 2;
+        char *names = (char *)ps_realloc(l->names, capacity);
+        if (names == NULL) return -1;
+        l->names = names;
+        l->names_capacity = capacity;
+    }
+    uint32 offset = l->names_used;
+    memcpy(l->names + offset, name, len);
+    l->names_used += len;
+    return offset;
+}
+
+static extfs_entry *listing_append(extfs_listing *l, const char *name)
+{
+    if (l->count == l->capacity) {
+        int capacity = l->capacity ? l->capacity * 2 : 64;
+        extfs_entry *entries = (extfs_entry *)ps_realloc(l->entries, capacity * sizeof(extfs_entry));
+        if (entries == NULL) return NULL;
+        l->entries = entries;
+        l->capacity = capacity;
+    }
+    int offset = listing_add_name(l, name);
+    if (offset < 0) return NULL;
+    extfs_entry *e = &l->entries[l->count++];
+    memset(e, 0, sizeof(*e));
+    e->name = offset;
+    return e;
+}
+
+static int listing_find(extfs_listing *l, const char *name)
+{
+    int lo = 0, hi = l->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcasecmp(name, l->names + l->entries[mid].name);
+        if (c == 0) return mid;
+        if (c < 0) hi = mid - 1; else lo = mid + 1;
+    }
+    return -1;
+}
+
+// Entries that don't show up on the Mac side
+static bool is_hidden_name(const char *name)
+{
+    return name[0] == '.' || strcasecmp(name, "System Volume Information") == 0;
+}
+
+static time_t fat_time(WORD fdate, WORD ftime)
+{
+    struct tm tm = {};
+    tm.tm_year = (fdate >> 9) + 80;
+    tm.tm_mon = ((fdate >> 5) & 15) - 1;
+    tm.tm_mday = fdate & 31;
+    tm.tm_hour = ftime >> 11;
+    tm.tm_min = (ftime >> 5) & 63;
+    tm.tm_sec = (ftime & 31) * 2;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/*
+ *  Read a directory into a listing slot
+ */
+static bool load_listing(extfs_listing *l, const char *path)
+{
+    static FILINFO fno;                 // Large with long file names
+    char fpath[MAX_PATH_LENGTH + 8];
+    int sidecars = 0;
+    uint32 *sidecar_names = NULL;
+    int sidecar_capacity = 0;
+
+    l->path = (char *)ps_malloc(strlen(path) + 1);
+    if (l->path == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    strcpy(l->path, path);
+
+    // Sidecar names are kept aside and merged into the entry flags below
+    #define ADD_SIDECAR(n) do { \
+        int off = listing_add_name(l, n); \
+        if (off >= 0 && sidecars == sidecar_capacity) { \
+            sidecar_capacity = sidecar_capacity ? sidecar_capacity * 2 : 32; \
+            uint32 *s = (uint32 *)ps_realloc(sidecar_names, sidecar_capacity * sizeof(uint32)); \
+            if (s == NULL) off = -1; else sidecar_names = s; \
+        } \
+        if (off >= 0) sidecar_names[sidecars++] = off; \
+    } while (0)
+
+    bool ok = true;
+    if (SDFatPath(path, fpath, sizeof(fpath))) {
+
+        // One f_readdir() pass delivers name, size, date and attributes
+        FF_DIR dir;
+        if (f_opendir(&dir, fpath) != FR_OK) {
+            free_listing(l);
+            errno = ENOENT;
+            return false;
+        }
+        while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0]) {
+            if (fno.fname[0] == '.' && fno.fname[1] == '_' && fno.fname[2] && !(fno.fattrib & AM_DIR)) {
+                ADD_SIDECAR(fno.fname + 2);
+                continue;
+            }
+            if (is_hidden_name(fno.fname) || (fno.fattrib & (AM_HID | AM_SYS))) {
+                continue;
+            }
+            extfs_entry *e = listing_append(l, fno.fname);
+            if (e == NULL) {
+                ok = false;
+                break;
+            }
+            e->size = fno.fsize;
+            e->mtime = fat_time(fno.fdate, fno.ftime);
+            e->flags = ((fno.fattrib & AM_DIR) ? ENTRY_DIR : 0) | ((fno.fattrib & AM_RDO) ? ENTRY_READ_ONLY : 0);
+        }
+        f_closedir(&dir);
+
+    } else {
+
+        // SPI mode: readdir() and a stat() per entry
+        char vpath[MAX_PATH_LENGTH];
+        vfs_path(vpath, path);
+        DIR *d = opendir(vpath);
+        if (d == NULL) {
+            free_listing(l);
+            return false;
+        }
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.' && de->d_name[1] == '_' && de->d_name[2]) {
+                ADD_SIDECAR(de->d_name + 2);
+                continue;
+            }
+            if (is_hidden_name(de->d_name)) {
+                continue;
+            }
+            char epath[MAX_PATH_LENGTH];
+            snprintf(epath, sizeof(epath), "%s/%s", vpath, de->d_name);
+            struct stat st;
+            if (stat(epath, &st) < 0) {
+                continue;
+            }
+            extfs_entry *e = listing_append(l, de->d_name);
+            if (e == NULL) {
+                ok = false;
+                break;
+            }
+            e->size = st.st_size;
+            e->mtime = st.st_mtime;
+            e->flags = (S_ISDIR(st.st_mode) ? ENTRY_DIR : 0) | ((st.st_mode & S_IWUSR) ? 0 : ENTRY_READ_ONLY);
+        }
+        closedir(d);
+    }
+    #undef ADD_SIDECAR
+
+    if (!ok) {
+        free(sidecar_names);
+        free_listing(l);
+        errno = ENOMEM;
+        return false;
+    }
+
+    sort_names = l->names;
+    qsort(l->entries, l->count, sizeof(extfs_entry), entry_compare);
+    for (int i = 0; i < sidecars; i++) {
+        int idx = listing_find(l, l->names + sidecar_names[i]);
+        if (idx >= 0) {
+            l->entries[idx].flags |= ENTRY_SIDECAR;
+        }
+    }
+    free(sidecar_names);
+    D(bug("[EXTFS] listed %s: %d entries, %d sidecars\n", path, l->count, sidecars));
+    return true;
+}
+
+/*
+ *  Get the listing of a directory, reading it on a miss
+ */
+static extfs_listing *get_listing(const char *path)
+{
+    extfs_listing *victim = &listings[0];
+    for (int i = 0; i < EXTFS_LISTINGS; i++) {
+        extfs_listing *l = &listings[i];
+        if (l->path && strcasecmp(l->path, path) == 0) {
+            l->last_use = ++listing_clock;
+            return l;
+        }
+        if (l->path == NULL || (victim->path && l->last_use < victim->last_use)) {
+            victim = l;
+        }
+    }
+    if (victim->path) {
+        free_listing(victim);
+    }
+    if (!load_listing(victim, path)) {
+        return NULL;
+    }
+    victim->last_use = ++listing_clock;
+    return victim;
+}
+
+// Find a cached listing without reading the card
+static extfs_listing *find_listing(const char *path)
+{
+    for (int i = 0; i < EXTFS_LISTINGS; i++) {
+        if (listings[i].path && strcasecmp(listings[i].path, path) == 0) {
+            return &listings[i];
+        }
+    }
+    return NULL;
+}
+
+// Drop the listings of a directory and everything below it
+static void drop_listings(const char *path)
+{
+    for (int i = 0; i < EXTFS_LISTINGS; i++) {
+        if (listings[i].path && is_sub_path(listings[i].path, path)) {
+            free_listing(&listings[i]);
+        }
+    }
+}
+
+/*
+ *  Find the entry of a file/dir, NULL (errno set) if it doesn't exist
+ */
+static extfs_entry *find_entry(const char *path, extfs_listing **listing = NULL)
+{
+    char dir[MAX_PATH_LENGTH];
+    const char *name = split_path(path, dir);
+    extfs_listing *l = get_listing(dir);
+    if (l == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    int idx = listing_find(l, name);
+    if (idx < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (listing) *listing = l;
+    return &l->entries[idx];
+}
+
+// Add a new object to the cached listing of its directory (if cached)
+static void listing_insert(const char *path, bool is_dir)
+{
+    char dir[MAX_PATH_LENGTH];
+    const char *name = split_path(path, dir);
+    extfs_listing *l = find_listing(dir);
+    if (l == NULL || listing_find(l, name) >= 0) return;
+    extfs_entry *e = listing_append(l, name);
+    if (e == NULL) {
+        free_listing(l);
+        return;
+    }
+    e->mtime = time(NULL);
+    e->flags = is_dir ? ENTRY_DIR : 0;
+    extfs_entry new_entry = *e;
+    int idx = l->count - 1;
+    while (idx > 0 && strcasecmp(name, l->names + l->entries[idx - 1].name) < 0) {
+        l->entries[idx] = l->entries[idx - 1];
+        idx--;
+    }
+    l->entries[idx] = new_entry;
+}
+
+// Remove an object from the cached listing of its directory
+static void listing_remove(const char *path)
+{
+    char dir[MAX_PATH_LENGTH];
+    const char *name = split_path(path, dir);
+    extfs_listing *l = find_listing(dir);
+    if (l == NULL) return;
+    int idx = listing_find(l, name);
+    if (idx < 0) return;
+    memmove(&l->entries[idx], &l->entries[idx + 1], (l->count - idx - 1) * sizeof(extfs_entry));
+    l->count--;
+}
+
+// ============================================================================
+// Finder info and AppleDouble sidecars
+// ============================================================================
+
+/*
+ *  Default Finder info of a file without sidecar
+ */
+static void default_finfo(const char *name, extfs_entry *e)
+{
+    memset(e->finfo, 0, sizeof(e->finfo));
+    if (e->flags & ENTRY_DIR) return;
+    const char *ext = strrchr(name, '.');
+    if (ext == NULL) return;
+    for (int i = 0; e2t_translation[i].ext; i++) {
+        if (strcasecmp(ext, e2t_translation[i].ext) == 0) {
+            put_be32(e->finfo + fdType, e2t_translation[i].type);
+            put_be32(e->finfo + fdCreator, e2t_translation[i].creator);
+            return;
+        }
+    }
+}
+
+/*
+ *  Read the sidecar header of an entry (once)
+ */
+static void load_info(const char *path, extfs_entry *e)
+{
+    if (e->flags & ENTRY_INFO) return;
+    e->flags |= ENTRY_INFO;
+    e->finfo_offset = e->rfork_offset = e->rfork_length = 0;
+
+    char dir[MAX_PATH_LENGTH];
+    const char *name = split_path(path, dir);
+    default_finfo(name, e);
+    if (!(e->flags & ENTRY_SIDECAR)) return;
+
+    char spath[MAX_PATH_LENGTH];
+    sidecar_path(spath, path);
+    int fd = open(spath, O_RDONLY);
+    if (fd < 0) {
+        e->flags &= ~ENTRY_SIDECAR;
+        return;
+    }
+    uint8 header[AD_HEADER_SIZE + AD_MAX_ENTRIES * AD_ENTRY_SIZE];
+    ssize_t actual = read(fd, header, sizeof(header));
+    if (actual < AD_HEADER_SIZE || get_be32(header) != AD_MAGIC) {
+        close(fd);
+        return;
+    }
+    int count = (header[24] << 8) | header[25];
+    if (count > AD_MAX_ENTRIES) count = AD_MAX_ENTRIES;
+    uint32 last_end = 0, rfork_end = 0;
+    for (int i = 0; i < count && AD_HEADER_SIZE + (i + 1) * AD_ENTRY_SIZE <= actual; i++) {
+        const uint8 *p = header + AD_HEADER_SIZE + i * AD_ENTRY_SIZE;
+        uint32 id = get_be32(p), offset = get_be32(p + 4), length = get_be32(p + 8);
+        if (offset + length > last_end) last_end = offset + length;
+        if (id == AD_RFORK_ID) {
+            e->rfork_offset = offset;
+            e->rfork_length = length;
+            rfork_end = offset + length;
+        } else if (id == AD_FINFO_ID && length >= AD_FINFO_SIZE) {
+            e->finfo_offset = offset;
+        }
+    }
+    if (e->finfo_offset && lseek(fd, e->finfo_offset, SEEK_SET) >= 0) {
+        if (read(fd, e->finfo, AD_FINFO_SIZE) != AD_FINFO_SIZE) {
+            default_finfo(name, e);
+        }
+    }
+    if (e->rfork_offset && rfork_end == last_end) {
+        e->flags |= ENTRY_RFORK_LAST;
+    }
+    close(fd);
+}
+
+/*
+ *  Write a sidecar in our layout: header, Finder info, resource fork (the
+ *  existing fork is copied over)
+ */
+static bool write_sidecar(const char *path, extfs_entry *e)
+{
+    char spath[MAX_PATH_LENGTH];
+    sidecar_path(spath, path);
+
+    // Keep the old resource fork
+    uint8 *rfork = NULL;
+    uint32 rfork_length = 0;
+    if ((e->flags & ENTRY_SIDECAR) && e->rfork_offset && e->rfork_length) {
+        rfork = (uint8 *)ps_malloc(e->rfork_length);
+        int fd = open(spath, O_RDONLY);
+        if (rfork == NULL || fd < 0 || lseek(fd, e->rfork_offset, SEEK_SET) < 0 ||
+            read(fd, rfork, e->rfork_length) != (ssize_t)e->rfork_length) {
+            if (fd >= 0) close(fd);
+            free(rfork);
+            errno = rfork ? EIO : ENOMEM;
+            return false;
+        }
+        close(fd);
+        rfork_length = e->rfork_length;
+    }
+
+    uint8 header[AD_OUR_RFORK] = {};
+    put_be32(header, AD_MAGIC);
+    put_be32(header + 4, AD_VERSION);
+    header[25] = 2;
+    uint8 *p = header + AD_HEADER_SIZE;
+    put_be32(p, AD_FINFO_ID);
+    put_be32(p + 4, AD_OUR_FINFO);
+    put_be32(p + 8, AD_FINFO_SIZE);
+    put_be32(p + 12, AD_RFORK_ID);
+    put_be32(p + 16, AD_OUR_RFORK);
+    put_be32(p + 20, rfork_length);
+    memcpy(header + AD_OUR_FINFO, e->finfo, AD_FINFO_SIZE);
+
+    int fd = open(spath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = fd >= 0 && write(fd, header, sizeof(header)) == sizeof(header) &&
+              (rfork_length == 0 || write(fd, rfork, rfork_length) == (ssize_t)rfork_length);
+    int err = errno;
+    if (fd >= 0) close(fd);
+    free(rfork);
+    if (!ok) {
+        errno = err;
+        return false;
+    }
+    e->flags |= ENTRY_SIDECAR | ENTRY_RFORK_LAST;
+    e->finfo_offset = AD_OUR_FINFO;
+    e->rfork_offset = AD_OUR_RFORK;
+    e->rfork_length = rfork_length;
+    return true;
+}
+
+// Update the resource fork length in a sidecar header
+static void write_rfork_length(extfs_fd *f)
+{
+    char spath[MAX_PATH_LENGTH];
+    sidecar_path(spath, f->path);
+    int fd = open(spath, O_RDWR);
+    if (fd < 0) return;
+    uint8 header[AD_HEADER_SIZE + AD_MAX_ENTRIES * AD_ENTRY_SIZE];
+    ssize_t actual = read(fd, header, sizeof(header));
+    int count = actual >= AD_HEADER_SIZE ? (header[24] << 8) | header[25] : 0;
+    for (int i = 0; i < count && i < AD_MAX_ENTRIES && AD_HEADER_SIZE + (i + 1) * AD_ENTRY_SIZE <= actual; i++) {
+        uint8 *p = header + AD_HEADER_SIZE + i * AD_ENTRY_SIZE;
+        if (get_be32(p) == AD_RFORK_ID) {
+            put_be32(p + 8, f->size);
+            lseek(fd, AD_HEADER_SIZE + i * AD_ENTRY_SIZE + 8, SEEK_SET);
+            write(fd, p + 8, 4);
+            break;
+        }
+    }
+    close(fd);
+    f->header_dirty = false;
+}
+
+/*
+ *  Get/set Finder info of a file/dir
+ */
+void get_finfo(const char *path, uint32 finfo, uint32 fxinfo, bool is_dir)
+{
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) {
+        Mac_memset(finfo, 0, SIZEOF_FInfo);
+        if (fxinfo) Mac_memset(fxinfo, 0, SIZEOF_FXInfo);
+        return;
+    }
+    load_info(path, e);
+    Host2Mac_memcpy(finfo, e->finfo, SIZEOF_FInfo);
+    if (fxinfo) Host2Mac_memcpy(fxinfo, e->finfo + SIZEOF_FInfo, SIZEOF_FXInfo);
+}
+
+void set_finfo(const char *path, uint32 finfo, uint32 fxinfo, bool is_dir)
+{
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) return;
+    load_info(path, e);
+
+    uint8 info[AD_FINFO_SIZE];
+    memcpy(info, e->finfo, AD_FINFO_SIZE);
+    Mac2Host_memcpy(info, finfo, SIZEOF_FInfo);
+    if (fxinfo) Mac2Host_memcpy(info + SIZEOF_FInfo, fxinfo, SIZEOF_FXInfo);
+    if (memcmp(info, e->finfo, AD_FINFO_SIZE) == 0) return;   // Nothing to write
+    memcpy(e->finfo, info, AD_FINFO_SIZE);
+
+    // Patch the Finder info of an existing sidecar, else write a new one
+    if ((e->flags & ENTRY_SIDECAR) && e->finfo_offset) {
+        char spath[MAX_PATH_LENGTH];
+        sidecar_path(spath, path);
+        int fd = open(spath, O_WRONLY);
+        if (fd >= 0) {
+            bool ok = lseek(fd, e->finfo_offset, SEEK_SET) >= 0 && write(fd, info, AD_FINFO_SIZE) == AD_FINFO_SIZE;
+            close(fd);
+            if (ok) return;
+        }
+    }
+    if (!write_sidecar(path, e)) {
+        Serial.printf("[EXTFS] Can't write Finder info of %s (errno %d)\n", path, errno);
+    }
+}
+
+// ============================================================================
+// Forks
+// ============================================================================
+
+static extfs_fd *get_fd(int fd)
+{
+    if (fd < 0 || fd >= EXTFS_MAX_FDS || !fds[fd].used) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &fds[fd];
+}
+
+static int alloc_fd(const char *path, bool rfork)
+{
+    for (int i = 0; i < EXTFS_MAX_FDS; i++) {
+        if (!fds[i].used) {
+            extfs_fd *f = &fds[i];
+            memset(f, 0, sizeof(*f));
+            f->used = true;
+            f->rfork = rfork;
+            f->fd = -1;
+            strncpy(f->path, path, MAX_PATH_LENGTH - 1);
+            return i;
+        }
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+/*
+ *  Get resource fork size
+ */
+uint32 get_rfork_size(const char *path)
+{
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) return 0;
+    load_info(path, e);
+    return e->rfork_length;
+}
+
+/*
+ *  Open resource fork (the sidecar is only created by the first write)
+ */
+int open_rfork(const char *path, int flag)
+{
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) return -1;
+    load_info(path, e);
+
+    // A fork that is going to be written has to end the sidecar
+    bool writable = (flag & O_ACCMODE) != O_RDONLY;
+    if (writable && e->rfork_offset && !(e->flags & ENTRY_RFORK_LAST)) {
+        if (!write_sidecar(path, e)) return -1;
+    }
+
+    int fd = alloc_fd(path, true);
+    if (fd < 0) return -1;
+    extfs_fd *f = &fds[fd];
+    if (e->rfork_offset) {
+        char spath[MAX_PATH_LENGTH];
+        sidecar_path(spath, path);
+        f->fd = open(spath, writable ? O_RDWR : O_RDONLY);
+        if (f->fd < 0) {
+            f->used = false;
+            return -1;
+        }
+        f->base = e->rfork_offset;
+        f->size = e->rfork_length;
+    }
+    return fd;
+}
+
+/*
+ *  Close resource fork
+ */
+void close_rfork(const char *path, int fd)
+{
+    extfs_close(fd);
+}
+
+/*
+ *  Open data fork
+ */
+int extfs_open(const char *path, int flag)
+{
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) return -1;
+    if (e->flags & ENTRY_DIR) {
+        errno = EISDIR;
+        return -1;
+    }
+    int fd = alloc_fd(path, false);
+    if (fd < 0) return -1;
+    extfs_fd *f = &fds[fd];
+    char vpath[MAX_PATH_LENGTH];
+    vfs_path(vpath, path);
+    f->fd = open(vpath, flag);
+    if (f->fd < 0) {
+        f->used = false;
+        return -1;
+    }
+    f->size = e->size;
+    return fd;
+}
+
+void extfs_close(int fd)
+{
+    extfs_fd *f = get_fd(fd);
+    if (f == NULL) return;
+    if (f->header_dirty) write_rfork_length(f);
+    if (f->fd >= 0) close(f->fd);
+    f->used = false;
+}
+
+// Create the sidecar for a resource fork opened before it existed
+static bool create_rfork(extfs_fd *f)
+{
+    extfs_entry *e = find_entry(f->path);
+    if (e == NULL) return false;
+    load_info(f->path, e);
+    if (!(e->flags & ENTRY_SIDECAR) || !e->rfork_offset) {
+        if (!write_sidecar(f->path, e)) return false;
+    }
+    char spath[MAX_PATH_LENGTH];
+    sidecar_path(spath, f->path);
+    f->fd = open(spath, O_RDWR);
+    if (f->fd < 0) return false;
+    f->base = e->rfork_offset;
+    f->size = e->rfork_length;
+    return true;
+}
+
+// New fork size: update the cached entry
+static void fork_resized(extfs_fd *f)
+{
+    free_bytes_valid = false;
+    extfs_entry *e = find_entry(f->path);
+    if (e == NULL) return;
+    if (f->rfork) {
+        e->rfork_length = f->size;
+        f->header_dirty = true;
+    } else {
+        e->size = f->size;
+    }
+    e->mtime = time(NULL);
+}
+
+/*
+ *  Read/write/seek/truncate on open forks
+ */
+ssize_t extfs_read(int fd, void *buffer, size_t length)
+{
+    extfs_fd *f = get_fd(fd);
+    if (f == NULL) return -1;
+    errno = 0;
+    if (f->pos >= f->size || f->fd < 0) return 0;
+    if (length > f->size - f->pos) length = f->size - f->pos;
+    if (lseek(f->fd, f->base + f->pos, SEEK_SET) < 0) return -1;
+    ssize_t actual = read(f->fd, buffer, length);
+    if (actual > 0) f->pos += actual;
+    return actual;
+}
+
+ssize_t extfs_write(int fd, void *buffer, size_t length)
+{
+    extfs_fd *f = get_fd(fd);
+    if (f == NULL) return -1;
+    errno = 0;
+    if (f->fd < 0 && !create_rfork(f)) return -1;
+    if (lseek(f->fd, f->base + f->pos, SEEK_SET) < 0) return -1;
+    ssize_t actual = write(f->fd, buffer, length);
+    if (actual > 0) {
+        f->pos += actual;
+        if (f->pos > f->size) {
+            f->size = f->pos;
+            fork_resized(f);
+        } else {
+            free_bytes_valid = false;
+        }
+    }
+    return actual;
+}
+
+off_t extfs_lseek(int fd, off_t offset, int whence)
+{
+    extfs_fd *f = get_fd(fd);
+    if (f == NULL) return -1;
+    off_t pos;
+    switch (whence) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = (off_t)f->pos + offset; break;
+        case SEEK_END: pos = (off_t)f->size + offset; break;
+        default: pos = -1; break;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    return pos;
+}
+
+bool extfs_ftruncate(int fd, off_t length)
+{
+    extfs_fd *f = get_fd(fd);
+    if (f == NULL) return false;
+    if (f->fd < 0) {
+        if (length == 0) return true;
+        if (!create_rfork(f)) return false;
+    }
+    if (ftruncate(f->fd, f->base + length) < 0) return false;
+    f->size = length;
+    fork_resized(f);
+    return true;
+}
+
+// ============================================================================
+// Files and directories
+// ============================================================================
+
+bool extfs_stat(const char *path, extfs_stat_info *info)
+{
+    if (strcmp(path, "/") == 0 || path[0] == 0) {
+        info->is_dir = true;
+        info->read_only = false;
+        info->size = 0;
+        info->mtime = 0;
+        return true;
+    }
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) return false;
+    info->is_dir = (e->flags & ENTRY_DIR) != 0;
+    info->read_only = (e->flags & ENTRY_READ_ONLY) != 0;
+    info->size = e->size;
+    info->mtime = e->mtime;
+    return true;
+}
+
+int extfs_dir_count(const char *path)
+{
+    extfs_listing *l = get_listing(path);
+    return l ? l->count : -1;
+}
+
+const char *extfs_dir_entry(const char *path, int index)
+{
+    extfs_listing *l = get_listing(path);
+    if (l == NULL || index < 0 || index >= l->count) return NULL;
+    return l->names + l->entries[index].name;
+}
+
+bool extfs_create(const char *path, bool is_dir)
+{
+    char vpath[MAX_PATH_LENGTH];
+    vfs_path(vpath, path);
+    if (is_dir) {
+        if (mkdir(vpath, 0777) < 0) return false;
+    } else {
+        int fd = open(vpath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0) return false;
+        close(fd);
+    }
+    listing_insert(path, is_dir);
+    free_bytes_valid = false;
+    return true;
+}
+
+/*
+ *  Remove file/directory; sidecars go with their files, and a directory
+ *  that only holds hidden metadata counts as empty
+ */
+bool extfs_remove(const char *path)
+{
+    extfs_entry *e = find_entry(path);
+    if (e == NULL) return false;
+    char vpath[MAX_PATH_LENGTH];
+    vfs_path(vpath, path);
+
+    if (e->flags & ENTRY_DIR) {
+        int visible = extfs_dir_count(path);
+        if (visible > 0) {
+            errno = ENOTEMPTY;
+            return false;
+        }
+        DIR *d = opendir(vpath);
+        if (d) {
+            struct dirent *de;
+            char epath[MAX_PATH_LENGTH];
+            while ((de = readdir(d)) != NULL) {
+                if (de->d_name[0] == '.' && de->d_name[1] != 0 && de->d_name[1] != '.') {
+                    snprintf(epath, sizeof(epath), "%s/%s", vpath, de->d_name);
+                    unlink(epath);
+                }
+            }
+            closedir(d);
+        }
+        if (rmdir(vpath) < 0) return false;
+        drop_listings(path);
+    } else {
+        if (unlink(vpath) < 0) return false;
+        if (e->flags & ENTRY_SIDECAR) {
+            char spath[MAX_PATH_LENGTH];
+            sidecar_path(spath, path);
+            unlink(spath);
+        }
+    }
+    listing_remove(path);
+    free_bytes_valid = false;
+    return true;
+}
+
+/*
+ *  Rename/move file/directory together with its sidecar
+ */
+bool extfs_rename(const char *old_path, const char *new_path)
+{
+    extfs_entry *e = find_entry(old_path);
+    if (e == NULL) return false;
+    extfs_entry saved = *e;
+
+    char old_vpath[MAX_PATH_LENGTH], new_vpath[MAX_PATH_LENGTH];
+    vfs_path(old_vpath, old_path);
+    vfs_path(new_vpath, new_path);
+    if (rename(old_vpath, new_vpath) < 0) return false;
+    if (e->flags & ENTRY_SIDECAR) {
+        sidecar_path(old_vpath, old_path);
+        sidecar_path(new_vpath, new_path);
+        rename(old_vpath, new_vpath);
+    }
+
+    // Move the entry, keeping its (already loaded) Finder info
+    listing_remove(old_path);
+    if (saved.flags & ENTRY_DIR) drop_listings(old_path);
+    listing_insert(new_path, (saved.flags & ENTRY_DIR) != 0);
+    extfs_listing *l;
+    e = find_entry(new_path, &l);
+    if (e) {
+        uint32 name = e->name;
+        *e = saved;
+        e->name = name;
+    }
+
+    // Open forks follow the file
+    for (int i = 0; i < EXTFS_MAX_FDS; i++) {
+        if (fds[i].used && strcasecmp(fds[i].path, old_path) == 0) {
+            strncpy(fds[i].path, new_path, MAX_PATH_LENGTH - 1);
+        }
+    }
+    return true;
+}
+
+uint64 extfs_free_bytes(void)
+{
+    uint32 now = millis();
+    if (!free_bytes_valid || now - free_bytes_time > FREE_SPACE_MS) {
+        free_bytes = SDCardFreeBytes();
+        free_bytes_time = now;
+        free_bytes_valid = true;
+    }
+    return free_bytes;
+}
+
+// ============================================================================
+// Names
+// ============================================================================
+
+/*
+ *  Append component to path name
+ */
+void add_path_component(char *path, const char *component)
+{
+    size_t len = strlen(path);
+    if (len < MAX_PATH_LENGTH - 1 && (len == 0 || path[len - 1] != '/')) {
+        path[len++] = '/';
+        path[len] = 0;
+    }
+    strncat(path, component, MAX_PATH_LENGTH - len - 1);
+}
+
+// Characters FAT can't store (or that would hide the file) in Mac names
+static bool needs_escape(uint8 c, int pos, int len)
+{
+    if (c < 0x20 || c >= 0x7f) return true;
+    if (strchr("\"*/:<>?\\|%", c)) return true;
+    if (pos == 0 && c == '.') return true;
+    if (pos == len - 1 && (c == '.' || c == ' ')) return true;
+    return false;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+const char *host_encoding_to_macroman(const char *filename)
+{
+    static char name[256];
+    int n = 0;
+    for (const char *p = filename; *p && n < 255; p++) {
+        int hi, lo;
+        if (p[0] == '%' && (hi = hex_digit(p[1])) >= 0 && (lo = hex_digit(p[2])) >= 0) {
+            name[n++] = (hi << 4) | lo;
+            p += 2;
+        } else {
+            name[n++] = *p;
+        }
+    }
+    name[n] = 0;
+    return name;
+}
+
+const char *macroman_to_host_encoding(const char *filename)
+{
+    static char name[256];
+    static const char hex[] = "0123456789ABCDEF";
+    int len = strlen(filename), n = 0;
+    for (int i = 0; i < len && n < 252; i++) {
+        uint8 c = filename[i];
+        if (needs_escape(c, i, len)) {
+            name[n++] = '%';
+            name[n++] = hex[c >> 4];
+            name[n++] = hex[c & 15];
+        } else {
+            name[n++] = c;
+        }
+    }
+    name[n] = 0;
+    return name;
+}
+
+// ============================================================================
+// Initialization
+// ============================================================================
+
+void extfs_init(void)
+{
+    memset(listings, 0, sizeof(listings));
+    memset(fds, 0, sizeof(fds));
+    free_bytes_valid = false;
+}
+
+void extfs_exit(void)
+{
+    for (int i = 0; i < EXTFS_MAX_FDS; i++) {
+        if (fds[i].used) extfs_close(i);
+    }
+    for (int i = 0; i < EXTFS_LISTINGS; i++) {
+        if (listings[i].path) free_listing(&listings[i]);
+    }
+}
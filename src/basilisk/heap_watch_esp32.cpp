@@ -0,0 +1,138 @@
+/*
+ *  heap_watch_esp32.cpp - Heap allocations after boot
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Once the 68k runs, the emulation shouldn't allocate: disk handles come
+ *  from a fixed pool (sys_esp32.cpp), timer descriptors from a table
+ *  (timer.cpp), and prefs, drive lists and audio formats are built during
+ *  boot. Allocating later fragments the ESP-IDF heap and can stall a core
+ *  on the heap lock, so this checks it two ways:
+ *
+ *  - operator new is replaced to count every C++ allocation after
+ *    HeapWatchArm(), separately for the CPU task, and to remember the
+ *    caller of the first one the CPU task made.
+ *  - malloc() from C code (and the network stack) isn't hooked; the report
+ *    instead compares the heap's allocated block count with the one at
+ *    HeapWatchArm(), which shows blocks that were allocated and kept.
+ */
+
+#include "sysdeps.h"
+#include "perf_esp32.h"
+#include "log_esp32.h"
+#include "heap_watch_esp32.h"
+
+#include <new>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if HEAP_WATCH
+
+static perf_counter *perf_allocs = NULL;       // "heap.allocs"
+static perf_counter *perf_cpu_allocs = NULL;   // "heap.cpu_allocs"
+
+static bool armed = false;
+static TaskHandle_t cpu_task = NULL;
+static void *first_cpu_caller = NULL;           // Return address of the first CPU task new
+static size_t first_cpu_size = 0;
+static size_t armed_blocks = 0;
+static uint64 last_allocs = 0;
+
+static inline void count_alloc(size_t size, void *caller)
+{
+    if (!__atomic_load_n(&armed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    PerfAdd(perf_allocs, 1);
+    if (xTaskGetCurrentTaskHandle() == cpu_task) {
+        PerfAdd(perf_cpu_allocs, 1);
+        if (first_cpu_caller == NULL) {
+            first_cpu_size = size;
+            first_cpu_caller = caller;
+        }
+    }
+}
+
+void *operator new(size_t size)
+{
+    count_alloc(size, __builtin_return_address(0));
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    count_alloc(size, __builtin_return_address(0));
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    count_alloc(size, __builtin_return_address(0));
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    count_alloc(size, __builtin_return_address(0));
+    return malloc(size ? size : 1);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static size_t heap_blocks(void)
+{
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+    return info.allocated_blocks;
+}
+
+/*
+ *  Start counting
+ */
+void HeapWatchArm(void)
+{
+    perf_allocs = PerfCounter("heap.allocs");
+    perf_cpu_allocs = PerfCounter("heap.cpu_allocs");
+    cpu_task = xTaskGetCurrentTaskHandle();
+    armed_blocks = heap_blocks();
+    __atomic_store_n(&armed, true, __ATOMIC_RELEASE);
+    LOG_PRINTF("[HEAP] Watching allocations, %u blocks in use at boot\n", (unsigned)armed_blocks);
+}
+
+/*
+ *  Allocations since the last report
+ */
+void HeapWatchReport(void)
+{
+    if (!armed) {
+        return;
+    }
+    uint64 allocs = PerfTotal(perf_allocs);
+    uint64 cpu_allocs = PerfTotal(perf_cpu_allocs);
+    long blocks = (long)heap_blocks() - (long)armed_blocks;
+    LOG_PRINTF("[HEAP] new: %llu since boot (+%llu), cpu task %llu, blocks %+ld since boot, "
+               "internal free %uKB largest %uKB\n",
+               (unsigned long long)allocs, (unsigned long long)(allocs - last_allocs),
+               (unsigned long long)cpu_allocs, blocks,
+               (unsigned)(heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / 1024),
+               (unsigned)(heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL) / 1024));
+    if (first_cpu_caller) {
+        LOG_PRINTF("[HEAP] First cpu task new after boot: %u bytes from %p\n",
+                   (unsigned)first_cpu_size, first_cpu_caller);
+    }
+    last_allocs = allocs;
+}
+
+#endif
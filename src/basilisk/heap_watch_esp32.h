@@ -0,0 +1,28 @@
+/*
+ *  heap_watch_esp32.h - Heap allocations after boot
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef HEAP_WATCH_ESP32_H
+#define HEAP_WATCH_ESP32_H
+
+#ifndef HEAP_WATCH
+#define HEAP_WATCH 0
+#endif
+
+#if HEAP_WATCH
+
+/*
+ *  Called on the CPU task right before the 68k starts: from here on every
+ *  operator new counts in "heap.allocs" ("heap.cpu_allocs" if made by the
+ *  CPU task), and the heap's block count is compared against this point
+ */
+extern void HeapWatchArm(void);
+
+// One [HEAP] line for the periodic report
+extern void HeapWatchReport(void);
+
+#endif
+
+#endif /* HEAP_WATCH_ESP32_H */
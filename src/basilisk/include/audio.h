@@ -96,4 +96,19 @@ enum {
 
 extern uint32 audio_data;		// Mac address of global data area
 
+// Print and reset audio statistics - call from the perf report
+extern void Audio_report_stats(void);
+
+// Built-in sounds: the platform plays the startup chime on reset and
+// SysBeep() (replaced by M68K_EMUL_OP_SYSBEEP in rom_patches.cpp) from its
+// own PCM, so neither runs the Sound Manager on the 68k
+#ifndef AUDIO_NATIVE_SOUNDS
+#define AUDIO_NATIVE_SOUNDS 0
+#endif
+
+#if AUDIO_NATIVE_SOUNDS
+extern void PlayStartupSound(void);
+extern bool AudioSysBeep(void);			// Returns false if Mac OS has to beep itself
+#endif
+
 #endif
@@ -18,6 +18,11 @@
 // Maximum number of files to list
 #define BOOT_GUI_MAX_FILES 32
 
+// Disk overlay modes (see overlay_esp32.cpp)
+#define BOOT_GUI_OVERLAY_OFF        0   // Write to the disk image itself
+#define BOOT_GUI_OVERLAY_ON         1   // Write to <image>.ovl
+#define BOOT_GUI_OVERLAY_DISCARD    2   // Empty the overlay, then as ON
+
 /*
  *  Initialize the boot GUI system
  *  Must be called after SD card is initialized
@@ -58,4 +63,30 @@ uint32_t BootGUI_GetRAMSize(void);
  */
 int BootGUI_GetRAMSizeMB(void);
 
+/*
+ *  Get the selected disk overlay mode
+ *  Returns BOOT_GUI_OVERLAY_OFF, BOOT_GUI_OVERLAY_ON or BOOT_GUI_OVERLAY_DISCARD
+ *  (discarding applies to this boot only, the saved setting becomes ON)
+ */
+int BootGUI_GetOverlayMode(void);
+
+/*
+ *  Get whether the hard disk image is to be copied into PSRAM at boot
+ *  Returns true if selected (see "diskpreload" in sys_esp32.cpp)
+ */
+bool BootGUI_GetPreload(void);
+
+/*
+ *  Get the selected CPU, as the "cpu" pref
+ *  Returns 4 (68040 with FPU) or 3 (68030 without FPU)
+ */
+int BootGUI_GetCPUType(void);
+
+/*
+ *  Get whether to resume the suspended machine instead of booting
+ *  Returns true if a snapshot was found and the settings screen wasn't used
+ *  (see SnapshotResume() in snapshot_esp32.cpp)
+ */
+bool BootGUI_GetResume(void);
+
 #endif // BOOT_GUI_H
@@ -91,10 +91,22 @@ enum {
 	M68K_EMUL_OP_DEBUGUTIL,
 	M68K_EMUL_OP_IDLE_TIME,
 	M68K_EMUL_OP_SUSPEND,
+	M68K_EMUL_OP_CURSOR,			// 0x713a
+	M68K_EMUL_OP_SYSBEEP,
+	M68K_EMUL_OP_NATIVE_BLOCK_MOVE,
+	M68K_EMUL_OP_QD_ACCEL,
 	M68K_EMUL_OP_MAX				// highest number
 };
 
 // Functions
 extern void EmulOp(uint16 opcode, struct M68kRegisters *r);	// Execute EMUL_OP opcode (called by 68k emulator or Line-F trap handler)
 
+// EmulOps that only use D0-D7/A0-A7 and run no 68k code, called on the
+// CPU's registers in place; indexed by opcode - M68K_EXEC_RETURN, NULL for
+// those that need an M68kRegisters and go through EmulOp()
+typedef void (*emulop_direct_func)(uint32 *d, uint32 *a);
+const int EMULOP_DIRECT_COUNT = M68K_EMUL_OP_MAX - M68K_EXEC_RETURN;
+extern emulop_direct_func EmulOpDirect[EMULOP_DIRECT_COUNT];
+extern void EmulOpDirectInit(void);
+
 #endif
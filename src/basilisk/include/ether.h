@@ -48,6 +48,9 @@ extern void ether_udp_read(uint32 packet, int length, struct sockaddr_in *from);
 
 extern uint8 ether_addr[6];	// Ethernet address (set by ether_init())
 
+// Print and reset network statistics - call from the perf report
+extern void Ether_report_stats(void);
+
 // Ethernet driver data in MacOS RAM
 enum {
 	ed_DeferredTask = 0,	// Deferred Task struct
@@ -45,6 +45,23 @@ extern bool extfs_rename(const char *old_path, const char *new_path);
 extern const char *host_encoding_to_macroman(const char *filename); // What if the guest OS is using MacJapanese or MacArabic? Oh well...
 extern const char *macroman_to_host_encoding(const char *filename); // What if the guest OS is using MacJapanese or MacArabic? Oh well...
 
+// Host file and directory access; errors are returned in errno
+struct extfs_stat_info {
+	bool is_dir;
+	bool read_only;
+	uint32 size;
+	time_t mtime;
+};
+extern bool extfs_stat(const char *path, extfs_stat_info *info);
+extern int extfs_dir_count(const char *path);						// Visible entries of a directory, -1 = no directory
+extern const char *extfs_dir_entry(const char *path, int index);	// Host name of the nth visible entry, NULL = past the end
+extern bool extfs_create(const char *path, bool is_dir);
+extern int extfs_open(const char *path, int flag);
+extern void extfs_close(int fd);
+extern off_t extfs_lseek(int fd, off_t offset, int whence);
+extern bool extfs_ftruncate(int fd, off_t length);
+extern uint64 extfs_free_bytes(void);
+
 // Maximum length of full path name
 const int MAX_PATH_LENGTH = 1024;
 
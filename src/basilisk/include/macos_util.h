@@ -60,6 +60,7 @@ enum {	// QHdr struct
 // Error codes
 enum {
 	noErr			= 0,
+	qErr			= -1,
 	controlErr		= -17,
 	statusErr		= -18,
 	readErr			= -19,
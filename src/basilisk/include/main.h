@@ -49,6 +49,14 @@ struct M68kRegisters {
 extern bool InitAll(const char *vmdir);
 extern void ExitAll(void);
 
+// The steps of InitAll(), for platforms that run them as separate stages
+extern bool InitROMType(void);
+extern void InitXPRAM(const char *vmdir);
+extern void InitDrivers(void);
+extern void InitHostServices(void);
+extern bool InitVideo(void);
+extern bool InitMachine(void);
+
 // Platform-specific functions
 extern void FlushCodeCache(void *start, uint32 size);	// Code was patched, flush caches if neccessary
 extern void QuitEmulator(void);							// Quit emulator
@@ -74,7 +82,8 @@ enum {
 	INTFLAG_AUDIO = 16,	// Audio block read
 	INTFLAG_TIMER = 32,	// Time Manager
 	INTFLAG_ADB = 64,	// ADB
-	INTFLAG_NMI = 128	// NMI
+	INTFLAG_NMI = 128,	// NMI
+	INTFLAG_DISK = 256	// Asynchronous disk I/O completed
 };
 
 extern uint32 InterruptFlags;									// Currently pending interrupts
@@ -54,6 +54,9 @@ extern int32 PrefsFindInt32(const char *name);
 
 extern void PrefsRemoveItem(const char *name, int index = 0);
 
+// Core for a host task from the "taskcores" pref (prefs_esp32.cpp)
+extern int PrefsFindTaskCore(const char *task, int default_core);
+
 #ifdef SHEEPSHAVER
 // Platform specific functions:
 extern void prefs_init();
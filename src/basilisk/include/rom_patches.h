@@ -44,13 +44,70 @@ extern uint32 PutScrapPatch;
 // Mac address of GetScrap() patch
 extern uint32 GetScrapPatch;
 
+// Mac address of an M68K_EXEC_RETURN word for Execute68k() to return to (0 = none)
+extern uint32 ExecReturnAddr;
+
 // Flag: print ROM information in PatchROM()
 extern bool PrintROMInfo;
 
+// Run BlockMove()/BlockMoveData() as a host memmove (M68K_EMUL_OP_NATIVE_BLOCK_MOVE)
+#ifndef NATIVE_BLOCK_MOVE
+#define NATIVE_BLOCK_MOVE 0
+#endif
+
+// Keep the patched ROM on the SD card so later boots can skip PatchROM()'s searches
+#ifndef ROM_PATCH_CACHE
+#define ROM_PATCH_CACHE 0
+#endif
+
+// Run the patched ROM in place from the "macrom" flash partition
+#ifndef ROM_FLASH_XIP
+#define ROM_FLASH_XIP 0
+#endif
+#if ROM_FLASH_XIP && !ROM_PATCH_CACHE
+#error "ROM_FLASH_XIP requires ROM_PATCH_CACHE"
+#endif
+
+#if ROM_PATCH_CACHE
+// What PatchROM() found and set up besides the ROM image itself
+struct rom_patch_state {
+	uint32 universal_info;
+	uint32 put_scrap_patch;
+	uint32 get_scrap_patch;
+	uint32 exec_return_addr;
+	uint32 sony_offset;
+	uint32 serd_offset;
+	uint32 microseconds_offset;
+	uint32 debugutil_offset;
+	uint32 cursor_offset;
+	uint32 sysbeep_offset;
+	uint32 block_move_offset;
+	uint32 qd_accel_offset;
+	uint32 sony_disk_icon;
+	uint32 sony_drive_icon;
+	uint32 disk_icon;
+	uint32 cdrom_icon;
+	uint32 slot_rom_size;
+};
+
+// Patched-ROM cache (rom_cache_esp32.cpp)
+extern bool ROMCacheLoad(const char *rom_path, uint32 rom_checksum, uint32 rom_file_size);
+extern bool ROMCacheRestore(rom_patch_state *state);
+extern void ROMCacheSave(const rom_patch_state *state);
+#if ROM_FLASH_XIP
+extern bool ROMFlashLoad(const char *rom_path, uint32 rom_checksum, uint32 rom_file_size);
+extern void ROMFlashStore(const rom_patch_state *state);
+extern void ROMWrite(uint32 offset, const void *data, uint32 size);
+#endif
+#endif
+
 extern bool CheckROM(void);
 extern bool PatchROM(void);
 extern void InstallDrivers(uint32 pb);
 extern void InstallSERD(void);
 extern void PatchAfterStartup(void);
 
+// ROM offset of an A-Trap routine, 0 if unimplemented
+extern uint32 FindROMTrap(uint16 trap);
+
 #endif
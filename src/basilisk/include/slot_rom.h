@@ -24,4 +24,8 @@
 extern bool InstallSlotROM(void);
 extern void ChecksumSlotROM(void);
 
+// Size of the slot ROM at the end of the ROM, for the patched-ROM cache
+extern int GetSlotROMSize(void);
+extern void SetSlotROMSize(int size);
+
 #endif
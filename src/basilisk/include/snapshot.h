@@ -0,0 +1,79 @@
+/*
+ *  snapshot.h - Machine snapshots: suspend to the SD card, resume at boot
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A snapshot holds Mac RAM, the frame buffer, the CPU and FPU registers,
+ *  XPRAM and the host-side state of the drivers, so that the next boot can
+ *  continue where the Mac left off instead of starting Mac OS again. It is
+ *  only valid as long as the disk images are unchanged, so it is consumed
+ *  by a resume and discarded by a normal boot.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#ifndef MAC_SNAPSHOT
+#define MAC_SNAPSHOT 0
+#endif
+
+#if MAC_SNAPSHOT
+
+// Snapshot file on the SD card
+#define SNAPSHOT_PATH "/BasiliskII.snap"
+
+/*
+ *  Ask for a snapshot (any thread); the CPU thread takes it at its next
+ *  tick check outside of EmulOps, then stops the emulator
+ */
+extern void SnapshotRequest(void);
+
+// Called by cpu_do_check_ticks() (CPU thread)
+extern void SnapshotCheck(void);
+
+// True if the emulator was stopped by a snapshot
+extern bool SnapshotSuspended(void);
+
+// Once the emulator has closed the disk images (before PrefsExit())
+extern void SnapshotSeal(void);
+
+/*
+ *  True if the SD card holds a snapshot made by this firmware (Boot GUI;
+ *  whether it fits the configuration is checked by SnapshotResume())
+ */
+extern bool SnapshotAvailable(void);
+
+/*
+ *  Restore the machine after InitAll(), in place of the CPU reset; false
+ *  (and the emulator as after InitAll()) if the snapshot doesn't fit
+ */
+extern bool SnapshotResume(void);
+
+// Mark the snapshot as used up (the disks are about to change)
+extern void SnapshotInvalidate(void);
+
+/*
+ *  Module state. Each function below saves or restores its module's state,
+ *  depending on SnapshotRestoring(), through SnapshotData(), in the same
+ *  order both ways. On a save, false refuses the snapshot (the machine is
+ *  in a state that can't be restored); on a restore, false rejects it.
+ */
+extern bool SnapshotRestoring(void);
+extern bool SnapshotData(void *data, size_t size);
+template <typename T> static inline bool SnapshotVar(T &v) { return SnapshotData(&v, sizeof(v)); }
+
+extern bool CPUSnapshotReady(void); // newcpu.cpp, false while an EmulOp runs 68k code
+extern bool CPUSnapshot(void);      // newcpu.cpp
+extern bool VideoSnapshot(void);    // video.cpp
+extern bool TimerSnapshot(void);    // timer.cpp
+extern bool ADBSnapshot(void);      // adb.cpp
+extern bool SonySnapshot(void);     // sony.cpp
+extern bool DiskSnapshot(void);     // disk.cpp
+extern bool CDROMSnapshot(void);    // cdrom.cpp
+extern bool AudioSnapshot(void);    // audio.cpp
+extern bool ExtFSSnapshot(void);    // extfs.cpp
+extern bool EtherSnapshot(void);    // ether_esp32.cpp
+
+#endif
+
+#endif
@@ -76,4 +76,59 @@ extern void SysCDGetVolume(void *fh, uint8 &left, uint8 &right);
 // Periodic flush for sector cache - call from main loop
 extern void Sys_periodic_flush(void);
 
+// Print and reset disk cache statistics - call from the perf report
+extern void Sys_report_stats(void);
+
+// Record the boot's reads for read-ahead on the next boot - call as the
+// CPU starts a fresh boot
+extern void Sys_boot_trace_start(void);
+
+// Benchmarks (disk_bench_esp32.cpp): drop a handle's cached lines and stop
+// its boot trace replay, then send its I/O through the block cache or
+// straight to the image
+extern void Sys_set_cached(void *fh, bool cached);
+
+// The boot trace recorded for an image, (4 KB block, count) runs in the
+// order they were read; ps_malloc'ed, NULL if there is none
+extern uint32 *Sys_load_boot_trace(void *fh, int *runs);
+
+// Write everything back and mark the writable images clean, so the next
+// boot skips their repair - call when Mac OS shuts down
+extern void Sys_record_clean_shutdown(void);
+
+// Which block of the image, as find_hfs_partition() last found it, holds
+// the Apple_HFS partition map entry: 0 = none, -1 = not known. Kept across
+// boots (media catalog); find_hfs_partition() reports what it found.
+extern int Sys_hfs_partition_block(void *fh);
+extern void Sys_set_hfs_partition_block(void *fh, int block);
+
+// The disk driver mounted the HFS volume that starts at this offset of the
+// image: keep its catalog and extents B-trees in the block cache
+extern void Sys_set_hfs_volume(void *fh, loff_t start);
+
+/*
+ *  Asynchronous disk I/O: disk.cpp and cdrom.cpp hand asynchronous Device
+ *  Manager Prime() calls to Sys_async_submit() and return with ioResult
+ *  still pending (sony.cpp does the same with DiskCopy's 'SC' writes, a
+ *  cylinder per request). The transfer runs off the 68k thread; when it is
+ *  over, done is set and INTFLAG_DISK raised, and DiskInterrupt() /
+ *  CDROMInterrupt() / SonyInterrupt() complete the request through IODone. Sys_async_submit()
+ *  returns false if the request has to be done synchronously instead.
+ */
+#ifndef SYS_ASYNC_IO
+#define SYS_ASYNC_IO 0
+#endif
+
+struct sys_async_req {
+	void *fh;
+	void *buffer;
+	loff_t offset;
+	size_t length;
+	bool write;
+	size_t actual;			// Bytes transferred, valid once done is set
+	volatile bool done;
+};
+
+extern bool Sys_async_submit(sys_async_req *req);
+
 #endif
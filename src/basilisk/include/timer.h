@@ -44,6 +44,8 @@ extern int32 timer_host2mac_time(tm_time_t hosttime);
 
 // Suspend execution of emulator thread and resume it on events
 extern void idle_wait(void);
+extern void idle_wait_masked(void);		// Also with an interrupt pending, for a STOP that masks it
 extern void idle_resume(void);
+extern uint64 idle_time_usec(void);		// Total time spent in idle_wait() [us]
 
 #endif
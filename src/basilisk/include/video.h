@@ -179,6 +179,11 @@ public:
 	int16 driver_control(uint16 code, uint32 param, uint32 dce);
 	int16 driver_status(uint16 code, uint32 param);
 
+#if MAC_SNAPSHOT
+	// Save or restore the driver state (snapshot.h)
+	bool snapshot(void);
+#endif
+
 protected:
 	vector<video_mode> modes;                         // List of supported video modes
 	vector<video_mode>::const_iterator current_mode;  // Currently selected video mode
@@ -254,6 +259,13 @@ public:
 	
 	// Called by the video driver to set the gamma table
 	virtual void set_gamma(uint8 *gamma, int num) = 0;
+
+	// Video pages of the current mode, the base address of one and showing
+	// one (cscGetPages, cscGetBaseAddress, cscSetMode); one page by default
+	virtual int16 page_count(void) {return 1;}
+	virtual uint32 page_base(int16 page) {return mac_frame_base;}
+	virtual int16 displayed_page(void) {return 0;}
+	virtual void show_page(int16 page) {}
 };
 
 // Vector of pointers to available monitor descriptions, filled by VideoInit()
@@ -280,5 +292,93 @@ extern void VideoSignalFrameReady(void);  // Signal video task that a new frame
 // expensive per-frame comparison
 extern void VideoMarkDirtyOffset(uint32 offset);     // Mark single byte dirty
 extern void VideoMarkDirtyRange(uint32 offset, uint32 size);  // Mark range dirty
+extern void VideoMarkDirtyRect(uint32 offset, uint32 width, uint32 rows);  // Mark rows of width bytes dirty
+
+// Page flipping: a second frame buffer page follows the first, and the marks
+// take offsets into the displayed one (writes to the other fall outside it)
+#ifndef VIDEO_PAGE_FLIP
+#define VIDEO_PAGE_FLIP 0
+#endif
+
+#if VIDEO_PAGE_FLIP
+extern volatile uint32 video_page_offset;	// Frame buffer offset of the displayed page
+#define VIDEO_PAGE_OFFSET(offset) ((uint32)(offset) - video_page_offset)
+#else
+#define VIDEO_PAGE_OFFSET(offset) (offset)
+#endif
+
+// Deferred dirty tracking: writes only set a bit per VIDEO_DIRTY_SPAN_SHIFT-sized
+// span of the framebuffer (shift/mask, no division, no atomics); VideoRefresh()
+// folds the span bitmap into the tile bitmap on the CPU thread before the video
+// task collects it. A second-level summary bitmap keeps the fold proportional
+// to the number of dirty spans.
+#ifndef VIDEO_DEFERRED_DIRTY
+#define VIDEO_DEFERRED_DIRTY 0
+#endif
+
+#if VIDEO_DEFERRED_DIRTY
+#define VIDEO_DIRTY_SPAN_SHIFT	5			// 32 bytes per span
+#define VIDEO_DIRTY_FB_MAX		0x200000	// Framebuffer bytes covered (1280x720x16)
+#define VIDEO_DIRTY_SPAN_WORDS	((VIDEO_DIRTY_FB_MAX >> VIDEO_DIRTY_SPAN_SHIFT) / 32 + 1)	// +1: last span of a write
+#define VIDEO_DIRTY_SUMMARY_WORDS	(VIDEO_DIRTY_SPAN_WORDS / 32 + 1)
+
+extern uint32 video_dirty_spans[VIDEO_DIRTY_SPAN_WORDS];
+extern uint32 video_dirty_summary[VIDEO_DIRTY_SUMMARY_WORDS];
+
+static inline void VideoMarkDirtySpan(uint32 span)
+{
+	video_dirty_spans[span >> 5] |= 1u << (span & 31);
+	video_dirty_summary[span >> 10] |= 1u << ((span >> 5) & 31);
+}
+
+// size is 1, 2 or 4, so a write touches at most two spans
+static inline void VideoMarkDirtyDeferred(uint32 offset, uint32 size)
+{
+	if (offset >= VIDEO_DIRTY_FB_MAX)
+		return;
+	uint32 first = offset >> VIDEO_DIRTY_SPAN_SHIFT;
+	uint32 last = (offset + size - 1) >> VIDEO_DIRTY_SPAN_SHIFT;
+	VideoMarkDirtySpan(first);
+	if (last != first)
+		VideoMarkDirtySpan(last);
+}
+
+extern void VideoFlushDirtySpans(void);
+
+#define VIDEO_MARK_DIRTY(offset, size) VideoMarkDirtyDeferred(VIDEO_PAGE_OFFSET(offset), size)
+#else
+#define VIDEO_MARK_DIRTY(offset, size) VideoMarkDirtyRange(VIDEO_PAGE_OFFSET(offset), size)
+#endif
+
+// Cursor overlay: the QuickDraw cursor vectors are replaced (rom_patches.cpp)
+// so Mac OS never draws the cursor into the frame buffer; VideoCursorOp()
+// keeps the Mac-side cursor state and the platform composites the cursor
+// image over the screen when it pushes tiles.
+#ifndef VIDEO_CURSOR_OVERLAY
+#define VIDEO_CURSOR_OVERLAY 0
+#endif
+
+#if VIDEO_CURSOR_OVERLAY
+enum {	// Selectors of M68K_EMUL_OP_CURSOR, one per replaced low-memory vector
+	CURSOR_OP_HIDE,			// JHideCursor
+	CURSOR_OP_SHOW,			// JShowCursor
+	CURSOR_OP_SHIELD,		// JShieldCursor
+	CURSOR_OP_OBSCURE,		// JCrsrObscure
+	CURSOR_OP_SET,			// JSetCrsr
+	CURSOR_OP_SET_COLOR,	// JSetCCrsr
+	CURSOR_OP_INIT,			// JInitCrsr
+	CURSOR_OP_TASK,			// JCrsrTask (VBL)
+	CURSOR_OP_COUNT
+};
+
+struct M68kRegisters;
+extern void VideoCursorInit(void);
+extern void VideoCursorOp(M68kRegisters *r);
+
+// Platform side: cursor is 16 rows of data, 16 rows of mask (big-endian bit
+// order as in a Cursor record) and the hot spot
+extern void video_cursor_set_image(const uint16 *data, const uint16 *mask, int hot_h, int hot_v);
+extern void video_cursor_update(int h, int v, bool visible);
+#endif
 
 #endif
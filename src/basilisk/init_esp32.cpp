@@ -0,0 +1,214 @@
+/*
+ *  init_esp32.cpp - Boot stages run by dependency on both cores
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Most of the boot is waiting: for the SD card while the ROM and the disk
+ *  images are read, for Wi-Fi and the USB host to come up. The stages of
+ *  InitEmulator() only depend on a few others, so the calling task (the
+ *  CPU thread on Core 1) and a helper task on Core 0 each pick the next
+ *  stage whose dependencies are done. Both take the table in order, so
+ *  putting the long chain first keeps it on the critical path. The time
+ *  of every stage is printed at the end to catch boot regressions.
+ */
+
+#include "sysdeps.h"
+#include "init_esp32.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define INIT_MAX_STAGES         32
+#define INIT_TASK_STACK_SIZE    8192        // Stages bring up Wi-Fi and the disk cache
+#define INIT_TASK_PRIORITY      1
+
+enum {
+    STAGE_WAITING,
+    STAGE_RUNNING,
+    STAGE_DONE
+};
+
+struct stage_info {
+    uint8 status;
+    uint8 core;
+    uint32 start_us;        // Since InitRunStages() was called
+    uint32 time_us;
+};
+
+static const init_stage *stage_table;
+static int stage_count;
+static stage_info stage_infos[INIT_MAX_STAGES];
+static uint32 done_mask;
+static int running_count;
+static int failed_stage;
+static bool stages_finished;            // Set by the caller, the helper then exits
+static uint32 start_time_us;
+
+static portMUX_TYPE stage_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t caller_task = NULL;
+static TaskHandle_t helper_task = NULL;
+static SemaphoreHandle_t helper_exited = NULL;
+
+/*
+ *  Claim the next stage this task can run (stage_lock held): its index,
+ *  -1 if one is waiting for its dependencies, -2 if none is left
+ */
+static int claim_stage(bool caller)
+{
+    bool waiting = false;
+    for (int i = 0; i < stage_count; i++) {
+        if (stage_infos[i].status != STAGE_WAITING || (stage_table[i].caller && !caller)) {
+            continue;
+        }
+        if ((stage_table[i].deps & ~done_mask) == 0) {
+            stage_infos[i].status = STAGE_RUNNING;
+            running_count++;
+            return i;
+        }
+        waiting = true;
+    }
+    return waiting ? -1 : -2;
+}
+
+static void wake_workers(void)
+{
+    xTaskNotifyGive(caller_task);
+    if (helper_task) {
+        xTaskNotifyGive(helper_task);
+    }
+}
+
+static void run_stage(int i)
+{
+    uint32 start = micros();
+    bool ok = stage_table[i].run();
+    uint32 end = micros();
+
+    portENTER_CRITICAL(&stage_lock);
+    stage_infos[i].status = STAGE_DONE;
+    stage_infos[i].core = xPortGetCoreID();
+    stage_infos[i].start_us = start - start_time_us;
+    stage_infos[i].time_us = end - start;
+    done_mask |= INIT_STAGE(i);
+    if (!ok && failed_stage < 0) {
+        failed_stage = i;
+    }
+    running_count--;
+    portEXIT_CRITICAL(&stage_lock);
+    wake_workers();
+}
+
+// Run stages until none is left for this task (the caller also waits for the helper's)
+static void run_stages(bool caller)
+{
+    for (;;) {
+        portENTER_CRITICAL(&stage_lock);
+        int i = failed_stage < 0 ? claim_stage(caller) : -2;
+        bool idle = running_count == 0;
+        bool finished = stages_finished;
+        portEXIT_CRITICAL(&stage_lock);
+
+        if (i >= 0) {
+            run_stage(i);
+            continue;
+        }
+        if (caller && idle) {
+            if (i == -1) {
+                // Nothing runs and nothing can start: a dependency on a later or unknown stage
+                for (int j = 0; j < stage_count; j++) {
+                    if (stage_infos[j].status == STAGE_WAITING) {
+                        Serial.printf("[INIT] ERROR: stage %s can't start, dependencies 0x%08x\n",
+                                      stage_table[j].name, stage_table[j].deps & ~done_mask);
+                        failed_stage = j;
+                        break;
+                    }
+                }
+            }
+            return;
+        }
+        if (!caller && finished) {
+            return;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+static void initHelperTask(void *param)
+{
+    UNUSED(param);
+    run_stages(false);
+    xSemaphoreGive(helper_exited);
+    vTaskDelete(NULL);
+}
+
+/*
+ *  Print the time of every stage
+ */
+static void report_stages(uint32 total_us)
+{
+    uint32 sum_us = 0;
+    Serial.println("[INIT] Stage           Core     Start      Time");
+    for (int i = 0; i < stage_count; i++) {
+        const stage_info &s = stage_infos[i];
+        if (s.status != STAGE_DONE) {
+            Serial.printf("[INIT] %-14s    -         -   not run\n", stage_table[i].name);
+            continue;
+        }
+        Serial.printf("[INIT] %-14s %4d %6u ms %6u ms\n", stage_table[i].name, s.core,
+                      (unsigned)(s.start_us / 1000), (unsigned)(s.time_us / 1000));
+        sum_us += s.time_us;
+    }
+    Serial.printf("[INIT] Boot stages took %u ms (%u ms one after another)\n",
+                  (unsigned)(total_us / 1000), (unsigned)(sum_us / 1000));
+}
+
+/*
+ *  Run the stages
+ */
+int InitRunStages(const init_stage *stages, int count, bool parallel)
+{
+    if (count > INIT_MAX_STAGES) {
+        Serial.printf("[INIT] ERROR: %d stages, at most %d\n", count, INIT_MAX_STAGES);
+        return 0;
+    }
+    stage_table = stages;
+    stage_count = count;
+    memset(stage_infos, 0, sizeof(stage_infos));
+    done_mask = 0;
+    running_count = 0;
+    failed_stage = -1;
+    stages_finished = false;
+    start_time_us = micros();
+    caller_task = xTaskGetCurrentTaskHandle();
+    helper_task = NULL;
+
+    if (parallel) {
+        if (helper_exited == NULL) {
+            helper_exited = xSemaphoreCreateBinary();
+        }
+        if (helper_exited == NULL ||
+            xTaskCreatePinnedToCore(initHelperTask, "InitHelper", INIT_TASK_STACK_SIZE, NULL,
+                                    INIT_TASK_PRIORITY, &helper_task, 0) != pdPASS) {
+            Serial.println("[INIT] WARNING: helper task not started, stages run one after another");
+            helper_task = NULL;
+        }
+    }
+
+    run_stages(true);
+
+    if (helper_task) {
+        portENTER_CRITICAL(&stage_lock);
+        stages_finished = true;
+        portEXIT_CRITICAL(&stage_lock);
+        xTaskNotifyGive(helper_task);
+        xSemaphoreTake(helper_exited, portMAX_DELAY);
+        helper_task = NULL;
+    }
+
+    report_stages(micros() - start_time_us);
+    return failed_stage;
+}
@@ -0,0 +1,28 @@
+/*
+ *  init_esp32.h - Boot stages run by dependency on both cores
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef INIT_ESP32_H
+#define INIT_ESP32_H
+
+// Up to 32 stages, each given by its index in the stage table
+#define INIT_STAGE(i)   (1u << (i))
+
+struct init_stage {
+    const char *name;
+    bool (*run)(void);      // false stops the boot
+    uint32 deps;            // INIT_STAGE() bits of the stages to finish first
+    bool caller;            // Must run on the calling task (the CPU thread)
+};
+
+/*
+ *  Run the stages, each once all of its dependencies are done. With
+ *  parallel set, a helper task on Core 0 takes stages alongside the
+ *  caller. Returns the index of the first stage that failed, or -1; the
+ *  stages running at that point still finish, no others start.
+ */
+extern int InitRunStages(const init_stage *stages, int count, bool parallel);
+
+#endif /* INIT_ESP32_H */
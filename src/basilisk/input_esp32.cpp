@@ -9,12 +9,22 @@
  *  - USB HID mouse input (via EspUsbHost library)
  *
  *  USB Host uses USB2 port on M5Stack Tab5
+ *
+ *  Touch is polled by the input task. The USB host has a task of its own
+ *  that waits in the host library's and client's event handlers, so a
+ *  keyboard or mouse report reaches the ADB queue as its transfer
+ *  completes, instead of at the next touch poll.
  */
 
 #include "sysdeps.h"
 #include "input.h"
 #include "adb.h"
 #include "video.h"
+#include "prefs.h"
+#include "snapshot.h"
+#include "profiler_esp32.h"
+#include "replay_esp32.h"
+#include "screenrec_esp32.h"
 
 #include <M5Unified.h>
 #include <EspUsbHost.h>
@@ -31,10 +41,17 @@
 #define INPUT_TASK_STACK_SIZE 4096
 #define INPUT_TASK_PRIORITY   1
 #define INPUT_TASK_CORE       0  // Run on Core 0, leaving Core 1 for CPU emulation
-#define INPUT_POLL_INTERVAL_MS 16  // 60Hz polling
+#define TOUCH_POLL_INTERVAL_MS  4  // Touch sampled faster than the panel reports
+#define USB_TASK_STACK_SIZE   4096
+#define USB_TASK_PRIORITY     2  // Reports preempt touch polling
+#define TOUCH_MOVE_INTERVAL_US 16625  // At most one cursor move per Mac 60Hz tick
+#define TOUCH_STILL_US 50000       // No new touch position for this long = finger stopped
+#define TOUCH_PREDICT_MAX_MS 32    // Upper limit for the "touchpredict" pref
 
 static TaskHandle_t input_task_handle = NULL;
 static volatile bool input_task_running = false;
+static TaskHandle_t usb_task_handle = NULL;
+static volatile bool usb_task_running = false;
 
 // ============================================================================
 // USB HID Scancode to Mac ADB Keycode Translation Table
@@ -252,6 +269,15 @@ static bool touch_pending_click = false;  // Defer click until cursor has moved
 static int last_touch_x = 0;
 static int last_touch_y = 0;
 
+// Touch motion: samples are coalesced into one cursor move per Mac tick,
+// optionally led by the finger's velocity ("touchpredict" ms ahead)
+static int touch_predict_ms = 0;
+static uint32 touch_down_us = 0;          // When the current touch started
+static uint32 touch_changed_us = 0;       // When the touch position last changed
+static uint32 touch_moved_us = 0;         // When the cursor was last moved
+static int touch_vx = 0, touch_vy = 0;    // Velocity [Mac pixels per ms, 8.8 fixed point]
+static int touch_sent_x = 0, touch_sent_y = 0;  // Last position handed to ADB
+
 // USB device connection state
 static bool keyboard_connected = false;
 static bool mouse_connected = false;
@@ -291,6 +317,11 @@ public:
     // Track if keyboard is connected for LED control
     bool has_keyboard = false;
     
+#if MAC_SNAPSHOT
+    // Ctrl+Pause suspends the machine; the Pause key isn't passed on then
+    bool suspend_key_down = false;
+#endif
+    
     // Helper to check if a specific modifier is held (combining left+right)
     bool isControlHeld() { return (modifier_state & 0x11) != 0; }
     bool isShiftHeld() { return (modifier_state & 0x22) != 0; }
@@ -344,6 +375,12 @@ public:
             }
             
             if (!still_pressed) {
+#if MAC_SNAPSHOT
+                if (old_key == 0x48 && suspend_key_down) {
+                    suspend_key_down = false;
+                    continue;
+                }
+#endif
                 uint8_t mac_code = usb_to_mac_keycode[old_key];
                 if (mac_code != 0xFF) {
                     ADBKeyUp(mac_code);
@@ -366,6 +403,34 @@ public:
             }
             
             if (!was_pressed) {
+#if MAC_SNAPSHOT
+                if (new_key == 0x48 && isControlHeld()) {
+                    suspend_key_down = true;
+                    SnapshotRequest();
+                    continue;
+                }
+#endif
+#if SCREEN_RECORD
+                // Ctrl+Shift+Print Screen starts or stops a screen recording
+                if (new_key == 0x46 && isControlHeld() && isShiftHeld()) {
+                    ScreenRecToggle();
+                    continue;
+                }
+#endif
+#if PROFILER
+                // Ctrl+Print Screen dumps the profile
+                if (new_key == 0x46 && isControlHeld()) {
+                    ProfilerRequestDump();
+                    continue;
+                }
+#endif
+#if REPLAY
+                // Ctrl+Scroll Lock ends a recording
+                if (new_key == 0x47 && isControlHeld()) {
+                    ReplayRequestStop();
+                    continue;
+                }
+#endif
                 uint8_t mac_code = usb_to_mac_keycode[new_key];
                 if (mac_code != 0xFF) {
                     ADBKeyDown(mac_code);
@@ -540,7 +605,8 @@ public:
 
 /*
  *  Convert display coordinates to Mac screen coordinates
- *  Display is 1280x720, Mac screen is 640x360 (2x scale factor)
+ *  Display is 1280x720 (720x1280 in portrait, touch follows the rotation),
+ *  Mac screen is the current mode from InputSetScreenSize()
  */
 static void convertTouchToMac(int touch_x, int touch_y, int *mac_x, int *mac_y)
 {
@@ -555,9 +621,20 @@ static void convertTouchToMac(int touch_x, int touch_y, int *mac_x, int *mac_y)
     if (*mac_y >= mac_screen_height) *mac_y = mac_screen_height - 1;
 }
 
+/*
+ *  Hand a touch position to ADB
+ */
+static void moveTouchCursor(int mac_x, int mac_y, uint32 now)
+{
+    ADBMouseMoved(mac_x, mac_y);
+    touch_sent_x = mac_x;
+    touch_sent_y = mac_y;
+    touch_moved_us = now;
+}
+
 /*
  *  Process touch panel input
- *  Called from InputPoll() to handle touch events
+ *  Called from the input task every TOUCH_POLL_INTERVAL_MS
  */
 static void processTouchInput(void)
 {
@@ -569,6 +646,7 @@ static void processTouchInput(void)
     bool is_pressed = touch_detail.isPressed();
     int touch_x = touch_detail.x;
     int touch_y = touch_detail.y;
+    uint32 now = micros();
     
     // Convert to Mac coordinates
     int mac_x, mac_y;
@@ -579,28 +657,55 @@ static void processTouchInput(void)
             // Touch just started - switch to absolute mode for touch
             ADBSetRelMouseMode(false);
             touch_was_pressed = true;
+            touch_down_us = now;
+            touch_changed_us = now;
+            touch_vx = touch_vy = 0;
             
             // Move cursor to touch position first
-            ADBMouseMoved(mac_x, mac_y);
+            moveTouchCursor(mac_x, mac_y, now);
             
-            // Defer the click until next poll cycle to ensure cursor has moved
+            // Defer the click for a Mac tick so the cursor has moved by then
             // This prevents the "click before move" issue where the Mac processes
             // the button event before the cursor position update takes effect
             touch_pending_click = true;
         } else {
-            // Check if we have a pending click from the previous cycle
-            if (touch_pending_click) {
+            // Check if we have a pending click from before
+            if (touch_pending_click && now - touch_down_us >= TOUCH_MOVE_INTERVAL_US) {
                 // Now that cursor position has been processed, send the click
                 ADBMouseDown(0);
                 touch_pending_click = false;
             }
             
-            // Touch is being held/dragged
-            // Only update if position changed significantly (reduce noise)
+            // Touch is being held/dragged; follow the finger's velocity
+            // between position changes (the panel reports slower than we poll)
             int dx = mac_x - last_touch_x;
             int dy = mac_y - last_touch_y;
             if (dx != 0 || dy != 0) {
-                ADBMouseMoved(mac_x, mac_y);
+                uint32 dt_us = now - touch_changed_us;
+                touch_changed_us = now;
+                if (dt_us > 0 && dt_us < TOUCH_STILL_US) {
+                    int vx = (int)(((int64_t)dx << 8) * 1000 / dt_us);
+                    int vy = (int)(((int64_t)dy << 8) * 1000 / dt_us);
+                    touch_vx = (touch_vx + vx) / 2;
+                    touch_vy = (touch_vy + vy) / 2;
+                }
+            } else if (now - touch_changed_us >= TOUCH_STILL_US) {
+                touch_vx = touch_vy = 0;
+            }
+            
+            // One cursor move per Mac tick, a little ahead of the finger if
+            // prediction is on; not before the click, which must land where
+            // the touch started
+            if (!touch_pending_click && now - touch_moved_us >= TOUCH_MOVE_INTERVAL_US) {
+                int x = mac_x + ((touch_vx * touch_predict_ms) >> 8);
+                int y = mac_y + ((touch_vy * touch_predict_ms) >> 8);
+                if (x < 0) x = 0;
+                if (x >= mac_screen_width) x = mac_screen_width - 1;
+                if (y < 0) y = 0;
+                if (y >= mac_screen_height) y = mac_screen_height - 1;
+                if (x != touch_sent_x || y != touch_sent_y) {
+                    moveTouchCursor(x, y, now);
+                }
             }
         }
         
@@ -608,7 +713,12 @@ static void processTouchInput(void)
         last_touch_y = mac_y;
     } else {
         if (touch_was_pressed) {
-            // Touch just released
+            // Touch just released - at the actual last position, not the
+            // predicted one (button events carry the cursor position)
+            if (last_touch_x != touch_sent_x || last_touch_y != touch_sent_y) {
+                moveTouchCursor(last_touch_x, last_touch_y, now);
+            }
+            
             // If there was a pending click that never got sent (very quick tap),
             // send click and release together
             if (touch_pending_click) {
@@ -651,15 +761,16 @@ static void updateKeyboardLEDs(void)
 // ============================================================================
 
 /*
- *  Input polling task - runs on Core 0 independently of CPU emulation
- *  This offloads the ~2.3ms USB host processing from the CPU emulation loop
+ *  Input polling task - runs on Core 0 independently of CPU emulation,
+ *  samples the touch panel every TOUCH_POLL_INTERVAL_MS
  */
 static void inputTask(void *param)
 {
     (void)param;
     Serial.println("[INPUT] Input task started on Core 0");
     
-    const TickType_t poll_interval = pdMS_TO_TICKS(INPUT_POLL_INTERVAL_MS);
+    const TickType_t poll_interval = pdMS_TO_TICKS(TOUCH_POLL_INTERVAL_MS);
+    TickType_t last_wake = xTaskGetTickCount();
     
     while (input_task_running) {
         // Update M5 library (touch, buttons, etc.)
@@ -668,19 +779,39 @@ static void inputTask(void *param)
         // Process touch input
         processTouchInput();
         
-        // Process USB Host events (this is the slow part ~2ms)
-        if (usbHost != NULL) {
-            usbHost->task();
-        }
+        // Wait until next poll interval (fixed rate, whatever this pass cost)
+        vTaskDelayUntil(&last_wake, poll_interval);
+    }
+    
+    Serial.println("[INPUT] Input task exiting");
+    vTaskDelete(NULL);
+}
+
+/*
+ *  USB host task: task() blocks in usb_host_lib_handle_events() and
+ *  usb_host_client_handle_events() (a tick at most each) and runs the
+ *  report callbacks as transfers complete; EspUsbHost resubmits the
+ *  interrupt transfers in there once their endpoint's bInterval is up, so
+ *  it has to keep being called for a fast mouse to be read at its own rate
+ */
+static void usbTask(void *param)
+{
+    (void)param;
+    
+    while (usb_task_running) {
+        TickType_t start = xTaskGetTickCount();
+        usbHost->task();
         
         // Update keyboard LEDs (Caps Lock, etc.)
         updateKeyboardLEDs();
         
-        // Wait until next poll interval
-        vTaskDelay(poll_interval);
+        // A pass that didn't block (events back to back) leaves the touch
+        // task a tick, it runs below us on this core
+        if (xTaskGetTickCount() == start) {
+            vTaskDelay(1);
+        }
     }
     
-    Serial.println("[INPUT] Input task exiting");
     vTaskDelete(NULL);
 }
 
@@ -704,6 +835,14 @@ bool InputInit(void)
     touch_pending_click = false;
     last_touch_x = 0;
     last_touch_y = 0;
+    touch_predict_ms = PrefsFindInt32("touchpredict");
+    if (touch_predict_ms < 0) {
+        touch_predict_ms = 0;
+    } else if (touch_predict_ms > TOUCH_PREDICT_MAX_MS) {
+        touch_predict_ms = TOUCH_PREDICT_MAX_MS;
+    }
+    Serial.printf("[INPUT] Touch: sampled every %d ms, cursor moves coalesced per tick, prediction %d ms\n",
+                  TOUCH_POLL_INTERVAL_MS, touch_predict_ms);
     
     // Initialize LED state
     last_led_state = 0;
@@ -724,8 +863,9 @@ bool InputInit(void)
         Serial.println("[INPUT] ERROR: Failed to create USB Host instance");
     }
     
-    // Start input polling task on Core 0
+    // Start input polling task on Core 0 (or as placed by "taskcores")
     // This offloads input processing from the CPU emulation loop
+    int input_core = PrefsFindTaskCore("input", INPUT_TASK_CORE);
     input_task_running = true;
     BaseType_t result = xTaskCreatePinnedToCore(
         inputTask,
@@ -734,14 +874,24 @@ bool InputInit(void)
         NULL,
         INPUT_TASK_PRIORITY,
         &input_task_handle,
-        INPUT_TASK_CORE
+        input_core
     );
     
     if (result != pdPASS) {
         Serial.println("[INPUT] ERROR: Failed to create input task");
         input_task_running = false;
     } else {
-        Serial.printf("[INPUT] Input task created on Core %d\n", INPUT_TASK_CORE);
+        Serial.printf("[INPUT] Input task created on Core %d\n", input_core);
+    }
+    
+    // USB host events on the same core, at a higher priority than touch
+    if (usbHost != NULL) {
+        usb_task_running = true;
+        if (xTaskCreatePinnedToCore(usbTask, "USBHostTask", USB_TASK_STACK_SIZE, NULL,
+                                    USB_TASK_PRIORITY, &usb_task_handle, input_core) != pdPASS) {
+            Serial.println("[INPUT] ERROR: Failed to create USB host task");
+            usb_task_running = false;
+        }
     }
     
     return true;
@@ -751,12 +901,14 @@ void InputExit(void)
 {
     Serial.println("[INPUT] Shutting down input subsystem");
     
-    // Stop input task first
-    if (input_task_running) {
+    // Stop the input and USB host tasks first
+    if (input_task_running || usb_task_running) {
         input_task_running = false;
-        // Give task time to exit gracefully
+        usb_task_running = false;
+        // Give the tasks time to exit gracefully
         vTaskDelay(pdMS_TO_TICKS(50));
         input_task_handle = NULL;
+        usb_task_handle = NULL;
     }
     
     // Release any held buttons
@@ -778,13 +930,11 @@ void InputPoll(void)
     // Process touch input
     processTouchInput();
     
-    // Process USB Host events
-    if (usbHost != NULL) {
+    // Process USB Host events, unless the USB host task does
+    if (usbHost != NULL && !usb_task_running) {
         usbHost->task();
+        updateKeyboardLEDs();
     }
-    
-    // Update keyboard LEDs (Caps Lock, etc.)
-    updateKeyboardLEDs();
 }
 
 void InputSetScreenSize(int width, int height)
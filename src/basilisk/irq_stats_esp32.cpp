@@ -0,0 +1,86 @@
+/*
+ *  irq_stats_esp32.cpp - Interrupt raise-to-delivery latency histograms
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Audio, the Time Manager and input all wait on how soon the 68k takes
+ *  a level 1 interrupt once a host task has raised its flag. That takes
+ *  the rest of the instruction batch, the tick quantum and, if the 68k
+ *  was stopped or in idle_wait(), the wake-up. SetInterruptFlag() stamps
+ *  each source the first time it is raised (esp_timer us), and the next
+ *  Interrupt() on the CPU task records now - stamp into that source's
+ *  histogram. The telemetry line then gives p50/p99/max per source:
+ *
+ *    "h":{"irq.60hz_us":{"n":60,...},"irq.timer_us":{...},"irq.adb_us":{...},...}
+ *
+ *  A source raised again before it was delivered keeps its first stamp.
+ *  These are the numbers to tune EXEC_BATCH_SIZE, "irqlatency" (the tick
+ *  quantum) and the event-driven timer against.
+ */
+
+#include "sysdeps.h"
+#include "main.h"
+#include "perf_esp32.h"
+#include "irq_stats_esp32.h"
+
+#include "esp_timer.h"
+
+#if IRQ_STATS
+
+#define IRQ_STATS_SOURCES       9       // Flag bits through INTFLAG_DISK
+
+// Histogram per flag bit, NULL = not timed (1Hz, NMI)
+static const char *const source_names[IRQ_STATS_SOURCES] = {
+    "irq.60hz_us",      // INTFLAG_60HZ
+    NULL,               // INTFLAG_1HZ
+    "irq.serial_us",    // INTFLAG_SERIAL
+    "irq.ether_us",     // INTFLAG_ETHER
+    "irq.audio_us",     // INTFLAG_AUDIO
+    "irq.timer_us",     // INTFLAG_TIMER
+    "irq.adb_us",       // INTFLAG_ADB
+    NULL,               // INTFLAG_NMI
+    "irq.disk_us",      // INTFLAG_DISK
+};
+
+static perf_histogram *histograms[IRQ_STATS_SOURCES];
+static uint32 source_mask = 0;                  // Bits with a histogram
+static uint32 raised_us[IRQ_STATS_SOURCES];
+uint32 irq_stats_pending = 0;
+
+void IRQStatsInit(void)
+{
+    for (int b = 0; b < IRQ_STATS_SOURCES; b++) {
+        if (source_names[b]) {
+            histograms[b] = PerfHistogram(source_names[b]);
+            source_mask |= 1 << b;
+        }
+    }
+}
+
+void IRQStatsRaise(uint32 flag)
+{
+    // Newly raised sources only; the first raise's stamp stands
+    uint32 fresh = flag & source_mask & ~__atomic_load_n(&InterruptFlags, __ATOMIC_RELAXED)
+                   & ~__atomic_load_n(&irq_stats_pending, __ATOMIC_RELAXED);
+    if (fresh == 0) {
+        return;
+    }
+    uint32 now = (uint32)esp_timer_get_time();
+    for (uint32 bits = fresh; bits; bits &= bits - 1) {
+        __atomic_store_n(&raised_us[__builtin_ctz(bits)], now, __ATOMIC_RELAXED);
+    }
+    // Release: the stamps are written before Interrupt() can see the bits
+    __atomic_or_fetch(&irq_stats_pending, fresh, __ATOMIC_RELEASE);
+}
+
+void IRQStatsDeliver(void)
+{
+    uint32 bits = __atomic_exchange_n(&irq_stats_pending, 0, __ATOMIC_ACQUIRE);
+    uint32 now = (uint32)esp_timer_get_time();
+    for (; bits; bits &= bits - 1) {
+        int b = __builtin_ctz(bits);
+        PerfRecord(histograms[b], now - __atomic_load_n(&raised_us[b], __ATOMIC_RELAXED));
+    }
+}
+
+#endif // IRQ_STATS
@@ -0,0 +1,41 @@
+/*
+ *  irq_stats_esp32.h - Interrupt raise-to-delivery latency histograms
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef IRQ_STATS_ESP32_H
+#define IRQ_STATS_ESP32_H
+
+#ifndef IRQ_STATS
+#define IRQ_STATS 0
+#endif
+
+#if IRQ_STATS
+
+// Interrupt flags raised and stamped, not yet seen by Interrupt()
+extern uint32 irq_stats_pending;
+
+// Register the "irq.*_us" histograms
+extern void IRQStatsInit(void);
+
+/*
+ *  SetInterruptFlag(), before the flag is set: stamps the sources in flag
+ *  that aren't pending yet, so a source raised again before the 68k took
+ *  it is timed from its first raise
+ */
+extern void IRQStatsRaise(uint32 flag);
+
+// Interrupt() in newcpu.cpp: record the latency of every stamped source
+extern void IRQStatsDeliver(void);
+
+static inline void IRQStatsCheck(void)
+{
+    if (__atomic_load_n(&irq_stats_pending, __ATOMIC_RELAXED)) {
+        IRQStatsDeliver();
+    }
+}
+
+#endif
+
+#endif /* IRQ_STATS_ESP32_H */
@@ -0,0 +1,452 @@
+/*
+ *  log_esp32.cpp - Deferred serial logging
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A Serial.printf() blocks while the USB CDC buffer is full, which is
+ *  whenever no host drains it; on the CPU task that stalls the Mac.
+ *  LogPrintf() instead writes a compact record into a ring of the calling
+ *  core and returns:
+ *
+ *    header   size in bytes (multiple of 4) | kind << 16, stored last
+ *    fmt      the format pointer (the strings are literals in flash)
+ *    specs    number of conversions whose arguments follow
+ *    args     each argument in its promoted type's bytes, strings as a
+ *             length byte and up to LOG_STR_MAX - 1 characters
+ *
+ *  The log task walks the format again, with the same parser, and prints
+ *  each conversion with snprintf(). Tasks on one core share its ring,
+ *  so space is reserved with a compare-and-swap on the head; the
+ *  header is published with release order once the record is complete,
+ *  and the task consumes up to the first record still being written. It
+ *  zeroes what it consumed, so a header slot reads 0 until its record is
+ *  ready. A record that doesn't fit before the end of the ring is preceded
+ *  by a pad record up to it.
+ */
+
+#include "sysdeps.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include "prefs.h"
+#include "perf_esp32.h"
+#include "log_esp32.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if LOG_ASYNC
+
+#define LOG_RING_SIZE           4096        // Bytes per core (power of two)
+#define LOG_RECORD_MAX          256         // Largest record
+#define LOG_STR_MAX             160         // Longest %s argument kept, with the NUL
+#define LOG_LINE_MAX            320         // Formatted record
+#define LOG_FLUSH_MS            20          // Log task period
+
+#define LOG_TASK_STACK_SIZE     3072
+#define LOG_TASK_PRIORITY       1
+#define LOG_TASK_CORE           0
+
+enum {
+    LOG_KIND_RECORD = 1,
+    LOG_KIND_PAD = 2,
+};
+
+struct log_ring {
+    uint32 head;                    // Reserved up to (producers)
+    uint32 tail;                    // Consumed up to (log task)
+    uint32 drops;                   // Messages that found the ring full
+    uint32 drops_reported;          // Log task
+    uint8 data[LOG_RING_SIZE] __attribute__((aligned(4)));
+};
+
+DRAM_ATTR static log_ring log_rings[portNUM_PROCESSORS];
+static TaskHandle_t log_task_handle = NULL;
+static volatile bool log_running = false;
+static volatile bool log_stop = false;
+
+static perf_counter *perf_drops = NULL;     // "log.drops"
+
+// Argument types, as printf promotes them
+enum {
+    ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+    ARG_DOUBLE, ARG_LDOUBLE, ARG_PTR, ARG_STR, ARG_COUNT, ARG_NONE, ARG_BAD
+};
+
+struct log_spec {
+    const char *start;              // At the '%'
+    const char *end;                // Past the conversion character
+    bool star_width, star_prec;
+    int type;
+};
+
+
+/*
+ *  Parse the conversion at p (just past its '%')
+ */
+
+static void parseSpec(const char *p, log_spec &s)
+{
+    s.start = p - 1;
+    s.star_width = s.star_prec = false;
+    while (*p && strchr("-+ #0", *p)) p++;
+    if (*p == '*') {
+        s.star_width = true;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            s.star_prec = true;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') p++;
+    }
+
+    int len = 0;                    // 'l', 'q' (ll), 'z', 'j', 't', 'L'
+    if (*p == 'h') {
+        p++;
+        if (*p == 'h') p++;
+    } else if (*p == 'l') {
+        p++;
+        len = 'l';
+        if (*p == 'l') {
+            p++;
+            len = 'q';
+        }
+    } else if (*p && strchr("zjtL", *p)) {
+        len = *p++;
+    }
+
+    char conv = *p;
+    s.end = conv ? p + 1 : p;
+    switch (conv) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+            s.type = len == 'l' ? ARG_LONG : len == 'q' ? ARG_LLONG : len == 'z' ? ARG_SIZE :
+                     len == 'j' ? ARG_INTMAX : len == 't' ? ARG_PTRDIFF : ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            s.type = len == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+            break;
+        case 's':
+            s.type = ARG_STR;
+            break;
+        case 'p':
+            s.type = ARG_PTR;
+            break;
+        case 'n':
+            s.type = ARG_COUNT;
+            break;
+        case '%':
+            s.type = ARG_NONE;
+            break;
+        default:
+            s.type = ARG_BAD;
+            break;
+    }
+}
+
+static size_t argSize(int type)
+{
+    switch (type) {
+        case ARG_LONG:      return sizeof(long);
+        case ARG_LLONG:     return sizeof(long long);
+        case ARG_SIZE:      return sizeof(size_t);
+        case ARG_INTMAX:    return sizeof(intmax_t);
+        case ARG_PTRDIFF:   return sizeof(ptrdiff_t);
+        case ARG_DOUBLE:    return sizeof(double);
+        case ARG_LDOUBLE:   return sizeof(long double);
+        case ARG_PTR:       return sizeof(void *);
+        default:            return sizeof(int);
+    }
+}
+
+
+/*
+ *  Pack the arguments of fmt into buf, returns the bytes used
+ */
+
+static size_t packArgs(const char *fmt, va_list ap, uint8 *buf, size_t size)
+{
+    size_t n = sizeof(uint16);      // specs
+    uint16 specs = 0;
+
+    for (const char *p = fmt; *p; ) {
+        if (*p++ != '%') continue;
+        log_spec s;
+        parseSpec(p, s);
+        p = s.end;
+        if (s.type == ARG_BAD) break;
+
+        // Worst case for this conversion: two '*' ints and the argument
+        size_t need = 2 * sizeof(int) + (s.type == ARG_STR ? LOG_STR_MAX : argSize(s.type));
+        if (n + need > size) break;
+
+        if (s.star_width) {
+            int v = va_arg(ap, int);
+            memcpy(buf + n, &v, sizeof(v));
+            n += sizeof(v);
+        }
+        if (s.star_prec) {
+            int v = va_arg(ap, int);
+            memcpy(buf + n, &v, sizeof(v));
+            n += sizeof(v);
+        }
+
+        union {
+            int i; long l; long long ll; size_t z; intmax_t j; ptrdiff_t t;
+            double d; long double ld; const void *ptr;
+        } v;
+        switch (s.type) {
+            case ARG_INT:       v.i = va_arg(ap, int); break;
+            case ARG_LONG:      v.l = va_arg(ap, long); break;
+            case ARG_LLONG:     v.ll = va_arg(ap, long long); break;
+            case ARG_SIZE:      v.z = va_arg(ap, size_t); break;
+            case ARG_INTMAX:    v.j = va_arg(ap, intmax_t); break;
+            case ARG_PTRDIFF:   v.t = va_arg(ap, ptrdiff_t); break;
+            case ARG_DOUBLE:    v.d = va_arg(ap, double); break;
+            case ARG_LDOUBLE:   v.ld = va_arg(ap, long double); break;
+            case ARG_PTR:       v.ptr = va_arg(ap, void *); break;
+            case ARG_COUNT:     (void)va_arg(ap, int *); break;
+            case ARG_STR: {
+                const char *str = va_arg(ap, const char *);
+                if (str == NULL) str = "(null)";
+                size_t len = strnlen(str, LOG_STR_MAX - 1);
+                buf[n++] = (uint8)len;
+                memcpy(buf + n, str, len);
+                n += len;
+                break;
+            }
+        }
+        if (s.type <= ARG_PTR) {
+            memcpy(buf + n, &v, argSize(s.type));
+            n += argSize(s.type);
+        }
+        specs++;
+    }
+
+    memcpy(buf, &specs, sizeof(specs));
+    return n;
+}
+
+
+/*
+ *  Format a record's arguments back through fmt, returns the length
+ */
+
+static int formatRecord(const char *fmt, const uint8 *args, char *out, int size)
+{
+    uint16 specs;
+    memcpy(&specs, args, sizeof(specs));
+    args += sizeof(specs);
+
+    int n = 0;
+    const char *p = fmt;
+    while (*p && n < size - 1) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        if (specs == 0) break;      // Arguments didn't fit the record
+        specs--;
+
+        log_spec s;
+        parseSpec(p + 1, s);
+        p = s.end;
+
+        // The conversion with its '*' replaced by the packed values
+        char spec[32];
+        int sn = 0;
+        for (const char *q = s.start; q < s.end && sn < (int)sizeof(spec) - 12; q++) {
+            if (*q == '*') {
+                int v;
+                memcpy(&v, args, sizeof(v));
+                args += sizeof(v);
+                sn += snprintf(spec + sn, sizeof(spec) - sn, "%d", v);
+            } else {
+                spec[sn++] = *q;
+            }
+        }
+        spec[sn] = 0;
+
+        int room = size - n;
+        int w = 0;
+        switch (s.type) {
+            case ARG_INT:     { int v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_LONG:    { long v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_LLONG:   { long long v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_SIZE:    { size_t v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_INTMAX:  { intmax_t v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_PTRDIFF: { ptrdiff_t v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_DOUBLE:  { double v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_LDOUBLE: { long double v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_PTR:     { void *v; memcpy(&v, args, sizeof(v)); w = snprintf(out + n, room, spec, v); break; }
+            case ARG_STR: {
+                char str[LOG_STR_MAX];
+                int len = *args++;
+                memcpy(str, args, len);
+                str[len] = 0;
+                args += len;
+                w = snprintf(out + n, room, spec, str);
+                break;
+            }
+            case ARG_NONE:
+                w = 1;
+                out[n] = '%';
+                break;
+            default:
+                break;
+        }
+        if (s.type <= ARG_PTR) {
+            args += argSize(s.type);
+        }
+        if (w > 0) {
+            n += w < room ? w : room - 1;
+        }
+    }
+    return n;
+}
+
+
+/*
+ *  Print a message right away (no log task)
+ */
+
+static void logDirect(const char *fmt, va_list ap)
+{
+    char line[LOG_LINE_MAX];
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    if (n > 0) {
+        Serial.write((const uint8_t *)line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+    }
+}
+
+void LogPrintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (!log_running) {
+        logDirect(fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    uint8 rec[LOG_RECORD_MAX] __attribute__((aligned(4)));
+    size_t hdr = sizeof(uint32) + sizeof(const char *);
+    size_t size = hdr + packArgs(fmt, ap, rec + hdr, sizeof(rec) - hdr - 3);
+    va_end(ap);
+    size = (size + 3) & ~3;
+    memcpy(rec + sizeof(uint32), &fmt, sizeof(fmt));
+
+    // Reserve the record (and a pad up to the end of the ring if it would wrap)
+    log_ring *r = &log_rings[xPortGetCoreID()];
+    uint32 head, pad;
+    do {
+        head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        uint32 off = head & (LOG_RING_SIZE - 1);
+        pad = off + size > LOG_RING_SIZE ? LOG_RING_SIZE - off : 0;
+        if (head + pad + size - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE) {
+            __atomic_fetch_add(&r->drops, 1, __ATOMIC_RELAXED);
+            PerfAdd(perf_drops, 1);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&r->head, &head, head + pad + size, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    if (pad) {
+        __atomic_store_n((uint32 *)(r->data + (head & (LOG_RING_SIZE - 1))),
+                         pad | (LOG_KIND_PAD << 16), __ATOMIC_RELEASE);
+    }
+    uint8 *dst = r->data + ((head + pad) & (LOG_RING_SIZE - 1));
+    memcpy(dst + sizeof(uint32), rec + sizeof(uint32), size - sizeof(uint32));
+    __atomic_store_n((uint32 *)dst, (uint32)size | (LOG_KIND_RECORD << 16), __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  Print and free the finished records of a ring (log task)
+ */
+
+static void drainRing(log_ring *r)
+{
+    char line[LOG_LINE_MAX];
+    uint32 tail = r->tail;
+
+    while (tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        uint8 *p = r->data + (tail & (LOG_RING_SIZE - 1));
+        uint32 h = __atomic_load_n((uint32 *)p, __ATOMIC_ACQUIRE);
+        if (h == 0) break;          // Reserved, still being written
+
+        uint32 size = h & 0xffff;
+        if ((h >> 16) == LOG_KIND_RECORD) {
+            const char *fmt;
+            memcpy(&fmt, p + sizeof(uint32), sizeof(fmt));
+            int n = formatRecord(fmt, p + sizeof(uint32) + sizeof(fmt), line, sizeof(line));
+            if (n > 0) {
+                Serial.write((const uint8_t *)line, n);
+            }
+        }
+        memset(p, 0, size);
+        tail += size;
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint32 drops = __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+    if (drops != r->drops_reported) {
+        Serial.printf("[LOG] %u messages dropped (ring full)\n", (unsigned)(drops - r->drops_reported));
+        r->drops_reported = drops;
+    }
+}
+
+static void logTask(void *param)
+{
+    UNUSED(param);
+    while (!log_stop) {
+        vTaskDelay(pdMS_TO_TICKS(LOG_FLUSH_MS));
+        for (int i = 0; i < portNUM_PROCESSORS; i++) {
+            drainRing(&log_rings[i]);
+        }
+    }
+    log_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+
+/*
+ *  Start the log task; messages print directly until then
+ */
+
+void LogInit(void)
+{
+    if (log_task_handle != NULL) return;
+    perf_drops = PerfCounter("log.drops");
+    log_stop = false;
+    if (xTaskCreatePinnedToCore(logTask, "LogTask", LOG_TASK_STACK_SIZE, NULL, LOG_TASK_PRIORITY,
+                                &log_task_handle, PrefsFindTaskCore("log", LOG_TASK_CORE)) != pdPASS) {
+        log_task_handle = NULL;
+        Serial.println("[LOG] WARNING: log task not started, logging directly");
+        return;
+    }
+    log_running = true;
+}
+
+
+/*
+ *  Print what is still queued and go back to direct output
+ */
+
+void LogExit(void)
+{
+    if (log_task_handle == NULL) return;
+    log_running = false;
+    log_stop = true;
+    for (int i = 0; i < 50 && log_task_handle != NULL; i++) {
+        vTaskDelay(pdMS_TO_TICKS(LOG_FLUSH_MS));
+    }
+    if (log_task_handle != NULL) return;   // Stuck in Serial.write(), leave the rest
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        drainRing(&log_rings[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ *  log_esp32.h - Deferred serial logging
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef LOG_ESP32_H
+#define LOG_ESP32_H
+
+#ifndef LOG_ASYNC
+#define LOG_ASYNC 0
+#endif
+
+#if LOG_ASYNC
+
+/*
+ *  LogPrintf() packs the format pointer and its arguments into a ring of
+ *  the calling core and returns; the log task on Core 0 formats and prints
+ *  them. A full ring drops the message (counted in "log.drops"), so the
+ *  caller never waits for the USB serial port. Before LogInit() and after
+ *  LogExit() it prints directly. Not for interrupt handlers.
+ */
+extern void LogInit(void);
+extern void LogExit(void);
+extern void LogPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define LOG_PRINTF(...)     LogPrintf(__VA_ARGS__)
+
+#else
+
+#define LOG_PRINTF(...)     Serial.printf(__VA_ARGS__)
+
+#endif
+
+#endif // LOG_ESP32_H
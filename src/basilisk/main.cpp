@@ -38,6 +38,7 @@
 #include "user_strings.h"
 #include "prefs.h"
 #include "main.h"
+#include "boot_timeline_esp32.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -59,9 +60,30 @@ static void mon_write_byte_b2(uintptr adr, uint32 b)
 
 /*
  *  Initialize everything, returns false on error
+ *
+ *  The steps below can also be run by a platform as separate stages, as
+ *  long as InitROMType() comes before InitVideo(), InitXPRAM() before
+ *  InitVideo(), and InitVideo() before InitMachine().
  */
 
 bool InitAll(const char *vmdir)
+{
+	if (!InitROMType())
+		return false;
+	InitXPRAM(vmdir);
+	InitDrivers();
+	InitHostServices();
+	if (!InitVideo())
+		return false;
+	return InitMachine();
+}
+
+
+/*
+ *  Check the ROM and set the CPU type from it
+ */
+
+bool InitROMType(void)
 {
 	// Check ROM version
 	if (!CheckROM()) {
@@ -99,6 +121,16 @@ bool InitAll(const char *vmdir)
 	CPUIs68060 = false;
 #endif
 
+	return true;
+}
+
+
+/*
+ *  Load XPRAM and set the boot volume
+ */
+
+void InitXPRAM(const char *vmdir)
+{
 	// Load XPRAM
 	XPRAMInit(vmdir);
 
@@ -139,7 +171,15 @@ bool InitAll(const char *vmdir)
 	i16 = PrefsFindInt32("bootdriver");
 	XPRAM[0x7a] = i16 >> 8;
 	XPRAM[0x7b] = i16 & 0xff;
+}
+
+
+/*
+ *  Open the floppy, disk and CD-ROM images and the external file system
+ */
 
+void InitDrivers(void)
+{
 	// Init drivers
 	SonyInit();
 	DiskInit();
@@ -150,7 +190,15 @@ bool InitAll(const char *vmdir)
 	// Init external file system
 	ExtFSInit();
 #endif
+}
+
+
+/*
+ *  Serial, network, timers, clipboard, ADB and audio
+ */
 
+void InitHostServices(void)
+{
 	// Init serial ports
 	SerialInit();
 
@@ -168,7 +216,15 @@ bool InitAll(const char *vmdir)
 
 	// Init audio
 	AudioInit();
+}
+
+
+/*
+ *  Init video and set the default video mode in XPRAM
+ */
 
+bool InitVideo(void)
+{
 	// Init video
 	if (!VideoInit(ROMVersion == ROM_VERSION_64K || ROMVersion == ROM_VERSION_PLUS || ROMVersion == ROM_VERSION_CLASSIC))
 		return false;
@@ -179,7 +235,16 @@ bool InitAll(const char *vmdir)
 	const monitor_desc &main_monitor = *VideoMonitors[0];
 	XPRAM[0x58] = uint8(main_monitor.depth_to_apple_mode(main_monitor.get_current_mode().depth));
 	XPRAM[0x59] = 0;
+	return true;
+}
+
 
+/*
+ *  Init 680x0 emulation and patch the ROM
+ */
+
+bool InitMachine(void)
+{
 #if EMULATED_68K
 	// Init 680x0 emulation (this also activates the memory system which is needed for PatchROM())
 	if (!Init680x0())
@@ -187,7 +252,14 @@ bool InitAll(const char *vmdir)
 #endif
 
 	// Install ROM patches
-	if (!PatchROM()) {
+#if BOOT_TIMELINE
+	BootPhaseBegin(BOOT_PHASE_PATCH);
+#endif
+	bool patched = PatchROM();
+#if BOOT_TIMELINE
+	BootPhaseEnd(BOOT_PHASE_PATCH);
+#endif
+	if (!patched) {
 		ErrorAlert(STR_UNSUPPORTED_ROM_TYPE_ERR);
 		return false;
 	}
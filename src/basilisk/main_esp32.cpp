@@ -6,19 +6,24 @@
  *  Dual-core optimized:
  *  - Core 1: CPU emulation (main Arduino loop)
  *  - Core 0: Video rendering task, timer interrupts
+ *
+ *  The 60Hz and 1Hz interrupts come from an esp_timer on Core 0 that only
+ *  raises InterruptFlags and SPCFLAG_INT, so their timing doesn't depend
+ *  on how often the CPU loop gets to basilisk_loop().
  */
 
 #include "sysdeps.h"
 
 #include <M5Unified.h>
 #include <M5GFX.h>
-#include <SD.h>
+#include "sd_esp32.h"
 #include <esp_heap_caps.h>
 
 // FreeRTOS for dual-core support and timers
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
+#include "esp_timer.h"
 
 #include "cpu_emulation.h"
 #include "sys.h"
@@ -26,12 +31,33 @@
 #include "xpram.h"
 #include "timer.h"
 #include "video.h"
+#include "audio.h"
+#include "ether.h"
 #include "prefs.h"
 #include "prefs_items.h"
 #include "main.h"
 #include "macos_util.h"
 #include "user_strings.h"
 #include "input.h"
+#include "predecode.h"
+#include "cpu_bench.h"
+#include "disk_bench_esp32.h"
+#include "profiler_esp32.h"
+#include "perf_esp32.h"
+#include "trap_stats_esp32.h"
+#include "irq_stats_esp32.h"
+#include "replay_esp32.h"
+#include "opcode_stats_esp32.h"
+#include "boot_timeline_esp32.h"
+#include "snapshot.h"
+#include "boot_gui.h"
+#include "init_esp32.h"
+#include "mem_plan_esp32.h"
+#include "vnc_esp32.h"
+#include "screenrec_esp32.h"
+#include "log_esp32.h"
+#include "heap_watch_esp32.h"
+#include "power_esp32.h"
 
 #define DEBUG 1
 #include "debug.h"
@@ -68,18 +94,52 @@ void basilisk_loop(void);
 // CPU tick counter for timing (used by newcpu.cpp)
 // With video rendering offloaded to Core 0, we can use a much higher quantum
 // Higher quantum = less frequent periodic checks = faster emulation
-// Increased to 40000 with 15fps video for maximum emulation performance
+// The quantum and the inner loop batch size start at these values and are
+// then adjusted by the adaptive scheduler below
 int32 emulated_ticks = 40000;
 static int32 emulated_ticks_quantum = 40000;
+int32 exec_batch_size = 32;
+
+// ============================================================================
+// Adaptive CPU scheduler
+// ============================================================================
+// Interrupts are only looked at when a quantum ends (basilisk_loop) and when
+// a batch ends (special flags with threaded dispatch), so both sizes bound
+// the interrupt latency. While no interrupts are raised the scheduler doubles
+// them up to SCHED_IDLE_PERIOD_US worth of instructions; the 60Hz tick
+// timer raises SPCFLAG_INT and is seen at the end of the current batch. As
+// soon as ADB or Time Manager activity shows up the quantum drops to what
+// fits in the "irqlatency" preference.
+#ifndef CPU_IRQ_LATENCY_US
+#define CPU_IRQ_LATENCY_US      2000        // Default for the "irqlatency" pref
+#endif
+#define SCHED_QUANTUM_MIN       2000        // Instructions
+#define SCHED_QUANTUM_MAX       400000
+#define SCHED_BATCH_MIN         8
+#define SCHED_BATCH_MAX         256
+#define SCHED_IDLE_PERIOD_US    8000        // Longest quantum while idle
+
+// 60Hz/1Hz flags are raised by the tick timer and don't count as activity
+#define SCHED_PERIODIC_FLAGS    (INTFLAG_60HZ | INTFLAG_1HZ)
+
+static uint32 sched_latency_us = CPU_IRQ_LATENCY_US;
+static volatile uint32 sched_irq_events = 0;    // Non-periodic SetInterruptFlag() calls
+static uint32 sched_last_irq_events = 0;
+static uint32 sched_last_check_us = 0;
+static uint64 sched_last_idle_us = 0;           // idle_time_usec() at the last check
+static uint32 sched_rate = 0;                   // Instructions per us, 8.8 fixed point
 
 // ============================================================================
 // IPS (Instructions Per Second) Monitoring
 // ============================================================================
 // These counters track emulated 68k instructions for performance measurement
-static volatile uint64_t ips_total_instructions = 0;    // Total instructions executed
+static perf_counter *perf_instructions = NULL;          // "cpu.insns", total executed
 static volatile uint64_t ips_last_instructions = 0;     // Instructions at last report
 static volatile uint32_t ips_last_report_time = 0;      // Time of last IPS report
 static volatile uint32_t ips_current = 0;               // Most recent IPS measurement
+#if USE_CYCLE_STATS
+static uint64_t ips_last_cycles = 0;                    // Estimated cycles at last report
+#endif
 #define IPS_REPORT_INTERVAL_MS 5000                     // Report IPS every 5 seconds
 
 /*
@@ -90,16 +150,96 @@ static volatile uint32_t ips_current = 0;               // Most recent IPS measu
  *  1. Count instructions for IPS monitoring
  *  2. Handle periodic tasks (60Hz, video, input, etc.)
  */
+/*
+ *  Pick the tick quantum and batch size for the next period
+ */
+static void sched_update(int32 executed)
+{
+    uint32 now = micros();
+    uint32 elapsed_us = now - sched_last_check_us;
+    sched_last_check_us = now;
+    
+    // Time asleep in idle_wait() is not emulation speed
+    uint64 idle_us = idle_time_usec();
+    uint32 slept_us = (uint32)(idle_us - sched_last_idle_us);
+    sched_last_idle_us = idle_us;
+    elapsed_us = slept_us < elapsed_us ? elapsed_us - slept_us : 0;
+    if (elapsed_us == 0) {
+        elapsed_us = 1;
+    }
+    
+    // Emulation speed over the last quantum (includes basilisk_loop time)
+    sched_rate = (uint32)(((uint64_t)executed << 8) / elapsed_us);
+    
+    // Only SetInterruptFlag() calls count: every 60Hz tick also raises
+    // INTFLAG_ADB (SetPeriodicInterruptFlag()), so pending flags don't say
+    // whether anything happened
+    uint32 events = sched_irq_events;
+    bool busy = events != sched_last_irq_events;
+    sched_last_irq_events = events;
+    
+    uint32 period_us = busy ? sched_latency_us : SCHED_IDLE_PERIOD_US;
+    int32 target = (int32)(((uint64_t)sched_rate * period_us) >> 8);
+    int32 quantum;
+    int32 batch;
+    
+    if (busy) {
+        // Shrink right away so the next interrupt is seen in time
+        quantum = target;
+        batch = SCHED_BATCH_MIN;
+    } else {
+        // Grow gradually, a single quiet period may be a gap between events
+        quantum = emulated_ticks_quantum * 2;
+        if (quantum > target) {
+            quantum = target;
+        }
+        batch = exec_batch_size * 2;
+        if (batch > SCHED_BATCH_MAX) {
+            batch = SCHED_BATCH_MAX;
+        }
+    }
+    
+    if (quantum < SCHED_QUANTUM_MIN) {
+        quantum = SCHED_QUANTUM_MIN;
+    } else if (quantum > SCHED_QUANTUM_MAX) {
+        quantum = SCHED_QUANTUM_MAX;
+    }
+    emulated_ticks_quantum = quantum;
+    exec_batch_size = batch;
+}
+
 void cpu_do_check_ticks(void)
 {
     // Count instructions executed since last tick check
-    // This is the number of instructions in one quantum
-    ips_total_instructions += emulated_ticks_quantum;
+    // The CPU loop subtracts whole batches, so emulated_ticks usually ends
+    // up slightly below zero; the overshoot was executed too
+    int32 executed = emulated_ticks_quantum - emulated_ticks;
+    PerfAdd(perf_instructions, executed);
+    
+#if USE_CYCLE_STATS
+    // Widen the 32-bit cycle counter before it can wrap
+    Get68kCycles();
+#endif
     
     // Call basilisk_loop to handle periodic tasks
     basilisk_loop();
     
-    // Reset tick counter
+#if MAC_SNAPSHOT
+    // Suspend requested (Ctrl+Pause)?
+    SnapshotCheck();
+#endif
+    
+    // Adjust quantum/batch for the next period, then reset tick counter
+    // (a recording or replay keeps its batch size). A call from the STOP
+    // wait with nothing executed says nothing about the speed; the time
+    // stopped is idle_wait() time, which sched_update() leaves out anyway
+    bool measured = executed > 0;
+#if REPLAY
+    measured = measured && replay_mode == REPLAY_OFF;
+#endif
+    if (measured) {
+        sched_update(executed);
+    }
     emulated_ticks = emulated_ticks_quantum;
 }
 
@@ -110,7 +250,8 @@ void cpu_do_check_ticks(void)
 static void reportIPSStats(uint32 current_time)
 {
     if (current_time - ips_last_report_time >= IPS_REPORT_INTERVAL_MS) {
-        uint64_t instructions_delta = ips_total_instructions - ips_last_instructions;
+        uint64_t total_instructions = PerfTotal(perf_instructions);
+        uint64_t instructions_delta = total_instructions - ips_last_instructions;
         uint32_t time_delta_ms = current_time - ips_last_report_time;
         
         if (time_delta_ms > 0) {
@@ -121,11 +262,24 @@ static void reportIPSStats(uint32 current_time)
             // Report in MIPS (millions of instructions per second) for readability
             float mips = ips_current / 1000000.0f;
             
-            Serial.printf("[IPS] %u instructions/sec (%.2f MIPS), total: %llu\n", 
-                          ips_current, mips, ips_total_instructions);
+            LOG_PRINTF("[IPS] %u instructions/sec (%.2f MIPS), total: %llu\n", 
+                       ips_current, mips, total_instructions);
+#if USE_CYCLE_STATS
+            // Estimated 68040 cycles per second = MHz of an equally fast real CPU
+            uint64_t cycles = Get68kCycles();
+            uint64_t cycles_delta = cycles - ips_last_cycles;
+            ips_last_cycles = cycles;
+            float mhz = (float)cycles_delta / (time_delta_ms * 1000.0f);
+            LOG_PRINTF("[IPS] ~%.1f MHz 68040 equivalent (%.2f cycles/instruction)\n",
+                       mhz, instructions_delta ? (float)cycles_delta / instructions_delta : 0.0f);
+#endif
+            LOG_PRINTF("[IPS] sched: quantum=%d batch=%d (~%uus per quantum, target %uus)\n",
+                       emulated_ticks_quantum, exec_batch_size,
+                       sched_rate ? (uint32)(((uint64_t)emulated_ticks_quantum << 8) / sched_rate) : 0,
+                       sched_latency_us);
         }
         
-        ips_last_instructions = ips_total_instructions;
+        ips_last_instructions = total_instructions;
         ips_last_report_time = current_time;
     }
 }
@@ -143,7 +297,7 @@ uint32_t getEmulatorIPS(void)
  */
 uint64_t getEmulatorTotalInstructions(void)
 {
-    return ips_total_instructions;
+    return PerfTotal(perf_instructions);
 }
 
 // Global emulator state
@@ -153,15 +307,21 @@ static uint32 last_second_time = 0;
 static uint32 last_video_signal = 0;
 static uint32 last_disk_flush_time = 0;
 
-// Video signal interval (ms) - how often to signal video task
-// The video task runs at its own pace, this just triggers buffer swap
-#define VIDEO_SIGNAL_INTERVAL 42  // ~24 FPS
+// Video signal interval (ms) - how often dirty writes are published to the
+// video task; it paces itself and is only woken when something changed
+#define VIDEO_SIGNAL_INTERVAL 16  // ~60 FPS
 
 // Disk flush interval (ms) - how often to flush write buffer to SD card
 #define DISK_FLUSH_INTERVAL 2000  // 2 seconds
 
-// FreeRTOS timer for 60Hz tick
-static TimerHandle_t timer_60hz = NULL;
+// 60Hz tick timer (esp_timer task, Core 0); NULL = ticks polled in basilisk_loop
+#define TICK_PERIOD_US          16625       // 60.15Hz, as on the real Mac
+#define TICK_CATCHUP_MAX        6           // Late ticks delivered back to back, more are dropped
+static esp_timer_handle_t tick_timer = NULL;
+static volatile uint32 ticks_pending = 0;   // 60Hz ticks raised but not yet taken by the 68k
+static uint64_t tick_next_1hz_us = 0;
+static volatile uint32 ticks_delivered = 0; // Statistics (reset by reportMainPerfStats)
+static volatile uint32 ticks_dropped = 0;
 
 // NOTE: Input polling is now handled by a dedicated task on Core 0
 // See input_esp32.cpp inputTask()
@@ -172,8 +332,10 @@ static TimerHandle_t timer_60hz = NULL;
 static uint32 perf_loop_count = 0;           // Number of basilisk_loop calls
 static uint32 perf_flush_us = 0;             // Time spent in disk flush
 static uint32 perf_flush_count = 0;          // Number of flushes
+static perf_histogram *perf_flush_hist = NULL; // "main.flush_us", per flush
 // NOTE: Input polling stats removed - input now runs on Core 0 task
 static uint32 perf_main_last_report = 0;     // Last time stats were printed
+static uint64 perf_last_idle_us = 0;         // idle_time_usec() at the last report
 #define PERF_MAIN_REPORT_INTERVAL_MS 5000    // Report every 5 seconds
 
 /*
@@ -181,66 +343,163 @@ static uint32 perf_main_last_report = 0;     // Last time stats were printed
  */
 void SetInterruptFlag(uint32 flag)
 {
-    // Use atomic OR for thread safety (called from timer callback on different core)
-    __atomic_or_fetch(&InterruptFlags, flag, __ATOMIC_SEQ_CST);
+#if REPLAY
+    if (ReplayHold(flag)) {
+        return;
+    }
+#endif
+#if IRQ_STATS
+    IRQStatsRaise(flag);
+#endif
+    
+    // Atomic OR, called from other tasks and cores too; release so that
+    // whatever the flag announces is visible once it is seen
+    __atomic_or_fetch(&InterruptFlags, flag, __ATOMIC_RELEASE);
+    
+    // Tell the scheduler about real activity (ADB, Time Manager, ...)
+    if (flag & ~SCHED_PERIODIC_FLAGS) {
+        __atomic_add_fetch(&sched_irq_events, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ *  Raise a flag generated by basilisk_loop itself (not counted as activity)
+ */
+static void SetPeriodicInterruptFlag(uint32 flag)
+{
+#if REPLAY
+    if (ReplayHold(flag)) {
+        return;
+    }
+#endif
+#if IRQ_STATS
+    IRQStatsRaise(flag);
+#endif
+    __atomic_or_fetch(&InterruptFlags, flag, __ATOMIC_RELEASE);
 }
 
+/*
+ *  Clear interrupt flags; the 68k taking a 60Hz interrupt (emul_op.cpp)
+ *  clears INTFLAG_60HZ, and if later ticks arrived meanwhile the flag is
+ *  raised again right away, so Ticks catches up instead of losing them
+ */
 void ClearInterruptFlag(uint32 flag)
 {
     // Use atomic AND for thread safety
-    __atomic_and_fetch(&InterruptFlags, ~flag, __ATOMIC_SEQ_CST);
+    __atomic_and_fetch(&InterruptFlags, ~flag, __ATOMIC_ACQ_REL);
+    
+    // ticks_pending is a plain counter, it orders nothing else
+    if ((flag & INTFLAG_60HZ) && tick_timer) {
+        uint32 pending = __atomic_load_n(&ticks_pending, __ATOMIC_RELAXED);
+        while (pending > 0 &&
+               !__atomic_compare_exchange_n(&ticks_pending, &pending, pending - 1, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        if (pending > 1) {
+            SetPeriodicInterruptFlag(INTFLAG_60HZ);
+            TriggerInterrupt();
+        }
+    }
 }
 
 /*
- *  Handle 60Hz tick - called from main loop at safe points
- *  Using polling instead of FreeRTOS timer to avoid race conditions
+ *  Handle 60Hz tick - called from the tick timer, or from basilisk_loop
+ *  without it
  */
 static void handle_60hz_tick(void)
 {
     // Set 60Hz interrupt flag
-    SetInterruptFlag(INTFLAG_60HZ);
+    SetPeriodicInterruptFlag(INTFLAG_60HZ);
     
     // Handle ADB (mouse/keyboard) updates
-    SetInterruptFlag(INTFLAG_ADB);
+    SetPeriodicInterruptFlag(INTFLAG_ADB);
     
     // Trigger interrupt in CPU emulation
     TriggerInterrupt();
 }
 
+static void handle_1hz_tick(void);
+
 /*
- *  Start the 60Hz timer (now uses polling in main loop)
+ *  Tick timer callback (esp_timer task): count the tick for catch-up, raise
+ *  the flags, nothing else. A CPU more than TICK_CATCHUP_MAX ticks behind
+ *  (a long EmulOp, say) loses the excess rather than getting a burst.
+ */
+static void tick_timer_callback(void *arg)
+{
+    UNUSED(arg);
+    uint32 pending = __atomic_load_n(&ticks_pending, __ATOMIC_RELAXED);
+    if (pending < TICK_CATCHUP_MAX) {
+        __atomic_add_fetch(&ticks_pending, 1, __ATOMIC_RELAXED);
+        ticks_delivered++;
+    } else {
+        ticks_dropped++;
+    }
+    handle_60hz_tick();
+    
+    uint64_t now = esp_timer_get_time();
+    if (now >= tick_next_1hz_us) {
+        tick_next_1hz_us += 1000000;
+        if (tick_next_1hz_us <= now) {
+            tick_next_1hz_us = now + 1000000;
+        }
+        handle_1hz_tick();
+    }
+}
+
+/*
+ *  Start the 60Hz tick timer
  */
 static bool start60HzTimer(void)
 {
-    // No timer creation needed - we use polling now
-    Serial.println("[MAIN] 60Hz using polling mode (safer)");
+    esp_timer_create_args_t args = {};
+    args.callback = tick_timer_callback;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "tick60hz";
+    if (esp_timer_create(&args, &tick_timer) != ESP_OK) {
+        tick_timer = NULL;
+        return false;
+    }
+    tick_next_1hz_us = esp_timer_get_time() + 1000000;
+    if (esp_timer_start_periodic(tick_timer, TICK_PERIOD_US) != ESP_OK) {
+        esp_timer_delete(tick_timer);
+        tick_timer = NULL;
+        return false;
+    }
+    Serial.printf("[MAIN] 60Hz tick timer started (%d us)\n", TICK_PERIOD_US);
     return true;
 }
 
 /*
- *  Stop the 60Hz timer (no-op when using polling)
+ *  Stop the 60Hz tick timer
  */
 static void stop60HzTimer(void)
 {
-    // No timer to stop in polling mode
+    if (tick_timer) {
+        esp_timer_stop(tick_timer);
+        esp_timer_delete(tick_timer);
+        tick_timer = NULL;
+    }
 }
 
 /*
- *  Mutex functions (now using FreeRTOS primitives for thread safety)
+ *  Mutex functions (spin locks, see B2_mutex in sysdeps.h)
  */
 B2_mutex *B2_create_mutex(void)
 {
-    return new B2_mutex;
+    B2_mutex *mutex = new B2_mutex;
+    portMUX_INITIALIZE(&mutex->mux);
+    return mutex;
 }
 
 void B2_lock_mutex(B2_mutex *mutex)
 {
-    UNUSED(mutex);
+    portENTER_CRITICAL(&mutex->mux);
 }
 
 void B2_unlock_mutex(B2_mutex *mutex)
 {
-    UNUSED(mutex);
+    portEXIT_CRITICAL(&mutex->mux);
 }
 
 void B2_delete_mutex(B2_mutex *mutex)
@@ -249,12 +508,16 @@ void B2_delete_mutex(B2_mutex *mutex)
 }
 
 /*
- *  Flush code cache (no-op for interpreted emulation)
+ *  Flush code cache (drops pre-decoded traces when USE_PREDECODE_CACHE is on)
  */
 void FlushCodeCache(void *start, uint32 size)
 {
+#if USE_PREDECODE_CACHE
+    predecode_invalidate(start, size);
+#else
     UNUSED(start);
     UNUSED(size);
+#endif
 }
 
 /*
@@ -297,6 +560,10 @@ void QuitEmulator(void)
 {
     Serial.println("[MAIN] QuitEmulator called");
     emulator_running = false;
+    
+    // Power is often cut right after Mac OS shuts down
+    Sys_record_clean_shutdown();
+    SaveXPRAM();
 }
 
 /*
@@ -306,7 +573,7 @@ static bool LoadROM(const char *rom_path)
 {
     Serial.printf("[MAIN] Loading ROM from: %s\n", rom_path);
     
-    File rom_file = SD.open(rom_path, FILE_READ);
+    File rom_file = SDCardFS().open(rom_path, FILE_READ);
     if (!rom_file) {
         Serial.printf("[MAIN] ERROR: Cannot open ROM file: %s\n", rom_path);
         return false;
@@ -325,16 +592,41 @@ static bool LoadROM(const char *rom_path)
     // Round up to nearest 64KB
     ROMSize = (rom_size + 0xFFFF) & ~0xFFFF;
     
+#if ROM_PATCH_CACHE
+    // A patched copy from an earlier boot saves the read and PatchROM()'s searches
+    uint32 rom_checksum = 0;
+    rom_file.read((uint8 *)&rom_checksum, sizeof(rom_checksum));
+    rom_file.seek(0);
+#if ROM_FLASH_XIP
+    if (ROMFlashLoad(rom_path, rom_checksum, rom_size)) {
+        rom_file.close();
+        MemPlanRelease("rom");
+        Serial.printf("[MAIN] Patched ROM mapped from flash at %p (%d bytes)\n",
+                      ROMBaseHost, ROMSize);
+        return true;
+    }
+#endif
+#endif
+    
     // Allocate ROM buffer in PSRAM
-    ROMBaseHost = (uint8 *)ps_malloc(ROMSize);
+    ROMBaseHost = (uint8 *)MemPlanAlloc("rom", ROMSize, MALLOC_CAP_SPIRAM);
     if (!ROMBaseHost) {
         Serial.println("[MAIN] ERROR: Cannot allocate ROM buffer in PSRAM!");
         rom_file.close();
         return false;
     }
     
-    // Clear buffer
-    memset(ROMBaseHost, 0, ROMSize);
+#if ROM_PATCH_CACHE
+    if (ROMCacheLoad(rom_path, rom_checksum, rom_size)) {
+        rom_file.close();
+        Serial.printf("[MAIN] Patched ROM loaded from cache at %p (%d bytes)\n",
+                      ROMBaseHost, ROMSize);
+        return true;
+    }
+#endif
+    
+    // Clear the padding up to the next 64KB, the file fills the rest
+    memset(ROMBaseHost + rom_size, 0, ROMSize - rom_size);
     
     // Read ROM file
     size_t bytes_read = rom_file.read(ROMBaseHost, rom_size);
@@ -361,6 +653,65 @@ static bool LoadROM(const char *rom_path)
     return true;
 }
 
+// ============================================================================
+// Background Mac RAM clear
+// ============================================================================
+// Zeroing 8-16 MB of PSRAM takes a noticeable part of the boot, and nothing
+// touches Mac RAM until the CPU starts. A Core 0 task therefore clears it in
+// chunks while LoadROM() and InitAll() read the SD card, and RunEmulator()
+// waits for the high-water mark to reach the end before the first 68k
+// access.
+#ifndef RAM_BACKGROUND_CLEAR
+#define RAM_BACKGROUND_CLEAR 0
+#endif
+
+#if RAM_BACKGROUND_CLEAR
+#define RAM_CLEAR_CHUNK         (64 * 1024)
+#define RAM_CLEAR_STACK_SIZE    2048
+
+static uint32 ram_clear_mark = 0;       // Mac RAM below this offset is zeroed
+static uint32 ram_clear_start_us = 0;
+
+static void ramClearTask(void *param)
+{
+    for (uint32 offset = 0; offset < RAMSize; offset += RAM_CLEAR_CHUNK) {
+        uint32 n = RAMSize - offset < RAM_CLEAR_CHUNK ? RAMSize - offset : RAM_CLEAR_CHUNK;
+        memset(RAMBaseHost + offset, 0, n);
+        __atomic_store_n(&ram_clear_mark, offset + n, __ATOMIC_RELEASE);
+    }
+    vTaskDelete(NULL);
+}
+
+static void start_ram_clear(void)
+{
+    ram_clear_mark = 0;
+    ram_clear_start_us = micros();
+    if (xTaskCreatePinnedToCore(ramClearTask, "RAMClear", RAM_CLEAR_STACK_SIZE, NULL, 1, NULL,
+                                PrefsFindTaskCore("ramclear", 0)) != pdPASS) {
+        Serial.println("[MAIN] WARNING: RAM clear task not started, clearing now");
+        memset(RAMBaseHost, 0, RAMSize);
+        ram_clear_mark = RAMSize;
+    }
+}
+
+/*
+ *  Wait until all of Mac RAM is zeroed (CPU thread, before the 68k runs)
+ */
+static void wait_ram_clear(void)
+{
+    if (__atomic_load_n(&ram_clear_mark, __ATOMIC_ACQUIRE) >= RAMSize) {
+        Serial.printf("[MAIN] Mac RAM cleared in the background (%u us)\n",
+                      (unsigned)(micros() - ram_clear_start_us));
+        return;
+    }
+    uint32 wait_start_us = micros();
+    while (__atomic_load_n(&ram_clear_mark, __ATOMIC_ACQUIRE) < RAMSize) {
+        vTaskDelay(1);
+    }
+    Serial.printf("[MAIN] Waited %u us for the Mac RAM clear\n", (unsigned)(micros() - wait_start_us));
+}
+#endif
+
 /*
  *  Allocate Mac RAM
  */
@@ -374,15 +725,25 @@ static bool AllocateRAM(void)
     
     Serial.printf("[MAIN] Allocating %d bytes for Mac RAM...\n", RAMSize);
     
-    // Allocate RAM in PSRAM
-    RAMBaseHost = (uint8 *)ps_malloc(RAMSize);
+    // Allocate RAM in PSRAM, stepping down 4 MB at a time when the size
+    // chosen does not fit next to the ROM, frame buffer and tables
+    RAMBaseHost = (uint8 *)MemPlanAlloc("ram", RAMSize, MALLOC_CAP_SPIRAM);
+    while (!RAMBaseHost && RAMSize > 4 * 1024 * 1024) {
+        RAMSize = (RAMSize - 1) & ~(4 * 1024 * 1024 - 1);
+        Serial.printf("[MAIN] WARNING: Mac RAM does not fit in PSRAM, trying %d MB\n", RAMSize >> 20);
+        RAMBaseHost = (uint8 *)MemPlanAlloc("ram", RAMSize, MALLOC_CAP_SPIRAM);
+    }
     if (!RAMBaseHost) {
         Serial.println("[MAIN] ERROR: Cannot allocate Mac RAM in PSRAM!");
         return false;
     }
     
     // Clear RAM
+#if RAM_BACKGROUND_CLEAR
+    start_ram_clear();
+#else
     memset(RAMBaseHost, 0, RAMSize);
+#endif
     
     Serial.printf("[MAIN] Mac RAM allocated at %p (%d bytes)\n", RAMBaseHost, RAMSize);
     
@@ -394,10 +755,147 @@ static bool AllocateRAM(void)
  */
 static void handle_1hz_tick(void)
 {
-    SetInterruptFlag(INTFLAG_1HZ);
+    SetPeriodicInterruptFlag(INTFLAG_1HZ);
     TriggerInterrupt();
 }
 
+// ============================================================================
+// Boot stages
+// ============================================================================
+// InitEmulator() runs these through InitRunStages(): the ROM, video and
+// 68k chain on the CPU thread, the drivers (disk image open, HFS repair,
+// preload), Wi-Fi, audio and the USB host on Core 0 alongside it. Video
+// and PatchROM() follow the ROM; nothing else waits for more than the SD
+// card. With BOOT_PARALLEL_INIT at 0 the CPU thread runs them one after
+// another, in table order as far as the dependencies allow.
+#ifndef BOOT_PARALLEL_INIT
+#define BOOT_PARALLEL_INIT 0
+#endif
+
+enum {
+    STAGE_PREFS, STAGE_SYS, STAGE_RAM, STAGE_ROM, STAGE_VIDEO, STAGE_MACHINE,
+    STAGE_XPRAM, STAGE_DRIVERS, STAGE_HOST, STAGE_INPUT
+};
+
+static bool init_prefs(void)
+{
+    // PrefsInit expects references for argc/argv, but we don't have command line args
+    // PrefsInit() internally calls LoadPrefs(), so we don't call it again
+    int dummy_argc = 0;
+    char *dummy_argv_data[] = { NULL };
+    char **dummy_argv = dummy_argv_data;
+    PrefsInit(NULL, dummy_argc, dummy_argv);
+    
+    // Budget the big allocations before the other stages start making them
+    MemPlanInit();
+    return true;
+}
+
+static bool init_sys(void)
+{
+    // System I/O (SD card)
+    SysInit();
+    return true;
+}
+
+static bool init_ram(void)
+{
+    if (!AllocateRAM()) {
+        ErrorAlert("Failed to allocate Mac RAM");
+        return false;
+    }
+    return true;
+}
+
+static bool init_rom(void)
+{
+    const char *rom_path = PrefsFindString("rom");
+    if (!rom_path) {
+        rom_path = "/Q650.ROM";
+    }
+#if BOOT_TIMELINE
+    BootPhaseBegin(BOOT_PHASE_ROM);
+#endif
+    bool ok = LoadROM(rom_path);
+#if BOOT_TIMELINE
+    BootPhaseEnd(BOOT_PHASE_ROM);
+#endif
+    if (!ok) {
+        ErrorAlert("Failed to load ROM file");
+        return false;
+    }
+    return true;
+}
+
+static bool init_video(void)
+{
+    // CheckROM() reports an unsupported ROM itself; VideoInit starts the video task
+    if (!InitROMType()) {
+        return false;
+    }
+    if (!InitVideo()) {
+        ErrorAlert("VideoInit() failed");
+        return false;
+    }
+    return true;
+}
+
+static bool init_machine(void)
+{
+    // Init680x0() and PatchROM()
+    if (!InitMachine()) {
+        ErrorAlert("InitAll() failed");
+        return false;
+    }
+    return true;
+}
+
+static bool init_xpram(void)
+{
+    InitXPRAM(NULL);
+    return true;
+}
+
+static bool init_drivers(void)
+{
+#if DISK_BENCH
+    // Before the disk driver opens the image
+    DiskBenchRun();
+#endif
+    InitDrivers();
+    return true;
+}
+
+static bool init_host(void)
+{
+    InitHostServices();
+    return true;
+}
+
+static bool init_input(void)
+{
+    // Touch panel, USB keyboard/mouse
+    if (!InputInit()) {
+        // Non-fatal - emulator can run without input
+        Serial.println("[MAIN] WARNING: Input initialization failed");
+    }
+    return true;
+}
+
+static const init_stage init_stages[] = {
+    // Name      Function      Waits for                                        CPU thread
+    {"prefs",   init_prefs,   0,                                               true},
+    {"sys",     init_sys,     INIT_STAGE(STAGE_PREFS),                         false},
+    {"ram",     init_ram,     INIT_STAGE(STAGE_PREFS),                         false},
+    {"rom",     init_rom,     INIT_STAGE(STAGE_SYS),                           false},
+    {"video",   init_video,   INIT_STAGE(STAGE_ROM) | INIT_STAGE(STAGE_XPRAM), true},
+    {"machine", init_machine, INIT_STAGE(STAGE_RAM) | INIT_STAGE(STAGE_VIDEO), true},
+    {"xpram",   init_xpram,   INIT_STAGE(STAGE_SYS),                           false},
+    {"drivers", init_drivers, INIT_STAGE(STAGE_SYS),                           false},
+    {"host",    init_host,    INIT_STAGE(STAGE_SYS),                           false},
+    {"input",   init_input,   INIT_STAGE(STAGE_HOST),                          false},
+};
+
 /*
  *  Initialize emulator
  */
@@ -423,55 +921,64 @@ static bool InitEmulator(void)
     Serial.printf("[MAIN] CPU Frequency: %d MHz\n", ESP.getCpuFreqMHz());
     Serial.printf("[MAIN] Running on Core: %d\n", xPortGetCoreID());
     
-    // Initialize preferences
-    // PrefsInit expects references for argc/argv, but we don't have command line args
-    // PrefsInit() internally calls LoadPrefs(), so we don't call it again
-    int dummy_argc = 0;
-    char *dummy_argv_data[] = { NULL };
-    char **dummy_argv = dummy_argv_data;
-    PrefsInit(NULL, dummy_argc, dummy_argv);
-    
-    // Initialize system I/O (SD card)
-    SysInit();
-    
-    // Allocate Mac RAM
-    if (!AllocateRAM()) {
-        ErrorAlert("Failed to allocate Mac RAM");
-        return false;
-    }
-    
-    // Load ROM file
-    const char *rom_path = PrefsFindString("rom");
-    if (!rom_path) {
-        rom_path = "/Q650.ROM";
-    }
+    perf_instructions = PerfCounter("cpu.insns");
+    perf_flush_hist = PerfHistogram("main.flush_us");
+#if TRAP_STATS
+    TrapStatsInit();
+#endif
+#if IRQ_STATS
+    IRQStatsInit();
+#endif
+#if OPCODE_STATS
+    OpcodeStatsInit();
+#endif
     
-    if (!LoadROM(rom_path)) {
-        ErrorAlert("Failed to load ROM file");
-        return false;
-    }
-    
-    // Initialize all emulator subsystems (including VideoInit which starts video task)
-    Serial.println("[MAIN] Calling InitAll()...");
-    if (!InitAll(NULL)) {
-        ErrorAlert("InitAll() failed");
+    // Bring up the subsystems in stages, overlapping those that don't
+    // depend on each other (see init_stages)
+    int failed = InitRunStages(init_stages, sizeof(init_stages) / sizeof(init_stages[0]),
+                               BOOT_PARALLEL_INIT);
+    if (failed >= 0) {
+        Serial.printf("[MAIN] ERROR: boot stage %s failed\n", init_stages[failed].name);
         return false;
     }
     
     // Start 60Hz FreeRTOS timer
     if (!start60HzTimer()) {
-        // Non-fatal - will fall back to polling
+        // Non-fatal - basilisk_loop polls the ticks instead
         Serial.println("[MAIN] WARNING: 60Hz timer failed, using polling fallback");
     }
     
-    // Initialize input handling (touch panel, USB keyboard/mouse)
-    if (!InputInit()) {
-        // Non-fatal - emulator can run without input
-        Serial.println("[MAIN] WARNING: Input initialization failed");
-    }
+    // One feed of the registered counters for dashboards ("telemetry" pref)
+    PerfTelemetryStart();
+    
+#if LOG_ASYNC
+    // From here on the periodic reports and disk messages go through the log task
+    LogInit();
+#endif
+    
+#if VNC_SERVER
+    // Mac screen for VNC viewers on the same network ("vncport" pref)
+    VNCInit();
+#endif
+    
+#if SCREEN_RECORD
+    // Ctrl+Shift+Print Screen records the screen to the SD card
+    ScreenRecInit();
+#endif
+    
+#if POWER_GOVERNOR
+    // Clock follows the load from the counters above ("powergov" pref)
+    PowerInit();
+#endif
     
     Serial.println("[MAIN] Emulator initialized successfully!");
-    Serial.printf("[MAIN] Tick quantum: %d instructions\n", emulated_ticks_quantum);
+    sched_latency_us = PrefsFindInt32("irqlatency");
+    if (sched_latency_us < 100) {
+        sched_latency_us = CPU_IRQ_LATENCY_US;
+    }
+    sched_last_check_us = micros();
+    Serial.printf("[MAIN] Tick quantum: %d instructions, adaptive (irq latency target %uus)\n",
+                  emulated_ticks_quantum, sched_latency_us);
     
     // Print memory status after init
     Serial.printf("[MAIN] Free heap after init: %d bytes\n", ESP.getFreeHeap());
@@ -484,6 +991,7 @@ static bool InitEmulator(void)
                   free_internal_after, total_internal_final);
     Serial.printf("[MAIN] Internal SRAM used: %d bytes\n", 
                   total_internal_final - free_internal_after);
+    MemPlanReport();
     
     return true;
 }
@@ -502,9 +1010,54 @@ static void RunEmulator(void)
     last_video_signal = millis();
     last_disk_flush_time = millis();
     
+#if RAM_BACKGROUND_CLEAR
+    wait_ram_clear();
+#endif
+    
+#if CPU_BENCH
+    CPUBenchRun();
+#endif
+    
+#if PROFILER
+    ProfilerInit();
+#endif
+    
+#if HEAP_WATCH
+    // Boot is done allocating, count whatever comes after
+    HeapWatchArm();
+#endif
+    
     // Start the 68k CPU - this function runs the emulation loop
-    // It will return when QuitEmulator() is called
+    // It will return when QuitEmulator() is called (or after a suspend)
+#if BOOT_TIMELINE
+    BootMark(BOOT_PHASE_CPU);
+#endif
+#if MAC_SNAPSHOT
+    if (BootGUI_GetResume() && SnapshotResume()) {
+        Resume680x0();
+    } else {
+        // The disks are about to change under any snapshot
+        SnapshotInvalidate();
+#if REPLAY
+        ReplayInit();
+#endif
+        Sys_boot_trace_start();
+        Start680x0();
+    }
+#else
+#if REPLAY
+    ReplayInit();
+#endif
+    Sys_boot_trace_start();
     Start680x0();
+#endif
+    
+#if REPLAY
+    ReplayFinish();
+#endif
+#if OPCODE_STATS
+    OpcodeStatsSave();
+#endif
     
     Serial.println("[MAIN] 68k CPU emulation ended");
 }
@@ -519,7 +1072,14 @@ void basilisk_setup(void)
     Serial.println("[MAIN] BasiliskII setup starting...");
     
     // Initialize emulator
-    if (!InitEmulator()) {
+#if BOOT_TIMELINE
+    BootPhaseBegin(BOOT_PHASE_INIT);
+#endif
+    bool init_ok = InitEmulator();
+#if BOOT_TIMELINE
+    BootPhaseEnd(BOOT_PHASE_INIT);
+#endif
+    if (!init_ok) {
         Serial.println("[MAIN] Emulator initialization failed!");
         
         // Display error and halt
@@ -534,13 +1094,121 @@ void basilisk_setup(void)
     // Cleanup
     stop60HzTimer();
     InputExit();
+#if VNC_SERVER
+    VNCExit();
+#endif
+#if SCREEN_RECORD
+    ScreenRecExit();
+#endif
+#if POWER_GOVERNOR
+    PowerExit();
+#endif
+#if LOG_ASYNC
+    LogExit();
+#endif
     ExitAll();
     SysExit();
+#if MAC_SNAPSHOT
+    SnapshotSeal();
+#endif
     PrefsExit();
     
     Serial.println("[MAIN] BasiliskII shutdown complete");
 }
 
+/*
+ *  Report how busy each core was and which tasks kept it so, from the
+ *  FreeRTOS run-time counters (needs run-time stats and the trace facility
+ *  in the framework's FreeRTOS configuration)
+ */
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+#define TASK_STATS_MAX 32
+static TaskStatus_t task_stats[TASK_STATS_MAX];
+static struct {
+    TaskHandle_t handle;
+    configRUN_TIME_COUNTER_TYPE runtime;
+} task_stats_last[TASK_STATS_MAX];
+static int task_stats_last_count = 0;
+static configRUN_TIME_COUNTER_TYPE task_stats_last_total = 0;
+
+static void reportTaskStats(void)
+{
+    configRUN_TIME_COUNTER_TYPE total;
+    int n = uxTaskGetSystemState(task_stats, TASK_STATS_MAX, &total);
+    if (n == 0) {
+        LOG_PRINTF("[TASKS] more than %d tasks, no report\n", TASK_STATS_MAX);
+        return;
+    }
+    configRUN_TIME_COUNTER_TYPE interval = total - task_stats_last_total;
+    bool first = task_stats_last_count == 0;
+    
+    // Turn each counter into the time used since the last report
+    for (int i = 0; i < n; i++) {
+        configRUN_TIME_COUNTER_TYPE runtime = task_stats[i].ulRunTimeCounter;
+        for (int j = 0; j < task_stats_last_count; j++) {
+            if (task_stats_last[j].handle == task_stats[i].xHandle) {
+                runtime -= task_stats_last[j].runtime;
+                break;
+            }
+        }
+        task_stats_last[i].handle = task_stats[i].xHandle;
+        task_stats_last[i].runtime = task_stats[i].ulRunTimeCounter;
+        task_stats[i].ulRunTimeCounter = runtime;
+    }
+    task_stats_last_count = n;
+    task_stats_last_total = total;
+    if (first || interval == 0) {
+        return;
+    }
+    
+    // Busiest first
+    for (int i = 1; i < n; i++) {
+        TaskStatus_t t = task_stats[i];
+        int j = i;
+        for (; j > 0 && task_stats[j - 1].ulRunTimeCounter < t.ulRunTimeCounter; j--) {
+            task_stats[j] = task_stats[j - 1];
+        }
+        task_stats[j] = t;
+    }
+    
+    // One line per core; each core's counters add up to the interval, so
+    // its load is whatever its IDLE task didn't get. Unpinned tasks go last.
+    for (int core = 0; core <= portNUM_PROCESSORS; core++) {
+        BaseType_t affinity = core < portNUM_PROCESSORS ? core : tskNO_AFFINITY;
+        char line[256];
+        int len = 0;
+        uint32 idle_pct = 0;
+        for (int i = 0; i < n; i++) {
+            if (xTaskGetCoreID(task_stats[i].xHandle) != affinity) {
+                continue;
+            }
+            uint32 pct10 = (uint32)((uint64_t)task_stats[i].ulRunTimeCounter * 1000 / interval);
+            if (strncmp(task_stats[i].pcTaskName, "IDLE", 4) == 0) {
+                idle_pct = pct10 / 10;
+                continue;
+            }
+            if (pct10 >= 5 && len < (int)sizeof(line) - 32) {
+                len += snprintf(line + len, sizeof(line) - len, " %s=%u.%u%%",
+                                task_stats[i].pcTaskName, pct10 / 10, pct10 % 10);
+            }
+        }
+        line[len] = 0;
+        if (affinity == tskNO_AFFINITY) {
+            if (len > 0) {
+                LOG_PRINTF("[TASKS] either core:%s\n", line);
+            }
+        } else {
+            LOG_PRINTF("[TASKS] core %d busy=%u%%:%s\n", core, idle_pct < 100 ? 100 - idle_pct : 0, line);
+        }
+    }
+}
+#else
+static void reportTaskStats(void)
+{
+    // FreeRTOS built without run-time stats, nothing to report
+}
+#endif
+
 /*
  *  Report main loop performance stats periodically
  */
@@ -549,18 +1217,34 @@ static void reportMainPerfStats(uint32 current_time)
     if (current_time - perf_main_last_report >= PERF_MAIN_REPORT_INTERVAL_MS) {
         perf_main_last_report = current_time;
         
+        // Share of the interval the CPU task slept in idle_wait()
+        uint64 idle_us = idle_time_usec();
+        uint32 idle_pct = (uint32)((idle_us - perf_last_idle_us) / (PERF_MAIN_REPORT_INTERVAL_MS * 10));
+        perf_last_idle_us = idle_us;
+        
         if (perf_loop_count > 0) {
             uint32 loops_per_sec = (perf_loop_count * 1000) / PERF_MAIN_REPORT_INTERVAL_MS;
-            Serial.printf("[MAIN PERF] loops/sec=%u flushes=%u flush_avg=%uus\n",
-                          loops_per_sec,
-                          perf_flush_count,
-                          perf_flush_count > 0 ? perf_flush_us / perf_flush_count : 0);
+            LOG_PRINTF("[MAIN PERF] loops/sec=%u flushes=%u flush_avg=%uus ticks=%u dropped=%u idle=%u%%\n",
+                       loops_per_sec,
+                       perf_flush_count,
+                       perf_flush_count > 0 ? perf_flush_us / perf_flush_count : 0,
+                       ticks_delivered, ticks_dropped, idle_pct);
         }
+        Sys_report_stats();
+        FPU_report_stats();
+        Audio_report_stats();
+        Ether_report_stats();
+        reportTaskStats();
+#if HEAP_WATCH
+        HeapWatchReport();
+#endif
         
         // Reset counters
         perf_loop_count = 0;
         perf_flush_us = 0;
         perf_flush_count = 0;
+        ticks_delivered = 0;
+        ticks_dropped = 0;
     }
 }
 
@@ -569,7 +1253,7 @@ static void reportMainPerfStats(uint32 current_time)
  *  This is called from the CPU emulator's main loop to handle periodic tasks
  *
  *  With dual-core optimization:
- *  - 60Hz tick is polled here (safer than async timer)
+ *  - 60Hz/1Hz ticks come from the tick timer (polled here only without it)
  *  - Video refresh is handled by video task on Core 0 (doesn't block here)
  *  - Input polling is handled by input task on Core 0 (doesn't block here)
  *  - This function is lightweight - no rendering or input polling happens here
@@ -580,16 +1264,20 @@ void basilisk_loop(void)
     
     perf_loop_count++;
     
-    // Handle 60Hz tick (~16ms intervals)
-    if (current_time - last_60hz_time >= 16) {
-        last_60hz_time = current_time;
-        handle_60hz_tick();
-    }
+#if REPLAY
+    ReplayPoll();
+#endif
     
-    // Handle 1Hz tick
-    if (current_time - last_second_time >= 1000) {
-        last_second_time = current_time;
-        handle_1hz_tick();
+    // Poll the 60Hz (~16ms intervals) and 1Hz ticks if there is no timer
+    if (!tick_timer) {
+        if (current_time - last_60hz_time >= 16) {
+            last_60hz_time = current_time;
+            handle_60hz_tick();
+        }
+        if (current_time - last_second_time >= 1000) {
+            last_second_time = current_time;
+            handle_1hz_tick();
+        }
     }
     
     // Signal video task that a new frame may be ready
@@ -608,6 +1296,7 @@ void basilisk_loop(void)
         uint32 t1 = micros();
         perf_flush_us += (t1 - t0);
         perf_flush_count++;
+        PerfRecord(perf_flush_hist, t1 - t0);
     }
     
     // NOTE: Input polling (M5.update + InputPoll) is now handled by a dedicated
@@ -620,6 +1309,13 @@ void basilisk_loop(void)
     // Report IPS stats periodically
     reportIPSStats(current_time);
     
+#if PROFILER
+    ProfilerPoll();
+#endif
+#if OPCODE_STATS
+    OpcodeStatsPoll();
+#endif
+    
     // Yield to allow FreeRTOS tasks to run
     taskYIELD();
 }
@@ -631,3 +1327,15 @@ bool basilisk_is_running(void)
 {
     return emulator_running;
 }
+
+/*
+ *  True if the emulator was stopped by a suspend to the SD card
+ */
+bool basilisk_was_suspended(void)
+{
+#if MAC_SNAPSHOT
+    return SnapshotSuspended();
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,466 @@
+/*
+ *  media_catalog_esp32.cpp - Catalog of the disk and CD-ROM images on the SD card
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The Boot GUI used to walk the card root with openNextFile(), which
+ *  opens every entry, on each boot and once per list. The catalog keeps
+ *  path, type, size, date, last use, volume name and HFS partition of
+ *  every image in MEDIA_CATALOG_FILE instead, so the boot lists come from
+ *  one file read and the disk drivers find the partition without walking
+ *  the partition map again.
+ *  A scan lists the directories with f_readdir() (name, size and date in
+ *  one pass, no file is opened) and only opens images that are new or
+ *  changed to read their volume name.
+ *
+ *  The file is plain text, one image per line:
+ *
+ *    D|C <tab> size <tab> mtime <tab> last used <tab> volume <tab> HFS block <tab> path
+ */
+
+#include "sysdeps.h"
+#include "media_catalog_esp32.h"
+#include "sd_esp32.h"
+#include "cdaudio_esp32.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <algorithm>
+
+#include "ff.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define MEDIA_CATALOG_VERSION   2
+#define MEDIA_MAX_ENTRIES       256
+#define MEDIA_MAX_DEPTH         4       // Subdirectory levels below the root
+#define MEDIA_MAX_PATH          256
+#define MEDIA_MAP_BLOCKS        64      // Blocks searched for the partition map, as disk.cpp does
+
+static std::vector<media_entry> entries;    // Sorted by path
+static uint32_t use_counter = 0;            // Highest last_used handed out
+static bool catalog_dirty = false;
+static bool catalog_scanned = false;
+
+static bool entry_path_less(const media_entry &a, const media_entry &b)
+{
+    return a.path < b.path;
+}
+
+static media_entry *find_entry(const char *path)
+{
+    media_entry key;
+    key.path = path;
+    auto it = std::lower_bound(entries.begin(), entries.end(), key, entry_path_less);
+    if (it == entries.end() || it->path != path) {
+        return NULL;
+    }
+    return &*it;
+}
+
+
+/*
+ *  Names and types
+ */
+
+static bool has_extension(const char *name, const char *ext)
+{
+    const char *dot = strrchr(name, '.');
+    return dot && strcasecmp(dot, ext) == 0;
+}
+
+static int media_type(const char *name)
+{
+    if (has_extension(name, ".dsk") || has_extension(name, ".dskz") || has_extension(name, ".img")) {
+        return MEDIA_DISK;
+    }
+    if (has_extension(name, ".iso")) {
+        return MEDIA_CDROM;
+    }
+#if CD_AUDIO
+    if (has_extension(name, ".cue")) {
+        return MEDIA_CDROM;     // BIN/CUE image, mounted through its sheet
+    }
+#endif
+    return -1;
+}
+
+static bool is_hidden_name(const char *name)
+{
+    return name[0] == '.' || strcasecmp(name, "System Volume Information") == 0;
+}
+
+// Volume names are Mac Roman or ISO 9660 d-characters; keep what the GUI font can show
+static std::string printable_name(const uint8_t *p, int len)
+{
+    std::string s;
+    for (int i = 0; i < len; i++) {
+        s += (p[i] >= 0x20 && p[i] < 0x7f) ? (char)p[i] : '?';
+    }
+    while (!s.empty() && s.back() == ' ') {
+        s.pop_back();
+    }
+    return s;
+}
+
+
+/*
+ *  Volume names
+ */
+
+static inline uint16_t get16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static inline uint32_t get32(const uint8_t *p) { return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static bool read_at(File &f, uint64_t offset, uint8_t *buf, size_t n)
+{
+    return f.seek(offset) && f.read(buf, n) == n;
+}
+
+// From the MDB of the HFS volume at offset
+static bool hfs_volume_name(File &f, uint64_t offset, std::string &name)
+{
+    uint8_t mdb[64];
+    if (!read_at(f, offset + 1024, mdb, sizeof(mdb)) || get16(mdb) != 0x4244) {
+        return false;
+    }
+    int len = mdb[36];      // drVN, a Pascal string of up to 27 characters
+    if (len == 0 || len > 27) {
+        return false;
+    }
+    name = printable_name(mdb + 37, len);
+    return true;
+}
+
+// Volume name and the block of the partition map entry of the HFS volume
+static void read_image_info(media_entry &e)
+{
+    e.volume.clear();
+    e.hfs_block = -1;
+    if (has_extension(e.path.c_str(), ".dskz")) {
+        return;             // Compressed, the MDB isn't at a fixed offset
+    }
+    if (has_extension(e.path.c_str(), ".cue")) {
+        return;             // A text sheet, the volume is in its BIN file
+    }
+    File f = SDCardFS().open(e.path.c_str(), FILE_READ);
+    if (!f) {
+        return;
+    }
+
+    // The first Apple_HFS partition map entry among the first blocks, in
+    // one read, the way find_hfs_partition() looks for it; 0 = none
+    uint8_t *map = (uint8_t *)ps_malloc(MEDIA_MAP_BLOCKS * 512);
+    if (map && f.seek(0)) {
+        size_t blocks = f.read(map, MEDIA_MAP_BLOCKS * 512) / 512;
+        e.hfs_block = blocks > 0 ? 0 : -1;
+        for (size_t i = 0; i < blocks; i++) {
+            const uint8_t *block = map + i * 512;
+            if (get16(block) == 0x504d && strncmp((const char *)block + 48, "Apple_HFS", 32) == 0) {
+                e.hfs_block = i;
+                break;
+            }
+        }
+    }
+
+    if (!hfs_volume_name(f, 0, e.volume) && e.hfs_block > 0) {
+        hfs_volume_name(f, (uint64_t)get32(map + e.hfs_block * 512 + 8) * 512, e.volume);
+    }
+    free(map);
+    uint8_t block[72];
+    if (e.volume.empty() && e.type == MEDIA_CDROM &&
+        read_at(f, 0x8000, block, sizeof(block)) && block[0] == 1 && memcmp(block + 1, "CD001", 5) == 0) {
+        // ISO 9660 primary volume descriptor
+        e.volume = printable_name(block + 40, 32);
+    }
+    f.close();
+}
+
+
+/*
+ *  Directory walk
+ */
+
+static bool child_path(char *out, const char *dir, const char *name)
+{
+    int n = snprintf(out, MEDIA_MAX_PATH, "%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", name);
+    return n > 0 && n < MEDIA_MAX_PATH;
+}
+
+static void found_file(std::vector<media_entry> &found, const char *path, const char *name,
+                       uint64_t size, uint32_t mtime)
+{
+    int type = media_type(name);
+    if (type < 0 || found.size() >= MEDIA_MAX_ENTRIES) {
+        return;
+    }
+    media_entry e;
+    e.path = path;
+    e.type = type;
+    e.size = size;
+    e.mtime = mtime;
+    e.last_used = 0;
+    e.hfs_block = -1;
+    found.push_back(e);
+}
+
+static void scan_dir(const char *path, int depth, std::vector<media_entry> &found)
+{
+    // Subdirectories are walked once this one is closed
+    std::vector<std::string> subdirs;
+    char child[MEDIA_MAX_PATH];
+    char fpath[MEDIA_MAX_PATH + 8];
+
+    if (SDFatPath(path, fpath, sizeof(fpath))) {
+
+        // One f_readdir() pass delivers name, size, date and attributes
+        static FILINFO fno;             // Large with long file names
+        FF_DIR dir;
+        if (f_opendir(&dir, fpath) != FR_OK) {
+            return;
+        }
+        while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0]) {
+            if (is_hidden_name(fno.fname) || (fno.fattrib & (AM_HID | AM_SYS)) ||
+                !child_path(child, path, fno.fname)) {
+                continue;
+            }
+            if (fno.fattrib & AM_DIR) {
+                if (depth < MEDIA_MAX_DEPTH) {
+                    subdirs.push_back(child);
+                }
+            } else {
+                found_file(found, child, fno.fname, fno.fsize, ((uint32_t)fno.fdate << 16) | fno.ftime);
+            }
+        }
+        f_closedir(&dir);
+
+    } else {
+
+        // SPI mode: readdir() and a stat() per entry
+        char vpath[MEDIA_MAX_PATH + 8];
+        snprintf(vpath, sizeof(vpath), "%s%s", SD_MOUNT_POINT, path);
+        DIR *d = opendir(vpath);
+        if (d == NULL) {
+            return;
+        }
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (is_hidden_name(de->d_name) || !child_path(child, path, de->d_name)) {
+                continue;
+            }
+            char epath[MEDIA_MAX_PATH + 8];
+            snprintf(epath, sizeof(epath), "%s%s", SD_MOUNT_POINT, child);
+            struct stat st;
+            if (stat(epath, &st) < 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                if (depth < MEDIA_MAX_DEPTH) {
+                    subdirs.push_back(child);
+                }
+            } else {
+                found_file(found, child, de->d_name, st.st_size, (uint32_t)st.st_mtime);
+            }
+        }
+        closedir(d);
+    }
+
+    for (size_t i = 0; i < subdirs.size(); i++) {
+        scan_dir(subdirs[i].c_str(), depth + 1, found);
+    }
+}
+
+
+/*
+ *  Catalog
+ */
+
+void MediaCatalogScan(void)
+{
+    uint32_t start = millis();
+    std::vector<media_entry> found;
+    scan_dir("/", 0, found);
+    std::sort(found.begin(), found.end(), entry_path_less);
+
+    int opened = 0;
+    for (size_t i = 0; i < found.size(); i++) {
+        media_entry &e = found[i];
+        const media_entry *old = find_entry(e.path.c_str());
+        if (old) {
+            e.last_used = old->last_used;
+            if (old->type == e.type && old->size == e.size && old->mtime == e.mtime) {
+                e.volume = old->volume;
+                e.hfs_block = old->hfs_block;
+                continue;
+            }
+        }
+        read_image_info(e);
+        opened++;
+    }
+    // A removed image without a new one shows as a smaller catalog
+    if (opened > 0 || found.size() != entries.size()) {
+        catalog_dirty = true;
+    }
+    entries.swap(found);
+    catalog_scanned = true;
+
+    Serial.printf("[MEDIA] %d images on the card, %d new or changed (%u ms)\n",
+                  (int)entries.size(), opened, (unsigned)(millis() - start));
+}
+
+bool MediaCatalogScanned(void)
+{
+    return catalog_scanned;
+}
+
+bool MediaCatalogLoad(void)
+{
+    if (!SDCardFS().exists(MEDIA_CATALOG_FILE)) {
+        return false;
+    }
+    File f = SDCardFS().open(MEDIA_CATALOG_FILE, FILE_READ);
+    if (!f) {
+        return false;
+    }
+    size_t size = f.size();
+    char *text = (char *)ps_malloc(size + 1);
+    if (text == NULL) {
+        f.close();
+        return false;
+    }
+    bool ok = f.read((uint8_t *)text, size) == size;
+    f.close();
+    text[ok ? size : 0] = 0;
+
+    entries.clear();
+    use_counter = 0;
+    int version = 0;
+    char *line = text;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = 0;
+        }
+        if (strncmp(line, "version=", 8) == 0) {
+            version = atoi(line + 8);
+        } else if (strncmp(line, "uses=", 5) == 0) {
+            use_counter = strtoul(line + 5, NULL, 10);
+        } else if ((line[0] == 'D' || line[0] == 'C') && line[1] == '\t') {
+            // Seven tab-separated fields, the path last
+            char *field[7];
+            int n = 0;
+            for (char *p = line; n < 7; n++) {
+                field[n] = p;
+                p = n < 6 ? strchr(p, '\t') : NULL;
+                if (p) {
+                    *p++ = 0;
+                } else if (n < 6) {
+                    break;
+                }
+            }
+            if (n == 7 && field[6][0] == '/') {
+                media_entry e;
+                e.type = line[0] == 'D' ? MEDIA_DISK : MEDIA_CDROM;
+                e.size = strtoull(field[1], NULL, 10);
+                e.mtime = strtoul(field[2], NULL, 10);
+                e.last_used = strtoul(field[3], NULL, 10);
+                e.volume = field[4];
+                e.hfs_block = atoi(field[5]);
+                e.path = field[6];
+                entries.push_back(e);
+            }
+        }
+        line = next;
+    }
+    free(text);
+
+    if (version != MEDIA_CATALOG_VERSION) {
+        Serial.println("[MEDIA] Catalog from another version, rescanning");
+        entries.clear();
+        return false;
+    }
+    std::sort(entries.begin(), entries.end(), entry_path_less);
+    catalog_dirty = false;
+    Serial.printf("[MEDIA] Catalog: %d images\n", (int)entries.size());
+    return true;
+}
+
+void MediaCatalogList(int type, std::vector<const media_entry *> &list)
+{
+    list.clear();
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].type == type) {
+            list.push_back(&entries[i]);
+        }
+    }
+    std::stable_sort(list.begin(), list.end(), [](const media_entry *a, const media_entry *b) {
+        return a->last_used > b->last_used;
+    });
+}
+
+void MediaCatalogUse(const char *path)
+{
+    if (path == NULL || path[0] == 0) {
+        return;
+    }
+    media_entry *e = find_entry(path);
+    if (e == NULL) {
+        return;
+    }
+    // Already the most recent of its type: nothing to write
+    bool most_recent = e->last_used != 0;
+    for (size_t i = 0; i < entries.size() && most_recent; i++) {
+        if (entries[i].type == e->type && entries[i].last_used > e->last_used) {
+            most_recent = false;
+        }
+    }
+    if (most_recent) {
+        return;
+    }
+    e->last_used = ++use_counter;
+    catalog_dirty = true;
+}
+
+void MediaCatalogSave(void)
+{
+    if (!catalog_dirty) {
+        return;
+    }
+    File f = SDCardFS().open(MEDIA_CATALOG_FILE, FILE_WRITE);
+    if (!f) {
+        Serial.println("[MEDIA] ERROR: Cannot write the catalog");
+        return;
+    }
+    f.printf("# BasiliskII media catalog, rebuilt when missing\n");
+    f.printf("version=%d\n", MEDIA_CATALOG_VERSION);
+    f.printf("uses=%u\n", (unsigned)use_counter);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const media_entry &e = entries[i];
+        f.printf("%c\t%llu\t%u\t%u\t%s\t%d\t%s\n", e.type == MEDIA_DISK ? 'D' : 'C',
+                 (unsigned long long)e.size, (unsigned)e.mtime, (unsigned)e.last_used,
+                 e.volume.c_str(), e.hfs_block, e.path.c_str());
+    }
+    f.close();
+    catalog_dirty = false;
+    D(bug("[MEDIA] catalog saved, %d images\n", (int)entries.size()));
+}
+
+int MediaCatalogHFSBlock(const char *path, uint64_t size)
+{
+    const media_entry *e = find_entry(path);
+    if (e == NULL || e->size != size) {
+        return -1;
+    }
+    return e->hfs_block;
+}
+
+void MediaCatalogSetHFSBlock(const char *path, int block)
+{
+    media_entry *e = find_entry(path);
+    if (e == NULL || e->hfs_block == block) {
+        return;
+    }
+    e->hfs_block = block;
+    catalog_dirty = true;
+    MediaCatalogSave();
+}
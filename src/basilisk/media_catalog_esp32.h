@@ -0,0 +1,59 @@
+/*
+ *  media_catalog_esp32.h - Catalog of the disk and CD-ROM images on the SD card
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef MEDIA_CATALOG_ESP32_H
+#define MEDIA_CATALOG_ESP32_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Catalog file, next to /basilisk_settings.txt
+#define MEDIA_CATALOG_FILE  "/basilisk_media.txt"
+
+// Image types
+#define MEDIA_DISK      0   // .dsk, .dskz, .img
+#define MEDIA_CDROM     1   // .iso
+
+struct media_entry {
+    std::string path;       // Full path on the card, e.g. "/Disks/System7.dsk"
+    int type;               // MEDIA_DISK or MEDIA_CDROM
+    uint64_t size;
+    uint32_t mtime;         // As listed in the directory
+    uint32_t last_used;     // Use sequence number (MediaCatalogUse), 0 = never
+    std::string volume;     // HFS or ISO 9660 volume name, empty if unknown
+    int hfs_block;          // Partition map block of the Apple_HFS entry, 0 = none, -1 = unknown
+};
+
+// Load the saved catalog (one file read); false if there is none
+extern bool MediaCatalogLoad(void);
+
+/*
+ *  Walk the card, root and subdirectories, and bring the catalog up to
+ *  date; only images that are new or whose size or date changed are
+ *  opened (for the volume name)
+ */
+extern void MediaCatalogScan(void);
+
+// True once MediaCatalogScan() has run in this boot
+extern bool MediaCatalogScanned(void);
+
+// Entries of one type, most recently used first, then by path
+extern void MediaCatalogList(int type, std::vector<const media_entry *> &list);
+
+// Record that this boot uses the image at path ("" is ignored)
+extern void MediaCatalogUse(const char *path);
+
+// Write the catalog back if anything changed
+extern void MediaCatalogSave(void);
+
+// The image's hfs_block if the catalog lists it with this size, else -1
+extern int MediaCatalogHFSBlock(const char *path, uint64_t size);
+
+// Correct an image's hfs_block (written back right away)
+extern void MediaCatalogSetHFSBlock(const char *path, int block);
+
+#endif /* MEDIA_CATALOG_ESP32_H */
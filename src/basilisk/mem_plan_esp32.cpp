@@ -0,0 +1,299 @@
+/*
+ *  mem_plan_esp32.cpp - Boot-time memory budget and allocation map
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The boot stages run in parallel, so without a plan whichever stage
+ *  allocates first wins: Wi-Fi could take the internal SRAM cpufunctbl
+ *  needs, or the disk cache the PSRAM of the frame buffer. MemPlanInit()
+ *  runs once the prefs are known and
+ *
+ *  - allocates the internal SRAM hot set (opcode table, predecode cache)
+ *    at once, to be picked up by MemPlanAlloc() when its owner starts
+ *  - reserves the fixed PSRAM consumers (Mac RAM, ROM, frame buffer,
+ *    opcode decode table) at their known sizes
+ *  - notes what the flexible consumers would like; MemPlanGrant() gives
+ *    each what is left after the open reservations and the wishes of the
+ *    consumers ranked above it in the "memplan" pref
+ *
+ *  The snapshot writer never asks for a grant: ranked above the others it
+ *  keeps its buffers free until the machine is suspended. Every block
+ *  goes into the allocation map printed at the end of the boot.
+ */
+
+#include "sysdeps.h"
+#include "mem_plan_esp32.h"
+#include "prefs.h"
+#include "sd_esp32.h"
+#include "readcpu.h"
+#include "predecode.h"
+
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define MEMPLAN_MAX_BLOCKS      32
+#define MEMPLAN_PSRAM_MARGIN    (1024 * 1024)           // Small PSRAM allocations (tiles, overlays, ExtFS)
+#define MEMPLAN_ROM_BYTES       (1024 * 1024)           // Largest ROM LoadROM() accepts
+#define MEMPLAN_FRAMEBUFFER     (1280 * 720 * 2)        // video_esp32.cpp, largest mode
+#define MEMPLAN_SNAPSHOT_PAGE   4096                    // snapshot_esp32.cpp page table and buffers
+#define MEMPLAN_SNAPSHOT_FIXED  (64 * 1024)
+
+enum {
+    BLOCK_HELD,         // Internal SRAM set aside by MemPlanInit(), not yet claimed
+    BLOCK_RESERVED,     // Fixed PSRAM consumer, not yet allocated
+    BLOCK_WANTED,       // Flexible PSRAM consumer, not yet granted
+    BLOCK_GRANTED,      // Flexible consumer granted, allocation follows
+    BLOCK_ALLOCATED,
+    BLOCK_RELEASED      // Reservation dropped, or allocation failed
+};
+
+struct plan_block {
+    const char *name;
+    size_t size;
+    void *ptr;
+    uint32 caps;
+    uint8 state;
+    uint8 rank;         // Position in "memplan" (flexible consumers)
+};
+
+static plan_block blocks[MEMPLAN_MAX_BLOCKS];
+static int block_count = 0;
+static portMUX_TYPE plan_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Find a block by name and state (plan_lock held); -1 if none
+static int find_block(const char *name, int state)
+{
+    for (int i = 0; i < block_count; i++) {
+        if (blocks[i].state == state && strcmp(blocks[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Add a block (plan_lock held); dropped from the map if it is full
+static void add_block(const char *name, size_t size, void *ptr, uint32 caps, int state, int rank)
+{
+    if (block_count >= MEMPLAN_MAX_BLOCKS) {
+        return;
+    }
+    plan_block &b = blocks[block_count++];
+    b.name = name;
+    b.size = size;
+    b.ptr = ptr;
+    b.caps = caps;
+    b.state = state;
+    b.rank = rank;
+}
+
+// Rank of a flexible consumer in "memplan", lower first; unlisted ones last
+static int consumer_rank(const char *name)
+{
+    const char *list = PrefsFindString("memplan");
+    size_t len = strlen(name);
+    for (int rank = 0; list && *list; rank++) {
+        while (*list == ',' || *list == ' ') {
+            list++;
+        }
+        if (strncmp(list, name, len) == 0 && (list[len] == ',' || list[len] == 0)) {
+            return rank;
+        }
+        list = strchr(list, ',');
+    }
+    return 255;
+}
+
+// Allocate a hot set block in internal SRAM now; its owner falls back to PSRAM without it
+static void hold_internal(const char *name, size_t size)
+{
+    void *p = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!p) {
+        Serial.printf("[MEM] WARNING: no internal SRAM for %s (%u KB)\n", name, (unsigned)(size / 1024));
+        return;
+    }
+    portENTER_CRITICAL(&plan_lock);
+    add_block(name, size, p, MALLOC_CAP_INTERNAL, BLOCK_HELD, 0);
+    portEXIT_CRITICAL(&plan_lock);
+}
+
+static void want_psram(const char *name, size_t size, int state)
+{
+    int rank = state == BLOCK_WANTED ? consumer_rank(name) : 0;
+    portENTER_CRITICAL(&plan_lock);
+    add_block(name, size, NULL, MALLOC_CAP_SPIRAM, state, rank);
+    portEXIT_CRITICAL(&plan_lock);
+}
+
+/*
+ *  Plan the boot's memory
+ */
+void MemPlanInit(void)
+{
+    // Hot set first, touched on every emulated instruction
+    hold_internal("cpufunctbl", 65536 * sizeof(void *));
+#if USE_PREDECODE_CACHE
+    hold_internal("predecode", PREDECODE_BLOCKS * sizeof(predecode_block));
+#endif
+    
+    // Fixed PSRAM consumers
+    size_t ram = PrefsFindInt32("ramsize");
+    if (ram < 1024 * 1024) {
+        ram = 8 * 1024 * 1024;      // AllocateRAM()'s default
+    }
+    want_psram("ram", ram, BLOCK_RESERVED);
+    want_psram("rom", MEMPLAN_ROM_BYTES, BLOCK_RESERVED);
+    want_psram("framebuffer", MEMPLAN_FRAMEBUFFER, BLOCK_RESERVED);
+    want_psram("table68k", 65536 * sizeof(struct instr), BLOCK_RESERVED);
+    
+    // Flexible ones, granted by rank
+#if MAC_SNAPSHOT
+    want_psram("snapshot", ram / MEMPLAN_SNAPSHOT_PAGE * 16 + MEMPLAN_SNAPSHOT_FIXED, BLOCK_WANTED);
+#endif
+    int32 cache_kb = PrefsFindInt32("diskcache");
+    if (cache_kb > 0) {
+        want_psram("diskcache", (size_t)cache_kb * 1024, BLOCK_WANTED);
+    }
+    const char *str;
+    for (int i = 0; (str = PrefsFindString("diskpreload", i)) != NULL; i++) {
+        File f = SDCardFS().open(str, FILE_READ);
+        if (f) {
+            want_psram("preload", f.size(), BLOCK_WANTED);
+            f.close();
+        }
+    }
+    
+    size_t reserved = 0, wanted = 0;
+    for (int i = 0; i < block_count; i++) {
+        if (blocks[i].state == BLOCK_RESERVED) reserved += blocks[i].size;
+        if (blocks[i].state == BLOCK_WANTED) wanted += blocks[i].size;
+    }
+    Serial.printf("[MEM] Plan: %u KB PSRAM for the machine, %u KB asked for by caches, %u KB free\n",
+                  (unsigned)(reserved / 1024), (unsigned)(wanted / 1024),
+                  (unsigned)(heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024));
+}
+
+/*
+ *  Allocate a named block
+ */
+void *MemPlanAlloc(const char *name, size_t size, uint32_t caps)
+{
+    portENTER_CRITICAL(&plan_lock);
+    int i = find_block(name, BLOCK_HELD);
+    if (i >= 0 && blocks[i].size >= size) {
+        blocks[i].state = BLOCK_ALLOCATED;
+        void *p = blocks[i].ptr;
+        portEXIT_CRITICAL(&plan_lock);
+        return p;
+    }
+    portEXIT_CRITICAL(&plan_lock);
+    
+    void *p = heap_caps_malloc(size, caps);
+    
+    portENTER_CRITICAL(&plan_lock);
+    i = find_block(name, BLOCK_RESERVED);
+    if (i < 0) {
+        i = find_block(name, BLOCK_GRANTED);
+    }
+    if (i >= 0) {
+        blocks[i].size = size;
+        blocks[i].ptr = p;
+        blocks[i].caps = caps;
+        blocks[i].state = p ? BLOCK_ALLOCATED : BLOCK_RELEASED;
+    } else if (p) {
+        add_block(name, size, p, caps, BLOCK_ALLOCATED, 0);
+    }
+    portEXIT_CRITICAL(&plan_lock);
+    return p;
+}
+
+void MemPlanRelease(const char *name)
+{
+    portENTER_CRITICAL(&plan_lock);
+    int i = find_block(name, BLOCK_RESERVED);
+    if (i < 0) {
+        i = find_block(name, BLOCK_GRANTED);
+    }
+    if (i >= 0) {
+        blocks[i].state = BLOCK_RELEASED;
+    }
+    portEXIT_CRITICAL(&plan_lock);
+}
+
+/*
+ *  PSRAM a flexible consumer may allocate
+ */
+size_t MemPlanGrant(const char *name, size_t want, size_t min)
+{
+    size_t free_psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    int rank = consumer_rank(name);
+    
+    portENTER_CRITICAL(&plan_lock);
+    int self = find_block(name, BLOCK_WANTED);
+    size_t held = MEMPLAN_PSRAM_MARGIN;
+    for (int i = 0; i < block_count; i++) {
+        const plan_block &b = blocks[i];
+        if (b.state == BLOCK_RESERVED || b.state == BLOCK_GRANTED ||
+            (b.state == BLOCK_WANTED && i != self && b.rank < rank)) {
+            held += b.size;
+        }
+    }
+    size_t grant = free_psram > held ? free_psram - held : 0;
+    if (grant > largest) grant = largest;
+    if (grant > want) grant = want;
+    if (grant < min) grant = 0;
+    if (self >= 0) {
+        blocks[self].size = grant;
+        blocks[self].state = grant ? BLOCK_GRANTED : BLOCK_RELEASED;
+    } else if (grant) {
+        add_block(name, grant, NULL, MALLOC_CAP_SPIRAM, BLOCK_GRANTED, rank);
+    }
+    portEXIT_CRITICAL(&plan_lock);
+    
+    if (grant < want) {
+        Serial.printf("[MEM] %s: %u of %u KB (%u KB free, %u KB held for others)\n", name,
+                      (unsigned)(grant / 1024), (unsigned)(want / 1024),
+                      (unsigned)(free_psram / 1024), (unsigned)(held / 1024));
+    }
+    return grant;
+}
+
+/*
+ *  Print the allocation map
+ */
+void MemPlanReport(void)
+{
+    static const char *const state_names[] = {
+        "held", "reserved", "wanted", "granted", "", "released"
+    };
+    size_t total[2] = {0, 0};
+    
+    Serial.println("[MEM] Block         Where      Size     Address");
+    portENTER_CRITICAL(&plan_lock);
+    plan_block map[MEMPLAN_MAX_BLOCKS];
+    int count = block_count;
+    memcpy(map, blocks, count * sizeof(plan_block));
+    portEXIT_CRITICAL(&plan_lock);
+    
+    for (int i = 0; i < count; i++) {
+        const plan_block &b = map[i];
+        bool internal = (b.caps & MALLOC_CAP_SPIRAM) == 0;
+        if (b.state == BLOCK_ALLOCATED) {
+            Serial.printf("[MEM] %-13s %-5s %7u KB  %p\n", b.name, internal ? "SRAM" : "PSRAM",
+                          (unsigned)(b.size / 1024), b.ptr);
+            total[internal ? 0 : 1] += b.size;
+        } else {
+            Serial.printf("[MEM] %-13s %-5s %7u KB  (%s)\n", b.name, internal ? "SRAM" : "PSRAM",
+                          (unsigned)(b.size / 1024), state_names[b.state]);
+        }
+    }
+    Serial.printf("[MEM] Mapped %u KB SRAM, %u KB PSRAM; free %u KB SRAM (largest %u KB), %u KB PSRAM (largest %u KB)\n",
+                  (unsigned)(total[0] / 1024), (unsigned)(total[1] / 1024),
+                  (unsigned)(heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / 1024),
+                  (unsigned)(heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL) / 1024),
+                  (unsigned)(heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024),
+                  (unsigned)(heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024));
+}
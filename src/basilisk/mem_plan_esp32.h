@@ -0,0 +1,38 @@
+/*
+ *  mem_plan_esp32.h - Boot-time memory budget and allocation map
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef MEM_PLAN_ESP32_H
+#define MEM_PLAN_ESP32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *  Plan the boot's memory (prefs stage, before any big allocation): the
+ *  internal SRAM hot set is allocated right away, ahead of Wi-Fi and the
+ *  host tasks, and the fixed PSRAM consumers get a reservation
+ */
+extern void MemPlanInit(void);
+
+// Allocate a named block: the one MemPlanInit() set aside for it if there
+// is one, else heap_caps_malloc(size, caps); NULL if that fails
+extern void *MemPlanAlloc(const char *name, size_t size, uint32_t caps);
+
+// Drop the reservation of a fixed consumer that won't allocate (ROM in flash),
+// or a grant that another block took up (the second video page)
+extern void MemPlanRelease(const char *name);
+
+/*
+ *  PSRAM a flexible consumer ("diskcache", "preload") may allocate: want,
+ *  or what is left after the open reservations and the consumers ranked
+ *  above it in "memplan"; 0 if that is less than min
+ */
+extern size_t MemPlanGrant(const char *name, size_t want, size_t min);
+
+// Print the allocation map and what is left
+extern void MemPlanReport(void);
+
+#endif /* MEM_PLAN_ESP32_H */
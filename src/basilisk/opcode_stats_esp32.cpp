@@ -0,0 +1,187 @@
+/*
+ *  opcode_stats_esp32.cpp - Opcode execution counts kept across sessions
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Every handler counts its opcode word on entry (cpuop_count() in
+ *  cpuop_begin()) into a 65536-entry table in PSRAM; basilisk_loop folds
+ *  that into 64-bit totals every few seconds, before a 32-bit count can
+ *  wrap. The totals start from /opcodes.68k on the SD card and are written
+ *  back to it every few minutes and when the 68k stops, so one file adds up
+ *  any number of sessions. It is in the dump_counts() format, most
+ *  executed first:
+ *
+ *    Total: 81234567890
+ *    2018: 4123456789 MOVE
+ *
+ *  which gencpu reads with --hot-profile (HOT_PROFILE=/path/opcodes.68k
+ *  tools/cpu_gen/generate_cpu_tables.sh): the handlers are written out
+ *  most executed first, and the busiest go to IRAM. Instructions that the
+ *  RISC-V JIT inlines don't reach a handler and aren't counted.
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "main.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "mem_plan_esp32.h"
+#include "sd_esp32.h"
+#include "opcode_stats_esp32.h"
+
+#include <esp_heap_caps.h>
+
+#if OPCODE_STATS
+
+#define OPCODE_STATS_FILE       SD_MOUNT_POINT "/opcodes.68k"
+#define OPCODE_STATS_TEMP       SD_MOUNT_POINT "/opcodes.tmp"
+#define OPCODE_STATS_FOLD_MS    10000       // < 2^32 executions of one opcode
+#define OPCODE_STATS_SAVE_MS    300000
+
+// Until OpcodeStatsInit(), every opcode counts here
+static uae_u32 opcode_count_dummy;
+
+uae_u32 *opcode_counts = &opcode_count_dummy;
+uae_u32 opcode_count_mask = 0;
+
+static uint64 *totals = NULL;               // Earlier sessions and folded counts
+static uint64 session_total = 0;
+static uint32 last_fold_ms = 0;
+static uint32 last_save_ms = 0;
+
+static void fold(void)
+{
+    uint64 sum = 0;
+    for (int i = 0; i < 65536; i++) {
+        uae_u32 n = opcode_counts[i];
+        if (n) {
+            totals[i] += n;
+            opcode_counts[i] = 0;
+            sum += n;
+        }
+    }
+    session_total += sum;
+}
+
+static void load(void)
+{
+    FILE *f = fopen(OPCODE_STATS_FILE, "r");
+    if (!f) {
+        Serial.println("[OPSTATS] No " OPCODE_STATS_FILE ", starting from zero");
+        return;
+    }
+    unsigned long long total, count;
+    unsigned opcode;
+    char name[20];
+    int n = 0;
+    if (fscanf(f, "Total: %llu\n", &total) == 1) {
+        while (fscanf(f, "%x: %llu %19s\n", &opcode, &count, name) == 3) {
+            if (opcode < 65536) {
+                totals[opcode] += count;
+                n++;
+            }
+        }
+    }
+    fclose(f);
+    Serial.printf("[OPSTATS] %d opcodes from earlier sessions in " OPCODE_STATS_FILE "\n", n);
+}
+
+// Most executed first
+static int compare_totals(const void *a, const void *b)
+{
+    uint64 x = totals[*(const uint16 *)a], y = totals[*(const uint16 *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// As dump_counts() names them; lookuptab ends with an empty name
+static const char *mnemonic(int opcode)
+{
+    const struct mnemolookup *l = lookuptab;
+    while (l->mnemo != table68k[opcode].mnemo && l->name[0]) {
+        l++;
+    }
+    return l->name[0] ? l->name : "ILLEGAL";
+}
+
+void OpcodeStatsSave(void)
+{
+    if (!totals) {
+        return;
+    }
+    fold();
+    last_fold_ms = last_save_ms = millis();
+
+    uint16 *order = (uint16 *)ps_malloc(65536 * sizeof(uint16));
+    if (!order) {
+        Serial.println("[OPSTATS] WARNING: no memory to sort the counts, not saved");
+        return;
+    }
+    int n = 0;
+    uint64 total = 0;
+    for (int i = 0; i < 65536; i++) {
+        if (totals[i]) {
+            order[n++] = i;
+            total += totals[i];
+        }
+    }
+    qsort(order, n, sizeof(uint16), compare_totals);
+
+    // A reset while writing leaves the old file
+    FILE *f = fopen(OPCODE_STATS_TEMP, "w");
+    bool ok = f != NULL && fprintf(f, "Total: %llu\n", (unsigned long long)total) > 0;
+    for (int i = 0; ok && i < n; i++) {
+        ok = fprintf(f, "%04x: %llu %s\n", order[i], (unsigned long long)totals[order[i]],
+                     mnemonic(order[i])) > 0;
+    }
+    if (f && fclose(f) != 0) {
+        ok = false;
+    }
+    free(order);
+    if (ok) {
+        remove(OPCODE_STATS_FILE);
+        ok = rename(OPCODE_STATS_TEMP, OPCODE_STATS_FILE) == 0;
+    }
+    if (ok) {
+        Serial.printf("[OPSTATS] Saved %d opcodes, %llu instructions (%llu this session)\n", n,
+                      (unsigned long long)total, (unsigned long long)session_total);
+    } else {
+        Serial.println("[OPSTATS] WARNING: can't write " OPCODE_STATS_FILE);
+    }
+}
+
+void OpcodeStatsPoll(void)
+{
+    if (!totals) {
+        return;
+    }
+    uint32 now = millis();
+    if (now - last_save_ms >= OPCODE_STATS_SAVE_MS) {
+        OpcodeStatsSave();
+    } else if (now - last_fold_ms >= OPCODE_STATS_FOLD_MS) {
+        last_fold_ms = now;
+        fold();
+    }
+}
+
+void OpcodeStatsInit(void)
+{
+    uae_u32 *counts = (uae_u32 *)MemPlanAlloc("opstats", 65536 * sizeof(uae_u32), MALLOC_CAP_SPIRAM);
+    totals = (uint64 *)ps_malloc(65536 * sizeof(uint64));
+    if (!counts || !totals) {
+        Serial.println("[OPSTATS] No memory for the opcode tables, not counting");
+        free(counts);
+        free(totals);
+        totals = NULL;
+        return;
+    }
+    memset(counts, 0, 65536 * sizeof(uae_u32));
+    memset(totals, 0, 65536 * sizeof(uint64));
+    load();
+    opcode_counts = counts;
+    opcode_count_mask = 0xffff;
+    last_fold_ms = last_save_ms = millis();
+}
+
+#endif // OPCODE_STATS
@@ -0,0 +1,30 @@
+/*
+ *  opcode_stats_esp32.h - Opcode execution counts kept across sessions
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef OPCODE_STATS_ESP32_H
+#define OPCODE_STATS_ESP32_H
+
+#ifndef OPCODE_STATS
+#define OPCODE_STATS 0
+#endif
+
+#if OPCODE_STATS
+
+/*
+ *  Allocate the tables and read the counts of earlier sessions from the
+ *  SD card; before the 68k starts
+ */
+extern void OpcodeStatsInit(void);
+
+// From basilisk_loop(): fold the counts, write the file now and then
+extern void OpcodeStatsPoll(void);
+
+// Write the counts so far (the 68k stopped or is suspended)
+extern void OpcodeStatsSave(void);
+
+#endif
+
+#endif /* OPCODE_STATS_ESP32_H */
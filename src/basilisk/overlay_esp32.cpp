@@ -0,0 +1,292 @@
+/*
+ *  overlay_esp32.cpp - Copy-on-write overlays for read-only base images
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  With the "diskoverlay" pref the disk image is opened read-only and
+ *  every write lands in "<image>.ovl" instead, so many devices can boot
+ *  the same golden image and a device is reset by deleting its overlay.
+ *
+ *  The overlay holds whole 4KB blocks:
+ *
+ *    header      512 bytes at offset 0 (overlay_header)
+ *    block map   one uint32 per disk block at 512: slot + 1, 0 = block
+ *                comes from the base image
+ *    slots       block data from data_offset, appended as blocks are
+ *                first written
+ *
+ *  A new block is written to its slot before its map entry, so an
+ *  interrupted write leaves at most an unused slot. Reads are split into
+ *  runs of base and overlay blocks, keeping base reads long and
+ *  sequential. The caller serialises access (sys_esp32.cpp holds io_lock).
+ */
+
+#include "sysdeps.h"
+#include "overlay_esp32.h"
+#include "sd_esp32.h"
+
+#include <FS.h>
+
+#define DEBUG 0
+#include "debug.h"
+
+#define OVERLAY_MAGIC       "B2OVRLAY"
+#define OVERLAY_VERSION     1
+#define OVERLAY_BLOCK_SIZE  4096
+#define OVERLAY_MAP_OFFSET  512
+
+struct overlay_header {
+    char magic[8];
+    uint32 version;
+    uint32 block_size;
+    uint64 disk_size;       // Size of the base image the overlay belongs to
+    uint32 block_count;
+    uint8 reserved[OVERLAY_MAP_OFFSET - 28];
+};
+
+struct disk_overlay {
+    File file;
+    uint32 *map;            // block_count entries, PSRAM
+    uint32 block_count;
+    uint32 slot_count;      // Slots in use (next free slot)
+    uint64 disk_size;
+    uint64 data_offset;
+    uint8 *block_buf;       // Block being assembled for a partial write
+    overlay_base_read base_read;
+    void *base_ctx;
+};
+
+static size_t ov_read_at(disk_overlay *ov, void *dst, uint64 offset, size_t length)
+{
+    if (!ov->file.seek(offset)) return 0;
+    return ov->file.read((uint8 *)dst, length);
+}
+
+static size_t ov_write_at(disk_overlay *ov, const void *src, uint64 offset, size_t length)
+{
+    if (!ov->file.seek(offset)) return 0;
+    return ov->file.write((const uint8 *)src, length);
+}
+
+/*
+ *  Write an empty overlay (header and zeroed block map)
+ */
+static bool create_overlay(disk_overlay *ov, const char *path)
+{
+    File f = SDCardFS().open(path, FILE_WRITE);
+    if (!f) return false;
+    
+    overlay_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+    hdr.version = OVERLAY_VERSION;
+    hdr.block_size = OVERLAY_BLOCK_SIZE;
+    hdr.disk_size = ov->disk_size;
+    hdr.block_count = ov->block_count;
+    bool ok = f.write((const uint8 *)&hdr, sizeof(hdr)) == sizeof(hdr);
+    
+    memset(ov->block_buf, 0, OVERLAY_BLOCK_SIZE);
+    uint64 left = ov->data_offset - OVERLAY_MAP_OFFSET;
+    while (ok && left > 0) {
+        size_t n = left < OVERLAY_BLOCK_SIZE ? (size_t)left : OVERLAY_BLOCK_SIZE;
+        ok = f.write(ov->block_buf, n) == n;
+        left -= n;
+    }
+    f.close();
+    return ok;
+}
+
+/*
+ *  Check an existing overlay and load its block map
+ */
+static bool load_overlay(disk_overlay *ov)
+{
+    overlay_header hdr;
+    if (ov_read_at(ov, &hdr, 0, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != OVERLAY_VERSION || hdr.block_size != OVERLAY_BLOCK_SIZE ||
+        hdr.disk_size != ov->disk_size || hdr.block_count != ov->block_count) {
+        return false;
+    }
+    size_t map_bytes = (size_t)ov->block_count * sizeof(uint32);
+    if (ov_read_at(ov, ov->map, OVERLAY_MAP_OFFSET, map_bytes) != map_bytes) {
+        return false;
+    }
+    
+    // A slot past the file end means a damaged map
+    uint64 file_size = ov->file.size();
+    ov->slot_count = 0;
+    for (uint32 b = 0; b < ov->block_count; b++) {
+        uint32 slot = ov->map[b];
+        if (slot == 0) continue;
+        if (ov->data_offset + (uint64)slot * OVERLAY_BLOCK_SIZE > file_size) {
+            return false;
+        }
+        if (slot > ov->slot_count) ov->slot_count = slot;
+    }
+    return true;
+}
+
+/*
+ *  Open or create an overlay
+ */
+disk_overlay *OverlayOpen(const char *path, uint64 disk_size, bool discard,
+                          overlay_base_read base_read, void *base_ctx)
+{
+    disk_overlay *ov = new disk_overlay;
+    ov->disk_size = disk_size;
+    ov->block_count = (uint32)((disk_size + OVERLAY_BLOCK_SIZE - 1) / OVERLAY_BLOCK_SIZE);
+    ov->slot_count = 0;
+    uint64 map_end = OVERLAY_MAP_OFFSET + (uint64)ov->block_count * sizeof(uint32);
+    ov->data_offset = (map_end + OVERLAY_BLOCK_SIZE - 1) & ~(uint64)(OVERLAY_BLOCK_SIZE - 1);
+    ov->map = (uint32 *)ps_malloc((size_t)ov->block_count * sizeof(uint32));
+    ov->block_buf = (uint8 *)ps_malloc(OVERLAY_BLOCK_SIZE);
+    ov->base_read = base_read;
+    ov->base_ctx = base_ctx;
+    if (!ov->map || !ov->block_buf) {
+        Serial.println("[OVERLAY] ERROR: out of memory");
+        OverlayClose(ov);
+        return NULL;
+    }
+    
+    bool fresh = discard || !SDCardFS().exists(path);
+    if (!fresh) {
+        ov->file = SDCardFS().open(path, "r+b");
+        if (!ov->file || !load_overlay(ov)) {
+            Serial.printf("[OVERLAY] %s does not match its base image, starting over\n", path);
+            ov->file.close();
+            fresh = true;
+        }
+    }
+    if (fresh) {
+        if (!create_overlay(ov, path)) {
+            Serial.printf("[OVERLAY] ERROR: cannot create %s\n", path);
+            OverlayClose(ov);
+            return NULL;
+        }
+        memset(ov->map, 0, (size_t)ov->block_count * sizeof(uint32));
+        ov->slot_count = 0;
+        ov->file = SDCardFS().open(path, "r+b");
+        if (!ov->file) {
+            Serial.printf("[OVERLAY] ERROR: cannot open %s\n", path);
+            OverlayClose(ov);
+            return NULL;
+        }
+    }
+    
+    Serial.printf("[OVERLAY] %s: %u of %u blocks%s\n", path, ov->slot_count, ov->block_count,
+                  discard ? " (discarded)" : "");
+    return ov;
+}
+
+void OverlayClose(disk_overlay *ov)
+{
+    if (!ov) return;
+    if (ov->file) {
+        ov->file.flush();
+        ov->file.close();
+    }
+    free(ov->map);
+    free(ov->block_buf);
+    delete ov;
+}
+
+void OverlayFlush(disk_overlay *ov)
+{
+    ov->file.flush();
+}
+
+uint32 OverlayBlocks(disk_overlay *ov)
+{
+    return ov->slot_count;
+}
+
+static uint64 slot_offset(disk_overlay *ov, uint32 slot)
+{
+    return ov->data_offset + (uint64)(slot - 1) * OVERLAY_BLOCK_SIZE;
+}
+
+/*
+ *  Read bytes of the merged disk
+ */
+size_t OverlayRead(disk_overlay *ov, uint8 *dst, uint64 offset, size_t length)
+{
+    if (offset >= ov->disk_size) return 0;
+    if (offset + length > ov->disk_size) length = ov->disk_size - offset;
+    
+    size_t done = 0;
+    while (done < length) {
+        // Run of blocks that all come from the base or all from the overlay
+        uint32 block = (uint32)(offset / OVERLAY_BLOCK_SIZE);
+        bool in_overlay = ov->map[block] != 0;
+        size_t n = OVERLAY_BLOCK_SIZE - (size_t)(offset % OVERLAY_BLOCK_SIZE);
+        if (!in_overlay) {
+            while (done + n < length && ov->map[block + (n + OVERLAY_BLOCK_SIZE - 1) / OVERLAY_BLOCK_SIZE] == 0) {
+                n += OVERLAY_BLOCK_SIZE;
+            }
+        }
+        if (n > length - done) n = length - done;
+        
+        size_t got;
+        if (in_overlay) {
+            got = ov_read_at(ov, dst, slot_offset(ov, ov->map[block]) + offset % OVERLAY_BLOCK_SIZE, n);
+        } else {
+            got = ov->base_read(ov->base_ctx, dst, offset, n);
+        }
+        if (got != n) break;
+        dst += n;
+        offset += n;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ *  Give a block a slot, filled from src (whole block) or from the base
+ *  patched with src
+ */
+static bool add_block(disk_overlay *ov, uint32 block, const uint8 *src, size_t in_block, size_t n)
+{
+    const uint8 *data = src;
+    if (n != OVERLAY_BLOCK_SIZE) {
+        uint64 base = (uint64)block * OVERLAY_BLOCK_SIZE;
+        size_t len = ov->disk_size - base < OVERLAY_BLOCK_SIZE ? (size_t)(ov->disk_size - base) : OVERLAY_BLOCK_SIZE;
+        memset(ov->block_buf, 0, OVERLAY_BLOCK_SIZE);
+        if (ov->base_read(ov->base_ctx, ov->block_buf, base, len) != len) return false;
+        memcpy(ov->block_buf + in_block, src, n);
+        data = ov->block_buf;
+    }
+    
+    uint32 slot = ov->slot_count + 1;
+    if (ov_write_at(ov, data, slot_offset(ov, slot), OVERLAY_BLOCK_SIZE) != OVERLAY_BLOCK_SIZE) return false;
+    if (ov_write_at(ov, &slot, OVERLAY_MAP_OFFSET + (uint64)block * sizeof(uint32), sizeof(slot)) != sizeof(slot)) return false;
+    ov->map[block] = slot;
+    ov->slot_count = slot;
+    return true;
+}
+
+/*
+ *  Write bytes of the merged disk
+ */
+size_t OverlayWrite(disk_overlay *ov, const uint8 *src, uint64 offset, size_t length)
+{
+    if (offset + length > ov->disk_size) return 0;
+    
+    size_t done = 0;
+    while (done < length) {
+        uint32 block = (uint32)(offset / OVERLAY_BLOCK_SIZE);
+        size_t in_block = (size_t)(offset % OVERLAY_BLOCK_SIZE);
+        size_t n = OVERLAY_BLOCK_SIZE - in_block;
+        if (n > length - done) n = length - done;
+        
+        if (ov->map[block] != 0) {
+            if (ov_write_at(ov, src, slot_offset(ov, ov->map[block]) + in_block, n) != n) break;
+        } else if (!add_block(ov, block, src, in_block, n)) {
+            break;
+        }
+        src += n;
+        offset += n;
+        done += n;
+    }
+    return done;
+}
@@ -0,0 +1,29 @@
+/*
+ *  overlay_esp32.h - Copy-on-write overlays for read-only base images
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef OVERLAY_ESP32_H
+#define OVERLAY_ESP32_H
+
+// Reads the base image (sys_esp32.cpp)
+typedef size_t (*overlay_base_read)(void *ctx, uint8 *dst, uint64 offset, size_t length);
+
+struct disk_overlay;
+
+// Open or create the overlay at path for a base of disk_size bytes;
+// discard starts it over empty
+extern disk_overlay *OverlayOpen(const char *path, uint64 disk_size, bool discard,
+                                 overlay_base_read base_read, void *base_ctx);
+extern void OverlayClose(disk_overlay *ov);
+extern void OverlayFlush(disk_overlay *ov);
+
+// Transfer bytes of the merged disk, returns the count transferred
+extern size_t OverlayRead(disk_overlay *ov, uint8 *dst, uint64 offset, size_t length);
+extern size_t OverlayWrite(disk_overlay *ov, const uint8 *src, uint64 offset, size_t length);
+
+// Blocks held by the overlay (statistics)
+extern uint32 OverlayBlocks(disk_overlay *ov);
+
+#endif /* OVERLAY_ESP32_H */
@@ -0,0 +1,279 @@
+/*
+ *  perf_esp32.cpp - Performance counter registry and telemetry stream
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Subsystems register named counters and histograms once at init and bump
+ *  them with an atomic add on their own core's slot, so the hot paths take
+ *  no lock and never contend with the other core. Readers sum the slots;
+ *  the 32-bit slots are widened into 64-bit totals under a spinlock that
+ *  only readers take.
+ *
+ *  The telemetry task prints one JSON line per "telemetry" interval to the
+ *  USB serial port, written with a single Serial.write() so it doesn't get
+ *  interleaved with the log lines around it:
+ *
+ *    {"perf":12,"ms":34567,"dt":1000,"c":{"cpu.insns":21504331,...},
+ *     "h":{"video.frame_us":{"n":31,"avg":5120,"p50":8191,"p99":16383,"max":9817},...}}
+ *
+ *  Counters are the deltas over "dt" ms; histograms summarize the values
+ *  recorded in it, p50/p99 as the upper bound of their power-of-two bucket.
+ *  A dashboard keeps the lines starting with {"perf": and divides by dt:
+ *  IPS is cpu.insns, idle share cpu.idle_us / (dt * 1000), disk cache hit
+ *  rate disk.cache_hits / (disk.cache_hits + disk.cache_misses).
+ */
+
+#include "sysdeps.h"
+#include <stdarg.h>
+#include "prefs.h"
+#include "perf_esp32.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#define PERF_MAX_COUNTERS       48
+#define PERF_MAX_HISTOGRAMS     16
+#define PERF_MAX_SECTIONS       4
+#define PERF_LINE_SIZE          4096
+
+#define PERF_TASK_STACK_SIZE    3072
+#define PERF_TASK_PRIORITY      1
+#define PERF_TASK_CORE          0
+#define PERF_WIDEN_MS           1000        // Interval with the stream off
+
+static perf_counter counters[PERF_MAX_COUNTERS];
+static perf_histogram histograms[PERF_MAX_HISTOGRAMS];
+static int ncounters = 0;
+static int nhistograms = 0;
+static perf_counter dummy_counter = { "dummy", {} };
+static perf_histogram dummy_histogram = { "dummy", {}, {}, {} };
+static portMUX_TYPE register_lock = portMUX_INITIALIZER_UNLOCKED;
+
+struct perf_section {
+    const char *name;
+    perf_section_fn fn;
+};
+static perf_section sections[PERF_MAX_SECTIONS];
+static int nsections = 0;
+
+// Reader side: widened totals, and what the last telemetry line reported
+static portMUX_TYPE read_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32 counter_seen[PERF_MAX_COUNTERS][portNUM_PROCESSORS];
+static uint64 counter_total[PERF_MAX_COUNTERS];
+static uint64 counter_reported[PERF_MAX_COUNTERS];
+static uint32 histogram_reported[PERF_MAX_HISTOGRAMS][PERF_HIST_BUCKETS];
+static uint32 histogram_sum_reported[PERF_MAX_HISTOGRAMS];
+
+static TaskHandle_t perf_task_handle = NULL;
+static uint32 telemetry_ms = 0;
+static char line[PERF_LINE_SIZE];
+
+perf_counter *PerfCounter(const char *name)
+{
+    perf_counter *c = &dummy_counter;
+    portENTER_CRITICAL(&register_lock);
+    for (int i = 0; i < ncounters; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            c = &counters[i];
+            break;
+        }
+    }
+    if (c == &dummy_counter && ncounters < PERF_MAX_COUNTERS) {
+        c = &counters[ncounters++];
+        c->name = name;
+    }
+    portEXIT_CRITICAL(&register_lock);
+    return c;
+}
+
+perf_histogram *PerfHistogram(const char *name)
+{
+    perf_histogram *h = &dummy_histogram;
+    portENTER_CRITICAL(&register_lock);
+    for (int i = 0; i < nhistograms; i++) {
+        if (strcmp(histograms[i].name, name) == 0) {
+            h = &histograms[i];
+            break;
+        }
+    }
+    if (h == &dummy_histogram && nhistograms < PERF_MAX_HISTOGRAMS) {
+        h = &histograms[nhistograms++];
+        h->name = name;
+    }
+    portEXIT_CRITICAL(&register_lock);
+    return h;
+}
+
+void PerfSection(const char *name, perf_section_fn fn)
+{
+    portENTER_CRITICAL(&register_lock);
+    if (nsections < PERF_MAX_SECTIONS) {
+        sections[nsections].name = name;
+        sections[nsections].fn = fn;
+        nsections++;
+    }
+    portEXIT_CRITICAL(&register_lock);
+}
+
+void PerfRecord(perf_histogram *h, uint32 value)
+{
+    int core = xPortGetCoreID();
+    int b = value ? 32 - __builtin_clz(value) : 0;
+    if (b >= PERF_HIST_BUCKETS) b = PERF_HIST_BUCKETS - 1;
+    __atomic_fetch_add(&h->buckets[core][b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum[core], value, __ATOMIC_RELAXED);
+    uint32 max = __atomic_load_n(&h->max[core], __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max[core], &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Fold the slots' growth since the last read into the total (read_lock held)
+static uint64 widen(int i)
+{
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        uint32 v = __atomic_load_n(&counters[i].value[core], __ATOMIC_RELAXED);
+        counter_total[i] += (uint32)(v - counter_seen[i][core]);
+        counter_seen[i][core] = v;
+    }
+    return counter_total[i];
+}
+
+uint64 PerfTotal(perf_counter *c)
+{
+    if (c < counters || c >= counters + ncounters) return 0;
+    int i = c - counters;
+    portENTER_CRITICAL(&read_lock);
+    uint64 total = widen(i);
+    portEXIT_CRITICAL(&read_lock);
+    return total;
+}
+
+// Upper bound of the bucket holding the given rank
+static uint32 bucket_rank(const uint32 *counts, uint32 rank)
+{
+    uint32 seen = 0;
+    for (int b = 0; b < PERF_HIST_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) {
+            return b == 0 ? 0 : (b == PERF_HIST_BUCKETS - 1 ? 0xffffffff : (1u << b) - 1);
+        }
+    }
+    return 0;
+}
+
+static size_t append(size_t len, const char *fmt, ...)
+{
+    if (len >= PERF_LINE_SIZE) return len;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line + len, PERF_LINE_SIZE - len, fmt, args);
+    va_end(args);
+    return n < 0 ? len : len + n;
+}
+
+/*
+ *  One telemetry line with the deltas since the last one
+ */
+static void emit_line(uint32 seq, uint32 dt_ms)
+{
+    size_t len = append(0, "{\"perf\":%u,\"ms\":%u,\"dt\":%u,\"c\":{",
+                        (unsigned)seq, (unsigned)(esp_timer_get_time() / 1000), (unsigned)dt_ms);
+    int n = ncounters;
+    for (int i = 0; i < n; i++) {
+        portENTER_CRITICAL(&read_lock);
+        uint64 total = widen(i);
+        portEXIT_CRITICAL(&read_lock);
+        len = append(len, "%s\"%s\":%llu", i ? "," : "", counters[i].name,
+                     (unsigned long long)(total - counter_reported[i]));
+        counter_reported[i] = total;
+    }
+
+    len = append(len, "},\"h\":{");
+    n = nhistograms;
+    for (int i = 0; i < n; i++) {
+        perf_histogram *h = &histograms[i];
+        uint32 counts[PERF_HIST_BUCKETS];
+        uint32 count = 0, sum = 0, max = 0;
+        for (int b = 0; b < PERF_HIST_BUCKETS; b++) {
+            uint32 v = 0;
+            for (int core = 0; core < portNUM_PROCESSORS; core++) {
+                v += __atomic_load_n(&h->buckets[core][b], __ATOMIC_RELAXED);
+            }
+            counts[b] = v - histogram_reported[i][b];
+            histogram_reported[i][b] = v;
+            count += counts[b];
+        }
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            sum += __atomic_load_n(&h->sum[core], __ATOMIC_RELAXED);
+            uint32 m = __atomic_exchange_n(&h->max[core], 0, __ATOMIC_RELAXED);
+            if (m > max) max = m;
+        }
+        uint32 sum_delta = sum - histogram_sum_reported[i];
+        histogram_sum_reported[i] = sum;
+
+        uint32 p50 = count ? bucket_rank(counts, count / 2) : 0;
+        uint32 p99 = count ? bucket_rank(counts, count - 1 - count / 100) : 0;
+        len = append(len, "%s\"%s\":{\"n\":%u,\"avg\":%u,\"p50\":%u,\"p99\":%u,\"max\":%u}",
+                     i ? "," : "", h->name, (unsigned)count, (unsigned)(count ? sum_delta / count : 0),
+                     (unsigned)(p50 < max ? p50 : max), (unsigned)(p99 < max ? p99 : max), (unsigned)max);
+    }
+    len = append(len, "}");
+    
+    n = nsections;
+    for (int i = 0; i < n; i++) {
+        size_t mark = len;
+        len = append(len, ",\"%s\":", sections[i].name);
+        if (len >= PERF_LINE_SIZE) break;
+        size_t value = sections[i].fn(line + len, PERF_LINE_SIZE - len);
+        len = value ? len + value : mark;
+    }
+    len = append(len, "}\n");
+
+    if (len >= PERF_LINE_SIZE) {
+        // Dropped, a cut-off line wouldn't parse
+        Serial.printf("[PERF] telemetry line over %d bytes, raise PERF_LINE_SIZE\n", PERF_LINE_SIZE);
+        return;
+    }
+    Serial.write((const uint8_t *)line, len);
+}
+
+static void perfTask(void *param)
+{
+    UNUSED(param);
+    uint32 seq = 0;
+    int64_t last_us = esp_timer_get_time();
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(telemetry_ms ? telemetry_ms : PERF_WIDEN_MS));
+        if (telemetry_ms) {
+            int64_t now = esp_timer_get_time();
+            emit_line(seq++, (uint32)((now - last_us) / 1000));
+            last_us = now;
+        } else {
+            // Keep the totals widened for PerfTotal()
+            portENTER_CRITICAL(&read_lock);
+            for (int i = 0; i < ncounters; i++) {
+                widen(i);
+            }
+            portEXIT_CRITICAL(&read_lock);
+        }
+    }
+}
+
+void PerfTelemetryStart(void)
+{
+    if (perf_task_handle != NULL) return;
+    int32 ms = PrefsFindInt32("telemetry");
+    telemetry_ms = ms > 0 ? (ms < 100 ? 100 : ms) : 0;
+    if (xTaskCreatePinnedToCore(perfTask, "PerfTask", PERF_TASK_STACK_SIZE, NULL, PERF_TASK_PRIORITY,
+                                &perf_task_handle, PrefsFindTaskCore("perf", PERF_TASK_CORE)) != pdPASS) {
+        perf_task_handle = NULL;
+        Serial.println("[PERF] WARNING: telemetry task not started");
+        return;
+    }
+    if (telemetry_ms) {
+        Serial.printf("[PERF] Telemetry every %u ms, %d counters, %d histograms\n",
+                      (unsigned)telemetry_ms, ncounters, nhistograms);
+    }
+}
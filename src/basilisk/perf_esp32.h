@@ -0,0 +1,71 @@
+/*
+ *  perf_esp32.h - Performance counter registry and telemetry stream
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef PERF_ESP32_H
+#define PERF_ESP32_H
+
+#include "freertos/FreeRTOS.h"
+
+#ifndef PERF_TELEMETRY_MS
+#define PERF_TELEMETRY_MS       0           // Default for the "telemetry" pref, 0 = off
+#endif
+
+#define PERF_HIST_BUCKETS       24          // Bucket b > 0 holds [2^(b-1), 2^b), the last one the rest
+
+/*
+ *  A counter has one slot per core, each only added to by tasks on that
+ *  core, so no lock is needed; readers sum the slots. Slots are 32 bits
+ *  and wrap - the registry widens them, so it must be read at least once
+ *  per 2^32 counts (the telemetry task is).
+ */
+struct perf_counter {
+    const char *name;
+    uint32 value[portNUM_PROCESSORS];
+};
+
+// Distribution of a value (latencies in us), per core like the counters
+struct perf_histogram {
+    const char *name;
+    uint32 buckets[portNUM_PROCESSORS][PERF_HIST_BUCKETS];
+    uint32 sum[portNUM_PROCESSORS];
+    uint32 max[portNUM_PROCESSORS];     // Since the last telemetry line
+};
+
+/*
+ *  Register a counter or histogram by name (once, at init; the name must
+ *  stay valid). Never NULL: with the registry full all further ones share
+ *  a dummy that isn't reported.
+ */
+extern perf_counter *PerfCounter(const char *name);
+extern perf_histogram *PerfHistogram(const char *name);
+
+static inline void PerfAdd(perf_counter *c, uint32 n)
+{
+    __atomic_fetch_add(&c->value[xPortGetCoreID()], n, __ATOMIC_RELAXED);
+}
+
+// Add one value to a histogram
+extern void PerfRecord(perf_histogram *h, uint32 value);
+
+// A counter's total since boot, all cores
+extern uint64 PerfTotal(perf_counter *c);
+
+/*
+ *  Data that doesn't fit counters (per-trap tables): fn writes one JSON
+ *  value for the interval since its last call into buf and returns its
+ *  length (0 = leave the section out); it appears as "name":value
+ */
+typedef size_t (*perf_section_fn)(char *buf, size_t size);
+extern void PerfSection(const char *name, perf_section_fn fn);
+
+/*
+ *  Start the telemetry task (Core 0): every "telemetry" ms one JSON line
+ *  with the counter deltas and histogram summaries of the interval goes
+ *  to the USB serial port; 0 only keeps the totals widened
+ */
+extern void PerfTelemetryStart(void);
+
+#endif /* PERF_ESP32_H */
@@ -0,0 +1,237 @@
+/*
+ *  power_esp32.cpp - Load-driven CPU clock governor
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Both P4 cores normally run at the full clock all the time, although a
+ *  Mac sitting at the Finder spends nearly all of Core 1 in idle_wait() and
+ *  redraws a tile or two a second. Every POWER_SAMPLE_MS the governor task
+ *  reads the perf counters the other subsystems already keep:
+ *
+ *    cpu.idle_us        share of the interval the 68k slept in idle_wait()
+ *    cpu.insns          emulation IPS (reported with each switch)
+ *    video.tiles        tiles the video task redrew
+ *    disk.*_bytes       disk traffic
+ *
+ *  Any sign of work (idle share below POWER_IDLE_SHARE, more than
+ *  POWER_IDLE_TILES tiles, disk traffic) puts it in the active state at
+ *  once; POWER_IDLE_SAMPLES quiet samples in a row drop it to the idle
+ *  state. Switching up is immediate, switching down slow, so a busy Mac
+ *  never waits for its clock and a pause between two clicks changes nothing.
+ *
+ *  With esp_pm in the SDK (CONFIG_PM_ENABLE) the active state holds an
+ *  ESP_PM_CPU_FREQ_MAX lock, and the video task holds another around each
+ *  frame's render and DMA pushes; in the idle state nothing is held and
+ *  dynamic frequency scaling drops to POWER_MIN_MHZ whenever both cores
+ *  wait. Without it the governor sets the clock itself. Light sleep stays
+ *  off either way: the DSI panel scans its frame buffer out of PSRAM
+ *  continuously, and the 60Hz tick would end every sleep within 16ms.
+ */
+
+#include "sysdeps.h"
+#include "prefs.h"
+#include "perf_esp32.h"
+#include "log_esp32.h"
+#include "power_esp32.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+#if POWER_GOVERNOR
+
+#define POWER_TASK_STACK_SIZE   3072
+#define POWER_TASK_PRIORITY     1
+#define POWER_TASK_CORE         0
+
+#define POWER_SAMPLE_MS         250
+#define POWER_IDLE_SAMPLES      8           // Quiet samples before the idle state (2s)
+#define POWER_IDLE_SHARE        80          // Min % of the interval 68k was asleep to count as idle
+#define POWER_IDLE_TILES        16          // Max tiles per sample still idle (caret, clock, cursor)
+#define POWER_MIN_MHZ           90
+
+static perf_counter *perf_insns = NULL;         // "cpu.insns"
+static perf_counter *perf_idle = NULL;          // "cpu.idle_us"
+static perf_counter *perf_video_tiles = NULL;   // "video.tiles"
+static perf_counter *perf_disk_read = NULL;     // "disk.read_bytes"
+static perf_counter *perf_disk_write = NULL;    // "disk.write_bytes"
+static perf_counter *perf_low_ms = NULL;        // "power.low_ms", time in the idle state
+static perf_counter *perf_switches = NULL;      // "power.switches"
+
+static TaskHandle_t power_task_handle = NULL;
+static volatile bool power_running = false;
+static bool power_low = false;                  // Idle state
+static uint32 max_mhz = 0;
+
+#if CONFIG_PM_ENABLE
+static bool pm_active = false;                  // esp_pm configured, locks valid
+static esp_pm_lock_handle_t emul_lock = NULL;   // Held in the active state
+static esp_pm_lock_handle_t video_lock = NULL;  // Held by the video task per frame
+static bool video_held = false;                 // Video task only
+#endif
+
+/*
+ *  Enter the active (full clock) or idle state
+ */
+static void power_set_low(bool low)
+{
+    if (low == power_low) {
+        return;
+    }
+    power_low = low;
+    PerfAdd(perf_switches, 1);
+#if CONFIG_PM_ENABLE
+    if (pm_active) {
+        if (low) {
+            esp_pm_lock_release(emul_lock);
+        } else {
+            esp_pm_lock_acquire(emul_lock);
+        }
+        return;
+    }
+#endif
+    setCpuFrequencyMhz(low ? POWER_MIN_MHZ : max_mhz);
+}
+
+static void powerTask(void *param)
+{
+    UNUSED(param);
+    
+    uint64 last_insns = PerfTotal(perf_insns);
+    uint64 last_idle = PerfTotal(perf_idle);
+    uint64 last_tiles = PerfTotal(perf_video_tiles);
+    uint64 last_disk = PerfTotal(perf_disk_read) + PerfTotal(perf_disk_write);
+    int64_t last_us = esp_timer_get_time();
+    int quiet = 0;
+    
+    while (power_running) {
+        vTaskDelay(pdMS_TO_TICKS(POWER_SAMPLE_MS));
+    
+        int64_t now_us = esp_timer_get_time();
+        uint64 insns = PerfTotal(perf_insns);
+        uint64 idle = PerfTotal(perf_idle);
+        uint64 tiles = PerfTotal(perf_video_tiles);
+        uint64 disk = PerfTotal(perf_disk_read) + PerfTotal(perf_disk_write);
+        uint32 dt_us = (uint32)(now_us - last_us);
+        if (dt_us == 0) {
+            continue;
+        }
+        uint32 idle_share = (uint32)((idle - last_idle) * 100 / dt_us);
+        uint32 dtiles = (uint32)(tiles - last_tiles);
+        bool busy = idle_share < POWER_IDLE_SHARE || dtiles > POWER_IDLE_TILES || disk != last_disk;
+    
+        if (power_low) {
+            PerfAdd(perf_low_ms, dt_us / 1000);
+        }
+        if (busy) {
+            quiet = 0;
+        } else if (quiet < POWER_IDLE_SAMPLES) {
+            quiet++;
+        }
+        bool low = quiet >= POWER_IDLE_SAMPLES;
+        if (low != power_low) {
+            LOG_PRINTF("[POWER] %s: idle %u%%, %.2f MIPS, %u tiles\n",
+                       low ? "idle, low clock" : "busy, full clock", idle_share,
+                       (float)(insns - last_insns) / dt_us, dtiles);
+            power_set_low(low);
+        }
+    
+        last_insns = insns;
+        last_idle = idle;
+        last_tiles = tiles;
+        last_disk = disk;
+        last_us = now_us;
+    }
+    
+    power_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+void PowerInit(void)
+{
+    if (!PrefsFindBool("powergov")) {
+        Serial.println("[POWER] Governor off (powergov)");
+        return;
+    }
+    
+    perf_insns = PerfCounter("cpu.insns");
+    perf_idle = PerfCounter("cpu.idle_us");
+    perf_video_tiles = PerfCounter("video.tiles");
+    perf_disk_read = PerfCounter("disk.read_bytes");
+    perf_disk_write = PerfCounter("disk.write_bytes");
+    perf_low_ms = PerfCounter("power.low_ms");
+    perf_switches = PerfCounter("power.switches");
+    max_mhz = ESP.getCpuFreqMHz();
+    
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t config = {};
+    config.max_freq_mhz = max_mhz;
+    config.min_freq_mhz = POWER_MIN_MHZ;
+    config.light_sleep_enable = false;
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "emul", &emul_lock) == ESP_OK &&
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "video", &video_lock) == ESP_OK) {
+        // The active state's lock first, so the clock never dips at boot
+        esp_pm_lock_acquire(emul_lock);
+        if (esp_pm_configure(&config) == ESP_OK) {
+            pm_active = true;
+        } else {
+            esp_pm_lock_release(emul_lock);
+        }
+    }
+    if (!pm_active) {
+        if (emul_lock) esp_pm_lock_delete(emul_lock);
+        if (video_lock) esp_pm_lock_delete(video_lock);
+        emul_lock = video_lock = NULL;
+    }
+    Serial.printf("[POWER] %u/%u MHz, %s\n", max_mhz, POWER_MIN_MHZ,
+                  pm_active ? "esp_pm frequency scaling" : "esp_pm unavailable, setting the clock directly");
+#else
+    Serial.printf("[POWER] %u/%u MHz, setting the clock directly (no CONFIG_PM_ENABLE)\n",
+                  max_mhz, POWER_MIN_MHZ);
+#endif
+    
+    power_low = false;
+    power_running = true;
+    if (xTaskCreatePinnedToCore(powerTask, "Power", POWER_TASK_STACK_SIZE, NULL,
+                                POWER_TASK_PRIORITY, &power_task_handle, POWER_TASK_CORE) != pdPASS) {
+        Serial.println("[POWER] ERROR: Failed to create governor task");
+        power_running = false;
+    }
+}
+
+void PowerExit(void)
+{
+    if (power_running) {
+        power_running = false;
+        while (power_task_handle != NULL) {
+            vTaskDelay(pdMS_TO_TICKS(POWER_SAMPLE_MS));
+        }
+    }
+    power_set_low(false);
+}
+
+void PowerBusyBegin(void)
+{
+#if CONFIG_PM_ENABLE
+    if (pm_active) {
+        esp_pm_lock_acquire(video_lock);
+        video_held = true;
+    }
+#endif
+}
+
+void PowerBusyEnd(void)
+{
+#if CONFIG_PM_ENABLE
+    if (video_held) {
+        esp_pm_lock_release(video_lock);
+        video_held = false;
+    }
+#endif
+}
+
+#endif // POWER_GOVERNOR
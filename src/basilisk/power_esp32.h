@@ -0,0 +1,33 @@
+/*
+ *  power_esp32.h - Load-driven CPU clock governor
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef POWER_ESP32_H
+#define POWER_ESP32_H
+
+#ifndef POWER_GOVERNOR
+#define POWER_GOVERNOR 0
+#endif
+
+#if POWER_GOVERNOR
+
+/*
+ *  Start the governor task (Core 0) if the "powergov" pref is set: it
+ *  samples the perf counters and keeps the full clock while the Mac is busy,
+ *  dropping to POWER_MIN_MHZ once it has sat idle for a while
+ */
+extern void PowerInit(void);
+extern void PowerExit(void);
+
+/*
+ *  Video task: held around each frame's render and DMA pushes, so a frame
+ *  never runs at the low clock (and the governor sees the display busy)
+ */
+extern void PowerBusyBegin(void);
+extern void PowerBusyEnd(void);
+
+#endif
+
+#endif /* POWER_ESP32_H */
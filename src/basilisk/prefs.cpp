@@ -32,6 +32,7 @@
 struct prefs_node {
 	prefs_node *next;
 	const char *name;
+	uint32 hash;		// prefs_hash(name), compared before the name
 	prefs_type type;
 	void *data;
 };
@@ -43,6 +44,20 @@ static prefs_node *the_prefs = NULL;
 static const prefs_desc *find_prefs_desc(const char *name);
 
 
+/*
+ *  Hash of a prefs item name (FNV-1a), so that looking an item up only
+ *  compares names on a hash match
+ */
+
+static uint32 prefs_hash(const char *name)
+{
+	uint32 h = 2166136261u;
+	while (*name)
+		h = (h ^ (uint8)*name++) * 16777619u;
+	return h;
+}
+
+
 /*
  *  Initialize preferences
  */
@@ -239,6 +254,7 @@ static void add_data(const char *name, prefs_type type, void *data, int size)
 	prefs_node *p = new prefs_node;
 	p->next = 0;
 	p->name = strdup(name);
+	p->hash = prefs_hash(name);
 	p->type = type;
 	p->data = d;
 	if (the_prefs) {
@@ -273,9 +289,10 @@ void PrefsAddInt32(const char *name, int32 val)
 static prefs_node *find_node(const char *name, prefs_type type, int index = 0)
 {
 	prefs_node *p = the_prefs;
+	uint32 hash = prefs_hash(name);
 	int i = 0;
 	while (p) {
-		if ((type == TYPE_ANY || p->type == type) && !strcmp(p->name, name)) {
+		if (p->hash == hash && (type == TYPE_ANY || p->type == type) && !strcmp(p->name, name)) {
 			if (i == index)
 				return p;
 			else
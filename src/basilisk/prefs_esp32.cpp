@@ -7,12 +7,44 @@
 #include "sysdeps.h"
 #include "prefs.h"
 #include "boot_gui.h"
+#include "sd_esp32.h"
+#include "perf_esp32.h"
+#include "replay_esp32.h"
+#include "vnc_esp32.h"
+#include "screenrec_esp32.h"
+
+#include "freertos/FreeRTOS.h"
 
 #define DEBUG 0
 #include "debug.h"
 
 // Platform-specific preferences items
 prefs_desc platform_prefs_items[] = {
+    {"irqlatency", TYPE_INT32, false, "worst-case interrupt latency [uS] targeted by the CPU scheduler"},
+    {"videofps", TYPE_INT32, false, "maximum video frame rate [FPS]"},
+    {"videobudget", TYPE_INT32, false, "PSRAM bandwidth budget for video refresh [KB/s]"},
+    {"portrait", TYPE_BOOLEAN, false, "show the Mac in portrait modes (360x640, 720x1280)"},
+    {"videotile", TYPE_STRING, false, "dirty tile size in Mac pixels, \"16x18\", \"32x18\", \"40x40\", \"64x36\" or \"auto\""},
+    {"diskcache", TYPE_INT32, false, "disk read cache size in PSRAM [KB], 0 = off"},
+    {"diskoverlay", TYPE_BOOLEAN, false, "keep disk images read-only and write to <image>.ovl"},
+    {"discardoverlay", TYPE_BOOLEAN, false, "empty the disk overlays before use"},
+    {"diskpreload", TYPE_STRING, true, "disk image to copy into spare PSRAM at boot"},
+    {"idlewait", TYPE_BOOLEAN, false, "sleep the CPU core while Mac OS is idle"},
+    {"nativebeep", TYPE_BOOLEAN, false, "play SysBeep() from a built-in sound instead of the alert sound"},
+    {"gfxaccel", TYPE_BOOLEAN, false, "run simple CopyBits()/FillRect()/EraseRect() calls on the screen natively"},
+    {"touchpredict", TYPE_INT32, false, "lead the cursor ahead of a dragging finger [ms], 0 = off"},
+    {"wifissid", TYPE_STRING, false, "Wi-Fi network to join for Ethernet (from /wifi.txt)"},
+    {"wifipass", TYPE_STRING, false, "Wi-Fi password (from /wifi.txt)"},
+    {"scsiusb", TYPE_BOOLEAN, false, "map USB mass-storage devices to SCSI IDs"},
+    {"clipport", TYPE_INT32, false, "TCP port of the clipboard bridge, 0 = off"},
+    {"vncport", TYPE_INT32, false, "TCP port of the VNC server, 0 = off"},
+    {"memplan", TYPE_STRING, false, "order in which the caches get the PSRAM left next to the machine, e.g. \"snapshot,diskcache,preload\""},
+    {"telemetry", TYPE_INT32, false, "interval of the JSON counter stream on the USB serial port [ms], 0 = off"},
+    {"replay", TYPE_STRING, false, "\"record\" the 68k's inputs to replayfile or \"play\" them back (from /replay.txt)"},
+    {"replayfile", TYPE_STRING, false, "input log on the SD card (from /replay.txt)"},
+    {"screenrec", TYPE_STRING, false, "file on the SD card the screen is recorded to from the start (from /screenrec.txt)"},
+    {"powergov", TYPE_BOOLEAN, false, "lower the CPU clock while the Mac is idle"},
+    {"taskcores", TYPE_STRING, false, "core placement of the host tasks, e.g. \"video=0,input=0,diskio=0,audio=0,ether=0,serial=0,clip=0\""},
     {NULL, TYPE_END, false, NULL}  // End marker
 };
 
@@ -32,10 +64,10 @@ void LoadPrefs(const char *vmdir)
     // Quadra 650 is similar architecture
     PrefsReplaceInt32("modelid", 14);
     
-    // Set CPU type to 68040
-    PrefsReplaceInt32("cpu", 4);
-    
-    // Disable FPU (not implemented on ESP32)
+    // CPU from the Boot GUI: 68040 (which always has its FPU), or a 68030
+    // without FPU for System 7.1 software, which runs on the 68020/030
+    // handler table without FPU and 68040 opcodes (see build_cpufunctbl())
+    PrefsReplaceInt32("cpu", BootGUI_GetCPUType());
     PrefsReplaceBool("fpu", false);
     
     // Get RAM size from Boot GUI selection
@@ -60,8 +92,12 @@ void LoadPrefs(const char *vmdir)
         Serial.println("[PREFS] Disk: /Macintosh8.dsk (default, read-write)");
     }
     
-    // Disable sound (for now)
-    PrefsReplaceBool("nosound", true);
+    // Sound through the built-in speaker; alerts beep without the Sound Manager
+    PrefsReplaceBool("nosound", false);
+    PrefsReplaceBool("nativebeep", true);
+    
+    // Native QuickDraw blits on the screen
+    PrefsReplaceBool("gfxaccel", true);
     
     // Get CD-ROM path from Boot GUI selection
     const char* cdrom_path = BootGUI_GetCDROMPath();
@@ -81,9 +117,113 @@ void LoadPrefs(const char *vmdir)
     PrefsReplaceInt32("bootdrive", 0);
     PrefsReplaceInt32("bootdriver", 0);
     
+    // Block the emulator task in SynchIdleTime() until the next interrupt
+    PrefsReplaceBool("idlewait", true);
+    
+    // Host tasks share Core 0; the 68k has Core 1 (see the [TASKS] report)
+    PrefsReplaceString("taskcores", "video=0,input=0,diskio=0,audio=0,ether=0,serial=0,clip=0");
+    
+    // JSON telemetry lines for dashboards (perf_esp32.cpp), off unless built in
+    PrefsReplaceInt32("telemetry", PERF_TELEMETRY_MS);
+    
     // Frame skip (lower = smoother but slower)
     PrefsReplaceInt32("frameskip", 4);
     
+    // Disk read cache (1-4MB is plenty; boot reads ~1.5MB of the System file)
+    PrefsReplaceInt32("diskcache", 2048);
+    
+    // Room for a suspend first, then the cache, then a disk preload (mem_plan_esp32.cpp)
+    PrefsReplaceString("memplan", "snapshot,diskcache,preload");
+    
+    // Copy-on-write overlay from Boot GUI selection
+    int overlay_mode = BootGUI_GetOverlayMode();
+    PrefsReplaceBool("diskoverlay", overlay_mode != BOOT_GUI_OVERLAY_OFF);
+    PrefsReplaceBool("discardoverlay", overlay_mode == BOOT_GUI_OVERLAY_DISCARD);
+    if (overlay_mode != BOOT_GUI_OVERLAY_OFF) {
+        Serial.printf("[PREFS] Disk overlay: on%s\n",
+                      overlay_mode == BOOT_GUI_OVERLAY_DISCARD ? " (discarding)" : "");
+    }
+    
+    // PSRAM copy of the hard disk from Boot GUI selection
+    if (BootGUI_GetPreload()) {
+        PrefsAddString("diskpreload", PrefsFindString("disk"));
+        Serial.printf("[PREFS] Disk preload: %s\n", PrefsFindString("disk"));
+    }
+    
+    // Share the card's /Shared folder as a Mac volume, if there is one
+    if (SDCardFS().exists("/Shared")) {
+        PrefsReplaceString("extfs", "/Shared");
+        Serial.println("[PREFS] Shared folder: /Shared");
+    }
+    
+    // Ethernet over Wi-Fi if the card has /wifi.txt (SSID on the first
+    // line, password on the second)
+    File wifi = SDCardFS().open("/wifi.txt", FILE_READ);
+    if (wifi) {
+        String ssid = wifi.readStringUntil('\n');
+        String pass = wifi.readStringUntil('\n');
+        wifi.close();
+        ssid.trim();
+        pass.trim();
+        if (ssid.length() > 0) {
+            PrefsReplaceString("wifissid", ssid.c_str());
+            PrefsReplaceString("wifipass", pass.c_str());
+            Serial.printf("[PREFS] Wi-Fi: %s\n", ssid.c_str());
+        }
+    }
+    
+#if REPLAY
+    // Record or replay a session if the card has /replay.txt ("record" or
+    // "play" on the first line, the log file on the second)
+    File replay = SDCardFS().open("/replay.txt", FILE_READ);
+    if (replay) {
+        String mode = replay.readStringUntil('\n');
+        String file = replay.readStringUntil('\n');
+        replay.close();
+        mode.trim();
+        file.trim();
+        PrefsReplaceString("replay", mode.c_str());
+        if (file.length() > 0) {
+            PrefsReplaceString("replayfile", file.c_str());
+        }
+        Serial.printf("[PREFS] Replay: %s %s\n", mode.c_str(), file.length() > 0 ? file.c_str() : "");
+    }
+#endif
+    
+#if SCREEN_RECORD
+    // Record the screen from the start if the card has /screenrec.txt (the
+    // file to record to on its first line)
+    File screenrec = SDCardFS().open("/screenrec.txt", FILE_READ);
+    if (screenrec) {
+        String file = screenrec.readStringUntil('\n');
+        screenrec.close();
+        file.trim();
+        PrefsReplaceString("screenrec", file.length() > 0 ? file.c_str() : "/screen.rec");
+        Serial.printf("[PREFS] Screen recording: %s\n", PrefsFindString("screenrec"));
+    }
+#endif
+    
+#if VIDEO_PORTRAIT
+    // Panel at its native orientation, Mac modes turned to match
+    PrefsReplaceBool("portrait", true);
+#endif
+    
+    // USB flash drives and CD-ROMs as SCSI devices
+    PrefsReplaceBool("scsiusb", true);
+    
+    // Clipboard bridge on the same network
+    PrefsReplaceInt32("clipport", 6067);
+    
+#if VNC_SERVER
+    // Mac screen for VNC viewers
+    PrefsReplaceInt32("vncport", 5900);
+#endif
+    
+#if POWER_GOVERNOR
+    // Drop the clock at the Finder, full speed as soon as the Mac works
+    PrefsReplaceBool("powergov", true);
+#endif
+    
     Serial.println("[PREFS] Preferences loaded");
     
     // Debug: Print loaded prefs
@@ -93,6 +233,30 @@ void LoadPrefs(const char *vmdir)
     D(bug("  RAM: %d bytes\n", PrefsFindInt32("ramsize")));
 }
 
+/*
+ *  Core to pin the named host task to, from the "taskcores" table
+ */
+int PrefsFindTaskCore(const char *task, int default_core)
+{
+    const char *table = PrefsFindString("taskcores");
+    size_t len = strlen(task);
+    while (table && *table) {
+        while (*table == ',' || *table == ' ') {
+            table++;
+        }
+        if (strncmp(table, task, len) == 0 && table[len] == '=') {
+            int core = atoi(table + len + 1);
+            if (core >= 0 && core < portNUM_PROCESSORS) {
+                return core;
+            }
+            Serial.printf("[PREFS] taskcores: no Core %d for %s, using Core %d\n", core, task, default_core);
+            break;
+        }
+        table = strchr(table, ',');
+    }
+    return default_core;
+}
+
 /*
  *  Save preferences to settings file (no-op on ESP32)
  */
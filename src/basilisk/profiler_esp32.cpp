@@ -0,0 +1,382 @@
+/*
+ *  profiler_esp32.cpp - Sampling profiler for the 68k PC and host code
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A gptimer interrupt on Core 1 fires every PROFILER_PERIOD_US and stores
+ *  the interrupted host PC (mepc), the 68k PC and the last A-line trap the
+ *  Mac took into a ring in PSRAM; when the emulation task wasn't the one
+ *  running, only the host PC is meaningful and the sample is marked. The
+ *  interrupt does nothing else, so the emulation loses well under 1%.
+ *
+ *  A dump turns the ring into histograms, most samples first: ROM code by
+ *  Toolbox/OS routine (the trap whose entry point in the ROM's trap table
+ *  is the nearest at or below the PC, the same table find_rom_trap() walks,
+ *  so internal subroutines count towards the trap before them), RAM code
+ *  by 64-byte block, the trap last called and raw host PCs (look them up
+ *  with addr2line against the firmware .elf). The ring is then emptied, so
+ *  each dump covers the time since the one before.
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "main.h"
+#include "rom_patches.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "mem_plan_esp32.h"
+#include "profiler_esp32.h"
+
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gptimer.h"
+#include "riscv/csr.h"
+
+#if PROFILER
+
+#define PROFILER_SAMPLES        16384       // Ring size (16 s at ~1 kHz)
+#define PROFILER_TOP            20          // Lines per histogram
+#define PROFILER_RAM_BLOCK      64          // Bytes of RAM code per bucket
+
+#define SAMPLE_OTHER_TASK       0x0001      // Not the emulation task, 68k PC invalid
+
+struct profiler_sample {
+    uint32 host_pc;
+    uint32 m68k_pc;
+    uint16 trap;
+    uint16 flags;
+};
+
+// Trap table entry point, sorted by ROM offset
+struct rom_routine {
+    uint32 offset;
+    uint16 trap;
+};
+
+struct hist_entry {
+    uint32 key;
+    uint32 count;
+};
+
+volatile uint16 ProfilerLastTrap = 0;
+
+static profiler_sample *samples = NULL;
+static volatile uint32 sample_head = 0;         // Samples taken (ring index = head % PROFILER_SAMPLES)
+static volatile bool sampling_paused = false;
+static TaskHandle_t emul_task = NULL;
+static gptimer_handle_t sample_timer = NULL;
+static volatile bool dump_requested = false;
+
+static rom_routine *routines = NULL;
+static int nroutines = 0;
+static uint32 dump_start_ms = 0;
+
+/*
+ *  Timer interrupt (Core 1): record what was running
+ */
+static bool IRAM_ATTR sample_isr(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg)
+{
+    uint32 host_pc = RV_READ_CSR(mepc);
+    if (sampling_paused) {
+        return false;
+    }
+    profiler_sample *s = &samples[sample_head % PROFILER_SAMPLES];
+    s->host_pc = host_pc;
+    if (xTaskGetCurrentTaskHandle() == emul_task) {
+        s->m68k_pc = m68k_getpc();
+        s->trap = ProfilerLastTrap;
+        s->flags = 0;
+    } else {
+        s->m68k_pc = 0;
+        s->trap = 0;
+        s->flags = SAMPLE_OTHER_TASK;
+    }
+    sample_head++;
+    return false;
+}
+
+static int routine_compare(const void *a, const void *b)
+{
+    const rom_routine *x = (const rom_routine *)a, *y = (const rom_routine *)b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->trap < y->trap ? -1 : x->trap > y->trap;
+}
+
+/*
+ *  Entry points of all implemented ROM traps, by offset; traps sharing one
+ *  entry point keep the lowest number
+ */
+static void build_routine_table(void)
+{
+    routines = (rom_routine *)ps_malloc(0x500 * sizeof(rom_routine));
+    if (!routines) return;
+    int n = 0;
+    for (uint32 trap = 0xa000; trap < 0xac00; trap++) {
+        if (trap == 0xa100) trap = 0xa800;      // 256 OS traps, 1024 Toolbox traps
+        uint32 offset = FindROMTrap(trap);
+        if (offset != 0 && offset < ROMSize) {
+            routines[n].offset = offset;
+            routines[n].trap = trap;
+            n++;
+        }
+    }
+    qsort(routines, n, sizeof(rom_routine), routine_compare);
+    nroutines = 0;
+    for (int i = 0; i < n; i++) {
+        if (nroutines == 0 || routines[nroutines - 1].offset != routines[i].offset) {
+            routines[nroutines++] = routines[i];
+        }
+    }
+}
+
+// Trap whose routine holds a ROM offset, 0 if it lies before all of them
+static uint16 rom_routine_at(uint32 offset)
+{
+    int lo = 0, hi = nroutines - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (routines[mid].offset <= offset) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found < 0 ? 0 : routines[found].trap;
+}
+
+static uint32 routine_offset(uint16 trap)
+{
+    for (int i = 0; i < nroutines; i++) {
+        if (routines[i].trap == trap) return routines[i].offset;
+    }
+    return 0;
+}
+
+// A-line trap word as its table number: flag bits dropped
+static uint16 trap_number(uint16 opcode)
+{
+    return (opcode & 0x0800) ? (0xa800 | (opcode & 0x03ff)) : (0xa000 | (opcode & 0x00ff));
+}
+
+static int key_compare(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int count_compare(const void *a, const void *b)
+{
+    const hist_entry *x = (const hist_entry *)a, *y = (const hist_entry *)b;
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+/*
+ *  Sort keys[0..n), count equal ones into hist, most frequent first;
+ *  returns the number of distinct keys
+ */
+static int build_histogram(uint32 *keys, int n, hist_entry *hist)
+{
+    qsort(keys, n, sizeof(uint32), key_compare);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m > 0 && hist[m - 1].key == keys[i]) {
+            hist[m - 1].count++;
+        } else {
+            hist[m].key = keys[i];
+            hist[m].count = 1;
+            m++;
+        }
+    }
+    qsort(hist, m, sizeof(hist_entry), count_compare);
+    return m;
+}
+
+static void print_histogram(const char *title, const hist_entry *hist, int m, uint32 total,
+                            void (*label)(uint32 key, char *buf, size_t size))
+{
+    Serial.printf("[PROF] %s (%u samples, %d distinct):\n", title, (unsigned)total, m);
+    for (int i = 0; i < m && i < PROFILER_TOP; i++) {
+        char buf[48];
+        label(hist[i].key, buf, sizeof(buf));
+        Serial.printf("[PROF]   %5.1f%%  %6u  %s\n", total ? 100.0f * hist[i].count / total : 0.0f,
+                      (unsigned)hist[i].count, buf);
+    }
+}
+
+static void label_routine(uint32 key, char *buf, size_t size)
+{
+    if (key == 0) {
+        snprintf(buf, size, "ROM before the first trap");
+    } else {
+        snprintf(buf, size, "trap %04X (ROM+%06X)", (unsigned)key, (unsigned)routine_offset(key));
+    }
+}
+
+static void label_ram(uint32 key, char *buf, size_t size)
+{
+    snprintf(buf, size, "RAM %08X", (unsigned)key);
+}
+
+static void label_trap(uint32 key, char *buf, size_t size)
+{
+    if (key == 0) {
+        snprintf(buf, size, "no trap yet");
+    } else {
+        snprintf(buf, size, "trap %04X", (unsigned)key);
+    }
+}
+
+static void label_host(uint32 key, char *buf, size_t size)
+{
+    snprintf(buf, size, "0x%08x", (unsigned)key);
+}
+
+/*
+ *  Print the histograms of the samples in the ring and empty it
+ */
+static void profiler_dump(void)
+{
+    sampling_paused = true;
+    uint32 taken = sample_head;
+    int n = taken < PROFILER_SAMPLES ? (int)taken : PROFILER_SAMPLES;
+    uint32 elapsed_ms = millis() - dump_start_ms;
+
+    uint32 *keys = (uint32 *)ps_malloc(n * sizeof(uint32) + 1);
+    hist_entry *hist = (hist_entry *)ps_malloc(n * sizeof(hist_entry) + 1);
+    if (!keys || !hist) {
+        Serial.println("[PROF] Not enough PSRAM for the histograms");
+        free(keys);
+        free(hist);
+        sampling_paused = false;
+        return;
+    }
+
+    Serial.printf("[PROF] %u samples over %u ms (%d kept, every %d us)\n",
+                  (unsigned)taken, (unsigned)elapsed_ms, n, PROFILER_PERIOD_US);
+
+    // Where the 68k was
+    int emul = 0, rom = 0, ram = 0;
+    for (int i = 0; i < n; i++) {
+        const profiler_sample *s = &samples[i];
+        if (s->flags & SAMPLE_OTHER_TASK) continue;
+        emul++;
+        uint32 pc = s->m68k_pc;
+        if (pc - ROMBaseMac < ROMSize) {
+            rom++;
+        } else if (pc - RAMBaseMac < RAMSize) {
+            ram++;
+        }
+    }
+    Serial.printf("[PROF] emulation task %d (ROM %d, RAM %d, other %d), other tasks %d\n",
+                  emul, rom, ram, emul - rom - ram, n - emul);
+
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        const profiler_sample *s = &samples[i];
+        uint32 offset = s->m68k_pc - ROMBaseMac;
+        if (!(s->flags & SAMPLE_OTHER_TASK) && offset < ROMSize) {
+            keys[k++] = rom_routine_at(offset);
+        }
+    }
+    int m = build_histogram(keys, k, hist);
+    print_histogram("ROM by routine", hist, m, k, label_routine);
+
+    k = 0;
+    for (int i = 0; i < n; i++) {
+        const profiler_sample *s = &samples[i];
+        if (!(s->flags & SAMPLE_OTHER_TASK) && s->m68k_pc - RAMBaseMac < RAMSize) {
+            keys[k++] = s->m68k_pc & ~(uint32)(PROFILER_RAM_BLOCK - 1);
+        }
+    }
+    m = build_histogram(keys, k, hist);
+    print_histogram("RAM by 64-byte block", hist, m, k, label_ram);
+
+    k = 0;
+    for (int i = 0; i < n; i++) {
+        const profiler_sample *s = &samples[i];
+        if (!(s->flags & SAMPLE_OTHER_TASK)) {
+            keys[k++] = s->trap ? trap_number(s->trap) : 0;
+        }
+    }
+    m = build_histogram(keys, k, hist);
+    print_histogram("Last trap called", hist, m, k, label_trap);
+
+    for (int i = 0; i < n; i++) {
+        keys[i] = samples[i].host_pc;
+    }
+    m = build_histogram(keys, n, hist);
+    print_histogram("Host PC, all tasks on Core 1", hist, m, n, label_host);
+
+    free(keys);
+    free(hist);
+
+    sample_head = 0;
+    dump_start_ms = millis();
+    sampling_paused = false;
+}
+
+void ProfilerInit(void)
+{
+    samples = (profiler_sample *)MemPlanAlloc("profiler", PROFILER_SAMPLES * sizeof(profiler_sample), MALLOC_CAP_SPIRAM);
+    if (!samples) {
+        Serial.println("[PROF] No memory for the sample ring, profiler off");
+        return;
+    }
+    build_routine_table();
+    emul_task = xTaskGetCurrentTaskHandle();
+
+    // The interrupt is allocated on the core registering the callback
+    gptimer_config_t config = {};
+    config.clk_src = GPTIMER_CLK_SRC_DEFAULT;
+    config.direction = GPTIMER_COUNT_UP;
+    config.resolution_hz = 1000000;
+    gptimer_alarm_config_t alarm = {};
+    alarm.alarm_count = PROFILER_PERIOD_US;
+    alarm.reload_count = 0;
+    alarm.flags.auto_reload_on_alarm = true;
+    gptimer_event_callbacks_t callbacks = {};
+    callbacks.on_alarm = sample_isr;
+
+    if (gptimer_new_timer(&config, &sample_timer) != ESP_OK) {
+        Serial.println("[PROF] No free gptimer, profiler off");
+        sample_timer = NULL;
+        return;
+    }
+    if (gptimer_set_alarm_action(sample_timer, &alarm) != ESP_OK ||
+        gptimer_register_event_callbacks(sample_timer, &callbacks, NULL) != ESP_OK ||
+        gptimer_enable(sample_timer) != ESP_OK ||
+        gptimer_start(sample_timer) != ESP_OK) {
+        Serial.println("[PROF] Timer setup failed, profiler off");
+        gptimer_del_timer(sample_timer);
+        sample_timer = NULL;
+        return;
+    }
+    dump_start_ms = millis();
+    Serial.printf("[PROF] Sampling every %d us on core %d, %d ROM routines; Ctrl+Print Screen or 'p' on serial dumps\n",
+                  PROFILER_PERIOD_US, xPortGetCoreID(), nroutines);
+}
+
+void ProfilerRequestDump(void)
+{
+    dump_requested = true;
+}
+
+void ProfilerPoll(void)
+{
+    if (!sample_timer) return;
+    while (Serial.available() > 0) {
+        if (Serial.read() == 'p') {
+            dump_requested = true;
+        }
+    }
+    if (dump_requested) {
+        dump_requested = false;
+        profiler_dump();
+    }
+}
+
+#endif // PROFILER
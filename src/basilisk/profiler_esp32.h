@@ -0,0 +1,40 @@
+/*
+ *  profiler_esp32.h - Sampling profiler for the 68k PC and host code
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef PROFILER_ESP32_H
+#define PROFILER_ESP32_H
+
+#ifndef PROFILER
+#define PROFILER 0
+#endif
+
+#ifndef PROFILER_PERIOD_US
+#define PROFILER_PERIOD_US      1009        // Sample period, off the 60Hz/1kHz beat
+#endif
+
+#if PROFILER
+
+// Last A-line trap word the CPU took (newcpu.cpp op_illg)
+extern volatile uint16 ProfilerLastTrap;
+
+/*
+ *  Start sampling the CPU core: call on Core 1 from the emulation task once
+ *  the ROM is patched, before the 68k starts
+ */
+extern void ProfilerInit(void);
+
+// Dump at the next ProfilerPoll() (Ctrl+Print Screen)
+extern void ProfilerRequestDump(void);
+
+/*
+ *  From basilisk_loop(): dump the histograms of the samples taken since the
+ *  last dump when requested, or when 'p' arrives on the serial console
+ */
+extern void ProfilerPoll(void);
+
+#endif
+
+#endif /* PROFILER_ESP32_H */
@@ -0,0 +1,452 @@
+/*
+ *  qd_accel_esp32.cpp - Native QuickDraw blits on the main screen
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  CopyBits(), FillRect() and EraseRect() are replaced by stubs that ask
+ *  QDAccelOp() first and chain to the previous trap when it declines.
+ *  Only the plain cases are taken: the current port draws into the
+ *  screen, which is in Mac layout; its visRgn and clipRgn are rectangles;
+ *  nothing is being recorded; no colorizing (black on white); byte-aligned
+ *  edges below 8 bits per pixel. CopyBits() additionally needs srcCopy
+ *  without a mask region, equal rectangles, the same depth and, for
+ *  indexed pixels, the same colour table seed, so that its copy is a row
+ *  by row memmove. The fills expand the 8x8 pattern into the port's
+ *  pixel values. Either way the tiles are marked dirty once for the
+ *  rectangle instead of per store, and QuickDraw's own cursor is hidden
+ *  around the blit like QuickDraw does.
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "main.h"
+#include "video.h"
+#include "qd_accel_esp32.h"
+
+#if QD_ACCEL
+
+// GrafPort/CGrafPort fields
+enum {
+    port_bits = 2,          // portBits / portPixMap, portVersion
+    port_vis_rgn = 24,
+    port_clip_rgn = 28,
+    port_bk_pat = 32,       // bkPat / bkPixPat
+    port_rgb_fg = 36,       // CGrafPort only
+    port_rgb_bk = 42,
+    port_fg_color = 80,     // Pixel value in a CGrafPort
+    port_bk_color = 84,
+    port_pic_save = 92,
+    port_rgn_save = 96,
+    port_poly_save = 100,
+    port_graf_procs = 104
+};
+
+#define BLACK_COLOR     33      // Old-style fgColor/bkColor values
+#define WHITE_COLOR     30
+
+struct qd_rect {
+    int top, left, bottom, right;
+};
+
+// A BitMap or PixMap
+struct qd_bits {
+    uint32 base;
+    uint32 row_bytes;
+    qd_rect bounds;
+    int depth;
+    int pixel_type;
+    uint32 seed;            // Colour table seed, 0 = none
+};
+
+static void read_rect(uint32 addr, qd_rect *r)
+{
+    r->top = int16(ReadMacInt16(addr));
+    r->left = int16(ReadMacInt16(addr + 2));
+    r->bottom = int16(ReadMacInt16(addr + 4));
+    r->right = int16(ReadMacInt16(addr + 6));
+}
+
+static void intersect(qd_rect *r, const qd_rect &s)
+{
+    r->top = r->top > s.top ? r->top : s.top;
+    r->left = r->left > s.left ? r->left : s.left;
+    r->bottom = r->bottom < s.bottom ? r->bottom : s.bottom;
+    r->right = r->right < s.right ? r->right : s.right;
+}
+
+static bool empty(const qd_rect &r)
+{
+    return r.bottom <= r.top || r.right <= r.left;
+}
+
+static bool read_bits(uint32 bits, qd_bits *b)
+{
+    uint16 row_bytes = ReadMacInt16(bits + 4);
+    uint32 map = bits;
+    if ((row_bytes & 0xc000) == 0xc000) {
+        // A CGrafPort's portPixMap handle and portVersion
+        uint32 handle = ReadMacInt32(bits);
+        if (handle == 0 || (map = ReadMacInt32(handle)) == 0) {
+            return false;
+        }
+        row_bytes = ReadMacInt16(map + 4);
+    }
+    b->base = ReadMacInt32(map);
+    b->row_bytes = row_bytes & 0x3fff;
+    read_rect(map + 6, &b->bounds);
+    b->depth = 1;
+    b->pixel_type = 0;
+    b->seed = 0;
+    if (row_bytes & 0x8000) {
+        b->pixel_type = ReadMacInt16(map + 30);
+        b->depth = ReadMacInt16(map + 32);
+        uint32 table = ReadMacInt32(map + 42);
+        if (table && ReadMacInt32(table)) {
+            b->seed = ReadMacInt32(ReadMacInt32(table));
+        }
+    }
+    switch (b->depth) {
+        case 1: case 2: case 4: case 8: case 16: case 32:
+            return b->row_bytes != 0;
+        default:
+            return false;
+    }
+}
+
+// Bounding box of a rectangular region handle
+static bool read_rect_rgn(uint32 handle, qd_rect *r)
+{
+    uint32 rgn;
+    if (handle == 0 || (rgn = ReadMacInt32(handle)) == 0 || ReadMacInt16(rgn) != 10) {
+        return false;
+    }
+    read_rect(rgn + 2, r);
+    return true;
+}
+
+// Host address of a span in RAM or in a frame buffer in Mac layout
+static uint8 *host_span(uint32 addr, uint32 size, bool *frame)
+{
+    *frame = false;
+    if (addr - RAMBaseMac < RAMSize && size <= RAMSize - (addr - RAMBaseMac)) {
+        ram_copy_host_write(addr - RAMBaseMac);
+        return RAMBaseHost + (addr - RAMBaseMac);
+    }
+    if (MacFrameLayout == FLAYOUT_DIRECT && addr - MacFrameBaseMac < MacFrameSize
+        && size <= MacFrameSize - (addr - MacFrameBaseMac)) {
+        *frame = true;
+        return MacFrameBaseHost + (addr - MacFrameBaseMac);
+    }
+    return NULL;
+}
+
+// Address of pixel (h, v) in local coordinates; depth < 8 needs aligned h
+static uint32 pixel_addr(const qd_bits &b, int v, int h)
+{
+    return b.base + (v - b.bounds.top) * b.row_bytes + (((h - b.bounds.left) * b.depth) >> 3);
+}
+
+static bool byte_aligned(const qd_bits &b, int h, int width)
+{
+    return (((h - b.bounds.left) * b.depth) & 7) == 0 && ((width * b.depth) & 7) == 0;
+}
+
+/*
+ *  The current port, if it can be drawn into natively: its bits on the
+ *  screen, nothing recorded; clip gets where drawing can go (local)
+ */
+static uint32 screen_port(M68kRegisters *r, qd_bits *bits, qd_rect *clip)
+{
+    uint32 port = ReadMacInt32(ReadMacInt32(r->a[5]));  // thePort
+    if (port == 0 || ReadMacInt32(port + port_graf_procs) || ReadMacInt32(port + port_pic_save)
+        || ReadMacInt32(port + port_rgn_save) || ReadMacInt32(port + port_poly_save)) {
+        return 0;
+    }
+    if (!read_bits(port + port_bits, bits) || bits->base - MacFrameBaseMac >= MacFrameSize) {
+        return 0;
+    }
+    qd_rect vis, clip_rgn;
+    if (!read_rect_rgn(ReadMacInt32(port + port_vis_rgn), &vis)
+        || !read_rect_rgn(ReadMacInt32(port + port_clip_rgn), &clip_rgn)) {
+        return 0;
+    }
+    *clip = bits->bounds;
+    intersect(clip, vis);
+    intersect(clip, clip_rgn);
+    return port;
+}
+
+static bool color_port(uint32 port)
+{
+    return (ReadMacInt16(port + port_bits + 4) & 0xc000) == 0xc000;
+}
+
+// Foreground and background pixel values
+static bool port_pixels(uint32 port, const qd_bits &bits, uint32 *fg, uint32 *bk)
+{
+    if (color_port(port)) {
+        uint32 mask = bits.depth == 32 ? 0xffffffff : (1u << bits.depth) - 1;
+        *fg = ReadMacInt32(port + port_fg_color) & mask;
+        *bk = ReadMacInt32(port + port_bk_color) & mask;
+        return true;
+    }
+    // An old port only draws in black and white into a bitmap
+    if (bits.depth != 1 || ReadMacInt32(port + port_fg_color) != BLACK_COLOR
+        || ReadMacInt32(port + port_bk_color) != WHITE_COLOR) {
+        return false;
+    }
+    *fg = 1;
+    *bk = 0;
+    return true;
+}
+
+// srcCopy leaves the pixels alone with a black foreground and white background
+static bool plain_colors(uint32 port)
+{
+    if (!color_port(port)) {
+        return ReadMacInt32(port + port_fg_color) == BLACK_COLOR
+            && ReadMacInt32(port + port_bk_color) == WHITE_COLOR;
+    }
+    for (int i = 0; i < 6; i += 2) {
+        if (ReadMacInt16(port + port_rgb_fg + i) != 0 || ReadMacInt16(port + port_rgb_bk + i) != 0xffff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#if !VIDEO_CURSOR_OVERLAY
+// QuickDraw draws the cursor into the frame buffer; take it off around a blit
+static bool hide_cursor(void)
+{
+    if (ReadMacInt8(0x8cc) == 0) {      // CrsrVis
+        return false;
+    }
+    M68kRegisters r;
+    Execute68k(ReadMacInt32(0x800), &r);    // JHideCursor
+    return true;
+}
+
+static void show_cursor(void)
+{
+    M68kRegisters r;
+    Execute68k(ReadMacInt32(0x804), &r);    // JShowCursor
+}
+#endif
+
+static void mark_dirty(uint32 addr, uint32 width, uint32 rows)
+{
+    VideoMarkDirtyRect(VIDEO_PAGE_OFFSET(addr - MacFrameBaseMac), width, rows);
+}
+
+/*
+ *  CopyBits(srcBits, dstBits: BitMap; srcRect, dstRect: Rect; mode: INTEGER; maskRgn: RgnHandle)
+ */
+
+static bool copy_bits(M68kRegisters *r)
+{
+    uint32 sp = r->a[7];
+    if (ReadMacInt32(sp + 4) != 0 || ReadMacInt16(sp + 8) != 0) {     // maskRgn, srcCopy
+        return false;
+    }
+    qd_bits src, dst, port_dst;
+    qd_rect clip;
+    uint32 port = screen_port(r, &port_dst, &clip);
+    if (port == 0 || !plain_colors(port)) {
+        return false;
+    }
+    if (!read_bits(ReadMacInt32(sp + 22), &src) || !read_bits(ReadMacInt32(sp + 18), &dst)) {
+        return false;
+    }
+
+    // Into the port's own bits, without any pixel translation
+    if (dst.base != port_dst.base || dst.row_bytes != port_dst.row_bytes || dst.depth != port_dst.depth
+        || memcmp(&dst.bounds, &port_dst.bounds, sizeof(qd_rect)) != 0) {
+        return false;
+    }
+    if (src.depth != dst.depth || src.pixel_type != dst.pixel_type) {
+        return false;
+    }
+    if (src.depth > 1 && src.depth <= 8 && (src.seed == 0 || src.seed != dst.seed)) {
+        return false;
+    }
+
+    qd_rect src_rect, dst_rect;
+    read_rect(ReadMacInt32(sp + 14), &src_rect);
+    read_rect(ReadMacInt32(sp + 10), &dst_rect);
+    if (src_rect.bottom - src_rect.top != dst_rect.bottom - dst_rect.top
+        || src_rect.right - src_rect.left != dst_rect.right - dst_rect.left) {
+        return false;       // Stretched
+    }
+
+    // Clip in destination coordinates, the source's bounds included
+    int dv = dst_rect.top - src_rect.top, dh = dst_rect.left - src_rect.left;
+    qd_rect src_bounds = {src.bounds.top + dv, src.bounds.left + dh, src.bounds.bottom + dv, src.bounds.right + dh};
+    qd_rect rect = dst_rect;
+    intersect(&rect, clip);
+    intersect(&rect, src_bounds);
+    if (empty(rect)) {
+        return true;
+    }
+    int width = rect.right - rect.left, rows = rect.bottom - rect.top;
+    if (!byte_aligned(dst, rect.left, width) || !byte_aligned(src, rect.left - dh, width)) {
+        return false;
+    }
+
+    uint32 bytes = (width * dst.depth) >> 3;
+    uint32 from_mac = pixel_addr(src, rect.top - dv, rect.left - dh);
+    uint32 to_mac = pixel_addr(dst, rect.top, rect.left);
+    bool src_frame, dst_frame;
+    uint8 *from = host_span(from_mac, (rows - 1) * src.row_bytes + bytes, &src_frame);
+    uint8 *to = host_span(to_mac, (rows - 1) * dst.row_bytes + bytes, &dst_frame);
+    if (from == NULL || to == NULL || !dst_frame) {
+        return false;
+    }
+
+#if !VIDEO_CURSOR_OVERLAY
+    bool cursor = hide_cursor();
+#endif
+    if (to > from && to < from + rows * src.row_bytes) {
+        // Overlapping, moving down: last row first
+        for (int y = rows - 1; y >= 0; y--) {
+            memmove(to + y * dst.row_bytes, from + y * src.row_bytes, bytes);
+        }
+    } else {
+        for (int y = 0; y < rows; y++) {
+            memmove(to + y * dst.row_bytes, from + y * src.row_bytes, bytes);
+        }
+    }
+    mark_dirty(to_mac, bytes, rows);
+#if !VIDEO_CURSOR_OVERLAY
+    if (cursor) {
+        show_cursor();
+    }
+#endif
+    return true;
+}
+
+// One pattern row as 8 pixels of depth bits, big-endian (depth bytes)
+static void expand_pattern_row(uint8 pat, int depth, uint32 fg, uint32 bk, uint8 *out)
+{
+    memset(out, 0, depth);
+    for (int p = 0; p < 8; p++) {
+        uint32 v = (pat & (0x80 >> p)) ? fg : bk;
+        if (depth >= 8) {
+            int n = depth >> 3;
+            for (int i = 0; i < n; i++) {
+                out[p * n + i] = v >> (8 * (n - 1 - i));
+            }
+        } else {
+            int bit = p * depth;
+            out[bit >> 3] |= v << (8 - depth - (bit & 7));
+        }
+    }
+}
+
+/*
+ *  Fill rect (local coordinates) of the current port with an 8x8 pattern
+ */
+
+static bool fill_rect(uint32 rect_addr, uint32 pat_addr, uint32 port, const qd_bits &bits, const qd_rect &clip)
+{
+    uint32 fg, bk;
+    if (!port_pixels(port, bits, &fg, &bk)) {
+        return false;
+    }
+    qd_rect rect;
+    read_rect(rect_addr, &rect);
+    intersect(&rect, clip);
+    if (empty(rect)) {
+        return true;
+    }
+    int width = rect.right - rect.left, rows = rect.bottom - rect.top;
+    if (!byte_aligned(bits, rect.left, width)) {
+        return false;
+    }
+
+    uint32 bytes = (width * bits.depth) >> 3;
+    uint32 to_mac = pixel_addr(bits, rect.top, rect.left);
+    bool frame;
+    uint8 *to = host_span(to_mac, (rows - 1) * bits.row_bytes + bytes, &frame);
+    if (to == NULL || !frame) {
+        return false;
+    }
+
+    // The pattern is aligned to the bitmap, i.e. to the screen
+    uint8 pat_rows[8][32];
+    bool solid[8];
+    for (int i = 0; i < 8; i++) {
+        expand_pattern_row(ReadMacInt8(pat_addr + i), bits.depth, fg, bk, pat_rows[i]);
+        solid[i] = true;
+        for (int b = 1; b < bits.depth; b++) {
+            solid[i] = solid[i] && pat_rows[i][b] == pat_rows[i][0];
+        }
+    }
+    int first_byte = (((rect.left - bits.bounds.left) & 7) * bits.depth) >> 3;
+
+#if !VIDEO_CURSOR_OVERLAY
+    bool cursor = hide_cursor();
+#endif
+    for (int y = 0; y < rows; y++) {
+        int row = (rect.top + y - bits.bounds.top) & 7;
+        uint8 *d = to + y * bits.row_bytes;
+        if (solid[row]) {
+            memset(d, pat_rows[row][0], bytes);
+        } else {
+            const uint8 *p = pat_rows[row];
+            int k = first_byte;
+            for (uint32 i = 0; i < bytes; i++) {
+                d[i] = p[k];
+                if (++k == bits.depth) {
+                    k = 0;
+                }
+            }
+        }
+    }
+    mark_dirty(to_mac, bytes, rows);
+#if !VIDEO_CURSOR_OVERLAY
+    if (cursor) {
+        show_cursor();
+    }
+#endif
+    return true;
+}
+
+bool QDAccelOp(int selector, M68kRegisters *r)
+{
+    if (TwentyFourBitAddressing) {
+        return false;
+    }
+
+    qd_bits bits;
+    qd_rect clip;
+    uint32 port;
+    switch (selector) {
+        case QD_ACCEL_COPYBITS:
+            return copy_bits(r);
+
+        case QD_ACCEL_FILLRECT:     // FillRect(r: Rect; pat: Pattern)
+            port = screen_port(r, &bits, &clip);
+            return port && fill_rect(ReadMacInt32(r->a[7] + 8), ReadMacInt32(r->a[7] + 4), port, bits, clip);
+
+        case QD_ACCEL_ERASERECT: {  // EraseRect(r: Rect)
+            port = screen_port(r, &bits, &clip);
+            if (port == 0) {
+                return false;
+            }
+            uint32 pat = port + port_bk_pat;
+            if (color_port(port)) {
+                // Only an old-style bkPixPat, which is drawn with the port's colours
+                uint32 pix_pat = ReadMacInt32(port + port_bk_pat);
+                if (pix_pat == 0 || (pix_pat = ReadMacInt32(pix_pat)) == 0 || ReadMacInt16(pix_pat) != 0) {
+                    return false;
+                }
+                pat = pix_pat + 20;     // pat1Data
+            }
+            return fill_rect(ReadMacInt32(r->a[7] + 4), pat, port, bits, clip);
+        }
+    }
+    return false;
+}
+
+#endif // QD_ACCEL
@@ -0,0 +1,34 @@
+/*
+ *  qd_accel_esp32.h - Native QuickDraw blits on the main screen
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef QD_ACCEL_ESP32_H
+#define QD_ACCEL_ESP32_H
+
+// Run the simple CopyBits()/FillRect()/EraseRect() calls on the screen natively
+#ifndef QD_ACCEL
+#define QD_ACCEL 0
+#endif
+
+#if QD_ACCEL
+
+// Traps replaced (rom_patches.cpp), the selector is in d0 of M68K_EMUL_OP_QD_ACCEL
+enum {
+    QD_ACCEL_COPYBITS,      // CopyBits()
+    QD_ACCEL_FILLRECT,      // FillRect()
+    QD_ACCEL_ERASERECT,     // EraseRect()
+    QD_ACCEL_COUNT
+};
+
+/*
+ *  Do the call whose Pascal arguments are on the 68k stack (a7 points at
+ *  the return address), true if done; false leaves everything untouched
+ *  for the trap's previous implementation
+ */
+extern bool QDAccelOp(int selector, M68kRegisters *r);
+
+#endif
+
+#endif /* QD_ACCEL_ESP32_H */
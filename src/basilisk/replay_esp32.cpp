@@ -0,0 +1,596 @@
+/*
+ *  replay_esp32.cpp - Record and replay of what the 68k gets from outside
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A run of the emulator only differs from the last one in what reaches
+ *  the 68k from outside: when interrupt flags are seen, what the clocks
+ *  read, which ADB events are queued and when an asynchronous transfer is
+ *  over. Recording logs each of those with the instruction count it was
+ *  taken at; replaying feeds the logged ones back at the same counts and
+ *  ignores the live ones, so a recorded Finder or application session
+ *  runs through the same instructions again - as fast as the build at
+ *  hand can, with no idle sleeps - and ends with the time it took and a
+ *  hash of Mac RAM to compare builds by.
+ *
+ *  Interrupt flags don't reach the 68k the moment they are raised while
+ *  this is on. SetInterruptFlag() holds them and TriggerInterrupt() leaves
+ *  SPCFLAG_INT alone; the batch sizes are fixed, and the next batch end
+ *  delivers the held flags (ReplaySync()), or the recorded ones when
+ *  replaying. With the same inputs the batches end at the same
+ *  instructions, so a delivery is identified by the count alone; the PC is
+ *  logged with it to notice a replay that has gone another way, which
+ *  then carries on live. A CPU waiting in STOP gets them in ReplayStopped().
+ *
+ *  Log: a replay_header, then one entry per input - kind byte, varint of
+ *  the instructions since the previous entry, varint value (zigzag delta
+ *  from the last one of that kind for the clocks), and for interrupts the
+ *  PC. The machine must boot the same way: same ROM, RAM size, disks (a
+ *  diskoverlay with discardoverlay keeps them unchanged) and dispatch loop;
+ *  XPRAM is saved in the header and restored. Ethernet, serial and
+ *  clipboard data aren't logged.
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "main.h"
+#include "prefs.h"
+#include "xpram.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "predecode.h"
+#include "replay_esp32.h"
+
+#ifdef ARDUINO
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <esp_heap_caps.h>
+#include "esp_timer.h"
+#include "mem_plan_esp32.h"
+#include "sd_esp32.h"
+#else
+#include <time.h>
+#endif
+
+#if REPLAY
+
+#define REPLAY_MAGIC            "B2REPLY1"
+#define REPLAY_DEFAULT_FILE     "/replay.b2r"
+#define REPLAY_LOG_SIZE         (4 * 1024 * 1024)   // Recording, in PSRAM
+#define REPLAY_BATCH            32                  // Instructions per batch while recording
+#define REPLAY_ENTRY_MAX        24                  // Longest entry (kind, 3 varints)
+
+// Dispatch loop, recorded: another one ends batches elsewhere
+#if USE_THREADED_DISPATCH
+#define REPLAY_DISPATCH         1
+#elif USE_PREDECODE_CACHE && USE_RV_JIT
+#define REPLAY_DISPATCH         3
+#elif USE_PREDECODE_CACHE
+#define REPLAY_DISPATCH         2
+#else
+#define REPLAY_DISPATCH         0
+#endif
+
+extern int32 exec_batch_size;
+
+struct replay_header {
+    char magic[8];                  // REPLAY_MAGIC
+    uint32 rom_checksum;            // First long word of the ROM
+    uint32 ram_size;
+    uint32 batch;                   // exec_batch_size
+    uint32 dispatch;                // REPLAY_DISPATCH
+    uint64 end_insns;               // Instructions recorded
+    uint32 log_bytes;
+    uint32 events;
+    uint8 xpram[XPRAM_SIZE];        // At the start
+};
+
+// Position in the log; each reader keeps its own running values
+struct replay_cursor {
+    uint32 pos;
+    uint64 insns;
+    uint64 last[REPLAY_KINDS];
+};
+
+struct replay_entry {
+    uint32 pos;
+    int kind;
+    uint64 insns;
+    uint64 value;
+    uint32 pc;                      // REPLAY_IRQ/REPLAY_IRQ_STOP
+};
+
+int replay_mode = REPLAY_OFF;
+uint64 replay_insns = 0;
+uint64 replay_next = ~(uint64)0;
+uint32 replay_pending = 0;
+
+static replay_header header;
+static uint8 *log_data = NULL;
+static uint32 log_size = 0;
+static char log_path[128];
+static uint64 start_us = 0;
+static bool finished = false;
+static volatile bool stop_requested = false;
+static bool save_pending = false;
+#ifdef ARDUINO
+static TaskHandle_t cpu_task = NULL;
+#endif
+
+// Record
+static replay_cursor writer;
+
+// Play: interrupts are read ahead, inputs as the 68k asks for them
+static replay_cursor irq_cursor;
+static replay_cursor input_cursor;
+static replay_entry next_irq;
+static bool have_next_irq = false;
+static uint32 irqs_played = 0;
+static uint32 inputs_played = 0;
+
+static bool is_delta(int kind)
+{
+    return kind == REPLAY_TIMER || kind == REPLAY_MICROS || kind == REPLAY_DATE;
+}
+
+static bool is_irq(int kind)
+{
+    return kind == REPLAY_IRQ || kind == REPLAY_IRQ_STOP;
+}
+
+static uint64 now_us(void)
+{
+#ifdef ARDUINO
+    return esp_timer_get_time();
+#else
+    // The host's esp_timer runs on its virtual clock
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static bool on_cpu_thread(void)
+{
+#ifdef ARDUINO
+    return xTaskGetCurrentTaskHandle() == cpu_task;
+#else
+    return true;
+#endif
+}
+
+static void *alloc_log(size_t size)
+{
+#ifdef ARDUINO
+    return MemPlanAlloc("replay", size, MALLOC_CAP_SPIRAM);
+#else
+    return malloc(size);
+#endif
+}
+
+static uint8 *put_varint(uint8 *p, uint64 v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8)v;
+    return p;
+}
+
+static bool get_varint(replay_cursor &c, uint64 &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64 && c.pos < header.log_bytes; shift += 7) {
+        uint8 b = log_data[c.pos++];
+        v |= (uint64)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode(replay_cursor &c, replay_entry &e)
+{
+    if (c.pos >= header.log_bytes) {
+        return false;
+    }
+    e.pos = c.pos;
+    e.kind = log_data[c.pos++];
+    uint64 delta, v, pc = 0;
+    if (e.kind >= REPLAY_KINDS || !get_varint(c, delta) || !get_varint(c, v) ||
+        (is_irq(e.kind) && !get_varint(c, pc))) {
+        c.pos = header.log_bytes;
+        return false;
+    }
+    c.insns += delta;
+    if (is_delta(e.kind)) {
+        v = c.last[e.kind] + (uint64)((int64)(v >> 1) ^ -(int64)(v & 1));
+        c.last[e.kind] = v;
+    }
+    e.insns = c.insns;
+    e.value = v;
+    e.pc = (uint32)pc;
+    return true;
+}
+
+/*
+ *  Hand the held flags out to the 68k (live, and on replay the rest of the run)
+ */
+static void deliver(uint32 flags)
+{
+    __atomic_or_fetch(&InterruptFlags, flags, __ATOMIC_RELEASE);
+    SPCFLAGS_SET(SPCFLAG_INT);
+}
+
+/*
+ *  Other tasks park their flags in replay_pending until they see
+ *  REPLAY_OFF: hand out what is held, switch, then hand out what was parked
+ *  meanwhile. A task that parks one later sees the switch in ReplayHold()
+ *  and raises it itself.
+ */
+static void go_live(void)
+{
+    uint32 flags = __atomic_exchange_n(&replay_pending, 0, __ATOMIC_ACQUIRE);
+    if (flags) {
+        deliver(flags);
+    }
+    replay_next = ~(uint64)0;
+    __atomic_store_n(&replay_mode, REPLAY_OFF, __ATOMIC_SEQ_CST);
+    flags = __atomic_exchange_n(&replay_pending, 0, __ATOMIC_SEQ_CST);
+    if (flags) {
+        deliver(flags);
+    }
+}
+
+/*
+ *  Recording: stop taking inputs, the log is written from ReplayPoll() or
+ *  ReplayFinish()
+ */
+static void record_stop(const char *why)
+{
+    header.end_insns = replay_insns;
+    header.log_bytes = writer.pos;
+    go_live();
+    save_pending = true;
+    Serial.printf("[REPLAY] Recording stopped (%s) after %llu instructions\n", why,
+                  (unsigned long long)replay_insns);
+}
+
+static void append(int kind, uint64 value, uint32 pc)
+{
+    if (writer.pos + REPLAY_ENTRY_MAX > log_size) {
+        record_stop("log full");
+        return;
+    }
+    uint8 *p = log_data + writer.pos;
+    *p++ = (uint8)kind;
+    p = put_varint(p, replay_insns - writer.insns);
+    writer.insns = replay_insns;
+    if (is_delta(kind)) {
+        int64 d = (int64)(value - writer.last[kind]);
+        writer.last[kind] = value;
+        p = put_varint(p, ((uint64)d << 1) ^ (uint64)(d >> 63));
+    } else {
+        p = put_varint(p, value);
+    }
+    if (is_irq(kind)) {
+        p = put_varint(p, pc);
+    }
+    writer.pos = p - log_data;
+    header.events++;
+}
+
+static void save_log(void)
+{
+    save_pending = false;
+    FILE *f = fopen(log_path, "wb");
+    bool ok = f && fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(log_data, 1, header.log_bytes, f) == header.log_bytes;
+    if (f && fclose(f) != 0) {
+        ok = false;
+    }
+    if (ok) {
+        Serial.printf("[REPLAY] Saved %s: %llu instructions, %u inputs, %u KB\n", log_path,
+                      (unsigned long long)header.end_insns, (unsigned)header.events,
+                      (unsigned)((sizeof(header) + header.log_bytes) / 1024));
+    } else {
+        Serial.printf("[REPLAY] WARNING: can't write %s\n", log_path);
+    }
+    free(log_data);
+    log_data = NULL;
+}
+
+// FNV-1a of Mac RAM, for comparing the end of two replays
+static uint64 ram_hash(void)
+{
+    uint64 h = 0xcbf29ce484222325ULL;
+    for (uint32 i = 0; i < RAMSize; i++) {
+        h = (h ^ RAMBaseHost[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void play_end(void)
+{
+    uint64 us = now_us() - start_us;
+    go_live();
+    finished = true;
+    free(log_data);
+    log_data = NULL;
+    Serial.printf("[REPLAY] Replayed %llu instructions, %u interrupts, %u inputs in %llu ms (%.2f MIPS)\n",
+                  (unsigned long long)replay_insns, (unsigned)irqs_played, (unsigned)inputs_played,
+                  (unsigned long long)(us / 1000), us ? (double)replay_insns / us : 0.0);
+    Serial.printf("[REPLAY] RAM hash %016llx\n", (unsigned long long)ram_hash());
+}
+
+static void diverged(const char *what, const replay_entry *e)
+{
+    if (e) {
+        Serial.printf("[REPLAY] Diverged at instruction %llu (PC %08x): %s, recorded kind %d at %llu\n",
+                      (unsigned long long)replay_insns, (unsigned)m68k_getpc(), what, e->kind,
+                      (unsigned long long)e->insns);
+    } else {
+        Serial.printf("[REPLAY] Diverged at instruction %llu (PC %08x): %s\n",
+                      (unsigned long long)replay_insns, (unsigned)m68k_getpc(), what);
+    }
+    Serial.println("[REPLAY] Running live from here");
+    go_live();
+    finished = true;
+    free(log_data);
+    log_data = NULL;
+}
+
+// Play: read ahead to the next recorded interrupt
+static void find_next_irq(void)
+{
+    have_next_irq = false;
+    replay_entry e;
+    while (decode(irq_cursor, e)) {
+        if (is_irq(e.kind)) {
+            next_irq = e;
+            have_next_irq = true;
+            break;
+        }
+    }
+    replay_next = have_next_irq && next_irq.insns < header.end_insns ? next_irq.insns : header.end_insns;
+}
+
+void ReplaySync(void)
+{
+    if (replay_mode == REPLAY_RECORD) {
+        uint32 flags = __atomic_exchange_n(&replay_pending, 0, __ATOMIC_ACQUIRE);
+        if (flags) {
+            deliver(flags);
+            append(REPLAY_IRQ, flags, m68k_getpc());
+        }
+        return;
+    }
+    if (replay_mode != REPLAY_PLAY) {
+        return;
+    }
+
+    // A REPLAY_IRQ_STOP here is for the STOP loop that follows
+    while (have_next_irq && next_irq.insns <= replay_insns && next_irq.kind == REPLAY_IRQ) {
+        if (next_irq.insns != replay_insns || next_irq.pc != m68k_getpc()) {
+            diverged("no batch end at a recorded interrupt", &next_irq);
+            return;
+        }
+        deliver((uint32)next_irq.value);
+        irqs_played++;
+        find_next_irq();
+    }
+    if (have_next_irq && next_irq.insns < replay_insns) {
+        diverged("CPU not stopped at a recorded interrupt", &next_irq);
+    } else if (replay_insns >= header.end_insns) {
+        play_end();
+    }
+}
+
+void ReplayStopped(void)
+{
+    if (replay_mode == REPLAY_RECORD) {
+        uint32 flags = __atomic_exchange_n(&replay_pending, 0, __ATOMIC_ACQUIRE);
+        if (flags) {
+            deliver(flags);
+            append(REPLAY_IRQ_STOP, flags, m68k_getpc());
+        }
+        return;
+    }
+    if (replay_mode != REPLAY_PLAY) {
+        return;
+    }
+
+    // The interrupt that woke the CPU, which doesn't get to sleep here
+    if (!have_next_irq || next_irq.kind != REPLAY_IRQ_STOP || next_irq.insns != replay_insns) {
+        diverged("CPU stopped, nothing recorded to wake it", have_next_irq ? &next_irq : NULL);
+        return;
+    }
+    if (next_irq.pc != m68k_getpc()) {
+        diverged("CPU stopped elsewhere", &next_irq);
+        return;
+    }
+    deliver((uint32)next_irq.value);
+    irqs_played++;
+    find_next_irq();
+}
+
+uint64 ReplayInput(int kind, uint64 value)
+{
+    if (replay_mode == REPLAY_OFF || !on_cpu_thread()) {
+        return value;
+    }
+    if (replay_mode == REPLAY_RECORD) {
+        append(kind, value, 0);
+        return value;
+    }
+
+    // Interrupts are read ahead; one not delivered yet means the 68k got here sooner
+    replay_entry e;
+    for (;;) {
+        if (!decode(input_cursor, e)) {
+            diverged("input past the end of the log", NULL);
+            return value;
+        }
+        if (!is_irq(e.kind)) {
+            break;
+        }
+        if (have_next_irq && e.pos >= next_irq.pos) {
+            diverged("input before a recorded interrupt", &e);
+            return value;
+        }
+    }
+    if (e.kind != kind || e.insns != replay_insns) {
+        diverged("another input than recorded", &e);
+        return value;
+    }
+    inputs_played++;
+    return e.value;
+}
+
+bool ReplayIODone(volatile bool *done)
+{
+    bool live = __atomic_load_n(done, __ATOMIC_ACQUIRE);
+    bool recorded = ReplayInput(REPLAY_IO_DONE, live) != 0;
+
+    // The data must be there before the 68k is told it is
+    while (recorded && replay_mode == REPLAY_PLAY && !__atomic_load_n(done, __ATOMIC_ACQUIRE)) {
+#ifdef ARDUINO
+        vTaskDelay(1);
+#endif
+    }
+    return recorded;
+}
+
+/*
+ *  Read a recording into log_data; false if it is missing or doesn't fit this machine
+ */
+static bool load_log(void)
+{
+    FILE *f = fopen(log_path, "rb");
+    if (!f) {
+        Serial.printf("[REPLAY] Can't open %s\n", log_path);
+        return false;
+    }
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) == 0;
+    if (!ok) {
+        Serial.printf("[REPLAY] %s is not a replay log\n", log_path);
+    } else if (header.rom_checksum != ReadMacInt32(ROMBaseMac) || header.ram_size != RAMSize ||
+               header.batch < 1) {
+        Serial.printf("[REPLAY] %s was recorded with another ROM (%08x) or RAM size (%u MB)\n", log_path,
+                      (unsigned)header.rom_checksum, (unsigned)(header.ram_size >> 20));
+        ok = false;
+    } else {
+        log_data = (uint8 *)alloc_log(header.log_bytes + 1);
+        ok = log_data && fread(log_data, 1, header.log_bytes, f) == header.log_bytes;
+        if (!ok) {
+            Serial.printf("[REPLAY] Can't read %s\n", log_path);
+            free(log_data);
+            log_data = NULL;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+void ReplayInit(void)
+{
+    const char *mode = PrefsFindString("replay");
+    if (mode == NULL || (strcmp(mode, "record") != 0 && strcmp(mode, "play") != 0)) {
+        return;
+    }
+    const char *file = PrefsFindString("replayfile");
+#ifdef ARDUINO
+    snprintf(log_path, sizeof(log_path), "%s%s", SD_MOUNT_POINT, file ? file : REPLAY_DEFAULT_FILE);
+    cpu_task = xTaskGetCurrentTaskHandle();
+#else
+    snprintf(log_path, sizeof(log_path), "%s", file ? file : REPLAY_DEFAULT_FILE);
+#endif
+
+    memset(&writer, 0, sizeof(writer));
+    memset(&irq_cursor, 0, sizeof(irq_cursor));
+    memset(&input_cursor, 0, sizeof(input_cursor));
+    replay_insns = 0;
+    replay_pending = 0;
+
+    if (strcmp(mode, "record") == 0) {
+        log_size = REPLAY_LOG_SIZE;
+        log_data = (uint8 *)alloc_log(log_size);
+        if (!log_data) {
+            Serial.printf("[REPLAY] No memory for a %u KB log, not recording\n", (unsigned)(log_size / 1024));
+            return;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+        header.rom_checksum = ReadMacInt32(ROMBaseMac);
+        header.ram_size = RAMSize;
+        header.batch = REPLAY_BATCH;
+        header.dispatch = REPLAY_DISPATCH;
+        memcpy(header.xpram, XPRAM, XPRAM_SIZE);
+
+        // Flags raised before the CPU starts are its first input
+        replay_pending = __atomic_exchange_n(&InterruptFlags, 0, __ATOMIC_ACQ_REL);
+        exec_batch_size = REPLAY_BATCH;
+        replay_next = ~(uint64)0;
+        replay_mode = REPLAY_RECORD;
+        Serial.printf("[REPLAY] Recording to %s (%u KB log, Ctrl+Scroll Lock ends it)\n", log_path,
+                      (unsigned)(log_size / 1024));
+        return;
+    }
+
+    if (!load_log()) {
+        return;
+    }
+    if (header.dispatch != REPLAY_DISPATCH) {
+        Serial.println("[REPLAY] WARNING: recorded with another dispatch loop, the batches will end elsewhere");
+    }
+    memcpy(XPRAM, header.xpram, XPRAM_SIZE);
+    __atomic_store_n(&InterruptFlags, 0, __ATOMIC_RELEASE);
+    exec_batch_size = header.batch;
+    irqs_played = inputs_played = 0;
+    finished = false;
+    replay_mode = REPLAY_PLAY;
+    find_next_irq();
+    Serial.printf("[REPLAY] Replaying %s: %llu instructions, %u inputs\n", log_path,
+                  (unsigned long long)header.end_insns, (unsigned)header.events);
+    start_us = now_us();
+}
+
+void ReplayRequestStop(void)
+{
+    stop_requested = true;
+}
+
+void ReplayPoll(void)
+{
+    if (stop_requested) {
+        stop_requested = false;
+        if (replay_mode == REPLAY_RECORD) {
+            record_stop("requested");
+        }
+    }
+    if (save_pending) {
+        save_log();
+    }
+}
+
+void ReplayFinish(void)
+{
+    if (replay_mode == REPLAY_RECORD) {
+        record_stop("CPU stopped");
+    }
+    if (save_pending) {
+        save_log();
+    }
+}
+
+bool ReplayFinished(void)
+{
+    return finished;
+}
+
+#endif // REPLAY
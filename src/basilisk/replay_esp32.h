@@ -0,0 +1,109 @@
+/*
+ *  replay_esp32.h - Record and replay of what the 68k gets from outside
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef REPLAY_ESP32_H
+#define REPLAY_ESP32_H
+
+#ifndef REPLAY
+#define REPLAY 0
+#endif
+
+#if REPLAY
+
+enum {
+    REPLAY_OFF,
+    REPLAY_RECORD,
+    REPLAY_PLAY
+};
+
+// Inputs read by the 68k thread (ReplayInput())
+enum {
+    REPLAY_IRQ,             // Interrupt flags delivered at a batch end
+    REPLAY_IRQ_STOP,        // ... to the CPU waiting in STOP
+    REPLAY_TIMER,           // timer_current_time()
+    REPLAY_MICROS,          // Microseconds()
+    REPLAY_DATE,            // TimerDateTime()
+    REPLAY_ADB,             // ADBInterrupt(): queued events | relative mouse << 8
+    REPLAY_ADB_EVENT,       // ... one of them: type << 40 | code << 32 | x << 16 | y
+    REPLAY_ADB_MOUSE,       // ... then the mouse: x << 16 | y (motion if relative)
+    REPLAY_ADB_KEYS,        // ADBOp() modifier register
+    REPLAY_IO_DONE,         // An asynchronous transfer was seen finished
+    REPLAY_KINDS
+};
+
+extern int replay_mode;
+extern uint64 replay_insns;         // Instructions at the last batch end
+extern uint64 replay_next;          // Play: batch end of the next recorded interrupt
+extern uint32 replay_pending;       // Record: interrupt flags not delivered yet
+
+/*
+ *  Start recording or replaying as the "replay" pref says ("record",
+ *  "play"), with the log in "replayfile"; right before the CPU starts, on
+ *  the thread that runs it
+ */
+extern void ReplayInit(void);
+
+// Write a recording out (Mac OS shut down, log full, Ctrl+Scroll Lock)
+extern void ReplayFinish(void);
+
+// Ask the 68k thread to end the recording (any task)
+extern void ReplayRequestStop(void);
+
+// 68k thread, between quanta: carries out ReplayRequestStop()
+extern void ReplayPoll(void);
+
+// A replay has run to its end or diverged
+extern bool ReplayFinished(void);
+
+// Deliver held interrupt flags (record) or the recorded ones (play)
+extern void ReplaySync(void);
+extern void ReplayStopped(void);
+
+/*
+ *  End of an instruction batch (m68k_do_execute(), any nesting level). The
+ *  batch sizes are fixed while recording or replaying, so with the same
+ *  inputs the batches end at the same instructions, which is where the
+ *  interrupt flags reach the 68k.
+ */
+static inline void ReplayBatchEnd(int32 executed)
+{
+    replay_insns += executed;
+    if (replay_insns >= replay_next || __atomic_load_n(&replay_pending, __ATOMIC_RELAXED)) {
+        ReplaySync();
+    }
+}
+
+// SetInterruptFlag(): true if the flag was held for ReplaySync() (record) or dropped (play)
+static inline bool ReplayHold(uint32 flag)
+{
+    int mode = __atomic_load_n(&replay_mode, __ATOMIC_ACQUIRE);
+    if (mode == REPLAY_OFF) {
+        return false;
+    }
+    if (mode == REPLAY_RECORD) {
+        __atomic_or_fetch(&replay_pending, flag, __ATOMIC_SEQ_CST);
+    }
+    // Gone live meanwhile: go_live() may have drained the held flags before
+    // this one was parked, so take it back and raise it live
+    if (__atomic_load_n(&replay_mode, __ATOMIC_SEQ_CST) == REPLAY_OFF) {
+        __atomic_and_fetch(&replay_pending, ~flag, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/*
+ *  A value the 68k thread got from outside: logged when recording, the
+ *  recorded one when replaying (other tasks and REPLAY_OFF get value)
+ */
+extern uint64 ReplayInput(int kind, uint64 value);
+
+// Asynchronous transfer finished? Replay waits for those that were
+extern bool ReplayIODone(volatile bool *done);
+
+#endif
+
+#endif /* REPLAY_ESP32_H */
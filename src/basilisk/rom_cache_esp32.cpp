@@ -0,0 +1,540 @@
+/*
+ *  rom_cache_esp32.cpp - Patched-ROM cache on the SD card or in flash
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  After PatchROM() has patched a ROM the long way, the patched image and
+ *  the offsets it recorded are written to <rom>.cache. On later boots,
+ *  LoadROM() reads that file instead of the ROM when it was made from
+ *  the same ROM (checksum and size) by the same firmware (ELF SHA-256),
+ *  and PatchROM() only restores the offsets. The ROM searches, the slot
+ *  ROM build and the slot ROM checksum are all skipped.
+ *
+ *  Some patches depend on the configuration (model ID, CPU/FPU, video
+ *  modes, memory layout). PatchROM() checks a fingerprint of these
+ *  before it accepts the cached image; if they differ, the original ROM
+ *  is read again, patched as usual, and the cache is replaced.
+ *
+ *  With ROM_FLASH_XIP the cache lives in the "macrom" flash partition
+ *  instead: a header sector, then the image at a 64 KB page boundary,
+ *  mapped read-only with esp_partition_mmap() so the CPU fetches ROM code
+ *  through the flash cache and the 1 MB PSRAM copy is freed. The few
+ *  run-time writes to the ROM (video mode switches update the slot ROM)
+ *  go through ROMWrite(), which rewrites the affected flash sector; the
+ *  slot ROM as patched is kept in the header sector and put back at boot.
+ */
+
+#include "sysdeps.h"
+
+#include <Arduino.h>
+#include "sd_esp32.h"
+#include "esp_app_desc.h"
+#if ROM_FLASH_XIP
+#include "esp_partition.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#endif
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "prefs.h"
+#include "video.h"
+#include "rom_patches.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#if ROM_PATCH_CACHE
+
+#define ROM_CACHE_MAGIC     0x42325243  // "B2RC"
+#define ROM_CACHE_VERSION   4
+#define ROM_CACHE_SUFFIX    ".cache"
+
+#ifndef ROM_XIP_BENCH
+#define ROM_XIP_BENCH 0
+#endif
+
+#if ROM_FLASH_XIP
+#define ROM_XIP_PARTITION   "macrom"
+#define ROM_XIP_IMAGE       0x10000     // Image offset in the partition, one MMU page
+#define ROM_XIP_SLOT_COPY   0x1000      // Offset of the slot ROM as patched
+#define ROM_XIP_SLOT_MAX    0x1000
+#define FLASH_SECTOR_SIZE   0x1000
+#endif
+
+struct rom_cache_header {
+    uint32 magic;
+    uint32 version;
+    uint32 rom_checksum;    // First long of the original ROM file, as read
+    uint32 rom_file_size;
+    uint8 build_id[32];     // SHA-256 of the firmware ELF
+    uint32 config;          // Fingerprint of the patch-relevant configuration
+    uint32 image_size;      // ROMSize
+    uint32 image_sum;       // Catches a truncated or damaged file
+    rom_patch_state state;
+};
+
+static char rom_file_path[256];
+static uint32 rom_file_checksum;
+static uint32 rom_file_length;
+static bool cache_loaded = false;
+static rom_cache_header loaded_header;
+
+#if ROM_FLASH_XIP
+static const esp_partition_t *xip_partition = NULL;
+static esp_partition_mmap_handle_t xip_handle;
+static bool xip_rom = false;        // ROMBaseHost points into the flash partition
+static bool xip_loaded = false;     // ... and came from there at boot
+#endif
+
+
+/*
+ *  Helpers
+ */
+
+static void cache_path(char *path, size_t size)
+{
+    snprintf(path, size, "%s" ROM_CACHE_SUFFIX, rom_file_path);
+}
+
+static void build_id(uint8 *id)
+{
+    const esp_app_desc_t *desc = esp_app_get_description();
+    memcpy(id, desc->app_elf_sha256, 32);
+}
+
+static uint32 image_sum(const uint8 *image, uint32 size)
+{
+    const uint32 *p = (const uint32 *)image;
+    uint32 sum = 0;
+    for (uint32 i = 0; i < size / 4; i++) {
+        sum = ((sum << 1) | (sum >> 31)) + p[i];
+    }
+    return sum;
+}
+
+static uint32 fnv_add(uint32 hash, uint32 value)
+{
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ (value & 0xff)) * 16777619;
+        value >>= 8;
+    }
+    return hash;
+}
+
+// Everything other than the ROM itself that changes the patched image
+static uint32 config_fingerprint(void)
+{
+    uint32 h = 2166136261u;
+    h = fnv_add(h, ROMBaseMac);
+    h = fnv_add(h, RAMBaseMac);
+    h = fnv_add(h, ROMSize);
+    h = fnv_add(h, ROMVersion);
+    h = fnv_add(h, CPUType);
+    h = fnv_add(h, FPUType);
+    h = fnv_add(h, PrefsFindInt32("modelid"));
+    h = fnv_add(h, ROMBreakpoint);
+    for (std::vector<monitor_desc *>::const_iterator m = VideoMonitors.begin(); m != VideoMonitors.end(); ++m) {
+        const video_mode &mode = (*m)->get_current_mode();
+        uint32 depths = 0;
+        for (int d = VDEPTH_1BIT; d <= VDEPTH_32BIT; d++) {
+            if ((*m)->has_depth((video_depth)d)) {
+                depths |= 1 << d;
+            }
+        }
+        h = fnv_add(h, (*m)->get_mac_frame_base());
+        h = fnv_add(h, depths);
+        h = fnv_add(h, mode.x);
+        h = fnv_add(h, mode.y);
+        h = fnv_add(h, mode.resolution_id);
+        h = fnv_add(h, mode.depth);
+        h = fnv_add(h, mode.bytes_per_row);
+    }
+    return h;
+}
+
+static void remember_rom(const char *rom_path, uint32 rom_checksum, uint32 rom_file_size)
+{
+    strncpy(rom_file_path, rom_path, sizeof(rom_file_path) - 1);
+    rom_file_path[sizeof(rom_file_path) - 1] = 0;
+    rom_file_checksum = rom_checksum;
+    rom_file_length = rom_file_size;
+}
+
+static bool header_matches(const rom_cache_header &h)
+{
+    uint8 id[32];
+    build_id(id);
+    return h.magic == ROM_CACHE_MAGIC && h.version == ROM_CACHE_VERSION &&
+           h.rom_checksum == rom_file_checksum && h.rom_file_size == rom_file_length &&
+           h.image_size == ROMSize && memcmp(h.build_id, id, sizeof(id)) == 0;
+}
+
+static void make_header(rom_cache_header &h, const rom_patch_state *state, uint32 sum_size)
+{
+    memset(&h, 0, sizeof(h));
+    h.magic = ROM_CACHE_MAGIC;
+    h.version = ROM_CACHE_VERSION;
+    h.rom_checksum = rom_file_checksum;
+    h.rom_file_size = rom_file_length;
+    build_id(h.build_id);
+    h.config = config_fingerprint();
+    h.image_size = ROMSize;
+    h.image_sum = image_sum(ROMBaseHost, sum_size);
+    h.state = *state;
+}
+
+// Read the original ROM file into ROMBaseHost again
+static bool reload_rom(void)
+{
+    File f = SDCardFS().open(rom_file_path, FILE_READ);
+    if (!f) {
+        memset(ROMBaseHost, 0, ROMSize);
+        return false;
+    }
+    memset(ROMBaseHost + rom_file_length, 0, ROMSize - rom_file_length);
+    size_t n = f.read(ROMBaseHost, rom_file_length);
+    f.close();
+    if (n != rom_file_length) {
+        memset(ROMBaseHost, 0, ROMSize);    // PatchROM() then fails cleanly
+        return false;
+    }
+    return true;
+}
+
+
+#if ROM_FLASH_XIP
+/*
+ *  Flash partition
+ */
+
+static bool find_partition(void)
+{
+    xip_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                             ROM_XIP_PARTITION);
+    if (!xip_partition) {
+        Serial.println("[ROMXIP] No \"" ROM_XIP_PARTITION "\" partition, ROM stays in PSRAM");
+        return false;
+    }
+    if (xip_partition->size < ROM_XIP_IMAGE + ROMSize) {
+        Serial.printf("[ROMXIP] Partition too small for a %u KB ROM, ROM stays in PSRAM\n",
+                      (unsigned)(ROMSize / 1024));
+        xip_partition = NULL;
+        return false;
+    }
+    return true;
+}
+
+static bool map_flash_rom(void)
+{
+    const void *p = NULL;
+    if (esp_partition_mmap(xip_partition, ROM_XIP_IMAGE, ROMSize, ESP_PARTITION_MMAP_DATA,
+                           &p, &xip_handle) != ESP_OK) {
+        Serial.println("[ROMXIP] WARNING: can't map the partition");
+        return false;
+    }
+    ROMBaseHost = (uint8 *)p;
+    xip_rom = true;
+    return true;
+}
+
+// Give up the mapping for an empty PSRAM buffer (the caller fills it)
+static bool unmap_flash_rom(void)
+{
+    uint8 *buf = (uint8 *)ps_malloc(ROMSize);
+    if (!buf) {
+        Serial.println("[ROMXIP] ERROR: can't allocate ROM buffer in PSRAM");
+        return false;
+    }
+    esp_partition_munmap(xip_handle);
+    ROMBaseHost = buf;
+    xip_rom = false;
+    xip_loaded = false;
+    memory_init();
+    return true;
+}
+
+// Mode switches rewrite the slot ROM; start each boot from the stored one
+static void restore_slot_rom(void)
+{
+    uint32 size = loaded_header.state.slot_rom_size;
+    uint32 offset = ROMSize - size;
+    uint8 *slot = (uint8 *)malloc(size);
+    if (!slot) {
+        return;
+    }
+    if (esp_partition_read(xip_partition, ROM_XIP_SLOT_COPY, slot, size) == ESP_OK) {
+        ROMWrite(offset, slot, size);
+    }
+    free(slot);
+}
+
+#if ROM_XIP_BENCH
+// Sequential 32-bit and random 16-bit reads, flash mapping against a PSRAM copy
+static void rom_xip_bench(void)
+{
+    uint8 *copy = (uint8 *)ps_malloc(ROMSize);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, ROMBaseHost, ROMSize);
+    const uint8 *images[2] = {ROMBaseHost, copy};
+    const char *names[2] = {"flash", "PSRAM"};
+    for (int k = 0; k < 2; k++) {
+        const uint32 *l = (const uint32 *)images[k];
+        const uint16 *w = (const uint16 *)images[k];
+        volatile uint32 sum = 0;
+        uint32 t0 = esp_timer_get_time();
+        for (int pass = 0; pass < 4; pass++) {
+            for (uint32 i = 0; i < ROMSize / 4; i++) {
+                sum += l[i];
+            }
+        }
+        uint32 t1 = esp_timer_get_time();
+        uint32 x = 1;
+        for (int i = 0; i < 1000000; i++) {
+            x = x * 1664525 + 1013904223;
+            sum += w[(x >> 8) % (ROMSize / 2)];
+        }
+        uint32 t2 = esp_timer_get_time();
+        Serial.printf("[ROMXIP] bench %s: sequential %u KB/ms, 1M random reads %u us\n",
+                      names[k], (unsigned)(4 * ROMSize / 1024 / ((t1 - t0) / 1000 + 1)),
+                      (unsigned)(t2 - t1));
+    }
+    free(copy);
+}
+#endif
+
+
+/*
+ *  Map a patched image stored by an earlier boot (LoadROM(), instead of allocating one)
+ */
+
+bool ROMFlashLoad(const char *rom_path, uint32 rom_checksum, uint32 rom_file_size)
+{
+    remember_rom(rom_path, rom_checksum, rom_file_size);
+    cache_loaded = false;
+    xip_loaded = false;
+    if (!find_partition()) {
+        return false;
+    }
+
+    rom_cache_header &h = loaded_header;
+    if (esp_partition_read(xip_partition, 0, &h, sizeof(h)) != ESP_OK || !header_matches(h) ||
+        h.state.slot_rom_size > ROM_XIP_SLOT_MAX) {
+        return false;
+    }
+    if (!map_flash_rom()) {
+        return false;
+    }
+    if (image_sum(ROMBaseHost, ROMSize - h.state.slot_rom_size) != h.image_sum) {
+        Serial.println("[ROMXIP] WARNING: image in flash damaged, patching anew");
+        esp_partition_munmap(xip_handle);
+        ROMBaseHost = NULL;
+        xip_rom = false;
+        return false;
+    }
+    cache_loaded = true;
+    xip_loaded = true;
+#if ROM_XIP_BENCH
+    rom_xip_bench();
+#endif
+    return true;
+}
+
+
+/*
+ *  After PatchROM(): move the image to flash and run it from there
+ */
+
+void ROMFlashStore(const rom_patch_state *state)
+{
+    if (xip_rom || !xip_partition || rom_file_path[0] == 0) {
+        return;
+    }
+    uint32 slot_size = state->slot_rom_size;
+    if (slot_size > ROM_XIP_SLOT_MAX) {
+        Serial.printf("[ROMXIP] Slot ROM too large (%u bytes), ROM stays in PSRAM\n", (unsigned)slot_size);
+        return;
+    }
+
+    rom_cache_header h;
+    make_header(h, state, ROMSize - slot_size);
+    uint32 start = millis();
+
+    // Header last, so an interrupted store never matches on the next boot
+    bool ok = esp_partition_erase_range(xip_partition, 0, ROM_XIP_IMAGE + ROMSize) == ESP_OK &&
+              esp_partition_write(xip_partition, ROM_XIP_IMAGE, ROMBaseHost, ROMSize) == ESP_OK &&
+              esp_partition_write(xip_partition, ROM_XIP_SLOT_COPY, ROMBaseHost + ROMSize - slot_size,
+                                  slot_size) == ESP_OK &&
+              esp_partition_write(xip_partition, 0, &h, sizeof(h)) == ESP_OK;
+    if (!ok) {
+        Serial.println("[ROMXIP] WARNING: can't write the partition, ROM stays in PSRAM");
+        return;
+    }
+
+    uint8 *copy = ROMBaseHost;
+    if (!map_flash_rom()) {
+        return;
+    }
+    if (memcmp(ROMBaseHost, copy, ROMSize) != 0) {
+        Serial.println("[ROMXIP] WARNING: flash readback differs, ROM stays in PSRAM");
+        esp_partition_munmap(xip_handle);
+        ROMBaseHost = copy;
+        xip_rom = false;
+        return;
+    }
+    free(copy);
+    memory_init();
+    Serial.printf("[ROMXIP] Patched ROM moved to flash (%u ms), %u KB PSRAM freed\n",
+                  (unsigned)(millis() - start), (unsigned)(ROMSize / 1024));
+#if ROM_XIP_BENCH
+    rom_xip_bench();
+#endif
+}
+
+
+/*
+ *  Run-time write into the ROM image (slot ROM updates after a mode switch)
+ */
+
+void ROMWrite(uint32 offset, const void *data, uint32 size)
+{
+    if (!xip_rom) {
+        memcpy(ROMBaseHost + offset, data, size);
+        return;
+    }
+    if (memcmp(ROMBaseHost + offset, data, size) == 0) {
+        return;
+    }
+
+    // Read-modify-write whole sectors through internal RAM
+    uint8 *sector = (uint8 *)heap_caps_malloc(FLASH_SECTOR_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!sector) {
+        Serial.println("[ROMXIP] ERROR: no memory for a sector rewrite");
+        return;
+    }
+    const uint8 *src = (const uint8 *)data;
+    while (size > 0) {
+        uint32 base = offset & ~(FLASH_SECTOR_SIZE - 1);
+        uint32 n = base + FLASH_SECTOR_SIZE - offset;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(sector, ROMBaseHost + base, FLASH_SECTOR_SIZE);
+        memcpy(sector + (offset - base), src, n);
+        if (esp_partition_erase_range(xip_partition, ROM_XIP_IMAGE + base, FLASH_SECTOR_SIZE) != ESP_OK ||
+            esp_partition_write(xip_partition, ROM_XIP_IMAGE + base, sector, FLASH_SECTOR_SIZE) != ESP_OK) {
+            Serial.printf("[ROMXIP] ERROR: can't rewrite ROM sector at %08x\n", (unsigned)base);
+            break;
+        }
+        offset += n;
+        src += n;
+        size -= n;
+    }
+    free(sector);
+}
+#endif
+
+
+/*
+ *  Load a cached image into ROMBaseHost (ROMSize bytes, allocated by the caller)
+ */
+
+bool ROMCacheLoad(const char *rom_path, uint32 rom_checksum, uint32 rom_file_size)
+{
+    remember_rom(rom_path, rom_checksum, rom_file_size);
+    cache_loaded = false;
+
+    char path[sizeof(rom_file_path) + 8];
+    cache_path(path, sizeof(path));
+    File f = SDCardFS().open(path, FILE_READ);
+    if (!f) {
+        return false;
+    }
+
+    rom_cache_header &h = loaded_header;
+    bool ok = f.read((uint8 *)&h, sizeof(h)) == sizeof(h) && header_matches(h);
+    if (!ok) {
+        f.close();
+        Serial.println("[ROMCACHE] Cache is for another ROM or firmware, patching anew");
+        return false;
+    }
+    ok = f.read(ROMBaseHost, ROMSize) == ROMSize && image_sum(ROMBaseHost, ROMSize) == h.image_sum;
+    f.close();
+    if (!ok) {
+        Serial.println("[ROMCACHE] WARNING: cache damaged, patching anew");
+        return false;
+    }
+    cache_loaded = true;
+    return true;
+}
+
+
+/*
+ *  In PatchROM(): true and the recorded state if the loaded image can be used
+ */
+
+bool ROMCacheRestore(rom_patch_state *state)
+{
+    if (!cache_loaded) {
+        return false;
+    }
+    cache_loaded = false;
+    if (loaded_header.config != config_fingerprint()) {
+        Serial.println("[ROMCACHE] Configuration changed, patching anew");
+#if ROM_FLASH_XIP
+        if (xip_rom && !unmap_flash_rom()) {
+            return false;
+        }
+#endif
+        if (!reload_rom()) {
+            Serial.printf("[ROMCACHE] ERROR: can't read %s again\n", rom_file_path);
+        }
+        return false;
+    }
+    *state = loaded_header.state;
+#if ROM_FLASH_XIP
+    if (xip_loaded) {
+        restore_slot_rom();
+        Serial.println("[ROMCACHE] Using the patched ROM in flash");
+        return true;
+    }
+#endif
+    Serial.println("[ROMCACHE] Using the patched ROM from the cache");
+    return true;
+}
+
+
+/*
+ *  After patching: store the image and state for the next boot
+ */
+
+void ROMCacheSave(const rom_patch_state *state)
+{
+    if (rom_file_path[0] == 0) {
+        return;
+    }
+    rom_cache_header h;
+    make_header(h, state, ROMSize);
+
+    char path[sizeof(rom_file_path) + 8];
+    cache_path(path, sizeof(path));
+    uint32 start = millis();
+    File f = SDCardFS().open(path, FILE_WRITE);
+    if (!f) {
+        Serial.printf("[ROMCACHE] WARNING: can't create %s\n", path);
+        return;
+    }
+    bool ok = f.write((const uint8 *)&h, sizeof(h)) == sizeof(h) &&
+              f.write(ROMBaseHost, ROMSize) == ROMSize;
+    f.close();
+    if (!ok) {
+        SDCardFS().remove(path);
+        Serial.printf("[ROMCACHE] WARNING: can't write %s\n", path);
+        return;
+    }
+    Serial.printf("[ROMCACHE] Patched ROM saved to %s (%u ms)\n", path, (unsigned)(millis() - start));
+}
+
+#endif
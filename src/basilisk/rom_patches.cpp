@@ -32,6 +32,8 @@
 #include "video.h"
 #include "extfs.h"
 #include "prefs.h"
+#include "audio.h"
+#include "qd_accel_esp32.h"
 
 #if ENABLE_MON
 #include "mon.h"
@@ -47,6 +49,7 @@
 uint32 UniversalInfo;		// ROM offset of UniversalInfo
 uint32 PutScrapPatch = 0;	// Mac address of PutScrap() patch
 uint32 GetScrapPatch = 0;	// Mac address of GetScrap() patch
+uint32 ExecReturnAddr = 0;	// Mac address of the Execute68k() return word (0 = none)
 uint32 ROMBreakpoint = 0;	// ROM offset of breakpoint (0 = disabled, 0x2310 = CritError)
 bool PrintROMInfo = false;	// Flag: print ROM information in PatchROM()
 bool PatchHWBases = true;	// Flag: patch hardware base addresses
@@ -55,6 +58,35 @@ static uint32 sony_offset;		// ROM offset of .Sony driver
 static uint32 serd_offset;		// ROM offset of SERD resource (serial drivers)
 static uint32 microseconds_offset;	// ROM offset of Microseconds() replacement routine
 static uint32 debugutil_offset;		// ROM offset of DebugUtil() replacement routine
+#if VIDEO_CURSOR_OVERLAY
+static uint32 cursor_offset = 0;	// ROM offset of cursor vector replacements (0 = not installed)
+
+// Low-memory cursor vectors replaced, indexed by CURSOR_OP_* selector
+static const uint32 cursor_vectors[CURSOR_OP_COUNT] = {
+	0x800,	// JHideCursor
+	0x804,	// JShowCursor
+	0x808,	// JShieldCursor
+	0x81c,	// JCrsrObscure
+	0x818,	// JSetCrsr
+	0x890,	// JSetCCrsr
+	0x814,	// JInitCrsr
+	0x8ee	// JCrsrTask
+};
+#endif
+#if AUDIO_NATIVE_SOUNDS
+static uint32 sysbeep_offset = 0;	// ROM offset of SysBeep() replacement (0 = not installed)
+#endif
+#if NATIVE_BLOCK_MOVE
+static uint32 block_move_offset = 0;	// ROM offset of BlockMove() replacement (0 = not installed)
+#endif
+#if QD_ACCEL
+static uint32 qd_accel_offset = 0;	// ROM offset of QuickDraw replacements (0 = not installed)
+
+// Traps replaced and their argument bytes, indexed by QD_ACCEL_* selector
+static const uint16 qd_accel_traps[QD_ACCEL_COUNT] = {0xa8ec, 0xa8a5, 0xa8a3};	// CopyBits, FillRect, EraseRect
+static const uint16 qd_accel_args[QD_ACCEL_COUNT] = {22, 8, 4};
+#define QD_ACCEL_STUB_SIZE 0x20
+#endif
 
 // Prototypes
 uint16 ROMVersion;
@@ -154,6 +186,11 @@ again:
 	goto again;
 }
 
+uint32 FindROMTrap(uint16 trap)
+{
+	return find_rom_trap(trap);
+}
+
 
 /*
  *  Print ROM information to stream,
@@ -821,6 +858,75 @@ void PatchAfterStartup(void)
 	// Install external file system
 	InstallExtFS();
 #endif
+
+#if VIDEO_CURSOR_OVERLAY
+	// Take over the cursor vectors; QuickDraw's cursor is erased first
+	// (HideCursor restores the pixels under it) and its level restored after
+	if (cursor_offset) {
+		M68kRegisters r;
+		Execute68k(ReadMacInt32(cursor_vectors[CURSOR_OP_HIDE]), &r);
+		for (int i = 0; i < CURSOR_OP_COUNT; i++)
+			WriteMacInt32(cursor_vectors[i], ROMBaseMac + cursor_offset + i * 8);
+		WriteMacInt16(0x8d0, ReadMacInt16(0x8d0) + 1);	// CrsrState
+		VideoCursorInit();
+	}
+#endif
+
+#if AUDIO_NATIVE_SOUNDS
+	// Put the SysBeep() replacement in front of whatever the System
+	// installed, and chain to that when the platform can't beep
+	if (sysbeep_offset && PrefsFindBool("nativebeep")) {
+		M68kRegisters r;
+		r.d[0] = 0xa9c8;
+		Execute68kTrap(0xa746, &r);		// GetToolTrapAddress()
+		uint16 *wp = (uint16 *)(ROMBaseHost + sysbeep_offset + 14);
+		*wp++ = htons(r.a[0] >> 16);
+		*wp = htons(r.a[0] & 0xffff);
+		r.d[0] = 0xa9c8;
+		r.a[0] = ROMBaseMac + sysbeep_offset;
+		Execute68kTrap(0xa647, &r);		// SetToolTrapAddress()
+	}
+#endif
+
+#if NATIVE_BLOCK_MOVE
+	// Go in front of the System's BlockMove() (which gpch 750 may have
+	// patched), and chain to it for the moves that aren't done natively
+	if (block_move_offset) {
+		M68kRegisters r;
+		r.d[0] = 0xa02e;
+		Execute68kTrap(0xa346, &r);		// GetOSTrapAddress()
+		uint8 previous[4] = {uint8(r.a[0] >> 24), uint8(r.a[0] >> 16), uint8(r.a[0] >> 8), uint8(r.a[0])};
+#if ROM_FLASH_XIP
+		ROMWrite(block_move_offset + 10, previous, 4);
+#else
+		memcpy(ROMBaseHost + block_move_offset + 10, previous, 4);
+#endif
+		r.d[0] = 0xa02e;
+		r.a[0] = ROMBaseMac + block_move_offset;
+		Execute68kTrap(0xa247, &r);		// SetOSTrapAddress()
+	}
+#endif
+
+#if QD_ACCEL
+	// Same for the QuickDraw calls, each chaining to its previous version
+	if (qd_accel_offset && PrefsFindBool("gfxaccel")) {
+		M68kRegisters r;
+		for (int i = 0; i < QD_ACCEL_COUNT; i++) {
+			uint32 stub = qd_accel_offset + i * QD_ACCEL_STUB_SIZE;
+			r.d[0] = qd_accel_traps[i];
+			Execute68kTrap(0xa746, &r);		// GetToolTrapAddress()
+			uint8 previous[4] = {uint8(r.a[0] >> 24), uint8(r.a[0] >> 16), uint8(r.a[0] >> 8), uint8(r.a[0])};
+#if ROM_FLASH_XIP
+			ROMWrite(stub + 18, previous, 4);
+#else
+			memcpy(ROMBaseHost + stub + 18, previous, 4);
+#endif
+			r.d[0] = qd_accel_traps[i];
+			r.a[0] = ROMBaseMac + stub;
+			Execute68kTrap(0xa647, &r);		// SetToolTrapAddress()
+		}
+	}
+#endif
 }
 
 
@@ -1638,6 +1744,75 @@ static bool patch_rom_32(void)
 	*wp++ = htons(base >> 16);
 	*wp = htons(base & 0xffff);
 
+#if VIDEO_CURSOR_OVERLAY
+	// Cursor vector replacements (installed by PatchAfterStartup())
+	cursor_offset = sony_offset + 0xe00;
+	wp = (uint16 *)(ROMBaseHost + cursor_offset);
+	for (int i = 0; i < CURSOR_OP_COUNT; i++) {
+		*wp++ = htons(0x3f3c);		// move.w	#selector,-(sp)
+		*wp++ = htons(i);
+		*wp++ = htons(M68K_EMUL_OP_CURSOR);
+		*wp++ = htons(M68K_RTS);
+	}
+#endif
+
+#if AUDIO_NATIVE_SOUNDS
+	// SysBeep() replacement (installed by PatchAfterStartup(), which also
+	// fills in the address of the previous SysBeep())
+	sysbeep_offset = sony_offset + 0xf00;
+	wp = (uint16 *)(ROMBaseHost + sysbeep_offset);
+	*wp++ = htons(M68K_EMUL_OP_SYSBEEP);
+	*wp++ = htons(0x4a80);		// tst.l	d0
+	*wp++ = htons(0x6706);		// beq.s	1f
+	*wp++ = htons(0x205f);		// move.l	(sp)+,a0
+	*wp++ = htons(0x548f);		// addq.l	#2,sp (duration)
+	*wp++ = htons(0x4ed0);		// jmp		(a0)
+	*wp++ = htons(M68K_JMP);	// 1: jmp	previous SysBeep()
+	*wp++ = 0;
+	*wp = 0;
+#endif
+
+#if NATIVE_BLOCK_MOVE
+	// BlockMove()/BlockMoveData() replacement (installed by PatchAfterStartup(),
+	// which also fills in the address of the previous BlockMove()); the trap
+	// dispatcher saves d1/d2, so d2 says whether the move was done
+	block_move_offset = sony_offset + 0x1000;
+	wp = (uint16 *)(ROMBaseHost + block_move_offset);
+	*wp++ = htons(M68K_EMUL_OP_NATIVE_BLOCK_MOVE);
+	*wp++ = htons(0x4a82);		// tst.l	d2
+	*wp++ = htons(0x6602);		// bne.s	1f
+	*wp++ = htons(M68K_RTS);
+	*wp++ = htons(M68K_JMP);	// 1: jmp	previous BlockMove()
+	*wp++ = 0;
+	*wp = 0;
+#endif
+
+#if QD_ACCEL
+	// CopyBits()/FillRect()/EraseRect() replacements (installed by
+	// PatchAfterStartup(), which also fills in the previous versions)
+	qd_accel_offset = sony_offset + 0x1100;
+	for (int i = 0; i < QD_ACCEL_COUNT; i++) {
+		wp = (uint16 *)(ROMBaseHost + qd_accel_offset + i * QD_ACCEL_STUB_SIZE);
+		*wp++ = htons(0x7000 + i);	// moveq	#selector,d0
+		*wp++ = htons(M68K_EMUL_OP_QD_ACCEL);
+		*wp++ = htons(0x4a80);		// tst.l	d0
+		*wp++ = htons(0x6708);		// beq.s	1f
+		*wp++ = htons(0x205f);		// move.l	(sp)+,a0
+		*wp++ = htons(0x4fef);		// lea		args(sp),sp
+		*wp++ = htons(qd_accel_args[i]);
+		*wp++ = htons(0x4ed0);		// jmp		(a0)
+		*wp++ = htons(M68K_JMP);	// 1: jmp	previous version
+		*wp++ = 0;
+		*wp = 0;
+	}
+#endif
+
+	// Execute68k() pushes this as the routine's return address, so its
+	// rts lands on M68K_EXEC_RETURN without an opcode on the Mac stack
+	ExecReturnAddr = ROMBaseMac + sony_offset + 0x1200;
+	wp = (uint16 *)(ROMBaseHost + sony_offset + 0x1200);
+	*wp = htons(M68K_EXEC_RETURN);
+
 	// Look for double PACK 4 resources
 	if ((base = find_rom_resource(FOURCC('P','A','C','K'), 4)) == 0) return false;
 	if ((base = find_rom_resource(FOURCC('P','A','C','K'), 4, true)) == 0 && FPUType == 0)
@@ -1660,8 +1835,82 @@ static bool patch_rom_32(void)
 	return true;
 }
 
+#if ROM_PATCH_CACHE
+static void get_patch_state(rom_patch_state *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->universal_info = UniversalInfo;
+	state->put_scrap_patch = PutScrapPatch;
+	state->get_scrap_patch = GetScrapPatch;
+	state->exec_return_addr = ExecReturnAddr;
+	state->sony_offset = sony_offset;
+	state->serd_offset = serd_offset;
+	state->microseconds_offset = microseconds_offset;
+	state->debugutil_offset = debugutil_offset;
+#if VIDEO_CURSOR_OVERLAY
+	state->cursor_offset = cursor_offset;
+#endif
+#if AUDIO_NATIVE_SOUNDS
+	state->sysbeep_offset = sysbeep_offset;
+#endif
+#if NATIVE_BLOCK_MOVE
+	state->block_move_offset = block_move_offset;
+#endif
+#if QD_ACCEL
+	state->qd_accel_offset = qd_accel_offset;
+#endif
+	state->sony_disk_icon = SonyDiskIconAddr;
+	state->sony_drive_icon = SonyDriveIconAddr;
+	state->disk_icon = DiskIconAddr;
+	state->cdrom_icon = CDROMIconAddr;
+	state->slot_rom_size = GetSlotROMSize();
+}
+
+static void set_patch_state(const rom_patch_state *state)
+{
+	UniversalInfo = state->universal_info;
+	PutScrapPatch = state->put_scrap_patch;
+	GetScrapPatch = state->get_scrap_patch;
+	ExecReturnAddr = state->exec_return_addr;
+	sony_offset = state->sony_offset;
+	serd_offset = state->serd_offset;
+	microseconds_offset = state->microseconds_offset;
+	debugutil_offset = state->debugutil_offset;
+#if VIDEO_CURSOR_OVERLAY
+	cursor_offset = state->cursor_offset;
+#endif
+#if AUDIO_NATIVE_SOUNDS
+	sysbeep_offset = state->sysbeep_offset;
+#endif
+#if NATIVE_BLOCK_MOVE
+	block_move_offset = state->block_move_offset;
+#endif
+#if QD_ACCEL
+	qd_accel_offset = state->qd_accel_offset;
+#endif
+	SonyDiskIconAddr = state->sony_disk_icon;
+	SonyDriveIconAddr = state->sony_drive_icon;
+	DiskIconAddr = state->disk_icon;
+	CDROMIconAddr = state->cdrom_icon;
+	SetSlotROMSize(state->slot_rom_size);
+}
+#endif
+
 bool PatchROM(void)
 {
+#if ROM_PATCH_CACHE
+	// Already patched on an earlier boot (loaded by LoadROM())
+	rom_patch_state state;
+	if (ROMCacheRestore(&state)) {
+		set_patch_state(&state);
+#if ROM_FLASH_XIP
+		ROMFlashStore(&state);
+#endif
+		FlushCodeCache(ROMBaseHost, ROMSize);
+		return true;
+	}
+#endif
+
 	// Print some information about the ROM
 	if (PrintROMInfo)
 		print_rom_info();
@@ -1692,6 +1941,14 @@ bool PatchROM(void)
 #endif
 	}
 
+#if ROM_PATCH_CACHE
+	get_patch_state(&state);
+	ROMCacheSave(&state);
+#if ROM_FLASH_XIP
+	ROMFlashStore(&state);
+#endif
+#endif
+
 	// Clear caches as we loaded and patched code
 	FlushCodeCache(ROMBaseHost, ROMSize);
 	return true;
@@ -44,15 +44,87 @@
 
 static uint32 find_rsrc_data(const uint8 *rsrc, uint32 max, const uint8 *search, uint32 search_len, uint32 ofs = 0)
 {
-	while (ofs < max - search_len) {
-		if (!memcmp(rsrc + ofs, search, search_len))
-			return ofs;
-		ofs++;
+	if (max <= search_len)
+		return 0;
+	const uint8 *end = rsrc + max - search_len;		// First offset not searched
+	const uint8 *q = rsrc + ofs;
+	while (q < end) {
+		// Only compare where the first byte matches
+		q = (const uint8 *)memchr(q, search[0], end - q);
+		if (q == NULL)
+			break;
+		if (!memcmp(q, search, search_len))
+			return q - rsrc;
+		q++;
 	}
 	return 0;
 }
 
 
+/*
+ *  Scans of whole resources are remembered by the checksum of the data
+ *  as loaded, so a resource that is purged and loaded again is patched
+ *  without scanning it for every signature once more. Offsets found are
+ *  compared again before they're used.
+ */
+
+struct rsrc_scan {
+	const uint8 *search;		// Signature, NULL if free
+	uint32 size;
+	uint32 sum;
+	uint32 ofs;					// 0 if not found
+};
+
+#define RSRC_SCAN_SLOTS 16
+
+static rsrc_scan rsrc_scans[RSRC_SCAN_SLOTS];
+static int rsrc_scan_next = 0;
+static uint32 rsrc_sum;			// Of the resource CheckLoad() is patching,
+static bool rsrc_sum_valid;		// taken before its first scan
+
+static uint32 rsrc_checksum(const uint8 *p, uint32 size)
+{
+	uint32 sum = size;
+	uint32 i = 0;
+	for (; i + 4 <= size; i += 4) {
+		uint32 w;
+		memcpy(&w, p + i, 4);
+		sum = ((sum << 5) | (sum >> 27)) ^ w;
+	}
+	for (; i < size; i++)
+		sum = ((sum << 5) | (sum >> 27)) ^ p[i];
+	return sum;
+}
+
+static uint32 find_rsrc_sig(const uint8 *p, uint32 size, const uint8 *search, uint32 search_len)
+{
+	if (!rsrc_sum_valid) {
+		rsrc_sum = rsrc_checksum(p, size);
+		rsrc_sum_valid = true;
+	}
+
+	for (int i = 0; i < RSRC_SCAN_SLOTS; i++) {
+		const rsrc_scan *s = &rsrc_scans[i];
+		if (s->search == search && s->size == size && s->sum == rsrc_sum) {
+			if (s->ofs == 0)
+				return 0;
+			if (!memcmp(p + s->ofs, search, search_len))
+				return s->ofs;
+			break;
+		}
+	}
+
+	uint32 ofs = find_rsrc_data(p, size, search, search_len);
+	rsrc_scan *s = &rsrc_scans[rsrc_scan_next];
+	rsrc_scan_next = (rsrc_scan_next + 1) % RSRC_SCAN_SLOTS;
+	s->search = search;
+	s->size = size;
+	s->sum = rsrc_sum;
+	s->ofs = ofs;
+	return ofs;
+}
+
+
 /*
  *  Install SynchIdleTime() patch
  */
@@ -63,7 +135,7 @@ static void patch_idle_time(uint8 *p, uint32 size, int n = 1)
 		return;
 
 	static const uint8 dat[] = {0x70, 0x03, 0xa0, 0x9f};
-	uint32 base = find_rsrc_data(p, size, dat, sizeof(dat));
+	uint32 base = find_rsrc_sig(p, size, dat, sizeof(dat));
 	if (base) {
 		uint8 *pbase = p + base - 0x80;
 		static const uint8 dat2[] = {0x20, 0x78, 0x02, 0xb6, 0x41, 0xe8, 0x00, 0x80};
@@ -80,280 +152,481 @@ static void patch_idle_time(uint8 *p, uint32 size, int n = 1)
 
 
 /*
- *  Resource patches via vCheckLoad
+ *  boot 3
  */
 
-void CheckLoad(uint32 type, int16 id, uint8 *p, uint32 size)
+static void patch_boot_3(uint8 *p, uint32 size)
 {
 	uint16 *p16;
 	uint32 base;
-	D(bug("vCheckLoad %c%c%c%c (%08x) ID %d, data %p, size %d\n", (char)(type >> 24), (char)((type >> 16) & 0xff), (char )((type >> 8) & 0xff), (char )(type & 0xff), type, id, p, size));
-	
-	if (type == FOURCC('b','o','o','t') && id == 3) {
-		D(bug(" boot 3 found\n"));
 
-		// Set boot stack pointer (7.5, 7.6, 7.6.1, 8.0)
-		static const uint8 dat[] = {0x22, 0x00, 0xe4, 0x89, 0x90, 0x81, 0x22, 0x40};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 6);
-			*p16 = htons(M68K_EMUL_OP_FIX_BOOTSTACK);
-			FlushCodeCache(p + base + 6, 2);
-			D(bug("  patch 1 applied\n"));
-		}
+	D(bug(" boot 3 found\n"));
+
+	// Set boot stack pointer (7.5, 7.6, 7.6.1, 8.0)
+	static const uint8 dat[] = {0x22, 0x00, 0xe4, 0x89, 0x90, 0x81, 0x22, 0x40};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 6);
+		*p16 = htons(M68K_EMUL_OP_FIX_BOOTSTACK);
+		FlushCodeCache(p + base + 6, 2);
+		D(bug("  patch 1 applied\n"));
+	}
 
 #if !ROM_IS_WRITE_PROTECTED
-		// Set fake handle at 0x0000 to some safe place (so broken Mac programs won't write into Mac ROM) (7.1, 7.5, 8.0)
-		static const uint8 dat2[] = {0x20, 0x78, 0x02, 0xae, 0xd1, 0xfc, 0x00, 0x01, 0x00, 0x00, 0x21, 0xc8, 0x00, 0x00};
-		base = find_rsrc_data(p, size, dat2, sizeof(dat2));
-		if (base) {
-			p16 = (uint16 *)(p + base);
+	// Set fake handle at 0x0000 to some safe place (so broken Mac programs won't write into Mac ROM) (7.1, 7.5, 8.0)
+	static const uint8 dat2[] = {0x20, 0x78, 0x02, 0xae, 0xd1, 0xfc, 0x00, 0x01, 0x00, 0x00, 0x21, 0xc8, 0x00, 0x00};
+	base = find_rsrc_sig(p, size, dat2, sizeof(dat2));
+	if (base) {
+		p16 = (uint16 *)(p + base);
 
 #if defined(USE_SCRATCHMEM_SUBTERFUGE)
-			// Set 0x0000 to scratch memory area
-			extern uint8 *ScratchMem;
-			const uint32 ScratchMemBase = Host2MacAddr(ScratchMem);
-			*p16++ = htons(0x207c);			// move.l	#ScratchMem,a0
-			*p16++ = htons(ScratchMemBase >> 16);
-			*p16++ = htons(ScratchMemBase);
-			*p16++ = htons(M68K_NOP);
-			*p16 = htons(M68K_NOP);
+		// Set 0x0000 to scratch memory area
+		extern uint8 *ScratchMem;
+		const uint32 ScratchMemBase = Host2MacAddr(ScratchMem);
+		*p16++ = htons(0x207c);			// move.l	#ScratchMem,a0
+		*p16++ = htons(ScratchMemBase >> 16);
+		*p16++ = htons(ScratchMemBase);
+		*p16++ = htons(M68K_NOP);
+		*p16 = htons(M68K_NOP);
 #else
 #error System specific handling for writable ROM is required here
 #endif
-			FlushCodeCache(p + base, 14);
-			D(bug("  patch 2 applied\n"));
-		}
+		FlushCodeCache(p + base, 14);
+		D(bug("  patch 2 applied\n"));
+	}
+#endif
+}
 
-	} else if (type == FOURCC('b','o','o','t') && id == 2) {
-		D(bug(" boot 2 found\n"));
 
-		// Set fake handle at 0x0000 to some safe place (so broken Mac programs won't write into Mac ROM) (7.1, 7.5, 8.0)
-		static const uint8 dat[] = {0x20, 0x78, 0x02, 0xae, 0xd1, 0xfc, 0x00, 0x01, 0x00, 0x00, 0x21, 0xc8, 0x00, 0x00};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base);
+/*
+ *  boot 2
+ */
+
+#if !ROM_IS_WRITE_PROTECTED
+static void patch_boot_2(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug(" boot 2 found\n"));
+
+	// Set fake handle at 0x0000 to some safe place (so broken Mac programs won't write into Mac ROM) (7.1, 7.5, 8.0)
+	static const uint8 dat[] = {0x20, 0x78, 0x02, 0xae, 0xd1, 0xfc, 0x00, 0x01, 0x00, 0x00, 0x21, 0xc8, 0x00, 0x00};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base);
 
 #if defined(USE_SCRATCHMEM_SUBTERFUGE)
-			// Set 0x0000 to scratch memory area
-			extern uint8 *ScratchMem;
-			const uint32 ScratchMemBase = Host2MacAddr(ScratchMem);
-			*p16++ = htons(0x207c);			// move.l	#ScratchMem,a0
-			*p16++ = htons(ScratchMemBase >> 16);
-			*p16++ = htons(ScratchMemBase);
-			*p16++ = htons(M68K_NOP);
-			*p16 = htons(M68K_NOP);
+		// Set 0x0000 to scratch memory area
+		extern uint8 *ScratchMem;
+		const uint32 ScratchMemBase = Host2MacAddr(ScratchMem);
+		*p16++ = htons(0x207c);			// move.l	#ScratchMem,a0
+		*p16++ = htons(ScratchMemBase >> 16);
+		*p16++ = htons(ScratchMemBase);
+		*p16++ = htons(M68K_NOP);
+		*p16 = htons(M68K_NOP);
 #else
 #error System specific handling for writable ROM is required here
 #endif
-			FlushCodeCache(p + base, 14);
-			D(bug("  patch 1 applied\n"));
-		}
+		FlushCodeCache(p + base, 14);
+		D(bug("  patch 1 applied\n"));
+	}
+}
 #endif
 
-	} else if (type == FOURCC('P','T','C','H') && id == 630) {
-		D(bug("PTCH 630 found\n"));
 
-		// Don't replace Time Manager (Classic ROM, 6.0.3)
-		static const uint8 dat[] = {0x30, 0x3c, 0x00, 0x58, 0xa2, 0x47};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base);
-			p16[2] = htons(M68K_NOP);
-			p16[7] = htons(M68K_NOP);
-			p16[12] = htons(M68K_NOP);
-			FlushCodeCache(p + base, 26);
-			D(bug("  patch 1 applied\n"));
-		}
+/*
+ *  PTCH 630
+ */
 
-		// Don't replace Time Manager (Classic ROM, 6.0.8)
-		static const uint8 dat2[] = {0x70, 0x58, 0xa2, 0x47};
-		base = find_rsrc_data(p, size, dat2, sizeof(dat2));
-		if (base) {
-			p16 = (uint16 *)(p + base);
-			p16[1] = htons(M68K_NOP);
-			p16[5] = htons(M68K_NOP);
-			p16[9] = htons(M68K_NOP);
-			FlushCodeCache(p + base, 20);
-			D(bug("  patch 1 applied\n"));
-		}
+static void patch_PTCH_630(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
 
-	} else if (type == FOURCC('p','t','c','h') && id == 26) {
-		D(bug(" ptch 26 found\n"));
+	D(bug("PTCH 630 found\n"));
 
-		// Trap ABC4 is initialized with absolute ROM address (7.1, 7.5, 7.6, 7.6.1, 8.0)
-		static const uint8 dat[] = {0x40, 0x83, 0x36, 0x10};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base);
-			*p16++ = htons((ROMBaseMac + 0x33610) >> 16);
-			*p16 = htons((ROMBaseMac + 0x33610) & 0xffff);
-			FlushCodeCache(p + base, 4);
-			D(bug("  patch 1 applied\n"));
-		}
+	// Don't replace Time Manager (Classic ROM, 6.0.3)
+	static const uint8 dat[] = {0x30, 0x3c, 0x00, 0x58, 0xa2, 0x47};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base);
+		p16[2] = htons(M68K_NOP);
+		p16[7] = htons(M68K_NOP);
+		p16[12] = htons(M68K_NOP);
+		FlushCodeCache(p + base, 26);
+		D(bug("  patch 1 applied\n"));
+	}
 
-	} else if (type == FOURCC('p','t','c','h') && id == 34) {
-		D(bug(" ptch 34 found\n"));
+	// Don't replace Time Manager (Classic ROM, 6.0.8)
+	static const uint8 dat2[] = {0x70, 0x58, 0xa2, 0x47};
+	base = find_rsrc_sig(p, size, dat2, sizeof(dat2));
+	if (base) {
+		p16 = (uint16 *)(p + base);
+		p16[1] = htons(M68K_NOP);
+		p16[5] = htons(M68K_NOP);
+		p16[9] = htons(M68K_NOP);
+		FlushCodeCache(p + base, 20);
+		D(bug("  patch 1 applied\n"));
+	}
+}
 
-		// Don't wait for VIA (Classic ROM, 6.0.8)
-		static const uint8 dat[] = {0x22, 0x78, 0x01, 0xd4, 0x10, 0x11, 0x02, 0x00, 0x00, 0x30};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 14);
-			*p16 = htons(M68K_NOP);
-			FlushCodeCache(p + base + 14, 2);
-			D(bug("  patch 1 applied\n"));
-		}
 
-		// Don't replace ADBOp() (Classic ROM, 6.0.8)
-		static const uint8 dat2[] = {0x21, 0xc0, 0x05, 0xf0};
-		base = find_rsrc_data(p, size, dat2, sizeof(dat2));
-		if (base) {
-			p16 = (uint16 *)(p + base);
-			*p16++ = htons(M68K_NOP);
-			*p16 = htons(M68K_NOP);
-			FlushCodeCache(p + base, 4);
-			D(bug("  patch 2 applied\n"));
-		}
+/*
+ *  ptch 26
+ */
 
-	} else if (type == FOURCC('g','p','c','h') && id == 750) {
-		D(bug(" gpch 750 found\n"));
+static void patch_ptch_26(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
 
-		// Don't use PTEST instruction in BlockMove() (7.5, 7.6, 7.6.1, 8.0)
-		static const uint8 dat[] = {0x20, 0x5f, 0x22, 0x5f, 0x0c, 0x38, 0x00, 0x04, 0x01, 0x2f};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 4);
-			*p16++ = htons(M68K_EMUL_OP_BLOCK_MOVE);
-			*p16++ = htons(0x7000);
-			*p16 = htons(M68K_RTS);
-			FlushCodeCache(p + base + 4, 6);
-			D(bug("  patch 1 applied\n"));
-		}
+	D(bug(" ptch 26 found\n"));
 
-		// Patch SynchIdleTime()
-		patch_idle_time(p, size, 2);
+	// Trap ABC4 is initialized with absolute ROM address (7.1, 7.5, 7.6, 7.6.1, 8.0)
+	static const uint8 dat[] = {0x40, 0x83, 0x36, 0x10};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base);
+		*p16++ = htons((ROMBaseMac + 0x33610) >> 16);
+		*p16 = htons((ROMBaseMac + 0x33610) & 0xffff);
+		FlushCodeCache(p + base, 4);
+		D(bug("  patch 1 applied\n"));
+	}
+}
 
-	} else if (type == FOURCC('l','p','c','h') && id == 24) {
-		D(bug(" lpch 24 found\n"));
 
-		// Don't replace Time Manager (7.0.1, 7.1, 7.5, 7.6, 7.6.1, 8.0)
-		static const uint8 dat[] = {0x70, 0x59, 0xa2, 0x47};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 2);
-			*p16++ = htons(M68K_NOP);
-			p16 += 3;
-			*p16++ = htons(M68K_NOP);
-			p16 += 7;
-			*p16 = htons(M68K_NOP);
-			FlushCodeCache(p + base + 2, 28);
-			D(bug("  patch 1 applied\n"));
-		}
+/*
+ *  ptch 34
+ */
 
-	} else if (type == FOURCC('l','p','c','h') && id == 31) {
-		D(bug(" lpch 31 found\n"));
+static void patch_ptch_34(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
 
-		// Don't write to VIA in vSoundDead() (7.0.1, 7.1, 7.5, 7.6, 7.6.1, 8.0)
-		static const uint8 dat[] = {0x20, 0x78, 0x01, 0xd4, 0x08, 0xd0, 0x00, 0x07, 0x4e, 0x75};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base);
-			*p16 = htons(M68K_RTS);
-			FlushCodeCache(p + base, 2);
-			D(bug("  patch 1 applied\n"));
-		}
+	D(bug(" ptch 34 found\n"));
 
-		// Don't replace SCSI manager (7.1, 7.5, 7.6.1, 8.0)
-		static const uint8 dat2[] = {0x0c, 0x6f, 0x00, 0x0e, 0x00, 0x04, 0x66, 0x0c};
-		base = find_rsrc_data(p, size, dat2, sizeof(dat2));
-		if (base) {
-			p16 = (uint16 *)(p + base);
-			*p16++ = htons(M68K_EMUL_OP_SCSI_DISPATCH);
-			*p16++ = htons(0x2e49);		// move.l	a1,a7
-			*p16 = htons(M68K_JMP_A0);
-			FlushCodeCache(p + base, 6);
-			D(bug("  patch 2 applied\n"));
-		}
+	// Don't wait for VIA (Classic ROM, 6.0.8)
+	static const uint8 dat[] = {0x22, 0x78, 0x01, 0xd4, 0x10, 0x11, 0x02, 0x00, 0x00, 0x30};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 14);
+		*p16 = htons(M68K_NOP);
+		FlushCodeCache(p + base + 14, 2);
+		D(bug("  patch 1 applied\n"));
+	}
 
-		// Patch SynchIdleTime()
-		patch_idle_time(p, size, 3);
+	// Don't replace ADBOp() (Classic ROM, 6.0.8)
+	static const uint8 dat2[] = {0x21, 0xc0, 0x05, 0xf0};
+	base = find_rsrc_sig(p, size, dat2, sizeof(dat2));
+	if (base) {
+		p16 = (uint16 *)(p + base);
+		*p16++ = htons(M68K_NOP);
+		*p16 = htons(M68K_NOP);
+		FlushCodeCache(p + base, 4);
+		D(bug("  patch 2 applied\n"));
+	}
+}
 
-	} else if (type == FOURCC('t','h','n','g') && id == -16563) {
-		D(bug(" thng -16563 found\n"));
 
-		// Set audio component flags (7.5, 7.6, 7.6.1, 8.0)
-		*(uint32 *)(p + componentFlags) = htonl(audio_component_flags);
-		D(bug("  patch 1 applied\n"));
+/*
+ *  gpch 750
+ */
 
-	} else if (type == FOURCC('s','i','f','t') && id == -16563) {
-		D(bug(" sift -16563 found\n"));
-
-		// Replace audio component (7.5, 7.6, 7.6.1, 8.0)
-		p16 = (uint16 *)p;
-		*p16++ = htons(0x4e56); *p16++ = htons(0x0000);	// link		a6,#0
-		*p16++ = htons(0x48e7); *p16++ = htons(0x8018);	// movem.l	d0/a3-a4,-(sp)
-		*p16++ = htons(0x266e); *p16++ = htons(0x000c);	// movea.l	12(a6),a3
-		*p16++ = htons(0x286e); *p16++ = htons(0x0008);	// movea.l	8(a6),a4
-		*p16++ = htons(M68K_EMUL_OP_AUDIO);
-		*p16++ = htons(0x2d40); *p16++ = htons(0x0010);	// move.l	d0,16(a6)
-		*p16++ = htons(0x4cdf); *p16++ = htons(0x1801);	// movem.l	(sp)+,d0/a3-a4
-		*p16++ = htons(0x4e5e);							// unlk		a6
-		*p16++ = htons(0x4e74); *p16++ = htons(0x0008);	// rtd		#8
-		FlushCodeCache(p, 32);
+static void patch_gpch_750(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug(" gpch 750 found\n"));
+
+	// Don't use PTEST instruction in BlockMove() (7.5, 7.6, 7.6.1, 8.0)
+	static const uint8 dat[] = {0x20, 0x5f, 0x22, 0x5f, 0x0c, 0x38, 0x00, 0x04, 0x01, 0x2f};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 4);
+		*p16++ = htons(M68K_EMUL_OP_BLOCK_MOVE);
+		*p16++ = htons(0x7000);
+		*p16 = htons(M68K_RTS);
+		FlushCodeCache(p + base + 4, 6);
 		D(bug("  patch 1 applied\n"));
+	}
 
-	} else if (type == FOURCC('i','n','s','t') && id == -19069) {
-		D(bug(" inst -19069 found\n"));
+	// Patch SynchIdleTime()
+	patch_idle_time(p, size, 2);
+}
 
-		// Don't replace Microseconds (QuickTime 2.0)
-		static const uint8 dat[] = {0x30, 0x3c, 0xa1, 0x93, 0xa2, 0x47};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 4);
-			*p16 = htons(M68K_NOP);
-			FlushCodeCache(p + base + 4, 2);
-			D(bug("  patch 1 applied\n"));
-		}
 
-	} else if (type == FOURCC('D','R','V','R') && id == -20066) {
-		D(bug("DRVR -20066 found\n"));
+/*
+ *  lpch 24
+ */
+
+static void patch_lpch_24(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug(" lpch 24 found\n"));
 
-		// Don't access SCC in .Infra driver
-		static const uint8 dat[] = {0x28, 0x78, 0x01, 0xd8, 0x48, 0xc7, 0x20, 0x0c, 0xd0, 0x87, 0x20, 0x40, 0x1c, 0x10};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 12);
-			*p16 = htons(0x7a00);	// moveq #0,d6
-			FlushCodeCache(p + base + 12, 2);
-			D(bug("  patch 1 applied\n"));
-		}
+	// Don't replace Time Manager (7.0.1, 7.1, 7.5, 7.6, 7.6.1, 8.0)
+	static const uint8 dat[] = {0x70, 0x59, 0xa2, 0x47};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 2);
+		*p16++ = htons(M68K_NOP);
+		p16 += 3;
+		*p16++ = htons(M68K_NOP);
+		p16 += 7;
+		*p16 = htons(M68K_NOP);
+		FlushCodeCache(p + base + 2, 28);
+		D(bug("  patch 1 applied\n"));
+	}
+}
 
-	} else if (type == FOURCC('l','t','l','k') && id == 0) {
-		D(bug(" ltlk 0 found\n"));
 
-		// Disable LocalTalk (7.0.1, 7.5, 7.6, 7.6.1, 8.0)
-		p16 = (uint16 *)p;
-		*p16++ = htons(M68K_JMP_A0);
-		*p16++ = htons(0x7000);
+/*
+ *  lpch 31
+ */
+
+static void patch_lpch_31(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug(" lpch 31 found\n"));
+
+	// Don't write to VIA in vSoundDead() (7.0.1, 7.1, 7.5, 7.6, 7.6.1, 8.0)
+	static const uint8 dat[] = {0x20, 0x78, 0x01, 0xd4, 0x08, 0xd0, 0x00, 0x07, 0x4e, 0x75};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base);
 		*p16 = htons(M68K_RTS);
-		FlushCodeCache(p, 6);
+		FlushCodeCache(p + base, 2);
 		D(bug("  patch 1 applied\n"));
+	}
 
-	} else if (type == FOURCC('D','R','V','R') && id == 41) {
-		D(bug(" DRVR 41 found\n"));
-		
-		// Don't access ROM85 as it it was a pointer to a ROM version number (8.0, 8.1)
-		static const uint8 dat[] = {0x3a, 0x2e, 0x00, 0x0a, 0x55, 0x4f, 0x3e, 0xb8, 0x02, 0x8e, 0x30, 0x1f, 0x48, 0xc0, 0x24, 0x40, 0x20, 0x40};
-		base = find_rsrc_data(p, size, dat, sizeof(dat));
-		if (base) {
-			p16 = (uint16 *)(p + base + 4);
-			*p16++ = htons(0x303c);		// move.l	#ROM85,%d0
-			*p16++ = htons(0x028e);
-			*p16++ = htons(M68K_NOP);
-			*p16++ = htons(M68K_NOP);
-			FlushCodeCache(p + base + 4, 8);
-			D(bug("  patch 1 applied\n"));
-		}
+	// Don't replace SCSI manager (7.1, 7.5, 7.6.1, 8.0)
+	static const uint8 dat2[] = {0x0c, 0x6f, 0x00, 0x0e, 0x00, 0x04, 0x66, 0x0c};
+	base = find_rsrc_sig(p, size, dat2, sizeof(dat2));
+	if (base) {
+		p16 = (uint16 *)(p + base);
+		*p16++ = htons(M68K_EMUL_OP_SCSI_DISPATCH);
+		*p16++ = htons(0x2e49);		// move.l	a1,a7
+		*p16 = htons(M68K_JMP_A0);
+		FlushCodeCache(p + base, 6);
+		D(bug("  patch 2 applied\n"));
+	}
+
+	// Patch SynchIdleTime()
+	patch_idle_time(p, size, 3);
+}
+
+
+/*
+ *  thng -16563
+ */
+
+static void patch_thng_m16563(uint8 *p, uint32 size)
+{
+	UNUSED(size);
+
+	D(bug(" thng -16563 found\n"));
+
+	// Set audio component flags (7.5, 7.6, 7.6.1, 8.0)
+	*(uint32 *)(p + componentFlags) = htonl(audio_component_flags);
+	D(bug("  patch 1 applied\n"));
+}
+
+
+/*
+ *  sift -16563
+ */
+
+static void patch_sift_m16563(uint8 *p, uint32 size)
+{
+	UNUSED(size);
+	uint16 *p16;
+
+	D(bug(" sift -16563 found\n"));
+
+	// Replace audio component (7.5, 7.6, 7.6.1, 8.0)
+	p16 = (uint16 *)p;
+	*p16++ = htons(0x4e56); *p16++ = htons(0x0000);	// link		a6,#0
+	*p16++ = htons(0x48e7); *p16++ = htons(0x8018);	// movem.l	d0/a3-a4,-(sp)
+	*p16++ = htons(0x266e); *p16++ = htons(0x000c);	// movea.l	12(a6),a3
+	*p16++ = htons(0x286e); *p16++ = htons(0x0008);	// movea.l	8(a6),a4
+	*p16++ = htons(M68K_EMUL_OP_AUDIO);
+	*p16++ = htons(0x2d40); *p16++ = htons(0x0010);	// move.l	d0,16(a6)
+	*p16++ = htons(0x4cdf); *p16++ = htons(0x1801);	// movem.l	(sp)+,d0/a3-a4
+	*p16++ = htons(0x4e5e);							// unlk		a6
+	*p16++ = htons(0x4e74); *p16++ = htons(0x0008);	// rtd		#8
+	FlushCodeCache(p, 32);
+	D(bug("  patch 1 applied\n"));
+}
+
+
+/*
+ *  inst -19069
+ */
+
+static void patch_inst_m19069(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug(" inst -19069 found\n"));
+
+	// Don't replace Microseconds (QuickTime 2.0)
+	static const uint8 dat[] = {0x30, 0x3c, 0xa1, 0x93, 0xa2, 0x47};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 4);
+		*p16 = htons(M68K_NOP);
+		FlushCodeCache(p + base + 4, 2);
+		D(bug("  patch 1 applied\n"));
 	}
 }
+
+
+/*
+ *  DRVR -20066
+ */
+
+static void patch_DRVR_m20066(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug("DRVR -20066 found\n"));
+
+	// Don't access SCC in .Infra driver
+	static const uint8 dat[] = {0x28, 0x78, 0x01, 0xd8, 0x48, 0xc7, 0x20, 0x0c, 0xd0, 0x87, 0x20, 0x40, 0x1c, 0x10};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 12);
+		*p16 = htons(0x7a00);	// moveq #0,d6
+		FlushCodeCache(p + base + 12, 2);
+		D(bug("  patch 1 applied\n"));
+	}
+}
+
+
+/*
+ *  ltlk 0
+ */
+
+static void patch_ltlk_0(uint8 *p, uint32 size)
+{
+	UNUSED(size);
+	uint16 *p16;
+
+	D(bug(" ltlk 0 found\n"));
+
+	// Disable LocalTalk (7.0.1, 7.5, 7.6, 7.6.1, 8.0)
+	p16 = (uint16 *)p;
+	*p16++ = htons(M68K_JMP_A0);
+	*p16++ = htons(0x7000);
+	*p16 = htons(M68K_RTS);
+	FlushCodeCache(p, 6);
+	D(bug("  patch 1 applied\n"));
+}
+
+
+/*
+ *  DRVR 41
+ */
+
+static void patch_DRVR_41(uint8 *p, uint32 size)
+{
+	uint16 *p16;
+	uint32 base;
+
+	D(bug(" DRVR 41 found\n"));
+	
+	// Don't access ROM85 as it it was a pointer to a ROM version number (8.0, 8.1)
+	static const uint8 dat[] = {0x3a, 0x2e, 0x00, 0x0a, 0x55, 0x4f, 0x3e, 0xb8, 0x02, 0x8e, 0x30, 0x1f, 0x48, 0xc0, 0x24, 0x40, 0x20, 0x40};
+	base = find_rsrc_sig(p, size, dat, sizeof(dat));
+	if (base) {
+		p16 = (uint16 *)(p + base + 4);
+		*p16++ = htons(0x303c);		// move.l	#ROM85,%d0
+		*p16++ = htons(0x028e);
+		*p16++ = htons(M68K_NOP);
+		*p16++ = htons(M68K_NOP);
+		FlushCodeCache(p + base + 4, 8);
+		D(bug("  patch 1 applied\n"));
+	}
+}
+
+
+/*
+ *  Patched resources, sorted by type and ID for the binary search
+ */
+
+struct rsrc_patch {
+	uint32 type;
+	int16 id;
+	void (*apply)(uint8 *p, uint32 size);
+};
+
+static const rsrc_patch rsrc_patch_table[] = {
+	{FOURCC('D','R','V','R'), -20066, patch_DRVR_m20066},
+	{FOURCC('D','R','V','R'), 41, patch_DRVR_41},
+	{FOURCC('P','T','C','H'), 630, patch_PTCH_630},
+#if !ROM_IS_WRITE_PROTECTED
+	{FOURCC('b','o','o','t'), 2, patch_boot_2},
+#endif
+	{FOURCC('b','o','o','t'), 3, patch_boot_3},
+	{FOURCC('g','p','c','h'), 750, patch_gpch_750},
+	{FOURCC('i','n','s','t'), -19069, patch_inst_m19069},
+	{FOURCC('l','p','c','h'), 24, patch_lpch_24},
+	{FOURCC('l','p','c','h'), 31, patch_lpch_31},
+	{FOURCC('l','t','l','k'), 0, patch_ltlk_0},
+	{FOURCC('p','t','c','h'), 26, patch_ptch_26},
+	{FOURCC('p','t','c','h'), 34, patch_ptch_34},
+	{FOURCC('s','i','f','t'), -16563, patch_sift_m16563},
+	{FOURCC('t','h','n','g'), -16563, patch_thng_m16563},
+};
+
+static const int rsrc_patch_count = sizeof(rsrc_patch_table) / sizeof(rsrc_patch_table[0]);
+
+// Bit per type hash that has a patch, so that the hundreds of resources an
+// application launch loads are turned away with one test
+static uint64 rsrc_patch_types = 0;
+
+static inline int rsrc_type_bit(uint32 type)
+{
+	return (type * 0x9e3779b1) >> 26;
+}
+
+
+/*
+ *  Resource patches via vCheckLoad
+ */
+
+void CheckLoad(uint32 type, int16 id, uint8 *p, uint32 size)
+{
+	D(bug("vCheckLoad %c%c%c%c (%08x) ID %d, data %p, size %d\n", (char)(type >> 24), (char)((type >> 16) & 0xff), (char )((type >> 8) & 0xff), (char )(type & 0xff), type, id, p, size));
+
+	if (rsrc_patch_types == 0) {
+		for (int i = 0; i < rsrc_patch_count; i++)
+			rsrc_patch_types |= (uint64)1 << rsrc_type_bit(rsrc_patch_table[i].type);
+	}
+	if (!(rsrc_patch_types & ((uint64)1 << rsrc_type_bit(type))))
+		return;
+
+	int lo = 0, hi = rsrc_patch_count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const rsrc_patch *e = &rsrc_patch_table[mid];
+		if (e->type < type || (e->type == type && e->id < id))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == rsrc_patch_count || rsrc_patch_table[lo].type != type || rsrc_patch_table[lo].id != id)
+		return;
+
+	rsrc_sum_valid = false;
+	rsrc_patch_table[lo].apply(p, size);
+}
@@ -0,0 +1,606 @@
+/*
+ *  screenrec_esp32.cpp - Screen recording to the SD card from the dirty tiles
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  With SCREEN_RECORD, Ctrl+Shift+Print Screen starts and stops a recording
+ *  of the Mac screen to the file in the "screenrec" pref (/screen.rec by
+ *  default; /screenrec.txt on the card names one and records from the
+ *  start). tools/screenrec turns it into a GIF or raw frames for ffmpeg.
+ *
+ *  The video task already knows which tiles changed in a frame: it hands
+ *  them to ScreenRecFrame(), which copies their bytes as the frame buffer
+ *  holds them into a PSRAM ring and returns, so a recording costs the
+ *  video task a memcpy per tile. The recorder task on Core 0 LZ4-compresses
+ *  the tiles and appends the records to the file through a large stdio
+ *  buffer. When the ring is full the tiles stay marked and go out with a
+ *  later frame, which keeps the recording whole at the price of lagging
+ *  behind the screen for a while; frames are never dropped from the video
+ *  task's side. The format is described in screenrec_format.h.
+ *
+ *  The ring holds records at 16-byte aligned positions, a pad record fills
+ *  the end of the ring when the next one doesn't fit there; the video task
+ *  publishes the head once a record is complete (release), the recorder
+ *  task the tail once it has written it out.
+ */
+
+#include "sysdeps.h"
+
+#include "screenrec_esp32.h"
+
+#if SCREEN_RECORD
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "prefs.h"
+#include "video.h"
+#include "perf_esp32.h"
+#include "mem_plan_esp32.h"
+#include "sd_esp32.h"
+#include "screenrec_format.h"
+
+#define SCREENREC_RING_SIZE     (1024 * 1024)               // PSRAM, power of two
+#define SCREENREC_RECORD_MAX    (SCREENREC_RING_SIZE / 4)   // Largest FRAME record
+#define SCREENREC_FILE_BUFFER   16384                       // stdio buffer, batches the writes
+#define SCREENREC_FLUSH_MS      50                          // Recorder task period
+#define SCREENREC_DEFAULT_FILE  "/screen.rec"
+
+#define SCREENREC_TASK_STACK_SIZE   4096
+#define SCREENREC_TASK_PRIORITY     1
+#define SCREENREC_TASK_CORE         0
+
+// Largest tile (64x36 at 16 bits) and its LZ4 bound
+#define SCREENREC_TILE_MAX      (64 * 36 * 2)
+#define SCREENREC_LZ4_MAX       (SCREENREC_TILE_MAX + SCREENREC_TILE_MAX / 255 + 16)
+
+volatile bool screenrec_active = false;
+volatile bool screenrec_pending = false;
+
+static uint8 *ring = NULL;
+static uint32 ring_head = 0;                // Published up to (video task)
+static uint32 ring_tail = 0;                // Written out up to (recorder task)
+static volatile bool in_frame = false;      // Video task in ScreenRecFrame()
+
+// Video task side
+static uint32 pending_tiles[SCREENREC_TILE_WORDS];  // Not recorded yet
+static screenrec_mode rec_mode;             // Last MODE recorded
+static bool mode_pending = false;
+static uint8 rec_palette[256 * 3];          // As of the last PALETTE recorded
+static bool palette_unknown = false;        // No PALETTE recorded yet
+static uint32 start_ms = 0;
+
+// Recorder task side
+static TaskHandle_t recorder_task_handle = NULL;
+static volatile bool toggle_request = false;
+static volatile bool exit_request = false;
+static FILE *rec_file = NULL;
+static char rec_path[128];
+static uint8 *out_buffer = NULL;            // One compressed FRAME record
+static screenrec_mode out_mode;             // Last MODE written
+static uint32 out_frames = 0;
+static uint64 out_bytes = 0;
+
+static perf_counter *perf_tiles = NULL;     // "screenrec.tiles", tiles recorded
+static perf_counter *perf_bytes = NULL;     // "screenrec.bytes", written to the file
+static perf_counter *perf_deferred = NULL;  // "screenrec.deferred", frames that left tiles for later
+
+static inline uint32 align16(uint32 n)
+{
+    return (n + 15) & ~15u;
+}
+
+static inline uint32 align4(uint32 n)
+{
+    return (n + 3) & ~3u;
+}
+
+
+/*
+ *  Ring (video task): room for a record of want bytes, or as much as there
+ *  is down to min; NULL if not even min fits. Padding to the end of the
+ *  ring goes out with the next record published.
+ */
+static uint8 *ring_reserve(uint32 want, uint32 min, uint32 &got)
+{
+    uint32 tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    uint32 room = SCREENREC_RING_SIZE - (ring_head - tail);
+    uint32 off = ring_head & (SCREENREC_RING_SIZE - 1);
+    uint32 to_end = SCREENREC_RING_SIZE - off;
+    uint32 here = room < to_end ? room : to_end;
+    uint32 wrapped = room > to_end ? room - to_end : 0;
+    if (here < want && wrapped > here) {
+        screenrec_record *pad = (screenrec_record *)(ring + off);
+        pad->size = to_end;
+        pad->type = SCREENREC_PAD;
+        ring_head += to_end;
+        off = 0;
+        here = wrapped;
+    }
+    if (here < min) {
+        return NULL;
+    }
+    got = here < want ? here : want;
+    return ring + off;
+}
+
+static void ring_publish(screenrec_record *r, uint16 type, uint32 size, uint32 now)
+{
+    r->size = size;
+    r->type = type;
+    r->reserved = 0;
+    r->time_ms = now;
+    __atomic_store_n(&ring_head, ring_head + align16(size), __ATOMIC_RELEASE);
+}
+
+// A MODE record; false if the ring is full
+static bool put_mode(uint32 now)
+{
+    uint32 size = sizeof(screenrec_record) + sizeof(screenrec_mode), got;
+    uint8 *p = ring_reserve(align16(size), align16(size), got);
+    if (p == NULL) {
+        return false;
+    }
+    memcpy(p + sizeof(screenrec_record), &rec_mode, sizeof(rec_mode));
+    ring_publish((screenrec_record *)p, SCREENREC_MODE, size, now);
+    return true;
+}
+
+// A PALETTE record of the entries that changed; false if the ring is full
+static bool put_palette(const uint8 *palette, int colours, uint32 now)
+{
+    int first = 0, last = colours - 1;
+    if (!palette_unknown) {
+        while (first < colours && memcmp(palette + first * 3, rec_palette + first * 3, 3) == 0) {
+            first++;
+        }
+        if (first == colours) {
+            return true;
+        }
+        while (memcmp(palette + last * 3, rec_palette + last * 3, 3) == 0) {
+            last--;
+        }
+    }
+
+    int count = last - first + 1;
+    uint32 size = align4(sizeof(screenrec_record) + 4 + count * 3), got;
+    uint8 *p = ring_reserve(align16(size), align16(size), got);
+    if (p == NULL) {
+        return false;
+    }
+    uint8 *q = p + sizeof(screenrec_record);
+    q[0] = (uint8)first;
+    q[1] = (uint8)(first >> 8);
+    q[2] = (uint8)count;
+    q[3] = (uint8)(count >> 8);
+    memcpy(q + 4, palette + first * 3, count * 3);
+    memset(q + 4 + count * 3, 0, size - sizeof(screenrec_record) - 4 - count * 3);
+    memcpy(rec_palette + first * 3, palette + first * 3, count * 3);
+    palette_unknown = false;
+    ring_publish((screenrec_record *)p, SCREENREC_PALETTE, size, now);
+    return true;
+}
+
+static void record_frame(const screenrec_frame &f, const uint32 *tiles)
+{
+    uint32 now = millis() - start_ms;
+    if (f.depth > VDEPTH_16BIT) {
+        return;
+    }
+    int bits = 1 << f.depth;
+    int ntiles = f.tiles_x * f.tiles_y;
+    int words = (ntiles + 31) / 32;
+    if (words > SCREENREC_TILE_WORDS) {
+        return;
+    }
+
+    // A mode switch is recorded with all of its tiles
+    screenrec_mode m;
+    memset(&m, 0, sizeof(m));
+    m.width = f.width;
+    m.height = f.height;
+    m.depth = bits;
+    m.tile_width = f.tile_width;
+    m.tile_height = f.tile_height;
+    m.tiles_x = f.tiles_x;
+    m.tiles_y = f.tiles_y;
+    if (memcmp(&m, &rec_mode, sizeof(m)) != 0) {
+        rec_mode = m;
+        mode_pending = true;
+        memset(pending_tiles, 0, sizeof(pending_tiles));
+        for (int i = 0; i < ntiles; i++) {
+            pending_tiles[i >> 5] |= 1u << (i & 31);
+        }
+    }
+    if (tiles) {
+        for (int i = 0; i < words; i++) {
+            pending_tiles[i] |= tiles[i];
+        }
+    }
+    if (ntiles & 31) {
+        pending_tiles[words - 1] &= (1u << (ntiles & 31)) - 1;
+    }
+
+    // The mode and palette first, then the tiles drawn with them
+    screenrec_pending = true;
+    if (mode_pending) {
+        if (!put_mode(now)) {
+            return;
+        }
+        mode_pending = false;
+    }
+    if (bits <= 8 && !put_palette(f.palette, 1 << bits, now)) {
+        return;
+    }
+
+    int count = 0;
+    for (int i = 0; i < words; i++) {
+        count += __builtin_popcount(pending_tiles[i]);
+    }
+    if (count == 0) {
+        screenrec_pending = false;
+        return;
+    }
+
+    uint32 row_bytes = f.tile_width * bits / 8;
+    uint32 tile_bytes = row_bytes * f.tile_height;
+    uint32 head_bytes = sizeof(screenrec_record) + words * 4;
+    uint32 want = align16(head_bytes + count * (2 + tile_bytes));
+    if (want > SCREENREC_RECORD_MAX) {
+        want = SCREENREC_RECORD_MAX;
+    }
+    uint32 got;
+    uint8 *p = ring_reserve(want, align16(head_bytes + 2 + tile_bytes), got);
+    if (p == NULL) {
+        PerfAdd(perf_deferred, 1);
+        return;
+    }
+
+    // As many of the waiting tiles as fit, in order
+    uint32 *bitmap = (uint32 *)(p + sizeof(screenrec_record));
+    memset(bitmap, 0, words * 4);
+    uint8 *q = p + head_bytes;
+    uint8 *end = p + got;
+    int recorded = 0;
+    for (int w = 0; w < words && q + 2 + tile_bytes <= end; w++) {
+        uint32 bits_left = pending_tiles[w];
+        while (bits_left && q + 2 + tile_bytes <= end) {
+            int b = __builtin_ctz(bits_left);
+            bits_left &= bits_left - 1;
+            int t = w * 32 + b;
+            int tx = t % f.tiles_x, ty = t / f.tiles_x;
+            bitmap[w] |= 1u << b;
+            pending_tiles[w] &= ~(1u << b);
+
+            uint16 len = tile_bytes | SCREENREC_TILE_RAW;
+            q[0] = (uint8)len;
+            q[1] = (uint8)(len >> 8);
+            q += 2;
+            const uint8 *src = f.pixels + ty * f.tile_height * f.bytes_per_row + tx * row_bytes;
+            for (int y = 0; y < f.tile_height; y++) {
+                memcpy(q, src, row_bytes);
+                q += row_bytes;
+                src += f.bytes_per_row;
+            }
+            recorded++;
+        }
+    }
+
+    uint32 size = q - p;
+    memset(q, 0, align4(size) - size);
+    ring_publish((screenrec_record *)p, SCREENREC_FRAME, align4(size), now);
+    PerfAdd(perf_tiles, recorded);
+    if (recorded < count) {
+        PerfAdd(perf_deferred, 1);
+    } else {
+        screenrec_pending = false;
+    }
+}
+
+void ScreenRecFrame(const screenrec_frame &f, const uint32 *tiles)
+{
+    // Announce before looking at the flag, the recorder task clears the
+    // flag before waiting for in_frame to drop
+    __atomic_store_n(&in_frame, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&screenrec_active, __ATOMIC_SEQ_CST)) {
+        record_frame(f, tiles);
+    }
+    __atomic_store_n(&in_frame, false, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  Greedy LZ4 block compression of one tile (as tools/dskz/dskz.c);
+ *  dst needs n + n / 255 + 16 bytes
+ */
+#define LZ4_HASH_BITS       10
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MF_LIMIT        12
+
+static uint16 lz4_table[1 << LZ4_HASH_BITS];
+
+static uint8 *lz4_put_length(uint8 *op, uint32 len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8)len;
+    return op;
+}
+
+static uint32 lz4_compress_tile(const uint8 *src, uint32 n, uint8 *dst)
+{
+    const uint8 *ip = src, *anchor = src, *iend = src + n;
+    const uint8 *mflimit = iend - LZ4_MF_LIMIT, *matchlimit = iend - LZ4_LAST_LITERALS;
+    uint8 *op = dst;
+
+    memset(lz4_table, 0, sizeof(lz4_table));
+    while (n > LZ4_MF_LIMIT && ip < mflimit) {
+        uint32 seq;
+        memcpy(&seq, ip, 4);
+        uint32 h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        uint32 cand = lz4_table[h];             // Position + 1, 0 = empty
+        lz4_table[h] = (uint16)(ip - src + 1);
+        uint32 ref_seq;
+        if (cand == 0 || (memcpy(&ref_seq, src + cand - 1, 4), ref_seq != seq)) {
+            ip++;
+            continue;
+        }
+        const uint8 *ref = src + cand - 1;
+        const uint8 *mp = ip + LZ4_MIN_MATCH, *rp = ref + LZ4_MIN_MATCH;
+        while (mp < matchlimit && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        uint32 lit = ip - anchor, mlen = (mp - ip) - LZ4_MIN_MATCH;
+        uint8 *token = op++;
+        *token = (uint8)((lit >= 15 ? 15 : lit) << 4);
+        if (lit >= 15) {
+            op = lz4_put_length(op, lit - 15);
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+        uint32 off = ip - ref;
+        *op++ = (uint8)off;
+        *op++ = (uint8)(off >> 8);
+        *token |= (uint8)(mlen >= 15 ? 15 : mlen);
+        if (mlen >= 15) {
+            op = lz4_put_length(op, mlen - 15);
+        }
+        ip = mp;
+        anchor = ip;
+    }
+
+    // Trailing literals
+    uint32 lit = iend - anchor;
+    *op++ = (uint8)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) {
+        op = lz4_put_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+
+/*
+ *  Recorder task: write out the records published so far
+ */
+static bool write_out(const void *data, uint32 size)
+{
+    if (fwrite(data, 1, size, rec_file) != size) {
+        return false;
+    }
+    out_bytes += size;
+    PerfAdd(perf_bytes, size);
+    return true;
+}
+
+// A FRAME record with its tiles compressed, unless that doesn't save anything
+static bool write_frame(const screenrec_record *r)
+{
+    int words = (out_mode.tiles_x * out_mode.tiles_y + 31) / 32;
+    uint32 tile_bytes = out_mode.tile_width * out_mode.depth / 8 * out_mode.tile_height;
+    uint32 head_bytes = sizeof(screenrec_record) + words * 4;
+    const uint8 *in = (const uint8 *)r + head_bytes;
+    const uint8 *in_end = (const uint8 *)r + r->size;
+    uint8 *q = out_buffer + head_bytes;
+    static uint8 packed[SCREENREC_LZ4_MAX];
+
+    memcpy(out_buffer, r, head_bytes);
+    while (in + 2 + tile_bytes <= in_end) {
+        uint16 len = in[0] | (in[1] << 8);
+        if (len != (tile_bytes | SCREENREC_TILE_RAW)) {
+            break;
+        }
+        in += 2;
+        uint32 n = lz4_compress_tile(in, tile_bytes, packed);
+        if (n < tile_bytes) {
+            q[0] = (uint8)n;
+            q[1] = (uint8)(n >> 8);
+            memcpy(q + 2, packed, n);
+            q += 2 + n;
+        } else {
+            memcpy(q, in - 2, 2 + tile_bytes);
+            q += 2 + tile_bytes;
+        }
+        in += tile_bytes;
+    }
+
+    uint32 size = q - out_buffer;
+    memset(q, 0, align4(size) - size);
+    ((screenrec_record *)out_buffer)->size = align4(size);
+    out_frames++;
+    return write_out(out_buffer, align4(size));
+}
+
+static bool drain(void)
+{
+    uint32 head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    bool ok = true;
+    while (ring_tail != head) {
+        const screenrec_record *r = (const screenrec_record *)(ring + (ring_tail & (SCREENREC_RING_SIZE - 1)));
+        if (ok) {
+            if (r->type == SCREENREC_FRAME) {
+                ok = write_frame(r);
+            } else if (r->type == SCREENREC_MODE) {
+                memcpy(&out_mode, (const uint8 *)r + sizeof(screenrec_record), sizeof(out_mode));
+                ok = write_out(r, r->size);
+            } else if (r->type == SCREENREC_PALETTE) {
+                ok = write_out(r, r->size);
+            }
+        }
+        __atomic_store_n(&ring_tail, ring_tail + align16(r->size), __ATOMIC_RELEASE);
+    }
+    return ok;
+}
+
+static void start_recording(void)
+{
+    if (ring == NULL) {
+        ring = (uint8 *)MemPlanAlloc("screenrec", SCREENREC_RING_SIZE, MALLOC_CAP_SPIRAM);
+    }
+    if (out_buffer == NULL) {
+        out_buffer = (uint8 *)heap_caps_malloc(SCREENREC_RECORD_MAX, MALLOC_CAP_SPIRAM);
+    }
+    if (ring == NULL || out_buffer == NULL) {
+        Serial.println("[SCREENREC] WARNING: not enough PSRAM to record");
+        return;
+    }
+
+    const char *file = PrefsFindString("screenrec");
+    snprintf(rec_path, sizeof(rec_path), "%s%s", SD_MOUNT_POINT, file ? file : SCREENREC_DEFAULT_FILE);
+    rec_file = fopen(rec_path, "wb");
+    if (rec_file == NULL) {
+        Serial.printf("[SCREENREC] WARNING: can't create %s\n", rec_path);
+        return;
+    }
+    setvbuf(rec_file, NULL, _IOFBF, SCREENREC_FILE_BUFFER);
+
+    screenrec_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCREENREC_MAGIC, sizeof(h.magic));
+    h.version = SCREENREC_VERSION;
+    out_frames = 0;
+    out_bytes = 0;
+    if (!write_out(&h, sizeof(h))) {
+        Serial.printf("[SCREENREC] WARNING: can't write %s\n", rec_path);
+        fclose(rec_file);
+        rec_file = NULL;
+        return;
+    }
+
+    // The video task stays out while the flag is clear
+    ring_head = ring_tail = 0;
+    memset(&rec_mode, 0, sizeof(rec_mode));
+    memset(&out_mode, 0, sizeof(out_mode));
+    memset(pending_tiles, 0, sizeof(pending_tiles));
+    mode_pending = false;
+    palette_unknown = true;
+    start_ms = millis();
+    __atomic_store_n(&screenrec_active, true, __ATOMIC_SEQ_CST);
+    Serial.printf("[SCREENREC] Recording to %s\n", rec_path);
+}
+
+static void stop_recording(bool ok)
+{
+    __atomic_store_n(&screenrec_active, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&in_frame, __ATOMIC_SEQ_CST)) {
+        vTaskDelay(1);
+    }
+    screenrec_pending = false;
+    ok = drain() && ok;
+    if (fclose(rec_file) != 0) {
+        ok = false;
+    }
+    rec_file = NULL;
+    if (ok) {
+        Serial.printf("[SCREENREC] Saved %s: %u frames, %u KB, %u s\n", rec_path, (unsigned)out_frames,
+                      (unsigned)(out_bytes / 1024), (unsigned)((millis() - start_ms) / 1000));
+    } else {
+        Serial.printf("[SCREENREC] WARNING: can't write %s, recording stopped\n", rec_path);
+    }
+}
+
+static void recorderTask(void *param)
+{
+    UNUSED(param);
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SCREENREC_FLUSH_MS));
+        if (rec_file && !drain()) {
+            stop_recording(false);
+        }
+        if (exit_request) {
+            if (rec_file) {
+                stop_recording(true);
+            }
+            exit_request = false;
+            recorder_task_handle = NULL;
+            vTaskDelete(NULL);
+        }
+        if (toggle_request) {
+            toggle_request = false;
+            if (rec_file) {
+                stop_recording(true);
+            } else {
+                start_recording();
+            }
+        }
+    }
+}
+
+
+/*
+ *  Initialization
+ */
+
+void ScreenRecInit(void)
+{
+    perf_tiles = PerfCounter("screenrec.tiles");
+    perf_bytes = PerfCounter("screenrec.bytes");
+    perf_deferred = PerfCounter("screenrec.deferred");
+
+    // Records from the start if /screenrec.txt named a file
+    toggle_request = PrefsFindString("screenrec") != NULL;
+    if (xTaskCreatePinnedToCore(recorderTask, "ScreenRec", SCREENREC_TASK_STACK_SIZE, NULL,
+                                SCREENREC_TASK_PRIORITY, &recorder_task_handle,
+                                PrefsFindTaskCore("screenrec", SCREENREC_TASK_CORE)) != pdPASS) {
+        Serial.println("[SCREENREC] WARNING: recorder task not started, screen recording off");
+        recorder_task_handle = NULL;
+        toggle_request = false;
+    }
+}
+
+
+/*
+ *  Deinitialization: finish the recording
+ */
+
+void ScreenRecExit(void)
+{
+    if (recorder_task_handle == NULL) {
+        return;
+    }
+    exit_request = true;
+    xTaskNotifyGive(recorder_task_handle);
+    for (int i = 0; i < 200 && exit_request; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+void ScreenRecToggle(void)
+{
+    TaskHandle_t task = recorder_task_handle;
+    if (task) {
+        toggle_request = true;
+        xTaskNotifyGive(task);
+    }
+}
+
+#endif // SCREEN_RECORD
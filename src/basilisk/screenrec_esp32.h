@@ -0,0 +1,58 @@
+/*
+ *  screenrec_esp32.h - Screen recording to the SD card from the dirty tiles
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef SCREENREC_ESP32_H
+#define SCREENREC_ESP32_H
+
+#ifndef SCREEN_RECORD
+#define SCREEN_RECORD 0
+#endif
+
+#if SCREEN_RECORD
+
+// Words of the tile bitmap for the largest mode (as VNC_TILE_WORDS)
+#if VIDEO_TILE_GEOMETRY
+#define SCREENREC_TILE_WORDS    100
+#else
+#define SCREENREC_TILE_WORDS    18
+#endif
+
+// The shown frame, as the video task hands it to the recorder
+struct screenrec_frame {
+    const uint8 *pixels;        // Shown page of the Mac frame buffer
+    uint32 bytes_per_row;
+    int width, height;          // Mac pixels
+    int depth;                  // video_depth; VDEPTH_16BIT is host RGB565
+    int tile_width, tile_height;
+    int tiles_x, tiles_y;
+    const uint8 *palette;       // RGB888, indexed modes
+};
+
+// True while recording; the video task hands over each frame then
+extern volatile bool screenrec_active;
+
+// Tiles are still waiting for room in the ring: call again soon, even
+// with nothing dirty
+extern volatile bool screenrec_pending;
+
+/*
+ *  Video task: record the tiles dirty in this frame (NULL for none) and
+ *  those left over from earlier frames. Only copies them into a PSRAM
+ *  ring; the recorder task compresses and writes them.
+ */
+extern void ScreenRecFrame(const screenrec_frame &f, const uint32 *tiles);
+
+// Start the recorder task; records from the start if the "screenrec" pref
+// names a file (from /screenrec.txt)
+extern void ScreenRecInit(void);
+extern void ScreenRecExit(void);
+
+// Start or stop recording (Ctrl+Shift+Print Screen), any task
+extern void ScreenRecToggle(void);
+
+#endif
+
+#endif // SCREENREC_ESP32_H
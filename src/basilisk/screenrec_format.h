@@ -0,0 +1,67 @@
+/*
+ *  screenrec_format.h - Screen recording format (.rec), shared by the
+ *  recorder (screenrec_esp32.cpp) and the converter (tools/screenrec/screenrec.c)
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A recording is a header followed by records, each starting with a
+ *  screenrec_record and padded to a multiple of 4 bytes:
+ *
+ *    MODE      screen geometry (screenrec_mode); every tile of the frame
+ *              follows in the next FRAME records before the screen is whole
+ *    PALETTE   first entry, count, then count RGB888 triples: the entries
+ *              that changed since the last PALETTE record (indexed modes)
+ *    FRAME     a tile bitmap of (tiles_x * tiles_y + 31) / 32 words, bit
+ *              ty * tiles_x + tx, then for each set bit in order a 16-bit
+ *              length and that many bytes of LZ4 block, or with
+ *              SCREENREC_TILE_RAW the tile as is
+ *
+ *  A tile is tile_height rows of tile_width pixels in the frame buffer's own
+ *  layout: 1, 2, 4 or 8-bit palette indices, packed MSB first, or 16-bit
+ *  little-endian RGB565. Tiles the recorder couldn't keep up with are left
+ *  to a later FRAME, so a frame is the screen as of the last tile
+ *  recorded. All fields are little-endian.
+ */
+
+#ifndef SCREENREC_FORMAT_H
+#define SCREENREC_FORMAT_H
+
+#include <stdint.h>
+
+#define SCREENREC_MAGIC         "B2SCREC\n"
+#define SCREENREC_VERSION       1
+#define SCREENREC_TILE_RAW      0x8000
+
+enum {
+    SCREENREC_PAD = 0,          // Recorder internal, never in a file
+    SCREENREC_MODE = 1,
+    SCREENREC_PALETTE = 2,
+    SCREENREC_FRAME = 3
+};
+
+struct screenrec_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct screenrec_record {
+    uint32_t size;              // Bytes including this header
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t time_ms;           // Since the recording started
+};
+
+struct screenrec_mode {
+    uint16_t width, height;     // Mac pixels
+    uint16_t depth;             // Bits per pixel: 1, 2, 4, 8 or 16
+    uint16_t tile_width, tile_height;
+    uint16_t tiles_x, tiles_y;
+    uint16_t reserved;
+};
+
+typedef char screenrec_header_size_check[sizeof(struct screenrec_header) == 16 ? 1 : -1];
+typedef char screenrec_record_size_check[sizeof(struct screenrec_record) == 12 ? 1 : -1];
+typedef char screenrec_mode_size_check[sizeof(struct screenrec_mode) == 16 ? 1 : -1];
+
+#endif /* SCREENREC_FORMAT_H */
@@ -0,0 +1,601 @@
+/*
+ *  scsi_esp32.cpp - SCSI Manager backend for USB mass-storage devices
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Flash drives, card readers and USB CD-ROMs on the USB2 host port show
+ *  up as SCSI targets, in the order they are plugged in, from ID 0 up (the
+ *  Mac is ID 7). Commands go to them unchanged inside the Bulk-Only
+ *  Transport wrappers, so whatever Mac OS or a tool like SCSIProbe sends
+ *  works as long as the device understands it.
+ *
+ *  The USB host library is shared with the keyboard/mouse driver in
+ *  input_esp32.cpp, which installs it; this file registers a second
+ *  client that only claims mass-storage interfaces. scsi_send_cmd() hands
+ *  the command to the SCSI task on the I/O core and blocks until it is
+ *  done. The task moves the data in USB-sized chunks between the
+ *  transfer buffer and the Mac's S/G entries, with no staging copy of the
+ *  whole transfer in between.
+ */
+
+#include "sysdeps.h"
+
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "usb/usb_host.h"
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "prefs.h"
+#include "scsi.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define SCSI_MAX_TARGETS        7       // IDs 0..6, the Mac is 7
+#define SCSI_MAX_NEW_DEVICES    4       // Attach events kept until the task gets to them
+#define SCSI_XFER_SIZE          16384   // USB transfer buffer, a multiple of 512
+#define SCSI_MIN_TIMEOUT_MS     2000    // Many drivers ask for less than a flash drive needs
+#define SCSI_CONTROL_TIMEOUT_MS 1000
+#define SCSI_IDLE_TIMEOUT_MS    100
+
+#define SCSI_TASK_STACK_SIZE    4096
+#define SCSI_TASK_PRIORITY      2
+#define SCSI_TASK_CORE          0
+
+// USB mass storage, Bulk-Only Transport
+#define USB_CLASS_MASS_STORAGE  0x08
+#define MSC_PROTOCOL_BOT        0x50
+#define MSC_REQ_RESET           0xff
+#define MSC_REQ_GET_MAX_LUN     0xfe
+#define MSC_CBW_SIGNATURE       0x43425355  // "USBC"
+#define MSC_CSW_SIGNATURE       0x53425355  // "USBS"
+#define MSC_CBW_SIZE            31
+#define MSC_CSW_SIZE            13
+
+// SCSI status bytes
+#define SCSI_STATUS_GOOD        0x00
+#define SCSI_STATUS_CHECK       0x02
+
+// A claimed mass-storage interface
+struct msc_device {
+    usb_device_handle_t handle;
+    uint8 interface;
+    uint8 ep_in, ep_out;
+    uint16 mps_in;              // Bulk IN transfers are a multiple of this
+    uint8 max_lun;
+    volatile bool present;      // Read by the 68k thread
+    volatile bool gone;         // Unplugged, but not yet closed by the task
+};
+
+// The command being executed (the SCSI Manager runs one at a time)
+struct scsi_request {
+    int id, lun;
+    uint8 cdb[16];
+    int cdb_length;
+    bool reading;
+    uint32 data_length;
+    int sg_size;
+    uint8 **sg_ptr;
+    uint32 *sg_len;
+    uint32 timeout_ms;
+    uint16 status;              // SCSI status byte
+    bool success;
+};
+
+static msc_device targets[SCSI_MAX_TARGETS];
+static scsi_request request;
+static volatile bool request_pending = false;
+static SemaphoreHandle_t request_done = NULL;
+
+// Set by scsi_set_cmd()/scsi_set_target()
+static uint8 cmd_buffer[16];
+static int cmd_length = 0;
+static int active_id = -1, active_lun = 0;
+
+static usb_host_client_handle_t client = NULL;
+static usb_transfer_t *xfer = NULL;
+static volatile bool xfer_done = false;
+static uint32 cbw_tag = 0;
+
+// Attach events from the client callback
+static uint8 new_devices[SCSI_MAX_NEW_DEVICES];
+static volatile int new_device_count = 0;
+
+static TaskHandle_t scsi_task_handle = NULL;
+static volatile bool scsi_task_running = false;
+
+
+/*
+ *  USB transfers (SCSI task only)
+ */
+
+static void transfer_callback(usb_transfer_t *transfer)
+{
+    UNUSED(transfer);
+    xfer_done = true;
+}
+
+static void client_callback(const usb_host_client_event_msg_t *msg, void *arg)
+{
+    UNUSED(arg);
+    if (msg->event == USB_HOST_CLIENT_EVENT_NEW_DEV) {
+        if (new_device_count < SCSI_MAX_NEW_DEVICES) {
+            new_devices[new_device_count++] = msg->new_dev.address;
+        }
+    } else if (msg->event == USB_HOST_CLIENT_EVENT_DEV_GONE) {
+        for (int i = 0; i < SCSI_MAX_TARGETS; i++) {
+            if (targets[i].handle == msg->dev_gone.dev_hdl) {
+                targets[i].present = false;
+                targets[i].gone = true;
+            }
+        }
+    }
+}
+
+// Wait for the transfer in xfer, cancelling it after timeout_ms
+static usb_transfer_status_t transfer_wait(msc_device &d, uint8 ep, uint32 timeout_ms)
+{
+    uint32 start = millis();
+    while (!xfer_done) {
+        usb_host_client_handle_events(client, pdMS_TO_TICKS(10));
+        if (!xfer_done && (d.gone || millis() - start > timeout_ms)) {
+            usb_host_endpoint_halt(d.handle, ep);
+            usb_host_endpoint_flush(d.handle, ep);
+            while (!xfer_done) {
+                usb_host_client_handle_events(client, pdMS_TO_TICKS(10));
+            }
+            usb_host_endpoint_clear(d.handle, ep);
+            return USB_TRANSFER_STATUS_TIMED_OUT;
+        }
+    }
+    return xfer->status;
+}
+
+static usb_transfer_status_t bulk_transfer(msc_device &d, uint8 ep, uint32 length, uint32 timeout_ms)
+{
+    // IN transfers must cover whole packets
+    if (ep & 0x80) {
+        length = (length + d.mps_in - 1) / d.mps_in * d.mps_in;
+    }
+    xfer->device_handle = d.handle;
+    xfer->bEndpointAddress = ep;
+    xfer->num_bytes = length;
+    xfer->callback = transfer_callback;
+    xfer->context = NULL;
+    xfer_done = false;
+    if (usb_host_transfer_submit(xfer) != ESP_OK) {
+        return USB_TRANSFER_STATUS_ERROR;
+    }
+    return transfer_wait(d, ep, timeout_ms);
+}
+
+// Control transfer on endpoint 0, data (if any) follows the setup packet in xfer
+static usb_transfer_status_t control_transfer(msc_device &d, uint8 type, uint8 req,
+                                              uint16 value, uint16 index, uint16 length)
+{
+    usb_setup_packet_t *setup = (usb_setup_packet_t *)xfer->data_buffer;
+    setup->bmRequestType = type;
+    setup->bRequest = req;
+    setup->wValue = value;
+    setup->wIndex = index;
+    setup->wLength = length;
+    xfer->device_handle = d.handle;
+    xfer->bEndpointAddress = 0;
+    xfer->num_bytes = sizeof(usb_setup_packet_t) + length;
+    xfer->callback = transfer_callback;
+    xfer->context = NULL;
+    xfer_done = false;
+    if (usb_host_transfer_submit_control(client, xfer) != ESP_OK) {
+        return USB_TRANSFER_STATUS_ERROR;
+    }
+    return transfer_wait(d, 0, SCSI_CONTROL_TIMEOUT_MS);
+}
+
+static void clear_halt(msc_device &d, uint8 ep)
+{
+    usb_host_endpoint_clear(d.handle, ep);
+    control_transfer(d, 0x02, 0x01, 0, ep, 0);  // CLEAR_FEATURE(ENDPOINT_HALT)
+}
+
+// Bulk-Only Mass Storage Reset, after a phase error or a lost CSW
+static void reset_recovery(msc_device &d)
+{
+    Serial.printf("[SCSI] Resetting mass-storage interface %d\n", d.interface);
+    control_transfer(d, 0x21, MSC_REQ_RESET, 0, d.interface, 0);
+    clear_halt(d, d.ep_in);
+    clear_halt(d, d.ep_out);
+}
+
+
+/*
+ *  Attaching and detaching devices (SCSI task only)
+ */
+
+static void attach_device(uint8 address)
+{
+    usb_device_handle_t handle;
+    if (usb_host_device_open(client, address, &handle) != ESP_OK) {
+        return;
+    }
+
+    // Find a Bulk-Only mass-storage interface and its bulk endpoints
+    const usb_config_desc_t *config;
+    if (usb_host_get_active_config_descriptor(handle, &config) != ESP_OK) {
+        usb_host_device_close(client, handle);
+        return;
+    }
+    const uint8 *p = (const uint8 *)config;
+    int total = config->wTotalLength;
+    int interface = -1, alt = 0;
+    bool in_msc = false;
+    uint8 ep_in = 0, ep_out = 0;
+    uint16 mps_in = 0;
+    for (int i = 0; i + 2 <= total && p[i] >= 2; i += p[i]) {
+        if (p[i + 1] == USB_B_DESCRIPTOR_TYPE_INTERFACE && i + 9 <= total) {
+            if (interface >= 0) {
+                break;
+            }
+            in_msc = p[i + 5] == USB_CLASS_MASS_STORAGE && p[i + 7] == MSC_PROTOCOL_BOT;
+            if (in_msc) {
+                interface = p[i + 2];
+                alt = p[i + 3];
+            }
+        } else if (in_msc && p[i + 1] == USB_B_DESCRIPTOR_TYPE_ENDPOINT && i + 7 <= total &&
+                   (p[i + 3] & 0x03) == 0x02) {
+            if (p[i + 2] & 0x80) {
+                ep_in = p[i + 2];
+                mps_in = p[i + 4] | ((p[i + 5] & 0x07) << 8);
+            } else {
+                ep_out = p[i + 2];
+            }
+        }
+    }
+    if (interface < 0 || ep_in == 0 || ep_out == 0 || mps_in == 0) {
+        usb_host_device_close(client, handle);     // Not ours (keyboard, mouse, hub)
+        return;
+    }
+
+    int id = -1;
+    for (int i = 0; i < SCSI_MAX_TARGETS; i++) {
+        if (targets[i].handle == NULL) {
+            id = i;
+            break;
+        }
+    }
+    if (id < 0 || usb_host_interface_claim(client, handle, interface, alt) != ESP_OK) {
+        Serial.println("[SCSI] WARNING: mass-storage device not attached");
+        usb_host_device_close(client, handle);
+        return;
+    }
+
+    msc_device &d = targets[id];
+    d.handle = handle;
+    d.interface = interface;
+    d.ep_in = ep_in;
+    d.ep_out = ep_out;
+    d.mps_in = mps_in;
+    d.gone = false;
+
+    // Card readers have one LUN per slot; most devices STALL the request
+    d.max_lun = 0;
+    if (control_transfer(d, 0xa1, MSC_REQ_GET_MAX_LUN, 0, interface, 1) == USB_TRANSFER_STATUS_COMPLETED &&
+        xfer->actual_num_bytes > sizeof(usb_setup_packet_t)) {
+        d.max_lun = xfer->data_buffer[sizeof(usb_setup_packet_t)] & 7;
+    }
+
+    const usb_device_desc_t *desc;
+    uint16 vid = 0, pid = 0;
+    if (usb_host_get_device_descriptor(handle, &desc) == ESP_OK) {
+        vid = desc->idVendor;
+        pid = desc->idProduct;
+    }
+    d.present = true;
+    Serial.printf("[SCSI] USB mass storage %04x:%04x at SCSI ID %d (%d LUN%s)\n",
+                  vid, pid, id, d.max_lun + 1, d.max_lun ? "s" : "");
+}
+
+static void detach_device(int id)
+{
+    msc_device &d = targets[id];
+    d.present = false;
+    usb_host_interface_release(client, d.handle, d.interface);
+    usb_host_device_close(client, d.handle);
+    d.handle = NULL;
+    d.gone = false;
+    Serial.printf("[SCSI] SCSI ID %d removed\n", id);
+}
+
+
+/*
+ *  Command execution (SCSI task only)
+ */
+
+// Copy between the transfer buffer and the S/G list, advancing the cursor
+static void sg_copy(scsi_request &req, int &sg, uint32 &offset, uint8 *buf, uint32 length, bool to_mac)
+{
+    while (length > 0 && sg < req.sg_size) {
+        uint32 n = req.sg_len[sg] - offset;
+        if (n > length) {
+            n = length;
+        }
+        if (to_mac) {
+            memcpy(req.sg_ptr[sg] + offset, buf, n);
+        } else {
+            memcpy(buf, req.sg_ptr[sg] + offset, n);
+        }
+        buf += n;
+        length -= n;
+        offset += n;
+        if (offset == req.sg_len[sg]) {
+            sg++;
+            offset = 0;
+        }
+    }
+}
+
+static void run_request(scsi_request &req)
+{
+    req.success = false;
+    req.status = SCSI_STATUS_GOOD;
+    msc_device &d = targets[req.id];
+    if (!d.present) {
+        return;
+    }
+
+    // Command block wrapper
+    uint8 *cbw = xfer->data_buffer;
+    uint32 tag = ++cbw_tag;
+    memset(cbw, 0, MSC_CBW_SIZE);
+    cbw[0] = MSC_CBW_SIGNATURE & 0xff;
+    cbw[1] = (MSC_CBW_SIGNATURE >> 8) & 0xff;
+    cbw[2] = (MSC_CBW_SIGNATURE >> 16) & 0xff;
+    cbw[3] = MSC_CBW_SIGNATURE >> 24;
+    cbw[4] = tag & 0xff;
+    cbw[5] = (tag >> 8) & 0xff;
+    cbw[6] = (tag >> 16) & 0xff;
+    cbw[7] = tag >> 24;
+    cbw[8] = req.data_length & 0xff;
+    cbw[9] = (req.data_length >> 8) & 0xff;
+    cbw[10] = (req.data_length >> 16) & 0xff;
+    cbw[11] = req.data_length >> 24;
+    cbw[12] = (req.reading && req.data_length) ? 0x80 : 0x00;
+    cbw[13] = req.lun;
+    cbw[14] = req.cdb_length;
+    memcpy(cbw + 15, req.cdb, req.cdb_length);
+    if (bulk_transfer(d, d.ep_out, MSC_CBW_SIZE, req.timeout_ms) != USB_TRANSFER_STATUS_COMPLETED) {
+        reset_recovery(d);
+        return;
+    }
+
+    // Data, one transfer buffer at a time straight to/from the S/G entries
+    int sg = 0;
+    uint32 offset = 0;
+    uint32 remaining = req.data_length;
+    while (remaining > 0) {
+        uint32 chunk = remaining < SCSI_XFER_SIZE ? remaining : SCSI_XFER_SIZE;
+        usb_transfer_status_t status;
+        if (req.reading) {
+            status = bulk_transfer(d, d.ep_in, chunk, req.timeout_ms);
+            if (status == USB_TRANSFER_STATUS_COMPLETED) {
+                uint32 actual = xfer->actual_num_bytes < chunk ? xfer->actual_num_bytes : chunk;
+                sg_copy(req, sg, offset, xfer->data_buffer, actual, true);
+                if (actual < chunk) {
+                    break;      // Short packet, the device has no more data
+                }
+            }
+        } else {
+            sg_copy(req, sg, offset, xfer->data_buffer, chunk, false);
+            status = bulk_transfer(d, d.ep_out, chunk, req.timeout_ms);
+        }
+        if (status == USB_TRANSFER_STATUS_STALL) {
+            clear_halt(d, req.reading ? d.ep_in : d.ep_out);
+            break;          // The CSW tells what happened
+        } else if (status != USB_TRANSFER_STATUS_COMPLETED) {
+            reset_recovery(d);
+            return;
+        }
+        remaining -= chunk;
+    }
+
+    // Command status wrapper (retried once after a STALL)
+    usb_transfer_status_t status = bulk_transfer(d, d.ep_in, MSC_CSW_SIZE, req.timeout_ms);
+    if (status == USB_TRANSFER_STATUS_STALL) {
+        clear_halt(d, d.ep_in);
+        status = bulk_transfer(d, d.ep_in, MSC_CSW_SIZE, req.timeout_ms);
+    }
+    const uint8 *csw = xfer->data_buffer;
+    if (status != USB_TRANSFER_STATUS_COMPLETED || xfer->actual_num_bytes < MSC_CSW_SIZE ||
+        (csw[0] | (csw[1] << 8) | (csw[2] << 16) | ((uint32)csw[3] << 24)) != MSC_CSW_SIGNATURE ||
+        (csw[4] | (csw[5] << 8) | (csw[6] << 16) | ((uint32)csw[7] << 24)) != tag ||
+        csw[12] > 1) {
+        reset_recovery(d);
+        return;
+    }
+
+    // A failed command leaves sense data for the Mac's REQUEST SENSE
+    req.status = csw[12] ? SCSI_STATUS_CHECK : SCSI_STATUS_GOOD;
+    req.success = true;
+}
+
+static void scsiTask(void *param)
+{
+    UNUSED(param);
+
+    // The input driver installs the USB host library; wait for it
+    usb_host_client_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.is_synchronous = false;
+    config.max_num_event_msg = 5;
+    config.async.client_event_callback = client_callback;
+    config.async.callback_arg = NULL;
+    while (scsi_task_running && usb_host_client_register(&config, &client) != ESP_OK) {
+        vTaskDelay(pdMS_TO_TICKS(SCSI_IDLE_TIMEOUT_MS));
+    }
+    if (client && usb_host_transfer_alloc(SCSI_XFER_SIZE, 0, &xfer) != ESP_OK) {
+        Serial.println("[SCSI] WARNING: no USB transfer buffer, USB storage off");
+        xfer = NULL;
+    }
+
+    while (scsi_task_running) {
+        usb_host_client_handle_events(client, pdMS_TO_TICKS(SCSI_IDLE_TIMEOUT_MS));
+
+        while (new_device_count > 0 && xfer) {
+            attach_device(new_devices[--new_device_count]);
+        }
+        for (int i = 0; i < SCSI_MAX_TARGETS; i++) {
+            if (targets[i].gone) {
+                detach_device(i);
+            }
+        }
+
+        if (request_pending) {
+            if (xfer) {
+                run_request(request);
+            } else {
+                request.success = false;
+            }
+            request_pending = false;
+            xSemaphoreGive(request_done);
+        }
+    }
+
+    if (client) {
+        for (int i = 0; i < SCSI_MAX_TARGETS; i++) {
+            if (targets[i].handle) {
+                detach_device(i);
+            }
+        }
+        if (xfer) {
+            usb_host_transfer_free(xfer);
+            xfer = NULL;
+        }
+        usb_host_client_deregister(client);
+        client = NULL;
+    }
+    vTaskDelete(NULL);
+}
+
+
+/*
+ *  Initialization
+ */
+
+void SCSIInit(void)
+{
+    // Reset SCSI bus
+    SCSIReset();
+
+    memset(targets, 0, sizeof(targets));
+    if (!PrefsFindBool("scsiusb")) {
+        return;
+    }
+
+    request_done = xSemaphoreCreateBinary();
+    if (request_done == NULL) {
+        Serial.println("[SCSI] WARNING: no semaphore, USB storage off");
+        return;
+    }
+    scsi_task_running = true;
+    if (xTaskCreatePinnedToCore(scsiTask, "SCSITask", SCSI_TASK_STACK_SIZE, NULL,
+                                SCSI_TASK_PRIORITY, &scsi_task_handle,
+                                PrefsFindTaskCore("diskio", SCSI_TASK_CORE)) != pdPASS) {
+        Serial.println("[SCSI] WARNING: SCSI task not started, USB storage off");
+        scsi_task_running = false;
+        scsi_task_handle = NULL;
+        return;
+    }
+    Serial.println("[SCSI] USB mass-storage devices will appear as SCSI IDs 0-6");
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void SCSIExit(void)
+{
+    if (scsi_task_running) {
+        scsi_task_running = false;
+        if (client) {
+            usb_host_client_unblock(client);
+        }
+        vTaskDelay(pdMS_TO_TICKS(2 * SCSI_IDLE_TIMEOUT_MS));
+        scsi_task_handle = NULL;
+    }
+}
+
+
+/*
+ *  Set SCSI command to be sent by scsi_send_cmd()
+ */
+
+void scsi_set_cmd(int cmd_length_, uint8 *cmd)
+{
+    cmd_length = cmd_length_ < 16 ? cmd_length_ : 16;
+    memcpy(cmd_buffer, cmd, cmd_length);
+}
+
+
+/*
+ *  Check for presence of SCSI target
+ */
+
+bool scsi_is_target_present(int id)
+{
+    return id >= 0 && id < SCSI_MAX_TARGETS && targets[id].present;
+}
+
+
+/*
+ *  Set SCSI target (returns false on error)
+ */
+
+bool scsi_set_target(int id, int lun)
+{
+    if (!scsi_is_target_present(id) || lun > targets[id].max_lun) {
+        return false;
+    }
+    active_id = id;
+    active_lun = lun;
+    return true;
+}
+
+
+/*
+ *  Send SCSI command to active target (scsi_set_command() must have been called),
+ *  read/write data according to S/G table (returns false on error)
+ */
+
+bool scsi_send_cmd(size_t data_length, bool reading, int sg_size, uint8 **sg_ptr, uint32 *sg_len, uint16 *stat, uint32 timeout)
+{
+    if (!scsi_task_running || !scsi_is_target_present(active_id)) {
+        return false;
+    }
+
+    request.id = active_id;
+    request.lun = active_lun;
+    memcpy(request.cdb, cmd_buffer, cmd_length);
+    request.cdb_length = cmd_length;
+    request.reading = reading;
+    request.data_length = data_length;
+    request.sg_size = sg_size;
+    request.sg_ptr = sg_ptr;
+    request.sg_len = sg_len;
+    request.timeout_ms = timeout * 1000 / 60;   // Ticks
+    if (request.timeout_ms < SCSI_MIN_TIMEOUT_MS) {
+        request.timeout_ms = SCSI_MIN_TIMEOUT_MS;
+    }
+
+    // The SCSI task enforces the timeout, so it always answers
+    request_pending = true;
+    usb_host_client_unblock(client);
+    xSemaphoreTake(request_done, portMAX_DELAY);
+
+    D(bug("[SCSI] cmd %02x id %d: %s, status %02x\n", request.cdb[0], request.id,
+          request.success ? "ok" : "failed", request.status));
+    *stat = request.status;
+    return request.success;
+}
@@ -0,0 +1,420 @@
+/*
+ *  sd_esp32.cpp - SD card bring-up and file system access for ESP32
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The Tab5 microSD slot is wired to the ESP32-P4 SDMMC slot 0 pins, so the
+ *  card is mounted through the native SDMMC host (4-bit, high speed) and
+ *  ESP-IDF's FAT VFS. If that fails, the old SPI mode at 25 MHz is used.
+ *  Everything else reaches the card through SDCardFS(), the same fs::FS
+ *  interface either way.
+ *  
+ *  In SDMMC mode, disk images also get a sector map (SDExtentMapBuild) so
+ *  their I/O seeks in O(log runs) instead of walking the FAT chain, and
+ *  whole sectors are DMAed between the card and Mac RAM directly.
+ */
+
+#include "sysdeps.h"
+#include "sd_esp32.h"
+
+#include <SPI.h>
+#include <SD.h>
+#include "vfs_api.h"
+
+#include "esp_vfs_fat.h"
+#include "sdmmc_cmd.h"
+#include "driver/sdmmc_host.h"
+#include "diskio_sdmmc.h"
+#include "esp_heap_caps.h"
+#include "ff.h"
+#include "soc/soc_caps.h"
+#if SOC_SDMMC_IO_POWER_EXTERNAL
+#include "sd_pwr_ctrl_by_on_chip_ldo.h"
+#endif
+
+// M5Stack Tab5 SD card pins (ESP32-P4 SDMMC slot 0 IOMUX pins)
+#define SD_SPI_SCK   43     // SDMMC CLK
+#define SD_SPI_MOSI  44     // SDMMC CMD
+#define SD_SPI_MISO  39     // SDMMC D0
+#define SD_SPI_CS    42     // SDMMC D3
+
+#define SD_MAX_FILES    20          // Disk images, ROM, XPRAM, settings, ExtFS forks
+#define SD_SECTOR_SIZE  512
+
+// SDMMC bus clock [kHz]; the card may negotiate lower
+#ifndef SD_MMC_FREQ_KHZ
+#define SD_MMC_FREQ_KHZ SDMMC_FREQ_HIGHSPEED
+#endif
+
+// On-chip LDO channel powering the SDMMC slot 0 I/O domain, -1 = none
+#ifndef SD_MMC_LDO_CHAN
+#define SD_MMC_LDO_CHAN 4
+#endif
+
+/*
+ *  fs::FS over the FAT VFS mounted by esp_vfs_fat_sdmmc_mount()
+ */
+class SDMMCCard : public fs::FS {
+public:
+    SDMMCCard() : fs::FS(fs::FSImplPtr(new VFSImpl())), card(NULL) {}
+    
+    bool begin(void);
+    
+    sdmmc_card_t *card;
+};
+
+static SDMMCCard sdmmc_card;
+static bool use_sdmmc = false;
+
+bool SDMMCCard::begin(void)
+{
+    sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+    host.slot = SDMMC_HOST_SLOT_0;
+    host.max_freq_khz = SD_MMC_FREQ_KHZ;
+    
+#if SOC_SDMMC_IO_POWER_EXTERNAL
+    if (SD_MMC_LDO_CHAN >= 0) {
+        sd_pwr_ctrl_ldo_config_t ldo_config = {};
+        ldo_config.ldo_chan_id = SD_MMC_LDO_CHAN;
+        sd_pwr_ctrl_handle_t pwr_ctrl = NULL;
+        if (sd_pwr_ctrl_new_on_chip_ldo(&ldo_config, &pwr_ctrl) != ESP_OK) {
+            Serial.println("[SD] WARNING: SDMMC LDO power control not available");
+        }
+        host.pwr_ctrl_handle = pwr_ctrl;
+    }
+#endif
+    
+    sdmmc_slot_config_t slot = SDMMC_SLOT_CONFIG_DEFAULT();
+    slot.width = 4;
+    slot.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+    
+    esp_vfs_fat_sdmmc_mount_config_t mount_config = {};
+    mount_config.format_if_mount_failed = false;
+    mount_config.max_files = SD_MAX_FILES;
+    mount_config.allocation_unit_size = 0;
+    
+    esp_err_t err = esp_vfs_fat_sdmmc_mount(SD_MOUNT_POINT, &host, &slot, &mount_config, &card);
+    if (err != ESP_OK) {
+        Serial.printf("[SD] SDMMC mount failed: %s\n", esp_err_to_name(err));
+        card = NULL;
+        return false;
+    }
+    
+    _impl->mountpoint(SD_MOUNT_POINT);
+    return true;
+}
+
+/*
+ *  Mount the card, SDMMC first
+ */
+bool SDCardBegin(void)
+{
+    if (sdmmc_card.begin()) {
+        use_sdmmc = true;
+        sdmmc_card_t *card = sdmmc_card.card;
+        Serial.printf("[SD] SDMMC %d-bit bus, %d kHz%s (max %d kHz)\n",
+                      1 << card->log_bus_width, card->real_freq_khz,
+                      card->is_ddr ? " DDR" : "", card->max_freq_khz);
+        return true;
+    }
+    
+    Serial.println("[SD] Falling back to SPI mode");
+    Serial.printf("[SD] SPI pins: SCK=%d, MOSI=%d, MISO=%d, CS=%d\n",
+                  SD_SPI_SCK, SD_SPI_MOSI, SD_SPI_MISO, SD_SPI_CS);
+    SPI.begin(SD_SPI_SCK, SD_SPI_MISO, SD_SPI_MOSI, SD_SPI_CS);
+    if (!SD.begin(SD_SPI_CS, SPI, 25000000, SD_MOUNT_POINT, SD_MAX_FILES)) {
+        return false;
+    }
+    Serial.println("[SD] SPI 1-bit bus, 25000 kHz");
+    return true;
+}
+
+/*
+ *  File system of the mounted card
+ */
+fs::FS &SDCardFS(void)
+{
+    if (use_sdmmc) {
+        return sdmmc_card;
+    }
+    return SD;
+}
+
+/*
+ *  Card capacity in bytes
+ */
+uint64_t SDCardSize(void)
+{
+    if (use_sdmmc) {
+        return (uint64_t)sdmmc_card.card->csd.capacity * sdmmc_card.card->csd.sector_size;
+    }
+    return SD.cardSize();
+}
+
+/*
+ *  Free space on the card in bytes
+ */
+uint64_t SDCardFreeBytes(void)
+{
+    if (use_sdmmc) {
+        char drive[8];
+        snprintf(drive, sizeof(drive), "%d:", (int)ff_diskio_get_pdrv_card(sdmmc_card.card));
+        DWORD free_clusters;
+        FATFS *fs;
+        if (f_getfree(drive, &free_clusters, &fs) != FR_OK) {
+            return 0;
+        }
+        return (uint64_t)free_clusters * fs->csize * SD_SECTOR_SIZE;
+    }
+    return SD.totalBytes() - SD.usedBytes();
+}
+
+/*
+ *  FATFS path of a file on the card (SDMMC only)
+ */
+bool SDFatPath(const char *path, char *fpath, size_t size)
+{
+    if (!use_sdmmc) return false;
+    return snprintf(fpath, size, "%d:%s", (int)ff_diskio_get_pdrv_card(sdmmc_card.card), path) < (int)size;
+}
+
+/*
+ *  Whole-card sector access (SDMMC only)
+ */
+uint32_t SDCardSectors(void)
+{
+    if (!use_sdmmc) return 0;
+    return sdmmc_card.card->csd.capacity;
+}
+
+bool SDCardTransfer(void *buf, uint32_t sector, uint32_t count, bool write)
+{
+    if (!use_sdmmc) return false;
+    esp_err_t err = write ? sdmmc_write_sectors(sdmmc_card.card, buf, sector, count)
+                          : sdmmc_read_sectors(sdmmc_card.card, buf, sector, count);
+    return err == ESP_OK;
+}
+
+// ============================================================================
+// Extent maps
+// ============================================================================
+
+struct sd_extent {
+    uint32 file_sector;     // First file sector of the run
+    uint32 card_sector;     // Where it is on the card
+    uint32 count;           // Sectors in the run
+};
+
+struct sd_extent_map {
+    sd_extent *extents;     // Sorted by file_sector
+    int count;
+    uint32 sectors;         // File size in sectors (rounded down)
+};
+
+/*
+ *  Walk the cluster chain of a file and merge consecutive clusters into runs
+ */
+sd_extent_map *SDExtentMapBuild(const char *path)
+{
+    if (!use_sdmmc) return NULL;
+    
+    // FATFS path on the logical drive the card was mounted as
+    char fpath[300];
+    snprintf(fpath, sizeof(fpath), "%d:%s", (int)ff_diskio_get_pdrv_card(sdmmc_card.card), path);
+    
+    FIL fil;
+    if (f_open(&fil, fpath, FA_READ) != FR_OK) {
+        return NULL;
+    }
+    
+    FATFS *fs = fil.obj.fs;
+    FSIZE_t size = f_size(&fil);
+    uint32 cluster_bytes = (uint32)fs->csize * SD_SECTOR_SIZE;
+    int capacity = 16;
+    sd_extent_map *map = (sd_extent_map *)malloc(sizeof(sd_extent_map));
+    sd_extent *ext = (sd_extent *)ps_malloc(capacity * sizeof(sd_extent));
+    if (!map || !ext) {
+        free(map);
+        free(ext);
+        f_close(&fil);
+        return NULL;
+    }
+    
+    // Forward seeks continue from the current cluster, so the walk is one
+    // pass over the FAT; seek one byte into each cluster to land inside it
+    int n = 0;
+    DWORD prev = 0;
+    bool ok = true;
+    for (FSIZE_t ofs = 0; ofs < size; ofs += cluster_bytes) {
+        if (f_lseek(&fil, ofs + 1) != FR_OK || fil.clust < 2) {
+            ok = false;
+            break;
+        }
+        DWORD clust = fil.clust;
+        uint32 sectors = fs->csize;
+        if (n > 0 && clust == prev + 1) {
+            ext[n - 1].count += sectors;
+        } else {
+            if (n == capacity) {
+                capacity *= 2;
+                sd_extent *grown = (sd_extent *)ps_malloc(capacity * sizeof(sd_extent));
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                memcpy(grown, ext, n * sizeof(sd_extent));
+                free(ext);
+                ext = grown;
+            }
+            ext[n].file_sector = (uint32)(ofs / SD_SECTOR_SIZE);
+            ext[n].card_sector = (uint32)(fs->database + (LBA_t)fs->csize * (clust - 2));
+            ext[n].count = sectors;
+            n++;
+        }
+        prev = clust;
+    }
+    f_close(&fil);
+    
+    if (!ok || n == 0) {
+        free(ext);
+        free(map);
+        return NULL;
+    }
+    
+    map->extents = ext;
+    map->count = n;
+    map->sectors = (uint32)(size / SD_SECTOR_SIZE);
+    Serial.printf("[SD] %s: %d extent%s\n", path, n, n == 1 ? "" : "s");
+    return map;
+}
+
+void SDExtentMapFree(sd_extent_map *map)
+{
+    if (!map) return;
+    free(map->extents);
+    free(map);
+}
+
+/*
+ *  Find the run holding a file sector (binary search)
+ */
+static const sd_extent *find_extent(sd_extent_map *map, uint32 sector)
+{
+    int lo = 0, hi = map->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (map->extents[mid].file_sector <= sector) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &map->extents[lo];
+}
+
+/*
+ *  Check that a byte range lies within the mapped sectors
+ */
+bool SDExtentCovers(sd_extent_map *map, uint64_t offset, size_t length)
+{
+    return offset + length <= (uint64_t)map->sectors * SD_SECTOR_SIZE;
+}
+
+/*
+ *  Transfer whole sectors, one SDMMC command per run touched
+ */
+static bool transfer_sectors(sd_extent_map *map, uint8 *buf, uint32 sector, uint32 count, bool write)
+{
+    while (count > 0) {
+        const sd_extent *e = find_extent(map, sector);
+        uint32 in_run = sector - e->file_sector;
+        uint32 n = e->count - in_run;
+        if (n > count) n = count;
+        esp_err_t err = write ? sdmmc_write_sectors(sdmmc_card.card, buf, e->card_sector + in_run, n)
+                              : sdmmc_read_sectors(sdmmc_card.card, buf, e->card_sector + in_run, n);
+        if (err != ESP_OK) {
+            return false;
+        }
+        buf += n * SD_SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    return true;
+}
+
+/*
+ *  Sector buffer for partial-sector transfers (DMA-capable internal RAM)
+ */
+static uint8 *bounce_sector(void)
+{
+    static uint8 *bounce = NULL;
+    if (!bounce) {
+        bounce = (uint8 *)heap_caps_aligned_alloc(64, SD_SECTOR_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    }
+    return bounce;
+}
+
+/*
+ *  Read a mapped byte range: whole sectors straight into dst, partial
+ *  sectors at either end through the bounce sector
+ */
+bool SDExtentRead(sd_extent_map *map, void *dst, uint64_t offset, size_t length)
+{
+    if (!SDExtentCovers(map, offset, length)) {
+        return false;
+    }
+    
+    uint8 *p = (uint8 *)dst;
+    while (length > 0) {
+        uint32 sector = (uint32)(offset / SD_SECTOR_SIZE);
+        size_t in_sector = (size_t)(offset % SD_SECTOR_SIZE);
+        size_t n;
+        if (in_sector == 0 && length >= SD_SECTOR_SIZE) {
+            n = length & ~(size_t)(SD_SECTOR_SIZE - 1);
+            if (!transfer_sectors(map, p, sector, n / SD_SECTOR_SIZE, false)) return false;
+        } else {
+            uint8 *bounce = bounce_sector();
+            n = SD_SECTOR_SIZE - in_sector;
+            if (n > length) n = length;
+            if (!bounce || !transfer_sectors(map, bounce, sector, 1, false)) return false;
+            memcpy(p, bounce + in_sector, n);
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+ *  Write a mapped byte range; partial sectors are read, patched and
+ *  written back
+ */
+bool SDExtentWrite(sd_extent_map *map, const void *src, uint64_t offset, size_t length)
+{
+    if (!SDExtentCovers(map, offset, length)) {
+        return false;
+    }
+    
+    const uint8 *p = (const uint8 *)src;
+    while (length > 0) {
+        uint32 sector = (uint32)(offset / SD_SECTOR_SIZE);
+        size_t in_sector = (size_t)(offset % SD_SECTOR_SIZE);
+        size_t n;
+        if (in_sector == 0 && length >= SD_SECTOR_SIZE) {
+            n = length & ~(size_t)(SD_SECTOR_SIZE - 1);
+            if (!transfer_sectors(map, (uint8 *)p, sector, n / SD_SECTOR_SIZE, true)) return false;
+        } else {
+            uint8 *bounce = bounce_sector();
+            n = SD_SECTOR_SIZE - in_sector;
+            if (n > length) n = length;
+            if (!bounce || !transfer_sectors(map, bounce, sector, 1, false)) return false;
+            memcpy(bounce + in_sector, p, n);
+            if (!transfer_sectors(map, bounce, sector, 1, true)) return false;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
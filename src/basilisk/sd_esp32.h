@@ -0,0 +1,56 @@
+/*
+ *  sd_esp32.h - SD card bring-up and file system access for ESP32
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef SD_ESP32_H
+#define SD_ESP32_H
+
+#include <FS.h>
+
+// VFS mount point of the card, for POSIX file access
+#define SD_MOUNT_POINT  "/sd"
+
+// Mount the card: native SDMMC host in 4-bit mode, SPI as fallback
+extern bool SDCardBegin(void);
+
+// File system on the mounted card (use instead of SD / SD_MMC)
+extern fs::FS &SDCardFS(void);
+
+// Card capacity and free space in bytes
+extern uint64_t SDCardSize(void);
+extern uint64_t SDCardFreeBytes(void);
+
+// Turn a path on the card into a path for the FATFS API (f_opendir() etc.),
+// false if FATFS can't be used directly (SPI mode)
+extern bool SDFatPath(const char *path, char *fpath, size_t size);
+
+// Raw 512-byte sectors of the whole card (SDMMC only, 0 / false in SPI
+// mode); nothing may use the file system while something else writes them
+extern uint32_t SDCardSectors(void);
+extern bool SDCardTransfer(void *buf, uint32_t sector, uint32_t count, bool write);
+
+/*
+ *  Sector map of a file on the card (SDMMC only): built once from the FAT
+ *  cluster chain, it turns a file offset into a card sector in O(log runs)
+ *  and lets reads and writes go straight to the card with sector DMA,
+ *  bypassing FATFS and stdio. A mapped range must only be accessed through
+ *  the map; the map covers the whole sectors of the file as opened, so
+ *  it has to be dropped if the file grows.
+ */
+struct sd_extent_map;
+
+// Build the map of a closed file, NULL if not possible (SPI mode, error)
+extern sd_extent_map *SDExtentMapBuild(const char *path);
+extern void SDExtentMapFree(sd_extent_map *map);
+
+// Check that a byte range lies within the mapped sectors
+extern bool SDExtentCovers(sd_extent_map *map, uint64_t offset, size_t length);
+
+// Read/write a mapped byte range; partial sectors go through a bounce
+// sector (callers serialise access)
+extern bool SDExtentRead(sd_extent_map *map, void *dst, uint64_t offset, size_t length);
+extern bool SDExtentWrite(sd_extent_map *map, const void *src, uint64_t offset, size_t length);
+
+#endif /* SD_ESP32_H */
@@ -0,0 +1,530 @@
+/*
+ *  serial_esp32.cpp - Serial device driver for ESP32
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The "seriala" (modem) and "serialb" (printer) prefs pick the device
+ *  behind each Mac port:
+ *    "usb"            the USB-C CDC port (shared with the log output)
+ *    "uart[:tx,rx]"   UART1, by default on the Grove Port A pins
+ *    "" (or unset)    no device; writes are dropped, reads return nothing
+ *
+ *  The UART and CDC drivers buffer both directions in interrupt/DMA-fed
+ *  rings, so Prime() normally completes at once by copying between a ring
+ *  and the Mac buffer in one block. A read that wants more than has
+ *  arrived (or a write larger than the free TX space) is left pending;
+ *  the serial task on Core 0 finishes it straight into/from Mac RAM and
+ *  raises INTFLAG_SERIAL, and SerialInterrupt() completes it with IODone.
+ */
+
+#include "sysdeps.h"
+
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "macos_util.h"
+#include "prefs.h"
+#include "serial.h"
+#include "serial_defs.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define SERIAL_UART_TX          53      // Grove Port A
+#define SERIAL_UART_RX          54
+#define SERIAL_RING_SIZE        4096    // Driver RX and TX rings
+#define SERIAL_DEFAULT_BAUD     9600
+
+#define SERIAL_TASK_STACK_SIZE  3072
+#define SERIAL_TASK_PRIORITY    2
+#define SERIAL_TASK_CORE        0
+#define SERIAL_IDLE_TIMEOUT_MS  100     // Backstop wake-up with nothing pending
+
+
+// Pending Prime() request, finished by the serial task
+struct serial_request {
+    uint32 pb;
+    uint32 dce;
+    uint32 buffer;          // Mac address
+    uint32 length;
+    uint32 actual;          // Bytes transferred so far
+};
+
+class ESP32SERDPort : public SERDPort {
+public:
+    ESP32SERDPort(const char *dev);
+    virtual ~ESP32SERDPort() {}
+
+    virtual int16 open(uint16 config);
+    virtual int16 prime_in(uint32 pb, uint32 dce);
+    virtual int16 prime_out(uint32 pb, uint32 dce);
+    virtual int16 control(uint32 pb, uint32 dce, uint16 code);
+    virtual int16 status(uint32 pb, uint32 dce, uint16 code);
+    virtual int16 close(void);
+
+    bool service(void);     // Called by the serial task, true if a request is still pending
+
+private:
+    bool configure(uint16 config);
+    void complete(serial_request &req, uint32 dt, volatile bool &done);
+
+    const char *device;
+    Stream *stream;         // NULL = no device
+    HardwareSerial *uart;   // Set for the UART, which has a line format
+    int tx_pin, rx_pin;
+    uint32 baud;
+    uint32 format;          // Arduino SERIAL_* line format
+
+    SemaphoreHandle_t lock; // Held by whoever touches the requests and the rings
+    serial_request read_req;
+    serial_request write_req;
+};
+
+static ESP32SERDPort *ports[2];
+static TaskHandle_t serial_task_handle = NULL;
+static volatile bool serial_task_running = false;
+
+
+/*
+ *  Serial task: finish pending requests
+ */
+
+static void serialTask(void *param)
+{
+    UNUSED(param);
+    Serial.printf("[SERIAL] Serial task started on Core %d\n", xPortGetCoreID());
+
+    while (serial_task_running) {
+        bool pending = false;
+        for (int i = 0; i < 2; i++) {
+            if (ports[i]->service()) {
+                pending = true;
+            }
+        }
+        if (pending) {
+            vTaskDelay(1);
+        } else {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SERIAL_IDLE_TIMEOUT_MS));
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+static void wake_serial_task(void)
+{
+    if (serial_task_handle) {
+        xTaskNotifyGive(serial_task_handle);
+    }
+}
+
+
+/*
+ *  Initialization
+ */
+
+void SerialInit(void)
+{
+    ports[0] = new ESP32SERDPort(PrefsFindString("seriala"));
+    ports[1] = new ESP32SERDPort(PrefsFindString("serialb"));
+    the_serd_port[0] = ports[0];
+    the_serd_port[1] = ports[1];
+
+    serial_task_running = true;
+    if (xTaskCreatePinnedToCore(serialTask, "SerialTask", SERIAL_TASK_STACK_SIZE, NULL,
+                                SERIAL_TASK_PRIORITY, &serial_task_handle,
+                                PrefsFindTaskCore("serial", SERIAL_TASK_CORE)) != pdPASS) {
+        Serial.println("[SERIAL] WARNING: serial task not started, long transfers will stall");
+        serial_task_running = false;
+        serial_task_handle = NULL;
+    }
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void SerialExit(void)
+{
+    if (serial_task_running) {
+        serial_task_running = false;
+        wake_serial_task();
+        vTaskDelay(pdMS_TO_TICKS(20));
+        serial_task_handle = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (ports[i]) {
+            ports[i]->close();
+        }
+    }
+}
+
+
+/*
+ *  ESP32SERDPort
+ */
+
+ESP32SERDPort::ESP32SERDPort(const char *dev)
+{
+    device = dev ? dev : "";
+    stream = NULL;
+    uart = NULL;
+    tx_pin = SERIAL_UART_TX;
+    rx_pin = SERIAL_UART_RX;
+    baud = SERIAL_DEFAULT_BAUD;
+    format = SERIAL_8N1;
+    lock = xSemaphoreCreateMutex();
+    read_pending = write_pending = false;
+    read_done = write_done = false;
+}
+
+
+/*
+ *  Open serial port
+ */
+
+int16 ESP32SERDPort::open(uint16 config)
+{
+    if (strcmp(device, "usb") == 0) {
+        // The CDC port is up from boot (the log uses it); baud rate and
+        // line format mean nothing on it
+        stream = &Serial;
+    } else if (strncmp(device, "uart", 4) == 0) {
+        if (device[4] == ':') {
+            sscanf(device + 5, "%d,%d", &tx_pin, &rx_pin);
+        }
+        uart = &Serial1;
+        uart->setRxBufferSize(SERIAL_RING_SIZE);
+        uart->setTxBufferSize(SERIAL_RING_SIZE);
+        configure(config);
+        stream = uart;
+    }
+    Serial.printf("[SERIAL] Port %c open on %s\n", this == ports[0] ? 'A' : 'B',
+                  device[0] ? device : "nothing");
+    return noErr;
+}
+
+
+/*
+ *  Set baud rate and line format from a Mac serial configuration word
+ */
+
+bool ESP32SERDPort::configure(uint16 config)
+{
+    // Mac rates are 115200 / (n + 2): 10 = 9600, 0 = 57600
+    baud = 115200 / ((config & 0x3ff) + 2);
+
+    // Arduino's SERIAL_* layout: data bits - 5 in bits 2-3, parity (0 =
+    // none, 2 = even, 3 = odd) in bits 0-1, stop bits (1 = 1, 2 = 1.5,
+    // 3 = 2) in bits 4-5
+    uint32 data_bits;
+    switch (config & 0x0c00) {
+        case data5: data_bits = 0; break;
+        case data6: data_bits = 1; break;
+        case data7: data_bits = 2; break;
+        default:    data_bits = 3; break;
+    }
+    uint32 parity;
+    switch (config & 0x3000) {
+        case evenParity: parity = 2; break;
+        case oddParity:  parity = 3; break;
+        default:         parity = 0; break;
+    }
+    uint32 stop_bits;
+    switch (config & 0xc000) {
+        case stop15: stop_bits = 2; break;
+        case stop20: stop_bits = 3; break;
+        default:     stop_bits = 1; break;
+    }
+    format = 0x8000000 | (stop_bits << 4) | (data_bits << 2) | parity;
+
+    if (uart == NULL) {
+        return true;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uart->end();
+    uart->begin(baud, format, rx_pin, tx_pin);
+    xSemaphoreGive(lock);
+    D(bug("[SERIAL] %u baud, format %08x\n", baud, format));
+    return true;
+}
+
+
+/*
+ *  Complete a pending request (serial task, lock held)
+ */
+
+void ESP32SERDPort::complete(serial_request &req, uint32 dt, volatile bool &done)
+{
+    WriteMacInt32(req.pb + ioActCount, req.actual);
+    WriteMacInt32(dt + serdtResult, noErr);
+    WriteMacInt32(dt + serdtDCE, req.dce);
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    SetInterruptFlag(INTFLAG_SERIAL);
+    TriggerInterrupt();
+}
+
+
+/*
+ *  Move data for the pending requests (serial task)
+ */
+
+bool ESP32SERDPort::service(void)
+{
+    if (!is_open || stream == NULL || (!read_pending && !write_pending)) {
+        return false;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (read_pending && !read_done) {
+        int avail = stream->available();
+        if (avail > 0) {
+            uint32 n = read_req.length - read_req.actual;
+            if ((uint32)avail < n) {
+                n = avail;
+            }
+            read_req.actual += stream->readBytes(Mac2HostAddr(read_req.buffer + read_req.actual), n);
+            if (read_req.actual == read_req.length) {
+                complete(read_req, input_dt, read_done);
+            }
+        }
+    }
+    if (write_pending && !write_done) {
+        int room = stream->availableForWrite();
+        if (room > 0) {
+            uint32 n = write_req.length - write_req.actual;
+            if ((uint32)room < n) {
+                n = room;
+            }
+            write_req.actual += stream->write(Mac2HostAddr(write_req.buffer + write_req.actual), n);
+            if (write_req.actual == write_req.length) {
+                complete(write_req, output_dt, write_done);
+            }
+        }
+    }
+    bool pending = (read_pending && !read_done) || (write_pending && !write_done);
+    xSemaphoreGive(lock);
+    return pending;
+}
+
+
+/*
+ *  Read data from port
+ */
+
+int16 ESP32SERDPort::prime_in(uint32 pb, uint32 dce)
+{
+    // Take what has arrived already
+    uint32 length = ReadMacInt32(pb + ioReqCount);
+    uint32 buffer = ReadMacInt32(pb + ioBuffer);
+    uint32 actual = 0;
+    if (stream == NULL) {
+        WriteMacInt32(pb + ioActCount, 0);
+        return noErr;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int avail = stream->available();
+    if (avail > 0) {
+        actual = (uint32)avail < length ? avail : length;
+        actual = stream->readBytes(Mac2HostAddr(buffer), actual);
+    }
+    if (actual == length) {
+        xSemaphoreGive(lock);
+        WriteMacInt32(pb + ioActCount, actual);
+        return noErr;
+    }
+
+    // Wait for the rest in the serial task
+    read_req.pb = pb;
+    read_req.dce = dce;
+    read_req.buffer = buffer;
+    read_req.length = length;
+    read_req.actual = actual;
+    read_done = false;
+    read_pending = true;
+    xSemaphoreGive(lock);
+    wake_serial_task();
+    return 1;   // Request in progress, IODone comes from SerialInterrupt()
+}
+
+
+/*
+ *  Write data to port
+ */
+
+int16 ESP32SERDPort::prime_out(uint32 pb, uint32 dce)
+{
+    uint32 length = ReadMacInt32(pb + ioReqCount);
+    uint32 buffer = ReadMacInt32(pb + ioBuffer);
+    if (stream == NULL) {
+        WriteMacInt32(pb + ioActCount, length);
+        return noErr;
+    }
+
+    // Hand as much as fits to the TX ring
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32 actual = 0;
+    int room = stream->availableForWrite();
+    if (room > 0) {
+        actual = (uint32)room < length ? room : length;
+        actual = stream->write(Mac2HostAddr(buffer), actual);
+    }
+    if (actual == length) {
+        xSemaphoreGive(lock);
+        WriteMacInt32(pb + ioActCount, actual);
+        return noErr;
+    }
+
+    // Feed the rest from the serial task
+    write_req.pb = pb;
+    write_req.dce = dce;
+    write_req.buffer = buffer;
+    write_req.length = length;
+    write_req.actual = actual;
+    write_done = false;
+    write_pending = true;
+    xSemaphoreGive(lock);
+    wake_serial_task();
+    return 1;
+}
+
+
+/*
+ *  Control calls
+ */
+
+int16 ESP32SERDPort::control(uint32 pb, uint32 dce, uint16 code)
+{
+    UNUSED(dce);
+    switch (code) {
+        case 1:                 // KillIO
+            xSemaphoreTake(lock, portMAX_DELAY);
+            read_pending = write_pending = false;
+            read_done = write_done = false;
+            if (stream) {
+                while (stream->available() > 0) {
+                    stream->read();
+                }
+            }
+            xSemaphoreGive(lock);
+            return noErr;
+
+        case kSERDConfiguration:
+            return configure(ReadMacInt16(pb + csParam)) ? noErr : controlErr;
+
+        case kSERDBaudRate: {
+            uint16 rate = ReadMacInt16(pb + csParam);
+            if (rate == 0) {
+                return controlErr;
+            }
+            baud = rate;
+            if (uart) {
+                uart->updateBaudRate(baud);
+            }
+            return noErr;
+        }
+
+        case kSERD115KBaud:
+        case kSERD230KBaud:
+            baud = code == kSERD115KBaud ? 115200 : 230400;
+            if (uart) {
+                uart->updateBaudRate(baud);
+            }
+            return noErr;
+
+        case kSERDInputBuffer:  // The driver's own ring is used
+        case kSERDSerHShake:
+        case kSERDHandshake:
+        case kSERDHandshakeRS232:
+        case kSERDClearBreak:
+        case kSERDSetBreak:
+        case kSERDClockMIDI:
+        case kSERDMiscOptions:
+        case kSERDAssertDTR:
+        case kSERDNegateDTR:
+        case kSERDAssertRTS:
+        case kSERDNegateRTS:
+        case kSERDSetPEChar:
+        case kSERDSetPEAltChar:
+        case kSERDSetXOffFlag:
+        case kSERDClearXOffFlag:
+        case kSERDSendXOn:
+        case kSERDSendXOnOut:
+        case kSERDSendXOff:
+        case kSERDSendXOffOut:
+        case kSERDResetChannel:
+        case kSERDStickParity:
+        case kSERDSetHighSpeed:
+            return noErr;
+
+        default:
+            printf("WARNING: SerialControl(): unimplemented control code %d\n", code);
+            return controlErr;
+    }
+}
+
+
+/*
+ *  Status calls
+ */
+
+int16 ESP32SERDPort::status(uint32 pb, uint32 dce, uint16 code)
+{
+    UNUSED(dce);
+    switch (code) {
+        case kSERDInputCount: {
+            int avail = 0;
+            if (stream && !read_pending) {
+                avail = stream->available();
+            }
+            WriteMacInt32(pb + csParam, avail);
+            return noErr;
+        }
+
+        case kSERDStatus: {
+            uint32 p = pb + csParam;
+            WriteMacInt8(p + staCumErrs, cum_errors);
+            cum_errors = 0;
+            WriteMacInt8(p + staXOffSent, 0);
+            WriteMacInt8(p + staRdPend, read_pending);
+            WriteMacInt8(p + staWrPend, write_pending);
+            WriteMacInt8(p + staCtsHold, 0);
+            WriteMacInt8(p + staXOffHold, 0);
+            WriteMacInt8(p + staDsrHold, 0);
+            WriteMacInt8(p + staModemStatus, dsrEvent | dcdEvent | ctsEvent);
+            return noErr;
+        }
+
+        case kSERDGetDCD:
+            WriteMacInt8(pb + csParam, 1);
+            return noErr;
+
+        default:
+            printf("WARNING: SerialStatus(): unimplemented status code %d\n", code);
+            return statusErr;
+    }
+}
+
+
+/*
+ *  Close serial port
+ */
+
+int16 ESP32SERDPort::close(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    read_pending = write_pending = false;
+    if (uart) {
+        uart->end();
+        uart = NULL;
+    }
+    stream = NULL;
+    xSemaphoreGive(lock);
+    return noErr;
+}
@@ -35,6 +35,7 @@
 #include "emul_op.h"
 #include "version.h"
 #include "slot_rom.h"
+#include "rom_patches.h"
 
 #ifdef ARDUINO
 #include <esp_heap_caps.h>
@@ -476,12 +477,38 @@ bool InstallSlotROM(void)
 	return true;
 }
 
+/*
+ *  Size of the installed slot ROM
+ */
+
+int GetSlotROMSize(void)
+{
+	return slot_rom_size;
+}
+
+void SetSlotROMSize(int size)
+{
+	slot_rom_size = size;
+}
+
 /*
  *  Calculate slot ROM checksum (in-place)
  */
 
 void ChecksumSlotROM(void)
 {
+#if ROM_FLASH_XIP
+	// The ROM may be mapped read-only from flash: sum around the CRC field
+	const uint8 *q = ROMBaseHost + ROMSize - slot_rom_size;
+	uint32 sum = 0;
+	for (int i=0; i<slot_rom_size; i++) {
+		sum = (sum << 1) | (sum >> 31);
+		if (i < slot_rom_size - 12 || i > slot_rom_size - 9)
+			sum += q[i];
+	}
+	uint8 crc_bytes[4] = {uint8(sum >> 24), uint8(sum >> 16), uint8(sum >> 8), uint8(sum)};
+	ROMWrite(ROMSize - 12, crc_bytes, 4);
+#else
 	// Calculate CRC
 	uint8 *p = ROMBaseHost + ROMSize - slot_rom_size;
 	p[slot_rom_size - 12] = 0;
@@ -497,4 +524,5 @@ void ChecksumSlotROM(void)
 	p[slot_rom_size - 11] = crc >> 16;
 	p[slot_rom_size - 10] = crc >> 8;
 	p[slot_rom_size - 9] = crc;
+#endif
 }
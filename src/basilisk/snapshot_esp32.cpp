@@ -0,0 +1,834 @@
+/*
+ *  snapshot_esp32.cpp - Machine snapshots: suspend to the SD card, resume at boot
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  File layout (one file, SNAPSHOT_PATH):
+ *
+ *    0       header (one 4 KB block)
+ *    4 KB    page table: one snap_page per 4 KB page of Mac RAM, then of
+ *            the frame buffer (its last page zero-padded), 4 KB aligned
+ *    ...     page records (LZ4 or raw) and state blobs, appended
+ *
+ *  A snapshot only writes the pages whose hash differs from the table
+ *  entry, so after a resume (which leaves the table in place) the next
+ *  suspend costs about as much as the Mac has touched since. The records
+ *  this makes unreachable are dropped by writing the file from scratch
+ *  once they outweigh the live ones. Hashing a copy of every page also
+ *  covers the memory written by host drivers and DMA-like copies, which
+ *  a write-path dirty bitmap would miss.
+ *
+ *  The header is written invalid before anything else and valid last, so
+ *  a power cut during a suspend leaves a file that is never resumed. A
+ *  snapshot is resumed at most once: the Boot GUI offers it, and resuming
+ *  it or booting normally marks it used (the table stays usable).
+ */
+
+#include "sysdeps.h"
+
+#include <Arduino.h>
+#include "sd_esp32.h"
+#include "esp_app_desc.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "prefs.h"
+#include "sys.h"
+#include "xpram.h"
+#include "timer.h"
+#include "video.h"
+#include "newcpu.h"
+#include "dskz_format.h"
+#include "snapshot.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#if MAC_SNAPSHOT
+
+#if SYS_ASYNC_IO
+#error "MAC_SNAPSHOT needs SYS_ASYNC_IO=0 (transfers in flight can't be saved)"
+#endif
+
+#define SNAP_MAGIC          0x4e533242  // "B2SN"
+#define SNAP_VERSION        2
+#define SNAP_PAGE_SIZE      4096
+#define SNAP_BLOCK          4096        // Header size, table alignment
+#define SNAP_RAW_LIMIT      (SNAP_PAGE_SIZE - SNAP_PAGE_SIZE / 8)   // Store raw unless LZ4 saves 1/8
+#define SNAP_IO_BUFFER      (32 * 1024)
+#define SNAP_STATE_CHUNK    (16 * 1024)
+#define SNAP_COMPACT_MIN    (4 * 1024 * 1024)   // Dead bytes worth a rewrite
+
+enum {
+    SNAP_INVALID = 0,       // Being written, or damaged
+    SNAP_VALID = 1,         // Resumable
+    SNAP_USED = 2           // Resumed or superseded by a normal boot; table still consistent
+};
+
+extern uint8 *MacFrameBaseHost;
+extern uint32 MacFrameSize;
+extern uint32 InterruptFlags;
+extern int CPUType;
+extern int FPUType;
+
+struct snap_header {
+    uint32 magic;
+    uint32 version;
+    uint32 valid;
+    uint8 build_id[32];     // SHA-256 of the firmware ELF
+    uint32 rom_checksum;    // First long of the ROM
+    uint32 ram_size;
+    uint32 frame_size;
+    uint32 cpu_type;
+    uint32 fpu_type;
+    uint32 model_id;
+    uint32 config;          // Fingerprint of the disk images and their prefs
+    uint32 page_count;
+    uint32 state_offset;
+    uint32 state_size;
+    uint32 state_sum;
+    uint32 data_end;        // End of the appended records
+    uint32 live_bytes;      // Bytes of records the table and the state refer to
+};
+
+struct snap_page {
+    uint32 offset;          // File offset of the record, 0 for a zero page
+    uint16 length;          // Record length, SNAP_PAGE_SIZE = stored raw
+    uint16 reserved;
+    uint64 hash;            // page_hash() of the contents, 0 = zero page
+};
+
+typedef char snap_header_size_check[sizeof(snap_header) <= SNAP_BLOCK ? 1 : -1];
+typedef char snap_page_size_check[sizeof(snap_page) == 16 ? 1 : -1];
+
+static volatile bool snapshot_requested = false;
+static bool snapshot_suspended = false;
+
+// State blob, filled by the module hooks on a save, read back on a restore
+static bool restoring = false;
+static uint8 *state_data = NULL;
+static uint32 state_size = 0;
+static uint32 state_capacity = 0;
+static uint32 state_pos = 0;
+static bool state_overrun = false;
+
+
+/*
+ *  Helpers
+ */
+
+static void build_id(uint8 *id)
+{
+    const esp_app_desc_t *desc = esp_app_get_description();
+    memcpy(id, desc->app_elf_sha256, 32);
+}
+
+static uint32 fnv_add(uint32 hash, uint32 value)
+{
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ (value & 0xff)) * 16777619;
+        value >>= 8;
+    }
+    return hash;
+}
+
+static uint32 fnv_add_string(uint32 hash, const char *s)
+{
+    while (*s) {
+        hash = (hash ^ (uint8)*s++) * 16777619;
+    }
+    return fnv_add(hash, 0);
+}
+
+static uint32 fnv_add_file(uint32 hash, const char *path)
+{
+    File f = SDCardFS().open(path, FILE_READ);
+    if (!f) {
+        return fnv_add(hash, 0xffffffff);
+    }
+    hash = fnv_add(hash, f.size());
+    hash = fnv_add(hash, (uint32)f.getLastWrite());
+    f.close();
+    return hash;
+}
+
+/*
+ *  Everything outside of the machine that a resumed Mac relies on: the
+ *  volumes it has mounted must be the images it had, unchanged
+ */
+static uint32 config_fingerprint(void)
+{
+    static const char *const path_prefs[] = { "disk", "cdrom", "floppy" };
+    bool overlay = PrefsFindBool("diskoverlay");
+    uint32 h = 2166136261u;
+    for (int p = 0; p < 3; p++) {
+        const char *str;
+        for (int i = 0; (str = PrefsFindString(path_prefs[p], i)) != NULL; i++) {
+            if (str[0] == '*') {
+                str++;      // Read-only marker
+            }
+            h = fnv_add_string(h, str);
+            h = fnv_add_file(h, str);
+            if (overlay && p == 0) {
+                char ovl[256];
+                snprintf(ovl, sizeof(ovl), "%s.ovl", str);
+                h = fnv_add_file(h, ovl);
+            }
+        }
+    }
+    const char *extfs = PrefsFindString("extfs");
+    h = fnv_add_string(h, extfs ? extfs : "");
+    h = fnv_add(h, overlay);
+    h = fnv_add(h, PrefsFindBool("nocdrom"));
+    return h;
+}
+
+static uint32 rom_checksum(void)
+{
+    uint32 sum;
+    memcpy(&sum, ROMBaseHost, 4);
+    return sum;
+}
+
+static uint32 state_sum(const uint8 *data, uint32 size)
+{
+    uint32 sum = 0;
+    for (uint32 i = 0; i < size; i++) {
+        sum = ((sum << 1) | (sum >> 31)) + data[i];
+    }
+    return sum;
+}
+
+static uint32 ram_pages(void)
+{
+    return RAMSize / SNAP_PAGE_SIZE;
+}
+
+static uint32 page_count(void)
+{
+    return ram_pages() + (MacFrameSize + SNAP_PAGE_SIZE - 1) / SNAP_PAGE_SIZE;
+}
+
+static uint32 data_start(uint32 pages)
+{
+    uint32 table = pages * sizeof(snap_page);
+    return SNAP_BLOCK + (table + SNAP_BLOCK - 1) / SNAP_BLOCK * SNAP_BLOCK;
+}
+
+// Host address and size of page i (the last frame buffer page may be short)
+static uint8 *page_address(uint32 i, uint32 &size)
+{
+    if (i < ram_pages()) {
+        size = SNAP_PAGE_SIZE;
+        return RAMBaseHost + i * SNAP_PAGE_SIZE;
+    }
+    uint32 offset = (i - ram_pages()) * SNAP_PAGE_SIZE;
+    size = MacFrameSize - offset < SNAP_PAGE_SIZE ? MacFrameSize - offset : SNAP_PAGE_SIZE;
+    return MacFrameBaseHost + offset;
+}
+
+static inline uint32 rotl32(uint32 x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+/*
+ *  Two-lane murmur-style hash of a page; 0 only for an all-zero page
+ */
+static uint64 page_hash(const uint8 *page)
+{
+    const uint32 *w = (const uint32 *)page;
+    uint32 a = 0x9e3779b9, b = 0x7f4a7c15, any = 0;
+    for (int i = 0; i < SNAP_PAGE_SIZE / 4; i += 2) {
+        uint32 x = w[i], y = w[i + 1];
+        any |= x | y;
+        x *= 0xcc9e2d51;
+        x = rotl32(x, 15);
+        a ^= x * 0x1b873593;
+        a = rotl32(a, 13) * 5 + 0xe6546b64;
+        y *= 0x85ebca6b;
+        y = rotl32(y, 17);
+        b ^= y * 0xc2b2ae35;
+        b = rotl32(b, 11) * 5 + 0x561ccd1b;
+    }
+    if (any == 0) {
+        return 0;
+    }
+    a ^= a >> 16;
+    a *= 0x85ebca6b;
+    b ^= b >> 13;
+    b *= 0xc2b2ae35;
+    uint64 h = ((uint64)a << 32) | b;
+    return h ? h : 1;
+}
+
+/*
+ *  Greedy LZ4 block compression of one page (as tools/dskz/dskz.c);
+ *  dst needs SNAP_PAGE_SIZE + SNAP_PAGE_SIZE / 255 + 16 bytes
+ */
+#define LZ4_HASH_BITS       12
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MF_LIMIT        12
+
+static uint8 *lz4_put_length(uint8 *op, uint32 len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8)len;
+    return op;
+}
+
+static uint32 lz4_compress_page(const uint8 *src, uint8 *dst, uint16 *table)
+{
+    const uint8 *ip = src, *anchor = src, *iend = src + SNAP_PAGE_SIZE;
+    const uint8 *mflimit = iend - LZ4_MF_LIMIT, *matchlimit = iend - LZ4_LAST_LITERALS;
+    uint8 *op = dst;
+
+    memset(table, 0, sizeof(uint16) << LZ4_HASH_BITS);
+    while (ip < mflimit) {
+        uint32 seq;
+        memcpy(&seq, ip, 4);
+        uint32 h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        uint32 cand = table[h];                 // Position + 1, 0 = empty
+        table[h] = (uint16)(ip - src + 1);
+        uint32 ref_seq;
+        if (cand == 0 || (memcpy(&ref_seq, src + cand - 1, 4), ref_seq != seq)) {
+            ip++;
+            continue;
+        }
+        const uint8 *ref = src + cand - 1;
+        const uint8 *mp = ip + LZ4_MIN_MATCH, *rp = ref + LZ4_MIN_MATCH;
+        while (mp < matchlimit && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        uint32 lit = ip - anchor, mlen = (mp - ip) - LZ4_MIN_MATCH;
+        uint8 *token = op++;
+        *token = (uint8)((lit >= 15 ? 15 : lit) << 4);
+        if (lit >= 15) {
+            op = lz4_put_length(op, lit - 15);
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+        uint32 off = ip - ref;
+        *op++ = (uint8)off;
+        *op++ = (uint8)(off >> 8);
+        *token |= (uint8)(mlen >= 15 ? 15 : mlen);
+        if (mlen >= 15) {
+            op = lz4_put_length(op, mlen - 15);
+        }
+        ip = mp;
+        anchor = ip;
+    }
+
+    // Trailing literals
+    uint32 lit = iend - anchor;
+    *op++ = (uint8)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) {
+        op = lz4_put_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/*
+ *  Buffered sequential writer
+ */
+struct snap_writer {
+    File *file;
+    uint8 *buffer;
+    uint32 used;
+    uint32 position;        // File offset of buffer[0]
+    bool error;
+};
+
+static void writer_flush(snap_writer &w)
+{
+    if (w.used && !w.error) {
+        if (!w.file->seek(w.position) || w.file->write(w.buffer, w.used) != w.used) {
+            w.error = true;
+        }
+    }
+    w.position += w.used;
+    w.used = 0;
+}
+
+static void writer_put(snap_writer &w, const void *data, uint32 size)
+{
+    const uint8 *p = (const uint8 *)data;
+    while (size) {
+        uint32 n = SNAP_IO_BUFFER - w.used;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(w.buffer + w.used, p, n);
+        w.used += n;
+        p += n;
+        size -= n;
+        if (w.used == SNAP_IO_BUFFER) {
+            writer_flush(w);
+        }
+    }
+}
+
+static bool write_at(File &f, uint32 offset, const void *data, uint32 size)
+{
+    return f.seek(offset) && f.write((const uint8 *)data, size) == size;
+}
+
+static bool read_at(File &f, uint32 offset, void *data, uint32 size)
+{
+    return f.seek(offset) && f.read((uint8 *)data, size) == size;
+}
+
+static bool read_header(File &f, snap_header &h)
+{
+    if (!read_at(f, 0, &h, sizeof(h)) || h.magic != SNAP_MAGIC || h.version != SNAP_VERSION) {
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ *  State blob access for the module hooks
+ */
+
+bool SnapshotRestoring(void)
+{
+    return restoring;
+}
+
+bool SnapshotData(void *data, size_t size)
+{
+    if (restoring) {
+        if (state_overrun || size > state_size - state_pos) {
+            state_overrun = true;
+            return false;
+        }
+        memcpy(data, state_data + state_pos, size);
+        state_pos += size;
+        return true;
+    }
+
+    if (state_size + size > state_capacity) {
+        uint32 capacity = (state_size + size + SNAP_STATE_CHUNK - 1) / SNAP_STATE_CHUNK * SNAP_STATE_CHUNK;
+        uint8 *p = (uint8 *)ps_realloc(state_data, capacity);
+        if (!p) {
+            return false;
+        }
+        state_data = p;
+        state_capacity = capacity;
+    }
+    memcpy(state_data + state_size, data, size);
+    state_size += size;
+    return true;
+}
+
+static void free_state(void)
+{
+    free(state_data);
+    state_data = NULL;
+    state_size = state_capacity = state_pos = 0;
+    state_overrun = false;
+}
+
+// Module state, in the same order for saving and restoring
+static bool transfer_state(void)
+{
+    uint32 xpram_size = XPRAM_SIZE;
+    if (!CPUSnapshot()) { D(bug("[SNAP] CPU\n")); return false; }
+    if (!SnapshotVar(InterruptFlags)) return false;
+    if (!SnapshotVar(xpram_size) || xpram_size != XPRAM_SIZE || !SnapshotData(XPRAM, XPRAM_SIZE)) return false;
+    if (!VideoSnapshot()) { D(bug("[SNAP] video\n")); return false; }
+    if (!TimerSnapshot()) { D(bug("[SNAP] timer\n")); return false; }
+    if (!ADBSnapshot()) return false;
+    if (!SonySnapshot()) { D(bug("[SNAP] floppy\n")); return false; }
+    if (!DiskSnapshot()) { D(bug("[SNAP] disk\n")); return false; }
+    if (!CDROMSnapshot()) { D(bug("[SNAP] CD-ROM\n")); return false; }
+    if (!AudioSnapshot()) { D(bug("[SNAP] audio\n")); return false; }
+    if (!ExtFSSnapshot()) { D(bug("[SNAP] ExtFS\n")); return false; }
+    if (!EtherSnapshot()) { D(bug("[SNAP] Ethernet\n")); return false; }
+    return true;
+}
+
+
+/*
+ *  Suspend: write the snapshot (CPU thread, between instructions)
+ */
+
+static void make_header(snap_header &h)
+{
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAP_MAGIC;
+    h.version = SNAP_VERSION;
+    h.valid = SNAP_INVALID;
+    build_id(h.build_id);
+    h.rom_checksum = rom_checksum();
+    h.ram_size = RAMSize;
+    h.frame_size = MacFrameSize;
+    h.cpu_type = CPUType;
+    h.fpu_type = FPUType;
+    h.model_id = PrefsFindInt32("modelid");
+    h.page_count = page_count();
+}
+
+static bool save_snapshot(void)
+{
+    uint32 start = millis();
+
+    // Machine state first; a module may refuse
+    restoring = false;
+    free_state();
+    if (!transfer_state()) {
+        Serial.println("[SNAP] Machine can't be suspended right now (see above), try again later");
+        free_state();
+        return false;
+    }
+
+    // Disk caches and overlays on the card, so the images match the snapshot
+    Sys_record_clean_shutdown();
+
+    uint32 pages = page_count();
+    uint32 table_bytes = pages * sizeof(snap_page);
+    snap_page *table = (snap_page *)ps_malloc(table_bytes);
+    uint8 *work = (uint8 *)heap_caps_malloc(2 * SNAP_PAGE_SIZE + SNAP_PAGE_SIZE / 255 + 16, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    uint16 *lz4_table = (uint16 *)heap_caps_malloc(sizeof(uint16) << LZ4_HASH_BITS, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    uint8 *io = (uint8 *)ps_malloc(SNAP_IO_BUFFER);
+    if (!table || !work || !lz4_table || !io) {
+        Serial.println("[SNAP] Not enough memory for a snapshot");
+        free(table); free(work); free(lz4_table); free(io);
+        free_state();
+        return false;
+    }
+
+    // Reuse the table of the last snapshot if it describes this machine
+    snap_header old;
+    bool reuse = false;
+    File f;
+    if (SDCardFS().exists(SNAPSHOT_PATH)) {
+        f = SDCardFS().open(SNAPSHOT_PATH, "r+");
+    }
+    if (f && read_header(f, old) && (old.valid == SNAP_VALID || old.valid == SNAP_USED) &&
+        old.ram_size == RAMSize && old.frame_size == MacFrameSize && old.page_count == pages &&
+        read_at(f, SNAP_BLOCK, table, table_bytes)) {
+        uint32 used = old.data_end - data_start(pages);
+        uint32 dead = old.data_end >= data_start(pages) && used >= old.live_bytes ? used - old.live_bytes : 0xffffffff;
+        reuse = !(dead > old.live_bytes && dead > SNAP_COMPACT_MIN);
+    }
+    if (!reuse) {
+        if (f) {
+            f.close();
+        }
+        f = SDCardFS().open(SNAPSHOT_PATH, "w+");
+        memset(table, 0, table_bytes);      // All zero pages, nothing stored
+    }
+
+    snap_header h;
+    make_header(h);
+    snap_writer w = { &f, io, 0, reuse ? old.data_end : data_start(pages), false };
+    bool ok = f && write_at(f, 0, &h, sizeof(h));   // Invalid until complete
+    if (ok && !reuse) {
+        // Placeholder for the table, so the records start where they should
+        memset(work, 0, SNAP_PAGE_SIZE);
+        for (uint32 pos = SNAP_BLOCK; ok && pos < data_start(pages); pos += SNAP_PAGE_SIZE) {
+            ok = write_at(f, pos, work, SNAP_PAGE_SIZE);
+        }
+    }
+
+    // Changed pages (hashed and compressed from a copy, as host tasks may
+    // still write to Mac RAM)
+    uint32 written = 0, live = 0;
+    uint8 *page = work, *packed = work + SNAP_PAGE_SIZE;
+    for (uint32 i = 0; ok && i < pages; i++) {
+        uint32 size;
+        const uint8 *src = page_address(i, size);
+        memcpy(page, src, size);
+        if (size < SNAP_PAGE_SIZE) {
+            memset(page + size, 0, SNAP_PAGE_SIZE - size);
+        }
+        uint64 hash = page_hash(page);
+        snap_page &e = table[i];
+        if (hash != e.hash) {
+            e.hash = hash;
+            e.reserved = 0;
+            if (hash == 0) {
+                e.offset = 0;
+                e.length = 0;
+            } else {
+                uint32 length = lz4_compress_page(page, packed, lz4_table);
+                e.offset = w.position + w.used;
+                if (length > SNAP_RAW_LIMIT) {
+                    e.length = SNAP_PAGE_SIZE;
+                    writer_put(w, page, SNAP_PAGE_SIZE);
+                } else {
+                    e.length = length;
+                    writer_put(w, packed, length);
+                }
+                written++;
+            }
+        }
+        live += e.length;
+        if ((i & 255) == 255) {
+            yield();
+        }
+    }
+
+    // State blob, table, then the header that makes it all valid
+    h.state_offset = w.position + w.used;
+    h.state_size = state_size;
+    h.state_sum = state_sum(state_data, state_size);
+    writer_put(w, state_data, state_size);
+    writer_flush(w);
+    h.data_end = w.position;
+    h.live_bytes = live + state_size;
+    h.config = config_fingerprint();
+    ok = ok && !w.error && write_at(f, SNAP_BLOCK, table, table_bytes);
+    if (ok) {
+        f.flush();
+        h.valid = SNAP_VALID;
+        ok = write_at(f, 0, &h, sizeof(h));
+    }
+    if (f) {
+        f.close();
+    }
+
+    free(table); free(work); free(lz4_table); free(io);
+    free_state();
+    if (!ok) {
+        Serial.println("[SNAP] ERROR: Writing " SNAPSHOT_PATH " failed, not suspended");
+        SDCardFS().remove(SNAPSHOT_PATH);
+        return false;
+    }
+    Serial.printf("[SNAP] Suspended to " SNAPSHOT_PATH ": %u of %u pages written (%s), %u KB in use, %u ms\n",
+                  (unsigned)written, (unsigned)pages, reuse ? "incremental" : "full",
+                  (unsigned)(h.data_end / 1024), (unsigned)(millis() - start));
+    return true;
+}
+
+void SnapshotRequest(void)
+{
+    snapshot_requested = true;
+}
+
+void SnapshotCheck(void)
+{
+    if (!snapshot_requested || snapshot_suspended) {
+        return;
+    }
+    if (!CPUSnapshotReady()) {
+        return;     // Inside an EmulOp, try again at the next tick check
+    }
+    snapshot_requested = false;
+    Serial.println("[SNAP] Suspending...");
+    if (save_snapshot()) {
+        snapshot_suspended = true;
+        m68k_emulop_return();   // Ends Start680x0()/Resume680x0()
+    }
+}
+
+bool SnapshotSuspended(void)
+{
+    return snapshot_suspended;
+}
+
+/*
+ *  After the emulator has closed the disk images: take the fingerprint
+ *  again, as closing a file can update its modification time
+ */
+void SnapshotSeal(void)
+{
+    if (!snapshot_suspended) {
+        return;
+    }
+    if (!SDCardFS().exists(SNAPSHOT_PATH)) {
+        return;
+    }
+    File f = SDCardFS().open(SNAPSHOT_PATH, "r+");
+    snap_header h;
+    if (f && read_header(f, h) && h.valid == SNAP_VALID) {
+        h.config = config_fingerprint();
+        write_at(f, 0, &h, sizeof(h));
+    }
+    if (f) {
+        f.close();
+    }
+}
+
+
+/*
+ *  Resume
+ */
+
+bool SnapshotAvailable(void)
+{
+    if (!SDCardFS().exists(SNAPSHOT_PATH)) {
+        return false;
+    }
+    File f = SDCardFS().open(SNAPSHOT_PATH, FILE_READ);
+    if (!f) {
+        return false;
+    }
+    snap_header h;
+    uint8 id[32];
+    build_id(id);
+    bool ok = read_header(f, h) && h.valid == SNAP_VALID && memcmp(h.build_id, id, 32) == 0;
+    f.close();
+    return ok;
+}
+
+static const snap_page *sort_table;
+
+static int compare_page_offsets(const void *a, const void *b)
+{
+    uint32 oa = sort_table[*(const uint32 *)a].offset;
+    uint32 ob = sort_table[*(const uint32 *)b].offset;
+    return oa < ob ? -1 : oa > ob;
+}
+
+// Page contents; false leaves RAM unusable for anything but a fresh boot
+static bool restore_pages(File &f, const snap_header &h, snap_page *table)
+{
+    uint32 pages = h.page_count;
+    uint32 *order = (uint32 *)ps_malloc(pages * sizeof(uint32));
+    uint8 *packed = (uint8 *)heap_caps_malloc(SNAP_PAGE_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    uint8 *page = (uint8 *)heap_caps_malloc(SNAP_PAGE_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    bool ok = order && packed && page;
+
+    // In file order, so the card sees one forward sweep
+    uint32 count = 0;
+    for (uint32 i = 0; ok && i < pages; i++) {
+        uint32 size;
+        uint8 *dst = page_address(i, size);
+        if (table[i].offset == 0) {
+            memset(dst, 0, size);
+        } else {
+            order[count++] = i;
+        }
+    }
+    if (ok) {
+        sort_table = table;
+        qsort(order, count, sizeof(uint32), compare_page_offsets);
+    }
+    for (uint32 n = 0; ok && n < count; n++) {
+        const snap_page &e = table[order[n]];
+        uint32 size;
+        uint8 *dst = page_address(order[n], size);
+        if (e.length == 0 || e.length > SNAP_PAGE_SIZE) {
+            ok = false;
+        } else if (e.length == SNAP_PAGE_SIZE) {
+            ok = read_at(f, e.offset, page, SNAP_PAGE_SIZE);
+        } else {
+            ok = read_at(f, e.offset, packed, e.length) &&
+                 dskz_lz4_decompress(packed, e.length, page, SNAP_PAGE_SIZE) == SNAP_PAGE_SIZE;
+        }
+        if (ok) {
+            memcpy(dst, page, size);
+        }
+        if ((n & 255) == 255) {
+            yield();
+        }
+    }
+    free(order); free(packed); free(page);
+    return ok;
+}
+
+bool SnapshotResume(void)
+{
+    uint32 start = millis();
+    if (!SDCardFS().exists(SNAPSHOT_PATH)) {
+        return false;
+    }
+    File f = SDCardFS().open(SNAPSHOT_PATH, FILE_READ);
+    if (!f) {
+        return false;
+    }
+
+    // Must be this firmware, ROM and machine, with the same disks
+    snap_header h;
+    uint8 id[32];
+    build_id(id);
+    const char *reason = NULL;
+    if (!read_header(f, h) || h.valid != SNAP_VALID) {
+        reason = "no valid snapshot";
+    } else if (memcmp(h.build_id, id, 32) != 0) {
+        reason = "made by another firmware";
+    } else if (h.rom_checksum != rom_checksum() || h.ram_size != RAMSize || h.frame_size != MacFrameSize ||
+               h.cpu_type != (uint32)CPUType || h.fpu_type != (uint32)FPUType ||
+               h.model_id != (uint32)PrefsFindInt32("modelid") || h.page_count != page_count()) {
+        reason = "different ROM, RAM size or machine";
+    } else if (h.config != config_fingerprint()) {
+        reason = "disk images or shared folder changed";
+    }
+    if (reason) {
+        Serial.printf("[SNAP] Not resuming: %s\n", reason);
+        f.close();
+        return false;
+    }
+
+    // Table and state blob before anything of the machine is touched
+    uint32 table_bytes = h.page_count * sizeof(snap_page);
+    snap_page *table = (snap_page *)ps_malloc(table_bytes);
+    free_state();
+    state_data = (uint8 *)ps_malloc(h.state_size ? h.state_size : 1);
+    bool ok = table && state_data &&
+              read_at(f, SNAP_BLOCK, table, table_bytes) &&
+              read_at(f, h.state_offset, state_data, h.state_size) &&
+              state_sum(state_data, h.state_size) == h.state_sum;
+    if (ok) {
+        state_size = state_capacity = h.state_size;
+        ok = restore_pages(f, h, table);
+    }
+    f.close();
+    free(table);
+    if (!ok) {
+        Serial.println("[SNAP] ERROR: Snapshot damaged, booting normally");
+        free_state();
+        return false;
+    }
+
+    // Module state; once this has begun there is no way back to a clean
+    // boot, so a mismatch restarts the device without the snapshot
+    restoring = true;
+    state_pos = 0;
+    ok = transfer_state() && state_pos == state_size;
+    restoring = false;
+    free_state();
+    if (!ok) {
+        Serial.println("[SNAP] ERROR: Snapshot doesn't fit this machine, restarting without it");
+        SnapshotInvalidate();
+        delay(100);
+        esp_restart();
+    }
+
+    FlushCodeCache(RAMBaseHost, RAMSize);
+    SnapshotInvalidate();
+    Serial.printf("[SNAP] Resumed from " SNAPSHOT_PATH " in %u ms\n", (unsigned)(millis() - start));
+    return true;
+}
+
+void SnapshotInvalidate(void)
+{
+    if (!SDCardFS().exists(SNAPSHOT_PATH)) {
+        return;
+    }
+    File f = SDCardFS().open(SNAPSHOT_PATH, "r+");
+    if (!f) {
+        return;
+    }
+    snap_header h;
+    if (read_header(f, h) && h.valid == SNAP_VALID) {
+        h.valid = SNAP_USED;
+        write_at(f, 0, &h, sizeof(h));
+    }
+    f.close();
+}
+
+#endif
@@ -44,6 +44,8 @@ using std::vector;
 #include "sys.h"
 #include "prefs.h"
 #include "sony.h"
+#include "snapshot.h"
+#include "replay_esp32.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -136,6 +138,22 @@ uint32 SonyDriveIconAddr;
 // Flag: Control(accRun) has been called, interrupt routine is now active
 static bool acc_run_called = false;
 
+// DiskCopy 'SC' control call: a 1440K disk, written one cylinder
+// (2 heads, 18 sectors/track) at a time
+const int SC_CYLINDERS = 80;
+const size_t SC_CYLINDER_SIZE = 2 * 18 * 512;
+
+#if SYS_ASYNC_IO
+// Asynchronous 'SC' control call in progress
+static struct {
+	sys_async_req io;
+	uint32 pb, dce, status;
+	uint8 *data;
+	int cylinder;		// Being written
+	bool busy;
+} async_copy;
+#endif
+
 
 /*
  *  Get reference to drive info or drives.end() if not found
@@ -202,6 +220,27 @@ void SonyExit(void)
 }
 
 
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the driver state (the drives come from the prefs, which
+ *  the snapshot was checked against)
+ */
+
+bool SonySnapshot(void)
+{
+	uint32 count = drives.size();
+	if (!SnapshotVar(count) || count != drives.size() || !SnapshotVar(acc_run_called))
+		return false;
+	drive_vec::iterator info, end = drives.end();
+	for (info = drives.begin(); info != end; ++info) {
+		if (!SnapshotVar(info->num) || !SnapshotVar(info->to_be_mounted) || !SnapshotVar(info->status))
+			return false;
+	}
+	return true;
+}
+#endif
+
+
 /*
  *  Disk was inserted, flag for mounting
  */
@@ -403,6 +442,78 @@ int16 SonyPrime(uint32 pb, uint32 dce)
 }
 
 
+/*
+ *  Write one cylinder of a DiskCopy 'SC' call, and report it as the
+ *  current track in the drive status record
+ */
+
+static bool write_cylinder(sony_drive_info &info, uint8 *data, int cylinder)
+{
+	WriteMacInt16(info.status + dsTrack, cylinder);
+	size_t offset = (size_t)cylinder * SC_CYLINDER_SIZE;
+	return Sys_write(info.fh, data + offset, offset, SC_CYLINDER_SIZE) == SC_CYLINDER_SIZE;
+}
+
+#if SYS_ASYNC_IO
+/*
+ *  Hand the next cylinder of the asynchronous 'SC' call to the I/O task;
+ *  returns false when the whole disk has been written (or a write failed)
+ */
+
+static bool start_async_cylinder(void)
+{
+	while (async_copy.cylinder < SC_CYLINDERS) {
+		size_t offset = (size_t)async_copy.cylinder * SC_CYLINDER_SIZE;
+		WriteMacInt16(async_copy.status + dsTrack, async_copy.cylinder);
+		async_copy.io.buffer = async_copy.data + offset;
+		async_copy.io.offset = offset;
+		async_copy.io.length = SC_CYLINDER_SIZE;
+		async_copy.io.write = true;
+		if (Sys_async_submit(&async_copy.io))
+			return true;
+
+		// Queue full: write this one here
+		if (Sys_write(async_copy.io.fh, async_copy.io.buffer, offset, SC_CYLINDER_SIZE) != SC_CYLINDER_SIZE)
+			return false;
+		async_copy.cylinder++;
+	}
+	return false;
+}
+
+/*
+ *  Advance a finished cylinder of the asynchronous 'SC' call, complete the
+ *  call through IODone after the last
+ */
+
+static void complete_async_copy(void)
+{
+	if (!async_copy.busy)
+		return;
+#if REPLAY
+	if (!ReplayIODone(&async_copy.io.done))
+#else
+	if (!__atomic_load_n(&async_copy.io.done, __ATOMIC_ACQUIRE))
+#endif
+		return;
+
+	bool ok = async_copy.io.actual == SC_CYLINDER_SIZE;
+	if (ok) {
+		async_copy.cylinder++;
+		if (start_async_cylinder())
+			return;
+		ok = async_copy.cylinder == SC_CYLINDERS;
+	}
+	async_copy.busy = false;
+
+	M68kRegisters r;
+	r.d[0] = (uint32)(int32)set_dsk_err(ok ? noErr : writErr);
+	r.a[0] = async_copy.pb;
+	r.a[1] = async_copy.dce;
+	Execute68k(ReadMacInt32(0x8fc), &r);	// JIODone
+}
+#endif
+
+
 /*
  *  Driver Control() routine
  */
@@ -489,12 +600,38 @@ int16 SonyControl(uint32 pb, uint32 dce)
 				err = offLinErr;
 			} else if (info->read_only) {
 				err = wPrErr;
+			} else if (!SysFormat(info->fh)) {
+				err = writErr;
 			} else {
-				// Assume that the disk is already formatted and only write the data
-				void *data = Mac2HostAddr(ReadMacInt32(pb + csParam + 2));
-				size_t actual = Sys_write(info->fh, data, 0, 2880*512);
-				if (actual != 2880*512)
-					err = writErr;
+				// The image needs no low-level format, write the data by
+				// cylinders so the block cache can take them
+				uint8 *data = Mac2HostAddr(ReadMacInt32(pb + csParam + 2));
+#if SYS_ASYNC_IO
+				// Asynchronous call: the I/O task writes the cylinders
+				// while Mac OS runs, IODone follows the last one
+				uint16 trap = ReadMacInt16(pb + ioTrap);
+				if ((trap & (1 << asyncTrpBit)) && !(trap & (1 << noQueueBit)) && !async_copy.busy) {
+					async_copy.io.fh = info->fh;
+					async_copy.pb = pb;
+					async_copy.dce = dce;
+					async_copy.status = info->status;
+					async_copy.data = data;
+					async_copy.cylinder = 0;
+					if (start_async_cylinder()) {
+						async_copy.busy = true;
+						return 1;
+					}
+					if (async_copy.cylinder < SC_CYLINDERS)
+						err = writErr;
+					break;
+				}
+#endif
+				for (int cylinder = 0; cylinder < SC_CYLINDERS; cylinder++) {
+					if (!write_cylinder(*info, data, cylinder)) {
+						err = writErr;
+						break;
+					}
+				}
 			}
 			break;
 
@@ -575,11 +712,16 @@ int16 SonyStatus(uint32 pb, uint32 dce)
 
 
 /*
- *  Driver interrupt routine (1Hz) - check for volumes to be mounted
+ *  Driver interrupt routine (1Hz and INTFLAG_DISK) - advance asynchronous
+ *  DiskCopy writes, check for volumes to be mounted
  */
 
 void SonyInterrupt(void)
 {
+#if SYS_ASYNC_IO
+	complete_async_copy();
+#endif
+
 	if (!acc_run_called)
 		return;
 
@@ -3,10 +3,47 @@
  *
  *  BasiliskII ESP32 Port
  *
- *  SIMPLIFIED DIRECT I/O - No caching, no buffering
+ *  BLOCK CACHE - read-ahead and write-back
  *  
- *  SD card has internal caching and Mac OS already batches I/O efficiently.
- *  Adding software caching/buffering just adds CPU overhead without benefit.
+ *  Mac OS boot and application launch issue thousands of small, mostly
+ *  sequential reads, each costing a seek and an SPI transaction. Reads are
+ *  served from a PSRAM block cache (4KB lines, CLOCK eviction, size set by
+ *  the "diskcache" pref in KB); a handle that reads sequentially gets the
+ *  following lines fetched ahead by an I/O task on Core 0. CD-ROM images,
+ *  which installers read almost entirely sequentially, are kept up to
+ *  256KB ahead of the reader.
+ *  
+ *  Writes land in the same lines and are marked dirty, so the repeated
+ *  small rewrites of HFS catalog and bitmap blocks coalesce in PSRAM. The
+ *  I/O task writes dirty lines back sorted and in contiguous runs when the
+ *  disk goes idle, when too much is dirty, and every 2s at the latest
+ *  (Sys_periodic_flush); Sys_close, SysEject and SysExit write back
+ *  synchronously. Block 0 of each image (boot blocks and the HFS MDB at
+ *  offset 1024) is written last, so a write-back cut short by power loss
+ *  leaves the old MDB pointing at fully written structures.
+ *  
+ *  Every Finder and File Manager call walks the catalog and extents
+ *  B-trees, so when a disk is mounted the lines those files occupy (from
+ *  the MDB's extent records) are pinned against eviction, up to a quarter
+ *  of the cache: a large file copy streams through the rest.
+ *  
+ *  PSRAM PRELOAD
+ *  
+ *  Images listed in the "diskpreload" pref are copied into PSRAM left over
+ *  after Mac RAM, frame buffers and the cache (a prefix of the disk if it
+ *  doesn't all fit). The I/O task streams them in while it has nothing
+ *  else to do, so booting isn't held up; reads of the loaded part are a
+ *  memcpy. Writes update the copy and mark 4KB blocks dirty, which go
+ *  back to the card with the cache's write-back.
+ *  
+ *  BOOT TRACE
+ *  
+ *  Mac OS reads nearly the same blocks on every boot. For BOOT_TRACE_MS
+ *  after Sys_boot_trace_start() (the CPU starting), the lines each image
+ *  is read at are recorded as runs and then saved as "<image>.trace".
+ *  When the image is opened on the next boot, the I/O task replays that
+ *  trace sorted by offset, at most 3/4 of the cache worth, as read-ahead
+ *  into the cache while the ROM is patched and Mac OS starts.
  */
 
 #include "sysdeps.h"
@@ -14,30 +51,1406 @@
 #include "macos_util.h"
 #include "prefs.h"
 #include "sys.h"
+#include "cpu_emulation.h"
+#include "sd_esp32.h"
+#include "dskz_esp32.h"
+#include "overlay_esp32.h"
+#include "mem_plan_esp32.h"
+#include "perf_esp32.h"
+#include "log_esp32.h"
+#include "media_catalog_esp32.h"
+#include "cdaudio_esp32.h"
 
-#include <SD.h>
 #include <FS.h>
+#include "esp_heap_caps.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 #define DEBUG 0
 #include "debug.h"
 
-// File handle structure - minimal with dirty tracking
-struct file_handle {
-    File file;
-    bool is_open;
-    bool read_only;
-    bool is_floppy;
-    bool is_cdrom;
-    bool is_dirty;      // Track if there are pending writes to flush
-    loff_t size;
-    char path[256];
-};
+// File handle structure - minimal with dirty tracking
+#define HFS_META_RANGES 6   // Three extents each of the catalog and extents files
+
+struct file_handle {
+    File file;
+    bool is_open;
+    bool read_only;
+    bool is_floppy;
+    bool is_cdrom;
+    bool is_dirty;      // Track if there are pending writes to flush
+    loff_t size;
+    loff_t ra_next;     // Offset a sequential reader would read next
+    int ra_streak;      // Consecutive sequential reads
+    uint32 ra_until;    // Block read-ahead has been requested up to
+    uint32 ra_window;   // Lines kept fetched ahead of a sequential reader
+    sd_extent_map *map; // Card sectors of the file, NULL = FATFS only (see image_read_at)
+    dskz_image *dskz;   // Chunked image (.dskz), NULL = plain image
+    loff_t image_size;  // Bytes in the file itself (size is the disk Mac OS sees)
+    disk_overlay *overlay;  // Receives all writes, NULL = writes go to the image
+    bool marked_clean;  // Listed in CLEAN_MARKER_FILE, unlist before writing
+    uint8 *ram;         // PSRAM copy of the first ram_size bytes of the disk, NULL = none
+    uint32 ram_size;
+    uint32 ram_loaded;  // Bytes of the copy valid so far (grows while preloading)
+    uint32 *ram_dirty;  // Bitmap of CACHE_LINE_SIZE blocks newer than the card
+    int ram_dirty_count;
+    uint32 *trace;      // Boot trace being recorded, (block, count) pairs; NULL = none yet
+    int trace_runs;
+    uint32 *replay;     // Last boot's trace, sorted, still to be read ahead; NULL = none
+    int replay_runs;
+    int replay_pos;
+    uint32 replay_lines;
+    uint32 replay_start_ms;
+    bool uncached;      // Reads and writes go straight to the image (Sys_set_cached)
+    uint32 meta_first[HFS_META_RANGES];     // Cache lines [first, end) of the HFS
+    uint32 meta_end[HFS_META_RANGES];       // catalog and extents files (Sys_set_hfs_volume)
+    int meta_ranges;
+#if CD_AUDIO
+    cue_sheet *cue;     // Track table of a .cue image, NULL = plain image (see cue_read_at)
+    loff_t cue_offset;  // File offset of the data track
+    uint32 cue_sector_size;
+    uint32 cue_data_offset;
+#endif
+    char path[256];
+};
+
+// Static flag for SD initialization
+static bool sd_initialized = false;
+
+// Images closed cleanly, one path per line (see clean_marker_update)
+#define CLEAN_MARKER_FILE   "/basilisk_clean.txt"
+#define CLEAN_MARKER_MAX    1024
+
+// Open file handles for periodic flush. The handles themselves come from a
+// fixed pool, so opening and closing images after boot doesn't allocate.
+#define FILE_HANDLE_MAX     16
+static file_handle *open_file_handles[FILE_HANDLE_MAX] = {NULL};
+static file_handle file_handle_pool[FILE_HANDLE_MAX];
+static bool file_handle_used[FILE_HANDLE_MAX];
+
+// ============================================================================
+// Block cache
+// ============================================================================
+#define CACHE_LINE_SIZE         4096        // Bytes per cache line
+#define CACHE_HASH_SIZE         1024        // Hash buckets (power of 2)
+#define CACHE_BYPASS_SIZE       (64 * 1024) // Larger reads go straight to the card
+#define CACHE_META_SHARE        4           // Up to 1/4 of the lines pinned for HFS B-trees
+#define READAHEAD_STREAK        2           // Sequential reads before read-ahead starts
+#define READAHEAD_LINES         8           // Lines fetched per read-ahead (one SD read)
+#define CDROM_READAHEAD_MIN     16          // Lines a streaming CD reader is kept ahead by,
+#define CDROM_READAHEAD_MAX     64          // doubling per sequential read (64-256KB)
+#define IO_QUEUE_LENGTH         (CDROM_READAHEAD_MAX / READAHEAD_LINES + 8) // A full CD window and more
+#define WRITEBACK_IDLE_MS       500         // Write back once no write for this long
+#define WRITEBACK_DIRTY_DIV     4           // ... or once 1/4 of the cache is dirty
+#define PRELOAD_CHUNK           (64 * 1024) // Bytes preloaded per I/O task step
+#define PRELOAD_MIN             (1024 * 1024)   // Smaller PSRAM copies aren't worth it
+#define FLOPPY_HD_SIZE          (2880 * 512)    // SysFormat() size of floppy images
+#define BOOT_TRACE_MS           20000       // Reads recorded this long after the CPU starts
+#define BOOT_TRACE_MAX_RUNS     4096        // Runs per image (32 KB)
+#define BOOT_TRACE_GAP          2           // Replay reads lines this close together as one run
+#define BOOT_TRACE_MAGIC        "B2TRACE1"
+
+enum {
+    LINE_FREE,
+    LINE_LOADING,       // Being read; the reader holds io_lock
+    LINE_VALID
+};
+
+struct cache_line {
+    file_handle *fh;
+    uint32 block;       // File offset / CACHE_LINE_SIZE
+    int16 next;         // Hash chain
+    uint8 state;
+    uint8 referenced;   // CLOCK bit
+    uint8 prefetched;   // Loaded by read-ahead, not yet used
+    uint8 dirty;        // Newer than the file; never evicted until written back
+    uint8 meta;         // HFS B-tree node, not evicted (cache_meta counts them)
+};
+
+enum {
+    IO_READAHEAD,
+    IO_WRITEBACK,
+    IO_ASYNC,           // Sys_async_submit() transfer
+    IO_TRACE_SAVE       // Write the recorded boot traces
+};
+
+struct io_request {
+    int op;
+    file_handle *fh;
+    uint32 block;
+    int count;
+    sys_async_req *async;
+};
+
+static cache_line *cache_lines = NULL;
+static uint8 *cache_data = NULL;            // cache_nlines * CACHE_LINE_SIZE, PSRAM
+static uint8 *readahead_buffer = NULL;      // READAHEAD_LINES * CACHE_LINE_SIZE, PSRAM
+static int16 *writeback_order = NULL;       // cache_nlines entries, sorted dirty lines
+static int cache_nlines = 0;
+static int cache_dirty = 0;                 // Dirty lines
+static int cache_meta = 0;                  // Pinned B-tree lines, at most cache_nlines / CACHE_META_SHARE
+static uint32 last_write_ms = 0;
+static int16 cache_hash[CACHE_HASH_SIZE];
+static int cache_hand = 0;
+static bool cache_init_done = false;
+
+// cache_lock guards the line table (held briefly, never across SD I/O);
+// io_lock serialises File access between the CPU thread and the I/O task
+static SemaphoreHandle_t cache_lock = NULL;
+static SemaphoreHandle_t io_lock = NULL;
+static QueueHandle_t io_queue = NULL;
+
+// Statistics (reset by Sys_report_stats)
+static uint32 cache_hits = 0;
+static uint32 cache_misses = 0;
+static uint32 cache_bypass = 0;
+static uint32 readahead_lines = 0;
+static uint32 readahead_used = 0;
+static uint32 writeback_lines = 0;
+static uint32 writeback_runs = 0;
+static uint32 direct_reads = 0;
+static uint32 cd_stream_reads = 0;          // CD reads continuing a sequential run
+static uint32 cd_stream_lines = 0;
+static uint32 cd_stream_hits = 0;
+static uint32 cd_meta_reads = 0;            // Other CD reads (directories, catalog)
+static uint32 cd_meta_lines = 0;
+static uint32 cd_meta_hits = 0;
+static uint32 ram_reads = 0;                // Reads served from a preloaded copy
+static uint32 ram_writeback_blocks = 0;
+
+// Registry counterparts for telemetry (perf_esp32.cpp), never reset
+static perf_counter *perf_cache_hits = NULL;        // "disk.cache_hits", lines
+static perf_counter *perf_cache_misses = NULL;      // "disk.cache_misses", lines
+static perf_counter *perf_read_bytes = NULL;        // "disk.read_bytes"
+static perf_counter *perf_write_bytes = NULL;       // "disk.write_bytes"
+static perf_histogram *perf_read_hist = NULL;       // "disk.read_us", per Sys_read()
+static perf_histogram *perf_write_hist = NULL;      // "disk.write_us", per Sys_write()
+
+// Dirty blocks of all preloaded copies, preloads still streaming
+static int ram_dirty_total = 0;
+static int preloads_active = 0;
+
+// Boot trace recording, and traces still being replayed
+static bool trace_recording = false;
+static uint32 trace_start_ms = 0;
+static int replays_active = 0;
+static int replay_budget = 0;               // Lines the replays may still read ahead
+
+struct boot_trace_header {
+    char magic[8];                          // BOOT_TRACE_MAGIC
+    uint64 disk_size;                       // The trace is dropped if the disk changes size
+    uint32 runs;                            // (block, count) pairs that follow
+    uint32 reserved;
+};
+
+static inline void io_lock_take(void)
+{
+    if (io_lock) xSemaphoreTake(io_lock, portMAX_DELAY);
+}
+
+static inline void io_lock_give(void)
+{
+    if (io_lock) xSemaphoreGive(io_lock);
+}
+
+static inline int cache_bucket(file_handle *fh, uint32 block)
+{
+    return (int)((((uintptr_t)fh >> 4) * 31 + block) & (CACHE_HASH_SIZE - 1));
+}
+
+/*
+ *  Find a line (cache_lock held), -1 if not cached
+ */
+static int cache_find(file_handle *fh, uint32 block)
+{
+    for (int i = cache_hash[cache_bucket(fh, block)]; i >= 0; i = cache_lines[i].next) {
+        if (cache_lines[i].fh == fh && cache_lines[i].block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Unlink a line from its hash chain and free it (cache_lock held)
+ */
+static void cache_remove(int i)
+{
+    cache_line *l = &cache_lines[i];
+    int16 *link = &cache_hash[cache_bucket(l->fh, l->block)];
+    while (*link >= 0) {
+        if (*link == i) {
+            *link = l->next;
+            break;
+        }
+        link = &cache_lines[*link].next;
+    }
+    l->state = LINE_FREE;
+    l->fh = NULL;
+    if (l->meta) {
+        l->meta = 0;
+        cache_meta--;
+    }
+}
+
+/*
+ *  Is the block part of the handle's catalog or extents file?
+ */
+static bool cache_meta_block(const file_handle *fh, uint32 block)
+{
+    for (int k = 0; k < fh->meta_ranges; k++) {
+        if (block >= fh->meta_first[k] && block < fh->meta_end[k]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Pin a line that holds B-tree nodes, while there is room (cache_lock held)
+ */
+static void cache_meta_pin(cache_line *l)
+{
+    if (!l->meta && cache_meta < cache_nlines / CACHE_META_SHARE && cache_meta_block(l->fh, l->block)) {
+        l->meta = 1;
+        cache_meta++;
+    }
+}
+
+/*
+ *  Claim a line for (fh, block) in LOADING state, CLOCK eviction
+ *  (cache_lock held); -1 if every line is loading
+ */
+static int cache_alloc(file_handle *fh, uint32 block)
+{
+    for (int n = 0; n < cache_nlines * 2; n++) {
+        int i = cache_hand;
+        cache_hand = (cache_hand + 1) % cache_nlines;
+        cache_line *l = &cache_lines[i];
+        if (l->state == LINE_LOADING || l->dirty || l->meta) continue;
+        if (l->state == LINE_VALID) {
+            if (l->referenced) {
+                l->referenced = 0;
+                continue;
+            }
+            cache_remove(i);
+        }
+        
+        int b = cache_bucket(fh, block);
+        l->fh = fh;
+        l->block = block;
+        l->state = LINE_LOADING;
+        l->referenced = 1;
+        l->prefetched = 0;
+        l->dirty = 0;
+        l->next = cache_hash[b];
+        cache_hash[b] = i;
+        cache_meta_pin(l);
+        return i;
+    }
+    return -1;
+}
+
+/*
+ *  Drop every line of a handle
+ */
+static void cache_invalidate(file_handle *fh)
+{
+    if (!cache_data) return;
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    for (int i = 0; i < cache_nlines; i++) {
+        if (cache_lines[i].state != LINE_FREE && cache_lines[i].fh == fh) {
+            if (cache_lines[i].dirty) cache_dirty--;
+            cache_remove(i);
+        }
+    }
+    xSemaphoreGive(cache_lock);
+}
+
+/*
+ *  Check that a handle is still open (io_lock held; no dereference, the
+ *  read-ahead queue may hold handles closed since)
+ */
+static bool handle_registered(file_handle *fh)
+{
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        if (open_file_handles[i] == fh) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Read from the file into a buffer (io_lock held). With an extent map,
+ *  the mapped part of the file is only ever accessed through it (never
+ *  through File, whose FATFS/stdio buffers would go stale); File only
+ *  serves a trailing partial sector.
+ */
+static size_t image_read_at(file_handle *fh, uint8 *dst, loff_t offset, size_t length)
+{
+    if (fh->map && SDExtentCovers(fh->map, offset, length)) {
+        if (!SDExtentRead(fh->map, dst, offset, length)) {
+            return 0;
+        }
+        direct_reads++;
+        return length;
+    }
+    if (!fh->file.seek(offset)) {
+        return 0;
+    }
+    return fh->file.read(dst, length);
+}
+
+/*
+ *  Write a buffer to the file (io_lock held), through the extent map for
+ *  its mapped part; a write that grows the file retires the map
+ */
+static size_t image_write_at(file_handle *fh, const uint8 *src, loff_t offset, size_t length)
+{
+    if (fh->map && SDExtentCovers(fh->map, offset, length)) {
+        return SDExtentWrite(fh->map, src, offset, length) ? length : 0;
+    }
+    if (fh->map && offset + (loff_t)length > fh->image_size) {
+        Serial.printf("[SYS] %s grows, dropping its extent map\n", fh->path);
+        SDExtentMapFree(fh->map);
+        fh->map = NULL;
+    }
+    if (!fh->file.seek(offset)) {
+        return 0;
+    }
+    size_t written = fh->file.write(src, length);
+    if (written > 0) {
+        fh->is_dirty = true;  // Mark for deferred flush
+    }
+    if (offset + (loff_t)written > fh->image_size) {
+        fh->image_size = offset + written;
+        if (!fh->dskz) {
+            fh->size = fh->image_size;
+        }
+    }
+    return written;
+}
+
+static size_t dskz_backing_read(void *ctx, uint8 *dst, uint64 offset, size_t length)
+{
+    return image_read_at((file_handle *)ctx, dst, offset, length);
+}
+
+static size_t dskz_backing_write(void *ctx, const uint8 *src, uint64 offset, size_t length)
+{
+    return image_write_at((file_handle *)ctx, src, offset, length);
+}
+
+/*
+ *  Read/write disk contents (io_lock held); a .dskz image translates
+ *  them to its chunks, a plain image is the disk itself. An overlay sits
+ *  on top of either and takes all writes.
+ */
+#if CD_AUDIO
+#define CUE_BOUNCE_SECTORS  16
+static uint8 *cue_bounce = NULL;            // CUE_BOUNCE_SECTORS raw sectors, PSRAM
+
+/*
+ *  Read the 2048-byte blocks of a .cue image's data track (io_lock held);
+ *  raw 2352-byte sectors are read a run at a time into the bounce buffer
+ *  and their user data cut out, so the cache above only sees blocks
+ */
+static size_t cue_read_at(file_handle *fh, uint8 *dst, loff_t offset, size_t length)
+{
+    uint32 ss = fh->cue_sector_size;
+    if (ss == 2048) {
+        return image_read_at(fh, dst, fh->cue_offset + offset, length);
+    }
+    size_t done = 0;
+    while (done < length) {
+        loff_t pos = offset + done;
+        uint32 sector = pos / 2048;
+        uint32 in_sector = pos % 2048;
+        uint32 n = (in_sector + (length - done) + 2047) / 2048;
+        if (n > CUE_BOUNCE_SECTORS) {
+            n = CUE_BOUNCE_SECTORS;
+        }
+        uint32 got = image_read_at(fh, cue_bounce, fh->cue_offset + (loff_t)sector * ss, n * ss) / ss;
+        for (uint32 i = 0; i < got && done < length; i++) {
+            size_t chunk = 2048 - in_sector;
+            if (chunk > length - done) {
+                chunk = length - done;
+            }
+            memcpy(dst + done, cue_bounce + i * ss + fh->cue_data_offset + in_sector, chunk);
+            done += chunk;
+            in_sector = 0;
+        }
+        if (got < n) {
+            break;
+        }
+    }
+    return done;
+}
+#endif
+
+static size_t base_read_at(file_handle *fh, uint8 *dst, loff_t offset, size_t length)
+{
+#if CD_AUDIO
+    if (fh->cue) {
+        return cue_read_at(fh, dst, offset, length);
+    }
+#endif
+    if (fh->dskz) {
+        return DSKZRead(fh->dskz, dst, offset, length);
+    }
+    return image_read_at(fh, dst, offset, length);
+}
+
+static size_t overlay_backing_read(void *ctx, uint8 *dst, uint64 offset, size_t length)
+{
+    return base_read_at((file_handle *)ctx, dst, offset, length);
+}
+
+static size_t file_read_at(file_handle *fh, uint8 *dst, loff_t offset, size_t length)
+{
+    if (fh->overlay) {
+        return OverlayRead(fh->overlay, dst, offset, length);
+    }
+    return base_read_at(fh, dst, offset, length);
+}
+
+static size_t file_write_at(file_handle *fh, const uint8 *src, loff_t offset, size_t length)
+{
+    if (fh->overlay) {
+        size_t written = OverlayWrite(fh->overlay, src, offset, length);
+        if (written > 0) {
+            fh->is_dirty = true;
+        }
+        return written;
+    }
+    if (fh->dskz) {
+        return DSKZWrite(fh->dskz, src, offset, length);
+    }
+    return image_write_at(fh, src, offset, length);
+}
+
+/*
+ *  Push buffered writes of a handle to the card (io_lock held)
+ */
+static void file_flush(file_handle *fh)
+{
+    if (fh->overlay) {
+        OverlayFlush(fh->overlay);
+    } else {
+        fh->file.flush();
+    }
+    fh->is_dirty = false;
+}
+
+/*
+ *  Clean-shutdown marker - CLEAN_MARKER_FILE lists the writable images
+ *  that were written back and closed cleanly. Opening an image takes it
+ *  off the list (before Mac OS writes to it), so an image on the list
+ *  needs no repair. Updates the list (io_lock held) and returns whether
+ *  path was on it.
+ */
+static bool clean_marker_update(const char *path, bool clean)
+{
+    static char list[CLEAN_MARKER_MAX];
+    static char out[CLEAN_MARKER_MAX];
+    size_t len = 0;
+    File f;
+    if (SDCardFS().exists(CLEAN_MARKER_FILE)) {
+        f = SDCardFS().open(CLEAN_MARKER_FILE, FILE_READ);
+    }
+    if (f) {
+        len = f.read((uint8 *)list, sizeof(list) - 1);
+        f.close();
+    }
+    list[len] = '\0';
+    
+    bool found = false;
+    size_t out_len = 0;
+    for (char *line = strtok(list, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        size_t n = strlen(line);
+        if (strcmp(line, path) == 0) {
+            found = true;
+        } else if (out_len + n + 1 < sizeof(out)) {
+            memcpy(out + out_len, line, n);
+            out_len += n;
+            out[out_len++] = '\n';
+        }
+    }
+    if (found == clean) {
+        return found;
+    }
+    if (clean) {
+        size_t n = strlen(path);
+        if (out_len + n + 1 >= sizeof(out)) {
+            return found;
+        }
+        memcpy(out + out_len, path, n);
+        out_len += n;
+        out[out_len++] = '\n';
+    }
+    
+    if (out_len == 0) {
+        SDCardFS().remove(CLEAN_MARKER_FILE);
+    } else {
+        f = SDCardFS().open(CLEAN_MARKER_FILE, FILE_WRITE);
+        if (f) {
+            f.write((const uint8 *)out, out_len);
+            f.close();
+        }
+    }
+    return found;
+}
+
+/*
+ *  Bytes of a line that lie inside the file (the last line may be short)
+ */
+static inline size_t line_bytes(file_handle *fh, uint32 block)
+{
+    loff_t left = fh->size - (loff_t)block * CACHE_LINE_SIZE;
+    return left < CACHE_LINE_SIZE ? (size_t)left : CACHE_LINE_SIZE;
+}
+
+/*
+ *  Sort key for write-back: by handle, then block, with block 0 (boot
+ *  blocks and MDB) after every other block of its handle
+ */
+static inline bool writeback_before(const cache_line *a, const cache_line *b)
+{
+    if (a->fh != b->fh) return (uintptr_t)a->fh < (uintptr_t)b->fh;
+    return (uint32)(a->block - 1) < (uint32)(b->block - 1);
+}
+
+/*
+ *  Write dirty lines of all handles or just "only" back to the card in
+ *  sorted runs (io_lock held); see cache_writeback
+ */
+static void cache_writeback_lines(file_handle *only)
+{
+    // Collect and sort (insertion sort: the list is short and mostly ordered)
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    int n = 0;
+    for (int i = 0; i < cache_nlines; i++) {
+        cache_line *l = &cache_lines[i];
+        if (!l->dirty || (only && l->fh != only)) continue;
+        int k = n++;
+        while (k > 0 && writeback_before(l, &cache_lines[writeback_order[k - 1]])) {
+            writeback_order[k] = writeback_order[k - 1];
+            k--;
+        }
+        writeback_order[k] = i;
+    }
+    xSemaphoreGive(cache_lock);
+    
+    // Nothing else writes or evicts dirty lines while io_lock is held, so
+    // the sorted list stays valid between the cache_lock sections
+    int k = 0;
+    while (k < n) {
+        cache_line *first = &cache_lines[writeback_order[k]];
+        file_handle *fh = first->fh;
+        int run = 1;
+        while (k + run < n && run < READAHEAD_LINES) {
+            cache_line *l = &cache_lines[writeback_order[k + run]];
+            if (l->fh != fh || l->block != first->block + run) break;
+            run++;
+        }
+        
+        size_t bytes = 0;
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        for (int r = 0; r < run; r++) {
+            int i = writeback_order[k + r];
+            size_t len = line_bytes(fh, cache_lines[i].block);
+            memcpy(readahead_buffer + bytes, cache_data + (size_t)i * CACHE_LINE_SIZE, len);
+            bytes += len;
+        }
+        xSemaphoreGive(cache_lock);
+        
+        size_t written = file_write_at(fh, readahead_buffer,
+                                       (loff_t)first->block * CACHE_LINE_SIZE, bytes);
+        if (written == bytes) {
+            xSemaphoreTake(cache_lock, portMAX_DELAY);
+            for (int r = 0; r < run; r++) {
+                cache_lines[writeback_order[k + r]].dirty = 0;
+            }
+            cache_dirty -= run;
+            xSemaphoreGive(cache_lock);
+            writeback_lines += run;
+            writeback_runs++;
+        } else {
+            // Lines stay dirty and are retried on the next write-back
+            Serial.printf("[SYS] Write-back failed: %s block %u\n", fh->path, first->block);
+        }
+        k += run;
+    }
+}
+
+static void cache_overlay_dirty(file_handle *fh, uint8 *dst, loff_t offset, size_t length);
+
+// ============================================================================
+// PSRAM preload
+// ============================================================================
+
+static inline bool ram_block_dirty(file_handle *fh, uint32 block)
+{
+    return (fh->ram_dirty[block / 32] & (1u << (block % 32))) != 0;
+}
+
+/*
+ *  Mark the blocks of a write to the PSRAM copy dirty (io_lock held)
+ */
+static void ram_mark_dirty(file_handle *fh, loff_t offset, size_t length)
+{
+    uint32 first = (uint32)(offset / CACHE_LINE_SIZE);
+    uint32 last = (uint32)((offset + length - 1) / CACHE_LINE_SIZE);
+    for (uint32 b = first; b <= last; b++) {
+        if (!ram_block_dirty(fh, b)) {
+            fh->ram_dirty[b / 32] |= 1u << (b % 32);
+            fh->ram_dirty_count++;
+            ram_dirty_total++;
+        }
+    }
+}
+
+/*
+ *  Write the dirty blocks of a PSRAM copy back to the card (io_lock held),
+ *  in runs of up to PRELOAD_CHUNK bytes straight from the copy; block 0
+ *  goes last, as in cache_writeback_lines
+ */
+static void ram_writeback(file_handle *fh)
+{
+    uint32 blocks = (fh->ram_loaded + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    uint32 max_run = PRELOAD_CHUNK / CACHE_LINE_SIZE;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32 b = pass == 0 ? 1 : 0;
+        uint32 end = pass == 0 ? blocks : 1;
+        while (b < end && fh->ram_dirty_count > 0) {
+            if (!ram_block_dirty(fh, b)) {
+                b++;
+                continue;
+            }
+            uint32 run = 1;
+            while (b + run < end && run < max_run && ram_block_dirty(fh, b + run)) {
+                run++;
+            }
+            uint32 offset = b * CACHE_LINE_SIZE;
+            size_t bytes = (size_t)run * CACHE_LINE_SIZE;
+            if (bytes > fh->ram_loaded - offset) bytes = fh->ram_loaded - offset;
+            if (file_write_at(fh, fh->ram + offset, offset, bytes) == bytes) {
+                for (uint32 r = 0; r < run; r++) {
+                    fh->ram_dirty[(b + r) / 32] &= ~(1u << ((b + r) % 32));
+                }
+                fh->ram_dirty_count -= run;
+                ram_dirty_total -= run;
+                ram_writeback_blocks += run;
+            } else {
+                // Blocks stay dirty and are retried on the next write-back
+                Serial.printf("[SYS] Write-back failed: %s block %u (PSRAM copy)\n", fh->path, b);
+            }
+            b += run;
+        }
+    }
+}
+
+/*
+ *  Load the next PRELOAD_CHUNK bytes of a PSRAM copy (io_lock held);
+ *  returns false once the copy is complete. Lines written meanwhile are
+ *  still dirty in the cache and copied over what the card returns.
+ */
+static bool preload_chunk(file_handle *fh)
+{
+    uint32 loaded = fh->ram_loaded;
+    if (loaded >= fh->ram_size) {
+        return false;
+    }
+    size_t n = fh->ram_size - loaded;
+    if (n > PRELOAD_CHUNK) n = PRELOAD_CHUNK;
+    if (file_read_at(fh, fh->ram + loaded, loaded, n) != n) {
+        // Keep what has been loaded, the rest stays on the card
+        Serial.printf("[SYS] Preload of %s stopped at %u KB (read error)\n", fh->path, loaded / 1024);
+        fh->ram_size = loaded;
+        preloads_active--;
+        return false;
+    }
+    if (cache_dirty > 0) {
+        cache_overlay_dirty(fh, fh->ram + loaded, loaded, n);
+    }
+    __atomic_store_n(&fh->ram_loaded, loaded + n, __ATOMIC_RELEASE);
+    if (loaded + n < fh->ram_size) {
+        return true;
+    }
+    Serial.printf("[SYS] Preloaded %s: %u KB in PSRAM\n", fh->path, fh->ram_size / 1024);
+    preloads_active--;
+    return false;
+}
+
+/*
+ *  Advance the first unfinished preload by one chunk (I/O task, when
+ *  nothing else is queued)
+ */
+static void preload_step(void)
+{
+    io_lock_take();
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        file_handle *fh = open_file_handles[i];
+        if (fh != NULL && fh->is_open && fh->ram && fh->ram_loaded < fh->ram_size) {
+            preload_chunk(fh);
+            break;
+        }
+    }
+    io_lock_give();
+}
+
+/*
+ *  Write dirty lines back to the card and flush, all handles or just
+ *  "only" (io_lock held). Runs of consecutive blocks go out as one write
+ *  of up to READAHEAD_LINES lines through readahead_buffer.
+ */
+static void cache_writeback(file_handle *only)
+{
+    if (cache_data && cache_dirty > 0) {
+        cache_writeback_lines(only);
+    }
+    
+    for (int i = 0; i < FILE_HANDLE_MAX && ram_dirty_total > 0; i++) {
+        file_handle *fh = open_file_handles[i];
+        if (fh != NULL && (!only || fh == only) && fh->is_open && fh->ram_dirty_count > 0) {
+            ram_writeback(fh);
+        }
+    }
+    
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        file_handle *fh = open_file_handles[i];
+        if (fh != NULL && (!only || fh == only) && fh->is_open && fh->is_dirty) {
+            file_flush(fh);
+        }
+    }
+}
+
+/*
+ *  Request a background write-back from the I/O task (non-blocking)
+ */
+static void cache_request_writeback(void)
+{
+    if (!io_queue) return;
+    io_request req;
+    req.op = IO_WRITEBACK;
+    req.fh = NULL;
+    req.block = 0;
+    req.count = 0;
+    req.async = NULL;
+    xQueueSend(io_queue, &req, 0);
+}
+
+/*
+ *  Read up to READAHEAD_LINES lines from block on into the cache (io_lock
+ *  held): skip the lines already cached, then fetch the contiguous run of
+ *  uncached ones after them with one SD read into readahead_buffer
+ */
+static void cache_fetch_run(file_handle *fh, uint32 block, int count)
+{
+    int lines[READAHEAD_LINES];
+    if (count > READAHEAD_LINES) count = READAHEAD_LINES;
+    
+    uint32 last_block = (uint32)((fh->size - 1) / CACHE_LINE_SIZE);
+    uint32 first = block;
+    int n = 0;
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    while (count > 0 && first <= last_block && cache_find(fh, first) >= 0) {
+        first++;
+        count--;
+    }
+    while (n < count && first + n <= last_block && cache_find(fh, first + n) < 0) {
+        int i = cache_alloc(fh, first + n);
+        if (i < 0) break;
+        lines[n++] = i;
+    }
+    xSemaphoreGive(cache_lock);
+    
+    size_t got = 0;
+    if (n > 0) {
+        got = file_read_at(fh, readahead_buffer, (loff_t)first * CACHE_LINE_SIZE,
+                           (size_t)n * CACHE_LINE_SIZE);
+    }
+    
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    for (int k = 0; k < n; k++) {
+        cache_line *l = &cache_lines[lines[k]];
+        // Only lines read whole (up to the end of the image) become valid;
+        // a short read leaves the rest of the line to the next miss
+        size_t len = line_bytes(fh, first + k);
+        if (got >= (size_t)k * CACHE_LINE_SIZE + len) {
+            uint8 *data = cache_data + (size_t)lines[k] * CACHE_LINE_SIZE;
+            memcpy(data, readahead_buffer + (size_t)k * CACHE_LINE_SIZE, len);
+            memset(data + len, 0, CACHE_LINE_SIZE - len);
+            l->state = LINE_VALID;
+            l->referenced = 0;      // Evict first if never used
+            l->prefetched = 1;
+            readahead_lines++;
+        } else {
+            cache_remove(lines[k]);
+        }
+    }
+    xSemaphoreGive(cache_lock);
+}
+
+// ============================================================================
+// Boot trace
+// ============================================================================
+
+/*
+ *  Note a read in the handle's boot trace (CPU thread or I/O task)
+ */
+static void boot_trace_note(file_handle *fh, loff_t offset, size_t length)
+{
+    uint32 first = (uint32)(offset / CACHE_LINE_SIZE);
+    uint32 end = (uint32)((offset + length + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE);
+    
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    if (fh->trace == NULL && fh->trace_runs == 0) {
+        fh->trace = (uint32 *)ps_malloc(BOOT_TRACE_MAX_RUNS * 2 * sizeof(uint32));
+        if (fh->trace == NULL) {
+            fh->trace_runs = -1;    // Don't try again
+        }
+    }
+    if (fh->trace) {
+        uint32 *last = fh->trace_runs > 0 ? fh->trace + (fh->trace_runs - 1) * 2 : NULL;
+        if (last && first >= last[0] && first <= last[0] + last[1]) {
+            // Continues or overlaps the previous run
+            if (end > last[0] + last[1]) last[1] = end - last[0];
+        } else if (fh->trace_runs < BOOT_TRACE_MAX_RUNS) {
+            fh->trace[fh->trace_runs * 2] = first;
+            fh->trace[fh->trace_runs * 2 + 1] = end - first;
+            fh->trace_runs++;
+        }
+    }
+    xSemaphoreGive(cache_lock);
+}
+
+/*
+ *  Write the recorded traces next to their images (I/O task, or the CPU
+ *  thread without one)
+ */
+static void boot_trace_save(void)
+{
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        // Take the trace off the handle, then write it without holding the locks
+        char path[sizeof(((file_handle *)0)->path) + 8];
+        boot_trace_header h;
+        uint32 *trace = NULL;
+        io_lock_take();
+        file_handle *fh = open_file_handles[i];
+        if (fh != NULL && fh->is_open && fh->trace && fh->trace_runs > 0) {
+            xSemaphoreTake(cache_lock, portMAX_DELAY);
+            trace = fh->trace;
+            memcpy(h.magic, BOOT_TRACE_MAGIC, sizeof(h.magic));
+            h.disk_size = fh->size;
+            h.runs = fh->trace_runs;
+            h.reserved = 0;
+            fh->trace = NULL;
+            xSemaphoreGive(cache_lock);
+            snprintf(path, sizeof(path), "%s.trace", fh->path);
+        }
+        io_lock_give();
+        if (trace == NULL) {
+            continue;
+        }
+        
+        File f = SDCardFS().open(path, FILE_WRITE);
+        size_t bytes = h.runs * 2 * sizeof(uint32);
+        bool ok = f && f.write((const uint8 *)&h, sizeof(h)) == sizeof(h) &&
+                  f.write((const uint8 *)trace, bytes) == bytes;
+        if (f) {
+            f.close();
+        }
+        if (ok) {
+            Serial.printf("[SYS] Boot trace saved: %s, %u runs\n", path, (unsigned)h.runs);
+        } else {
+            Serial.printf("[SYS] WARNING: can't write %s\n", path);
+        }
+        free(trace);
+    }
+}
+
+static int trace_run_compare(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ *  Read "<image>.trace", the runs in recorded order; NULL if there is none
+ *  or it doesn't belong to this disk (io_lock not held)
+ */
+static uint32 *boot_trace_read(file_handle *fh, uint32 *nruns)
+{
+    char path[sizeof(fh->path) + 8];
+    snprintf(path, sizeof(path), "%s.trace", fh->path);
+    if (!SDCardFS().exists(path)) {
+        return NULL;
+    }
+    File f = SDCardFS().open(path, FILE_READ);
+    if (!f) {
+        return NULL;
+    }
+    boot_trace_header h;
+    uint32 *runs = NULL;
+    bool ok = f.read((uint8 *)&h, sizeof(h)) == sizeof(h) &&
+              memcmp(h.magic, BOOT_TRACE_MAGIC, sizeof(h.magic)) == 0 &&
+              h.disk_size == (uint64)fh->size && h.runs > 0 && h.runs <= BOOT_TRACE_MAX_RUNS;
+    if (ok) {
+        size_t bytes = h.runs * 2 * sizeof(uint32);
+        runs = (uint32 *)ps_malloc(bytes);
+        ok = runs && f.read((uint8 *)runs, bytes) == bytes;
+    }
+    f.close();
+    if (!ok) {
+        free(runs);
+        Serial.printf("[SYS] Ignoring %s (another disk size or damaged)\n", path);
+        return NULL;
+    }
+    *nruns = h.runs;
+    return runs;
+}
+
+/*
+ *  Load the trace of the last boot for replay (Sys_open, io_lock not held)
+ */
+static void boot_trace_load(file_handle *fh)
+{
+    if (!io_queue || !cache_data || fh->ram) {
+        return;         // Nothing to replay into, or all in PSRAM anyway
+    }
+    uint32 nruns;
+    uint32 *runs = boot_trace_read(fh, &nruns);
+    if (!runs) {
+        return;
+    }
+    
+    // In offset order, merging runs that touch or nearly do
+    qsort(runs, nruns, 2 * sizeof(uint32), trace_run_compare);
+    int n = 0;
+    uint32 lines = 0;
+    for (uint32 i = 0; i < nruns; i++) {
+        uint32 start = runs[i * 2], end = start + runs[i * 2 + 1];
+        if (n > 0 && start <= runs[(n - 1) * 2] + runs[(n - 1) * 2 + 1] + BOOT_TRACE_GAP) {
+            uint32 *last = runs + (n - 1) * 2;
+            if (end > last[0] + last[1]) {
+                lines += end - (last[0] + last[1]);
+                last[1] = end - last[0];
+            }
+        } else {
+            runs[n * 2] = start;
+            runs[n * 2 + 1] = end - start;
+            lines += end - start;
+            n++;
+        }
+    }
+    
+    io_lock_take();
+    if (replays_active == 0) {
+        replay_budget = cache_nlines * 3 / 4;
+    }
+    fh->replay = runs;
+    fh->replay_runs = n;
+    fh->replay_pos = 0;
+    fh->replay_lines = 0;
+    fh->replay_start_ms = millis();
+    replays_active++;
+    io_lock_give();
+    Serial.printf("[SYS] Replaying boot trace of %s: %d runs, %u KB\n",
+                  fh->path, n, (unsigned)(lines * (CACHE_LINE_SIZE / 1024)));
+}
+
+// The handle's replay is over (io_lock held)
+static void boot_trace_replay_done(file_handle *fh)
+{
+    Serial.printf("[SYS] Boot trace of %s read ahead: %u KB in %u ms\n", fh->path,
+                  (unsigned)(fh->replay_lines * (CACHE_LINE_SIZE / 1024)),
+                  (unsigned)(millis() - fh->replay_start_ms));
+    free(fh->replay);
+    fh->replay = NULL;
+    replays_active--;
+}
+
+/*
+ *  Read ahead the next piece of the first unfinished replay (I/O task,
+ *  when nothing else is queued)
+ */
+static void boot_trace_step(void)
+{
+    io_lock_take();
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        file_handle *fh = open_file_handles[i];
+        if (fh == NULL || !fh->is_open || fh->replay == NULL) {
+            continue;
+        }
+        if (replay_budget <= 0 || fh->replay_pos >= fh->replay_runs) {
+            boot_trace_replay_done(fh);
+            break;
+        }
+        uint32 *run = fh->replay + fh->replay_pos * 2;
+        int count = run[1] < READAHEAD_LINES ? (int)run[1] : READAHEAD_LINES;
+        cache_fetch_run(fh, run[0], count);
+        run[0] += count;
+        run[1] -= count;
+        replay_budget -= count;
+        fh->replay_lines += count;
+        if (run[1] == 0) {
+            fh->replay_pos++;
+        }
+        break;
+    }
+    io_lock_give();
+}
+
+/*
+ *  Start recording which parts of the images the boot reads (CPU thread,
+ *  as the 68k starts)
+ */
+void Sys_boot_trace_start(void)
+{
+    trace_start_ms = millis();
+    trace_recording = true;
+}
+
+/*
+ *  The last boot's trace of an image for a benchmark to replay, (block,
+ *  count) runs of CACHE_LINE_SIZE blocks in the order they were read
+ */
+uint32 *Sys_load_boot_trace(void *arg, int *runs)
+{
+    file_handle *fh = (file_handle *)arg;
+    uint32 n = 0;
+    uint32 *trace = fh && fh->is_open ? boot_trace_read(fh, &n) : NULL;
+    *runs = (int)n;
+    return trace;
+}
+
+static size_t cache_read(file_handle *fh, void *buffer, loff_t offset, size_t length);
+
+/*
+ *  I/O task: asynchronous transfers, write-back on request or once writes have gone idle, and
+ *  read-ahead (cache_fetch_run). Boot trace replays, then preloads,
+ *  advance whenever the queue is empty.
+ */
+static void ioTask(void *param)
+{
+    UNUSED(param);
+    io_request req;
+    
+    for (;;) {
+        TickType_t wait = preloads_active > 0 || replays_active > 0 ? 1 : pdMS_TO_TICKS(WRITEBACK_IDLE_MS);
+        if (xQueueReceive(io_queue, &req, wait) != pdTRUE) {
+            if ((cache_dirty > 0 || ram_dirty_total > 0) && millis() - last_write_ms >= WRITEBACK_IDLE_MS) {
+                io_lock_take();
+                cache_writeback(NULL);
+                io_lock_give();
+            }
+            if (replays_active > 0) {
+                boot_trace_step();
+            } else if (preloads_active > 0) {
+                preload_step();
+            }
+            continue;
+        }
+        
+        if (req.op == IO_WRITEBACK) {
+            io_lock_take();
+            cache_writeback(NULL);
+            io_lock_give();
+            continue;
+        }
+        
+        if (req.op == IO_ASYNC) {
+            sys_async_req *io = req.async;
+            if (io->write) {
+                io->actual = Sys_write(io->fh, io->buffer, io->offset, io->length);
+            } else {
+                io->actual = cache_read((file_handle *)io->fh, io->buffer, io->offset, io->length);
+            }
+            __atomic_store_n(&io->done, true, __ATOMIC_RELEASE);
+            SetInterruptFlag(INTFLAG_DISK);
+            TriggerInterrupt();
+            continue;
+        }
+        
+        if (req.op == IO_TRACE_SAVE) {
+            boot_trace_save();
+            continue;
+        }
+        
+        io_lock_take();
+        if (handle_registered(req.fh) && req.fh->is_open) {
+            cache_fetch_run(req.fh, req.block, req.count);
+        }
+        io_lock_give();
+    }
+}
+
+/*
+ *  Allocate the cache (first Sys_open, after Mac RAM has been allocated)
+ */
+static void cache_init(void)
+{
+    if (cache_init_done) return;
+    cache_init_done = true;
+    
+    io_lock = xSemaphoreCreateMutex();
+    cache_lock = xSemaphoreCreateMutex();
+    if (!io_lock || !cache_lock) {
+        Serial.println("[SYS] Disk cache disabled (no semaphores)");
+        return;
+    }
+    
+    int32 kb = PrefsFindInt32("diskcache");
+    if (kb <= 0) {
+        Serial.println("[SYS] Disk cache disabled");
+        return;
+    }
+    
+    // What the memory plan leaves next to the machine and higher-ranked caches
+    size_t bytes = MemPlanGrant("diskcache", (size_t)kb * 1024, CACHE_LINE_SIZE * 16);
+    if (bytes == 0) {
+        Serial.println("[SYS] Disk cache disabled (not enough PSRAM)");
+        return;
+    }
+    
+    cache_nlines = bytes / CACHE_LINE_SIZE;
+    cache_data = (uint8 *)MemPlanAlloc("diskcache", (size_t)cache_nlines * CACHE_LINE_SIZE, MALLOC_CAP_SPIRAM);
+    readahead_buffer = (uint8 *)ps_malloc(READAHEAD_LINES * CACHE_LINE_SIZE);
+    cache_lines = (cache_line *)malloc(cache_nlines * sizeof(cache_line));
+    writeback_order = (int16 *)malloc(cache_nlines * sizeof(int16));
+    io_queue = xQueueCreate(IO_QUEUE_LENGTH, sizeof(io_request));
+    if (!cache_data || !readahead_buffer || !cache_lines || !writeback_order || !io_queue) {
+        Serial.println("[SYS] Disk cache disabled (allocation failed)");
+        free(cache_data);
+        free(readahead_buffer);
+        free(cache_lines);
+        free(writeback_order);
+        cache_data = NULL;
+        return;
+    }
+    
+    memset(cache_lines, 0, cache_nlines * sizeof(cache_line));
+    for (int i = 0; i < CACHE_HASH_SIZE; i++) {
+        cache_hash[i] = -1;
+    }
+    
+    // Core 0 with the video and input tasks, unless "taskcores" places it
+    // elsewhere; Core 1 runs the 68k. Without the task, writes stay
+    // write-through (see Sys_write)
+    if (xTaskCreatePinnedToCore(ioTask, "diskio", 4096, NULL, 1, NULL,
+                                PrefsFindTaskCore("diskio", 0)) != pdPASS) {
+        Serial.println("[SYS] WARNING: disk I/O task not started");
+        vQueueDelete(io_queue);
+        io_queue = NULL;
+    }
+    
+    Serial.printf("[SYS] Disk cache: %d KB (%d lines), read-ahead/write-back runs %d KB\n",
+                  cache_nlines * CACHE_LINE_SIZE / 1024, cache_nlines,
+                  READAHEAD_LINES * CACHE_LINE_SIZE / 1024);
+}
+
+/*
+ *  Copy part of one block to dst, loading it on a miss
+ */
+static bool cache_read_block(file_handle *fh, uint32 block, size_t in_block, uint8 *dst, size_t n, bool *hit)
+{
+    *hit = false;
+    for (;;) {
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        int i = cache_find(fh, block);
+        if (i >= 0 && cache_lines[i].state == LINE_VALID) {
+            cache_line *l = &cache_lines[i];
+            memcpy(dst, cache_data + (size_t)i * CACHE_LINE_SIZE + in_block, n);
+            l->referenced = 1;
+            if (l->prefetched) {
+                l->prefetched = 0;
+                readahead_used++;
+            }
+            cache_hits++;
+            PerfAdd(perf_cache_hits, 1);
+            xSemaphoreGive(cache_lock);
+            *hit = true;
+            return true;
+        }
+        xSemaphoreGive(cache_lock);
+        
+        if (i >= 0) {
+            // Being read ahead: the loader holds io_lock until it is done
+            io_lock_take();
+            io_lock_give();
+            continue;
+        }
+        
+        // Miss: load the whole line
+        io_lock_take();
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        if (cache_find(fh, block) >= 0) {
+            // Read-ahead got it meanwhile
+            xSemaphoreGive(cache_lock);
+            io_lock_give();
+            continue;
+        }
+        i = cache_alloc(fh, block);
+        xSemaphoreGive(cache_lock);
+        
+        if (i < 0) {
+            size_t got = file_read_at(fh, dst, (loff_t)block * CACHE_LINE_SIZE + in_block, n);
+            io_lock_give();
+            return got == n;
+        }
+        
+        uint8 *line = cache_data + (size_t)i * CACHE_LINE_SIZE;
+        size_t got = file_read_at(fh, line, (loff_t)block * CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+        
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        size_t len = line_bytes(fh, block);
+        bool whole = got >= len;
+        bool ok = got >= in_block + n;
+        if (ok) {
+            memcpy(dst, line + in_block, n);
+        }
+        if (whole) {
+            memset(line + len, 0, CACHE_LINE_SIZE - len);
+            cache_lines[i].state = LINE_VALID;
+        } else {
+            // Short read (SD error): don't keep a line that is partly stale
+            cache_remove(i);
+        }
+        cache_misses++;
+        PerfAdd(perf_cache_misses, 1);
+        xSemaphoreGive(cache_lock);
+        io_lock_give();
+        return ok;
+    }
+}
+
+/*
+ *  Track sequential access on a handle and queue read-ahead past the end
+ *  of the current read. Disks are kept one request ahead; a CD being
+ *  streamed by an installer gets a window that grows towards
+ *  CDROM_READAHEAD_MAX lines, fetched in READAHEAD_LINES requests.
+ */
+static void cache_note_read(file_handle *fh, loff_t offset, size_t length)
+{
+    if (offset == fh->ra_next) {
+        fh->ra_streak++;
+    } else {
+        fh->ra_streak = 0;
+        fh->ra_until = 0;
+        fh->ra_window = fh->is_cdrom ? CDROM_READAHEAD_MIN : READAHEAD_LINES;
+    }
+    fh->ra_next = offset + length;
+    
+    if (fh->ra_streak < READAHEAD_STREAK || !io_queue) return;
+    
+    if (fh->is_cdrom && fh->ra_streak > READAHEAD_STREAK && fh->ra_window < CDROM_READAHEAD_MAX) {
+        fh->ra_window *= 2;
+    }
+    
+    // Top the window up once half of it has been consumed
+    uint32 next_block = (uint32)((offset + length + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE);
+    if (fh->ra_until > next_block + fh->ra_window / 2) return;
+    
+    if (fh->ra_until < next_block) fh->ra_until = next_block;
+    while (fh->ra_until < next_block + fh->ra_window) {
+        io_request req;
+        req.op = IO_READAHEAD;
+        req.fh = fh;
+        req.block = fh->ra_until;
+        req.count = READAHEAD_LINES;
+        req.async = NULL;
+        if (xQueueSend(io_queue, &req, 0) != pdTRUE) break;
+        fh->ra_until = req.block + READAHEAD_LINES;
+    }
+}
+
+/*
+ *  Copy data written straight to the card into cached lines (io_lock held);
+ *  lines wholly overwritten are no longer dirty
+ */
+static void cache_patch_lines(file_handle *fh, const uint8 *src, loff_t offset, size_t length)
+{
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    loff_t pos = offset;
+    loff_t end = offset + length;
+    while (pos < end) {
+        uint32 block = (uint32)(pos / CACHE_LINE_SIZE);
+        size_t in_block = (size_t)(pos % CACHE_LINE_SIZE);
+        size_t n = CACHE_LINE_SIZE - in_block;
+        if ((loff_t)n > end - pos) n = end - pos;
+        int i = cache_find(fh, block);
+        if (i >= 0 && cache_lines[i].state == LINE_VALID) {
+            memcpy(cache_data + (size_t)i * CACHE_LINE_SIZE + in_block, src, n);
+            if (cache_lines[i].dirty && in_block == 0 && n >= line_bytes(fh, block)) {
+                cache_lines[i].dirty = 0;
+                cache_dirty--;
+            }
+        }
+        src += n;
+        pos += n;
+    }
+    xSemaphoreGive(cache_lock);
+}
 
-// Static flag for SD initialization
-static bool sd_initialized = false;
+/*
+ *  Copy dirty cached data over a buffer read straight from the card
+ *  (io_lock held)
+ */
+static void cache_overlay_dirty(file_handle *fh, uint8 *dst, loff_t offset, size_t length)
+{
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    loff_t pos = offset;
+    loff_t end = offset + length;
+    while (pos < end) {
+        uint32 block = (uint32)(pos / CACHE_LINE_SIZE);
+        size_t in_block = (size_t)(pos % CACHE_LINE_SIZE);
+        size_t n = CACHE_LINE_SIZE - in_block;
+        if ((loff_t)n > end - pos) n = end - pos;
+        int i = cache_find(fh, block);
+        if (i >= 0 && cache_lines[i].dirty) {
+            memcpy(dst, cache_data + (size_t)i * CACHE_LINE_SIZE + in_block, n);
+        }
+        dst += n;
+        pos += n;
+    }
+    xSemaphoreGive(cache_lock);
+}
 
-// Open file handles for periodic flush
-static file_handle *open_file_handles[16] = {NULL};
+/*
+ *  Print and reset the cache statistics (called from the main perf report)
+ */
+void Sys_report_stats(void)
+{
+    if (ram_reads + ram_writeback_blocks > 0) {
+        LOG_PRINTF("[SYS PSRAM] reads=%u dirty=%d wb=%u blocks\n",
+                   ram_reads, ram_dirty_total, ram_writeback_blocks);
+        ram_reads = ram_writeback_blocks = 0;
+    }
+    
+    if (!cache_data) return;
+    uint32 total = cache_hits + cache_misses;
+    LOG_PRINTF("[SYS CACHE] hits=%u misses=%u (%u%% hit) bypass=%u readahead=%u used=%u dirty=%d wb=%u/%u runs direct=%u meta=%d\n",
+               cache_hits, cache_misses, total ? cache_hits * 100 / total : 0,
+               cache_bypass, readahead_lines, readahead_used,
+               cache_dirty, writeback_lines, writeback_runs, direct_reads, cache_meta);
+    cache_hits = cache_misses = cache_bypass = 0;
+    readahead_lines = readahead_used = 0;
+    writeback_lines = writeback_runs = 0;
+    direct_reads = 0;
+    
+    if (cd_stream_reads + cd_meta_reads > 0) {
+        LOG_PRINTF("[SYS CD] stream=%u reads (%u%% hit) meta=%u reads (%u%% hit)\n",
+                   cd_stream_reads, cd_stream_lines ? cd_stream_hits * 100 / cd_stream_lines : 0,
+                   cd_meta_reads, cd_meta_lines ? cd_meta_hits * 100 / cd_meta_lines : 0);
+        cd_stream_reads = cd_stream_lines = cd_stream_hits = 0;
+        cd_meta_reads = cd_meta_lines = cd_meta_hits = 0;
+    }
+}
 
 /*
  *  Initialize SD card
@@ -54,12 +1467,37 @@ static bool init_sd_card(void)
     return true;
 }
 
+/*
+ *  Take a handle from the pool (under io_lock), NULL if all are in use
+ */
+static file_handle *alloc_file_handle(void)
+{
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        if (!file_handle_used[i]) {
+            file_handle_used[i] = true;
+            return &file_handle_pool[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Give a handle back, dropping what its File still refers to
+ */
+static void free_file_handle(file_handle *fh)
+{
+    fh->file = File();
+    io_lock_take();
+    file_handle_used[fh - file_handle_pool] = false;
+    io_lock_give();
+}
+
 /*
  *  Register an open file handle
  */
 static void register_file_handle(file_handle *fh)
 {
-    for (int i = 0; i < 16; i++) {
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
         if (open_file_handles[i] == NULL) {
             open_file_handles[i] = fh;
             return;
@@ -72,7 +1510,7 @@ static void register_file_handle(file_handle *fh)
  */
 static void unregister_file_handle(file_handle *fh)
 {
-    for (int i = 0; i < 16; i++) {
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
         if (open_file_handles[i] == fh) {
             open_file_handles[i] = NULL;
             return;
@@ -84,16 +1522,36 @@ static void unregister_file_handle(file_handle *fh)
  *  Periodic flush - ensures data is written to SD card
  *  Called every 2 seconds from main loop
  *  
+ *  With the I/O task running this only queues a write-back, so the SD
+ *  writes and File::flush() happen on Core 0 instead of the CPU core.
+ *  
  *  OPTIMIZED: Only flushes handles that have been written to since last flush.
  *  This avoids unnecessary SD card operations when files haven't changed.
  */
 void Sys_periodic_flush(void)
 {
-    for (int i = 0; i < 16; i++) {
+    if (trace_recording && millis() - trace_start_ms >= BOOT_TRACE_MS) {
+        trace_recording = false;
+        io_request req = { IO_TRACE_SAVE, NULL, 0, 0, NULL };
+        if (!io_queue || xQueueSend(io_queue, &req, 0) != pdTRUE) {
+            boot_trace_save();
+        }
+    }
+    
+    if (io_queue) {
+        bool pending = cache_dirty > 0 || ram_dirty_total > 0;
+        for (int i = 0; i < FILE_HANDLE_MAX && !pending; i++) {
+            pending = open_file_handles[i] != NULL && open_file_handles[i]->is_dirty;
+        }
+        if (pending) cache_request_writeback();
+        return;
+    }
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
         file_handle *fh = open_file_handles[i];
         if (fh != NULL && fh->is_open && !fh->read_only && fh->is_dirty) {
-            fh->file.flush();
-            fh->is_dirty = false;  // Clear dirty flag after flush
+            io_lock_take();
+            file_flush(fh);
+            io_lock_give();
         }
     }
 }
@@ -104,7 +1562,13 @@ void Sys_periodic_flush(void)
 void SysInit(void)
 {
     init_sd_card();
-    Serial.println("[SYS] Direct I/O mode (no caching)");
+    perf_cache_hits = PerfCounter("disk.cache_hits");
+    perf_cache_misses = PerfCounter("disk.cache_misses");
+    perf_read_bytes = PerfCounter("disk.read_bytes");
+    perf_write_bytes = PerfCounter("disk.write_bytes");
+    perf_read_hist = PerfHistogram("disk.read_us");
+    perf_write_hist = PerfHistogram("disk.write_us");
+    Serial.println("[SYS] Block cache allocated on first open");
 }
 
 /*
@@ -112,11 +1576,52 @@ void SysInit(void)
  */
 void SysExit(void)
 {
-    // Flush all open files
-    Sys_periodic_flush();
+    // Write back and flush all open files
+    Sys_record_clean_shutdown();
     sd_initialized = false;
 }
 
+/*
+ *  Record a clean shutdown
+ */
+void Sys_record_clean_shutdown(void)
+{
+    io_lock_take();
+    cache_writeback(NULL);
+    for (int i = 0; i < FILE_HANDLE_MAX; i++) {
+        file_handle *fh = open_file_handles[i];
+        if (fh != NULL && fh->is_open && !fh->read_only && !fh->marked_clean) {
+            clean_marker_update(fh->path, true);
+            fh->marked_clean = true;
+        }
+    }
+    io_lock_give();
+    Serial.println("[SYS] Clean shutdown recorded");
+}
+
+/*
+ *  HFS partition of an image, from the media catalog
+ */
+int Sys_hfs_partition_block(void *arg)
+{
+    file_handle *fh = (file_handle *)arg;
+    if (!fh || fh->dskz) return -1;
+#if CD_AUDIO
+    if (fh->cue) return -1;     // The catalog lists the sheet, not its BIN file
+#endif
+    return MediaCatalogHFSBlock(fh->path, fh->image_size);
+}
+
+void Sys_set_hfs_partition_block(void *arg, int block)
+{
+    file_handle *fh = (file_handle *)arg;
+    if (!fh || fh->dskz) return;
+#if CD_AUDIO
+    if (fh->cue) return;
+#endif
+    MediaCatalogSetHFSBlock(fh->path, block);
+}
+
 /*
  *  Mount first floppy disk
  */
@@ -145,60 +1650,127 @@ void SysAddSerialPrefs(void)
 {
 }
 
+static inline uint16 mdb_get16(const uint8 *p) { return (p[0] << 8) | p[1]; }
+static inline uint32 mdb_get32(const uint8 *p) { return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
 /*
- *  Repair HFS volume - fix common corruption issues from improper shutdown
+ *  Check the header node of the B-tree whose first extent record is at
+ *  rec in the MDB
  */
-static void Sys_repair_hfs_volume(const char *path)
+static bool hfs_btree_header_ok(file_handle *fh, const uint8 *mdb, const uint8 *rec)
 {
-    // Only repair .dsk files
-    if (strstr(path, ".dsk") == NULL && strstr(path, ".DSK") == NULL) {
+    loff_t offset = (loff_t)mdb_get16(mdb + 28) * 512 +
+                    (loff_t)mdb_get16(rec) * mdb_get32(mdb + 20);
+    uint8 node[512];
+    if (offset + 512 > fh->image_size || image_read_at(fh, node, offset, 512) != 512) {
+        return false;
+    }
+    // ndType = ndHdrNode, bthNodeSize = 512
+    return node[8] == 1 && mdb_get16(node + 32) == 512;
+}
+
+/*
+ *  The disk driver found the HFS volume at start: pin the cache lines of
+ *  its catalog and extents B-trees, from the first three extents of each
+ *  in the MDB (files that spill into the extents tree are rare)
+ */
+void Sys_set_hfs_volume(void *arg, loff_t start)
+{
+    file_handle *fh = (file_handle *)arg;
+    if (!fh || !fh->is_open || !cache_data) return;
+    
+    uint8 mdb[512];
+    if (Sys_read(fh, mdb, start + 1024, 512) != 512 || mdb_get16(mdb) != 0x4244) {
         return;
     }
+    uint32 block_size = mdb_get32(mdb + 20);    // drAlBlkSiz
+    loff_t blocks_start = start + (loff_t)mdb_get16(mdb + 28) * 512;    // drAlBlSt
     
-    Serial.printf("[SYS] Checking HFS volume: %s\n", path);
+    uint32 first[HFS_META_RANGES], end[HFS_META_RANGES];
+    int n = 0;
+    uint32 lines = 0;
+    static const int records[2] = {134, 150};   // drXTExtRec, drCTExtRec
+    for (int r = 0; r < 2; r++) {
+        for (int k = 0; k < 3; k++) {
+            const uint8 *ext = mdb + records[r] + k * 4;
+            uint16 count = mdb_get16(ext + 2);
+            if (count == 0) continue;
+            loff_t offset = blocks_start + (loff_t)mdb_get16(ext) * block_size;
+            loff_t bytes = (loff_t)count * block_size;
+            if (offset + bytes > fh->size) continue;
+            first[n] = (uint32)(offset / CACHE_LINE_SIZE);
+            end[n] = (uint32)((offset + bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE);
+            lines += end[n] - first[n];
+            n++;
+        }
+    }
     
-    File f = SD.open(path, "r+b");
-    if (!f) {
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    memcpy(fh->meta_first, first, sizeof(first));
+    memcpy(fh->meta_end, end, sizeof(end));
+    fh->meta_ranges = n;
+    // Lines read before the volume was mounted (the MDB, the tree headers)
+    for (int i = 0; i < cache_nlines; i++) {
+        if (cache_lines[i].state != LINE_FREE && cache_lines[i].fh == fh) {
+            cache_meta_pin(&cache_lines[i]);
+        }
+    }
+    xSemaphoreGive(cache_lock);
+    
+    Serial.printf("[SYS] %s: %u KB of HFS B-trees pinned in the cache\n", fh->path,
+                  (unsigned)(lines * (CACHE_LINE_SIZE / 1024)));
+}
+
+/*
+ *  Repair HFS volume - fix common corruption issues from improper shutdown
+ *  
+ *  Runs on the open handle (io_lock held), so with an extent map the MDB,
+ *  the alternate MDB at the end of the volume and the B-tree headers are
+ *  a handful of direct sector reads.
+ */
+static void Sys_repair_hfs_volume(file_handle *fh)
+{
+    // Only repair .dsk files (a .dskz holds its volume in chunks)
+    const char *path = fh->path;
+    if (strstr(path, ".dsk") == NULL && strstr(path, ".DSK") == NULL) {
         return;
     }
+    if (strstr(path, ".dskz") != NULL || strstr(path, ".DSKZ") != NULL) {
+        return;
+    }
+    
+    Serial.printf("[SYS] Checking HFS volume: %s\n", path);
     
-    size_t file_size = f.size();
+    loff_t file_size = fh->image_size;
     if (file_size < 1024 + 512) {
-        f.close();
         return;
     }
     
     // Read main MDB
-    uint8_t mdb[128];
-    if (!f.seek(1024) || f.read(mdb, 128) != 128) {
-        f.close();
+    uint8_t mdb[512];
+    if (image_read_at(fh, mdb, 1024, 512) != 512) {
         return;
     }
     
     // Check HFS signature
-    uint16_t signature = (mdb[0] << 8) | mdb[1];
+    uint16_t signature = mdb_get16(mdb);
     if (signature != 0x4244) {
-        f.close();
         return;
     }
     
     // Read key fields
-    uint16_t drAtrb = (mdb[10] << 8) | mdb[11];
-    uint32_t drFndrInfo2 = (mdb[100] << 24) | (mdb[101] << 16) | (mdb[102] << 8) | mdb[103];
-    uint32_t drFndrInfo3 = (mdb[104] << 24) | (mdb[105] << 16) | (mdb[106] << 8) | mdb[107];
+    uint16_t drAtrb = mdb_get16(mdb + 10);
+    uint32_t drFndrInfo2 = mdb_get32(mdb + 100);
+    uint32_t drFndrInfo3 = mdb_get32(mdb + 104);
     
     // Get original drAtrb from Alternate MDB
-    size_t amdb_offset = ((file_size / 512) - 2) * 512;
+    loff_t amdb_offset = ((file_size / 512) - 2) * 512;
     uint16_t original_drAtrb = drAtrb;
     
-    uint8_t amdb_sig[2];
-    if (f.seek(amdb_offset) && f.read(amdb_sig, 2) == 2) {
-        if ((amdb_sig[0] << 8 | amdb_sig[1]) == 0x4244) {
-            uint8_t amdb_atrb[2];
-            if (f.seek(amdb_offset + 10) && f.read(amdb_atrb, 2) == 2) {
-                original_drAtrb = (amdb_atrb[0] << 8) | amdb_atrb[1];
-            }
-        }
+    uint8_t amdb[12];
+    if (image_read_at(fh, amdb, amdb_offset, sizeof(amdb)) == sizeof(amdb) &&
+        mdb_get16(amdb) == 0x4244) {
+        original_drAtrb = mdb_get16(amdb + 10);
     }
     
     bool needs_repair = false;
@@ -219,19 +1791,66 @@ static void Sys_repair_hfs_volume(const char *path)
         needs_repair = true;
     }
     
+    // The B-trees can't be rebuilt here, but Mac OS should know to check them
+    if (!hfs_btree_header_ok(fh, mdb, mdb + 134) || !hfs_btree_header_ok(fh, mdb, mdb + 150)) {
+        Serial.println("[SYS] WARNING: extents/catalog B-tree header damaged, run Disk First Aid");
+    }
+    
     if (needs_repair) {
         Serial.println("[SYS] Repairing HFS volume...");
-        f.seek(1024 + 10);
-        f.write(&mdb[10], 2);
-        f.seek(1024 + 100);
-        f.write(&mdb[100], 8);
-        f.flush();
+        image_write_at(fh, mdb, 1024, 512);
+        file_flush(fh);
         Serial.println("[SYS] Volume repaired");
     } else {
         Serial.println("[SYS] Volume OK");
     }
+}
+
+/*
+ *  Set up the PSRAM copy of a disk listed in "diskpreload": all of it, or
+ *  as much from the start as the memory plan grants. The I/O
+ *  task fills it in the background; without the task it is loaded here.
+ */
+static void preload_init(file_handle *fh)
+{
+    bool listed = false;
+    const char *str;
+    for (int i = 0; (str = PrefsFindString("diskpreload", i)) != NULL && !listed; i++) {
+        listed = strcmp(str, fh->path) == 0;
+    }
+    if (!listed) return;
     
-    f.close();
+    size_t bytes = MemPlanGrant("preload", fh->size, PRELOAD_MIN);
+    if (bytes == 0) {
+        Serial.printf("[SYS] Not enough PSRAM to preload %s\n", fh->path);
+        return;
+    }
+    if ((loff_t)bytes < fh->size) {
+        bytes &= ~(size_t)(CACHE_LINE_SIZE - 1);
+    }
+    uint32 blocks = (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    uint8 *ram = (uint8 *)MemPlanAlloc("preload", bytes, MALLOC_CAP_SPIRAM);
+    uint32 *dirty = (uint32 *)calloc((blocks + 31) / 32, sizeof(uint32));
+    if (!ram || !dirty) {
+        Serial.printf("[SYS] Preload of %s disabled (allocation failed)\n", fh->path);
+        free(ram);
+        free(dirty);
+        return;
+    }
+    
+    Serial.printf("[SYS] Preloading %s into PSRAM: %u of %lld KB\n",
+                  fh->path, (unsigned)(bytes / 1024), (long long)(fh->size / 1024));
+    
+    io_lock_take();
+    fh->ram_dirty = dirty;
+    fh->ram_size = bytes;
+    fh->ram_loaded = 0;
+    fh->ram = ram;
+    preloads_active++;
+    if (!io_queue) {
+        while (preload_chunk(fh)) {}
+    }
+    io_lock_give();
 }
 
 /*
@@ -243,13 +1862,16 @@ void *Sys_open(const char *name, bool read_only, bool is_cdrom)
         return NULL;
     }
     
-    // Repair HFS volume before opening
-    if (!read_only && !is_cdrom) {
-        Sys_repair_hfs_volume(name);
-    }
+    cache_init();
+    
+    // Overlay mode leaves the image untouched, writes go to <image>.ovl
+    bool overlay = !read_only && !is_cdrom && PrefsFindBool("diskoverlay");
     
-    file_handle *fh = new file_handle;
+    io_lock_take();
+    file_handle *fh = alloc_file_handle();
+    io_lock_give();
     if (!fh) {
+        LOG_PRINTF("[SYS] ERROR: more than %d open images, can't open %s\n", FILE_HANDLE_MAX, name);
         return NULL;
     }
     
@@ -265,19 +1887,47 @@ void *Sys_open(const char *name, bool read_only, bool is_cdrom)
         fh->read_only = read_only;
     }
     
+    // A CUE sheet: the disc is the data track in its BIN file
+    const char *image = name;
+#if CD_AUDIO
+    cue_data_track data_track;
+    if (strstr(name, ".cue") != NULL || strstr(name, ".CUE") != NULL) {
+        if (!cue_bounce) {
+            cue_bounce = (uint8 *)ps_malloc(CUE_BOUNCE_SECTORS * 2352);
+        }
+        fh->cue = cue_bounce ? CueOpen(name) : NULL;
+        if (!fh->cue || !CueDataTrack(fh->cue, data_track)) {
+            LOG_PRINTF("[SYS] ERROR: %s has no data track to mount\n", name);
+            CueClose(fh->cue);
+            free_file_handle(fh);
+            return NULL;
+        }
+        image = data_track.file;
+        fh->read_only = true;
+        overlay = false;
+    }
+#endif
+    
+    // Map the image before opening it, FATFS won't open it twice
+    fh->map = SDExtentMapBuild(image);
+    
     // Open file
-    if (fh->read_only) {
-        fh->file = SD.open(name, FILE_READ);
+    if (fh->read_only || overlay) {
+        fh->file = SDCardFS().open(image, FILE_READ);
     } else {
-        fh->file = SD.open(name, "r+b");
+        fh->file = SDCardFS().open(image, "r+b");
         if (!fh->file) {
-            fh->file = SD.open(name, FILE_READ);
+            fh->file = SDCardFS().open(image, FILE_READ);
             fh->read_only = true;
         }
     }
     
     if (!fh->file) {
-        delete fh;
+#if CD_AUDIO
+        CueClose(fh->cue);
+#endif
+        SDExtentMapFree(fh->map);
+        free_file_handle(fh);
         return NULL;
     }
     
@@ -291,16 +1941,76 @@ void *Sys_open(const char *name, bool read_only, bool is_cdrom)
     
     if (fh->size == 0) {
         fh->file.close();
-        delete fh;
+#if CD_AUDIO
+        CueClose(fh->cue);
+#endif
+        SDExtentMapFree(fh->map);
+        free_file_handle(fh);
+        return NULL;
+    }
+    fh->image_size = fh->size;
+#if CD_AUDIO
+    if (fh->cue) {
+        fh->cue_offset = data_track.offset;
+        fh->cue_sector_size = data_track.sector_size;
+        fh->cue_data_offset = data_track.data_offset;
+        fh->size = (loff_t)data_track.sectors * 2048;
+    }
+#endif
+    
+    // The map's sector transfers and Files are shared with the I/O task
+    io_lock_take();
+    
+    // Repair HFS volume unless it was shut down cleanly
+    if (!fh->read_only) {
+        if (clean_marker_update(name, false)) {
+            LOG_PRINTF("[SYS] %s was shut down cleanly\n", name);
+        } else if (!overlay) {
+            Sys_repair_hfs_volume(fh);
+        }
+    }
+    
+    // Chunked image? Its chunks are read through the same map and File
+    dskz_backing backing = { dskz_backing_read, dskz_backing_write, fh };
+    bool is_dskz;
+    fh->dskz = DSKZOpen(&backing, fh->image_size, fh->read_only, &is_dskz);
+    if (is_dskz && !fh->dskz) {
+        io_lock_give();
+        LOG_PRINTF("[SYS] ERROR: %s is not a usable .dskz image\n", name);
+        fh->file.close();
+#if CD_AUDIO
+        CueClose(fh->cue);
+#endif
+        SDExtentMapFree(fh->map);
+        free_file_handle(fh);
         return NULL;
     }
+    if (fh->dskz) {
+        fh->size = DSKZSize(fh->dskz);
+    }
+    
+    if (overlay) {
+        char ovl_path[sizeof(fh->path) + 4];
+        snprintf(ovl_path, sizeof(ovl_path), "%s.ovl", name);
+        fh->overlay = OverlayOpen(ovl_path, fh->size, PrefsFindBool("discardoverlay"),
+                                  overlay_backing_read, fh);
+        if (!fh->overlay) {
+            // Never fall back to writing the shared image
+            LOG_PRINTF("[SYS] No overlay for %s, opening it read-only\n", name);
+            fh->read_only = true;
+        }
+    }
     
     fh->is_open = true;
+    fh->ra_next = -1;
     register_file_handle(fh);
+    io_lock_give();
     
-    Serial.printf("[SYS] Opened %s (%lld KB, ro=%d)\n", 
-                  name, (long long)(fh->size / 1024), fh->read_only);
+    LOG_PRINTF("[SYS] Opened %s (%lld KB, ro=%d)\n", 
+               name, (long long)(fh->size / 1024), fh->read_only);
     
+    preload_init(fh);
+    boot_trace_load(fh);
     return fh;
 }
 
@@ -313,54 +2023,309 @@ void Sys_close(void *arg)
     if (!fh) return;
     
     if (fh->is_open) {
+        // Under io_lock so no read-ahead is using the handle
+        io_lock_take();
+        cache_writeback(fh);
+        if (fh->ram && fh->ram_loaded < fh->ram_size) {
+            preloads_active--;
+        }
+        if (fh->replay) {
+            replays_active--;
+        }
         unregister_file_handle(fh);
+        if (!fh->read_only) {
+            clean_marker_update(fh->path, true);
+        }
         fh->file.flush();
         fh->file.close();
         fh->is_open = false;
+        io_lock_give();
+        cache_invalidate(fh);
     }
     
-    delete fh;
+    OverlayClose(fh->overlay);
+    DSKZClose(fh->dskz);
+#if CD_AUDIO
+    CueClose(fh->cue);
+#endif
+    SDExtentMapFree(fh->map);
+    free(fh->ram);
+    free(fh->ram_dirty);
+    free(fh->trace);
+    free(fh->replay);
+    free_file_handle(fh);
 }
 
 /*
- *  Read from a file/device - direct read, no caching
+ *  Read through the block cache, from the CPU thread or the I/O task
  */
-size_t Sys_read(void *arg, void *buffer, loff_t offset, size_t length)
+static size_t cache_read(file_handle *fh, void *buffer, loff_t offset, size_t length)
 {
-    file_handle *fh = (file_handle *)arg;
     if (!fh || !fh->is_open || !buffer) {
         return 0;
     }
     
-    if (!fh->file.seek(offset)) {
+    if (offset >= fh->size) {
         return 0;
     }
+    if (offset + (loff_t)length > fh->size) {
+        length = fh->size - offset;
+    }
+    if (trace_recording && length > 0) {
+        boot_trace_note(fh, offset, length);
+    }
     
-    return fh->file.read((uint8_t *)buffer, length);
+    // Preloaded part: straight from the PSRAM copy
+    if (fh->ram && !fh->uncached &&
+        offset + (loff_t)length <= (loff_t)__atomic_load_n(&fh->ram_loaded, __ATOMIC_ACQUIRE)) {
+        memcpy(buffer, fh->ram + offset, length);
+        ram_reads++;
+        return length;
+    }
+    
+    // Large reads bypass the cache, except those streaming a CD: they
+    // are what its read-ahead window was filled for
+    bool cd_stream = fh->is_cdrom && offset == fh->ra_next && fh->ra_streak >= READAHEAD_STREAK;
+    bool bypass = fh->uncached || (length >= CACHE_BYPASS_SIZE &&
+                  !(cd_stream && length <= CDROM_READAHEAD_MAX * CACHE_LINE_SIZE));
+    
+    size_t bytes_read = 0;
+    uint32 lines = 0, hits = 0;
+    if (!cache_data || bypass) {
+        // Large or uncached: one direct read
+        io_lock_take();
+        bytes_read = file_read_at(fh, (uint8 *)buffer, offset, length);
+        if (cache_dirty > 0 && bytes_read > 0) {
+            cache_overlay_dirty(fh, (uint8 *)buffer, offset, bytes_read);
+        }
+        io_lock_give();
+        if (cache_data && !fh->uncached) cache_bypass++;
+    } else {
+        uint8 *dst = (uint8 *)buffer;
+        loff_t pos = offset;
+        while (bytes_read < length) {
+            uint32 block = (uint32)(pos / CACHE_LINE_SIZE);
+            size_t in_block = (size_t)(pos % CACHE_LINE_SIZE);
+            size_t n = CACHE_LINE_SIZE - in_block;
+            if (n > length - bytes_read) n = length - bytes_read;
+            bool hit;
+            if (!cache_read_block(fh, block, in_block, dst, n, &hit)) break;
+            lines++;
+            if (hit) hits++;
+            dst += n;
+            pos += n;
+            bytes_read += n;
+        }
+    }
+    if (cache_data && !fh->uncached) {
+        if (fh->is_cdrom) {
+            if (cd_stream) {
+                cd_stream_reads++;
+                cd_stream_lines += lines;
+                cd_stream_hits += hits;
+            } else {
+                cd_meta_reads++;
+                cd_meta_lines += lines;
+                cd_meta_hits += hits;
+            }
+        }
+        cache_note_read(fh, offset, bytes_read);
+    }
+    return bytes_read;
 }
 
 /*
- *  Write to a file/device - direct write, no buffering
- *  Marks handle dirty for deferred flush
+ *  Read from a file/device through the block cache
  */
-size_t Sys_write(void *arg, void *buffer, loff_t offset, size_t length)
+size_t Sys_read(void *arg, void *buffer, loff_t offset, size_t length)
+{
+    uint32 start = micros();
+    size_t bytes_read = cache_read((file_handle *)arg, buffer, offset, length);
+    PerfRecord(perf_read_hist, micros() - start);
+    PerfAdd(perf_read_bytes, bytes_read);
+    
+    // The buffer is usually Mac RAM and may receive code (disk driver reads
+    // bypass the 68k write path), so drop any pre-decoded traces there
+    if (bytes_read > 0) {
+        FlushCodeCache(buffer, bytes_read);
+    }
+    return bytes_read;
+}
+
+/*
+ *  Write to a file/device through the block cache
+ *  Full or partial lines are updated in the cache and marked dirty for the
+ *  I/O task to write back; large writes, writes past the end of the file
+ *  and writes that find no free line go straight to the card
+ */
+static size_t cache_write(void *arg, void *buffer, loff_t offset, size_t length)
 {
     file_handle *fh = (file_handle *)arg;
     if (!fh || !fh->is_open || !buffer || fh->read_only) {
         return 0;
     }
     
-    if (!fh->file.seek(offset)) {
-        return 0;
+    // Under io_lock no line of this handle is being loaded or written back
+    io_lock_take();
+    
+    // The image no longer is as it was shut down
+    if (fh->marked_clean) {
+        clean_marker_update(fh->path, false);
+        fh->marked_clean = false;
     }
+    const uint8 *src = (const uint8 *)buffer;
     
-    size_t written = fh->file.write((uint8_t *)buffer, length);
-    if (written > 0) {
-        fh->is_dirty = true;  // Mark for deferred flush
+    // Preloaded part: update the PSRAM copy, the write-back follows. Cached
+    // lines are patched so neither copy goes back to the card stale.
+    size_t ram_bytes = 0;
+    if (fh->ram && offset < (loff_t)fh->ram_loaded) {
+        ram_bytes = fh->ram_loaded - offset;
+        if (ram_bytes > length) ram_bytes = length;
+        memcpy(fh->ram + offset, src, ram_bytes);
+        if (cache_data) {
+            cache_patch_lines(fh, src, offset, ram_bytes);
+        }
+        if (io_queue) {
+            ram_mark_dirty(fh, offset, ram_bytes);
+        } else if (file_write_at(fh, src, offset, ram_bytes) != ram_bytes) {
+            io_lock_give();
+            return 0;
+        }
+        last_write_ms = millis();
+        if (ram_bytes == length) {
+            io_lock_give();
+            return length;
+        }
+        src += ram_bytes;
+        offset += ram_bytes;
+        length -= ram_bytes;
+    }
+    
+    size_t written = 0;
+    bool write_back = io_queue && !fh->uncached && length < CACHE_BYPASS_SIZE &&
+                      offset + (loff_t)length <= fh->size;
+    
+    if (!write_back) {
+        written = file_write_at(fh, src, offset, length);
+        if (cache_data && written > 0) {
+            cache_patch_lines(fh, src, offset, written);
+        }
+        io_lock_give();
+        return ram_bytes + written;
+    }
+    
+    loff_t pos = offset;
+    while (written < length) {
+        uint32 block = (uint32)(pos / CACHE_LINE_SIZE);
+        size_t in_block = (size_t)(pos % CACHE_LINE_SIZE);
+        size_t n = CACHE_LINE_SIZE - in_block;
+        if (n > length - written) n = length - written;
+        
+        xSemaphoreTake(cache_lock, portMAX_DELAY);
+        int i = cache_find(fh, block);
+        bool fresh = i < 0;
+        if (fresh) {
+            i = cache_alloc(fh, block);
+        }
+        xSemaphoreGive(cache_lock);
+        
+        uint8 *line = i >= 0 ? cache_data + (size_t)i * CACHE_LINE_SIZE : NULL;
+        size_t len = line_bytes(fh, block);
+        if (line && fresh && n < len) {
+            // Partial write to an uncached line: fetch the rest first
+            if (file_read_at(fh, line, (loff_t)block * CACHE_LINE_SIZE, len) != len) {
+                xSemaphoreTake(cache_lock, portMAX_DELAY);
+                cache_remove(i);
+                xSemaphoreGive(cache_lock);
+                line = NULL;
+            }
+        }
+        
+        if (line) {
+            xSemaphoreTake(cache_lock, portMAX_DELAY);
+            cache_line *l = &cache_lines[i];
+            memcpy(line + in_block, src, n);
+            l->state = LINE_VALID;
+            l->referenced = 1;
+            if (!l->dirty) {
+                l->dirty = 1;
+                cache_dirty++;
+            }
+            xSemaphoreGive(cache_lock);
+        } else if (file_write_at(fh, src, pos, n) != n) {
+            break;
+        }
+        src += n;
+        pos += n;
+        written += n;
+    }
+    last_write_ms = millis();
+    bool over = cache_dirty >= cache_nlines / WRITEBACK_DIRTY_DIV;
+    io_lock_give();
+    
+    if (over) {
+        cache_request_writeback();
     }
+    return ram_bytes + written;
+}
+
+size_t Sys_write(void *arg, void *buffer, loff_t offset, size_t length)
+{
+    uint32 start = micros();
+    size_t written = cache_write(arg, buffer, offset, length);
+    PerfRecord(perf_write_hist, micros() - start);
+    PerfAdd(perf_write_bytes, written);
     return written;
 }
 
+/*
+ *  Benchmarks: start a handle cold (its dirty lines written back, its
+ *  lines dropped, its boot trace replay stopped), then route its reads and
+ *  writes through the cache or straight to the image. Preloaded parts are
+ *  still written to their PSRAM copy too, so it stays current.
+ */
+void Sys_set_cached(void *arg, bool cached)
+{
+    file_handle *fh = (file_handle *)arg;
+    if (!fh || !fh->is_open) return;
+    
+    io_lock_take();
+    cache_writeback(fh);
+    if (fh->replay) {
+        free(fh->replay);
+        fh->replay = NULL;
+        replays_active--;
+    }
+    fh->uncached = !cached;
+    fh->ra_next = -1;
+    fh->ra_streak = 0;
+    fh->ra_until = 0;
+    io_lock_give();
+    cache_invalidate(fh);
+}
+
+/*
+ *  Queue an asynchronous transfer for the I/O task; the caller flushes
+ *  code caches for reads once the transfer is done (CPU thread only)
+ */
+bool Sys_async_submit(sys_async_req *req)
+{
+    file_handle *fh = (file_handle *)req->fh;
+    if (!io_queue || !fh || !fh->is_open) {
+        return false;
+    }
+    
+    req->actual = 0;
+    req->done = false;
+    io_request r;
+    r.op = IO_ASYNC;
+    r.fh = fh;
+    r.block = 0;
+    r.count = 0;
+    r.async = req;
+    return xQueueSend(io_queue, &r, 0) == pdTRUE;
+}
+
 /*
  *  Return size of file/device
  */
@@ -374,11 +2339,16 @@ loff_t SysGetFileSize(void *arg)
 }
 
 /*
- *  Eject disk (no-op)
+ *  Eject disk - write back cached data before the volume goes away
  */
 void SysEject(void *arg)
 {
-    UNUSED(arg);
+    file_handle *fh = (file_handle *)arg;
+    if (!fh || !fh->is_open || fh->read_only) return;
+    
+    io_lock_take();
+    cache_writeback(fh);
+    io_lock_give();
 }
 
 /*
@@ -386,8 +2356,26 @@ void SysEject(void *arg)
  */
 bool SysFormat(void *arg)
 {
-    UNUSED(arg);
-    return false;
+    file_handle *fh = (file_handle *)arg;
+    if (!fh || !fh->is_open || fh->read_only) return false;
+    
+    // An image has no low-level format to write; a short floppy image is
+    // grown to the 1440K the .Sony driver formats in one write, so the
+    // data written next doesn't extend the file cluster by cluster
+    if (!fh->is_floppy || fh->dskz || fh->overlay || fh->size >= FLOPPY_HD_SIZE) {
+        return true;
+    }
+    static const uint8 zero[512] = {0};
+    io_lock_take();
+    cache_writeback(fh);
+    cache_invalidate(fh);   // The last line was short
+    bool ok = image_write_at(fh, zero, FLOPPY_HD_SIZE - sizeof(zero), sizeof(zero)) == sizeof(zero);
+    if (ok) {
+        file_flush(fh);
+    }
+    io_lock_give();
+    Serial.printf("[SYS] Formatted %s: %lld KB\n", fh->path, (long long)(fh->size / 1024));
+    return ok;
 }
 
 /*
@@ -423,6 +2411,60 @@ bool SysIsDiskInserted(void *arg)
 void SysPreventRemoval(void *arg) { UNUSED(arg); }
 void SysAllowRemoval(void *arg) { UNUSED(arg); }
 
+#if CD_AUDIO
+// CD-ROM audio, played from .cue images (see cdaudio_esp32.cpp); other images have none
+static inline cue_sheet *cd_cue(void *arg)
+{
+    file_handle *fh = (file_handle *)arg;
+    return fh && fh->is_open ? fh->cue : NULL;
+}
+
+bool SysCDReadTOC(void *arg, uint8 *toc)
+{
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CueReadTOC(cue, toc);
+}
+
+bool SysCDGetPosition(void *arg, uint8 *pos)
+{
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CDAudioGetPosition(cue, pos);
+}
+
+bool SysCDPlay(void *arg, uint8 start_m, uint8 start_s, uint8 start_f, uint8 end_m, uint8 end_s, uint8 end_f)
+{
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CDAudioPlay(cue, start_m, start_s, start_f, end_m, end_s, end_f);
+}
+
+bool SysCDPause(void *arg)
+{
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CDAudioPause(cue);
+}
+
+bool SysCDResume(void *arg)
+{
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CDAudioResume(cue);
+}
+
+bool SysCDStop(void *arg, uint8 lead_out_m, uint8 lead_out_s, uint8 lead_out_f)
+{
+    UNUSED(lead_out_m); UNUSED(lead_out_s); UNUSED(lead_out_f);
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CDAudioStop(cue);
+}
+
+bool SysCDScan(void *arg, uint8 start_m, uint8 start_s, uint8 start_f, bool reverse)
+{
+    cue_sheet *cue = cd_cue(arg);
+    return cue && CDAudioScan(cue, start_m, start_s, start_f, reverse);
+}
+
+void SysCDSetVolume(void *arg, uint8 left, uint8 right) { UNUSED(arg); CDAudioSetVolume(left, right); }
+void SysCDGetVolume(void *arg, uint8 &left, uint8 &right) { UNUSED(arg); CDAudioGetVolume(left, right); }
+#else
 // CD-ROM stubs
 bool SysCDReadTOC(void *arg, uint8 *toc) { UNUSED(arg); UNUSED(toc); return false; }
 bool SysCDGetPosition(void *arg, uint8 *pos) { UNUSED(arg); UNUSED(pos); return false; }
@@ -440,3 +2482,4 @@ bool SysCDScan(void *arg, uint8 start_m, uint8 start_s, uint8 start_f, bool reve
 }
 void SysCDSetVolume(void *arg, uint8 left, uint8 right) { UNUSED(arg); UNUSED(left); UNUSED(right); }
 void SysCDGetVolume(void *arg, uint8 &left, uint8 &right) { UNUSED(arg); left = right = 0; }
+#endif
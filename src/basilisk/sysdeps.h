@@ -44,8 +44,22 @@ using std::vector;
 // No prefetch buffer needed
 #define USE_PREFETCH_BUFFER 0
 
-// ExtFS not supported on ESP32
-#define SUPPORTS_EXTFS 0
+// ExtFS shares a folder on the SD card (extfs_esp32.cpp)
+#ifndef SUPPORTS_EXTFS
+#define SUPPORTS_EXTFS 1
+#endif
+
+// Time Manager tasks wake at their deadline through an esp_timer (timer.cpp)
+// instead of being polled from the 60Hz interrupt; not with
+// TIMER_EMULATED_CYCLES, whose clock an esp_timer can't follow
+#ifndef PRECISE_TIMING
+#if TIMER_EMULATED_CYCLES
+#define PRECISE_TIMING 0
+#else
+#define PRECISE_TIMING 1
+#define PRECISE_TIMING_ESP32 1
+#endif
+#endif
 
 // No UDP tunnel support
 #define SUPPORTS_UDP_TUNNEL 0
@@ -59,13 +73,17 @@ using std::vector;
 #undef WORDS_BIGENDIAN
 
 /*
- * Data type sizes for ESP32-P4
+ * Data type sizes for ESP32-P4 (the host build in tools/host is LP64)
  */
 #define SIZEOF_SHORT 2
 #define SIZEOF_INT 4
-#define SIZEOF_LONG 4
+#ifndef SIZEOF_LONG
+#define SIZEOF_LONG __SIZEOF_LONG__
+#endif
 #define SIZEOF_LONG_LONG 8
-#define SIZEOF_VOID_P 4
+#ifndef SIZEOF_VOID_P
+#define SIZEOF_VOID_P __SIZEOF_POINTER__
+#endif
 #define SIZEOF_FLOAT 4
 #define SIZEOF_DOUBLE 8
 
@@ -80,11 +98,20 @@ typedef uint32_t uint32;
 typedef int32_t int32;
 typedef uint64_t uint64;
 typedef int64_t int64;
+#if SIZEOF_VOID_P == 4
 typedef uint32_t uintptr;
 typedef int32_t intptr;
+#else
+typedef uint64_t uintptr;
+typedef int64_t intptr;
+#endif
 
-// File offset type
+// File offset type (the host's C library has its own)
+#if SIZEOF_VOID_P == 4
 typedef int32_t loff_t;
+#else
+#include <sys/types.h>
+#endif
 
 // Character address type
 typedef char* caddr_t;
@@ -192,9 +219,14 @@ static ALWAYS_INLINE void do_put_mem_word(uae_u16 *a, uae_u32 v) {
 #define ENUMNAME(name) name
 
 /*
- * Logging function
+ * Logging function (deferred to the log task with LOG_ASYNC, see log_esp32.h)
  */
+#if LOG_ASYNC
+extern void LogPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define write_log LogPrintf
+#else
 #define write_log Serial.printf
+#endif
 
 /*
  * Register parameter hints (not used on ESP32)
@@ -242,10 +274,17 @@ static inline int spin_trylock(b2_spinlock_t *lock) {
 }
 
 /*
- * Mutex implementation (single-threaded, no-op)
+ * Mutex: a FreeRTOS spin lock (portMUX) that also masks interrupts on the
+ * holding core, so the holder can't be preempted and a waiter never
+ * sleeps. Only for short critical sections that don't block; the host
+ * build has one thread and keeps it a no-op.
  */
 struct B2_mutex {
+#ifdef ESP32
+    portMUX_TYPE mux;
+#else
     int dummy;
+#endif
 };
 
 /*
@@ -23,6 +23,7 @@
 #include "macos_util.h"
 #include "main.h"
 #include "cpu_emulation.h"
+#include "snapshot.h"
 
 #ifdef PRECISE_TIMING_POSIX
 #include <pthread.h>
@@ -34,6 +35,10 @@
 #include <mach/mach.h>
 #endif
 
+#ifdef PRECISE_TIMING_ESP32
+#include "esp_timer.h"
+#endif
+
 #define DEBUG 0
 #include "debug.h"
 
@@ -50,14 +55,50 @@ enum {	// TMTask struct
 };
 
 
-// Array of additional info for each installed TMTask
+// Array of additional info for each installed TMTask. The descriptors come
+// from a fixed pool (internal RAM, no heap traffic on InsTime/RmvTime), and
+// the index of a task's descriptor is kept in its tmReserved field, tagged
+// with TM_DESC_TAG, so it is found without a search. A task whose tag the
+// application cleared or overwrote is found through a hash on its address.
+const int TM_DESC_MAX = 128;
+const uint32 TM_DESC_TAG = 0x544d0000;	// 'TM' in the upper word, index in the lower
+const int TM_DESC_HASH = 64;			// Hash buckets, power of 2
+
 struct TMDesc {
-	uint32 task;		// Mac address of associated TMTask
+	uint32 task;		// Mac address of associated TMTask, 0 if descriptor is free
 	tm_time_t wakeup;	// Time this task is scheduled for execution
-	TMDesc *next;
+	int next_free;		// Next free descriptor, -1 for end of list
+	int next_hash;		// Next descriptor in the same hash bucket, -1 for end of chain
+#ifdef PRECISE_TIMING_ESP32
+	int heap_index;		// Position in wakeup_heap, -1 if not scheduled
+#endif
 };
 
-static TMDesc *tmDescList;
+static TMDesc tm_desc[TM_DESC_MAX];
+static int tm_desc_free = -1;	// First free descriptor, -1 if pool exhausted
+static int tm_desc_hash[TM_DESC_HASH];	// First descriptor per bucket, -1 if none
+
+static inline int desc_hash(uint32 tm)
+{
+	// TMTask records are at least word aligned and usually sit in an
+	// application's globals or heap, a few bytes to a few KB apart
+	return ((tm >> 1) ^ (tm >> 7)) & (TM_DESC_HASH - 1);
+}
+
+static void hash_insert(int i)
+{
+	int *head = &tm_desc_hash[desc_hash(tm_desc[i].task)];
+	tm_desc[i].next_hash = *head;
+	*head = i;
+}
+
+static void hash_remove(int i)
+{
+	int *link = &tm_desc_hash[desc_hash(tm_desc[i].task)];
+	while (*link != i)
+		link = &tm_desc[*link].next_hash;
+	*link = tm_desc[i].next_hash;
+}
 
 #if PRECISE_TIMING
 #ifdef PRECISE_TIMING_BEOS
@@ -86,36 +127,75 @@ static tm_time_t wakeup_time = wakeup_time_max;
 static semaphore_t wakeup_time_sem;
 static void *timer_func(void *arg);
 #endif
+#ifdef PRECISE_TIMING_ESP32
+// Scheduled tasks are kept in a min-heap on their wakeup time, and a one-shot
+// esp_timer is armed for the root. The heap is only touched from the emulator
+// thread (Time Manager EmulOps and TimerInterrupt()); the esp_timer callback
+// just raises INTFLAG_TIMER.
+static esp_timer_handle_t wakeup_timer = NULL;
+static bool timer_thread_active = false;
+static const tm_time_t wakeup_time_max = 0xffffffffffffffffULL;
+static tm_time_t wakeup_time = wakeup_time_max;	// Deadline wakeup_timer is armed for
+static TMDesc *wakeup_heap[TM_DESC_MAX];
+static int wakeup_heap_count = 0;
+static void timer_func(void *arg);
+#endif
 #endif
 
 
+#ifdef PRECISE_TIMING_ESP32
+static void heap_remove(TMDesc *desc);
+#endif
+
+/*
+ *  Allocate descriptor for given TMTask, NULL if pool exhausted
+ */
+
+inline static TMDesc *alloc_desc(uint32 tm)
+{
+	int i = tm_desc_free;
+	if (i < 0)
+		return NULL;
+	TMDesc *desc = &tm_desc[i];
+	tm_desc_free = desc->next_free;
+	desc->task = tm;
+#ifdef PRECISE_TIMING_ESP32
+	desc->heap_index = -1;
+#endif
+	hash_insert(i);
+	WriteMacInt32(tm + tmReserved, TM_DESC_TAG | i);
+	return desc;
+}
+
 inline static void free_desc(TMDesc *desc)
 {
-	if (desc == tmDescList) {
-		tmDescList = desc->next;
-	} else {
-		for (TMDesc *d = tmDescList; d; d = d->next) {
-			if (d->next == desc) {
-				d->next = desc->next;
-				break;
-			}
-		}
-	}
-	delete desc;
+#ifdef PRECISE_TIMING_ESP32
+	heap_remove(desc);
+#endif
+	WriteMacInt32(desc->task + tmReserved, 0);
+	hash_remove(desc - tm_desc);
+	desc->task = 0;
+	desc->next_free = tm_desc_free;
+	tm_desc_free = desc - tm_desc;
 }
 
 /*
- *  Find descriptor associated with given TMTask
+ *  Find descriptor associated with given TMTask, NULL if it has none
  */
 
 inline static TMDesc *find_desc(uint32 tm)
 {
-	TMDesc *desc = tmDescList;
-	while (desc) {
-		if (desc->task == tm) {
-			return desc;
+	uint32 tag = ReadMacInt32(tm + tmReserved);
+	if ((tag & 0xffff0000) == TM_DESC_TAG && (tag & 0xffff) < TM_DESC_MAX && tm_desc[tag & 0xffff].task == tm)
+		return &tm_desc[tag & 0xffff];
+
+	// No tag (a fresh task, or tmReserved overwritten by the application),
+	// look through the task's hash bucket
+	for (int i = tm_desc_hash[desc_hash(tm)]; i >= 0; i = tm_desc[i].next_hash) {
+		if (tm_desc[i].task == tm) {
+			WriteMacInt32(tm + tmReserved, TM_DESC_TAG | i);
+			return &tm_desc[i];
 		}
-		desc = desc->next;
 	}
 	return NULL;
 }
@@ -154,6 +234,97 @@ static void dequeue_tm(uint32 tm)
 }
 
 
+/*
+ *  Wakeup heap operations
+ */
+
+#ifdef PRECISE_TIMING_ESP32
+static inline void heap_set(int i, TMDesc *desc)
+{
+	wakeup_heap[i] = desc;
+	desc->heap_index = i;
+}
+
+static void heap_sift_up(int i)
+{
+	TMDesc *desc = wakeup_heap[i];
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (timer_cmp_time(desc->wakeup, wakeup_heap[parent]->wakeup) >= 0)
+			break;
+		heap_set(i, wakeup_heap[parent]);
+		i = parent;
+	}
+	heap_set(i, desc);
+}
+
+static void heap_sift_down(int i)
+{
+	TMDesc *desc = wakeup_heap[i];
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= wakeup_heap_count)
+			break;
+		if (child + 1 < wakeup_heap_count && timer_cmp_time(wakeup_heap[child + 1]->wakeup, wakeup_heap[child]->wakeup) < 0)
+			child++;
+		if (timer_cmp_time(wakeup_heap[child]->wakeup, desc->wakeup) >= 0)
+			break;
+		heap_set(i, wakeup_heap[child]);
+		i = child;
+	}
+	heap_set(i, desc);
+}
+
+// Schedule task at desc->wakeup, or move it there if already scheduled
+static void heap_insert(TMDesc *desc)
+{
+	if (desc->heap_index < 0)
+		heap_set(wakeup_heap_count++, desc);	// Can't overflow, one entry per descriptor
+	heap_sift_up(desc->heap_index);
+	heap_sift_down(desc->heap_index);
+}
+
+static void heap_remove(TMDesc *desc)
+{
+	int i = desc->heap_index;
+	if (i < 0)
+		return;
+	desc->heap_index = -1;
+	TMDesc *last = wakeup_heap[--wakeup_heap_count];
+	if (i < wakeup_heap_count) {
+		heap_set(i, last);
+		heap_sift_up(i);
+		heap_sift_down(last->heap_index);
+	}
+}
+
+// Arm wakeup_timer for the earliest scheduled task
+static void timer_rearm(void)
+{
+	if (!timer_thread_active)
+		return;
+	tm_time_t next = wakeup_heap_count ? wakeup_heap[0]->wakeup : wakeup_time_max;
+	if (next == wakeup_time)
+		return;
+	esp_timer_stop(wakeup_timer);	// Fails harmlessly if it isn't running
+	wakeup_time = next;
+	if (next == wakeup_time_max)
+		return;
+
+	tm_time_t now;
+	timer_current_time(now);
+	if (timer_cmp_time(next, now) <= 0) {
+
+		// Already due, trigger interrupt right away
+		wakeup_time = wakeup_time_max;
+		SetInterruptFlag(INTFLAG_TIMER);
+		TriggerInterrupt();
+	} else
+		esp_timer_start_once(wakeup_timer, next - now);
+}
+#endif
+
+
 /*
  *  Timer thread operations
  */
@@ -282,6 +453,15 @@ void TimerInit(void)
 #ifdef PRECISE_TIMING_POSIX
 	timer_thread_active = timer_thread_init();
 #endif
+#ifdef PRECISE_TIMING_ESP32
+	esp_timer_create_args_t args = {};
+	args.callback = timer_func;
+	args.dispatch_method = ESP_TIMER_TASK;
+	args.name = "Time Manager";
+	timer_thread_active = (esp_timer_create(&args, &wakeup_timer) == ESP_OK);
+	if (!timer_thread_active)
+		printf("FATAL: Cannot create Time Manager timer\n");
+#endif
 #endif
 }
 
@@ -309,6 +489,13 @@ void TimerExit(void)
 #endif
 #ifdef PRECISE_TIMING_POSIX
 		timer_thread_kill();
+#endif
+#ifdef PRECISE_TIMING_ESP32
+		timer_thread_active = false;
+		esp_timer_stop(wakeup_timer);
+		esp_timer_delete(wakeup_timer);
+		wakeup_timer = NULL;
+		wakeup_time = wakeup_time_max;
 #endif
 	}
 #endif
@@ -321,14 +508,75 @@ void TimerExit(void)
 
 void TimerReset(void)
 {
-	TMDesc *desc = tmDescList;
-	while (desc) {
-		TMDesc *next = desc->next;
-		delete desc;
-		desc = next;
+	for (int i = 0; i < TM_DESC_MAX; i++) {
+		tm_desc[i].task = 0;
+		tm_desc[i].next_free = i + 1 < TM_DESC_MAX ? i + 1 : -1;
+	}
+	tm_desc_free = 0;
+	for (int i = 0; i < TM_DESC_HASH; i++)
+		tm_desc_hash[i] = -1;
+#ifdef PRECISE_TIMING_ESP32
+	wakeup_heap_count = 0;
+	timer_rearm();
+#endif
+}
+
+
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the descriptors; wakeup times are kept relative to the
+ *  time of the snapshot, as the host clock starts over at the next boot
+ */
+
+bool TimerSnapshot(void)
+{
+	tm_time_t now;
+	timer_current_time(now);
+	for (int i = 0; i < TM_DESC_MAX; i++) {
+		int64 remaining = 0;
+		if (!SnapshotRestoring() && tm_desc[i].task)
+			remaining = (int64)(tm_desc[i].wakeup - now);
+#ifdef PRECISE_TIMING_ESP32
+		uint8 scheduled = tm_desc[i].heap_index >= 0;
+#else
+		uint8 scheduled = 0;
+#endif
+		if (!SnapshotVar(tm_desc[i].task) || !SnapshotVar(remaining) || !SnapshotVar(scheduled))
+			return false;
+		if (SnapshotRestoring()) {
+			tm_desc[i].wakeup = now + remaining;
+#ifdef PRECISE_TIMING_ESP32
+			tm_desc[i].heap_index = scheduled ? 0 : -1;
+#endif
+		}
+	}
+	if (!SnapshotRestoring())
+		return true;
+
+	// Rebuild the free list, the hash and the wakeup heap
+	tm_desc_free = -1;
+	for (int i = 0; i < TM_DESC_HASH; i++)
+		tm_desc_hash[i] = -1;
+	for (int i = TM_DESC_MAX - 1; i >= 0; i--) {
+		if (tm_desc[i].task == 0) {
+			tm_desc[i].next_free = tm_desc_free;
+			tm_desc_free = i;
+		} else
+			hash_insert(i);
+	}
+#ifdef PRECISE_TIMING_ESP32
+	wakeup_heap_count = 0;
+	for (int i = 0; i < TM_DESC_MAX; i++) {
+		if (tm_desc[i].heap_index >= 0) {
+			tm_desc[i].heap_index = -1;
+			heap_insert(&tm_desc[i]);
+		}
 	}
-	tmDescList = NULL;
+	timer_rearm();
+#endif
+	return true;
 }
+#endif
 
 
 /*
@@ -339,13 +587,13 @@ int16 InsTime(uint32 tm, uint16 trap)
 {
 	D(bug("InsTime %08lx, trap %04x\n", tm, trap));
 	WriteMacInt16(tm + qType, (ReadMacInt16(tm + qType) & 0x1fff) | ((trap << 4) & 0x6000));
+	// find_desc() also catches a task record the application cleared or
+	// reused, which must not get a second descriptor while its first is live
 	if (find_desc(tm))
 		printf("WARNING: InsTime(%08x): Task re-inserted\n", tm);
-	else {
-		TMDesc *desc = new TMDesc;
-		desc->task = tm;
-		desc->next = tmDescList;
-		tmDescList = desc;
+	else if (alloc_desc(tm) == NULL) {
+		printf("WARNING: InsTime(%08x): Too many tasks\n", tm);
+		return qErr;
 	}
 	return 0;
 }
@@ -384,11 +632,14 @@ int16 RmvTime(uint32 tm)
 		// Yes, make task inactive and remove it from the Time Manager queue
 		WriteMacInt16(tm + qType, ReadMacInt16(tm + qType) & 0x7fff);
 		dequeue_tm(tm);
-#if PRECISE_TIMING
+#ifdef PRECISE_TIMING_ESP32
+		heap_remove(desc);
+		timer_rearm();
+#elif PRECISE_TIMING
 		// Look for next task to be called and set wakeup_time
 		wakeup_time = wakeup_time_max;
-		for (TMDesc *d = tmDescList; d; d = d->next)
-			if ((ReadMacInt16(d->task + qType) & 0x8000))
+		for (TMDesc *d = tm_desc; d < tm_desc + TM_DESC_MAX; d++)
+			if (d->task && (ReadMacInt16(d->task + qType) & 0x8000))
 				if (timer_cmp_time(d->wakeup, wakeup_time) < 0)
 					wakeup_time = d->wakeup;
 #endif
@@ -498,11 +749,14 @@ int16 PrimeTime(uint32 tm, int32 time)
 #endif
 	WriteMacInt16(tm + qType, ReadMacInt16(tm + qType) | 0x8000);
 	enqueue_tm(tm);
-#if PRECISE_TIMING
+#ifdef PRECISE_TIMING_ESP32
+	heap_insert(desc);
+	timer_rearm();
+#elif PRECISE_TIMING
 	// Look for next task to be called and set wakeup_time
 	wakeup_time = wakeup_time_max;
-	for (TMDesc *d = tmDescList; d; d = d->next)
-		if ((ReadMacInt16(d->task + qType) & 0x8000))
+	for (TMDesc *d = tm_desc; d < tm_desc + TM_DESC_MAX; d++)
+		if (d->task && (ReadMacInt16(d->task + qType) & 0x8000))
 			if (timer_cmp_time(d->wakeup, wakeup_time) < 0)
 				wakeup_time = d->wakeup;
 #ifdef PRECISE_TIMING_BEOS
@@ -601,41 +855,72 @@ static void *timer_func(void *arg)
 }
 #endif
 
+#ifdef PRECISE_TIMING_ESP32
+static void timer_func(void *arg)
+{
+	// Timer expired, trigger interrupt
+	SetInterruptFlag(INTFLAG_TIMER);
+	TriggerInterrupt();
+}
+#endif
+
+
+/*
+ *  Run expired timer task
+ */
+
+static void call_tm(uint32 tm)
+{
+	// Mark as inactive and remove it from the Time Manager queue
+	WriteMacInt16(tm + qType, ReadMacInt16(tm + qType) & 0x7fff);
+	dequeue_tm(tm);
+
+	// Call timer function
+	uint32 addr = ReadMacInt32(tm + tmAddr);
+	if (addr) {
+		D(bug("Calling TimeTask %08lx, addr %08lx\n", tm, addr));
+		M68kRegisters r;
+		r.a[0] = addr;
+		r.a[1] = tm;
+		Execute68k(r.a[0], &r);
+		D(bug(" returned from TimeTask\n"));
+	}
+}
+
 
 /*
- *  Timer interrupt function (executed as part of 60Hz interrupt)
+ *  Timer interrupt function (executed as part of 60Hz interrupt, or of
+ *  the INTFLAG_TIMER interrupt with PRECISE_TIMING)
  */
 
 void TimerInterrupt(void)
 {
-	// Look for active TMTasks that have expired
 	tm_time_t now;
 	timer_current_time(now);
-	TMDesc *desc = tmDescList;
-	while (desc) {
-		TMDesc *next = desc->next;
+
+#ifdef PRECISE_TIMING_ESP32
+	// wakeup_timer has fired; pop the expired tasks off the heap. A task
+	// that primes itself again for a time already past runs on the next
+	// interrupt, not in this loop.
+	wakeup_time = wakeup_time_max;
+	int n = wakeup_heap_count;
+	while (n-- > 0 && wakeup_heap_count > 0 && timer_cmp_time(wakeup_heap[0]->wakeup, now) <= 0) {
+		uint32 tm = wakeup_heap[0]->task;
+		heap_remove(wakeup_heap[0]);
+		if (ReadMacInt16(tm + qType) & 0x8000)
+			call_tm(tm);
+	}
+	timer_rearm();
+#else
+	// Look for active TMTasks that have expired
+	for (TMDesc *desc = tm_desc; desc < tm_desc + TM_DESC_MAX; desc++) {
 		uint32 tm = desc->task;
-		if ((ReadMacInt16(tm + qType) & 0x8000) && timer_cmp_time(desc->wakeup, now) <= 0) {
-
-			// Found one, mark as inactive and remove it from the Time Manager queue
-			WriteMacInt16(tm + qType, ReadMacInt16(tm + qType) & 0x7fff);
-			dequeue_tm(tm);
-
-			// Call timer function
-			uint32 addr = ReadMacInt32(tm + tmAddr);
-			if (addr) {
-				D(bug("Calling TimeTask %08lx, addr %08lx\n", tm, addr));
-				M68kRegisters r;
-				r.a[0] = addr;
-				r.a[1] = tm;
-				Execute68k(r.a[0], &r);
-				D(bug(" returned from TimeTask\n"));
-			}
-		}
-		desc = next;
+		if (tm && (ReadMacInt16(tm + qType) & 0x8000) && timer_cmp_time(desc->wakeup, now) <= 0)
+			call_tm(tm);
 	}
+#endif
 
-#if PRECISE_TIMING
+#if PRECISE_TIMING && !defined(PRECISE_TIMING_ESP32)
 	// Look for next task to be called and set wakeup_time
 #if PRECISE_TIMING_BEOS
 	while (acquire_sem(wakeup_time_sem) == B_INTERRUPTED) ;
@@ -650,8 +935,8 @@ void TimerInterrupt(void)
 	timer_thread_suspend();
 #endif
 	wakeup_time = wakeup_time_max;
-	for (TMDesc *d = tmDescList; d; d = d->next)
-		if ((ReadMacInt16(d->task + qType) & 0x8000))
+	for (TMDesc *d = tm_desc; d < tm_desc + TM_DESC_MAX; d++)
+		if (d->task && (ReadMacInt16(d->task + qType) & 0x8000))
 			if (timer_cmp_time(d->wakeup, wakeup_time) < 0)
 				wakeup_time = d->wakeup;
 #if PRECISE_TIMING_BEOS
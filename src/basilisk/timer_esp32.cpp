@@ -5,11 +5,25 @@
  */
 
 #include "sysdeps.h"
+#include "main.h"
 #include "timer.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "perf_esp32.h"
+#include "replay_esp32.h"
+
 #define DEBUG 0
 #include "debug.h"
 
+// Longest sleep in idle_wait(); the 60Hz tick timer normally ends it sooner
+#define IDLE_WAIT_MAX_MS 20
+
+static TaskHandle_t idle_task = NULL;      // Emulator task, once it has idled
+static uint64 idle_total_us = 0;           // Time spent blocked in idle_wait()
+static perf_counter *idle_counter = NULL;  // The same as "cpu.idle_us" for telemetry
+
 /*
  *  Return microseconds since boot
  */
@@ -33,21 +47,85 @@ void Delay_usec(uint64 usec)
     }
 }
 
+/*
+ *  Block until idle_resume() or IDLE_WAIT_MAX_MS
+ */
+static void idle_sleep(void)
+{
+    int64_t start = esp_timer_get_time();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IDLE_WAIT_MAX_MS));
+    uint32 slept_us = (uint32)(esp_timer_get_time() - start);
+    idle_total_us += slept_us;
+    PerfAdd(idle_counter, slept_us);
+}
+
+static void idle_register(void)
+{
+    if (idle_task == NULL) {
+        idle_task = xTaskGetCurrentTaskHandle();
+        idle_counter = PerfCounter("cpu.idle_us");
+    }
+}
+
 /*
  *  Suspend emulator thread, wait for wakeup
- *  (Not used in single-threaded ESP32 implementation)
+ *  
+ *  Called when Mac OS is idle (SynchIdleTime() patch, 68k STOP). Blocks the
+ *  emulator task until TriggerInterrupt() is called for the next 60Hz tick,
+ *  an input event, a Time Manager task or a disk transfer, so Core 1 sleeps
+ *  instead of spinning through the event loop.
  */
 void idle_wait(void)
 {
-    // In single-threaded mode, just yield briefly
-    yield();
+    idle_register();
+    
+    // An interrupt raised meanwhile is either still pending or has left a
+    // notification behind; both end the wait right away
+    if (InterruptFlags) {
+        return;
+    }
+#if REPLAY
+    // A replay runs flat out; a recording has its flags held back
+    if (replay_mode == REPLAY_PLAY || (replay_mode == REPLAY_RECORD && replay_pending)) {
+        return;
+    }
+#endif
+    
+    idle_sleep();
+}
+
+/*
+ *  Suspend emulator thread while the 68k is stopped with the pending
+ *  interrupt masked: only a new TriggerInterrupt() (or the timeout) can
+ *  change anything, so the pending flags don't end the wait
+ */
+void idle_wait_masked(void)
+{
+    idle_register();
+#if REPLAY
+    if (replay_mode == REPLAY_PLAY) {
+        return;
+    }
+#endif
+    idle_sleep();
 }
 
 /*
  *  Resume execution of emulator thread
- *  (Not used in single-threaded ESP32 implementation)
+ *  (called by TriggerInterrupt(), from any task)
  */
 void idle_resume(void)
 {
-    // No-op in single-threaded mode
+    TaskHandle_t task = idle_task;
+    if (task != NULL && xTaskGetCurrentTaskHandle() != task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+/*
+ *  Total time the emulator task spent in idle_wait() [us]
+ */
+uint64 idle_time_usec(void)
+{
+    return idle_total_us;
 }
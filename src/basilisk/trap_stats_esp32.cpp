@@ -0,0 +1,235 @@
+/*
+ *  trap_stats_esp32.cpp - Host time spent in EmulOps and A-line traps
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Per EmulOp and per A-line trap: calls, host microseconds and the
+ *  longest single call, so a workload shows whether disk, timer or video
+ *  driver calls are what hold the 68k up. Time the CPU task sleeps in
+ *  idle_wait() is left out (SynchIdleTime, WaitNextEvent).
+ *
+ *  EmulOps are timed exactly around EmulOp(). A-line traps are 68k code,
+ *  so a trap counts as open from the A-line instruction until A7 has
+ *  climbed back to where it was when the trap was taken - the routine has
+ *  returned and popped its arguments. That is checked on every trap and at
+ *  the end of every instruction batch (up to a few hundred instructions),
+ *  which bounds the error. Times are inclusive: a trap's time includes the
+ *  traps and EmulOps it calls and the interrupts taken meanwhile.
+ *
+ *  Each telemetry line gets the EmulOps and traps with the most time in
+ *  its interval:
+ *
+ *    "emulops":[["DISK_PRIME",calls,us,max_us],...],"traps":[["A9FE",calls,us,max_us],...]
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "main.h"
+#include "timer.h"
+#include "emul_op.h"
+#include "mem_plan_esp32.h"
+#include "perf_esp32.h"
+#include "trap_stats_esp32.h"
+
+#include <esp_heap_caps.h>
+#include "esp_timer.h"
+
+#if TRAP_STATS
+
+#define TRAP_COUNT              (256 + 1024)    // OS traps, then Toolbox traps
+#define EMULOP_COUNT            (M68K_EMUL_OP_MAX - M68K_EXEC_RETURN)
+#define TRAP_STACK_DEPTH        32
+#define TRAP_STATS_TOP          8               // Entries per telemetry line
+
+struct trap_counts {
+    uint32 calls;
+    uint32 us;
+    uint32 max_us;                              // Since the last telemetry line
+};
+
+// Where the last telemetry line left off
+struct trap_reported {
+    uint32 calls;
+    uint32 us;
+};
+
+struct open_trap {
+    uint16 index;
+    uint32 a7;
+    trap_stats_mark start;
+};
+
+static const char *const emulop_names[EMULOP_COUNT] = {
+    "EXEC_RETURN", "EMUL_BREAK", "SHUTDOWN", "RESET", "CLKNOMEM", "READ_XPRAM", "READ_XPRAM2",
+    "PATCH_BOOT_GLOBS", "FIX_BOOTSTACK", "FIX_MEMSIZE", "INSTALL_DRIVERS", "SERD", "SONY_OPEN",
+    "SONY_PRIME", "SONY_CONTROL", "SONY_STATUS", "DISK_OPEN", "DISK_PRIME", "DISK_CONTROL",
+    "DISK_STATUS", "CDROM_OPEN", "CDROM_PRIME", "CDROM_CONTROL", "CDROM_STATUS", "VIDEO_OPEN",
+    "VIDEO_CONTROL", "VIDEO_STATUS", "SERIAL_OPEN", "SERIAL_PRIME", "SERIAL_CONTROL",
+    "SERIAL_STATUS", "SERIAL_CLOSE", "ETHER_OPEN", "ETHER_CONTROL", "ETHER_READ_PACKET", "ADBOP",
+    "INSTIME", "RMVTIME", "PRIMETIME", "MICROSECONDS", "SCSI_DISPATCH", "IRQ", "PUT_SCRAP",
+    "GET_SCRAP", "CHECKLOAD", "AUDIO", "EXTFS_COMM", "EXTFS_HFS", "BLOCK_MOVE", "SOUNDIN_OPEN",
+    "SOUNDIN_PRIME", "SOUNDIN_CONTROL", "SOUNDIN_STATUS", "SOUNDIN_CLOSE", "DEBUGUTIL",
+    "IDLE_TIME", "SUSPEND", "CURSOR", "SYSBEEP",
+    "NATIVE_BLOCK_MOVE", "QD_ACCEL"
+};
+static_assert(sizeof(emulop_names) / sizeof(emulop_names[0]) == EMULOP_COUNT,
+              "emulop_names out of step with emul_op.h");
+
+int trap_stats_depth = 0;
+uint32 trap_stats_top_a7 = 0;
+
+static trap_counts *trap_table = NULL;
+static trap_counts emulop_table[EMULOP_COUNT];
+static trap_reported *trap_last = NULL;
+static trap_reported emulop_last[EMULOP_COUNT];
+static open_trap trap_stack[TRAP_STACK_DEPTH];     // Deeper traps go untimed
+
+// Table index of an A-line trap word, flag bits dropped
+static int trap_index(uint16 opcode)
+{
+    return (opcode & 0x0800) ? 256 + (opcode & 0x03ff) : (opcode & 0x00ff);
+}
+
+static void account(trap_counts *t, uint32 us)
+{
+    __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->us, us, __ATOMIC_RELAXED);
+    uint32 max = __atomic_load_n(&t->max_us, __ATOMIC_RELAXED);
+    while (us > max &&
+           !__atomic_compare_exchange_n(&t->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Busy time since start: wall clock minus sleeps in idle_wait()
+static uint32 busy_us(uint64 start_us, uint64 start_idle_us)
+{
+    uint64 wall = esp_timer_get_time() - start_us;
+    uint64 idle = idle_time_usec() - start_idle_us;
+    return wall > idle ? (uint32)(wall - idle) : 0;
+}
+
+trap_stats_mark TrapStatsStart(void)
+{
+    trap_stats_mark m;
+    m.us = esp_timer_get_time();
+    m.idle_us = idle_time_usec();
+    return m;
+}
+
+void TrapStatsEmulOpEnd(uint16 opcode, trap_stats_mark start)
+{
+    uint32 index = opcode - M68K_EXEC_RETURN;
+    if (index < EMULOP_COUNT) {
+        account(&emulop_table[index], busy_us(start.us, start.idle_us));
+    }
+}
+
+void TrapStatsUnwind(uint32 a7)
+{
+    while (trap_stats_depth > 0 && a7 >= trap_stack[trap_stats_depth - 1].a7) {
+        open_trap *t = &trap_stack[--trap_stats_depth];
+        if (trap_table) {
+            account(&trap_table[t->index], busy_us(t->start.us, t->start.idle_us));
+        }
+    }
+    trap_stats_top_a7 = trap_stats_depth > 0 ? trap_stack[trap_stats_depth - 1].a7 : 0;
+}
+
+void TrapStatsALine(uint16 opcode, uint32 a7)
+{
+    TrapStatsUnwind(a7);
+    if (trap_stats_depth == TRAP_STACK_DEPTH) {
+        return;
+    }
+    open_trap *t = &trap_stack[trap_stats_depth++];
+    t->index = trap_index(opcode);
+    t->a7 = a7;
+    t->start = TrapStatsStart();
+    trap_stats_top_a7 = a7;
+}
+
+/*
+ *  Write the TRAP_STATS_TOP entries with the most time since the last call
+ *  as a JSON array; returns its length, 0 if nothing ran or it didn't fit
+ */
+static size_t write_top(char *buf, size_t size, trap_counts *table, trap_reported *last, int count,
+                        bool is_trap)
+{
+    int top[TRAP_STATS_TOP];
+    uint32 top_us[TRAP_STATS_TOP];
+    int ntop = 0;
+    for (int i = 0; i < count; i++) {
+        uint32 us = __atomic_load_n(&table[i].us, __ATOMIC_RELAXED) - last[i].us;
+        uint32 calls = __atomic_load_n(&table[i].calls, __ATOMIC_RELAXED) - last[i].calls;
+        if (calls == 0) continue;
+        int pos = ntop < TRAP_STATS_TOP ? ntop++ : TRAP_STATS_TOP;
+        while (pos > 0 && top_us[pos - 1] < us) {
+            if (pos < TRAP_STATS_TOP) {
+                top[pos] = top[pos - 1];
+                top_us[pos] = top_us[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < TRAP_STATS_TOP) {
+            top[pos] = i;
+            top_us[pos] = us;
+        }
+    }
+
+    size_t len = 0;
+    int n = snprintf(buf, size, "[");
+    len = n > 0 ? n : 0;
+    for (int j = 0; j < ntop && len < size; j++) {
+        int i = top[j];
+        uint32 calls = __atomic_load_n(&table[i].calls, __ATOMIC_RELAXED) - last[i].calls;
+        uint32 max = __atomic_load_n(&table[i].max_us, __ATOMIC_RELAXED);
+        char name[8];
+        if (is_trap) {
+            snprintf(name, sizeof(name), "%04X", i < 256 ? 0xa000 + i : 0xa800 + i - 256);
+        }
+        n = snprintf(buf + len, size - len, "%s[\"%s\",%u,%u,%u]", j ? "," : "",
+                     is_trap ? name : emulop_names[i], (unsigned)calls, (unsigned)top_us[j], (unsigned)max);
+        len += n > 0 ? n : 0;
+    }
+    if (len < size) {
+        n = snprintf(buf + len, size - len, "]");
+        len += n > 0 ? n : 0;
+    }
+
+    // This interval is reported (or lost if it didn't fit)
+    for (int i = 0; i < count; i++) {
+        last[i].calls = __atomic_load_n(&table[i].calls, __ATOMIC_RELAXED);
+        last[i].us = __atomic_load_n(&table[i].us, __ATOMIC_RELAXED);
+        __atomic_store_n(&table[i].max_us, 0, __ATOMIC_RELAXED);
+    }
+    return ntop > 0 && len < size ? len : 0;
+}
+
+static size_t emulop_section(char *buf, size_t size)
+{
+    return write_top(buf, size, emulop_table, emulop_last, EMULOP_COUNT, false);
+}
+
+static size_t trap_section(char *buf, size_t size)
+{
+    return trap_table ? write_top(buf, size, trap_table, trap_last, TRAP_COUNT, true) : 0;
+}
+
+void TrapStatsInit(void)
+{
+    trap_table = (trap_counts *)MemPlanAlloc("trapstats", TRAP_COUNT * sizeof(trap_counts), MALLOC_CAP_SPIRAM);
+    trap_last = (trap_reported *)ps_malloc(TRAP_COUNT * sizeof(trap_reported));
+    if (!trap_table || !trap_last) {
+        Serial.println("[TRAPS] No memory for the A-line trap table, EmulOps only");
+        free(trap_last);
+        trap_table = NULL;
+        trap_last = NULL;
+    } else {
+        memset(trap_table, 0, TRAP_COUNT * sizeof(trap_counts));
+        memset(trap_last, 0, TRAP_COUNT * sizeof(trap_reported));
+    }
+    PerfSection("emulops", emulop_section);
+    PerfSection("traps", trap_section);
+}
+
+#endif // TRAP_STATS
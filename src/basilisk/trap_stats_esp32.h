@@ -0,0 +1,48 @@
+/*
+ *  trap_stats_esp32.h - Host time spent in EmulOps and A-line traps
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef TRAP_STATS_ESP32_H
+#define TRAP_STATS_ESP32_H
+
+#ifndef TRAP_STATS
+#define TRAP_STATS 0
+#endif
+
+#if TRAP_STATS
+
+// Open A-line traps (newcpu.cpp checks these at the end of each batch)
+extern int trap_stats_depth;
+extern uint32 trap_stats_top_a7;        // A7 at the innermost open trap
+
+// Allocate the tables and add "traps"/"emulops" to the telemetry line
+extern void TrapStatsInit(void);
+
+// Host time and idle_wait() total when a call started
+struct trap_stats_mark {
+    uint64 us;
+    uint64 idle_us;
+};
+
+// Around EmulOp() (m68k_emulop), time asleep in idle_wait() excluded
+extern trap_stats_mark TrapStatsStart(void);
+extern void TrapStatsEmulOpEnd(uint16 opcode, trap_stats_mark start);
+
+// An A-line trap is taken, a7 = A7 before the exception frame is pushed
+extern void TrapStatsALine(uint16 opcode, uint32 a7);
+
+// Close the traps A7 has climbed back above, i.e. that have returned
+extern void TrapStatsUnwind(uint32 a7);
+
+static inline void TrapStatsCheck(uint32 a7)
+{
+    if (trap_stats_depth > 0 && a7 >= trap_stats_top_a7) {
+        TrapStatsUnwind(a7);
+    }
+}
+
+#endif
+
+#endif /* TRAP_STATS_ESP32_H */
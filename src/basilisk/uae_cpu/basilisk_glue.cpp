@@ -22,6 +22,8 @@
 
 #ifdef ARDUINO
 #include <esp_heap_caps.h>
+#include "mem_plan_esp32.h"
+#include "perf_esp32.h"
 #endif
 
 #include "cpu_emulation.h"
@@ -35,6 +37,9 @@
 #include "readcpu.h"
 #include "newcpu.h"
 #include "compiler/compemu.h"
+#include "predecode.h"
+#include "compiler/jit_riscv.h"
+#include "replay_esp32.h"
 
 
 // RAM and ROM pointers
@@ -63,6 +68,10 @@ bool UseJIT = false;
 // From newcpu.cpp
 extern bool quit_program;
 
+#ifdef ARDUINO
+static perf_counter *perf_nested_calls = NULL;	// "cpu.nested_calls", Execute68k()/Execute68kTrap()
+#endif
+
 
 /*
  *  Initialize 680x0 emulation, CheckROM() must have been called first
@@ -73,8 +82,7 @@ bool Init680x0(void)
 #ifdef ARDUINO
 	// Allocate 256KB opcode table
 	// This table is accessed once per instruction for opcode dispatch
-	// NOTE: mem_banks gets priority for internal SRAM since it's accessed more frequently
-	// (multiple memory operations per instruction)
+	// NOTE: the memory bank map is a small static table in internal SRAM (memory.cpp)
 	if (cpufunctbl == NULL) {
 		// Report available internal SRAM before allocation
 		size_t free_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
@@ -84,12 +92,12 @@ bool Init680x0(void)
 		
 		// Try internal SRAM first - cpufunctbl is accessed once per instruction for dispatch
 		// This is the hot path for CPU emulation
-		cpufunctbl = (cpuop_func **)heap_caps_malloc(65536 * sizeof(cpuop_func *), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		cpufunctbl = (cpuop_func **)MemPlanAlloc("cpufunctbl", 65536 * sizeof(cpuop_func *), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 		if (cpufunctbl != NULL) {
 			write_log("Allocated cpufunctbl (256KB) in internal SRAM - FAST DISPATCH\n");
 		} else {
 			// Fall back to PSRAM if internal SRAM not available
-			cpufunctbl = (cpuop_func **)heap_caps_malloc(65536 * sizeof(cpuop_func *), MALLOC_CAP_SPIRAM);
+			cpufunctbl = (cpuop_func **)MemPlanAlloc("cpufunctbl", 65536 * sizeof(cpuop_func *), MALLOC_CAP_SPIRAM);
 			if (cpufunctbl == NULL) {
 				write_log("ERROR: Failed to allocate cpufunctbl!\n");
 				return false;
@@ -97,6 +105,12 @@ bool Init680x0(void)
 			write_log("Allocated cpufunctbl (256KB) in PSRAM (fallback)\n");
 		}
 	}
+#else
+	if (cpufunctbl == NULL) {
+		cpufunctbl = (cpuop_func **)malloc(65536 * sizeof(cpuop_func *));
+		if (cpufunctbl == NULL)
+			return false;
+	}
 #endif
 
 #if REAL_ADDRESSING
@@ -129,7 +143,18 @@ bool Init680x0(void)
 	memory_init();
 #endif
 
+#if USE_PREDECODE_CACHE
+	if (!predecode_init())
+		return false;
+#endif
+#if USE_RV_JIT
+	jit_init();		// Falls back to the interpreter if no executable memory
+#endif
+
 	init_m68k();
+#ifdef ARDUINO
+	perf_nested_calls = PerfCounter("cpu.nested_calls");
+#endif
 #if USE_JIT
 	UseJIT = compiler_use_jit();
 	if (UseJIT)
@@ -150,6 +175,12 @@ void Exit680x0(void)
 	compiler_exit();
 #endif
 	exit_m68k();
+#if USE_RV_JIT
+	jit_exit();
+#endif
+#if USE_PREDECODE_CACHE
+	predecode_exit();
+#endif
 }
 
 
@@ -170,6 +201,7 @@ void InitFrameBufferMapping(void)
 
 void Start680x0(void)
 {
+	RamCopyReset();
 	m68k_reset();
 #if USE_JIT
     if (UseJIT)
@@ -180,6 +212,39 @@ void Start680x0(void)
 }
 
 
+#if MAC_SNAPSHOT
+/*
+ *  Continue 680x0 emulation from the registers restored by a snapshot
+ *  (doesn't return)
+ */
+
+void Resume680x0(void)
+{
+	RamCopyReset();
+	m68k_execute();
+}
+#endif
+
+
+#if USE_CYCLE_STATS
+/*
+ *  Estimated 68040 cycles since startup; must be called at least once every
+ *  2^32 cycles (cpu_do_check_ticks() does) and only from the CPU thread
+ */
+
+uint64 Get68kCycles(void)
+{
+	static uint64 cycles_total = 0;
+	static uae_u32 cycles_seen = 0;
+
+	uae_u32 now = regs.cycles;
+	cycles_total += (uae_u32)(now - cycles_seen);
+	cycles_seen = now;
+	return cycles_total;
+}
+#endif
+
+
 /*
  *  Trigger interrupt
  */
@@ -187,7 +252,20 @@ void Start680x0(void)
 void TriggerInterrupt(void)
 {
 	idle_resume();
-	SPCFLAGS_SET( SPCFLAG_INT );
+#if REPLAY
+	// The next batch end delivers them (ReplaySync())
+	if (replay_mode != REPLAY_OFF)
+		return;
+#endif
+	// Nothing to deliver while the 68k masks level 1: MakeFromSR() raises
+	// SPCFLAG_INT when the mask comes down, so code running masked isn't
+	// cut short at every batch. The caller has set InterruptFlags; the
+	// fence pairs with the one in MakeFromSR()
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&regs.intmask, __ATOMIC_RELAXED) >= 1)
+		return;
+	// From any task, the CPU task picks it up at the end of its batch
+	SPCFLAGS_POST( SPCFLAG_INT );
 }
 
 void TriggerNMI(void)
@@ -215,10 +293,15 @@ void Execute68kTrap(uint16 trap, struct M68kRegisters *r)
 {
 	int i;
 
+#ifdef ARDUINO
+	PerfAdd(perf_nested_calls, 1);
+#endif
+
 	// Save old PC
 	uaecptr oldpc = m68k_getpc();
 
 	// Set registers
+	ram_copy_refresh();
 	for (i=0; i<8; i++)
 		m68k_dreg(regs, i) = r->d[i];
 	for (i=0; i<7; i++)
@@ -262,20 +345,32 @@ void Execute68k(uint32 addr, struct M68kRegisters *r)
 {
 	int i;
 
+#ifdef ARDUINO
+	PerfAdd(perf_nested_calls, 1);
+#endif
+
 	// Save old PC
 	uaecptr oldpc = m68k_getpc();
 
 	// Set registers
+	ram_copy_refresh();
 	for (i=0; i<8; i++)
 		m68k_dreg(regs, i) = r->d[i];
 	for (i=0; i<7; i++)
 		m68k_areg(regs, i) = r->a[i];
 
-	// Push EXEC_RETURN and faked return address (points to EXEC_RETURN) on stack
-	m68k_areg(regs, 7) -= 2;
-	put_word(m68k_areg(regs, 7), M68K_EXEC_RETURN);
+	// Push a return address that points to EXEC_RETURN: the patched ROM's
+	// one if there is one, else one put on the stack above it
+	uae_u32 cleanup = 0;
+	uaecptr ret = ExecReturnAddr;
+	if (ret == 0) {
+		m68k_areg(regs, 7) -= 2;
+		put_word(m68k_areg(regs, 7), M68K_EXEC_RETURN);
+		ret = m68k_areg(regs, 7);
+		cleanup = 2;
+	}
 	m68k_areg(regs, 7) -= 4;
-	put_long(m68k_areg(regs, 7), m68k_areg(regs, 7) + 4);
+	put_long(m68k_areg(regs, 7), ret);
 
 	// Execute routine
 	m68k_setpc(addr);
@@ -284,7 +379,7 @@ void Execute68k(uint32 addr, struct M68kRegisters *r)
 	m68k_execute();
 
 	// Clean up stack
-	m68k_areg(regs, 7) += 2;
+	m68k_areg(regs, 7) += cleanup;
 
 	// Restore old PC
 	m68k_setpc(oldpc);
@@ -0,0 +1,500 @@
+/*
+ *  jit_riscv.cpp - Block translator for RISC-V hosts (ESP32-P4)
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Generated code layout for a trace of N instructions:
+ *
+ *    prologue       save ra/s0, s0 = &regs
+ *    insn 0..N-1    inlined op, or: a0 = opcode; call handler;
+ *                   exit if spcflags set or trace invalidated;
+ *                   exit if regs.pc_p != recorded pc of next insn
+ *    epilogue       a0 = instructions executed, restore, ret
+ */
+
+#include "sysdeps.h"
+
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#include <esp_cache.h>
+#if JIT_BACKGROUND
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+#endif
+
+#include <stddef.h>
+
+#include "cpu_emulation.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "predecode.h"
+#include "prefs.h"
+#include "compiler/jit_riscv.h"
+
+#if USE_RV_JIT
+
+#ifndef __riscv
+#error "USE_RV_JIT needs a RISC-V host"
+#endif
+
+int jit_exec_depth = 0;
+
+static uae_u32 *jit_code = NULL;		// Start of executable buffer
+static uae_u32 *jit_code_end = NULL;
+static uae_u32 *jit_emit_p = NULL;		// Next free word
+static bool jit_overflow = false;
+
+// Perf counters
+static uint32 jit_compiled_blocks = 0;
+static uint32 jit_buffer_flushes = 0;
+
+#if JIT_BACKGROUND
+// Translation worker, see "Background translation" below
+#define JIT_WORKER_STACK_SIZE	4096
+#define JIT_WORKER_PRIORITY		1
+#define JIT_WORKER_CORE			0
+
+static predecode_block *jit_queue[JIT_QUEUE_SIZE];
+static uae_u32 jit_queue_gen[JIT_QUEUE_SIZE];
+static uae_u32 jit_queue_head = 0;		// Written by the CPU task
+static uae_u32 jit_queue_tail = 0;		// Written by the worker
+static bool jit_flush_pending = false;	// Set by the worker, cleared by the CPU task
+static TaskHandle_t jit_worker_task = NULL;
+
+static uint32 jit_queue_drops = 0;		// CPU task
+static uint32 jit_stale_traces = 0;		// Worker
+#endif
+
+
+// ============================================================================
+// RV32I instruction encoding
+// ============================================================================
+
+enum {
+	R_ZERO = 0, R_RA = 1, R_SP = 2,
+	R_T0 = 5, R_T1 = 6, R_T2 = 7,
+	R_S0 = 8, R_A0 = 10
+};
+
+static inline uae_u32 rv_itype(int opc, int f3, int rd, int rs1, int imm)
+{
+	return ((uae_u32)(imm & 0xfff) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opc;
+}
+
+static inline uae_u32 rv_stype(int f3, int rs1, int rs2, int imm)
+{
+	return ((uae_u32)((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | ((imm & 0x1f) << 7) | 0x23;
+}
+
+static inline uae_u32 rv_btype(int f3, int rs1, int rs2, int imm)
+{
+	return ((uae_u32)((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15)
+		| (f3 << 12) | (((imm >> 1) & 0xf) << 8) | (((imm >> 11) & 1) << 7) | 0x63;
+}
+
+static inline uae_u32 rv_jtype(int rd, int imm)
+{
+	return ((uae_u32)((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20)
+		| (((imm >> 12) & 0xff) << 12) | (rd << 7) | 0x6f;
+}
+
+static inline uae_u32 rv_rtype(int f7, int f3, int rd, int rs1, int rs2)
+{
+	return ((uae_u32)f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | 0x33;
+}
+
+static inline void emit(uae_u32 insn)
+{
+	if (jit_emit_p < jit_code_end)
+		*jit_emit_p++ = insn;
+	else
+		jit_overflow = true;
+}
+
+#define emit_lw(rd, rs1, off)		emit(rv_itype(0x03, 2, rd, rs1, off))
+#define emit_sw(rs2, rs1, off)		emit(rv_stype(2, rs1, rs2, off))
+#define emit_addi(rd, rs1, imm)		emit(rv_itype(0x13, 0, rd, rs1, imm))
+#define emit_slli(rd, rs1, sh)		emit(rv_itype(0x13, 1, rd, rs1, sh))
+#define emit_srai(rd, rs1, sh)		emit(rv_itype(0x13, 5, rd, rs1, 0x400 | (sh)))
+#define emit_and(rd, rs1, rs2)		emit(rv_rtype(0, 7, rd, rs1, rs2))
+#define emit_jalr(rd, rs1, off)		emit(rv_itype(0x67, 0, rd, rs1, off))
+
+// Load a 32-bit constant (lui + addi, with the usual sign carry)
+static void emit_li(int rd, uae_u32 v)
+{
+	int32 lo = ((int32)(v << 20)) >> 20;
+	uae_u32 hi = v - (uae_u32)lo;
+	if (hi != 0) {
+		emit(hi | (rd << 7) | 0x37);
+		if (lo != 0)
+			emit_addi(rd, rd, lo);
+	} else {
+		emit_addi(rd, R_ZERO, lo);
+	}
+}
+
+
+// ============================================================================
+// Trace exits
+// ============================================================================
+
+#define JIT_MAX_EXITS	(PREDECODE_BLOCK_LEN * 3)
+
+struct jit_exit_fixup {
+	uae_u32 *	branch;		// Conditional branch to patch
+	int			executed;	// Instructions completed when taken
+};
+
+static jit_exit_fixup exits[JIT_MAX_EXITS];
+static int num_exits;
+
+// Branch to an exit stub when rs1 <f3> rs2 holds; target patched later
+static void emit_exit_branch(int f3, int rs1, int rs2, int executed)
+{
+	if (num_exits == JIT_MAX_EXITS || jit_emit_p >= jit_code_end) {
+		jit_overflow = true;
+		return;
+	}
+	exits[num_exits].branch = jit_emit_p;
+	exits[num_exits].executed = executed;
+	num_exits++;
+	emit(rv_btype(f3, rs1, rs2, 0));
+}
+
+#define BR_BEQ	0
+#define BR_BNE	1
+
+
+// ============================================================================
+// Inlined instructions (no condition codes, two bytes, no memory access)
+// ============================================================================
+
+#define REG_OFFSET(n)	((int)(offsetof(regstruct, regs) + (n) * sizeof(uae_u32)))
+
+static bool emit_inline(uae_u32 opcode)
+{
+	if (opcode == 0x4e71)						// NOP
+		return true;
+
+	if ((opcode & 0xf038) == 0x5008) {			// ADDQ/SUBQ.W/L #q,An
+		int size = (opcode >> 6) & 3;
+		if (size != 1 && size != 2)
+			return false;
+		int q = (opcode >> 9) & 7;
+		if (q == 0)
+			q = 8;
+		if (opcode & 0x100)
+			q = -q;
+		int an = REG_OFFSET(8 + (opcode & 7));
+		emit_lw(R_T0, R_S0, an);
+		emit_addi(R_T0, R_T0, q);
+		emit_sw(R_T0, R_S0, an);
+		return true;
+	}
+
+	if ((opcode & 0xf1f0) == 0x2040) {			// MOVEA.L Rn,Am
+		emit_lw(R_T0, R_S0, REG_OFFSET(opcode & 15));
+		emit_sw(R_T0, R_S0, REG_OFFSET(8 + ((opcode >> 9) & 7)));
+		return true;
+	}
+
+	if ((opcode & 0xf1f0) == 0x3040) {			// MOVEA.W Rn,Am
+		emit_lw(R_T0, R_S0, REG_OFFSET(opcode & 15));
+		emit_slli(R_T0, R_T0, 16);
+		emit_srai(R_T0, R_T0, 16);
+		emit_sw(R_T0, R_S0, REG_OFFSET(8 + ((opcode >> 9) & 7)));
+		return true;
+	}
+
+	if ((opcode & 0xf1f8) == 0x41d0) {			// LEA (An),Am
+		emit_lw(R_T0, R_S0, REG_OFFSET(8 + (opcode & 7)));
+		emit_sw(R_T0, R_S0, REG_OFFSET(8 + ((opcode >> 9) & 7)));
+		return true;
+	}
+
+	return false;
+}
+
+
+// ============================================================================
+// Code buffer
+// ============================================================================
+
+static void jit_sync_code(uae_u32 *start, uae_u32 *end)
+{
+#ifdef ARDUINO
+	// Push the new words out of the data cache and drop stale instruction
+	// lines; uncached regions just return an error, which is fine here
+	size_t size = (end - start) * sizeof(uae_u32);
+	esp_cache_msync(start, size, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_TYPE_DATA | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
+	esp_cache_msync(start, size, ESP_CACHE_MSYNC_FLAG_DIR_M2C | ESP_CACHE_MSYNC_FLAG_TYPE_INST | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
+#endif
+	__asm__ __volatile__ ("fence.i" ::: "memory");
+}
+
+#if JIT_BACKGROUND
+static void jit_worker(void *param);
+#endif
+
+bool jit_init(void)
+{
+#ifdef ARDUINO
+	jit_code = (uae_u32 *)heap_caps_malloc(JIT_CODE_SIZE, MALLOC_CAP_EXEC | MALLOC_CAP_32BIT);
+#endif
+	if (jit_code == NULL) {
+		write_log("JIT: no executable memory, using interpreter only\n");
+		return false;
+	}
+	jit_code_end = jit_code + JIT_CODE_SIZE / sizeof(uae_u32);
+	jit_emit_p = jit_code;
+	write_log("JIT: %d KB code buffer at %p\n", JIT_CODE_SIZE / 1024, jit_code);
+#if JIT_BACKGROUND
+	if (xTaskCreatePinnedToCore(jit_worker, "JITWorker", JIT_WORKER_STACK_SIZE, NULL,
+	                            JIT_WORKER_PRIORITY, &jit_worker_task,
+	                            PrefsFindTaskCore("jit", JIT_WORKER_CORE)) != pdPASS) {
+		write_log("JIT: no worker task, using interpreter only\n");
+		jit_worker_task = NULL;
+	}
+#endif
+	return true;
+}
+
+void jit_exit(void)
+{
+	if (jit_code) {
+#if JIT_BACKGROUND
+		if (jit_worker_task) {
+			vTaskDelete(jit_worker_task);
+			jit_worker_task = NULL;
+		}
+		write_log("JIT: %u queued traces dropped, %u stale\n", jit_queue_drops, jit_stale_traces);
+#endif
+		write_log("JIT: %u blocks translated, %u buffer flushes\n", jit_compiled_blocks, jit_buffer_flushes);
+		free(jit_code);
+		jit_code = NULL;
+	}
+}
+
+
+/*
+ *  Emit the native code for trace t, recorded in block b (the guards
+ *  check b, the code follows t); returns the entry or NULL
+ */
+
+static uae_u32 *jit_emit_trace(predecode_block *b, const predecode_block *t)
+{
+	uae_u32 *entry = jit_emit_p;
+	jit_overflow = false;
+	num_exits = 0;
+
+	// Prologue
+	emit_addi(R_SP, R_SP, -16);
+	emit_sw(R_RA, R_SP, 12);
+	emit_sw(R_S0, R_SP, 8);
+	emit_li(R_S0, (uae_u32)(uintptr)&regs);
+
+	const int pc_off = (int)offsetof(regstruct, pc_p);
+	const int spc_off = (int)offsetof(regstruct, spcflags);
+
+	bool pc_known = true;		// regs.pc_p is known at translation time
+	bool pc_dirty = false;		// ...and has not been stored yet
+	uae_u8 *pc_value = t->start;
+	int n;
+
+	for (n = 0; n < t->count; n++) {
+		const predecode_insn *insn = &t->insn[n];
+
+		if (pc_known) {
+			// Sequence of inlined ops must lead to the recorded instruction
+			if (pc_value != insn->pc_p)
+				break;
+		} else {
+			emit_lw(R_T0, R_S0, pc_off);
+			emit_li(R_T1, (uae_u32)(uintptr)insn->pc_p);
+			emit_exit_branch(BR_BNE, R_T0, R_T1, n);
+		}
+
+		if (emit_inline(insn->opcode)) {
+			pc_known = true;
+			pc_dirty = true;
+			pc_value = insn->pc_p + 2;
+			continue;
+		}
+
+		if (pc_dirty) {
+			emit_li(R_T0, (uae_u32)(uintptr)pc_value);
+			emit_sw(R_T0, R_S0, pc_off);
+			pc_dirty = false;
+		}
+
+		emit_li(R_A0, insn->opcode);
+		emit_li(R_T2, (uae_u32)(uintptr)insn->handler);
+		emit_jalr(R_RA, R_T2, 0);
+		pc_known = false;
+
+		// Interrupts, traps, STOP and nested EXEC_RETURN
+		emit_lw(R_T0, R_S0, spc_off);
+		emit_li(R_T1, SPCFLAG_ALL_BUT_EXEC_RETURN);
+		emit_and(R_T0, R_T0, R_T1);
+		emit_exit_branch(BR_BNE, R_T0, R_ZERO, n + 1);
+
+		// The handler may have written to this trace's code
+		emit_li(R_T1, (uae_u32)(uintptr)&b->start);
+		emit_lw(R_T0, R_T1, 0);
+		emit_li(R_T1, (uae_u32)(uintptr)t->start);
+		emit_exit_branch(BR_BNE, R_T0, R_T1, n + 1);
+	}
+
+	if (pc_dirty) {
+		emit_li(R_T0, (uae_u32)(uintptr)pc_value);
+		emit_sw(R_T0, R_S0, pc_off);
+	}
+
+	// Fall-through exit and epilogue
+	emit_li(R_A0, n);
+	uae_u32 *epilogue = jit_emit_p;
+	emit_lw(R_RA, R_SP, 12);
+	emit_lw(R_S0, R_SP, 8);
+	emit_addi(R_SP, R_SP, 16);
+	emit_jalr(R_ZERO, R_RA, 0);
+
+	// Exit stubs: a0 = executed count, jump to the epilogue
+	for (int i = 0; i < num_exits && !jit_overflow; i++) {
+		uae_u32 *stub = jit_emit_p;
+		emit_li(R_A0, exits[i].executed);
+		emit(rv_jtype(R_ZERO, (int)((epilogue - jit_emit_p) * 4)));
+		uae_u32 br = *exits[i].branch;
+		*exits[i].branch = br | rv_btype(0, 0, 0, (int)((stub - exits[i].branch) * 4));
+	}
+
+	if (jit_overflow || n == 0) {
+		jit_emit_p = entry;
+		return NULL;
+	}
+
+	jit_sync_code(entry, jit_emit_p);
+	jit_compiled_blocks++;
+	return entry;
+}
+
+
+/*
+ *  Translate a recorded trace, returns false if it stays interpreted
+ */
+
+bool jit_compile(predecode_block *b)
+{
+	if (jit_code == NULL || jit_exec_depth != 0)
+		return false;
+
+	// Full buffer: drop every trace (and with it every native pointer)
+	if (jit_code_end - jit_emit_p < 512) {
+		predecode_flush_all();
+		jit_emit_p = jit_code;
+		jit_buffer_flushes++;
+		return false;
+	}
+
+	uae_u32 *entry = jit_emit_trace(b, b);
+	if (entry == NULL)
+		return false;
+	b->native = (int (*)(void))entry;
+	return true;
+}
+
+
+#if JIT_BACKGROUND
+/*
+ *  Background translation
+ *
+ *  The CPU task (producer) puts hot traces with their gen into a ring, the
+ *  worker (consumer) takes them, so head and tail each have one writer.
+ *  The worker copies the trace and checks gen afterwards: recording bumps
+ *  it before touching the trace, so an unchanged gen means an intact copy
+ *  (a seqlock read). The translation is published with native, then its
+ *  gen in native_gen; the CPU task only runs native while native_gen
+ *  matches the trace's gen, so a translation that a new recording overtook
+ *  is never run. The worker owns jit_emit_p; on a full buffer it asks the
+ *  CPU task to flush, which only happens outside native code, and waits.
+ */
+
+/*
+ *  Queue a hot trace for the worker (CPU task); a full queue drops it, the
+ *  trace then stays interpreted until it is recorded again
+ */
+
+void jit_request(predecode_block *b)
+{
+	if (jit_worker_task == NULL)
+		return;
+
+	// Flush on the worker's behalf, never under translated code
+	if (__atomic_load_n(&jit_flush_pending, __ATOMIC_ACQUIRE)) {
+		if (jit_exec_depth != 0)
+			return;
+		predecode_flush_all();
+		jit_emit_p = jit_code;
+		jit_buffer_flushes++;
+		__asm__ __volatile__ ("fence.i" ::: "memory");	// This core may have fetched the old code
+		__atomic_store_n(&jit_flush_pending, false, __ATOMIC_RELEASE);
+		xTaskNotifyGive(jit_worker_task);
+		return;		// b was just dropped with the rest
+	}
+
+	uae_u32 head = jit_queue_head;
+	if (head - __atomic_load_n(&jit_queue_tail, __ATOMIC_ACQUIRE) == JIT_QUEUE_SIZE) {
+		jit_queue_drops++;
+		return;
+	}
+	jit_queue[head & (JIT_QUEUE_SIZE - 1)] = b;
+	jit_queue_gen[head & (JIT_QUEUE_SIZE - 1)] = b->gen;
+	__atomic_store_n(&jit_queue_head, head + 1, __ATOMIC_RELEASE);
+	xTaskNotifyGive(jit_worker_task);
+}
+
+static void jit_worker(void *param)
+{
+	UNUSED(param);
+	predecode_block t;
+
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		while (!__atomic_load_n(&jit_flush_pending, __ATOMIC_ACQUIRE)) {
+			uae_u32 tail = jit_queue_tail;
+			if (tail == __atomic_load_n(&jit_queue_head, __ATOMIC_ACQUIRE))
+				break;
+			predecode_block *b = jit_queue[tail & (JIT_QUEUE_SIZE - 1)];
+			uae_u32 gen = jit_queue_gen[tail & (JIT_QUEUE_SIZE - 1)];
+			__atomic_store_n(&jit_queue_tail, tail + 1, __ATOMIC_RELEASE);
+
+			if (jit_code_end - jit_emit_p < 512) {
+				__atomic_store_n(&jit_flush_pending, true, __ATOMIC_RELEASE);
+				break;
+			}
+
+			// Copy the trace, then check that no recording started meanwhile
+			if (__atomic_load_n(&b->gen, __ATOMIC_ACQUIRE) != gen) {
+				jit_stale_traces++;
+				continue;
+			}
+			memcpy(&t, b, sizeof(t));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&b->gen, __ATOMIC_RELAXED) != gen || t.start == NULL) {
+				jit_stale_traces++;
+				continue;
+			}
+
+			uae_u32 *entry = jit_emit_trace(b, &t);
+			if (entry == NULL)
+				continue;
+			b->native = (int (*)(void))entry;
+			__atomic_store_n(&b->native_gen, gen, __ATOMIC_RELEASE);
+		}
+	}
+}
+#endif
+
+#endif /* USE_RV_JIT */
@@ -0,0 +1,84 @@
+/*
+ *  jit_riscv.h - Block translator for RISC-V hosts (ESP32-P4)
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Hot pre-decoded traces (see predecode.h) are translated into native
+ *  RV32I code that calls the recorded handlers back to back and inlines a
+ *  few flag-free instructions. Guards on regs.pc_p, regs.spcflags and the
+ *  trace itself fall back to the interpreter loop whenever the recorded path
+ *  no longer holds. The UAE x86 compiler (USE_JIT) stays disabled.
+ *
+ *  With JIT_BACKGROUND the CPU task only queues hot traces; a worker task
+ *  on Core 0 translates them from a snapshot and publishes the result, and
+ *  the trace is interpreted until then.
+ */
+
+#ifndef JIT_RISCV_H
+#define JIT_RISCV_H
+
+#ifndef USE_RV_JIT
+#define USE_RV_JIT 0
+#endif
+
+#if USE_RV_JIT
+
+#if !USE_PREDECODE_CACHE
+#error "USE_RV_JIT translates predecode traces, enable USE_PREDECODE_CACHE"
+#endif
+
+#define JIT_CODE_SIZE		(64 * 1024)		// Executable code buffer
+#define JIT_HOT_THRESHOLD	16				// Replays before a trace is translated
+
+#ifndef JIT_BACKGROUND
+#define JIT_BACKGROUND 0
+#endif
+#define JIT_QUEUE_SIZE		32				// Hot traces waiting for the worker (power of two)
+
+// Native trace entry, returns the number of 68k instructions executed
+typedef int (*jit_block_func)(void);
+
+extern bool jit_init(void);
+extern void jit_exit(void);
+extern bool jit_compile(predecode_block *b);
+extern int jit_exec_depth;
+
+#if JIT_BACKGROUND
+extern void jit_request(predecode_block *b);
+
+// A translation of the trace as it is recorded now has been published
+static inline bool jit_ready(const predecode_block *b)
+{
+	return __atomic_load_n(&b->native_gen, __ATOMIC_ACQUIRE) == b->gen;
+}
+
+// Hot trace, CPU task: queue it for the worker
+static inline void jit_hot(predecode_block *b)
+{
+	jit_request(b);
+}
+#else
+static inline bool jit_ready(const predecode_block *b)
+{
+	return b->native != NULL;
+}
+
+// Hot trace: translate it right away
+static inline void jit_hot(predecode_block *b)
+{
+	jit_compile(b);
+}
+#endif
+
+// Run a translated trace; nested m68k_execute() calls must not retranslate
+static inline int jit_run(predecode_block *b)
+{
+	jit_exec_depth++;
+	int n = b->native();
+	jit_exec_depth--;
+	return n;
+}
+
+#endif /* USE_RV_JIT */
+
+#endif /* JIT_RISCV_H */
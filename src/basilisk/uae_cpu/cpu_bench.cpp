@@ -0,0 +1,218 @@
+/*
+ *  cpu_bench.cpp - 68k interpreter microbenchmarks
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Each case is one instruction, assembled into Mac RAM unrolled
+ *  CPU_BENCH_UNROLL times inside a DBRA loop and run with Execute68k(), so
+ *  it goes through the same cpufunctbl dispatch (threaded or pre-decoded)
+ *  as Mac OS code. An empty loop is timed first and subtracted; the DBRA
+ *  line itself is that empty loop per pass. Every case is run
+ *  CPU_BENCH_RUNS times and the fastest run is kept, which filters out
+ *  interrupts and cache refills on the device.
+ *
+ *  The operands are chosen so that each instruction leaves its result in
+ *  a steady state (divide by 1, multiply by 1, branch to the next word),
+ *  and the data area is rewritten before every run. The A-line case
+ *  includes its two-instruction handler, which skips the trap word.
+ */
+
+#include "sysdeps.h"
+
+#ifdef ARDUINO
+#include <esp_timer.h>
+#else
+#include <time.h>
+#endif
+
+#include "cpu_emulation.h"
+#include "main.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "cpu_bench.h"
+
+#define CPU_BENCH_UNROLL	16			// Copies of the instruction per loop pass
+#define CPU_BENCH_RUNS		5			// Runs per case, the fastest is kept
+
+#define BENCH_CODE			0x10000		// Mac addresses of the generated code,
+#define BENCH_DATA			0x18000		// of the operands (a0 = double, a1 = single)
+#define BENCH_END			0x20000		// and end of the area zeroed afterwards
+
+struct bench_case {
+	const char *	family;
+	const char *	insn;
+	int				min_cpu;	// CPUType needed (2 = 68020), -1 = needs an FPU
+	int				nwords;
+	uae_u16			words[4];
+};
+
+static const bench_case bench_cases[] = {
+	{ "move",		"move.l d0,d1",				0,	1, { 0x2200 } },
+	{ "move",		"move.l (a0),d1",			0,	1, { 0x2210 } },
+	{ "move",		"move.l d1,(a0)",			0,	1, { 0x2081 } },
+	{ "move",		"move.l 16(a0),d1",			0,	2, { 0x2228, 0x0010 } },
+	{ "move",		"move.l 16(a0,d2.w),d1",	0,	2, { 0x2230, 0x2010 } },
+	{ "move",		"move.w #imm,d1",			0,	2, { 0x323c, 0x1234 } },
+	{ "move",		"move.b (a0),d1",			0,	1, { 0x1210 } },
+	{ "alu",		"add.l d0,d1",				0,	1, { 0xd280 } },
+	{ "alu",		"add.l (a0),d1",			0,	1, { 0xd290 } },
+	{ "alu",		"add.l d1,(a0)",			0,	1, { 0xd390 } },
+	{ "alu",		"add.l 16(a0),d1",			0,	2, { 0xd2a8, 0x0010 } },
+	{ "alu",		"addi.l #1,d1",				0,	3, { 0x0681, 0x0000, 0x0001 } },
+	{ "alu",		"addq.l #1,d1",				0,	1, { 0x5281 } },
+	{ "alu",		"sub.w d0,d1",				0,	1, { 0x9240 } },
+	{ "alu",		"and.l d0,d1",				0,	1, { 0xc280 } },
+	{ "alu",		"or.l (a0),d1",				0,	1, { 0x8290 } },
+	{ "alu",		"eor.l d0,d1",				0,	1, { 0xb181 } },
+	{ "alu",		"cmp.l d0,d1",				0,	1, { 0xb280 } },
+	{ "alu",		"lsl.l #3,d1",				0,	1, { 0xe789 } },
+	{ "branch",		"bne.w (taken)",			0,	2, { 0x6600, 0x0002 } },
+	{ "branch",		"beq.w (not taken)",		0,	2, { 0x6700, 0x0002 } },
+	{ "branch",		"bra.w",					0,	2, { 0x6000, 0x0002 } },
+	{ "branch",		"tst.l d0 + bne.w (taken)",	0,	3, { 0x4a80, 0x6600, 0x0002 } },
+	{ "branch",		"jsr (a2) + rts",			0,	1, { 0x4e92 } },
+	{ "trap",		"A-line trap + handler",	0,	1, { 0xa000 } },
+	{ "movem",		"movem.l d0-d3,(a0)",		0,	2, { 0x48d0, 0x000f } },
+	{ "movem",		"movem.l (a0),d0-d3",		0,	2, { 0x4cd0, 0x000f } },
+	{ "bitfield",	"bfextu d0{4:12},d1",		2,	2, { 0xe9c0, 0x110c } },
+	{ "bitfield",	"bfins d1,(a0){4:12}",		2,	2, { 0xefd0, 0x110c } },
+	{ "bitfield",	"bftst (a0){0:8}",			2,	2, { 0xe8d0, 0x0008 } },
+	{ "bitfield",	"bfffo d0{0:32},d1",		2,	2, { 0xedc0, 0x1000 } },
+	{ "muldiv",		"mulu.w d0,d1",				0,	1, { 0xc2c0 } },
+	{ "muldiv",		"muls.w d0,d1",				0,	1, { 0xc3c0 } },
+	{ "muldiv",		"divs.w d0,d1",				0,	1, { 0x83c0 } },
+	{ "muldiv",		"mulu.l d0,d1",				2,	2, { 0x4c00, 0x1000 } },
+	{ "muldiv",		"muls.l d0,d1",				2,	2, { 0x4c00, 0x1800 } },
+	{ "muldiv",		"divs.l d0,d1",				2,	2, { 0x4c40, 0x1801 } },
+	{ "fpu",		"fadd.x fp0,fp1",			-1,	2, { 0xf200, 0x00a2 } },
+	{ "fpu",		"fmul.x fp0,fp1",			-1,	2, { 0xf200, 0x00a3 } },
+	{ "fpu",		"fdiv.x fp0,fp1",			-1,	2, { 0xf200, 0x00a0 } },
+	{ "fpu",		"fsqrt.x fp0,fp1",			-1,	2, { 0xf200, 0x0084 } },
+	{ "fpu",		"fsin.x fp0,fp1",			-1,	2, { 0xf200, 0x008e } },
+	{ "fpu",		"fmove.d (a0),fp1",			-1,	2, { 0xf210, 0x5480 } },
+	{ "fpu",		"fadd.s (a1),fp1",			-1,	2, { 0xf211, 0x44a2 } },
+};
+
+static uae_u64 bench_now_ns(void)
+{
+#ifdef ARDUINO
+	return (uae_u64)esp_timer_get_time() * 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uae_u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uaecptr emit(uaecptr pc, uae_u16 w)
+{
+	WriteMacInt16(pc, w);
+	return pc + 2;
+}
+
+static uaecptr emit_long(uaecptr pc, uae_u32 l)
+{
+	pc = emit(pc, l >> 16);
+	return emit(pc, l & 0xffff);
+}
+
+/*
+ *  Assemble the loop around "c" (NULL = empty loop) at BENCH_CODE
+ */
+static void assemble(const bench_case *c)
+{
+	uaecptr pc = BENCH_CODE;
+	if (FPUType) {
+		pc = emit(pc, 0xf206); pc = emit(pc, 0x4000);	// fmove.l d6,fp0
+		pc = emit(pc, 0xf206); pc = emit(pc, 0x4080);	// fmove.l d6,fp1
+	}
+	pc = emit(pc, 0x4a80);								// tst.l d0 (clears Z for bne/beq)
+
+	uaecptr loop = pc;
+	if (c) {
+		for (int i = 0; i < CPU_BENCH_UNROLL; i++) {
+			for (int w = 0; w < c->nwords; w++)
+				pc = emit(pc, c->words[w]);
+		}
+	}
+	pc = emit(pc, 0x51cf);								// dbra d7,loop
+	pc = emit(pc, (uae_u16)(loop - pc));
+	pc = emit(pc, 0x4e75);								// rts
+
+	FlushCodeCache(Mac2HostAddr(BENCH_CODE), pc - BENCH_CODE);
+}
+
+/*
+ *  Run the assembled loop, fastest of CPU_BENCH_RUNS [ns]
+ */
+static uae_u64 run(void)
+{
+	uae_u64 best = ~(uae_u64)0;
+	for (int r = 0; r < CPU_BENCH_RUNS; r++) {
+		emit_long(BENCH_DATA, 0x3ff00000);				// 1.0 as a double at (a0)
+		emit_long(BENCH_DATA + 4, 0);
+		emit_long(BENCH_DATA + 0x40, 0x3f800000);		// 1.0 as a single at (a1)
+		emit_long(0x28, BENCH_DATA + 0x80);				// A-line vector:
+		emit_long(BENCH_DATA + 0x80, 0x54af0002);		// addq.l #2,2(sp)
+		emit(BENCH_DATA + 0x84, 0x4e73);				// rte
+		emit(BENCH_DATA + 0x88, 0x4e75);				// rts at (a2)
+
+		M68kRegisters regs68;
+		memset(&regs68, 0, sizeof(regs68));
+		regs68.d[0] = 1;
+		regs68.d[1] = 6;
+		regs68.d[2] = 2;
+		regs68.d[6] = 1;
+		regs68.d[7] = CPU_BENCH_ITERATIONS - 1;
+		regs68.a[0] = BENCH_DATA;
+		regs68.a[1] = BENCH_DATA + 0x40;
+		regs68.a[2] = BENCH_DATA + 0x88;
+		m68k_areg(regs, 7) = BENCH_CODE;				// Stack grows down from the code
+
+		uae_u64 start = bench_now_ns();
+		Execute68k(BENCH_CODE, &regs68);
+		uae_u64 elapsed = bench_now_ns() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static void print_line(const char *family, const char *insn, double ns)
+{
+	Serial.printf("[CPUBENCH] %s,%s,%.2f,%.1f\n", family, insn, ns, ns > 0 ? 1000.0 / ns : 0.0);
+}
+
+/*
+ *  Run all cases and print the CSV
+ */
+void CPUBenchRun(void)
+{
+	m68k_reset();		// Supervisor mode, interrupts masked, FPU registers cleared
+
+	Serial.printf("[CPUBENCH] begin: %d iterations x %d, best of %d, CPU 680%d0, FPU %s\n",
+				  CPU_BENCH_ITERATIONS, CPU_BENCH_UNROLL, CPU_BENCH_RUNS, CPUType, FPUType ? "yes" : "no");
+	Serial.printf("[CPUBENCH] family,instruction,ns_per_insn,minsn_per_s\n");
+
+	assemble(NULL);
+	uae_u64 base_ns = run();
+	print_line("branch", "dbra (loop)", (double)base_ns / CPU_BENCH_ITERATIONS);
+
+	uae_u64 total_start = bench_now_ns();
+	for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+		const bench_case *c = &bench_cases[i];
+		if (c->min_cpu < 0 ? !FPUType : CPUType < c->min_cpu)
+			continue;
+		assemble(c);
+		uae_u64 ns = run();
+		double per_insn = ns > base_ns ? (double)(ns - base_ns) / ((double)CPU_BENCH_ITERATIONS * CPU_BENCH_UNROLL) : 0.0;
+		print_line(c->family, c->insn, per_insn);
+	}
+
+	// Leave Mac RAM as the boot expects it
+	Mac_memset(0, 0, BENCH_END);
+	FlushCodeCache(Mac2HostAddr(BENCH_CODE), BENCH_END - BENCH_CODE);
+	Serial.printf("[CPUBENCH] end (%llu ms)\n", (unsigned long long)((bench_now_ns() - total_start) / 1000000));
+}
@@ -0,0 +1,27 @@
+/*
+ *  cpu_bench.h - 68k interpreter microbenchmarks
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Synthetic instruction streams run through the normal m68k_execute()
+ *  dispatch, timed per instruction and printed as CSV lines ("[CPUBENCH]")
+ *  with ns/instruction per opcode family. Runs on the device before the
+ *  Mac boots (CPU_BENCH=1) and on the host build ("basilisk_host --bench"),
+ *  so a change to the core can be measured on both without a ROM.
+ */
+
+#ifndef CPU_BENCH_H
+#define CPU_BENCH_H
+
+#ifndef CPU_BENCH
+#define CPU_BENCH 0
+#endif
+
+#ifndef CPU_BENCH_ITERATIONS
+#define CPU_BENCH_ITERATIONS	4096	// DBRA loop passes per run
+#endif
+
+// Needs Init680x0() and Mac RAM; uses and zeroes the first 128 KB of it
+extern void CPUBenchRun(void);
+
+#endif /* CPU_BENCH_H */
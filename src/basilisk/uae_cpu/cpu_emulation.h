@@ -64,13 +64,18 @@ static inline uint32 ReadMacInt8(uint32 addr) {return get_byte(addr);}
 static inline void WriteMacInt32(uint32 addr, uint32 l) {put_long(addr, l);}
 static inline void WriteMacInt16(uint32 addr, uint32 w) {put_word(addr, w);}
 static inline void WriteMacInt8(uint32 addr, uint32 b) {put_byte(addr, b);}
+#if LOWMEM_SRAM_SIZE || RAM_HOT_BANKS
+// The caller may write through the pointer, see LOWMEM_SRAM_SIZE
+static inline uint8 *Mac2HostAddr(uint32 addr) {ram_copy_host_write(addr); return get_real_address(addr);}
+#else
 static inline uint8 *Mac2HostAddr(uint32 addr) {return get_real_address(addr);}
+#endif
 static inline uint32 Host2MacAddr(uint8 *addr) {return get_virtual_address(addr);}
 
 static inline void *Mac_memset(uint32 addr, int c, size_t n) {return memset(Mac2HostAddr(addr), c, n);}
-static inline void *Mac2Host_memcpy(void *dest, uint32 src, size_t n) {return memcpy(dest, Mac2HostAddr(src), n);}
+static inline void *Mac2Host_memcpy(void *dest, uint32 src, size_t n) {return memcpy(dest, get_real_address(src), n);}
 static inline void *Host2Mac_memcpy(uint32 dest, const void *src, size_t n) {return memcpy(Mac2HostAddr(dest), src, n);}
-static inline void *Mac2Mac_memcpy(uint32 dest, uint32 src, size_t n) {return memcpy(Mac2HostAddr(dest), Mac2HostAddr(src), n);}
+static inline void *Mac2Mac_memcpy(uint32 dest, uint32 src, size_t n) {return memcpy(Mac2HostAddr(dest), get_real_address(src), n);}
 
 
 /*
@@ -92,9 +97,18 @@ const bool UseJIT = false;
 // 680x0 emulation functions
 struct M68kRegisters;
 extern void Start680x0(void);									// Reset and start 680x0
+#if MAC_SNAPSHOT
+extern void Resume680x0(void);									// Start 680x0 from a restored snapshot
+#endif
 extern "C" void Execute68k(uint32 addr, M68kRegisters *r);		// Execute 68k code from EMUL_OP routine
 extern "C" void Execute68kTrap(uint16 trap, M68kRegisters *r);	// Execute MacOS 68k trap from EMUL_OP routine
 
+#if USE_CYCLE_STATS
+extern uint64 Get68kCycles(void);								// Estimated 68040 cycles since startup
+#endif
+
+extern void FPU_report_stats(void);								// Print and reset FPU fast path counters
+
 // Interrupt functions
 extern void TriggerInterrupt(void);								// Trigger interrupt level 1 (InterruptFlag must be set first)
 extern void TriggerNMI(void);									// Trigger interrupt level 7
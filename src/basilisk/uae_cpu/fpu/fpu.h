@@ -18,6 +18,12 @@
 #include "sysdeps.h"
 #include "fpu/types.h"
 
+/* Keep single-precision shadows of the data registers so that .S operand
+ * arithmetic can run on the hardware FPU (see fpu_ieee.cpp) */
+#ifndef FPU_SINGLE_FASTPATH
+#define FPU_SINGLE_FASTPATH 0
+#endif
+
 /* ========================================================================== */
 /* ========================= FPU CONTEXT DEFINITION ========================= */
 /* ========================================================================== */
@@ -34,6 +40,13 @@ struct fpu_t {
     /* Used for lazy evaluation of FPU flags */
     fpu_register    result;
     
+#if FPU_SINGLE_FASTPATH
+    /* Single-precision copy of each register; bit n of shadow_valid is set
+     * while shadow[n] holds exactly the value of registers[n] */
+    fpu_single      shadow[8];
+    uae_u32         shadow_valid;
+#endif
+    
     /* ---------------------------------------------------------------------- */
     /* --- Floating-Point Control Register                                --- */
     /* ---------------------------------------------------------------------- */
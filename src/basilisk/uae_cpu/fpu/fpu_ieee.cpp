@@ -102,8 +102,8 @@ PRIVATE inline void FFPU make_quotient(fpu_register const & quotient, uae_u32 si
     FPU fpsr.quotient = sign | (lsb << 16);
 }
 
-// to_single
-PRIVATE inline fpu_register FFPU make_single(uae_u32 value)
+// to_single, keeping the host single-precision value
+PRIVATE inline fpu_single FFPU make_native_single(uae_u32 value)
 {
     fpu_single result = 0;
     fp_declare_init_shape(srp, result, single);
@@ -114,6 +114,12 @@ PRIVATE inline fpu_register FFPU make_single(uae_u32 value)
     return result;
 }
 
+// to_single
+PRIVATE inline fpu_register FFPU make_single(uae_u32 value)
+{
+    return make_native_single(value);
+}
+
 // from_single
 PRIVATE inline uae_u32 FFPU extract_single(fpu_register const & src)
 {
@@ -126,9 +132,234 @@ PRIVATE inline uae_u32 FFPU extract_single(fpu_register const & src)
     return result;
 }
 
+/* -------------------------- Single-precision fast path -------------------------- */
+
+/*
+ *  The ESP32-P4 FPU only does single precision in hardware; every operation
+ *  on fpu_register (double) goes through soft-float. With FPU_SINGLE_FASTPATH
+ *  each data register carries a float shadow that is valid while the register
+ *  holds a value exactly representable in single precision. The ops whose
+ *  result is single by definition (68040 FSADD/FSSUB/FSMUL/FSDIV, FSGLMUL/
+ *  FSGLDIV), FMOVE and FCMP, whose outcome is exact, then run on the
+ *  hardware when both operands have a single view. Plain FADD/FSUB/FMUL/FDIV
+ *  stay on the double path even with FPCR precision single: that path
+ *  doesn't round to FPCR precision, and the result mustn't depend on whether
+ *  the shadows happen to be valid. Everything else takes the double path and
+ *  drops the destination shadow.
+ */
+
+#if FPU_SINGLE_FASTPATH
+
+enum {
+    FPU_SGL_MOVE,
+    FPU_SGL_ADD,
+    FPU_SGL_SUB,
+    FPU_SGL_MUL,
+    FPU_SGL_DIV,
+    FPU_SGL_CMP,
+    FPU_SGL_STORE,
+    FPU_SGL_OPS
+};
+
+static const char * const single_op_names[FPU_SGL_OPS] = {
+    "move", "add", "sub", "mul", "div", "cmp", "store"
+};
+
+// Per-op hit/miss counters, reset by FPU_report_stats()
+static uae_u32 single_hits[FPU_SGL_OPS];
+static uae_u32 single_misses[FPU_SGL_OPS];
+
+// Single-precision view of the last get_fp_value() source operand
+static bool       src_single_valid;
+static fpu_single src_single;
+
+PRIVATE inline void FFPU set_single_source(fpu_single value)
+{
+    src_single = value;
+    src_single_valid = true;
+}
+
+// Integer sources convert exactly when they fit in the 24-bit significand
+PRIVATE inline void FFPU set_single_source_int(uae_s32 value)
+{
+    if (value >= -(1 << 24) && value <= (1 << 24))
+        set_single_source((fpu_single)value);
+}
+
+PRIVATE inline void FFPU set_single_register(int r, fpu_single value)
+{
+    FPU registers[r] = value;
+    FPU shadow[r] = value;
+    FPU shadow_valid |= 1 << r;
+}
+
+PRIVATE inline void FFPU invalidate_single(int r)
+    { FPU shadow_valid &= ~(1 << r); }
+
+PRIVATE inline void FFPU invalidate_single_all(void)
+    { FPU shadow_valid = 0; }
+
+// Encode a register for FMOVE.S, from its shadow when it has one
+PRIVATE inline bool FFPU extract_single_shadow(int r, uae_u32 * value)
+{
+    if ((FPU shadow_valid & (1 << r)) == 0) {
+        single_misses[FPU_SGL_STORE]++;
+        return false;
+    }
+    fpu_single input = FPU shadow[r];
+    fp_declare_init_shape(sip, input, single);
+    *value = (sip->ieee.negative << 31)
+           | (sip->ieee.exponent << 23)
+           | sip->ieee.mantissa;
+    single_hits[FPU_SGL_STORE]++;
+    return true;
+}
+
+// Try to execute a register-destination arithmetic op in single precision.
+// Returns false when the caller must run the double-precision path.
+PRIVATE inline bool FFPU single_fastpath(uae_u32 extra, int reg)
+{
+    int op;
+    bool rounds_to_single = false;
+
+    switch (extra & 0x7f) {
+    case 0x00:  op = FPU_SGL_MOVE; break;
+    case 0x27:  op = FPU_SGL_MUL;  rounds_to_single = true; break;  /* FSGLMUL */
+    case 0x24:  op = FPU_SGL_DIV;  rounds_to_single = true; break;  /* FSGLDIV */
+    case 0x38:  op = FPU_SGL_CMP;  break;
+    case 0x40: case 0x62: case 0x68: case 0x63: case 0x60:
+        if (!FPU is_integral)
+            return false;
+        rounds_to_single = true;
+        switch (extra & 0x7f) {
+        case 0x40:  op = FPU_SGL_MOVE; break;  /* FSMOVE */
+        case 0x62:  op = FPU_SGL_ADD;  break;  /* FSADD */
+        case 0x68:  op = FPU_SGL_SUB;  break;  /* FSSUB */
+        case 0x63:  op = FPU_SGL_MUL;  break;  /* FSMUL */
+        default:    op = FPU_SGL_DIV;  break;  /* FSDIV */
+        }
+        break;
+    default:
+        return false;
+    }
+
+    if (!src_single_valid) {
+        single_misses[op]++;
+        return false;
+    }
+
+    if (op == FPU_SGL_MOVE) {
+        set_single_register(reg, src_single);
+        make_fpsr(FPU registers[reg]);
+        single_hits[op]++;
+        return true;
+    }
+
+    // The destination needs a single view too, and a two-operand result must
+    // be single by definition: float arithmetic on float inputs gives the
+    // correctly rounded single result, but not the extended one
+    if ((FPU shadow_valid & (1 << reg)) == 0 ||
+        (op != FPU_SGL_CMP && !rounds_to_single)) {
+        single_misses[op]++;
+        return false;
+    }
+
+    fpu_single dest = FPU shadow[reg];
+    fpu_single result;
+    switch (op) {
+    case FPU_SGL_ADD:   result = dest + src_single; break;
+    case FPU_SGL_SUB:   result = dest - src_single; break;
+    case FPU_SGL_MUL:   result = dest * src_single; break;
+    case FPU_SGL_DIV:   result = dest / src_single; break;
+    default:
+        // The sign and zero-ness of a single difference are exact
+        set_fpsr(0);
+        make_fpsr(dest - src_single);
+        single_hits[op]++;
+        return true;
+    }
+
+    if (isnan(result)) {
+        // Leave NaN generation to the common code so the bit pattern matches
+        make_nan(FPU registers[reg]);
+        invalidate_single(reg);
+    }
+    else {
+        set_single_register(reg, result);
+    }
+    make_fpsr(FPU registers[reg]);
+    single_hits[op]++;
+    return true;
+}
+
+PUBLIC void FFPU FPU_report_stats(void)
+{
+    char line[256];
+    int len = 0;
+    uae_u32 total = 0;
+    line[0] = 0;
+    for (int i = 0; i < FPU_SGL_OPS; i++) {
+        uae_u32 n = single_hits[i] + single_misses[i];
+        total += n;
+        if (n == 0)
+            continue;
+        if (len < (int)sizeof(line))
+            len += snprintf(line + len, sizeof(line) - len, " %s=%u/%u",
+                            single_op_names[i], single_hits[i], n);
+        single_hits[i] = single_misses[i] = 0;
+    }
+    if (total > 0)
+        printf("[FPU] single hits%s\n", line);
+}
+
+#else
+
+PRIVATE inline void FFPU set_single_source(fpu_single value)
+    { }
+PRIVATE inline void FFPU set_single_source_int(uae_s32 value)
+    { }
+PRIVATE inline void FFPU invalidate_single(int r)
+    { }
+PRIVATE inline void FFPU invalidate_single_all(void)
+    { }
+PRIVATE inline bool FFPU extract_single_shadow(int r, uae_u32 * value)
+    { return false; }
+PRIVATE inline bool FFPU single_fastpath(uae_u32 extra, int reg)
+    { return false; }
+
+PUBLIC void FFPU FPU_report_stats(void)
+    { }
+
+#endif /* FPU_SINGLE_FASTPATH */
+
+/* -------------------------- Extended precision -------------------------- */
+
+// Re-biased double exponent of an extended exponent, or 0 if the value is
+// not a normal double (zero, denormal, Inf/NaN, out of range)
+PRIVATE inline uae_u32 FFPU extended_to_double_exp(uae_u32 wrd1)
+{
+    uae_u32 exp = ((wrd1 >> 16) & 0x7fff) - (FP_EXTENDED_EXP_BIAS - FP_DOUBLE_EXP_BIAS);
+    return exp - 1 < FP_DOUBLE_EXP_MAX - 1 ? exp : 0;
+}
+
+// Pack a normalised extended value with a representable exponent straight
+// into the double words; the low 11 mantissa bits are dropped as before
+PRIVATE inline fpu_register FFPU pack_extended(uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3, uae_u32 exp)
+{
+    fpu_register result;
+    fp_declare_init_shape(srp, result, double);
+    srp->parts.msw = (wrd1 & 0x80000000) | (exp << 20) | ((wrd2 & 0x7fffffff) >> 11);
+    srp->parts.lsw = (wrd2 << 21) | (wrd3 >> 11);
+    return result;
+}
+
 // to_exten
 PRIVATE inline fpu_register FFPU make_extended(uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3)
 {
+    uae_u32 dexp = extended_to_double_exp(wrd1);
+    if (dexp != 0 && (wrd2 & 0x80000000) != 0)
+        return pack_extended(wrd1, wrd2, wrd3, dexp);
+
     // is it zero?
     if ((wrd1 & 0x7fff0000) == 0 && wrd2 == 0 && wrd3 == 0)
         return 0.0;
@@ -176,6 +407,12 @@ PRIVATE inline fpu_register FFPU make_extended(uae_u32 wrd1, uae_u32 wrd2, uae_u
 PRIVATE inline void FFPU make_extended_no_normalize(
     uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3, fpu_register & result)
 {
+    uae_u32 dexp = extended_to_double_exp(wrd1);
+    if (dexp != 0) {
+        result = pack_extended(wrd1, wrd2, wrd3, dexp);
+        return;
+    }
+
     // is it zero?
     if ((wrd1 && 0x7fff0000) == 0 && wrd2 == 0 && wrd3 == 0) {
         make_zero_positive(result);
@@ -209,6 +446,18 @@ PRIVATE inline void FFPU make_extended_no_normalize(
 PRIVATE inline void FFPU extract_extended(fpu_register const & src,
     uae_u32 * wrd1, uae_u32 * wrd2, uae_u32 * wrd3)
 {
+    fp_declare_init_shape(sfp, src, double);
+    uae_u32 msw = sfp->parts.msw;
+    uae_u32 lsw = sfp->parts.lsw;
+    uae_u32 dexp = (msw >> 20) & FP_DOUBLE_EXP_MAX;
+    if (dexp - 1 < FP_DOUBLE_EXP_MAX - 1) {
+        // normal double: re-bias and set the explicit integer bit
+        *wrd1 = (msw & 0x80000000) | ((dexp + FP_EXTENDED_EXP_BIAS - FP_DOUBLE_EXP_BIAS) << 16);
+        *wrd2 = 0x80000000 | ((msw & 0x000fffff) << 11) | (lsw >> 21);
+        *wrd3 = lsw << 11;
+        return;
+    }
+
     if (src == 0.0) {
         *wrd1 = *wrd2 = *wrd3 = 0;
         return;
@@ -263,8 +512,216 @@ PRIVATE inline void FFPU extract_double(fpu_register const & src,
     fpu_debug(("extract_double (%.04f) = %X,%X\n", (double)src, *wrd1, *wrd2));
 }
 
+/* -------------------------- Packed decimal -------------------------- */
+
+/*
+ *  FMOVE.P used to go through sscanf()/sprintf() for every operand. The
+ *  common cases are now handled with integer arithmetic: a packed operand
+ *  whose significant digits fit in 53 bits and whose exponent is within the
+ *  exactly representable powers of ten converts with one correctly rounded
+ *  multiply or divide, and integral doubles encode directly. Whatever is
+ *  left goes through the string path, whose results are remembered in a
+ *  small cache, since code tends to move the same constants over and over.
+ */
+
+// Two BCD digits <-> 0..99
+DRAM_ATTR static uae_u8 bcd_to_bin[256];
+DRAM_ATTR static uae_u8 bin_to_bcd[100];
+
+static const uae_u64 pow10_u64[20] = {
+    UVAL64(1), UVAL64(10), UVAL64(100), UVAL64(1000), UVAL64(10000),
+    UVAL64(100000), UVAL64(1000000), UVAL64(10000000), UVAL64(100000000),
+    UVAL64(1000000000), UVAL64(10000000000), UVAL64(100000000000),
+    UVAL64(1000000000000), UVAL64(10000000000000), UVAL64(100000000000000),
+    UVAL64(1000000000000000), UVAL64(10000000000000000),
+    UVAL64(100000000000000000), UVAL64(1000000000000000000),
+    UVAL64(10000000000000000000)
+};
+
+static const fpu_double pow10_double[23] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define PACKED_CACHE_SIZE 16
+
+struct packed_cache_entry {
+    uae_u32      wrd1, wrd2, wrd3;
+    uae_u32      msw, lsw;
+    bool         valid;
+};
+
+DRAM_ATTR static packed_cache_entry packed_to_double_cache[PACKED_CACHE_SIZE];
+DRAM_ATTR static packed_cache_entry double_to_packed_cache[PACKED_CACHE_SIZE];
+
+PRIVATE inline void FFPU fpu_init_packed_tables(void)
+{
+    for (int i = 0; i < 256; i++)
+        bcd_to_bin[i] = (uae_u8)((i >> 4) * 10 + (i & 0xf));
+    for (int i = 0; i < 100; i++)
+        bin_to_bcd[i] = (uae_u8)(((i / 10) << 4) | (i % 10));
+    memset(packed_to_double_cache, 0, sizeof(packed_to_double_cache));
+    memset(double_to_packed_cache, 0, sizeof(double_to_packed_cache));
+}
+
+PRIVATE inline int FFPU packed_cache_slot(uae_u32 a, uae_u32 b, uae_u32 c)
+{
+    return ((a ^ b ^ c) * 0x9e3779b1) >> (32 - 4);
+}
+
+// 8 BCD digits of a word -> 0..99999999
+PRIVATE inline uae_u32 FFPU bcd8_to_bin(uae_u32 w)
+{
+    return ((bcd_to_bin[w >> 24] * 100 + bcd_to_bin[(w >> 16) & 0xff]) * 100 +
+             bcd_to_bin[(w >> 8) & 0xff]) * 100 + bcd_to_bin[w & 0xff];
+}
+
+// 0..99999999 -> 8 BCD digits
+PRIVATE inline uae_u32 FFPU bin_to_bcd8(uae_u32 v)
+{
+    uae_u32 hi = v / 10000, lo = v % 10000;
+    return ((uae_u32)bin_to_bcd[hi / 100] << 24) | ((uae_u32)bin_to_bcd[hi % 100] << 16) |
+           ((uae_u32)bin_to_bcd[lo / 100] << 8) | bin_to_bcd[lo % 100];
+}
+
+// to_pack (exact cases only); returns false to take the string path
+PRIVATE inline bool FFPU make_packed_fast(uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3, fpu_register & result)
+{
+    // The 17 significant digits are d.dddddddddddddddd; drop trailing zeros
+    // first so short decimals like 1.5 keep a small integer mantissa
+    int tz;
+    if (wrd3 != 0)
+        tz = __builtin_ctz(wrd3) >> 2;
+    else if (wrd2 != 0)
+        tz = 8 + (__builtin_ctz(wrd2) >> 2);
+    else
+        tz = 16;
+
+    uae_u64 mant = (uae_u64)(wrd1 & 0xf) * pow10_u64[16] +
+                   (uae_u64)bcd8_to_bin(wrd2) * pow10_u64[8] + bcd8_to_bin(wrd3);
+    if (mant == 0) {
+        if (wrd1 & 0x80000000)
+            make_zero_negative(result);
+        else
+            make_zero_positive(result);
+        return true;
+    }
+    if (tz != 0)
+        mant /= pow10_u64[tz];
+    if (mant >= (UVAL64(1) << 53))
+        return false;
+
+    int exp10 = (((wrd1 >> 24) & 0xf) * 10 + ((wrd1 >> 20) & 0xf)) * 10 + ((wrd1 >> 16) & 0xf);
+    if (wrd1 & 0x40000000)
+        exp10 = -exp10;
+    int k = exp10 - 16 + tz;
+
+    fpu_double value;
+    if (k >= 0 && k <= 22)
+        value = (fpu_double)mant * pow10_double[k];
+    else if (k < 0 && k >= -22)
+        value = (fpu_double)mant / pow10_double[-k];
+    else if (k > 22 && k - 22 < 16 && mant < (UVAL64(1) << 53) / pow10_u64[k - 22])
+        value = (fpu_double)(mant * pow10_u64[k - 22]) * pow10_double[22];
+    else
+        return false;
+    result = (wrd1 & 0x80000000) ? -value : value;
+    return true;
+}
+
+// from_pack (integral values only); returns false to take the string path
+PRIVATE inline bool FFPU extract_packed_fast(fpu_register const & src, uae_u32 * wrd1, uae_u32 * wrd2, uae_u32 * wrd3)
+{
+    fp_declare_init_shape(sfp, src, double);
+    uae_u32 msw = sfp->parts.msw;
+    uae_u32 lsw = sfp->parts.lsw;
+    int exp = (int)((msw >> 20) & FP_DOUBLE_EXP_MAX) - FP_DOUBLE_EXP_BIAS;
+
+    if (((msw & 0x7fffffff) | lsw) == 0) {
+        *wrd1 = msw & 0x80000000;
+        *wrd2 = *wrd3 = 0;
+        return true;
+    }
+    // integral and below 2^53: all fraction bits below the binary point zero
+    if (exp < 0 || exp > 52)
+        return false;
+    uae_u64 mant = ((uae_u64)((msw & 0x000fffff) | 0x00100000) << 32) | lsw;
+    if (mant & ((UVAL64(1) << (52 - exp)) - 1))
+        return false;
+    uae_u64 n = mant >> (52 - exp);
+
+    // Scale to a 17-digit significand d.dddddddddddddddd
+    int digits = 1;
+    while (digits < 17 && n >= pow10_u64[digits])
+        digits++;
+    n *= pow10_u64[17 - digits];
+
+    uae_u32 ones = (uae_u32)(n / pow10_u64[16]);
+    uae_u64 frac = n - ones * pow10_u64[16];
+    uae_u32 frac_hi = (uae_u32)(frac / pow10_u64[8]);
+    uae_u32 frac_lo = (uae_u32)(frac - frac_hi * pow10_u64[8]);
+    uae_u32 e = digits - 1;
+
+    *wrd1 = (msw & 0x80000000) | ((uae_u32)bin_to_bcd[e] << 16) | ones;
+    *wrd2 = bin_to_bcd8(frac_hi);
+    *wrd3 = bin_to_bcd8(frac_lo);
+    return true;
+}
+
+PRIVATE inline fpu_register FFPU make_packed_slow(uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3);
+PRIVATE inline void FFPU extract_packed_slow(fpu_register const & src, uae_u32 * wrd1, uae_u32 * wrd2, uae_u32 * wrd3);
+
 // to_pack
 PRIVATE inline fpu_register FFPU make_packed(uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3)
+{
+    fpu_register result;
+    if (make_packed_fast(wrd1, wrd2, wrd3, result))
+        return result;
+
+    packed_cache_entry & ce = packed_to_double_cache[packed_cache_slot(wrd1, wrd2, wrd3)];
+    fp_declare_init_shape(srp, result, double);
+    if (ce.valid && ce.wrd1 == wrd1 && ce.wrd2 == wrd2 && ce.wrd3 == wrd3) {
+        srp->parts.msw = ce.msw;
+        srp->parts.lsw = ce.lsw;
+        return result;
+    }
+    result = make_packed_slow(wrd1, wrd2, wrd3);
+    ce.wrd1 = wrd1;
+    ce.wrd2 = wrd2;
+    ce.wrd3 = wrd3;
+    ce.msw = srp->parts.msw;
+    ce.lsw = srp->parts.lsw;
+    ce.valid = true;
+    return result;
+}
+
+// from_pack
+PRIVATE inline void FFPU extract_packed(fpu_register const & src, uae_u32 * wrd1, uae_u32 * wrd2, uae_u32 * wrd3)
+{
+    if (extract_packed_fast(src, wrd1, wrd2, wrd3))
+        return;
+
+    fp_declare_init_shape(sfp, src, double);
+    uae_u32 msw = sfp->parts.msw;
+    uae_u32 lsw = sfp->parts.lsw;
+    packed_cache_entry & ce = double_to_packed_cache[packed_cache_slot(msw, lsw, 0)];
+    if (ce.valid && ce.msw == msw && ce.lsw == lsw) {
+        *wrd1 = ce.wrd1;
+        *wrd2 = ce.wrd2;
+        *wrd3 = ce.wrd3;
+        return;
+    }
+    extract_packed_slow(src, wrd1, wrd2, wrd3);
+    ce.msw = msw;
+    ce.lsw = lsw;
+    ce.wrd1 = *wrd1;
+    ce.wrd2 = *wrd2;
+    ce.wrd3 = *wrd3;
+    ce.valid = true;
+}
+
+// to_pack, through the C library
+PRIVATE inline fpu_register FFPU make_packed_slow(uae_u32 wrd1, uae_u32 wrd2, uae_u32 wrd3)
 {
     fpu_double d;
     char *cp;
@@ -305,8 +762,8 @@ PRIVATE inline fpu_register FFPU make_packed(uae_u32 wrd1, uae_u32 wrd2, uae_u32
     return d;
 }
 
-// from_pack
-PRIVATE inline void FFPU extract_packed(fpu_register const & src, uae_u32 * wrd1, uae_u32 * wrd2, uae_u32 * wrd3)
+// from_pack, through the C library
+PRIVATE inline void FFPU extract_packed_slow(fpu_register const & src, uae_u32 * wrd1, uae_u32 * wrd2, uae_u32 * wrd3)
 {
     int i;
     int t;
@@ -368,8 +825,17 @@ PRIVATE inline int FFPU get_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
     static int sz1[8] = {4, 4, 12, 12, 2, 8, 1, 0};
     static int sz2[8] = {4, 4, 12, 12, 2, 8, 2, 0};
 
+#if FPU_SINGLE_FASTPATH
+    src_single_valid = false;
+#endif
+
     if ((extra & 0x4000) == 0) {
-        src = FPU registers[(extra >> 10) & 7];
+        int src_reg = (extra >> 10) & 7;
+        src = FPU registers[src_reg];
+#if FPU_SINGLE_FASTPATH
+        if (FPU shadow_valid & (1 << src_reg))
+            set_single_source(FPU shadow[src_reg]);
+#endif
         return 1;
     }
     mode = (opcode >> 3) & 7;
@@ -383,16 +849,22 @@ PRIVATE inline int FFPU get_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
         switch (size) {
         case 6:
             src = (fpu_register)(uae_s8)m68k_dreg(regs, reg);
+            set_single_source_int((uae_s8)m68k_dreg(regs, reg));
             break;
         case 4:
             src = (fpu_register)(uae_s16)m68k_dreg(regs, reg);
+            set_single_source_int((uae_s16)m68k_dreg(regs, reg));
             break;
         case 0:
             src = (fpu_register)(uae_s32)m68k_dreg(regs, reg);
+            set_single_source_int((uae_s32)m68k_dreg(regs, reg));
             break;
-        case 1:
-            src = make_single(m68k_dreg(regs, reg));
+        case 1: {
+            fpu_single value = make_native_single(m68k_dreg(regs, reg));
+            src = value;
+            set_single_source(value);
             break;
+        }
         default:
             return 0;
         }
@@ -451,12 +923,18 @@ PRIVATE inline int FFPU get_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
     fpu_debug(("get_fp_value get_long (ad)=%X\n", get_long(ad)));
 
     switch (size) {
-    case 0:
-        src = (fpu_register)(uae_s32)get_long(ad);
+    case 0: {
+        uae_s32 value = (uae_s32)get_long(ad);
+        src = (fpu_register)value;
+        set_single_source_int(value);
         break;
-    case 1:
-        src = make_single(get_long(ad));
+    }
+    case 1: {
+        fpu_single value = make_native_single(get_long(ad));
+        src = value;
+        set_single_source(value);
         break;
+    }
     case 2: {
         uae_u32 wrd1, wrd2, wrd3;
         wrd1 = get_long(ad);
@@ -477,9 +955,12 @@ PRIVATE inline int FFPU get_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
         src = make_packed(wrd1, wrd2, wrd3);
         break;
     }
-    case 4:
-        src = (fpu_register)(uae_s16)get_word(ad);
+    case 4: {
+        uae_s16 value = (uae_s16)get_word(ad);
+        src = (fpu_register)value;
+        set_single_source_int(value);
         break;
+    }
     case 5: {
         uae_u32 wrd1, wrd2;
         wrd1 = get_long(ad);
@@ -488,9 +969,12 @@ PRIVATE inline int FFPU get_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
         src = make_double(wrd1, wrd2);
         break;
     }
-    case 6:
-        src = (fpu_register)(uae_s8)get_byte(ad);
+    case 6: {
+        uae_s8 value = (uae_s8)get_byte(ad);
+        src = (fpu_register)value;
+        set_single_source_int(value);
         break;
+    }
     default:
         return 0;
     }
@@ -522,7 +1006,7 @@ PRIVATE inline uae_s32 FFPU toint(fpu_register const & src)
     return (uae_s32)result;
 }
 
-PRIVATE inline int FFPU put_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register const & value)
+PRIVATE inline int FFPU put_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register const & value, int value_reg = -1)
 {
     uae_u16 tmp;
     uaecptr tmppc;
@@ -535,6 +1019,7 @@ PRIVATE inline int FFPU put_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
 
     if ((extra & 0x4000) == 0) {
         int dest_reg = (extra >> 10) & 7;
+        invalidate_single(dest_reg);
         FPU registers[dest_reg] = value;
         make_fpsr(FPU registers[dest_reg]);
         return 1;
@@ -543,6 +1028,12 @@ PRIVATE inline int FFPU put_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
     reg = opcode & 7;
     size = (extra >> 10) & 7;
     ad = 0xffffffff;
+
+    // FMOVE.S of a register with a single shadow skips the double conversion
+    uae_u32 single_bits = 0;
+    bool have_single_bits = size == 1 && value_reg >= 0 &&
+                            extract_single_shadow(value_reg, &single_bits);
+
     switch (mode) {
     case 0:
         switch (size) {
@@ -558,7 +1049,7 @@ PRIVATE inline int FFPU put_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
             m68k_dreg(regs, reg) = toint(value);
             break;
         case 1:
-            m68k_dreg(regs, reg) = extract_single(value);
+            m68k_dreg(regs, reg) = have_single_bits ? single_bits : extract_single(value);
             break;
         default:
             return 0;
@@ -613,7 +1104,7 @@ PRIVATE inline int FFPU put_fp_value(uae_u32 opcode, uae_u16 extra, fpu_register
         put_long(ad, toint(value));
         break;
     case 1:
-        put_long(ad, extract_single(value));
+        put_long(ad, have_single_bits ? single_bits : extract_single(value));
         break;
     case 2: {
         uae_u32 wrd1, wrd2, wrd3;
@@ -986,6 +1477,38 @@ void FFPU fpuop_restore(uae_u32 opcode)
     }
 }
 
+/*
+ *  FMOVECR constant ROM, resolved at compile time. FMOVECR_PRESENT marks the
+ *  defined offsets (anything else is illegal here), FMOVECR_SINGLE those that
+ *  are exact in single precision, and 0x3c-0x3f (10^512 and up) load +Inf.
+ */
+static const fpu_double fmovecr_rom[0x3c] = {
+    /* 0x00 */ 3.1415926535897932384626433832795,     /* Pi */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x0b */ 0.30102999566398119521373889472449,    /* Log10(2) */
+    /* 0x0c */ 2.7182818284590452353602874713527,     /* e */
+    /* 0x0d */ 1.4426950408889634073599246810019,     /* Log2(e) */
+    /* 0x0e */ 0.43429448190325182765112891891661,    /* Log10(e) */
+    /* 0x0f */ 0.0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x30 */ 0.69314718055994530941723212145818,    /* ln(2) */
+    /* 0x31 */ 2.3025850929940456840179914546844,     /* ln(10) */
+    /* 0x32 */ 1.0e0,
+    /* 0x33 */ 1.0e1,
+    /* 0x34 */ 1.0e2,
+    /* 0x35 */ 1.0e4,
+    /* 0x36 */ 1.0e8,
+    /* 0x37 */ 1.0e16,
+    /* 0x38 */ 1.0e32,
+    /* 0x39 */ 1.0e64,
+    /* 0x3a */ 1.0e128,
+    /* 0x3b */ 1.0e256,
+};
+
+#define FMOVECR_PRESENT (UVAL64(0xffff000000000000) | UVAL64(0x000000000000f801))
+#define FMOVECR_SINGLE  (UVAL64(0x007c000000000000) | UVAL64(0x0000000000008000))
+
 void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
 {
     int reg;
@@ -999,7 +1522,7 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
     switch ((extra >> 13) & 0x7) {
     case 3:
         fpu_debug(("FMOVE -> <ea>\n"));
-        if (put_fp_value(opcode, extra, FPU registers[(extra >> 7) & 7]) == 0) {
+        if (put_fp_value(opcode, extra, FPU registers[(extra >> 7) & 7], (extra >> 7) & 7) == 0) {
             m68k_setpc(m68k_getpc() - 4);
             op_illg(opcode);
         }
@@ -1278,6 +1801,7 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
                         ad -= 4;
                         wrd1 = get_long(ad);
                         make_extended_no_normalize(wrd1, wrd2, wrd3, FPU registers[reg]);
+                        invalidate_single(reg);
                     }
                     list <<= 1;
                 }
@@ -1293,6 +1817,7 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
                         wrd3 = get_long(ad);
                         ad += 4;
                         make_extended_no_normalize(wrd1, wrd2, wrd3, FPU registers[reg]);
+                        invalidate_single(reg);
                     }
                     list <<= 1;
                 }
@@ -1310,93 +1835,24 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
         reg = (extra >> 7) & 7;
         if ((extra & 0xfc00) == 0x5c00) {
             fpu_debug(("FMOVECR memory->FPP\n"));
-            switch (extra & 0x7f) {
-            case 0x00:
-                FPU registers[reg] = 3.1415926535897932384626433832795;
-                fpu_debug(("FP const: Pi\n"));
-                break;
-            case 0x0b:
-                FPU registers[reg] = 0.30102999566398119521373889472449;
-                fpu_debug(("FP const: Log 10 (2)\n"));
-                break;
-            case 0x0c:
-                FPU registers[reg] = 2.7182818284590452353602874713527;
-                fpu_debug(("FP const: e\n"));
-                break;
-            case 0x0d:
-                FPU registers[reg] = 1.4426950408889634073599246810019;
-                fpu_debug(("FP const: Log 2 (e)\n"));
-                break;
-            case 0x0e:
-                FPU registers[reg] = 0.43429448190325182765112891891661;
-                fpu_debug(("FP const: Log 10 (e)\n"));
-                break;
-            case 0x0f:
-                FPU registers[reg] = 0.0;
-                fpu_debug(("FP const: zero\n"));
-                break;
-            case 0x30:
-                FPU registers[reg] = 0.69314718055994530941723212145818;
-                fpu_debug(("FP const: ln(2)\n"));
-                break;
-            case 0x31:
-                FPU registers[reg] = 2.3025850929940456840179914546844;
-                fpu_debug(("FP const: ln(10)\n"));
-                break;
-            case 0x32:
-                FPU registers[reg] = 1.0e0;
-                fpu_debug(("FP const: 1.0e0\n"));
-                break;
-            case 0x33:
-                FPU registers[reg] = 1.0e1;
-                fpu_debug(("FP const: 1.0e1\n"));
-                break;
-            case 0x34:
-                FPU registers[reg] = 1.0e2;
-                fpu_debug(("FP const: 1.0e2\n"));
-                break;
-            case 0x35:
-                FPU registers[reg] = 1.0e4;
-                fpu_debug(("FP const: 1.0e4\n"));
-                break;
-            case 0x36:
-                FPU registers[reg] = 1.0e8;
-                fpu_debug(("FP const: 1.0e8\n"));
-                break;
-            case 0x37:
-                FPU registers[reg] = 1.0e16;
-                fpu_debug(("FP const: 1.0e16\n"));
-                break;
-            case 0x38:
-                FPU registers[reg] = 1.0e32;
-                fpu_debug(("FP const: 1.0e32\n"));
-                break;
-            case 0x39:
-                FPU registers[reg] = 1.0e64;
-                fpu_debug(("FP const: 1.0e64\n"));
-                break;
-            case 0x3a:
-                FPU registers[reg] = 1.0e128;
-                fpu_debug(("FP const: 1.0e128\n"));
-                break;
-            case 0x3b:
-                FPU registers[reg] = 1.0e256;
-                fpu_debug(("FP const: 1.0e256\n"));
-                break;
-            // Note: 1.0e512 and above overflow double precision
-            // They will become infinity, which is acceptable behavior
-            case 0x3c:
-            case 0x3d:
-            case 0x3e:
-            case 0x3f:
-                make_inf_positive(FPU registers[reg]);
-                fpu_debug(("FP const: large power of 10 (inf)\n"));
-                break;
-            default:
+            invalidate_single(reg);
+            int offset = extra & 0x7f;
+            if (offset >= 0x40 || ((FMOVECR_PRESENT >> offset) & 1) == 0) {
                 m68k_setpc(m68k_getpc() - 4);
                 op_illg(opcode);
-                break;
             }
+            else if (offset >= 0x3c) {
+                // 1.0e512 and above overflow double precision
+                make_inf_positive(FPU registers[reg]);
+            }
+            else {
+                FPU registers[reg] = fmovecr_rom[offset];
+#if FPU_SINGLE_FASTPATH
+                if ((FMOVECR_SINGLE >> offset) & 1)
+                    set_single_register(reg, (fpu_single)fmovecr_rom[offset]);
+#endif
+            }
+            fpu_debug(("FP const: offset %X\n", offset));
             make_fpsr(FPU registers[reg]);
             dump_registers("END  ");
             return;
@@ -1410,6 +1866,15 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
         }
         fpu_debug(("returned from get_fp_value m68k_getpc()=%X\n", m68k_getpc()));
         
+        if (single_fastpath(extra, reg)) {
+            dump_registers("END  ");
+            return;
+        }
+        if ((extra & 0x7f) != 0x38 && (extra & 0x7f) != 0x3a) {
+            // Everything but FCMP and FTST writes the destination
+            invalidate_single(reg);
+        }
+        
         if (FPU is_integral) {
             // 68040-specific operations
             switch (extra & 0x7f) {
@@ -1558,12 +2023,12 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
             break;
         case 0x06:      /* FLOGNP1 */
             fpu_debug(("FLOGNP1 %.04f\n", (double)src));
-            FPU registers[reg] = fp_log(src + 1.0);
+            FPU registers[reg] = fp_log1p(src);
             make_fpsr(FPU registers[reg]);
             break;
         case 0x08:      /* FETOXM1 */
             fpu_debug(("FETOXM1 %.04f\n", (double)src));
-            FPU registers[reg] = fp_exp(src) - 1.0;
+            FPU registers[reg] = fp_expm1(src);
             make_fpsr(FPU registers[reg]);
             break;
         case 0x09:      /* FTANH */
@@ -1603,12 +2068,12 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
             break;
         case 0x11:      /* FTWOTOX */
             fpu_debug(("FTWOTOX %.04f\n", (double)src));
-            FPU registers[reg] = fp_pow(2.0, src);
+            FPU registers[reg] = fp_exp2(src);
             make_fpsr(FPU registers[reg]);
             break;
         case 0x12:      /* FTENTOX */
             fpu_debug(("FTENTOX %.04f\n", (double)src));
-            FPU registers[reg] = fp_pow(10.0, src);
+            FPU registers[reg] = fp_exp10(src);
             make_fpsr(FPU registers[reg]);
             break;
         case 0x14:      /* FLOGN */
@@ -1623,7 +2088,7 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
             break;
         case 0x16:      /* FLOG2 */
             fpu_debug(("FLOG2 %.04f\n", (double)src));
-            FPU registers[reg] = fp_log(src) / fp_log(2.0);
+            FPU registers[reg] = fp_log2(src);
             make_fpsr(FPU registers[reg]);
             break;
         case 0x18:      /* FABS */
@@ -1785,9 +2250,14 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
         case 0x36:
         case 0x37:
             fpu_debug(("FSINCOS %.04f\n", (double)src));
-            // Cosine must be calculated first if same register
-            FPU registers[extra & 7] = fp_cos(src);
-            FPU registers[reg] = fp_sin(src);
+            // Cosine must be stored first if same register
+            invalidate_single(extra & 7);
+            {
+                fpu_register sin_value, cos_value;
+                fp_sincos(src, &sin_value, &cos_value);
+                FPU registers[extra & 7] = cos_value;
+                FPU registers[reg] = sin_value;
+            }
             make_fpsr(FPU registers[reg]);
             break;
         case 0x38:      /* FCMP */
@@ -1819,6 +2289,91 @@ void FFPU fpuop_arithmetic(uae_u32 opcode, uae_u32 extra)
 
 /* -------------------------- Initialization -------------------------- */
 
+#if FPU_FAST_MATH && FPU_MATH_BENCH
+#include "esp_timer.h"
+
+/*
+ *  Microbenchmark of each table-driven kernel against the libm call it
+ *  replaces, with the largest difference between the two in ulps
+ */
+struct math_bench {
+    const char * name;
+    fpu_register (*fast)(fpu_register const &);
+    fpu_register (*libm)(fpu_register);
+    fpu_register lo, hi;
+};
+
+#define MATH_BENCH_FAST(n) static fpu_register bench_fast_##n(fpu_register const & x) { return fp_##n(x); }
+MATH_BENCH_FAST(exp) MATH_BENCH_FAST(exp2) MATH_BENCH_FAST(exp10) MATH_BENCH_FAST(expm1)
+MATH_BENCH_FAST(log) MATH_BENCH_FAST(log2) MATH_BENCH_FAST(log10) MATH_BENCH_FAST(log1p)
+MATH_BENCH_FAST(sin) MATH_BENCH_FAST(cos) MATH_BENCH_FAST(tan) MATH_BENCH_FAST(atan)
+MATH_BENCH_FAST(asin) MATH_BENCH_FAST(acos) MATH_BENCH_FAST(sinh) MATH_BENCH_FAST(cosh)
+MATH_BENCH_FAST(tanh) MATH_BENCH_FAST(atanh)
+#undef MATH_BENCH_FAST
+
+static fpu_register bench_libm_exp2(fpu_register x)  { return pow(2.0, x); }
+static fpu_register bench_libm_exp10(fpu_register x) { return pow(10.0, x); }
+static fpu_register bench_libm_log2(fpu_register x)  { return log(x) / log(2.0); }
+
+static const math_bench math_benches[] = {
+    { "FETOX",   bench_fast_exp,   exp,              -20.0, 20.0 },
+    { "FTWOTOX", bench_fast_exp2,  bench_libm_exp2,  -30.0, 30.0 },
+    { "FTENTOX", bench_fast_exp10, bench_libm_exp10, -10.0, 10.0 },
+    { "FETOXM1", bench_fast_expm1, expm1,             -2.0,  2.0 },
+    { "FLOGN",   bench_fast_log,   log,              1e-3,  1e3 },
+    { "FLOG2",   bench_fast_log2,  bench_libm_log2,  1e-3,  1e3 },
+    { "FLOG10",  bench_fast_log10, log10,            1e-3,  1e3 },
+    { "FLOGNP1", bench_fast_log1p, log1p,            -0.5,  2.0 },
+    { "FSIN",    bench_fast_sin,   sin,             -10.0, 10.0 },
+    { "FCOS",    bench_fast_cos,   cos,             -10.0, 10.0 },
+    { "FTAN",    bench_fast_tan,   tan,             -10.0, 10.0 },
+    { "FATAN",   bench_fast_atan,  atan,            -10.0, 10.0 },
+    { "FASIN",   bench_fast_asin,  asin,             -1.0,  1.0 },
+    { "FACOS",   bench_fast_acos,  acos,             -1.0,  1.0 },
+    { "FSINH",   bench_fast_sinh,  sinh,             -5.0,  5.0 },
+    { "FCOSH",   bench_fast_cosh,  cosh,             -5.0,  5.0 },
+    { "FTANH",   bench_fast_tanh,  tanh,             -5.0,  5.0 },
+    { "FATANH",  bench_fast_atanh, atanh,            -0.9,  0.9 },
+};
+
+PRIVATE void FFPU fpu_benchmark_math(void)
+{
+    const int samples = 256, rounds = 4;
+    static fpu_register input[256];
+    volatile fpu_register sink = 0;
+
+    for (size_t b = 0; b < sizeof(math_benches) / sizeof(math_benches[0]); b++) {
+        const math_bench & mb = math_benches[b];
+        for (int i = 0; i < samples; i++)
+            input[i] = mb.lo + (mb.hi - mb.lo) * (i + 0.5) / samples;
+
+        int64_t t0 = esp_timer_get_time();
+        for (int n = 0; n < rounds; n++)
+            for (int i = 0; i < samples; i++)
+                sink = mb.fast(input[i]);
+        int64_t t1 = esp_timer_get_time();
+        for (int n = 0; n < rounds; n++)
+            for (int i = 0; i < samples; i++)
+                sink = mb.libm(input[i]);
+        int64_t t2 = esp_timer_get_time();
+
+        fpu_register max_ulp = 0;
+        for (int i = 0; i < samples; i++) {
+            fpu_register ref = mb.libm(input[i]);
+            fpu_register ulp = nextafter(fp_fabs(ref), HUGE_VAL) - fp_fabs(ref);
+            fpu_register err = ulp > 0 ? fp_fabs(mb.fast(input[i]) - ref) / ulp : 0;
+            if (err > max_ulp)
+                max_ulp = err;
+        }
+
+        const int calls = samples * rounds;
+        printf("[FPU] bench %-8s fast=%4dns libm=%4dns diff<=%.1f ulp\n", mb.name,
+               (int)((t1 - t0) * 1000 / calls), (int)((t2 - t1) * 1000 / calls), (double)max_ulp);
+    }
+    (void)sink;
+}
+#endif
+
 PUBLIC void FFPU fpu_init(bool integral_68040)
 {
     fpu_debug(("fpu_init\n"));
@@ -1828,7 +2383,12 @@ PUBLIC void FFPU fpu_init(bool integral_68040)
         fpu_init_native_fflags();
         fpu_init_native_exceptions();
         fpu_init_native_accrued_exceptions();
+        fp_init_math_tables();
+        fpu_init_packed_tables();
         initialized_lookup_tables = true;
+#if FPU_FAST_MATH && FPU_MATH_BENCH
+        fpu_benchmark_math();
+#endif
     }
 
     FPU is_integral = integral_68040;
@@ -1842,6 +2402,7 @@ PUBLIC void FFPU fpu_init(bool integral_68040)
     for (int i = 0; i < 8; i++) {
         make_nan(FPU registers[i]);
     }
+    invalidate_single_all();
 
     printf("[FPU] Initialized IEEE FPU emulation (68040 integral: %s)\n", 
            integral_68040 ? "yes" : "no");
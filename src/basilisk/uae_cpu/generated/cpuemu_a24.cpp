@@ -0,0 +1,6 @@
+#if USE_24BIT_ACCESSORS
+#define MEM_ADDR_24BIT 1
+#define CPUFUNC_VARIANT(x) x##_a24
+#include "cpuemu.cpp"
+#include "cpustbl.cpp"
+#endif
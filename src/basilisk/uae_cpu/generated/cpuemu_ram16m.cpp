@@ -0,0 +1,6 @@
+#if USE_FIXED_RAM_ACCESSORS
+#define MEM_FIXED_RAMSIZE 0x01000000
+#define CPUFUNC_VARIANT(x) x##_ram16m
+#include "cpuemu.cpp"
+#include "cpustbl.cpp"
+#endif
@@ -8,13 +8,19 @@
 #include "cputbl.h"
 #define SET_CFLG_ALWAYS(x) SET_CFLG(x)
 #define SET_NFLG_ALWAYS(x) SET_NFLG(x)
+#ifdef CPUFUNC_VARIANT
+#define CPUFUNC_FF(x) CPUFUNC_VARIANT(x)
+#define CPUTBL_CONST const
+#else
 #define CPUFUNC_FF(x) x##_ff
+#define CPUTBL_CONST
+#endif
 #define CPUFUNC_NF(x) x##_nf
 #define CPUFUNC(x) CPUFUNC_FF(x)
 #ifdef NOFLAGS
 # include "noflags.h"
 #endif
-struct cputbl CPUFUNC(op_smalltbl_0)[] = {
+CPUTBL_CONST struct cputbl CPUFUNC(op_smalltbl_0)[] = {
 { CPUFUNC(op_0_0), 0, 0 }, /* OR.B #<data>.B,Dn */
 { CPUFUNC(op_10_0), 0, 16 }, /* OR.B #<data>.B,(An) */
 { CPUFUNC(op_18_0), 0, 24 }, /* OR.B #<data>.B,(An)+ */
@@ -1884,7 +1890,8 @@ struct cputbl CPUFUNC(op_smalltbl_0)[] = {
 { CPUFUNC_FF(op_f618_0), 0, 63000 }, /* MOVE16.L (xxx).L,(An) */
 { CPUFUNC_FF(op_f620_0), 0, 63008 }, /* MOVE16.L (An)+,(An)+ */
 { 0, 0, 0 }};
-struct cputbl CPUFUNC(op_smalltbl_1)[] = {
+#ifndef CPUFUNC_VARIANT
+CPUTBL_CONST struct cputbl CPUFUNC(op_smalltbl_1)[] = {
 { CPUFUNC(op_0_0), 0, 0 }, /* OR.B #<data>.B,Dn */
 { CPUFUNC(op_10_0), 0, 16 }, /* OR.B #<data>.B,(An) */
 { CPUFUNC(op_18_0), 0, 24 }, /* OR.B #<data>.B,(An)+ */
@@ -3728,7 +3735,9 @@ struct cputbl CPUFUNC(op_smalltbl_1)[] = {
 { CPUFUNC_FF(op_f37a_0), 0, 62330 }, /* FRESTORE.L (d16,PC) */
 { CPUFUNC_FF(op_f37b_0), 0, 62331 }, /* FRESTORE.L (d8,PC,Xn) */
 { 0, 0, 0 }};
-struct cputbl CPUFUNC(op_smalltbl_2)[] = {
+#endif
+#ifndef CPUFUNC_VARIANT
+CPUTBL_CONST struct cputbl CPUFUNC(op_smalltbl_2)[] = {
 { CPUFUNC(op_0_0), 0, 0 }, /* OR.B #<data>.B,Dn */
 { CPUFUNC(op_10_0), 0, 16 }, /* OR.B #<data>.B,(An) */
 { CPUFUNC(op_18_0), 0, 24 }, /* OR.B #<data>.B,(An)+ */
@@ -5532,7 +5541,9 @@ struct cputbl CPUFUNC(op_smalltbl_2)[] = {
 { CPUFUNC(op_eff8_0), 0, 61432 }, /* BFINS.L #<data>.W,(xxx).W */
 { CPUFUNC(op_eff9_0), 0, 61433 }, /* BFINS.L #<data>.W,(xxx).L */
 { 0, 0, 0 }};
-struct cputbl CPUFUNC(op_smalltbl_3)[] = {
+#endif
+#ifndef CPUFUNC_VARIANT
+CPUTBL_CONST struct cputbl CPUFUNC(op_smalltbl_3)[] = {
 { CPUFUNC(op_0_0), 0, 0 }, /* OR.B #<data>.B,Dn */
 { CPUFUNC(op_10_0), 0, 16 }, /* OR.B #<data>.B,(An) */
 { CPUFUNC(op_18_0), 0, 24 }, /* OR.B #<data>.B,(An)+ */
@@ -7130,7 +7141,9 @@ struct cputbl CPUFUNC(op_smalltbl_3)[] = {
 { CPUFUNC(op_e7f8_0), 0, 59384 }, /* ROLW.W (xxx).W */
 { CPUFUNC(op_e7f9_0), 0, 59385 }, /* ROLW.W (xxx).L */
 { 0, 0, 0 }};
-struct cputbl CPUFUNC(op_smalltbl_4)[] = {
+#endif
+#ifndef CPUFUNC_VARIANT
+CPUTBL_CONST struct cputbl CPUFUNC(op_smalltbl_4)[] = {
 { CPUFUNC(op_0_0), 0, 0 }, /* OR.B #<data>.B,Dn */
 { CPUFUNC(op_10_0), 0, 16 }, /* OR.B #<data>.B,(An) */
 { CPUFUNC(op_18_0), 0, 24 }, /* OR.B #<data>.B,(An)+ */
@@ -8718,3 +8731,4 @@ struct cputbl CPUFUNC(op_smalltbl_4)[] = {
 { CPUFUNC(op_e7f8_0), 0, 59384 }, /* ROLW.W (xxx).W */
 { CPUFUNC(op_e7f9_0), 0, 59385 }, /* ROLW.W (xxx).L */
 { 0, 0, 0 }};
+#endif
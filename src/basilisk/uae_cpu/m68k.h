@@ -23,6 +23,14 @@
 #ifndef M68K_FLAGS_H
 #define M68K_FLAGS_H
 
+#ifndef USE_LAZY_FLAGS
+#define USE_LAZY_FLAGS 0
+#endif
+
+#if USE_LAZY_FLAGS && defined(OPTIMIZED_FLAGS)
+#error "USE_LAZY_FLAGS is only implemented for the generic flag representation"
+#endif
+
 #ifdef OPTIMIZED_FLAGS
 
 #if defined(X86_ASSEMBLY) || defined(X86_64_ASSEMBLY) || defined(MSVC_INTRINSICS)
@@ -1019,6 +1027,12 @@ struct flag_struct {
     unsigned int n;
     unsigned int v; 
     unsigned int x;
+#if USE_LAZY_FLAGS
+    uae_u32 lazy;	/* FLAGS_LAZY_* kind | size, 0 if c/z/n/v are valid */
+    uae_u32 lsrc;
+    uae_u32 ldst;
+    uae_u32 lres;
+#endif
 };
 
 extern struct flag_struct regflags;
@@ -1050,6 +1064,36 @@ extern struct flag_struct regflags;
 
 #define COPY_CARRY (SET_XFLG (GET_CFLG))
 
+#if USE_LAZY_FLAGS
+/* Lazy condition codes (gencpu --lazy-flags).  Logical, ADD, SUB and CMP
+   handlers only record the operation, its size and operands; C, Z, N and V
+   are computed by m68k_flags_materialize() when a later handler, MakeSR()
+   or an exception actually reads them.  X is always kept up to date.  */
+#define FLAGS_LAZY_B		0
+#define FLAGS_LAZY_W		1
+#define FLAGS_LAZY_L		2
+#define FLAGS_LAZY_LOGICAL	0x04
+#define FLAGS_LAZY_ADD		0x08
+#define FLAGS_LAZY_SUB		0x0c	/* also CMP, which only differs in X */
+
+#define FLAGS_SET_LAZY(k, s, d, r) do { \
+ regflags.lsrc = (s); \
+ regflags.ldst = (d); \
+ regflags.lres = (r); \
+ regflags.lazy = (k); \
+} while (0)
+
+#define FLAGS_SET_LAZY_RES(k, r) do { \
+ regflags.lres = (r); \
+ regflags.lazy = (k); \
+} while (0)
+
+extern void m68k_flags_materialize (void);
+
+#define FLAGS_SYNC() do { if (regflags.lazy) m68k_flags_materialize (); } while (0)
+#define FLAGS_DROP_LAZY() (regflags.lazy = 0)
+#endif
+
 static __inline__ int cctrue(const int cc)
 {
     switch(cc){
@@ -1075,4 +1119,10 @@ static __inline__ int cctrue(const int cc)
 
 #endif /* OPTIMIZED_FLAGS */
 
+/* Without lazy flags the condition codes are always up to date */
+#ifndef FLAGS_SYNC
+#define FLAGS_SYNC() do { } while (0)
+#define FLAGS_DROP_LAZY() do { } while (0)
+#endif
+
 #endif /* M68K_FLAGS_H */
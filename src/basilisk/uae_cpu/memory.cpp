@@ -22,11 +22,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <esp_attr.h>  // For DRAM_ATTR
 
 #include "sysdeps.h"
 
 #ifdef ARDUINO
 #include <esp_heap_caps.h>
+#include "mem_plan_esp32.h"
+#include "perf_esp32.h"
 #endif
 
 #include "cpu_emulation.h"
@@ -43,8 +47,14 @@
 static bool illegal_mem = false;
 
 #ifdef SAVE_MEMORY_BANKS
-// 256KB pointer array - dynamically allocated in PSRAM on ESP32
-addrbank **mem_banks = NULL;
+// Sub-tables are shared between top-level entries until one of them is
+// changed (copy on write). 32-bit mode needs four at most (dummy, RAM, ROM,
+// frame buffer); 24-bit mode aliases all 256 entries to the low 16MB.
+#define MEM_BANK_SUBTABLES 8
+
+addrbank **mem_bank_top[256];
+static addrbank *mem_bank_sub[MEM_BANK_SUBTABLES][256];
+static uae_u16 mem_bank_refs[MEM_BANK_SUBTABLES];	// Top-level entries using each sub-table
 #else
 addrbank mem_banks[65536];
 #endif
@@ -84,6 +94,13 @@ void byteput (uaecptr addr, uae_u32 b)
 
 /* A dummy bank that only contains zeros */
 
+#ifdef ARDUINO
+static perf_counter *perf_unmapped = NULL;	// "mem.unmapped", accesses to the dummy bank
+#define DUMMY_ACCESS() PerfAdd(perf_unmapped, 1)
+#else
+#define DUMMY_ACCESS() do { } while (0)
+#endif
+
 static uae_u32 REGPARAM2 dummy_lget (uaecptr) REGPARAM;
 static uae_u32 REGPARAM2 dummy_wget (uaecptr) REGPARAM;
 static uae_u32 REGPARAM2 dummy_bget (uaecptr) REGPARAM;
@@ -93,6 +110,7 @@ static void REGPARAM2 dummy_bput (uaecptr, uae_u32) REGPARAM;
 
 uae_u32 REGPARAM2 dummy_lget (uaecptr addr)
 {
+    DUMMY_ACCESS();
     if (illegal_mem)
 	write_log ("Illegal lget at %08x\n", addr);
 
@@ -101,6 +119,7 @@ uae_u32 REGPARAM2 dummy_lget (uaecptr addr)
 
 uae_u32 REGPARAM2 dummy_wget (uaecptr addr)
 {
+    DUMMY_ACCESS();
     if (illegal_mem)
 	write_log ("Illegal wget at %08x\n", addr);
 
@@ -109,6 +128,7 @@ uae_u32 REGPARAM2 dummy_wget (uaecptr addr)
 
 uae_u32 REGPARAM2 dummy_bget (uaecptr addr)
 {
+    DUMMY_ACCESS();
     if (illegal_mem)
 	write_log ("Illegal bget at %08x\n", addr);
 
@@ -117,16 +137,19 @@ uae_u32 REGPARAM2 dummy_bget (uaecptr addr)
 
 void REGPARAM2 dummy_lput (uaecptr addr, uae_u32 l)
 {
+    DUMMY_ACCESS();
     if (illegal_mem)
 	write_log ("Illegal lput at %08x\n", addr);
 }
 void REGPARAM2 dummy_wput (uaecptr addr, uae_u32 w)
 {
+    DUMMY_ACCESS();
     if (illegal_mem)
 	write_log ("Illegal wput at %08x\n", addr);
 }
 void REGPARAM2 dummy_bput (uaecptr addr, uae_u32 b)
 {
+    DUMMY_ACCESS();
     if (illegal_mem)
 	write_log ("Illegal bput at %08x\n", addr);
 }
@@ -143,6 +166,192 @@ static uae_u8 *REGPARAM2 ram_xlate(uaecptr addr) REGPARAM;
 
 static uintptr RAMBaseDiff;	// RAMBaseHost - RAMBaseMac
 
+#if LOWMEM_SRAM_SIZE
+DRAM_ATTR uae_u8 LowMemMirror[LOWMEM_SRAM_SIZE + 4] __attribute__((aligned(4)));
+bool lowmem_stale = true;
+
+// Copy the low-memory range from RAMBaseHost again
+void LowMemSync(void)
+{
+	memcpy(LowMemMirror, RAMBaseHost, RAMSize < LOWMEM_SRAM_SIZE ? RAMSize : LOWMEM_SRAM_SIZE);
+	lowmem_stale = false;
+}
+#endif
+
+#if RAM_HOT_BANKS
+#define RAM_HOT_COPY_SIZE	(0x10000 + RAM_HOT_SLACK)
+#define RAM_HOT_PERIOD		8192	// Samples between promotions
+
+DRAM_ATTR uae_u8 *ram_hot_get[RAM_HOT_TABLE_BANKS];
+DRAM_ATTR uae_u8 *ram_hot_put[RAM_HOT_TABLE_BANKS];
+uaecptr ram_hot_top = 0;
+uaecptr ram_hot_stale = ~(uaecptr)0;
+
+static uae_u8 *ram_hot_copy[RAM_HOT_TABLE_BANKS];	// Copy of each bank, NULL = not copied
+static uae_u8 *ram_hot_buffers[RAM_HOT_BANKS];		// Copies that could be allocated
+static int ram_hot_nbuffers = -1;					// -1 = not allocated yet
+static uae_u32 ram_hot_count[RAM_HOT_TABLE_BANKS];	// Samples per bank, halved every period
+static uae_u32 ram_hot_samples = 0;
+#ifdef ARDUINO
+static perf_counter *perf_hot_swaps = NULL;			// "mem.hot_swaps", banks copied in
+#endif
+
+// Banks of Mac RAM
+static inline int ram_hot_banks(void)
+{
+	return (RAMSize + 0xffff) >> 16;
+}
+
+// Set the tables of bank b and of the banks next to it, whose edge stores
+// reach its copy
+static void ram_hot_update(int b)
+{
+	// The banks on both sides: stores at their near ends reach this copy
+	for (int i = b > 0 ? b - 1 : 0; i <= b + 1 && i < RAM_HOT_TABLE_BANKS; i++) {
+		uintptr base = (uintptr)i << 16;
+		if (ram_hot_copy[i]) {
+			ram_hot_get[i] = (uae_u8 *)((uintptr)ram_hot_copy[i] - base);
+			ram_hot_put[i] = ram_hot_get[i];
+		} else {
+			ram_hot_get[i] = RAMBaseHost;
+			bool edge = (i > 0 && ram_hot_copy[i - 1]) ||
+			            (i + 1 < RAM_HOT_TABLE_BANKS && ram_hot_copy[i + 1]);
+			ram_hot_put[i] = edge ? RAM_HOT_EDGE : NULL;
+		}
+	}
+	ram_hot_top = 0;
+	for (int i = 0; i < RAM_HOT_TABLE_BANKS; i++)
+		if (ram_hot_copy[i])
+			ram_hot_top = ((uaecptr)i << 16) + RAM_HOT_COPY_SIZE;
+}
+
+// Fill a copy from RAMBaseHost
+static void ram_hot_fill(int b)
+{
+	uae_u32 start = (uae_u32)b << 16;
+	uae_u32 size = RAMSize - start < RAM_HOT_COPY_SIZE ? RAMSize - start : RAM_HOT_COPY_SIZE;
+	memcpy(ram_hot_copy[b], RAMBaseHost + start, size);
+}
+
+// Write to the copies byte by byte, including the slack of the bank below
+void RamHotPut(uaecptr addr, uae_u32 size, uae_u32 value)
+{
+	for (uae_u32 i = 0; i < size; i++) {
+		uaecptr a = addr + i;
+		uae_u8 byte = value >> (8 * (size - 1 - i));
+		int b = a >> 16;
+		uae_u32 offset = a & 0xffff;
+		if (b < RAM_HOT_TABLE_BANKS && ram_hot_copy[b])
+			ram_hot_copy[b][offset] = byte;
+		if (offset < RAM_HOT_SLACK && b > 0 && b <= RAM_HOT_TABLE_BANKS && ram_hot_copy[b - 1])
+			ram_hot_copy[b - 1][0x10000 + offset] = byte;
+	}
+}
+
+// Refill the copies that host code may have written past ram_hot_stale
+void RamHotSync(void)
+{
+	for (int b = 0; b < RAM_HOT_TABLE_BANKS; b++)
+		if (ram_hot_copy[b] && ((uaecptr)b << 16) + RAM_HOT_COPY_SIZE > ram_hot_stale)
+			ram_hot_fill(b);
+	ram_hot_stale = ~(uaecptr)0;
+}
+
+// Copy in the most sampled banks, replacing ones sampled clearly less
+static void ram_hot_promote(void)
+{
+	int n = ram_hot_banks();
+	for (int k = 0; k < ram_hot_nbuffers; k++) {
+		// Hottest bank without a copy, and the coldest with one
+		int hot = -1, cold = -1;
+		for (int b = 0; b < n; b++) {
+			if (ram_hot_copy[b]) {
+				if (cold < 0 || ram_hot_count[b] < ram_hot_count[cold])
+					cold = b;
+			} else if (hot < 0 || ram_hot_count[b] > ram_hot_count[hot])
+				hot = b;
+		}
+		if (hot < 0 || ram_hot_count[hot] == 0)
+			break;
+
+		uae_u8 *buffer = NULL;
+		for (int i = 0; i < ram_hot_nbuffers; i++) {
+			bool used = false;
+			for (int b = 0; b < n && !used; b++)
+				used = ram_hot_copy[b] == ram_hot_buffers[i];
+			if (!used) {
+				buffer = ram_hot_buffers[i];
+				break;
+			}
+		}
+		if (buffer == NULL) {
+			// Hysteresis: only swap for a bank a quarter hotter
+			if (ram_hot_count[hot] <= ram_hot_count[cold] + (ram_hot_count[cold] >> 2))
+				break;
+			buffer = ram_hot_copy[cold];
+			ram_hot_copy[cold] = NULL;
+			ram_hot_update(cold);
+		}
+		ram_hot_copy[hot] = buffer;
+		ram_hot_fill(hot);
+		ram_hot_update(hot);
+#ifdef ARDUINO
+		PerfAdd(perf_hot_swaps, 1);
+#endif
+	}
+
+	for (int b = 0; b < n; b++)
+		ram_hot_count[b] >>= 1;
+}
+
+// Count the bank one address register points into, a0-a7 in turn (batch end, CPU thread)
+void RamHotSample(void)
+{
+	uaecptr a = m68k_areg(regs, ram_hot_samples & 7);
+	if (a < RAMSize)
+		ram_hot_count[a >> 16]++;
+	if (++ram_hot_samples >= RAM_HOT_PERIOD) {
+		ram_hot_samples = 0;
+		ram_hot_promote();
+	}
+}
+
+// Drop all copies (start of the 68k, new memory layout)
+void RamCopyReset(void)
+{
+	if (ram_hot_nbuffers < 0) {
+		ram_hot_nbuffers = 0;
+		for (int i = 0; i < RAM_HOT_BANKS; i++) {
+#ifdef ARDUINO
+			ram_hot_buffers[i] = (uae_u8 *)MemPlanAlloc("ramhot", RAM_HOT_COPY_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#else
+			ram_hot_buffers[i] = (uae_u8 *)malloc(RAM_HOT_COPY_SIZE);
+#endif
+			if (ram_hot_buffers[i] == NULL)
+				break;
+			ram_hot_nbuffers++;
+		}
+		write_log("Hot RAM banks: %d of %d copies in internal SRAM\n", ram_hot_nbuffers, RAM_HOT_BANKS);
+#ifdef ARDUINO
+		perf_hot_swaps = PerfCounter("mem.hot_swaps");
+#endif
+	}
+	if (RAMSize > (RAM_HOT_TABLE_BANKS << 16)) {
+		write_log("Hot RAM banks: Mac RAM limited to %d MB\n", RAM_HOT_TABLE_BANKS >> 4);
+		RAMSize = RAM_HOT_TABLE_BANKS << 16;
+	}
+	for (int b = 0; b < RAM_HOT_TABLE_BANKS; b++) {
+		ram_hot_copy[b] = NULL;
+		ram_hot_count[b] = 0;
+		ram_hot_get[b] = RAMBaseHost;
+		ram_hot_put[b] = NULL;
+	}
+	ram_hot_top = 0;
+	ram_hot_stale = ~(uaecptr)0;
+	ram_hot_samples = 0;
+}
+#endif
+
 uae_u32 REGPARAM2 ram_lget(uaecptr addr)
 {
     uae_u32 *m;
@@ -166,19 +375,25 @@ void REGPARAM2 ram_lput(uaecptr addr, uae_u32 l)
 {
     uae_u32 *m;
     m = (uae_u32 *)(RAMBaseDiff + addr);
+    PREDECODE_CHECK_WRITE(addr, 4);
     do_put_mem_long(m, l);
+    RAM_COPY_PUT_LONG(addr, l);
 }
 
 void REGPARAM2 ram_wput(uaecptr addr, uae_u32 w)
 {
     uae_u16 *m;
     m = (uae_u16 *)(RAMBaseDiff + addr);
+    PREDECODE_CHECK_WRITE(addr, 2);
     do_put_mem_word(m, w);
+    RAM_COPY_PUT_WORD(addr, w);
 }
 
 void REGPARAM2 ram_bput(uaecptr addr, uae_u32 b)
 {
+	PREDECODE_CHECK_WRITE(addr, 1);
 	*(uae_u8 *)(RAMBaseDiff + addr) = b;
+	RAM_COPY_PUT_BYTE(addr, b);
 }
 
 uae_u8 *REGPARAM2 ram_xlate(uaecptr addr)
@@ -219,19 +434,25 @@ void REGPARAM2 ram24_lput(uaecptr addr, uae_u32 l)
 {
     uae_u32 *m;
     m = (uae_u32 *)(RAMBaseDiff + (addr & 0xffffff));
+    PREDECODE_CHECK_WRITE(addr & 0xffffff, 4);
     do_put_mem_long(m, l);
+    RAM_COPY_PUT_LONG(addr & 0xffffff, l);
 }
 
 void REGPARAM2 ram24_wput(uaecptr addr, uae_u32 w)
 {
     uae_u16 *m;
     m = (uae_u16 *)(RAMBaseDiff + (addr & 0xffffff));
+    PREDECODE_CHECK_WRITE(addr & 0xffffff, 2);
     do_put_mem_word(m, w);
+    RAM_COPY_PUT_WORD(addr & 0xffffff, w);
 }
 
 void REGPARAM2 ram24_bput(uaecptr addr, uae_u32 b)
 {
+	PREDECODE_CHECK_WRITE(addr & 0xffffff, 1);
 	*(uae_u8 *)(RAMBaseDiff + (addr & 0xffffff)) = b;
+	RAM_COPY_PUT_BYTE(addr & 0xffffff, b);
 }
 
 uae_u8 *REGPARAM2 ram24_xlate(uaecptr addr)
@@ -375,7 +596,7 @@ void REGPARAM2 frame_direct_lput(uaecptr addr, uae_u32 l)
     m = (uae_u32 *)(FrameBaseDiff + addr);
     do_put_mem_long(m, l);
     // Mark dirty tiles for write-time tracking (offset from frame buffer base)
-    VideoMarkDirtyRange(addr - MacFrameBaseMac, 4);
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 4);
 }
 
 void REGPARAM2 frame_direct_wput(uaecptr addr, uae_u32 w)
@@ -384,14 +605,14 @@ void REGPARAM2 frame_direct_wput(uaecptr addr, uae_u32 w)
     m = (uae_u16 *)(FrameBaseDiff + addr);
     do_put_mem_word(m, w);
     // Mark dirty tiles for write-time tracking
-    VideoMarkDirtyRange(addr - MacFrameBaseMac, 2);
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 2);
 }
 
 void REGPARAM2 frame_direct_bput(uaecptr addr, uae_u32 b)
 {
     *(uae_u8 *)(FrameBaseDiff + addr) = b;
     // Mark dirty tile for write-time tracking
-    VideoMarkDirtyOffset(addr - MacFrameBaseMac);
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 1);
 }
 
 uae_u32 REGPARAM2 frame_host_555_lget(uaecptr addr)
@@ -414,6 +635,7 @@ void REGPARAM2 frame_host_555_lput(uaecptr addr, uae_u32 l)
     uae_u32 *m;
     m = (uae_u32 *)(FrameBaseDiff + addr);
     *m = swap_words(l);
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 4);
 }
 
 void REGPARAM2 frame_host_555_wput(uaecptr addr, uae_u32 w)
@@ -421,6 +643,7 @@ void REGPARAM2 frame_host_555_wput(uaecptr addr, uae_u32 w)
     uae_u16 *m;
     m = (uae_u16 *)(FrameBaseDiff + addr);
     *m = w;
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 2);
 }
 
 uae_u32 REGPARAM2 frame_host_565_lget(uaecptr addr)
@@ -446,6 +669,8 @@ void REGPARAM2 frame_host_565_lput(uaecptr addr, uae_u32 l)
     m = (uae_u32 *)(FrameBaseDiff + addr);
     l = (l & 0x001f001f) | ((l << 1) & 0xffc0ffc0);
     *m = swap_words(l);
+    // Mark dirty tiles for write-time tracking (16-bit direct colour)
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 4);
 }
 
 void REGPARAM2 frame_host_565_wput(uaecptr addr, uae_u32 w)
@@ -453,6 +678,7 @@ void REGPARAM2 frame_host_565_wput(uaecptr addr, uae_u32 w)
     uae_u16 *m;
     m = (uae_u16 *)(FrameBaseDiff + addr);
     *m = (w & 0x1f) | ((w << 1) & 0xffc0);
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 2);
 }
 
 uae_u32 REGPARAM2 frame_host_888_lget(uaecptr addr)
@@ -467,6 +693,7 @@ void REGPARAM2 frame_host_888_lput(uaecptr addr, uae_u32 l)
     uae_u32 *m;
     m = (uae_u32 *)(MacFrameBaseHost + addr - MacFrameBaseMac);
     *m = l;
+    VIDEO_MARK_DIRTY(addr - MacFrameBaseMac, 4);
 }
 
 uae_u8 *REGPARAM2 frame_xlate(uaecptr addr)
@@ -492,11 +719,12 @@ void REGPARAM2 fram24_lput(uaecptr addr, uae_u32 l)
 	fm = (uae_u32 *)(MacFrameBaseHost + page_off - 0xa700);
 	do_put_mem_long(fm, l);
 	// Mark dirty tiles for write-time tracking (24-bit addressing)
-	VideoMarkDirtyRange(page_off - 0xa700, 4);
+	VIDEO_MARK_DIRTY(page_off - 0xa700, 4);
     }
 
     uae_u32 *m;
     m = (uae_u32 *)(RAMBaseDiff + (addr & 0xffffff));
+    PREDECODE_CHECK_WRITE(addr & 0xffffff, 4);
     do_put_mem_long(m, l);
 }
 
@@ -508,11 +736,12 @@ void REGPARAM2 fram24_wput(uaecptr addr, uae_u32 w)
 	fm = (uae_u16 *)(MacFrameBaseHost + page_off - 0xa700);
 	do_put_mem_word(fm, w);
 	// Mark dirty tiles for write-time tracking
-	VideoMarkDirtyRange(page_off - 0xa700, 2);
+	VIDEO_MARK_DIRTY(page_off - 0xa700, 2);
     }
 
     uae_u16 *m;
     m = (uae_u16 *)(RAMBaseDiff + (addr & 0xffffff));
+    PREDECODE_CHECK_WRITE(addr & 0xffffff, 2);
     do_put_mem_word(m, w);
 }
 
@@ -522,9 +751,10 @@ void REGPARAM2 fram24_bput(uaecptr addr, uae_u32 b)
     if (0xa700 <= page_off && page_off < 0xfc80) {
         *(uae_u8 *)(MacFrameBaseHost + page_off - 0xa700) = b;
         // Mark dirty tile for write-time tracking
-        VideoMarkDirtyOffset(page_off - 0xa700);
+        VIDEO_MARK_DIRTY(page_off - 0xa700, 1);
     }
 
+    PREDECODE_CHECK_WRITE(addr & 0xffffff, 1);
     *(uae_u8 *)(RAMBaseDiff + (addr & 0xffffff)) = b;
 }
 
@@ -598,39 +828,74 @@ addrbank fram24_bank = {
     ram24_xlate
 };
 
-void memory_init(void)
+#ifdef SAVE_MEMORY_BANKS
+/*
+ *  Bank map maintenance
+ */
+
+static inline int mem_bank_sub_index(addrbank **sub)
 {
-#if defined(ARDUINO) && defined(SAVE_MEMORY_BANKS)
-	// Allocate 256KB memory bank pointer array
-	// This is accessed on EVERY memory operation (multiple times per instruction)
-	// Gets PRIORITY for internal SRAM since it's the hottest path
-	if (mem_banks == NULL) {
-		// Report available internal SRAM before allocation
-		size_t free_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-		size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
-		write_log("mem_banks allocation: need 256KB, internal SRAM has %d bytes free (largest: %d)\n",
-		          free_before, largest_block);
-		
-		// Try PSRAM first - cpufunctbl gets priority for internal SRAM
-		// (cpufunctbl dispatch is per-instruction, mem_banks is per-memory-access but
-		// memory functions themselves do the heavy lifting)
-		mem_banks = (addrbank **)heap_caps_malloc(65536 * sizeof(addrbank *), MALLOC_CAP_SPIRAM);
-		if (mem_banks != NULL) {
-			write_log("Allocated mem_banks (256KB) in PSRAM (cpufunctbl has SRAM priority)\n");
-		} else {
-			// Fall back to internal SRAM if PSRAM fails
-			mem_banks = (addrbank **)heap_caps_malloc(65536 * sizeof(addrbank *), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
-			if (mem_banks == NULL) {
-				write_log("ERROR: Failed to allocate mem_banks!\n");
-				return;
-			}
-			write_log("Allocated mem_banks (256KB) in internal SRAM (fallback)\n");
+	return (sub - &mem_bank_sub[0][0]) / 256;
+}
+
+static void mem_banks_reset(addrbank *bank)
+{
+	for (int i = 0; i < 256; i++)
+		mem_bank_sub[0][i] = bank;
+	for (int i = 0; i < 256; i++)
+		mem_bank_top[i] = mem_bank_sub[0];
+	memset(mem_bank_refs, 0, sizeof(mem_bank_refs));
+	mem_bank_refs[0] = 256;
+}
+
+// Point top-level entry 'top' at sub-table 'sub'
+static void mem_bank_set_top(int top, int sub)
+{
+	mem_bank_refs[mem_bank_sub_index(mem_bank_top[top])]--;
+	mem_bank_refs[sub]++;
+	mem_bank_top[top] = mem_bank_sub[sub];
+}
+
+void put_mem_bank_index(int bnr, addrbank *b)
+{
+	int top = (bnr >> 8) & 0xff;
+	addrbank **sub = mem_bank_top[top];
+	if (sub[bnr & 0xff] == b)
+		return;
+
+	// Shared sub-table: give this top-level entry a private copy first
+	if (mem_bank_refs[mem_bank_sub_index(sub)] > 1) {
+		int i;
+		for (i = 0; i < MEM_BANK_SUBTABLES; i++)
+			if (mem_bank_refs[i] == 0)
+				break;
+		if (i == MEM_BANK_SUBTABLES) {
+			write_log("ERROR: out of memory bank sub-tables, bank %04x not mapped\n", bnr);
+			return;
 		}
+		memcpy(mem_bank_sub[i], sub, sizeof(mem_bank_sub[i]));
+		mem_bank_set_top(top, i);
+		sub = mem_bank_sub[i];
 	}
+	sub[bnr & 0xff] = b;
+}
 #endif
 
+void memory_init(void)
+{
+#ifdef ARDUINO
+	if (perf_unmapped == NULL)
+		perf_unmapped = PerfCounter("mem.unmapped");
+#endif
+#if RAM_HOT_BANKS
+	RamCopyReset();
+#endif
+#ifdef SAVE_MEMORY_BANKS
+	mem_banks_reset(&dummy_bank);
+#else
 	for(long i=0; i<65536; i++)
 		put_mem_bank(i<<16, &dummy_bank);
+#endif
 
 	// Limit RAM size to not overlap ROM
 	uint32 ram_size = RAMSize > ROMBaseMac ? ROMBaseMac : RAMSize;
@@ -678,10 +943,21 @@ void map_banks(addrbank *bank, int start, int size)
 	    put_mem_bank (bnr << 16, bank);
 	return;
     }
+#ifdef SAVE_MEMORY_BANKS
+    // Map the low 16MB once; in 24-bit mode every top-level entry mirrors it
+    for (bnr = start; bnr < start+size; bnr++)
+	put_mem_bank(bnr << 16, bank);
+    if (TwentyFourBitAddressing) {
+	int sub = mem_bank_sub_index(mem_bank_top[0]);
+	for (hioffs = 1; hioffs < 0x100; hioffs++)
+	    mem_bank_set_top(hioffs, sub);
+    }
+#else
     if (TwentyFourBitAddressing) endhioffs = 0x10000;
     for (hioffs = 0; hioffs < endhioffs; hioffs += 0x100)
 	for (bnr = start; bnr < start+size; bnr++)
 	    put_mem_bank((bnr + hioffs) << 16, bank);
+#endif
 }
 
 /*
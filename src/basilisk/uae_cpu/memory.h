@@ -72,10 +72,16 @@ extern uae_u8 *REGPARAM2 default_xlate(uaecptr addr) REGPARAM;
 #define bankindex(addr) (((uaecptr)(addr)) >> 16)
 
 #ifdef SAVE_MEMORY_BANKS
-// Note: mem_banks is dynamically allocated in PSRAM on ESP32
-extern addrbank **mem_banks;
-#define get_mem_bank(addr) (*mem_banks[bankindex(addr)])
-#define put_mem_bank(addr, b) (mem_banks[bankindex(addr)] = (b))
+/*
+ * Two-level bank map: the top address byte selects a 256-entry sub-table of
+ * bank pointers, the next byte the 64KB bank in it. Top-level entries that
+ * cover a uniform 16MB region (or a 24-bit mirror) share one sub-table, so
+ * the whole map is a few KB and lives in internal SRAM (see memory.cpp).
+ */
+extern addrbank **mem_bank_top[256];
+extern void put_mem_bank_index(int bnr, addrbank *b);
+#define get_mem_bank(addr) (*mem_bank_top[((uaecptr)(addr)) >> 24][(((uaecptr)(addr)) >> 16) & 0xff])
+#define put_mem_bank(addr, b) put_mem_bank_index(bankindex(addr), (b))
 #else
 extern addrbank mem_banks[65536];
 #define get_mem_bank(addr) (mem_banks[bankindex(addr)])
@@ -85,6 +91,110 @@ extern addrbank mem_banks[65536];
 extern void memory_init(void);
 extern void map_banks(addrbank *bank, int first, int count);
 
+/*
+ * Copy of the first LOWMEM_SRAM_SIZE bytes of Mac RAM (low-memory globals,
+ * trap tables) in internal SRAM, 0 = none. RAMBaseHost stays the real
+ * one: the 68k reads whole accesses below the end from the copy, and its
+ * writes go to both. Host code that writes there through a pointer marks
+ * the copy stale (ram_copy_host_write()); it is refreshed before the 68k
+ * runs again (ram_copy_refresh()).
+ */
+#ifndef LOWMEM_SRAM_SIZE
+#define LOWMEM_SRAM_SIZE 0
+#endif
+
+/*
+ * The same for up to RAM_HOT_BANKS of the 64 KB banks of Mac RAM, 0 =
+ * none: the banks the 68k's address registers pointed into most often at
+ * the ends of its batches (RamHotSample()) are copied to whatever internal
+ * SRAM is left, and swapped as that changes. Each copy has the first bytes
+ * of the next bank behind it, for reads that cross the end.
+ */
+#ifndef RAM_HOT_BANKS
+#define RAM_HOT_BANKS 0
+#endif
+
+#if LOWMEM_SRAM_SIZE && RAM_HOT_BANKS
+#error "LOWMEM_SRAM_SIZE and RAM_HOT_BANKS are alternatives"
+#endif
+
+#if LOWMEM_SRAM_SIZE
+extern uae_u8 LowMemMirror[LOWMEM_SRAM_SIZE + 4];	// + 4 for writes that cross the end
+extern bool lowmem_stale;
+extern void LowMemSync(void);
+
+#define LOWMEM_READ(addr, size)	((uae_u32)(addr) <= LOWMEM_SRAM_SIZE - (size))
+#define LOWMEM_WRITE(addr)		((uae_u32)(addr) < LOWMEM_SRAM_SIZE)
+#define RAM_READ_BASE(addr, size)	(LOWMEM_READ(addr, size) ? LowMemMirror : RAMBaseHost)
+#define RAM_COPY_PUT_LONG(addr, l)	do { if (LOWMEM_WRITE(addr)) do_put_mem_long((uae_u32 *)(LowMemMirror + (addr)), l); } while (0)
+#define RAM_COPY_PUT_WORD(addr, w)	do { if (LOWMEM_WRITE(addr)) do_put_mem_word((uae_u16 *)(LowMemMirror + (addr)), w); } while (0)
+#define RAM_COPY_PUT_BYTE(addr, b)	do { if (LOWMEM_WRITE(addr)) LowMemMirror[addr] = (b); } while (0)
+#define RAM_COPY_NONE(addr, size)	(!LOWMEM_WRITE(addr))
+
+static inline void ram_copy_host_write(uaecptr addr) {
+    if (LOWMEM_WRITE(addr))
+        lowmem_stale = true;
+}
+
+static inline void ram_copy_refresh(void) {
+    if (lowmem_stale)
+        LowMemSync();
+}
+
+static inline void RamCopyReset(void) { LowMemSync(); }
+#elif RAM_HOT_BANKS
+#define RAM_HOT_TABLE_BANKS	512				// Mac RAM covered (32 MB)
+#define RAM_HOT_SLACK		4				// Bytes of the next bank behind each copy
+#define RAM_HOT_EDGE		((uae_u8 *)1)	// ram_hot_put[]: not copied, but a bank next to it is
+
+extern uae_u8 *ram_hot_get[RAM_HOT_TABLE_BANKS];	// RAMBaseHost, or the bank's copy minus its address
+extern uae_u8 *ram_hot_put[RAM_HOT_TABLE_BANKS];	// NULL, the copy minus the address, or RAM_HOT_EDGE
+extern uaecptr ram_hot_top;			// Host writes below this may reach a copy
+extern uaecptr ram_hot_stale;			// Copies above this are stale, ~0 = none
+extern void RamHotPut(uaecptr addr, uae_u32 size, uae_u32 value);
+extern void RamHotSync(void);
+extern void RamHotSample(void);
+extern void RamCopyReset(void);
+
+// Write through to the copy; the out-of-line path covers stores within
+// RAM_HOT_SLACK of either end of a bank, which may reach the slack of the
+// copy below or run into the copy above
+#define RAM_HOT_PUT(addr, size, value, store) do { \
+	uae_u8 *copy_ = ram_hot_put[(uae_u32)(addr) >> 16]; \
+	if (copy_ != NULL) { \
+		if ((((addr) + RAM_HOT_SLACK) & 0xffff) < 2 * RAM_HOT_SLACK) \
+			RamHotPut(addr, size, value); \
+		else if (copy_ != RAM_HOT_EDGE) \
+			store; \
+	} \
+} while (0)
+
+#define RAM_READ_BASE(addr, size)	(ram_hot_get[(uae_u32)(addr) >> 16])
+#define RAM_COPY_PUT_LONG(addr, l)	RAM_HOT_PUT(addr, 4, l, do_put_mem_long((uae_u32 *)(copy_ + (addr)), l))
+#define RAM_COPY_PUT_WORD(addr, w)	RAM_HOT_PUT(addr, 2, w, do_put_mem_word((uae_u16 *)(copy_ + (addr)), w))
+#define RAM_COPY_PUT_BYTE(addr, b)	RAM_HOT_PUT(addr, 1, b, copy_[addr] = (b))
+#define RAM_COPY_NONE(addr, size)	(ram_hot_put[(uae_u32)(addr) >> 16] == NULL && ram_hot_put[(uae_u32)((addr) + (size) - 1) >> 16] == NULL)
+
+static inline void ram_copy_host_write(uaecptr addr) {
+    if (addr < ram_hot_top && addr < ram_hot_stale)
+        ram_hot_stale = addr;
+}
+
+static inline void ram_copy_refresh(void) {
+    if (ram_hot_stale != ~(uaecptr)0)
+        RamHotSync();
+}
+#else
+#define RAM_READ_BASE(addr, size)	RAMBaseHost
+#define RAM_COPY_PUT_LONG(addr, l)	do { } while (0)
+#define RAM_COPY_PUT_WORD(addr, w)	do { } while (0)
+#define RAM_COPY_PUT_BYTE(addr, b)	do { } while (0)
+#define RAM_COPY_NONE(addr, size)	1
+static inline void ram_copy_host_write(uaecptr) {}
+static inline void ram_copy_refresh(void) {}
+static inline void RamCopyReset(void) {}
+#endif
+
 #ifndef NO_INLINE_MEMORY_ACCESS
 
 /*
@@ -119,17 +229,66 @@ extern uint32 ROMBaseMac;
 extern uint8 *ROMBaseHost;
 extern uint32 ROMSize;
 
+#include "predecode.h"
+
+/*
+ * Bounds used by the fast paths. The generic handlers read them from the
+ * globals; the copies in generated/cpuemu_ram*.cpp define MEM_FIXED_RAMSIZE
+ * so that RAM size and ROM location become immediates. Those copies are only
+ * bound (see build_cpufunctbl()) when the runtime layout matches.
+ */
+#ifndef USE_FIXED_RAM_ACCESSORS
+#define USE_FIXED_RAM_ACCESSORS 0
+#endif
+
+#define FIXED_ROM_BASE_MAC	0x40800000	// ROM_VERSION_32 (Quadra 650 etc.)
+#define FIXED_ROM_SIZE		0x00100000
+
+#ifndef USE_24BIT_ACCESSORS
+#define USE_24BIT_ACCESSORS 0
+#endif
+
+#ifdef MEM_ADDR_24BIT
+/* generated/cpuemu_a24.cpp: 24-bit addressing ignores the top byte, so it
+   is masked off once and the mirrors hit the same fast paths. The last RAM
+   bank is left to fram24_bank, as memory_init() maps it */
+#define MEM_ADDR(addr)	((addr) & 0x00ffffff)
+#define MEM_RAM_SIZE	(RAMSize - 0x10000)
+#define MEM_ROM_BASE	ROMBaseMac
+#define MEM_ROM_SIZE	ROMSize
+#elif defined(MEM_FIXED_RAMSIZE)
+#define MEM_ADDR(addr)	(addr)
+#define MEM_RAM_SIZE	((uae_u32)MEM_FIXED_RAMSIZE)
+#define MEM_ROM_BASE	((uae_u32)FIXED_ROM_BASE_MAC)
+#define MEM_ROM_SIZE	((uae_u32)FIXED_ROM_SIZE)
+#else
+#define MEM_ADDR(addr)	(addr)
+#define MEM_RAM_SIZE	RAMSize
+#define MEM_ROM_BASE	ROMBaseMac
+#define MEM_ROM_SIZE	ROMSize
+#endif
+
+// One unsigned compare covers both ROM bounds
+#define MEM_IN_ROM(addr)	((uae_u32)((addr) - MEM_ROM_BASE) < MEM_ROM_SIZE)
+
+#if USE_PREDECODE_CACHE
+#define PREDECODE_CHECK_WRITE(addr, size) predecode_check_write(addr, size)
+#else
+#define PREDECODE_CHECK_WRITE(addr, size) do { } while (0)
+#endif
+
 // Fast-path long (32-bit) read
 static inline uae_u32 longget_fastpath(uaecptr addr) {
+    addr = MEM_ADDR(addr);
     // Fast path for RAM (most common case)
-    // RAM is at address 0, so just check if addr < RAMSize
-    if (likely(addr < RAMSize)) {
-        uae_u32 *m = (uae_u32 *)(RAMBaseHost + addr);
+    // RAM is at address 0, so just check if addr < MEM_RAM_SIZE
+    if (likely(addr < MEM_RAM_SIZE)) {
+        uae_u32 *m = (uae_u32 *)(RAM_READ_BASE(addr, 4) + addr);
         return do_get_mem_long(m);
     }
     // Fast path for ROM
-    if (addr >= ROMBaseMac && addr < ROMBaseMac + ROMSize) {
-        uae_u32 *m = (uae_u32 *)(ROMBaseHost + (addr - ROMBaseMac));
+    if (MEM_IN_ROM(addr)) {
+        uae_u32 *m = (uae_u32 *)(ROMBaseHost + (addr - MEM_ROM_BASE));
         return do_get_mem_long(m);
     }
     // Fall back to bank lookup for other addresses (frame buffer, hardware, etc.)
@@ -138,12 +297,13 @@ static inline uae_u32 longget_fastpath(uaecptr addr) {
 
 // Fast-path word (16-bit) read
 static inline uae_u32 wordget_fastpath(uaecptr addr) {
-    if (likely(addr < RAMSize)) {
-        uae_u16 *m = (uae_u16 *)(RAMBaseHost + addr);
+    addr = MEM_ADDR(addr);
+    if (likely(addr < MEM_RAM_SIZE)) {
+        uae_u16 *m = (uae_u16 *)(RAM_READ_BASE(addr, 2) + addr);
         return do_get_mem_word(m);
     }
-    if (addr >= ROMBaseMac && addr < ROMBaseMac + ROMSize) {
-        uae_u16 *m = (uae_u16 *)(ROMBaseHost + (addr - ROMBaseMac));
+    if (MEM_IN_ROM(addr)) {
+        uae_u16 *m = (uae_u16 *)(ROMBaseHost + (addr - MEM_ROM_BASE));
         return do_get_mem_word(m);
     }
     return call_mem_get_func(get_mem_bank(addr).wget, addr);
@@ -151,21 +311,25 @@ static inline uae_u32 wordget_fastpath(uaecptr addr) {
 
 // Fast-path byte (8-bit) read
 static inline uae_u32 byteget_fastpath(uaecptr addr) {
-    if (likely(addr < RAMSize)) {
-        return *(uae_u8 *)(RAMBaseHost + addr);
+    addr = MEM_ADDR(addr);
+    if (likely(addr < MEM_RAM_SIZE)) {
+        return *(uae_u8 *)(RAM_READ_BASE(addr, 1) + addr);
     }
-    if (addr >= ROMBaseMac && addr < ROMBaseMac + ROMSize) {
-        return *(uae_u8 *)(ROMBaseHost + (addr - ROMBaseMac));
+    if (MEM_IN_ROM(addr)) {
+        return *(uae_u8 *)(ROMBaseHost + (addr - MEM_ROM_BASE));
     }
     return call_mem_get_func(get_mem_bank(addr).bget, addr);
 }
 
 // Fast-path long (32-bit) write
 static inline void longput_fastpath(uaecptr addr, uae_u32 l) {
+    addr = MEM_ADDR(addr);
     // Fast path for RAM writes (most common case)
-    if (likely(addr < RAMSize)) {
+    if (likely(addr < MEM_RAM_SIZE)) {
         uae_u32 *m = (uae_u32 *)(RAMBaseHost + addr);
+        PREDECODE_CHECK_WRITE(addr, 4);
         do_put_mem_long(m, l);
+        RAM_COPY_PUT_LONG(addr, l);
         return;
     }
     // ROM writes go to bank handler (which will log/ignore them)
@@ -175,9 +339,12 @@ static inline void longput_fastpath(uaecptr addr, uae_u32 l) {
 
 // Fast-path word (16-bit) write
 static inline void wordput_fastpath(uaecptr addr, uae_u32 w) {
-    if (likely(addr < RAMSize)) {
+    addr = MEM_ADDR(addr);
+    if (likely(addr < MEM_RAM_SIZE)) {
         uae_u16 *m = (uae_u16 *)(RAMBaseHost + addr);
+        PREDECODE_CHECK_WRITE(addr, 2);
         do_put_mem_word(m, w);
+        RAM_COPY_PUT_WORD(addr, w);
         return;
     }
     call_mem_put_func(get_mem_bank(addr).wput, addr, w);
@@ -185,13 +352,38 @@ static inline void wordput_fastpath(uaecptr addr, uae_u32 w) {
 
 // Fast-path byte (8-bit) write
 static inline void byteput_fastpath(uaecptr addr, uae_u32 b) {
-    if (likely(addr < RAMSize)) {
+    addr = MEM_ADDR(addr);
+    if (likely(addr < MEM_RAM_SIZE)) {
+        PREDECODE_CHECK_WRITE(addr, 1);
         *(uae_u8 *)(RAMBaseHost + addr) = b;
+        RAM_COPY_PUT_BYTE(addr, b);
         return;
     }
     call_mem_put_func(get_mem_bank(addr).bput, addr, b);
 }
 
+// Host address of a whole MOVEM/MOVE16 transfer [addr, addr + size) in RAM
+// (or ROM for reads), so one check covers it; NULL = go through the banks
+static inline uae_u8 *ram_read_range(uaecptr addr, uae_u32 size) {
+    addr = MEM_ADDR(addr);
+    if (likely(addr < MEM_RAM_SIZE && size <= MEM_RAM_SIZE - addr)) {
+        return RAMBaseHost + addr;
+    }
+    if (MEM_IN_ROM(addr) && size <= MEM_ROM_SIZE - (addr - MEM_ROM_BASE)) {
+        return ROMBaseHost + (addr - MEM_ROM_BASE);
+    }
+    return NULL;
+}
+
+static inline uae_u8 *ram_write_range(uaecptr addr, uae_u32 size) {
+    addr = MEM_ADDR(addr);
+    if (likely(addr < MEM_RAM_SIZE && size <= MEM_RAM_SIZE - addr) && RAM_COPY_NONE(addr, size)) {
+        PREDECODE_CHECK_WRITE(addr, size);
+        return RAMBaseHost + addr;
+    }
+    return NULL;
+}
+
 // Use fast-path functions for all memory access
 #define longget(addr) longget_fastpath(addr)
 #define wordget(addr) wordget_fastpath(addr)
@@ -209,6 +401,9 @@ extern void longput(uaecptr addr, uae_u32 l);
 extern void wordput(uaecptr addr, uae_u32 w);
 extern void byteput(uaecptr addr, uae_u32 b);
 
+static inline uae_u8 *ram_read_range(uaecptr, uae_u32) { return NULL; }
+static inline uae_u8 *ram_write_range(uaecptr, uae_u32) { return NULL; }
+
 #endif
 
 #ifndef MD_HAVE_MEM_1_FUNCS
@@ -277,6 +472,14 @@ static __inline__ uae_u32 get_virtual_address(uae_u8 *addr)
 {
 	return do_get_virtual_address(addr);
 }
+static __inline__ uae_u8 *ram_read_range(uaecptr addr, uae_u32)
+{
+	return do_get_real_address(addr);
+}
+static __inline__ uae_u8 *ram_write_range(uaecptr addr, uae_u32)
+{
+	return do_get_real_address(addr);
+}
 #else
 static __inline__ uae_u32 get_long(uaecptr addr)
 {
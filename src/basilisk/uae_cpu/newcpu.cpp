@@ -30,10 +30,17 @@
 #ifdef ARDUINO
 #include <esp_heap_caps.h>
 #include <esp_attr.h>  // For IRAM_ATTR, DRAM_ATTR
+#include "profiler_esp32.h"
+#include "trap_stats_esp32.h"
+#include "irq_stats_esp32.h"
+#include "boot_timeline_esp32.h"
+#include "perf_esp32.h"
 #endif
+#include "replay_esp32.h"
 
 #include "cpu_emulation.h"
 #include "main.h"
+#include "timer.h"
 #include "emul_op.h"
 
 extern int intlev(void);	// From baisilisk_glue.cpp
@@ -44,6 +51,9 @@ extern int intlev(void);	// From baisilisk_glue.cpp
 #include "newcpu.h"
 #include "compiler/compemu.h"
 #include "fpu/fpu.h"
+#include "predecode.h"
+#include "compiler/jit_riscv.h"
+#include "snapshot.h"
 
 #if defined(ENABLE_EXCLUSIVE_SPCFLAGS) && !defined(HAVE_HARDWARE_LOCKS)
 B2_mutex *spcflags_lock = NULL;
@@ -281,13 +291,37 @@ static void build_cpufunctbl (void)
 		else if (CPUType == 1)
 			cpu_level = 1;
 	}
-	struct cputbl *tbl = (
+	const struct cputbl *tbl = (
 				cpu_level == 4 ? op_smalltbl_0_ff
 				: cpu_level == 3 ? op_smalltbl_1_ff
 				: cpu_level == 2 ? op_smalltbl_2_ff
 				: cpu_level == 1 ? op_smalltbl_3_ff
 				: op_smalltbl_4_ff);
 
+#if USE_FIXED_RAM_ACCESSORS
+	// Bind the copy whose compiled-in bounds match the memory layout, if any
+	if (cpu_level == 4 && ROMBaseMac == FIXED_ROM_BASE_MAC && ROMSize == FIXED_ROM_SIZE) {
+		const struct cputbl *fixed = NULL;
+		switch (RAMSize) {
+			case 0x00400000: fixed = op_smalltbl_0_ram4m; break;
+			case 0x00800000: fixed = op_smalltbl_0_ram8m; break;
+			case 0x00c00000: fixed = op_smalltbl_0_ram12m; break;
+			case 0x01000000: fixed = op_smalltbl_0_ram16m; break;
+		}
+		if (fixed) {
+			tbl = fixed;
+			write_log("Using fixed-layout CPU handlers for %d MB RAM\n", RAMSize >> 20);
+		}
+	}
+#endif
+#if USE_24BIT_ACCESSORS
+	// With 24-bit addressing, the copy that masks addresses before its bounds checks
+	if (cpu_level == 4 && TwentyFourBitAddressing && RAMSize <= ROMBaseMac) {
+		tbl = op_smalltbl_0_a24;
+		write_log("Using 24-bit addressing CPU handlers\n");
+	}
+#endif
+
 	for (opcode = 0; opcode < 65536; opcode++)
 		cpufunctbl[cft_map (opcode)] = op_illg_1;
 	for (i = 0; tbl[i].handler != NULL; i++) {
@@ -313,10 +347,19 @@ static void build_cpufunctbl (void)
 	}
 }
 
+#if DBCC_FAST_FORWARD && defined(ARDUINO)
+static perf_counter *perf_dbcc_skips = NULL;	// "cpu.dbcc_skips", delay loop passes skipped
+#endif
+
 void init_m68k (void)
 {
 	int i;
 
+#if DBCC_FAST_FORWARD && defined(ARDUINO)
+	if (perf_dbcc_skips == NULL)
+		perf_dbcc_skips = PerfCounter("cpu.dbcc_skips");
+#endif
+
 	// movem tables are now const and pre-computed at compile time
 	(void)i;  // silence unused variable warning
 
@@ -352,6 +395,7 @@ void init_m68k (void)
 	do_merges ();
 
 	build_cpufunctbl ();
+	EmulOpDirectInit ();
 
 #if defined(ENABLE_EXCLUSIVE_SPCFLAGS) && !defined(HAVE_HARDWARE_LOCKS)
 	spcflags_lock = B2_create_mutex();
@@ -370,6 +414,9 @@ void exit_m68k (void)
 // Place CPU registers in internal SRAM for fast access (accessed every instruction)
 // ESP32-P4 internal DRAM is ~10x faster than PSRAM
 DRAM_ATTR struct regstruct regs;
+#if defined(ARDUINO_ARCH_ESP32) || defined(ESP32)
+DRAM_ATTR spcflags_t spcflags_doorbell = 0;	// SPCFLAGS_POST() from other tasks
+#endif
 struct regstruct *lastint_regs_ptr = NULL;
 #define lastint_regs (*lastint_regs_ptr)
 // regs_backup removed - was 1856 bytes and never used
@@ -736,8 +783,152 @@ uae_u32 get_disp_ea_000 (uae_u32 base, uae_u32 dp)
 #endif
 }
 
+#if USE_LAZY_FLAGS
+/*
+ *  Compute C/Z/N/V from the operation recorded by a lazy-flags handler
+ */
+
+void m68k_flags_materialize (void)
+{
+	uae_u32 kind = regflags.lazy;
+	uae_u32 mask, msb;
+
+	switch (kind & 3) {
+	 case FLAGS_LAZY_B: mask = 0xff; msb = 0x80; break;
+	 case FLAGS_LAZY_W: mask = 0xffff; msb = 0x8000; break;
+	 default: mask = 0xffffffff; msb = 0x80000000; break;
+	}
+
+	uae_u32 res = regflags.lres & mask;
+	SET_ZFLG (res == 0);
+	SET_NFLG ((res & msb) != 0);
+
+	switch (kind & ~3) {
+	 case FLAGS_LAZY_ADD: {
+		uae_u32 src = regflags.lsrc & mask;
+		uae_u32 dst = regflags.ldst & mask;
+		SET_VFLG (((src ^ res) & (dst ^ res) & msb) != 0);
+		SET_CFLG (res < src);
+		break;
+	 }
+	 case FLAGS_LAZY_SUB: {
+		uae_u32 src = regflags.lsrc & mask;
+		uae_u32 dst = regflags.ldst & mask;
+		SET_VFLG (((src ^ dst) & (res ^ dst) & msb) != 0);
+		SET_CFLG (src > dst);
+		break;
+	 }
+	 default:
+		SET_VFLG (0);
+		SET_CFLG (0);
+		break;
+	}
+
+	regflags.lazy = 0;
+}
+
+#if USE_THREADED_DISPATCH && !defined(HAVE_GET_WORD_UNSWAPPED)
+/*
+ *  Condition cc (2..15) of a Bcc right after a lazy-flags handler, taken
+ *  from the recorded operands without materializing C/Z/N/V. The operands
+ *  are shifted up so that the operation size does not matter; for SUB and
+ *  CMP, dst - src compares like dst against src. ADD and the V conditions are
+ *  rare enough to go through cctrue().
+ */
+
+static inline int lazy_cctrue (int cc)
+{
+	uae_u32 kind = regflags.lazy;
+	int shift = (kind & 3) == FLAGS_LAZY_B ? 24 : (kind & 3) == FLAGS_LAZY_W ? 16 : 0;
+
+	switch (kind & ~3) {
+	 case FLAGS_LAZY_LOGICAL: {
+		uae_s32 res = regflags.lres << shift;
+		switch (cc) {
+		 case 2: case 6: return res != 0;		/* HI, NE */
+		 case 3: case 7: return res == 0;		/* LS, EQ */
+		 case 4: case 8: return 1;				/* CC, VC */
+		 case 5: case 9: return 0;				/* CS, VS */
+		 case 10: case 12: return res >= 0;		/* PL, GE */
+		 case 11: case 13: return res < 0;		/* MI, LT */
+		 case 14: return res > 0;				/* GT */
+		 case 15: return res <= 0;				/* LE */
+		}
+		break;
+	 }
+	 case FLAGS_LAZY_SUB: {
+		uae_u32 src = regflags.lsrc << shift;
+		uae_u32 dst = regflags.ldst << shift;
+		switch (cc) {
+		 case 2: return dst > src;				/* HI */
+		 case 3: return dst <= src;				/* LS */
+		 case 4: return dst >= src;				/* CC */
+		 case 5: return dst < src;				/* CS */
+		 case 6: return dst != src;				/* NE */
+		 case 7: return dst == src;				/* EQ */
+		 case 10: return (uae_s32)(regflags.lres << shift) >= 0;	/* PL */
+		 case 11: return (uae_s32)(regflags.lres << shift) < 0;	/* MI */
+		 case 12: return (uae_s32)dst >= (uae_s32)src;	/* GE */
+		 case 13: return (uae_s32)dst < (uae_s32)src;	/* LT */
+		 case 14: return (uae_s32)dst > (uae_s32)src;	/* GT */
+		 case 15: return (uae_s32)dst <= (uae_s32)src;	/* LE */
+		}
+		break;
+	 }
+	}
+	m68k_flags_materialize ();
+	return cctrue (cc);
+}
+
+/*
+ *  Bcc.B/W/L with a condition other than T and F, called by cpuop_chain_bcc()
+ *  in place of its cpufunctbl handler; ends the chain like that handler
+ */
+
+#ifdef ARDUINO
+IRAM_ATTR
+#endif
+void m68k_fused_bcc (uae_u32 opcode)
+{
+	cpuop_begin();
+	cpuop_cycles(2);
+	int cc = (opcode >> 8) & 15;
+	int taken = regflags.lazy ? lazy_cctrue (cc) : cctrue (cc);
+	uae_s32 disp = (uae_s8)opcode;
+	int len = 2;
+	if (disp == 0) {
+		disp = (uae_s16)get_iword(2);
+		len = 4;
+	} else if (disp == -1) {
+		disp = (uae_s32)get_ilong(2);
+		len = 6;
+	}
+	if (taken)
+		m68k_incpc (disp + 2);
+	else
+		m68k_incpc (len);
+	cpuop_end();
+}
+#endif
+#endif
+
+#if DBCC_FAST_FORWARD
+/*
+ *  A DBcc branching to itself skipped n passes (see DBCC_FAST_FORWARD in newcpu.h)
+ */
+
+void m68k_dbcc_skip (uae_u32 n)
+{
+	cpuop_cycles(3 * n);
+#ifdef ARDUINO
+	PerfAdd(perf_dbcc_skips, n);
+#endif
+}
+#endif
+
 void MakeSR (void)
 {
+	FLAGS_SYNC();
 #if 0
 	assert((regs.t1 & 1) == regs.t1);
 	assert((regs.t0 & 1) == regs.t0);
@@ -759,6 +950,7 @@ void MakeFromSR (void)
 {
 	int oldm = regs.m;
 	int olds = regs.s;
+	int oldmask = regs.intmask;
 
 	regs.t1 = (regs.sr >> 15) & 1;
 	regs.t0 = (regs.sr >> 14) & 1;
@@ -770,6 +962,7 @@ void MakeFromSR (void)
 	SET_ZFLG ((regs.sr >> 2) & 1);
 	SET_VFLG ((regs.sr >> 1) & 1);
 	SET_CFLG (regs.sr & 1);
+	FLAGS_DROP_LAZY();
 	if (CPUType >= 2) {
 		if (olds != regs.s) {
 			if (olds) {
@@ -803,7 +996,15 @@ void MakeFromSR (void)
 		}
 	}
 
-	SPCFLAGS_SET( SPCFLAG_INT );
+	// Only a lowered mask can let a pending interrupt through. The fence
+	// pairs with the one in TriggerInterrupt(), which doesn't post
+	// SPCFLAG_INT while the mask is up: either it sees the new mask or
+	// this sees its InterruptFlags
+	if (regs.intmask < oldmask) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (intlev() > regs.intmask)
+			SPCFLAGS_SET( SPCFLAG_INT );
+	}
 	if (regs.t1 || regs.t0)
 		SPCFLAGS_SET( SPCFLAG_TRACE );
 	else
@@ -812,8 +1013,46 @@ void MakeFromSR (void)
 		SPCFLAGS_CLEAR( SPCFLAG_TRACE );
 }
 
+/*
+ *  A-line and F-line exceptions (every Toolbox and OS trap) on a 68020+:
+ *  the four-word format 0 frame is stored through one host pointer and the
+ *  vector read directly when the supervisor stack and the vector table are
+ *  in RAM. Returns false without changing anything otherwise.
+ */
+
+static bool exception_line_fast(int nr)
+{
+	uaecptr sp = regs.s ? m68k_areg(regs, 7) : regs.m ? regs.msp : regs.isp;
+	if (sp & 1)
+		return false;
+	uae_u8 *frame = ram_write_range(sp - 8, 8);
+	uae_u8 *vector = ram_read_range(regs.vbr + 4*nr, 4);
+	if (frame == NULL || vector == NULL)
+		return false;
+
+	uae_u32 currpc = m68k_getpc ();
+	MakeSR();
+	if (!regs.s) {
+		regs.usp = m68k_areg(regs, 7);
+		regs.s = 1;
+	}
+	m68k_areg(regs, 7) = sp - 8;
+	do_put_mem_word((uae_u16 *)frame, regs.sr);
+	do_put_mem_long((uae_u32 *)(frame + 2), currpc);
+	do_put_mem_word((uae_u16 *)(frame + 6), nr * 4);
+	m68k_setpc (do_get_mem_long((uae_u32 *)vector));
+	SPCFLAGS_SET( SPCFLAG_JIT_END_COMPILE );
+	fill_prefetch_0 ();
+	regs.t1 = regs.t0 = regs.m = 0;
+	SPCFLAGS_CLEAR( SPCFLAG_TRACE | SPCFLAG_DOTRACE );
+	return true;
+}
+
 void Exception(int nr, uaecptr oldpc)
 {
+	if ((nr == 0xA || nr == 0xB) && CPUType >= 2 && exception_line_fast(nr))
+		return;
+
 	uae_u32 currpc = m68k_getpc ();
 	MakeSR();
 	if (!regs.s) {
@@ -883,12 +1122,17 @@ kludge_me_do:
 static void Interrupt(int nr)
 {
 	assert(nr < 8 && nr >= 0);
+#if IRQ_STATS
+	// Raise-to-delivery time of the sources this interrupt hands the 68k
+	IRQStatsCheck();
+#endif
 	lastint_regs = regs;
 	lastint_no = nr;
 	Exception(nr+24, 0);
 
 	regs.intmask = nr;
-	SPCFLAGS_SET( SPCFLAG_INT );
+	if (intlev() > regs.intmask)
+		SPCFLAGS_SET( SPCFLAG_INT );
 }
 
 static int caar, cacr, tc, itt0, itt1, dtt0, dtt1, mmusr, urp, srp;
@@ -1026,6 +1270,41 @@ void m68k_divl (uae_u32 opcode, uae_u32 src, uae_u16 extra, uaecptr oldpc)
 		Exception (5, oldpc);
 		return;
 	}
+	/* A 32-bit dividend (DIVx.L, or DIVx.L with a 64-bit dividend whose
+	   upper long only extends the lower one) is divided with the CPU's own
+	   32-bit div/rem; the uae_s64 code below is a __divdi3/__moddi3 call
+	   pair on RV32 */
+	if (extra & 0x800) {
+		uae_s32 lo = (uae_s32)m68k_dreg(regs, (extra >> 12) & 7);
+		if (!(extra & 0x400) || (uae_s32)m68k_dreg(regs, extra & 7) == (lo >> 31)) {
+			if (lo == (uae_s32)0x80000000 && (uae_s32)src == -1) {
+				SET_VFLG (1);
+				SET_NFLG (1);
+				SET_CFLG (0);
+			} else {
+				uae_s32 quot = lo / (uae_s32)src;
+				uae_s32 rem = lo % (uae_s32)src;
+				SET_VFLG (0);
+				SET_CFLG (0);
+				SET_ZFLG (quot == 0);
+				SET_NFLG (quot < 0);
+				m68k_dreg(regs, extra & 7) = (uae_u32)rem;
+				m68k_dreg(regs, (extra >> 12) & 7) = (uae_u32)quot;
+			}
+			return;
+		}
+	} else if (!(extra & 0x400) || m68k_dreg(regs, extra & 7) == 0) {
+		uae_u32 lo = (uae_u32)m68k_dreg(regs, (extra >> 12) & 7);
+		uae_u32 quot = lo / src;
+		uae_u32 rem = lo % src;
+		SET_VFLG (0);
+		SET_CFLG (0);
+		SET_ZFLG (quot == 0);
+		SET_NFLG (((uae_s32)quot) < 0);
+		m68k_dreg(regs, extra & 7) = rem;
+		m68k_dreg(regs, (extra >> 12) & 7) = quot;
+		return;
+	}
 	if (extra & 0x800) {
 		/* signed variant */
 		uae_s64 a = (uae_s64)(uae_s32)m68k_dreg(regs, (extra >> 12) & 7);
@@ -1256,8 +1535,35 @@ static const char* ccnames[] =
 // execution only
 static int m68k_execute_depth = 0;
 
+#if !(REAL_ADDRESSING || DIRECT_ADDRESSING)
+/*
+ *  Host address of a jump target outside the current code region; a
+ *  target in RAM or ROM makes that the region for the following jumps
+ */
+
+uae_u8 *m68k_pc_region (uaecptr newpc)
+{
+	if (newpc - RAMBaseMac < RAMSize) {
+		regs.pc_region_host = RAMBaseHost;
+		regs.pc_region_mac = RAMBaseMac;
+		regs.pc_region_size = RAMSize;
+	} else if (newpc - ROMBaseMac < ROMSize) {
+		regs.pc_region_host = ROMBaseHost;
+		regs.pc_region_mac = ROMBaseMac;
+		regs.pc_region_size = ROMSize;
+	} else {
+		regs.pc_region_size = 0;
+		return get_real_address(newpc);
+	}
+	return regs.pc_region_host + (newpc - regs.pc_region_mac);
+}
+#endif
+
 void m68k_reset (void)
 {
+#if !(REAL_ADDRESSING || DIRECT_ADDRESSING)
+	regs.pc_region_size = 0;	// RAM or ROM may have moved
+#endif
 	m68k_areg (regs, 7) = 0x2000;
 	m68k_setpc (ROMBaseMac + 0x2a);
 	fill_prefetch_0 ();
@@ -1300,18 +1606,83 @@ void m68k_emulop_return(void)
 	quit_program = true;
 }
 
+#if MAC_SNAPSHOT
+// A snapshot can only be taken between instructions of the outermost
+// m68k_execute(), not while an EmulOp runs 68k code through Execute68k()
+bool CPUSnapshotReady(void)
+{
+	return m68k_execute_depth == 1;
+}
+
+bool CPUSnapshot(void)
+{
+	const uae_u32 spc_mask = SPCFLAG_STOP | SPCFLAG_INT | SPCFLAG_DOINT | SPCFLAG_TRACE | SPCFLAG_DOTRACE;
+	uae_u32 pc = 0, spcflags = 0;
+
+	if (!SnapshotRestoring()) {
+		MakeSR();
+		pc = m68k_getpc();
+		spcflags = regs.spcflags & spc_mask;
+	}
+	bool ok = SnapshotData(regs.regs, sizeof(regs.regs))
+		&& SnapshotVar(pc) && SnapshotVar(spcflags)
+		&& SnapshotVar(regs.vbr) && SnapshotVar(regs.sfc) && SnapshotVar(regs.dfc)
+		&& SnapshotVar(regs.usp) && SnapshotVar(regs.isp) && SnapshotVar(regs.msp)
+		&& SnapshotVar(regs.sr) && SnapshotVar(regs.stopped)
+		&& SnapshotVar(caar) && SnapshotVar(cacr) && SnapshotVar(tc)
+		&& SnapshotVar(itt0) && SnapshotVar(itt1) && SnapshotVar(dtt0) && SnapshotVar(dtt1)
+		&& SnapshotVar(mmusr) && SnapshotVar(urp) && SnapshotVar(srp)
+		&& SnapshotVar(fpu);
+	if (!ok || !SnapshotRestoring())
+		return ok;
+
+	// A7 already holds the stack pointer of the saved mode, so make that
+	// the current mode before MakeFromSR() to keep it from swapping stacks
+	SPCFLAGS_INIT( spcflags & spc_mask );
+	regs.s = (regs.sr >> 13) & 1;
+	regs.m = (regs.sr >> 12) & 1;
+	MakeFromSR();
+	m68k_setpc(pc);
+	fill_prefetch_0();
+	return true;
+}
+#endif
+
 void m68k_emulop(uae_u32 opcode)
 {
 	struct M68kRegisters r;
 	int i;
 
+	// The hot EmulOps only use D/A: no copy, no SR round trip
+	emulop_direct_func direct = NULL;
+	if (opcode - M68K_EXEC_RETURN < (uae_u32)EMULOP_DIRECT_COUNT)
+		direct = EmulOpDirect[opcode - M68K_EXEC_RETURN];
+	if (direct != NULL) {
+#if TRAP_STATS
+		trap_stats_mark start = TrapStatsStart();
+		direct(&m68k_dreg(regs, 0), &m68k_areg(regs, 0));
+		TrapStatsEmulOpEnd(opcode, start);
+#else
+		direct(&m68k_dreg(regs, 0), &m68k_areg(regs, 0));
+#endif
+		ram_copy_refresh();
+		return;
+	}
+
 	for (i=0; i<8; i++) {
 		r.d[i] = m68k_dreg(regs, i);
 		r.a[i] = m68k_areg(regs, i);
 	}
 	MakeSR();
 	r.sr = regs.sr;
+#if TRAP_STATS
+	trap_stats_mark start = TrapStatsStart();
 	EmulOp(opcode, &r);
+	TrapStatsEmulOpEnd(opcode, start);
+#else
+	EmulOp(opcode, &r);
+#endif
+	ram_copy_refresh();
 	for (i=0; i<8; i++) {
 		m68k_dreg(regs, i) = r.d[i];
 		m68k_areg(regs, i) = r.a[i];
@@ -1325,6 +1696,15 @@ void REGPARAM2 op_illg (uae_u32 opcode)
 	uaecptr pc = m68k_getpc ();
 
 	if ((opcode & 0xF000) == 0xA000) {
+#if PROFILER
+		ProfilerLastTrap = opcode;
+#endif
+#if TRAP_STATS
+		TrapStatsALine(opcode, m68k_areg(regs, 7));
+#endif
+#if BOOT_TIMELINE
+		BootTimelineALine(opcode);
+#endif
 		Exception(0xA,0);
 		return;
 	}
@@ -1368,6 +1748,8 @@ static void do_trace (void)
 		m68k_setpc (m68k_getpc ());
 		fill_prefetch_0 ();
 		opcode = get_word(m68k_getpc());
+		// The Bcc/DBcc tests below read the flags through cctrue()
+		FLAGS_SYNC();
 		if (opcode == 0x4e72            /* RTE */
 				|| opcode == 0x4e74                 /* RTD */
 				|| opcode == 0x4e75                 /* RTS */
@@ -1393,6 +1775,9 @@ static void do_trace (void)
 	}
 }
 
+// Periodic work of a quantum end (main_esp32.cpp), also run while stopped
+extern void cpu_do_check_ticks(void);
+
 int m68k_do_specialties (void)
 {
 #if USE_JIT
@@ -1411,6 +1796,22 @@ int m68k_do_specialties (void)
 		Exception (9,last_trace_ad);
 	}
 	while (SPCFLAGS_TEST( SPCFLAG_STOP )) {
+		// Sleep until TriggerInterrupt() instead of spinning, also while
+		// the interrupt that is pending is one the STOP masked
+		SPCFLAGS_COLLECT();
+		if (!SPCFLAGS_TEST( SPCFLAG_INT | SPCFLAG_DOINT )) {
+			int intr = intlev ();
+			if (intr > 0 && intr <= regs.intmask)
+				idle_wait_masked();
+			else
+				idle_wait();
+		}
+		SPCFLAGS_COLLECT();
+#if REPLAY
+		// Interrupt flags are handed over here while stopped
+		if (replay_mode != REPLAY_OFF)
+			ReplayStopped();
+#endif
 		if (SPCFLAGS_TEST( SPCFLAG_INT | SPCFLAG_DOINT )){
 			SPCFLAGS_CLEAR( SPCFLAG_INT | SPCFLAG_DOINT );
 			int intr = intlev ();
@@ -1420,6 +1821,13 @@ int m68k_do_specialties (void)
 				SPCFLAGS_CLEAR( SPCFLAG_STOP );
 			}
 		}
+		// Still stopped: polled ticks, disk flushes and video signals
+		// (basilisk_loop()) go on as if a quantum had ended
+#if REPLAY
+		if (replay_mode == REPLAY_OFF)
+#endif
+		if (SPCFLAGS_TEST( SPCFLAG_STOP ))
+			cpu_do_check_ticks();
 	}
 	if (SPCFLAGS_TEST( SPCFLAG_TRACE ))
 		do_trace ();
@@ -1448,16 +1856,181 @@ int m68k_do_specialties (void)
 //
 // OPTIMIZATION: The inner loop executes multiple instructions before checking
 // for ticks and special flags. This reduces overhead significantly.
-// The BATCH_SIZE controls how many instructions run before checking - higher
+// The batch size controls how many instructions run before checking - higher
 // values improve performance but reduce interrupt responsiveness.
-// 32 instructions = good balance of performance vs responsiveness
-// Higher values (64, 128) give diminishing returns but less responsive interrupts
-#define EXEC_BATCH_SIZE 32
+// exec_batch_size is adjusted at runtime by the scheduler in cpu_do_check_ticks()
+// (main_esp32.cpp): it grows while no interrupts show up and drops back as
+// soon as ADB or Time Manager activity is seen.
 
-// External tick counter (defined in main_esp32.cpp via newcpu.h)
+// External tick counter and batch size (defined in main_esp32.cpp)
 extern int32 emulated_ticks;
-extern void cpu_do_check_ticks(void);
+extern int32 exec_batch_size;
+
+#if USE_THREADED_DISPATCH
+// Threaded variant: straight-line handlers chain to each other through
+// cpuop_chain(), so one call here may run up to exec_batch_size instructions.
+// regs.thread_budget is decremented by every handler, which keeps the
+// instruction count exact. Special flags are only looked at when a chain
+// ends (branch, trap, SR change or exhausted budget). With FLIGHT_RECORDER
+// only the first instruction of each chain is recorded.
+#ifdef ARDUINO
+IRAM_ATTR
+#endif
+void m68k_do_execute (void)
+{
+	// Nested m68k_execute() calls (Execute68k from an EmulOp) reuse
+	// regs.thread_budget, so restore the caller's budget on the way out
+	int saved_budget = regs.thread_budget;
 
+	for (;;) {
+		int batch = exec_batch_size;
+		regs.thread_budget = batch;
+		
+		do {
+			uae_u32 opcode = GET_OPCODE;
+#if FLIGHT_RECORDER
+			m68k_record_step(m68k_getpc());
+#endif
+			(*cpufunctbl[opcode])(opcode);
+			
+			if (unlikely(SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN))) {
+				break;
+			}
+		} while (regs.thread_budget > 0);
+		
+#if TRAP_STATS
+		TrapStatsCheck(m68k_areg(regs, 7));
+#endif
+#if RAM_HOT_BANKS
+		RamHotSample();
+#endif
+#if REPLAY
+		ReplayBatchEnd(batch - regs.thread_budget);
+#endif
+		emulated_ticks -= batch - regs.thread_budget;
+		if (emulated_ticks <= 0) {
+			cpu_do_check_ticks();
+		}
+		
+		SPCFLAGS_COLLECT();
+		if (SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN)) {
+			if (m68k_do_specialties()) {
+				regs.thread_budget = saved_budget;
+				return;
+			}
+		}
+	}
+}
+#elif USE_PREDECODE_CACHE
+// Pre-decode variant: the first pass over a trace records {pc_p, opcode,
+// handler} into predecode_blocks, later passes replay the handlers without
+// fetching the opcode or touching cpufunctbl. A trace is left as soon as the
+// PC diverges from the recorded path, special flags are raised or the trace
+// gets invalidated by a write to its code.
+#ifdef ARDUINO
+IRAM_ATTR
+#endif
+void m68k_do_execute (void)
+{
+	for (;;) {
+		int batch = exec_batch_size;
+		int instructions_executed = 0;
+		
+		do {
+			uae_u8 *start = regs.pc_p;
+			predecode_block *b = &predecode_blocks[PREDECODE_HASH(start)];
+			
+			if (likely(b->start == start)) {
+#if USE_RV_JIT
+				if (jit_ready(b)) {
+					instructions_executed += jit_run(b);
+				} else
+#endif
+				{
+				// Replay recorded trace
+				const predecode_insn *insn = b->insn;
+				const predecode_insn *end = insn + b->count;
+				do {
+					if (regs.pc_p != insn->pc_p)
+						break;
+					(*insn->handler)(insn->opcode);
+					instructions_executed++;
+					if (unlikely(SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN) || b->start != start))
+						break;
+				} while (++insn < end);
+#if USE_RV_JIT
+				// Translate hot traces (not while inside translated code)
+				if (++b->hits == JIT_HOT_THRESHOLD && b->start == start)
+					jit_hot(b);
+#endif
+				}
+			} else {
+				// Record a new trace while executing it
+				b->start = NULL;
+				b->count = 0;
+#if USE_RV_JIT
+				b->native = NULL;
+				b->hits = 0;
+#if JIT_BACKGROUND
+				// Before the trace changes, see jit_worker()
+				__atomic_store_n(&b->gen, b->gen + 1, __ATOMIC_RELAXED);
+				__atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+#endif
+				b->lo = b->hi = start;
+				for (;;) {
+					uae_u8 *pc_p = regs.pc_p;
+					uae_u32 opcode = GET_OPCODE;
+					cpuop_func *handler = cpufunctbl[opcode];
+					bool cached = predecode_record_page(pc_p);
+					if (cached) {
+						predecode_insn *insn = &b->insn[b->count++];
+						insn->pc_p = pc_p;
+						insn->handler = handler;
+						insn->opcode = opcode;
+						if (pc_p < b->lo) b->lo = pc_p;
+						if (pc_p > b->hi) b->hi = pc_p;
+						b->start = start;
+					}
+#if FLIGHT_RECORDER
+					m68k_record_step(m68k_getpc());
+#endif
+					(*handler)(opcode);
+					instructions_executed++;
+					if (unlikely(SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN)))
+						break;
+					// Stop at uncacheable code, self-modification or a full trace
+					if (!cached || b->start != start || b->count == PREDECODE_BLOCK_LEN)
+						break;
+				}
+			}
+			
+			if (unlikely(SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN)))
+				break;
+		} while (instructions_executed < batch);
+		
+#if TRAP_STATS
+		TrapStatsCheck(m68k_areg(regs, 7));
+#endif
+#if RAM_HOT_BANKS
+		RamHotSample();
+#endif
+#if REPLAY
+		ReplayBatchEnd(instructions_executed);
+#endif
+		emulated_ticks -= instructions_executed;
+		if (emulated_ticks <= 0) {
+			cpu_do_check_ticks();
+		}
+		
+		SPCFLAGS_COLLECT();
+		if (SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN)) {
+			if (m68k_do_specialties())
+				return;
+		}
+	}
+}
+#else
 #ifdef ARDUINO
 IRAM_ATTR
 #endif
@@ -1466,8 +2039,8 @@ void m68k_do_execute (void)
 	for (;;) {
 		// Execute a batch of instructions before checking ticks/flags
 		// This reduces the overhead of the tick check from every instruction
-		// to every EXEC_BATCH_SIZE instructions
-		int batch_count = EXEC_BATCH_SIZE;
+		// to every exec_batch_size instructions
+		int batch_count = exec_batch_size;
 		int instructions_executed = 0;
 		
 		do {
@@ -1485,6 +2058,15 @@ void m68k_do_execute (void)
 			}
 		} while (--batch_count > 0);
 		
+#if TRAP_STATS
+		TrapStatsCheck(m68k_areg(regs, 7));
+#endif
+#if RAM_HOT_BANKS
+		RamHotSample();
+#endif
+#if REPLAY
+		ReplayBatchEnd(instructions_executed);
+#endif
 		// Decrement tick counter by number of instructions actually executed
 		// This maintains accurate instruction counting for IPS monitoring
 		emulated_ticks -= instructions_executed;
@@ -1493,16 +2075,18 @@ void m68k_do_execute (void)
 		}
 		
 		// Handle special conditions (interrupts, trace, etc.)
+		SPCFLAGS_COLLECT();
 		if (SPCFLAGS_TEST(SPCFLAG_ALL_BUT_EXEC_RETURN)) {
 			if (m68k_do_specialties())
 				return;
 		}
 	}
 }
+#endif
 
 void m68k_execute (void)
 {
-#if USE_JIT
+#if USE_JIT || MAC_SNAPSHOT
 	++m68k_execute_depth;
 #endif
 	for (;;) {
@@ -1510,7 +2094,7 @@ void m68k_execute (void)
 			break;
 		m68k_do_execute();
 	}
-#if USE_JIT
+#if USE_JIT || MAC_SNAPSHOT
 	--m68k_execute_depth;
 #endif
 }
@@ -1618,6 +2202,7 @@ void m68k_dumpstate (uaecptr *nextpc)
 	if (regs.s && regs.m == 0) regs.isp = m68k_areg(regs, 7);
 	printf ("USP=%08x ISP=%08x MSP=%08x VBR=%08x\n",
 			regs.usp,regs.isp,regs.msp,regs.vbr);
+	FLAGS_SYNC();
 	printf ("T=%d%d S=%d M=%d X=%ld N=%ld Z=%ld V=%ld C=%ld IMASK=%d\n",
 			regs.t1, regs.t0, regs.s, regs.m,
 			GET_XFLG, GET_NFLG, GET_ZFLG, GET_VFLG, GET_CFLG, regs.intmask);
@@ -27,6 +27,10 @@
 #define FLIGHT_RECORDER 0
 #endif
 
+#ifndef USE_THREADED_DISPATCH
+#define USE_THREADED_DISPATCH 0
+#endif
+
 #include "m68k.h"
 #include "readcpu.h"
 #include "spcflags.h"
@@ -56,8 +60,93 @@ extern int broken_in;
 # define cpuop_tag(tag)		;
 #endif
 
-#define cpuop_begin()		do { cpuop_tag("begin"); } while (0)
+/* Execution count per opcode word, for "gencpu --hot-profile" (see
+   opcode_stats_esp32.cpp); every handler has its opcode in "opcode" */
+#ifndef OPCODE_STATS
+#define OPCODE_STATS 0
+#endif
+#if OPCODE_STATS
+extern uae_u32 *opcode_counts;
+extern uae_u32 opcode_count_mask;	/* 0 until the table is allocated */
+#define cpuop_count()		(opcode_counts[opcode & opcode_count_mask]++)
+#else
+#define cpuop_count()		do { } while (0)
+#endif
+
+#if USE_THREADED_DISPATCH
+/* Threaded dispatch: every handler consumes one slot of regs.thread_budget on
+   entry. Straight-line handlers (generated with "gencpu --threaded") end with
+   cpuop_chain(), which fetches and calls the next handler directly while
+   budget remains. Branches, traps and SR writes end with cpuop_end() and
+   return to m68k_do_execute(), which is where special flags are checked.
+   The chain depth is bounded by the budget, so a missed sibling call costs
+   stack but cannot overflow it. */
+#define cpuop_begin()		do { cpuop_tag("begin"); --regs.thread_budget; cpuop_count(); } while (0)
 #define cpuop_end()			do { cpuop_tag("end"); } while (0)
+#define cpuop_chain()		do { cpuop_tag("end"); \
+								 if (likely(regs.thread_budget > 0)) { \
+									 uae_u32 next_opcode = GET_OPCODE; \
+									 (*cpufunctbl[next_opcode])(next_opcode); \
+									 return; \
+								 } } while (0)
+/* Compiled code tests with CMP, TST, SUBQ or AND just before a Bcc, so
+   handlers that leave lazy flags behind ("gencpu --fuse-bcc") end with
+   cpuop_chain_bcc(). A conditional branch after them is run by
+   m68k_fused_bcc(), which decides it from the recorded operands; that saves
+   the cpufunctbl lookup and materializing all of C/Z/N/V. BRA and BSR
+   (condition T and F) go through the table as usual. */
+#if USE_LAZY_FLAGS && !defined(HAVE_GET_WORD_UNSWAPPED)
+extern void m68k_fused_bcc (uae_u32 opcode);
+#define cpuop_chain_bcc()	do { cpuop_tag("end"); \
+								 if (likely(regs.thread_budget > 0)) { \
+									 uae_u32 next_opcode = GET_OPCODE; \
+									 if ((next_opcode & 0xf000) == 0x6000 && (next_opcode & 0x0e00) != 0) \
+										 m68k_fused_bcc(next_opcode); \
+									 else \
+										 (*cpufunctbl[next_opcode])(next_opcode); \
+									 return; \
+								 } } while (0)
+#else
+#define cpuop_chain_bcc()	cpuop_chain()
+#endif
+#else
+#define cpuop_begin()		do { cpuop_tag("begin"); cpuop_count(); } while (0)
+#define cpuop_end()			do { cpuop_tag("end"); } while (0)
+#define cpuop_chain()		cpuop_end()
+#define cpuop_chain_bcc()	cpuop_end()
+#endif
+
+/* Estimated 68040 cycles: "gencpu --cycles" puts cpuop_cycles(n) after
+   cpuop_begin() in every handler, regs.cycles wraps and is widened to 64 bits
+   by Get68kCycles() */
+#ifndef USE_CYCLE_STATS
+#define USE_CYCLE_STATS 0
+#endif
+#if USE_CYCLE_STATS
+#define cpuop_cycles(n)		(regs.cycles += (n))
+#else
+#define cpuop_cycles(n)		do { } while (0)
+#endif
+
+/* Delay loops ("dbra d0,*" on TimeDBRA counts): with DBCC_FAST_FORWARD a
+   DBcc that branches to itself skips to its last pass, and the passes
+   skipped are charged to the cycle count by m68k_dbcc_skip(n) */
+#ifndef DBCC_FAST_FORWARD
+#define DBCC_FAST_FORWARD 0
+#endif
+#if DBCC_FAST_FORWARD
+extern void m68k_dbcc_skip(uae_u32 n);
+#endif
+
+/* Handlers picked by "gencpu --hot-profile" run from internal RAM instead
+   of going through the flash cache */
+#ifndef CPUOP_HOT
+#ifdef ARDUINO
+#define CPUOP_HOT			IRAM_ATTR
+#else
+#define CPUOP_HOT
+#endif
+#endif
 
 typedef void REGPARAM2 cpuop_func (uae_u32) REGPARAM;
  
@@ -105,6 +194,18 @@ struct regstruct {
     flagtype	x;
     flagtype	stopped;
 
+#if USE_THREADED_DISPATCH
+    int			thread_budget;	/* handlers left before control returns to m68k_do_execute() */
+#endif
+#if USE_CYCLE_STATS
+    uae_u32		cycles;			/* estimated 68040 cycles, see cpuop_cycles() */
+#endif
+#if !(REAL_ADDRESSING || DIRECT_ADDRESSING)
+    uae_u8 *	pc_region_host;	/* RAM or ROM, whichever m68k_setpc() last */
+    uaecptr		pc_region_mac;	/* went into: host and Mac base and size */
+    uae_u32		pc_region_size;	/* (0 = none, look up the next target) */
+#endif
+
 #if USE_PREFETCH_BUFFER
     /* Fellow sources say this is 4 longwords. That's impossible. It needs
      * to be at least a longword. The HRM has some cryptic comment about two
@@ -192,6 +293,10 @@ static __inline__ uaecptr m68k_getpc (void)
 #endif
 }
 
+#if !(REAL_ADDRESSING || DIRECT_ADDRESSING)
+extern uae_u8 *m68k_pc_region (uaecptr newpc);
+#endif
+
 static __inline__ void m68k_setpc (uaecptr newpc)
 {
 #if ENABLE_MON
@@ -201,7 +306,12 @@ static __inline__ void m68k_setpc (uaecptr newpc)
 #if REAL_ADDRESSING || DIRECT_ADDRESSING
 	regs.pc_p = get_real_address(newpc);
 #else
-	regs.pc_p = regs.pc_oldp = get_real_address(newpc);
+	// Jumps within the current code region skip the bank lookup
+	uae_u32 offset = newpc - regs.pc_region_mac;
+	if (likely(offset < regs.pc_region_size))
+		regs.pc_p = regs.pc_oldp = regs.pc_region_host + offset;
+	else
+		regs.pc_p = regs.pc_oldp = m68k_pc_region(newpc);
 	regs.pc = newpc;
 #endif
 
@@ -291,6 +401,20 @@ static __inline__ void m68k_setstopped (int stop)
 extern uae_u32 get_disp_ea_020 (uae_u32 base, uae_u32 dp);
 extern uae_u32 get_disp_ea_000 (uae_u32 base, uae_u32 dp);
 
+/* (d8,An,Xn) and (d8,PC,Xn) in generated handlers: the brief extension word
+   is computed in place, only the full format (base and outer displacements,
+   memory indirection) calls get_disp_ea_020() */
+static __inline__ uae_u32 get_disp_ea_020_inline (uae_u32 base, uae_u32 dp)
+{
+	if (likely((dp & 0x100) == 0)) {
+		uae_s32 regd = regs.regs[(dp >> 12) & 15];
+		if ((dp & 0x800) == 0)
+			regd = (uae_s32)(uae_s16)regd;
+		return base + (uae_s32)(uae_s8)dp + ((uae_u32)regd << ((dp >> 9) & 3));
+	}
+	return get_disp_ea_020 (base, dp);
+}
+
 extern uae_s32 ShowEA (int reg, amodes mode, wordsizes size, char *buf);
 
 extern void MakeSR (void);
@@ -332,6 +456,17 @@ extern struct cputbl op_smalltbl_2_ff[];
 extern struct cputbl op_smalltbl_3_ff[];
 /* 68000 slow but compatible.  */
 extern struct cputbl op_smalltbl_4_ff[];
+#if USE_FIXED_RAM_ACCESSORS
+/* 68040 copies with RAM/ROM bounds as immediates (generated/cpuemu_ram*.cpp) */
+extern const struct cputbl op_smalltbl_0_ram4m[];
+extern const struct cputbl op_smalltbl_0_ram8m[];
+extern const struct cputbl op_smalltbl_0_ram12m[];
+extern const struct cputbl op_smalltbl_0_ram16m[];
+#endif
+#if USE_24BIT_ACCESSORS
+/* 68040 copy masking addresses to 24 bits (generated/cpuemu_a24.cpp) */
+extern const struct cputbl op_smalltbl_0_a24[];
+#endif
 
 #if FLIGHT_RECORDER
 extern void m68k_record_step(uaecptr) REGPARAM;
@@ -0,0 +1,190 @@
+/*
+ *  predecode.cpp - Pre-decoded basic block cache for the 68k interpreter
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#include "sysdeps.h"
+
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#include "mem_plan_esp32.h"
+#endif
+
+#include "cpu_emulation.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "predecode.h"
+#include "compiler/jit_riscv.h"
+
+#if USE_PREDECODE_CACHE
+
+predecode_block *predecode_blocks = NULL;
+uae_u32 *predecode_code_pages = NULL;
+uae_u32 predecode_ram_pages = 0;
+
+static uae_u32 predecode_bitmap_words = 0;
+
+
+/*
+ *  Allocate trace cache and page bitmap (RAM must already be allocated)
+ */
+
+bool predecode_init(void)
+{
+	size_t blocks_size = PREDECODE_BLOCKS * sizeof(predecode_block);
+
+	predecode_ram_pages = (RAMSize + (1 << PREDECODE_PAGE_SHIFT) - 1) >> PREDECODE_PAGE_SHIFT;
+	predecode_bitmap_words = (predecode_ram_pages + 31) / 32;
+
+#ifdef ARDUINO
+	// Both tables are touched on every replayed instruction or RAM write
+	predecode_blocks = (predecode_block *)MemPlanAlloc("predecode", blocks_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+	if (predecode_blocks == NULL) {
+		predecode_blocks = (predecode_block *)MemPlanAlloc("predecode", blocks_size, MALLOC_CAP_SPIRAM);
+		write_log("Predecode cache (%d KB) in PSRAM (fallback)\n", (int)(blocks_size / 1024));
+	} else {
+		write_log("Predecode cache (%d KB) in internal SRAM\n", (int)(blocks_size / 1024));
+	}
+	predecode_code_pages = (uae_u32 *)heap_caps_malloc(predecode_bitmap_words * sizeof(uae_u32), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#else
+	predecode_blocks = (predecode_block *)malloc(blocks_size);
+	predecode_code_pages = (uae_u32 *)malloc(predecode_bitmap_words * sizeof(uae_u32));
+#endif
+
+	if (predecode_blocks == NULL || predecode_code_pages == NULL) {
+		write_log("ERROR: Failed to allocate predecode cache!\n");
+		predecode_exit();
+		return false;
+	}
+
+#if JIT_BACKGROUND
+	// Never reset later: a translation still in the worker must not match
+	// a newer recording by chance
+	for (int i = 0; i < PREDECODE_BLOCKS; i++) {
+		predecode_blocks[i].gen = 0;
+		predecode_blocks[i].native_gen = ~0u;
+	}
+#endif
+	predecode_flush_all();
+	return true;
+}
+
+
+/*
+ *  Free trace cache
+ */
+
+void predecode_exit(void)
+{
+	if (predecode_blocks) {
+		free(predecode_blocks);
+		predecode_blocks = NULL;
+	}
+	if (predecode_code_pages) {
+		free(predecode_code_pages);
+		predecode_code_pages = NULL;
+	}
+}
+
+
+/*
+ *  Drop all traces
+ */
+
+void predecode_flush_all(void)
+{
+	for (int i = 0; i < PREDECODE_BLOCKS; i++) {
+		predecode_blocks[i].start = NULL;
+		predecode_blocks[i].count = 0;
+#if USE_RV_JIT
+		predecode_blocks[i].native = NULL;
+		predecode_blocks[i].hits = 0;
+#endif
+#if JIT_BACKGROUND
+		predecode_blocks[i].gen++;		// Stales queued and translated traces
+#endif
+	}
+	memset(predecode_code_pages, 0, predecode_bitmap_words * sizeof(uae_u32));
+}
+
+
+/*
+ *  Drop all traces with opcodes in [lo, hi)
+ */
+
+static void invalidate_host_range(uae_u8 *lo, uae_u8 *hi)
+{
+	for (int i = 0; i < PREDECODE_BLOCKS; i++) {
+		predecode_block *b = &predecode_blocks[i];
+		if (b->start != NULL && b->lo < hi && b->hi + 2 > lo)
+			b->start = NULL;
+	}
+}
+
+
+/*
+ *  Code was patched or loaded by the host (FlushCodeCache() hook)
+ */
+
+void predecode_invalidate(void *start, uint32 size)
+{
+	if (predecode_blocks == NULL || size == 0)
+		return;
+
+	uae_u8 *lo = (uae_u8 *)start;
+	uae_u8 *hi = lo + size;
+
+	// Skip the scan when the range is in RAM and touches no recorded page
+	if (lo >= RAMBaseHost && hi <= RAMBaseHost + RAMSize) {
+		uae_u32 first = (lo - RAMBaseHost) >> PREDECODE_PAGE_SHIFT;
+		uae_u32 last = (hi - 1 - RAMBaseHost) >> PREDECODE_PAGE_SHIFT;
+		bool hit = false;
+		for (uae_u32 page = first; page <= last; page++) {
+			if (predecode_code_pages[page >> 5] & (1u << (page & 31))) {
+				hit = true;
+				break;
+			}
+		}
+		if (!hit)
+			return;
+	}
+
+	invalidate_host_range(lo, hi);
+}
+
+
+/*
+ *  The 68k wrote to a page that holds recorded opcodes
+ */
+
+void predecode_write_hit(uae_u32 page)
+{
+	// The bit is set again when code on this page is recorded next time,
+	// so data writes next to code only pay for one scan
+	predecode_code_pages[page >> 5] &= ~(1u << (page & 31));
+
+	uae_u8 *lo = RAMBaseHost + (page << PREDECODE_PAGE_SHIFT);
+	invalidate_host_range(lo, lo + (1 << PREDECODE_PAGE_SHIFT));
+}
+
+
+/*
+ *  Mark the page of an opcode about to be recorded, returns false if
+ *  the code is outside RAM and ROM and must not be cached
+ */
+
+bool predecode_record_page(uae_u8 *pc_p)
+{
+	if (pc_p >= RAMBaseHost && pc_p < RAMBaseHost + RAMSize) {
+		uae_u32 page = (pc_p - RAMBaseHost) >> PREDECODE_PAGE_SHIFT;
+		predecode_code_pages[page >> 5] |= 1u << (page & 31);
+		return true;
+	}
+	// ROM is write-protected, patches go through FlushCodeCache()
+	return pc_p >= ROMBaseHost && pc_p < ROMBaseHost + ROMSize;
+}
+
+#endif /* USE_PREDECODE_CACHE */
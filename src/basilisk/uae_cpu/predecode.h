@@ -0,0 +1,88 @@
+/*
+ *  predecode.h - Pre-decoded basic block cache for the 68k interpreter
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A direct-mapped cache of instruction traces keyed by host PC. Each trace
+ *  remembers {pc_p, opcode, handler} for up to PREDECODE_BLOCK_LEN
+ *  instructions, so replaying it skips the opcode fetch and the cpufunctbl
+ *  lookup. Extension words are still read by the handlers themselves.
+ *
+ *  Traces are invalidated through FlushCodeCache() and through writes to
+ *  4 KB RAM pages that hold recorded opcodes (see predecode_check_write()).
+ *  The check sits in the inline put fast paths (memory.h) and in the RAM
+ *  bank handlers (memory.cpp) that take the writes the fast paths don't,
+ *  such as the 24-bit mirrors and the last 64 KB of RAM in 24-bit mode, so
+ *  a loader that patches code without flushing is still caught.
+ */
+
+#ifndef PREDECODE_H
+#define PREDECODE_H
+
+#ifndef USE_PREDECODE_CACHE
+#define USE_PREDECODE_CACHE 0
+#endif
+
+#if USE_PREDECODE_CACHE
+
+#if USE_THREADED_DISPATCH
+#error "USE_PREDECODE_CACHE replays one handler at a time, disable USE_THREADED_DISPATCH"
+#endif
+
+#define PREDECODE_BLOCKS		512		// Number of cached traces (power of two)
+#define PREDECODE_BLOCK_LEN		8		// Instructions per trace
+#define PREDECODE_PAGE_SHIFT	12		// Write-tracking granularity (4 KB)
+
+// Same as in newcpu.h; repeated because memory.h includes this header first
+typedef void REGPARAM2 cpuop_func (uae_u32) REGPARAM;
+
+struct predecode_insn {
+	uae_u8 *		pc_p;		// Host PC the instruction was recorded at
+	cpuop_func *	handler;
+	uae_u32			opcode;
+};
+
+struct predecode_block {
+	uae_u8 *		start;		// Host PC of the first instruction, NULL if free
+	uae_u8 *		lo;			// Lowest/highest recorded opcode address,
+	uae_u8 *		hi;			// used for range invalidation
+	int				count;
+#if USE_RV_JIT
+	int				(*native)(void);	// Translated trace, see compiler/jit_riscv.h
+	int				hits;				// Replays since recording
+#if JIT_BACKGROUND
+	uae_u32			gen;				// Bumped by every recording (CPU task)
+	uae_u32			native_gen;			// gen that native was translated from (worker)
+#endif
+#endif
+	predecode_insn	insn[PREDECODE_BLOCK_LEN];
+};
+
+extern predecode_block *predecode_blocks;
+extern uae_u32 *predecode_code_pages;		// One bit per RAM page holding recorded code
+extern uae_u32 predecode_ram_pages;
+
+#define PREDECODE_HASH(p)	((((uintptr)(p)) >> 1) & (PREDECODE_BLOCKS - 1))
+
+extern bool predecode_init(void);
+extern void predecode_exit(void);
+extern void predecode_flush_all(void);
+extern void predecode_invalidate(void *start, uint32 size);
+extern void predecode_write_hit(uae_u32 page);
+extern bool predecode_record_page(uae_u8 *pc_p);
+
+// Called on every RAM write; only the bitmap test sits on the hot path
+static inline void predecode_check_write(uaecptr addr, int size)
+{
+	uae_u32 first = addr >> PREDECODE_PAGE_SHIFT;
+	uae_u32 last = (addr + size - 1) >> PREDECODE_PAGE_SHIFT;
+	if (unlikely(predecode_code_pages[first >> 5] & (1u << (first & 31))))
+		predecode_write_hit(first);
+	if (unlikely(last != first && last < predecode_ram_pages
+			&& (predecode_code_pages[last >> 5] & (1u << (last & 31)))))
+		predecode_write_hit(last);
+}
+
+#endif /* USE_PREDECODE_CACHE */
+
+#endif /* PREDECODE_H */
@@ -30,6 +30,7 @@
 
 #ifdef ARDUINO
 #include <esp_heap_caps.h>
+#include "mem_plan_esp32.h"
 #endif
 
 int nr_cpuop_funcs;
@@ -821,7 +822,7 @@ void read_table68k (void)
 
 #ifdef ARDUINO
     // Allocate in PSRAM on ESP32 (~1.5MB)
-    table68k = (struct instr *)heap_caps_malloc (65536 * sizeof (struct instr), MALLOC_CAP_SPIRAM);
+    table68k = (struct instr *)MemPlanAlloc ("table68k", 65536 * sizeof (struct instr), MALLOC_CAP_SPIRAM);
     write_log("Allocated table68k (%d bytes) in PSRAM\n", 65536 * sizeof(struct instr));
 #else
     table68k = (struct instr *)malloc (65536 * sizeof (struct instr));
@@ -54,36 +54,42 @@ enum {
 };
 
 #if defined(ARDUINO_ARCH_ESP32) || defined(ESP32)
-/* Atomic read for ESP32 dual-core safety */
-#define SPCFLAGS_TEST(m) \
-	((__atomic_load_n(&regs.spcflags, __ATOMIC_SEQ_CST) & (m)) != 0)
+/* regs.spcflags belongs to the CPU task, which tests it after every
+   instruction, so it is read and written without atomics. Other tasks
+   (60Hz tick, audio, disk and network completion) ring spcflags_doorbell
+   with SPCFLAGS_POST() instead; m68k_do_execute() folds it in with
+   SPCFLAGS_COLLECT() once per batch, and the acquire there pairs with the
+   release in SPCFLAGS_POST(), so InterruptFlags etc. are current once a
+   flag is seen. A batch is at most SCHED_BATCH_MAX instructions. */
+extern spcflags_t spcflags_doorbell;
+
+#define SPCFLAGS_POST(m) do { \
+	__atomic_or_fetch(&spcflags_doorbell, (m), __ATOMIC_RELEASE); \
+} while (0)
+
+#define SPCFLAGS_COLLECT() do { \
+	if (__atomic_load_n(&spcflags_doorbell, __ATOMIC_RELAXED)) \
+		regs.spcflags |= __atomic_exchange_n(&spcflags_doorbell, 0, __ATOMIC_ACQUIRE); \
+} while (0)
 #else
+#define SPCFLAGS_POST(m) SPCFLAGS_SET(m)
+#define SPCFLAGS_COLLECT() do { } while (0)
+#endif
+
 #define SPCFLAGS_TEST(m) \
 	((regs.spcflags & (m)) != 0)
-#endif
 
 /* Macro only used in m68k_reset() */
 #define SPCFLAGS_INIT(m) do { \
 	regs.spcflags = (m); \
 } while (0)
 
-#if defined(ARDUINO_ARCH_ESP32) || defined(ESP32)
+#if defined(ARDUINO_ARCH_ESP32) || defined(ESP32) || !(ENABLE_EXCLUSIVE_SPCFLAGS)
 
-/*
- * ESP32 dual-core atomic operations using GCC builtins
- * Required for thread-safety when 60Hz timer runs on different core than CPU emulation
- */
+#if defined(ARDUINO_ARCH_ESP32) || defined(ESP32)
+/* Only the CPU task writes regs.spcflags, so no lock is needed */
 #define HAVE_HARDWARE_LOCKS
-
-#define SPCFLAGS_SET(m) do { \
-	__atomic_or_fetch(&regs.spcflags, (m), __ATOMIC_SEQ_CST); \
-} while (0)
-
-#define SPCFLAGS_CLEAR(m) do { \
-	__atomic_and_fetch(&regs.spcflags, ~(m), __ATOMIC_SEQ_CST); \
-} while (0)
-
-#elif !(ENABLE_EXCLUSIVE_SPCFLAGS)
+#endif
 
 #define SPCFLAGS_SET(m) do { \
 	regs.spcflags |= (m); \
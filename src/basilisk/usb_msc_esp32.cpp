@@ -0,0 +1,364 @@
+/*
+ *  usb_msc_esp32.cpp - USB disk mode: the SD card or an image as a USB drive
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  A maintenance mode picked in the boot GUI: the Type-C port becomes a
+ *  USB mass storage device (TinyUSB, through the Arduino USBMSC class)
+ *  showing either one disk image as a raw drive, which a Mac formatter
+ *  or dd sees as the disk itself, or the whole card, for copying images
+ *  onto it without pulling it out.
+ *
+ *  TinyUSB asks for a few KB per callback. Card commands that small
+ *  would cap the copy speed far below the bus, so the callbacks only
+ *  copy between TinyUSB and two USB_MSC_CHUNK buffers, and the disk task
+ *  moves whole chunks to and from the card with one SDMMC command each
+ *  (an image through its extent map). Reads prefetch the following chunk
+ *  into the other buffer while the host takes this one, and writes
+ *  collect into one buffer while the other is written out, so card and
+ *  bus transfers overlap.
+ *
+ *  A chunk being collected is written out once it is full, when the host
+ *  writes elsewhere or reads, after USB_MSC_IDLE_MS without writes, and
+ *  on eject or UsbMscStop().
+ */
+
+#include "sysdeps.h"
+
+#include <Arduino.h>
+#include <USB.h>
+#include <USBMSC.h>
+#include <FS.h>
+#include <esp_heap_caps.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+
+#include "sd_esp32.h"
+#include "usb_msc_esp32.h"
+
+#if USB_MSC
+
+#define USB_MSC_SECTOR          512
+#define USB_MSC_CHUNK           (256 * 1024)    // Bytes per card transfer, per buffer
+#define USB_MSC_CHUNK_SECTORS   (USB_MSC_CHUNK / USB_MSC_SECTOR)
+#define USB_MSC_IDLE_MS         100             // Write out a partial chunk after this
+
+#define USB_MSC_TASK_STACK      4096
+#define USB_MSC_TASK_PRIORITY   5               // Above TinyUSB's task, so the card keeps up
+
+enum {
+    BUF_EMPTY,
+    BUF_READ,           // Holds (or is being read with) sectors of the drive
+    BUF_WRITE           // Collects sectors the host wrote, or is being written out
+};
+
+struct msc_buffer {
+    uint8 *data;
+    int kind;
+    uint32 sector;      // First drive sector
+    uint32 count;       // Sectors held or collected
+    bool ok;            // Last transfer succeeded
+    SemaphoreHandle_t idle;     // Taken while the disk task has the buffer
+};
+
+static USBMSC msc;
+static msc_buffer buffers[2];
+static int collecting = -1;             // Buffer collecting writes, -1 = none
+static int next_collecting = 0;         // Buffer to collect the next chunk in
+static uint32 last_write_ms = 0;
+static SemaphoreHandle_t msc_lock = NULL;   // Buffer state, callbacks vs. the idle flush
+static QueueHandle_t jobs = NULL;
+static TaskHandle_t disk_task = NULL;
+
+static sd_extent_map *image_map = NULL;  // Drive is this image, NULL = the whole card
+static uint32 drive_sectors = 0;
+
+static usb_msc_stats stats;
+
+
+/*
+ *  Card transfers (disk task)
+ */
+
+static bool drive_transfer(uint8 *buf, uint32 sector, uint32 count, bool write)
+{
+    if (image_map) {
+        uint64 offset = (uint64)sector * USB_MSC_SECTOR;
+        size_t length = count * USB_MSC_SECTOR;
+        return write ? SDExtentWrite(image_map, buf, offset, length)
+                     : SDExtentRead(image_map, buf, offset, length);
+    }
+    return SDCardTransfer(buf, sector, count, write);
+}
+
+static void disk_task_loop(void *param)
+{
+    UNUSED(param);
+    for (;;) {
+        int i;
+        if (xQueueReceive(jobs, &i, pdMS_TO_TICKS(USB_MSC_IDLE_MS / 2)) == pdTRUE) {
+            msc_buffer &b = buffers[i];
+            b.ok = drive_transfer(b.data, b.sector, b.count, b.kind == BUF_WRITE);
+            if (!b.ok) {
+                stats.errors++;
+                Serial.printf("[USB_MSC] %s of %u sectors at %u failed\n",
+                              b.kind == BUF_WRITE ? "Write" : "Read", (unsigned)b.count, (unsigned)b.sector);
+            }
+            xSemaphoreGive(b.idle);
+            continue;
+        }
+
+        // Nothing for a while: write out a partial chunk. Only if no
+        // callback holds the lock, it may be waiting for this task.
+        if (xSemaphoreTake(msc_lock, 0) == pdTRUE) {
+            if (collecting >= 0 && millis() - last_write_ms >= USB_MSC_IDLE_MS) {
+                int c = collecting;
+                collecting = -1;
+                xSemaphoreTake(buffers[c].idle, portMAX_DELAY);
+                xQueueSend(jobs, &c, portMAX_DELAY);
+            }
+            xSemaphoreGive(msc_lock);
+        }
+    }
+}
+
+// Hand a buffer to the disk task; the caller took its idle semaphore
+static inline void submit(int i)
+{
+    xQueueSend(jobs, &i, portMAX_DELAY);
+}
+
+// Wait until the disk task is done with a buffer
+static inline void wait_idle(int i)
+{
+    xSemaphoreTake(buffers[i].idle, portMAX_DELAY);
+    xSemaphoreGive(buffers[i].idle);
+}
+
+static void start_read(int i, uint32 sector)
+{
+    msc_buffer &b = buffers[i];
+    xSemaphoreTake(b.idle, portMAX_DELAY);
+    b.kind = BUF_READ;
+    b.sector = sector;
+    b.count = drive_sectors - sector;
+    if (b.count > USB_MSC_CHUNK_SECTORS) {
+        b.count = USB_MSC_CHUNK_SECTORS;
+    }
+    submit(i);
+}
+
+// Start writing out the collected chunk (msc_lock held)
+static void submit_collected(void)
+{
+    if (collecting >= 0) {
+        int c = collecting;
+        collecting = -1;
+        xSemaphoreTake(buffers[c].idle, portMAX_DELAY);
+        submit(c);
+    }
+}
+
+static inline bool holds(const msc_buffer &b, uint32 sector, uint32 count)
+{
+    return b.kind == BUF_READ && sector >= b.sector && sector + count <= b.sector + b.count;
+}
+
+
+/*
+ *  TinyUSB callbacks
+ */
+
+static int32_t msc_read(uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+{
+    uint32 sector = lba + offset / USB_MSC_SECTOR;
+    uint32 count = bufsize / USB_MSC_SECTOR;
+    if (sector + count > drive_sectors) {
+        return -1;
+    }
+
+    xSemaphoreTake(msc_lock, portMAX_DELAY);
+
+    // What the host wrote goes to the card before anything is read back
+    submit_collected();
+    for (int i = 0; i < 2; i++) {
+        if (buffers[i].kind == BUF_WRITE) {
+            wait_idle(i);
+            buffers[i].kind = BUF_EMPTY;
+        }
+    }
+
+    int i = holds(buffers[0], sector, count) ? 0 : holds(buffers[1], sector, count) ? 1 : -1;
+    if (i < 0) {
+        // Not read ahead: read from here, then prefetch into the other one
+        i = 0;
+        start_read(i, sector);
+    }
+    wait_idle(i);
+    bool ok = buffers[i].ok;
+    if (ok) {
+        memcpy(buffer, buffers[i].data + (sector - buffers[i].sector) * USB_MSC_SECTOR, bufsize);
+        stats.read_bytes += bufsize;
+    } else {
+        buffers[i].kind = BUF_EMPTY;
+    }
+
+    // Keep the next chunk coming in the other buffer
+    uint32 next = buffers[i].sector + buffers[i].count;
+    int j = 1 - i;
+    if (ok && next < drive_sectors && !(buffers[j].kind == BUF_READ && buffers[j].sector == next)) {
+        start_read(j, next);
+    }
+
+    xSemaphoreGive(msc_lock);
+    return ok ? (int32_t)bufsize : -1;
+}
+
+static int32_t msc_write(uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
+{
+    uint32 sector = lba + offset / USB_MSC_SECTOR;
+    uint32 count = bufsize / USB_MSC_SECTOR;
+    if (sector + count > drive_sectors) {
+        return -1;
+    }
+
+    xSemaphoreTake(msc_lock, portMAX_DELAY);
+
+    // Read-ahead data is stale now
+    for (int i = 0; i < 2; i++) {
+        if (buffers[i].kind == BUF_READ) {
+            wait_idle(i);
+            buffers[i].kind = BUF_EMPTY;
+        }
+    }
+
+    // Continue the collected chunk if this follows it and fits
+    if (collecting >= 0) {
+        const msc_buffer &c = buffers[collecting];
+        if (sector != c.sector + c.count || c.count + count > USB_MSC_CHUNK_SECTORS) {
+            submit_collected();
+        }
+    }
+    if (collecting < 0) {
+        // The other buffer may still be writing out the previous chunk
+        collecting = next_collecting;
+        next_collecting = 1 - next_collecting;
+        wait_idle(collecting);
+        buffers[collecting].kind = BUF_WRITE;
+        buffers[collecting].sector = sector;
+        buffers[collecting].count = 0;
+    }
+    msc_buffer &c = buffers[collecting];
+    memcpy(c.data + c.count * USB_MSC_SECTOR, buffer, bufsize);
+    c.count += count;
+    stats.write_bytes += bufsize;
+    last_write_ms = millis();
+    if (c.count == USB_MSC_CHUNK_SECTORS) {
+        submit_collected();
+    }
+
+    xSemaphoreGive(msc_lock);
+    return bufsize;
+}
+
+// Write everything out and wait for it
+static void msc_flush(void)
+{
+    xSemaphoreTake(msc_lock, portMAX_DELAY);
+    submit_collected();
+    wait_idle(0);
+    wait_idle(1);
+    xSemaphoreGive(msc_lock);
+}
+
+static bool msc_start_stop(uint8_t power_condition, bool start, bool load_eject)
+{
+    UNUSED(power_condition);
+    if (!start && load_eject) {
+        msc_flush();
+        stats.ejected = true;
+        Serial.println("[USB_MSC] Ejected by the host");
+    }
+    return true;
+}
+
+
+/*
+ *  Start/stop
+ */
+
+bool UsbMscStart(const char *path)
+{
+    if (SDCardSectors() == 0) {
+        Serial.println("[USB_MSC] Needs the card in SDMMC mode");
+        return false;
+    }
+    if (path) {
+        File f = SDCardFS().open(path, FILE_READ);
+        if (!f) {
+            return false;
+        }
+        drive_sectors = f.size() / USB_MSC_SECTOR;
+        f.close();
+        image_map = SDExtentMapBuild(path);
+        if (!image_map || drive_sectors == 0 || !SDExtentCovers(image_map, 0, (size_t)drive_sectors * USB_MSC_SECTOR)) {
+            Serial.printf("[USB_MSC] Can't map %s\n", path);
+            SDExtentMapFree(image_map);
+            image_map = NULL;
+            return false;
+        }
+    } else {
+        drive_sectors = SDCardSectors();
+    }
+
+    msc_lock = xSemaphoreCreateMutex();
+    jobs = xQueueCreate(2, sizeof(int));
+    for (int i = 0; i < 2; i++) {
+        buffers[i].data = (uint8 *)heap_caps_aligned_alloc(64, USB_MSC_CHUNK, MALLOC_CAP_SPIRAM);
+        buffers[i].kind = BUF_EMPTY;
+        buffers[i].idle = xSemaphoreCreateBinary();
+        xSemaphoreGive(buffers[i].idle);
+    }
+    if (!msc_lock || !jobs || !buffers[0].data || !buffers[1].data ||
+        xTaskCreatePinnedToCore(disk_task_loop, "USBDisk", USB_MSC_TASK_STACK, NULL,
+                                USB_MSC_TASK_PRIORITY, &disk_task, 0) != pdPASS) {
+        Serial.println("[USB_MSC] ERROR: out of memory");
+        return false;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    msc.vendorID("M5Tab");
+    msc.productID(path ? "Mac disk image" : "SD card");
+    msc.productRevision("1.0");
+    msc.onRead(msc_read);
+    msc.onWrite(msc_write);
+    msc.onStartStop(msc_start_stop);
+    msc.isWritable(true);
+    msc.mediaPresent(true);
+    if (!msc.begin(drive_sectors, USB_MSC_SECTOR) || !USB.begin()) {
+        Serial.println("[USB_MSC] ERROR: USB device didn't start");
+        return false;
+    }
+    Serial.printf("[USB_MSC] Serving %s, %u MB, in %u KB transfers\n", path ? path : "the SD card",
+                  (unsigned)(drive_sectors / 2048), (unsigned)(USB_MSC_CHUNK / 1024));
+    return true;
+}
+
+void UsbMscStop(void)
+{
+    msc.mediaPresent(false);
+    msc_flush();
+    msc.end();
+    Serial.printf("[USB_MSC] Stopped: %llu MB read, %llu MB written, %u errors\n",
+                  (unsigned long long)(stats.read_bytes >> 20),
+                  (unsigned long long)(stats.write_bytes >> 20), (unsigned)stats.errors);
+}
+
+void UsbMscGetStats(usb_msc_stats &out)
+{
+    out = stats;
+}
+
+#endif
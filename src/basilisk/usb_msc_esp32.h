@@ -0,0 +1,38 @@
+/*
+ *  usb_msc_esp32.h - USB disk mode: the SD card or an image as a USB drive
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef USB_MSC_ESP32_H
+#define USB_MSC_ESP32_H
+
+#ifndef USB_MSC
+#define USB_MSC 0
+#endif
+
+#if USB_MSC
+
+/*
+ *  Serve the image at path, or with NULL the whole card, as a USB mass
+ *  storage device until UsbMscStop(). Started from the boot GUI before
+ *  the emulator, which can't run alongside: the host owns the sectors,
+ *  so nothing may use the card's file system until the restart.
+ */
+extern bool UsbMscStart(const char *path);
+
+// Write back what the host wrote and detach
+extern void UsbMscStop(void);
+
+struct usb_msc_stats {
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint32_t errors;        // Failed card transfers
+    bool ejected;           // The host ejected the drive
+};
+
+extern void UsbMscGetStats(usb_msc_stats &stats);
+
+#endif
+
+#endif // USB_MSC_ESP32_H
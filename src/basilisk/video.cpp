@@ -36,6 +36,8 @@
 #include "slot_rom.h"
 #include "video.h"
 #include "video_defs.h"
+#include "rom_patches.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -393,10 +395,16 @@ void monitor_desc::switch_mode(vector<video_mode>::const_iterator it, uint32 par
 	r.d[0] = 0x0006;
 	Execute68kTrap(0xa06e, &r); // SFindStruct()
 	uint32 minor_base = ReadMacInt32(slot_param + spPointer) - ROMBaseMac;
+#if ROM_FLASH_XIP
+	uint8 base_bytes[4] = {uint8(mac_frame_base >> 24), uint8(mac_frame_base >> 16),
+	                       uint8(mac_frame_base >> 8), uint8(mac_frame_base)};
+	ROMWrite(minor_base, base_bytes, 4);
+#else
 	ROMBaseHost[minor_base + 0] = mac_frame_base >> 24;
 	ROMBaseHost[minor_base + 1] = mac_frame_base >> 16;
 	ROMBaseHost[minor_base + 2] = mac_frame_base >> 8;
 	ROMBaseHost[minor_base + 3] = mac_frame_base;
+#endif
 
 	// Patch video mode parameter table
 	WriteMacInt32(slot_param + spPointer, rsrc);
@@ -407,12 +415,25 @@ void monitor_desc::switch_mode(vector<video_mode>::const_iterator it, uint32 par
 	r.d[0] = 0x0006;
 	Execute68kTrap(0xa06e, &r); // SFindStruct()
 	uint32 p = ReadMacInt32(slot_param + spPointer) - ROMBaseMac;
+#if ROM_FLASH_XIP
+	// One sector rewrite for the whole table entry (the ROM is in flash)
+	uint8 params[10];
+	memcpy(params, ROMBaseHost + p + 8, sizeof(params));
+	params[0] = mode.bytes_per_row >> 8;
+	params[1] = mode.bytes_per_row;
+	params[6] = mode.y >> 8;
+	params[7] = mode.y;
+	params[8] = mode.x >> 8;
+	params[9] = mode.x;
+	ROMWrite(p + 8, params, sizeof(params));
+#else
 	ROMBaseHost[p +  8] = mode.bytes_per_row >> 8;
 	ROMBaseHost[p +  9] = mode.bytes_per_row;
 	ROMBaseHost[p + 14] = mode.y >> 8;
 	ROMBaseHost[p + 15] = mode.y;
 	ROMBaseHost[p + 16] = mode.x >> 8;
 	ROMBaseHost[p + 17] = mode.x;
+#endif
 
 	// Recalculate slot ROM checksum
 	ChecksumSlotROM();
@@ -448,6 +469,66 @@ void monitor_desc::switch_mode(vector<video_mode>::const_iterator it, uint32 par
 }
 
 
+#if MAC_SNAPSHOT
+/*
+ *  Save or restore the driver state
+ */
+
+bool monitor_desc::snapshot(void)
+{
+	uint32 mode_index = current_mode - modes.begin();
+	uint32 mode_count = modes.size();
+	if (!SnapshotVar(mode_count) || !SnapshotVar(mode_index)
+	 || !SnapshotVar(palette) || !SnapshotVar(luminance_mapping) || !SnapshotVar(interrupts_enabled) || !SnapshotVar(dm_present)
+	 || !SnapshotVar(gamma_table) || !SnapshotVar(alloc_gamma_table_size)
+	 || !SnapshotVar(current_apple_mode) || !SnapshotVar(current_id) || !SnapshotVar(preferred_apple_mode) || !SnapshotVar(preferred_id)
+	 || !SnapshotVar(slot_param))
+		return false;
+	if (!SnapshotRestoring())
+		return true;
+
+	if (mode_count != modes.size() || mode_index >= mode_count)
+		return false;
+	if (current_mode != modes.begin() + mode_index) {
+		current_mode = modes.begin() + mode_index;
+		switch_to_current_mode();
+	}
+	set_palette(palette, palette_size(current_mode->depth));
+	return true;
+}
+
+bool VideoSnapshot(void)
+{
+	uint32 count = VideoMonitors.size();
+	if (!SnapshotVar(count) || count != VideoMonitors.size())
+		return false;
+	for (vector<monitor_desc *>::const_iterator m = VideoMonitors.begin(); m != VideoMonitors.end(); ++m) {
+		if (!(*m)->snapshot())
+			return false;
+	}
+
+	// Mode switches rewrite the slot ROM, keep it as the Mac last saw it
+	uint32 size = GetSlotROMSize();
+	if (!SnapshotVar(size) || size != (uint32)GetSlotROMSize())
+		return false;
+	uint8 *slot = ROMBaseHost + ROMSize - size;
+	if (!SnapshotRestoring())
+		return SnapshotData(slot, size);
+	uint8 *saved = new uint8[size];
+	bool ok = SnapshotData(saved, size);
+	if (ok && memcmp(saved, slot, size)) {
+#if ROM_FLASH_XIP
+		ROMWrite(ROMSize - size, saved, size);
+#else
+		memcpy(slot, saved, size);
+#endif
+	}
+	delete[] saved;
+	return ok;
+}
+#endif
+
+
 /*
  *  Driver Open() routine
  */
@@ -512,7 +593,8 @@ int16 monitor_desc::driver_control(uint16 code, uint32 param, uint32 dce)
 			// Set old base address in case the switch fails
 			WriteMacInt32(param + csBaseAddr, mac_frame_base);
 
-			if (ReadMacInt16(param + csPage))
+			int16 page = ReadMacInt16(param + csPage);
+			if (page < 0 || page >= page_count())
 				return paramErr;
 
 			if (mode != current_apple_mode) {
@@ -521,7 +603,10 @@ int16 monitor_desc::driver_control(uint16 code, uint32 param, uint32 dce)
 					return paramErr;
 				switch_mode(i, param, dce);
 			}
-			D(bug("  base %08x\n", mac_frame_base));
+			if (page != displayed_page())
+				show_page(page);
+			WriteMacInt32(param + csBaseAddr, page_base(page));
+			D(bug("  base %08x\n", page_base(page)));
 			return noErr;
 		}
 
@@ -610,8 +695,9 @@ int16 monitor_desc::driver_control(uint16 code, uint32 param, uint32 dce)
 		}
 
 		case cscGrayPage: {		// Fill page with dithered gray pattern
-			D(bug(" GrayPage %d\n", ReadMacInt16(param + csPage)));
-			if (ReadMacInt16(param + csPage))
+			int16 page = ReadMacInt16(param + csPage);
+			D(bug(" GrayPage %d\n", page));
+			if (page < 0 || page >= page_count())
 				return paramErr;
 
 			uint32 pattern[6] = {
@@ -622,7 +708,7 @@ int16 monitor_desc::driver_control(uint16 code, uint32 param, uint32 dce)
 				0xffff0000,		// 16 bpp
 				0xffffffff		// 32 bpp
 			};
-			uint32 p = mac_frame_base;
+			uint32 p = page_base(page);
 			uint32 pat = pattern[current_mode->depth];
 			bool invert = (current_mode->depth == VDEPTH_32BIT);
 			for (uint32 y=0; y<current_mode->y; y++) {
@@ -665,7 +751,8 @@ int16 monitor_desc::driver_control(uint16 code, uint32 param, uint32 dce)
 			// Set old base address in case the switch fails
 			WriteMacInt32(param + csBaseAddr, mac_frame_base);
 
-			if (ReadMacInt16(param + csPage))
+			int16 page = ReadMacInt16(param + csPage);
+			if (page < 0 || page >= page_count())
 				return paramErr;
 
 			if (mode != current_apple_mode || id != current_id) {
@@ -674,7 +761,10 @@ int16 monitor_desc::driver_control(uint16 code, uint32 param, uint32 dce)
 					return paramErr;
 				switch_mode(i, param, dce);
 			}
-			D(bug("  base %08x\n", mac_frame_base));
+			if (page != displayed_page())
+				show_page(page);
+			WriteMacInt32(param + csBaseAddr, page_base(page));
+			D(bug("  base %08x\n", page_base(page)));
 			return noErr;
 		}
 
@@ -719,8 +809,8 @@ int16 monitor_desc::driver_status(uint16 code, uint32 param)
 		case cscGetMode:			// Get current color depth
 			D(bug(" GetMode -> %04x, base %08x\n", current_apple_mode, mac_frame_base));
 			WriteMacInt16(param + csMode, current_apple_mode);
-			WriteMacInt16(param + csPage, 0);
-			WriteMacInt32(param + csBaseAddr, mac_frame_base);
+			WriteMacInt16(param + csPage, displayed_page());
+			WriteMacInt32(param + csBaseAddr, page_base(displayed_page()));
 			return noErr;
 
 		case cscGetEntries: {		// Read palette
@@ -762,17 +852,20 @@ int16 monitor_desc::driver_status(uint16 code, uint32 param)
 		}
 
 		case cscGetPages:			// Get number of pages
-			D(bug(" GetPages -> 1\n"));
-			WriteMacInt16(param + csPage, 1);
+			D(bug(" GetPages -> %d\n", page_count()));
+			WriteMacInt16(param + csPage, page_count());
 			return noErr;
 
-		case cscGetBaseAddress:		// Get page base address
-			D(bug(" GetBaseAddress -> %08x\n", mac_frame_base));
-			WriteMacInt32(param + csBaseAddr, mac_frame_base);
-			if (ReadMacInt16(param + csPage))
+		case cscGetBaseAddress: {	// Get page base address
+			int16 page = ReadMacInt16(param + csPage);
+			D(bug(" GetBaseAddress %d -> %08x\n", page, page_base(page)));
+			if (page < 0 || page >= page_count()) {
+				WriteMacInt32(param + csBaseAddr, mac_frame_base);
 				return paramErr;
-			else
-				return noErr;
+			}
+			WriteMacInt32(param + csBaseAddr, page_base(page));
+			return noErr;
+		}
 
 		case cscGetGray:			// Get luminance mapping flag
 			D(bug(" GetGray -> %d\n", luminance_mapping));
@@ -798,8 +891,8 @@ int16 monitor_desc::driver_status(uint16 code, uint32 param)
 			D(bug(" GetCurMode -> %04x/%08x, base %08x\n", current_apple_mode, current_id, mac_frame_base));
 			WriteMacInt16(param + csMode, current_apple_mode);
 			WriteMacInt32(param + csData, current_id);
-			WriteMacInt16(param + csPage, 0);
-			WriteMacInt32(param + csBaseAddr, mac_frame_base);
+			WriteMacInt16(param + csPage, displayed_page());
+			WriteMacInt32(param + csBaseAddr, page_base(displayed_page()));
 			return noErr;
 
 		case cscGetConnection:		// Get monitor information
@@ -923,7 +1016,7 @@ int16 monitor_desc::driver_status(uint16 code, uint32 param)
 					WriteMacInt16(vp + vpPixelSize, pix_size);
 					WriteMacInt16(vp + vpCmpCount, cmp_count);
 					WriteMacInt16(vp + vpCmpSize, cmp_size);
-					WriteMacInt32(param + csPageCount, 1);
+					WriteMacInt32(param + csPageCount, page_count());
 					WriteMacInt32(param + csDeviceType, dev_type);
 					return noErr;
 				}
@@ -967,3 +1060,168 @@ int16 VideoDriverStatus(uint32 pb, uint32 dce)
 	else
 		return nsDrvErr;
 }
+
+
+#if VIDEO_CURSOR_OVERLAY
+/*
+ *  Cursor overlay - replacements for the QuickDraw cursor vectors
+ *  The cursor level, obscuring and mouse pinning follow the Cursor Utilities
+ *  in Inside Macintosh: Imaging With QuickDraw; drawing is left to the
+ *  platform, which composites the cursor over the screen.
+ */
+
+// Cursor low-memory globals
+const uint32 lmMTemp = 0x828;		// Point: new mouse position
+const uint32 lmMouse = 0x830;		// Point: processed (pinned) mouse position
+const uint32 lmCrsrPin = 0x834;		// Rect: cursor pinning rectangle
+const uint32 lmTheCrsr = 0x844;		// Cursor: current cursor record
+const uint32 lmCrsrVis = 0x8cc;		// Byte: cursor is showing
+const uint32 lmCrsrBusy = 0x8cd;	// Byte: cursor is being changed
+const uint32 lmCrsrNew = 0x8ce;		// Byte: mouse has moved
+const uint32 lmCrsrCouple = 0x8cf;	// Byte: cursor follows the mouse
+const uint32 lmCrsrState = 0x8d0;	// Word: cursor level (0 = showing)
+const uint32 lmCrsrObscure = 0x8d2;	// Byte: hidden until the mouse moves
+
+// Standard arrow cursor (for InitCursor)
+static const uint16 arrow_cursor[34] = {
+	0x0000, 0x4000, 0x6000, 0x7000, 0x7800, 0x7c00, 0x7e00, 0x7f00,
+	0x7f80, 0x7c00, 0x6c00, 0x4600, 0x0600, 0x0300, 0x0300, 0x0000,
+	0xc000, 0xe000, 0xf000, 0xf800, 0xfc00, 0xfe00, 0xff00, 0xff80,
+	0xffc0, 0xffe0, 0xfe00, 0xef00, 0xcf00, 0x8780, 0x0780, 0x0380,
+	0x0001, 0x0001		// hotSpot (v, h)
+};
+
+// ShieldCursor() calls not yet balanced by ShowCursor(); they only protect
+// frame buffer pixels, so they must not hide an overlay cursor
+static int shield_depth = 0;
+
+// Copy a 68-byte Cursor record (data, mask, hotSpot) to TheCrsr and the platform
+static void cursor_load(uint32 crsr)
+{
+	uint16 data[16], mask[16];
+	for (int i = 0; i < 16; i++) {
+		data[i] = ReadMacInt16(crsr + i * 2);
+		mask[i] = ReadMacInt16(crsr + 32 + i * 2);
+	}
+	if (crsr != lmTheCrsr)
+		Mac2Mac_memcpy(lmTheCrsr, crsr, 68);
+	video_cursor_set_image(data, mask, (int16)ReadMacInt16(crsr + 66), (int16)ReadMacInt16(crsr + 64));
+}
+
+static void cursor_load_arrow(void)
+{
+	for (int i = 0; i < 34; i++)
+		WriteMacInt16(lmTheCrsr + i * 2, arrow_cursor[i]);
+	cursor_load(lmTheCrsr);
+}
+
+// Hand the current position and visibility to the platform
+static void cursor_publish(void)
+{
+	int16 level = ReadMacInt16(lmCrsrState) + shield_depth;
+	bool visible = level >= 0 && ReadMacInt8(lmCrsrObscure) == 0;
+	WriteMacInt8(lmCrsrVis, visible ? 1 : 0);
+	video_cursor_update((int16)ReadMacInt16(lmMouse + 2), (int16)ReadMacInt16(lmMouse), visible);
+}
+
+/*
+ *  Take over from QuickDraw's cursor (vectors already replaced)
+ */
+
+void VideoCursorInit(void)
+{
+	shield_depth = 0;
+	WriteMacInt8(lmCrsrObscure, 0);
+	cursor_load(lmTheCrsr);
+	cursor_publish();
+}
+
+/*
+ *  M68K_EMUL_OP_CURSOR: the stub pushed the selector word (CURSOR_OP_*) on
+ *  top of the vector's return address and Pascal parameters; pop both
+ */
+
+void VideoCursorOp(M68kRegisters *r)
+{
+	uint16 sel = ReadMacInt16(r->a[7]);
+	uint32 ret_sp = r->a[7] + 2;
+	uint32 params = ret_sp + 4;
+	uint32 param_bytes = 0;
+	int16 level = ReadMacInt16(lmCrsrState);
+
+	switch (sel) {
+		case CURSOR_OP_HIDE:
+			level--;
+			break;
+
+		case CURSOR_OP_SHOW:
+			if (shield_depth > 0)
+				shield_depth--;
+			if (level < 0)
+				level++;
+			break;
+
+		case CURSOR_OP_SHIELD:		// ShieldCursor(shieldRect, offsetPt)
+			level--;
+			shield_depth++;
+			param_bytes = 8;
+			break;
+
+		case CURSOR_OP_OBSCURE:
+			WriteMacInt8(lmCrsrObscure, 0xff);
+			break;
+
+		case CURSOR_OP_SET:			// SetCursor(crsr: Cursor)
+			cursor_load(ReadMacInt32(params));
+			param_bytes = 4;
+			break;
+
+		case CURSOR_OP_SET_COLOR: {	// SetCCursor(cCrsr: CCrsrHandle)
+			// Use the black-and-white image (crsr1Data, crsrMask, crsrHotSpot)
+			uint32 ccrsr = ReadMacInt32(ReadMacInt32(params));
+			if (ccrsr)
+				cursor_load(ccrsr + 20);
+			param_bytes = 4;
+			break;
+		}
+
+		case CURSOR_OP_INIT:
+			cursor_load_arrow();
+			level = 0;
+			shield_depth = 0;
+			WriteMacInt8(lmCrsrObscure, 0);
+			break;
+
+		case CURSOR_OP_TASK:
+			// Move the cursor to the new mouse position, pinned to CrsrPin
+			if (ReadMacInt8(lmCrsrNew) && !ReadMacInt8(lmCrsrBusy)) {
+				WriteMacInt8(lmCrsrNew, 0);
+				if (ReadMacInt8(lmCrsrCouple)) {
+					int16 v = ReadMacInt16(lmMTemp);
+					int16 h = ReadMacInt16(lmMTemp + 2);
+					int16 top = ReadMacInt16(lmCrsrPin), left = ReadMacInt16(lmCrsrPin + 2);
+					int16 bottom = ReadMacInt16(lmCrsrPin + 4), right = ReadMacInt16(lmCrsrPin + 6);
+					if (v >= bottom) v = bottom - 1;
+					if (v < top) v = top;
+					if (h >= right) h = right - 1;
+					if (h < left) h = left;
+					WriteMacInt16(lmMouse, v);
+					WriteMacInt16(lmMouse + 2, h);
+					WriteMacInt16(lmMTemp, v);
+					WriteMacInt16(lmMTemp + 2, h);
+					WriteMacInt8(lmCrsrObscure, 0);
+				}
+			}
+			break;
+	}
+
+	WriteMacInt16(lmCrsrState, level);
+
+	// Drop the selector and parameters, keep the return address for the RTS
+	uint32 ret = ReadMacInt32(ret_sp);
+	r->a[7] = ret_sp + param_bytes;
+	WriteMacInt32(r->a[7], ret);
+
+	cursor_publish();
+}
+#endif
@@ -19,9 +19,11 @@
  *     - Working buffers placed in internal SRAM for fast access
  *  
  *  TUNING PARAMETERS (defined below):
- *  - TILE_WIDTH/TILE_HEIGHT: Tile size in Mac pixels (40x40 default)
+ *  - TILE_WIDTH/TILE_HEIGHT: Tile size in Mac pixels (40x40 default, per
+ *    mode with VIDEO_TILE_GEOMETRY and the "videotile" pref)
  *  - DIRTY_THRESHOLD_PERCENT: Threshold for switching to full update (80% default)
- *  - VIDEO_SIGNAL_INTERVAL: Frame rate target in main_esp32.cpp (~15 FPS)
+ *  - VIDEO_DEFAULT_MAX_FPS/VIDEO_DEFAULT_BUDGET_KBS: adaptive frame pacing
+ *    limits ("videofps"/"videobudget" prefs)
  */
 
 #include "sysdeps.h"
@@ -31,6 +33,14 @@
 #include "prefs.h"
 #include "video.h"
 #include "video_defs.h"
+#include "input.h"
+#include "mem_plan_esp32.h"
+#include "perf_esp32.h"
+#include "log_esp32.h"
+#include "boot_timeline_esp32.h"
+#include "vnc_esp32.h"
+#include "screenrec_esp32.h"
+#include "power_esp32.h"
 
 #include <M5Unified.h>
 #include <M5GFX.h>
@@ -46,6 +56,9 @@
 // ESP-IDF memory attributes (DRAM_ATTR for internal SRAM placement)
 #include "esp_attr.h"
 
+// Cycle counter (VIDEO_PIPELINE_BENCH stage timing)
+#include "esp_cpu.h"
+
 // Cache control for DMA visibility
 #if __has_include(<esp_cache.h>)
 #include <esp_cache.h>
@@ -60,25 +73,51 @@
 #define DEBUG 1
 #include "debug.h"
 
-// Display configuration - 640x360 with 2x pixel doubling for 1280x720 display
+// Display configuration - default mode is 640x360 with 2x pixel doubling for
+// the 1280x720 display; the 1280x720 mode is shown 1:1
 #define MAC_SCREEN_WIDTH  640
 #define MAC_SCREEN_HEIGHT 360
 #define MAC_SCREEN_DEPTH  VDEPTH_8BIT  // 8-bit indexed color
-#define PIXEL_SCALE       2            // 2x scaling to fill 1280x720
 
 // Physical display dimensions
 #define DISPLAY_WIDTH     1280
 #define DISPLAY_HEIGHT    720
 
+// Largest Mac mode (1:1) and pixel size; the frame buffer is allocated for it
+#define MAC_MAX_WIDTH     DISPLAY_WIDTH
+#define MAC_MAX_HEIGHT    DISPLAY_HEIGHT
+#define MAC_MAX_BYTES_PER_PIXEL 2      // 16-bit direct colour
+
 // Tile-based dirty tracking configuration
-// Tile size: 40x40 Mac pixels (80x80 display pixels after 2x scaling)
-// Grid: 16 columns x 9 rows = 144 tiles total
-// Coverage: 640x360 exactly (40*16=640, 40*9=360)
+// Tile size: 40x40 Mac pixels (80x80 display pixels with 2x scaling)
+// The grid follows the current mode at runtime (tiles_x, tiles_y):
+// 16x9 = 144 tiles at 640x360, 32x18 = 576 tiles at 1280x720
 #define TILE_WIDTH        40
 #define TILE_HEIGHT       40
-#define TILES_X           16
-#define TILES_Y           9
-#define TOTAL_TILES       (TILES_X * TILES_Y)  // 144 tiles
+
+// Runtime tile geometry: the tile size (tile_width, tile_height) is picked
+// per mode from tile_geometries[] in updateVideoStateCache(), by the
+// "videotile" pref or automatically. Every size divides both resolutions
+// and has byte-aligned rows at 1 bit. The bitmaps and tile tables are
+// sized for the smallest tiles at 1280x720 (3200 tiles, the colour sets
+// then take 100KB of PSRAM).
+#ifndef VIDEO_TILE_GEOMETRY
+#define VIDEO_TILE_GEOMETRY 0
+#endif
+
+#if VIDEO_TILE_GEOMETRY
+#define TILE_MIN_WIDTH    16
+#define TILE_MIN_HEIGHT   18
+#define TILE_MAX_PIXELS   (64 * 36)     // Largest tile area
+#else
+#define TILE_MIN_WIDTH    TILE_WIDTH
+#define TILE_MIN_HEIGHT   TILE_HEIGHT
+#define TILE_MAX_PIXELS   (TILE_WIDTH * TILE_HEIGHT)
+#endif
+#define MAX_TILES_X       (MAC_MAX_WIDTH / TILE_MIN_WIDTH)
+#define MAX_TILES_Y       (MAC_MAX_HEIGHT / TILE_MIN_HEIGHT)
+#define MAX_TOTAL_TILES   (MAX_TILES_X * MAX_TILES_Y)
+#define TILE_BITMAP_WORDS ((MAX_TOTAL_TILES + 31) / 32)
 
 // Dirty tile threshold - if more than this percentage of tiles are dirty,
 // do a full update instead of partial
@@ -87,6 +126,95 @@
 // double-buffered DMA while streaming mode processes rows sequentially
 #define DIRTY_THRESHOLD_PERCENT  101
 
+// Vertical doubling on the display side: tiles are rendered 2x wide only
+// (80x40) and every row is pushed twice into the tile's address window, so
+// the tile buffers are half the size and the second row is never written
+#ifndef VIDEO_LINE_REPEAT
+#define VIDEO_LINE_REPEAT 0
+#endif
+
+// Buffers are sized for the 2x scaled mode, the 1:1 mode needs less
+// (RGB565 pixels per rendered tile)
+#if VIDEO_LINE_REPEAT
+#define TILE_BUFFER_PIXELS  (TILE_MAX_PIXELS * 2)
+#else
+#define TILE_BUFFER_PIXELS  (TILE_MAX_PIXELS * 4)
+#endif
+
+// Maximum number of horizontally adjacent dirty tiles pushed as one span
+// Each of the two span buffers takes TILE_SPAN_MAX tile buffers of DRAM
+#ifndef TILE_SPAN_MAX
+#define TILE_SPAN_MAX     2
+#endif
+
+// Direct framebuffer backend: dirty tiles are rendered straight into the
+// panel's scan-out framebuffer (DISPLAY_WIDTH x DISPLAY_HEIGHT RGB565 in PSRAM)
+// and only the touched lines are written back from cache, with no M5GFX
+// transaction per tile. The framebuffer comes from videoDirectFrameBuffer();
+// if that returns NULL the M5GFX path is used.
+#ifndef VIDEO_DIRECT_FB
+#define VIDEO_DIRECT_FB 0
+#endif
+
+// Portrait modes: with the "portrait" pref the display is left at its
+// native orientation (the Tab5 panel scans out 720x1280, so M5GFX then
+// copies rows straight through instead of transposing them as it does for
+// the landscape rotation) and the Mac gets 360x640 (2x) and 720x1280 (1:1).
+// Tiles, dirty tracking and touch all work in the rotated Mac coordinates,
+// so nothing per pixel changes; only the geometry does.
+#ifndef VIDEO_PORTRAIT
+#define VIDEO_PORTRAIT 0
+#endif
+
+// Content check: a write-dirty tile whose snapshot hashes the same as when
+// it was last shown (same pixels, palette and cursor) is neither rendered
+// nor pushed. QuickDraw rewrites identical pixels all the time (menu
+// redraws, cursor save/restore, caret blinks).
+#ifndef VIDEO_TILE_HASH
+#define VIDEO_TILE_HASH 0
+#endif
+
+// Frame pacing - the video task renders at up to VIDEO_DEFAULT_MAX_FPS while
+// frames are cheap and backs off as their PSRAM traffic approaches the budget,
+// never below VIDEO_MIN_FPS while there are still dirty tiles.
+// Both defaults can be overridden with the "videofps" and "videobudget" prefs.
+#define VIDEO_DEFAULT_MAX_FPS       60
+#define VIDEO_DEFAULT_BUDGET_KBS    48000   // ~2MB full 1280x720 frame at 24 FPS
+#define VIDEO_MIN_FPS               8
+#define VIDEO_IDLE_TIMEOUT_MS       1000    // Backstop wake-up when nothing signals
+
+// With VIDEO_VBL_SYNC the video task takes each frame at the Mac's VBL
+// (VideoInterrupt(), just before the VBL tasks run), so software that draws
+// from VBL tasks is shown once per Mac frame and never half drawn. Without
+// VBLs (the Mac not started yet) it goes on after VIDEO_VBL_WAIT_MS.
+#ifndef VIDEO_VBL_SYNC
+#define VIDEO_VBL_SYNC 0
+#endif
+#define VIDEO_VBL_PERIOD_MS         16      // One 60.15Hz tick, rounded down
+#define VIDEO_VBL_WAIT_MS           34      // Two ticks
+
+// With VIDEO_PAGE_FLIP the frame buffer gets a second page, granted as
+// "videopage" after the caches ranked in "memplan", that Mac software can
+// draw into while the first is shown and flip to with cscSetMode
+#if VIDEO_PAGE_FLIP
+volatile uint32 video_page_offset = 0;              // See video.h
+static uint32 video_page_stride = 0;                // Page size rounded up to whole frame banks
+static int16 video_pages = 1;
+#endif
+
+#if VNC_SERVER
+// Tiles the video task found dirty since the VNC server last took them
+static uint32 remote_tiles[TILE_BITMAP_WORDS];
+static_assert(VNC_TILE_WORDS == TILE_BITMAP_WORDS, "VNC_TILE_WORDS must match the tile grid");
+#endif
+#if VNC_SERVER || SCREEN_RECORD
+// The palette as the Mac set it, for VNC and the screen recorder (under frame_spinlock)
+static uint8 palette_rgb888[256 * 3];
+#endif
+#if SCREEN_RECORD
+static_assert(SCREENREC_TILE_WORDS == TILE_BITMAP_WORDS, "SCREENREC_TILE_WORDS must match the tile grid");
+#endif
+
 // Video task configuration
 #define VIDEO_TASK_STACK_SIZE  8192
 #define VIDEO_TASK_PRIORITY    1
@@ -111,17 +239,49 @@ DRAM_ATTR static uint16 palette_rgb565[256];
 // Flag to track if palette has changed - avoids unnecessary copies in video task
 static volatile bool palette_changed = true;
 
+// Palette entries changed since the video task last copied the palette
+// (256 bits, under frame_spinlock)
+DRAM_ATTR static uint32 palette_changed_set[8];
+
+// Palette indices each tile showed when it was last rendered (256 bits per
+// tile), so a palette change only redraws the tiles using changed entries
+// In PSRAM (18KB for the 1280x720 grid); only touched once per rendered tile
+static uint32 (*tile_colours)[8] = NULL;
+static volatile uint32_t perf_palette_tiles = 0;    // Tiles redrawn for palette changes
+
 // Dirty tile bitmap - in internal SRAM for fast access during video frame processing
-DRAM_ATTR static uint32 dirty_tiles[(TOTAL_TILES + 31) / 32];          // Bitmap of dirty tiles (read by video task)
+DRAM_ATTR static uint32 dirty_tiles[TILE_BITMAP_WORDS];           // Bitmap of dirty tiles (read by video task)
 
 // Write-time dirty tracking bitmap - marked when CPU writes to framebuffer
 // This is double-buffered to avoid race conditions between CPU writes and video task reads
-DRAM_ATTR static uint32 write_dirty_tiles[(TOTAL_TILES + 31) / 32];    // Tiles dirtied by CPU writes
+DRAM_ATTR static uint32 write_dirty_tiles[TILE_BITMAP_WORDS];     // Tiles dirtied by CPU writes
+
+#if VIDEO_DEFERRED_DIRTY
+// Span bitmaps written by the CPU thread (see VideoMarkDirtyDeferred() in video.h)
+#if MAC_MAX_WIDTH * MAC_MAX_HEIGHT * MAC_MAX_BYTES_PER_PIXEL > VIDEO_DIRTY_FB_MAX
+#error "VIDEO_DIRTY_FB_MAX does not cover the Mac frame buffer"
+#endif
+DRAM_ATTR uint32 video_dirty_spans[VIDEO_DIRTY_SPAN_WORDS];
+DRAM_ATTR uint32 video_dirty_summary[VIDEO_DIRTY_SUMMARY_WORDS];
+#endif
+
+// Per-tile write generation - the CPU-side marker bumps it before setting
+// the tile's dirty bit; the video task snapshots seqlock-style and copies
+// the tile again if the generation moved during the copy
+#ifndef VIDEO_SNAPSHOT_RETRIES
+#define VIDEO_SNAPSHOT_RETRIES 2    // Retries before a torn tile is left for the next frame
+#endif
+DRAM_ATTR static uint32 tile_generation[MAX_TOTAL_TILES];
 
-// Per-tile render lock bitmap - set while video task is snapshotting a tile
-// If CPU tries to write while this is set, the tile is re-marked dirty for next frame
-// This prevents torn data from race conditions during snapshot
-DRAM_ATTR static uint32 tile_render_active[(TOTAL_TILES + 31) / 32];   // Tiles currently being rendered
+#if VIDEO_TILE_HASH
+// Hash of what each tile showed when it was last rendered, and a seed that
+// the video task bumps whenever tiles can look different with the same
+// pixels (mode switch, full redraw, palette change); video task only
+static uint64 tile_hash[MAX_TOTAL_TILES];
+static uint32 tile_hash_epoch = 0;
+static volatile uint32_t perf_hash_skips = 0;       // Tiles not rendered, content unchanged
+static perf_counter *perf_hash_skip = NULL;         // "video.hash_skips"
+#endif
 
 // Double-buffered row buffers for streaming full-frame renders with async DMA
 // Processes 4 Mac rows at a time (becomes 8 display rows with 2x scaling)
@@ -129,8 +289,8 @@ DRAM_ATTR static uint32 tile_render_active[(TOTAL_TILES + 31) / 32];   // Tiles
 // Double-buffering allows rendering to one buffer while DMA pushes the other
 // In internal SRAM for fast access during full-frame renders
 #define STREAMING_ROW_COUNT 8
-DRAM_ATTR static uint16 streaming_row_buffer_a[DISPLAY_WIDTH * STREAMING_ROW_COUNT];
-DRAM_ATTR static uint16 streaming_row_buffer_b[DISPLAY_WIDTH * STREAMING_ROW_COUNT];
+DRAM_ATTR static uint16 streaming_row_buffer_a[DISPLAY_WIDTH * STREAMING_ROW_COUNT] __attribute__((aligned(16)));
+DRAM_ATTR static uint16 streaming_row_buffer_b[DISPLAY_WIDTH * STREAMING_ROW_COUNT] __attribute__((aligned(16)));
 static uint16 *render_buffer = streaming_row_buffer_a;
 static uint16 *push_buffer = streaming_row_buffer_b;
 
@@ -140,6 +300,7 @@ static int dirty_tile_count = 0;                             // Count of dirty t
 // Display dimensions (from M5.Display)
 static int display_width = 0;
 static int display_height = 0;
+static bool video_portrait = false;     // "portrait" pref, display at rotation 0
 
 // Video mode info
 static video_mode current_mode;
@@ -151,6 +312,39 @@ static volatile uint32 current_bytes_per_row = MAC_SCREEN_WIDTH;  // Bytes per r
 static volatile int current_pixels_per_byte = 1;  // Pixels packed per byte (8=1bit, 4=2bit, 2=4bit, 1=8bit)
 static volatile int current_bit_shift = 0;  // Bits to shift per pixel (7=1bit, 6=2bit, 4=4bit, 0=8bit)
 static volatile uint8 current_pixel_mask = 0xFF;  // Mask for extracting pixel value
+static volatile int current_bytes_per_pixel = 1;  // 2 for 16-bit direct colour, else 1
+
+// Current geometry - the tile grid and scale follow the Mac mode
+static volatile int mac_width = MAC_SCREEN_WIDTH;   // Mac screen size in pixels
+static volatile int mac_height = MAC_SCREEN_HEIGHT;
+static volatile int pixel_scale = 2;                 // Display pixels per Mac pixel (1 or 2)
+#if VIDEO_TILE_GEOMETRY
+// Tile size in Mac pixels, only changed by mode switches (which redraw all)
+static int tile_width = TILE_WIDTH;
+static int tile_height = TILE_HEIGHT;
+
+static const struct {
+    int width, height;
+} tile_geometries[] = {
+    { 16, 18 },     // Least overdraw for text and cursor edits
+    { 32, 18 },
+    { 40, 40 },     // TILE_WIDTH x TILE_HEIGHT
+    { 64, 36 },     // Fewest DMA transactions at 1280x720
+};
+#define TILE_GEOMETRY_COUNT (int)(sizeof(tile_geometries) / sizeof(tile_geometries[0]))
+static int tile_geometry_pref = -1;                  // Index from "videotile", -1 = auto
+#else
+static const int tile_width = TILE_WIDTH;
+static const int tile_height = TILE_HEIGHT;
+#endif
+static volatile int tiles_x = MAC_SCREEN_WIDTH / TILE_WIDTH;
+static volatile int tiles_y = MAC_SCREEN_HEIGHT / TILE_HEIGHT;
+static volatile int total_tiles = (MAC_SCREEN_WIDTH / TILE_WIDTH) * (MAC_SCREEN_HEIGHT / TILE_HEIGHT);
+
+// Frame pacing state (set from prefs in VideoInit)
+static int video_max_fps = VIDEO_DEFAULT_MAX_FPS;
+static uint32 video_budget_kbs = VIDEO_DEFAULT_BUDGET_KBS;
+static volatile uint32 video_frame_interval_ms = 1000 / VIDEO_DEFAULT_MAX_FPS;
 
 // ============================================================================
 // Performance profiling counters (lightweight, always enabled)
@@ -161,9 +355,39 @@ static volatile uint32_t perf_frame_count = 0;      // Frames rendered
 static volatile uint32_t perf_partial_count = 0;    // Partial updates
 static volatile uint32_t perf_full_count = 0;       // Full updates
 static volatile uint32_t perf_skip_count = 0;       // Skipped frames (no changes)
+static volatile uint32_t perf_retry_count = 0;      // Tile snapshots taken again after a concurrent write
+static volatile uint32_t perf_torn_count = 0;       // Tiles still torn after VIDEO_SNAPSHOT_RETRIES
 static volatile uint32_t perf_last_report_ms = 0;   // Last time stats were printed
 #define PERF_REPORT_INTERVAL_MS 5000                // Report every 5 seconds
 
+// Registry counterparts for telemetry (perf_esp32.cpp)
+static perf_counter *perf_frames = NULL;            // "video.frames", rendered frames
+static perf_counter *perf_tiles = NULL;             // "video.tiles", tiles rendered
+static perf_counter *perf_torn = NULL;              // "video.torn"
+static perf_histogram *perf_frame_hist = NULL;      // "video.frame_us", detect + render per frame
+#if VIDEO_VBL_SYNC
+static perf_histogram *perf_vbl_hist = NULL;        // "video.vbl_us", VBL to frame pushed
+static SemaphoreHandle_t vbl_sem = NULL;            // Given by VideoInterrupt()
+static volatile uint32_t vbl_us = 0;                // micros() at the last VBL
+#endif
+
+// Pipeline benchmark: synthetic dirty patterns pushed through
+// renderAndPushDirtyTiles() at VideoInit, with the snapshot, render, DMA
+// push and DMA wait stages timed separately (see benchmarkVideoPipeline())
+#ifndef VIDEO_PIPELINE_BENCH
+#define VIDEO_PIPELINE_BENCH 0
+#endif
+
+#if VIDEO_PIPELINE_BENCH
+enum { BENCH_SNAPSHOT, BENCH_RENDER, BENCH_PUSH, BENCH_WAIT, BENCH_STAGES };
+static uint64 bench_stage_cycles[BENCH_STAGES];     // CPU cycles per stage since the last reset
+#define BENCH_STAGE_BEGIN(t)        uint32 t = esp_cpu_get_cycle_count()
+#define BENCH_STAGE_END(stage, t)   (bench_stage_cycles[stage] += esp_cpu_get_cycle_count() - (t))
+#else
+#define BENCH_STAGE_BEGIN(t)
+#define BENCH_STAGE_END(stage, t)
+#endif
+
 // Monitor descriptor for ESP32
 class ESP32_monitor_desc : public monitor_desc {
 public:
@@ -173,6 +397,12 @@ public:
     virtual void switch_to_current_mode(void);
     virtual void set_palette(uint8 *pal, int num);
     virtual void set_gamma(uint8 *gamma, int num);
+#if VIDEO_PAGE_FLIP
+    virtual int16 page_count(void) {return video_pages;}
+    virtual uint32 page_base(int16 page) {return mac_frame_base + page * video_page_stride;}
+    virtual int16 displayed_page(void) {return video_pages > 1 ? video_page_offset / video_page_stride : 0;}
+    virtual void show_page(int16 page);
+#endif
 };
 
 // Pointer to our monitor
@@ -195,25 +425,40 @@ static inline uint16 rgb888_to_rgb565(uint8 r, uint8 g, uint8 b)
  *  Set palette for indexed color modes
  *  Thread-safe: uses spinlock since palette can be updated from CPU emulation
  *  
- *  When palette changes, we force a full screen update since all pixels
- *  may look different even though the framebuffer data hasn't changed.
+ *  Only the entries that actually change are recorded; the video task then
+ *  redraws just the tiles whose last render used one of them.
  */
 void ESP32_monitor_desc::set_palette(uint8 *pal, int num)
 {
     D(bug("[VIDEO] set_palette: %d entries\n", num));
     
+    bool changed = false;
     portENTER_CRITICAL(&frame_spinlock);
     for (int i = 0; i < num && i < 256; i++) {
         uint8 r = pal[i * 3 + 0];
         uint8 g = pal[i * 3 + 1];
         uint8 b = pal[i * 3 + 2];
-        palette_rgb565[i] = rgb888_to_rgb565(r, g, b);
+        uint16 c = rgb888_to_rgb565(r, g, b);
+#if VNC_SERVER || SCREEN_RECORD
+        palette_rgb888[i * 3 + 0] = r;
+        palette_rgb888[i * 3 + 1] = g;
+        palette_rgb888[i * 3 + 2] = b;
+#endif
+        if (c != palette_rgb565[i]) {
+            palette_rgb565[i] = c;
+            palette_changed_set[i >> 5] |= 1u << (i & 31);
+            changed = true;
+        }
+    }
+    if (changed) {
+        palette_changed = true;
     }
-    palette_changed = true;
     portEXIT_CRITICAL(&frame_spinlock);
     
-    // Force a full screen update since palette affects all pixels
-    force_full_update = true;
+    // Without the per-tile colour sets every pixel may look different
+    if (changed && !tile_colours) {
+        force_full_update = true;
+    }
 }
 
 /*
@@ -230,10 +475,28 @@ void ESP32_monitor_desc::set_gamma(uint8 *gamma, int num)
 /*
  *  Helper to update the video state cache based on depth
  */
-static void updateVideoStateCache(video_depth depth, uint32 bytes_per_row)
+static void updateVideoStateCache(video_depth depth, uint32 bytes_per_row, int width, int height)
 {
     current_depth = depth;
     current_bytes_per_row = bytes_per_row;
+    current_bytes_per_pixel = 1;
+    
+    mac_width = width;
+    mac_height = height;
+    pixel_scale = display_width / width;
+#if VIDEO_TILE_GEOMETRY
+    // Auto: 64x36 display pixels per tile in both resolutions (neither
+    // divides the portrait modes, which get 40x40)
+    int g = tile_geometry_pref >= 0 ? tile_geometry_pref : (pixel_scale == 2 ? 1 : 3);
+    if (width % tile_geometries[g].width || height % tile_geometries[g].height) {
+        g = 2;
+    }
+    tile_width = tile_geometries[g].width;
+    tile_height = tile_geometries[g].height;
+#endif
+    tiles_x = width / tile_width;
+    tiles_y = height / tile_height;
+    total_tiles = tiles_x * tiles_y;
     
     switch (depth) {
         case VDEPTH_1BIT:
@@ -251,6 +514,13 @@ static void updateVideoStateCache(video_depth depth, uint32 bytes_per_row)
             current_bit_shift = 4;
             current_pixel_mask = 0x0F;
             break;
+        case VDEPTH_16BIT:
+            // Host RGB565 (FLAYOUT_HOST_565), no palette
+            current_pixels_per_byte = 1;
+            current_bit_shift = 0;
+            current_pixel_mask = 0xFF;
+            current_bytes_per_pixel = 2;
+            break;
         case VDEPTH_8BIT:
         default:
             current_pixels_per_byte = 1;
@@ -259,8 +529,9 @@ static void updateVideoStateCache(video_depth depth, uint32 bytes_per_row)
             break;
     }
     
-    Serial.printf("[VIDEO] Mode cache updated: depth=%d, bpr=%d, ppb=%d\n", 
-                  (int)depth, (int)bytes_per_row, current_pixels_per_byte);
+    Serial.printf("[VIDEO] Mode cache updated: %dx%d (x%d), depth=%d, bpr=%d, ppb=%d, tiles %dx%d of %dx%d\n", 
+                  width, height, (int)pixel_scale, (int)depth, (int)bytes_per_row,
+                  current_pixels_per_byte, (int)tiles_x, (int)tiles_y, tile_width, tile_height);
 }
 
 /*
@@ -358,6 +629,19 @@ static void initDefaultPalette(video_depth depth)
             break;
     }
     
+#if VNC_SERVER || SCREEN_RECORD
+    // Widened back from swap565; the Mac sets its own palette right after
+    for (int i = 0; i < 256; i++) {
+        uint16 c = palette_rgb565[i];
+        uint8 r = c & 0xf8;
+        uint8 g = ((c & 0x07) << 5) | ((c >> 11) & 0x1c);
+        uint8 b = (c >> 5) & 0xf8;
+        palette_rgb888[i * 3 + 0] = r | (r >> 5);
+        palette_rgb888[i * 3 + 1] = g | (g >> 6);
+        palette_rgb888[i * 3 + 2] = b | (b >> 5);
+    }
+#endif
+    palette_changed = true;
     portEXIT_CRITICAL(&frame_spinlock);
     
     // Force a full screen update since palette changed
@@ -374,7 +658,16 @@ void ESP32_monitor_desc::switch_to_current_mode(void)
           mode.x, mode.y, mode.depth, mode.bytes_per_row));
     
     // Update the video state cache for rendering
-    updateVideoStateCache(mode.depth, mode.bytes_per_row);
+    updateVideoStateCache(mode.depth, mode.bytes_per_row, mode.x, mode.y);
+    InputSetScreenSize(mode.x, mode.y);
+    
+    // 16-bit uses the host-565 frame bank so the renderer needs no palette
+    // stage (the bank converts the Mac's 555 on write); remap if it changed
+    int layout = (mode.depth == VDEPTH_16BIT) ? FLAYOUT_HOST_565 : FLAYOUT_DIRECT;
+    if (layout != MacFrameLayout) {
+        MacFrameLayout = layout;
+        InitFrameBufferMapping();
+    }
     
     // Initialize default palette for this depth
     // MacOS will set its own palette shortly after, but this ensures
@@ -383,11 +676,28 @@ void ESP32_monitor_desc::switch_to_current_mode(void)
     
     // Update frame buffer base address
     set_mac_frame_base(MacFrameBaseMac);
+#if VIDEO_PAGE_FLIP
+    video_page_offset = 0;
+#endif
     
     // Force a full screen update on mode change (already done by initDefaultPalette)
     force_full_update = true;
 }
 
+#if VIDEO_PAGE_FLIP
+/*
+ *  Show another page: the writes the tiles hold are the old page's, so
+ *  everything is redrawn from the new one
+ */
+void ESP32_monitor_desc::show_page(int16 page)
+{
+    D(bug("[VIDEO] show_page: %d\n", page));
+    video_page_offset = page * video_page_stride;
+    force_full_update = true;
+    VideoSignalFrameReady();
+}
+#endif
+
 // ============================================================================
 // Packed pixel decoding helpers for 1/2/4-bit modes
 // ============================================================================
@@ -490,23 +800,18 @@ static inline bool isTileDirty(int tile_idx)
 }
 
 /*
- *  Tile render lock functions - used to prevent race conditions during snapshot
- *  When a tile is being rendered (snapshotted), CPU writes to that tile will
- *  be deferred to the next frame by re-marking the tile dirty.
+ *  Record a CPU write to a tile: bump its generation, then mark it dirty
+ *  (in that order, see snapshotAndRenderTile()). CPU thread only.
  */
-static inline void setTileRenderActive(int tile_idx)
+static inline void markTileWritten(int tile_idx)
 {
-    __atomic_or_fetch(&tile_render_active[tile_idx / 32], (1u << (tile_idx % 32)), __ATOMIC_RELEASE);
+    __atomic_fetch_add(&tile_generation[tile_idx], 1, __ATOMIC_RELEASE);
+    __atomic_or_fetch(&write_dirty_tiles[tile_idx / 32], (1u << (tile_idx % 32)), __ATOMIC_RELEASE);
 }
 
-static inline void clearTileRenderActive(int tile_idx)
+static inline uint32 tileGeneration(int tile_idx)
 {
-    __atomic_and_fetch(&tile_render_active[tile_idx / 32], ~(1u << (tile_idx % 32)), __ATOMIC_RELEASE);
-}
-
-static inline bool isTileRenderActive(int tile_idx)
-{
-    return (__atomic_load_n(&tile_render_active[tile_idx / 32], __ATOMIC_ACQUIRE) & (1u << (tile_idx % 32))) != 0;
+    return __atomic_load_n(&tile_generation[tile_idx], __ATOMIC_ACQUIRE);
 }
 
 /*
@@ -517,12 +822,9 @@ static inline bool isTileRenderActive(int tile_idx)
  *  current_bytes_per_row and current_pixels_per_byte.
  *  
  *  RACE CONDITION HANDLING:
- *  If the video task is currently rendering (snapshotting) this tile, the snapshot
- *  might contain torn data. However, we unconditionally mark the tile dirty here,
- *  which ensures it will be re-rendered cleanly in the next frame. Combined with
- *  the tile_render_active lock in renderAndPushDirtyTiles(), this provides
- *  eventual consistency - a torn frame may appear briefly but will be fixed
- *  within one frame interval (42ms).
+ *  The tile's generation is bumped with the mark, so a snapshot the video
+ *  task takes while this write lands is detected and taken again within the
+ *  same frame (see snapshotAndRenderTile()).
  *  
  *  @param offset  Byte offset into the Mac framebuffer
  */
@@ -530,36 +832,39 @@ void VideoMarkDirtyOffset(uint32 offset)
 {
     if (offset >= frame_buffer_size) return;
     
-    // Get current bytes per row (volatile)
+    // Get current bytes per row and geometry (volatile)
     uint32 bpr = current_bytes_per_row;
     int ppb = current_pixels_per_byte;
+    int bypp = current_bytes_per_pixel;
+    int width = mac_width;
+    int ntx = tiles_x;
     
     // Calculate row from byte offset
     int y = offset / bpr;
-    if (y >= MAC_SCREEN_HEIGHT) return;
+    if (y >= mac_height) return;
     
     // Calculate byte position within row
     int byte_in_row = offset % bpr;
     
     // Calculate pixel range that this byte affects
-    int pixel_start = byte_in_row * ppb;
+    int pixel_start = byte_in_row * ppb / bypp;
     int pixel_end = pixel_start + ppb - 1;
     
     // Clamp to screen width
-    if (pixel_start >= MAC_SCREEN_WIDTH) return;
-    if (pixel_end >= MAC_SCREEN_WIDTH) pixel_end = MAC_SCREEN_WIDTH - 1;
+    if (pixel_start >= width) return;
+    if (pixel_end >= width) pixel_end = width - 1;
     
     // Calculate tile range
-    int tile_x_start = pixel_start / TILE_WIDTH;
-    int tile_x_end = pixel_end / TILE_WIDTH;
-    int tile_y = y / TILE_HEIGHT;
+    int tile_x_start = pixel_start / tile_width;
+    int tile_x_end = pixel_end / tile_width;
+    int tile_y = y / tile_height;
     
     // Mark all affected tiles dirty (unconditionally - even if being rendered)
     // This ensures tiles written during rendering are re-rendered next frame
     for (int tile_x = tile_x_start; tile_x <= tile_x_end; tile_x++) {
-        int tile_idx = tile_y * TILES_X + tile_x;
-        if (tile_idx < TOTAL_TILES) {
-            __atomic_or_fetch(&write_dirty_tiles[tile_idx / 32], (1u << (tile_idx % 32)), __ATOMIC_RELAXED);
+        int tile_idx = tile_y * ntx + tile_x;
+        if (tile_idx < MAX_TOTAL_TILES) {
+            markTileWritten(tile_idx);
         }
     }
 }
@@ -585,9 +890,12 @@ void VideoMarkDirtyRange(uint32 offset, uint32 size)
         size = frame_buffer_size - offset;
     }
     
-    // Get current bytes per row (volatile)
+    // Get current bytes per row and geometry (volatile)
     uint32 bpr = current_bytes_per_row;
     int ppb = current_pixels_per_byte;
+    int bypp = current_bytes_per_pixel;
+    int ntx = tiles_x;
+    int nty = tiles_y;
     
     // Calculate start and end rows
     int start_y = offset / bpr;
@@ -609,35 +917,101 @@ void VideoMarkDirtyRange(uint32 offset, uint32 size)
     int end_byte_in_row = (offset + size - 1) % bpr;
     
     // Calculate pixel columns affected
-    int pixel_col_start = start_byte_in_row * ppb;
-    int pixel_col_end = (end_byte_in_row + 1) * ppb - 1;
+    int pixel_col_start = start_byte_in_row * ppb / bypp;
+    int pixel_col_end = ((end_byte_in_row + 1) * ppb - 1) / bypp;
     
     // For writes spanning multiple rows, the middle rows are fully affected
     // So we need to consider columns from 0 to end for complex cases
     if (end_y > start_y) {
         // Multi-row write: could affect any column
         pixel_col_start = 0;
-        pixel_col_end = MAC_SCREEN_WIDTH - 1;
+        pixel_col_end = mac_width - 1;
     }
     
     // Calculate tile ranges
-    int tile_x_start = pixel_col_start / TILE_WIDTH;
-    int tile_x_end = pixel_col_end / TILE_WIDTH;
-    if (tile_x_end >= TILES_X) tile_x_end = TILES_X - 1;
+    int tile_x_start = pixel_col_start / tile_width;
+    int tile_x_end = pixel_col_end / tile_width;
+    if (tile_x_end >= ntx) tile_x_end = ntx - 1;
     
-    int tile_y_start = start_y / TILE_HEIGHT;
-    int tile_y_end = end_y / TILE_HEIGHT;
-    if (tile_y_end >= TILES_Y) tile_y_end = TILES_Y - 1;
+    int tile_y_start = start_y / tile_height;
+    int tile_y_end = end_y / tile_height;
+    if (tile_y_end >= nty) tile_y_end = nty - 1;
     
     // Mark all affected tiles dirty
     for (int tile_y = tile_y_start; tile_y <= tile_y_end; tile_y++) {
         for (int tile_x = tile_x_start; tile_x <= tile_x_end; tile_x++) {
-            int tile_idx = tile_y * TILES_X + tile_x;
-            __atomic_or_fetch(&write_dirty_tiles[tile_idx / 32], (1u << (tile_idx % 32)), __ATOMIC_RELAXED);
+            int tile_idx = tile_y * ntx + tile_x;
+            markTileWritten(tile_idx);
+        }
+    }
+}
+
+/*
+ *  Mark the tiles of a rectangle dirty at write-time (native blits)
+ *  
+ *  @param offset  Byte offset of the rectangle's top left corner
+ *  @param width   Bytes per row of the rectangle
+ *  @param rows    Number of rows
+ */
+void VideoMarkDirtyRect(uint32 offset, uint32 width, uint32 rows)
+{
+    uint32 bpr = current_bytes_per_row;
+    if (offset >= frame_buffer_size || width == 0 || rows == 0 || bpr == 0) return;
+    
+    int ppb = current_pixels_per_byte;
+    int bypp = current_bytes_per_pixel;
+    int ntx = tiles_x;
+    int nty = tiles_y;
+    
+    uint32 start_y = offset / bpr;
+    uint32 start_byte_in_row = offset % bpr;
+    int pixel_col_start = start_byte_in_row * ppb / bypp;
+    int pixel_col_end = ((start_byte_in_row + width) * ppb - 1) / bypp;
+    
+    int tile_x_start = pixel_col_start / tile_width;
+    int tile_x_end = pixel_col_end / tile_width;
+    if (tile_x_end >= ntx) tile_x_end = ntx - 1;
+    
+    int tile_y_start = start_y / tile_height;
+    int tile_y_end = (start_y + rows - 1) / tile_height;
+    if (tile_y_end >= nty) tile_y_end = nty - 1;
+    
+    for (int tile_y = tile_y_start; tile_y <= tile_y_end; tile_y++) {
+        for (int tile_x = tile_x_start; tile_x <= tile_x_end; tile_x++) {
+            markTileWritten(tile_y * ntx + tile_x);
         }
     }
 }
 
+#if VIDEO_DEFERRED_DIRTY
+/*
+ *  Fold the deferred span bitmap into write_dirty_tiles
+ *  Must run on the CPU thread, which is the only writer of the span bitmaps,
+ *  so they need no atomics; the tile bitmap is still updated atomically.
+ */
+void VideoFlushDirtySpans(void)
+{
+    for (int s = 0; s < VIDEO_DIRTY_SUMMARY_WORDS; s++) {
+        uint32 summary = video_dirty_summary[s];
+        if (summary == 0) continue;
+        video_dirty_summary[s] = 0;
+        
+        while (summary) {
+            int w = s * 32 + __builtin_ctz(summary);
+            summary &= summary - 1;
+            
+            uint32 bits = video_dirty_spans[w];
+            video_dirty_spans[w] = 0;
+            while (bits) {
+                uint32 span = w * 32 + __builtin_ctz(bits);
+                bits &= bits - 1;
+                VideoMarkDirtyRange(span << VIDEO_DIRTY_SPAN_SHIFT, 1u << VIDEO_DIRTY_SPAN_SHIFT);
+            }
+        }
+    }
+}
+#endif
+
 /*
  *  Collect write-dirty tiles into the render dirty bitmap and clear write bitmap
  *  Returns the number of dirty tiles
@@ -648,7 +1022,7 @@ static int collectWriteDirtyTiles(void)
     int count = 0;
     
     // Copy write_dirty_tiles to dirty_tiles and count
-    for (int i = 0; i < (TOTAL_TILES + 31) / 32; i++) {
+    for (int i = 0; i < TILE_BITMAP_WORDS; i++) {
         // Atomically read and clear the write dirty bitmap
         uint32 bits = __atomic_exchange_n(&write_dirty_tiles[i], 0, __ATOMIC_RELAXED);
         dirty_tiles[i] = bits;
@@ -663,22 +1037,329 @@ static int collectWriteDirtyTiles(void)
     return count;
 }
 
+#if VNC_SERVER
+/*
+ *  Hand the VNC server the shown frame and the tiles rendered since its
+ *  last call (vnc_esp32.cpp); VNC task
+ */
+void VideoRemoteTake(vnc_frame &f, uint32 *tiles)
+{
+    portENTER_CRITICAL(&frame_spinlock);
+    memcpy(f.palette, palette_rgb888, sizeof(f.palette));
+    portEXIT_CRITICAL(&frame_spinlock);
+    
+#if VIDEO_PAGE_FLIP
+    f.pixels = mac_frame_buffer + video_page_offset;
+#else
+    f.pixels = mac_frame_buffer;
+#endif
+    f.bytes_per_row = current_bytes_per_row;
+    f.width = mac_width;
+    f.height = mac_height;
+    f.depth = current_depth;
+    f.tile_width = tile_width;
+    f.tile_height = tile_height;
+    f.tiles_x = tiles_x;
+    f.tiles_y = tiles_y;
+    for (int i = 0; i < TILE_BITMAP_WORDS; i++) {
+        tiles[i] = __atomic_exchange_n(&remote_tiles[i], 0, __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+#if SCREEN_RECORD
+/*
+ *  Hand the screen recorder the shown frame and the tiles dirty in it
+ *  (NULL: none, it only catches up); video task
+ */
+static void recordScreen(const uint32 *tiles)
+{
+    if (!screenrec_active) {
+        return;
+    }
+    uint8 palette[256 * 3];
+    portENTER_CRITICAL(&frame_spinlock);
+    memcpy(palette, palette_rgb888, sizeof(palette));
+    portEXIT_CRITICAL(&frame_spinlock);
+    
+    screenrec_frame f;
+#if VIDEO_PAGE_FLIP
+    f.pixels = mac_frame_buffer + video_page_offset;
+#else
+    f.pixels = mac_frame_buffer;
+#endif
+    f.bytes_per_row = current_bytes_per_row;
+    f.width = mac_width;
+    f.height = mac_height;
+    f.depth = current_depth;
+    f.tile_width = tile_width;
+    f.tile_height = tile_height;
+    f.tiles_x = tiles_x;
+    f.tiles_y = tiles_y;
+    f.palette = palette;
+    ScreenRecFrame(f, tiles);
+}
+#endif
+
+/*
+ *  Check whether any tile has been dirtied since the last collect
+ */
+static bool videoDirtyPending(void)
+{
+    for (int i = 0; i < TILE_BITMAP_WORDS; i++) {
+        if (__atomic_load_n(&write_dirty_tiles[i], __ATOMIC_RELAXED) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Work out how long to wait before the next frame, in ms
+ *  A frame costs the tile source reads plus the display writes of every
+ *  dirty tile; it is spread so the average stays within video_budget_kbs.
+ *  Light frames (cursor, typing) run at video_max_fps.
+ */
+static uint32 nextFrameInterval(int tiles_rendered)
+{
+    uint32 src_bytes = tile_height * (tile_width * current_bytes_per_row / mac_width);
+    uint32 dst_bytes = tile_width * tile_height * pixel_scale * pixel_scale * 2;
+    uint32 frame_kb = (tiles_rendered * (src_bytes + dst_bytes)) >> 10;
+    
+    uint32 interval = 1000 / video_max_fps;
+    uint32 budget_interval = (frame_kb * 1000) / video_budget_kbs;
+    if (budget_interval > interval) {
+        interval = budget_interval;
+    }
+    if (interval > 1000 / VIDEO_MIN_FPS) {
+        interval = 1000 / VIDEO_MIN_FPS;
+    }
+    video_frame_interval_ms = interval;
+    return interval;
+}
+
+#if VIDEO_CURSOR_OVERLAY
+// ============================================================================
+// Cursor overlay - Mac OS keeps the cursor out of the frame buffer (see
+// VideoCursorOp() in video.cpp) and it is composited into each tile as the
+// tile is rendered, so pointer motion only re-renders the tiles it crosses
+// ============================================================================
+#define CURSOR_SIZE 16
+
+// Written on the CPU thread under frame_spinlock
+static uint16 cursor_data[CURSOR_SIZE];
+static uint16 cursor_mask[CURSOR_SIZE];
+static int cursor_hot_h = 0, cursor_hot_v = 0;
+static int cursor_x = 0, cursor_y = 0;      // Top-left in Mac pixels
+static bool cursor_visible = false;
+static bool cursor_image_changed = false;
+static volatile uint32 cursor_seq = 0;      // Bumped on every change
+
+// Copy taken by the video task at the start of each frame
+struct cursor_state {
+    uint16 data[CURSOR_SIZE];
+    uint16 mask[CURSOR_SIZE];
+    int x, y;
+    bool visible;
+    uint32 seq;
+};
+static cursor_state cursor_frame;
+
+/*
+ *  Mark the tiles under a cursor-sized rectangle dirty
+ */
+static void markCursorTiles(int x, int y)
+{
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + CURSOR_SIZE - 1;
+    int y1 = y + CURSOR_SIZE - 1;
+    if (x1 >= mac_width) x1 = mac_width - 1;
+    if (y1 >= mac_height) y1 = mac_height - 1;
+    if (x0 > x1 || y0 > y1) return;
+    
+    int ntx = tiles_x;
+    for (int ty = y0 / tile_height; ty <= y1 / tile_height; ty++) {
+        for (int tx = x0 / tile_width; tx <= x1 / tile_width; tx++) {
+            int tile_idx = ty * ntx + tx;
+            markTileWritten(tile_idx);
+        }
+    }
+}
+
+/*
+ *  Set the cursor image (called on the CPU thread)
+ */
+void video_cursor_set_image(const uint16 *data, const uint16 *mask, int hot_h, int hot_v)
+{
+    portENTER_CRITICAL(&frame_spinlock);
+    if (memcmp(cursor_data, data, sizeof(cursor_data)) != 0 ||
+        memcmp(cursor_mask, mask, sizeof(cursor_mask)) != 0 ||
+        hot_h != cursor_hot_h || hot_v != cursor_hot_v) {
+        memcpy(cursor_data, data, sizeof(cursor_data));
+        memcpy(cursor_mask, mask, sizeof(cursor_mask));
+        cursor_hot_h = hot_h;
+        cursor_hot_v = hot_v;
+        cursor_image_changed = true;
+    }
+    portEXIT_CRITICAL(&frame_spinlock);
+}
+
+/*
+ *  Move/show/hide the cursor (called on the CPU thread)
+ *  The state is updated before the tiles are marked, so a frame that
+ *  collects the marks also sees the new state (collect, then sample).
+ */
+void video_cursor_update(int h, int v, bool visible)
+{
+    portENTER_CRITICAL(&frame_spinlock);
+    int x = h - cursor_hot_h;
+    int y = v - cursor_hot_v;
+    int old_x = cursor_x, old_y = cursor_y;
+    bool old_visible = cursor_visible;
+    bool changed = cursor_image_changed || x != old_x || y != old_y || visible != old_visible;
+    cursor_x = x;
+    cursor_y = y;
+    cursor_visible = visible;
+    cursor_image_changed = false;
+    if (changed) cursor_seq++;
+    portEXIT_CRITICAL(&frame_spinlock);
+    
+    if (!changed || !mac_frame_buffer) return;
+    if (old_visible) markCursorTiles(old_x, old_y);
+    if (visible) markCursorTiles(x, y);
+    
+    // Don't wait for the next VideoRefresh(), the pacer decides when to draw
+    VideoSignalFrameReady();
+}
+
+/*
+ *  Take the per-frame copy of the cursor (video task)
+ */
+static void sampleCursor(void)
+{
+    portENTER_CRITICAL(&frame_spinlock);
+    memcpy(cursor_frame.data, cursor_data, sizeof(cursor_frame.data));
+    memcpy(cursor_frame.mask, cursor_mask, sizeof(cursor_frame.mask));
+    cursor_frame.x = cursor_x;
+    cursor_frame.y = cursor_y;
+    cursor_frame.visible = cursor_visible;
+    cursor_frame.seq = cursor_seq;
+    portEXIT_CRITICAL(&frame_spinlock);
+}
+
+/*
+ *  Check whether the cursor changed after this frame's sample (its tiles
+ *  then need another render with the new state)
+ */
+static inline bool cursorChangedSinceSample(void)
+{
+    return cursor_seq != cursor_frame.seq;
+}
+
+/*
+ *  Check whether this frame's cursor covers part of tile (tx, ty)
+ */
+static inline bool cursorInTile(int tx, int ty)
+{
+    const cursor_state &c = cursor_frame;
+    int x0 = tx * tile_width;
+    int y0 = ty * tile_height;
+    return c.visible && c.x < x0 + tile_width && c.x + CURSOR_SIZE > x0 &&
+           c.y < y0 + tile_height && c.y + CURSOR_SIZE > y0;
+}
+
+/*
+ *  Draw the part of the cursor that falls in tile (tx, ty) over its
+ *  rendered pixels; out/out_stride/line_repeat as renderTileFromSnapshot()
+ *  mask+data = black, mask only = white, data only = inverted
+ */
+static void compositeCursor(int tx, int ty, uint16 *out, int out_stride, bool line_repeat)
+{
+    const cursor_state &c = cursor_frame;
+    if (!cursorInTile(tx, ty)) return;
+    
+    int x0 = tx * tile_width;
+    int y0 = ty * tile_height;
+    
+    int scale = pixel_scale;
+    int rows_per_pixel = line_repeat ? 1 : scale;
+    for (int row = 0; row < CURSOR_SIZE; row++) {
+        int y = c.y + row - y0;
+        if (y < 0 || y >= tile_height) continue;
+        uint16 data = c.data[row];
+        uint16 mask = c.mask[row];
+        if ((data | mask) == 0) continue;
+        
+        for (int col = 0; col < CURSOR_SIZE; col++) {
+            int x = c.x + col - x0;
+            if (x < 0 || x >= tile_width) continue;
+            uint16 bit = 0x8000 >> col;
+            if (((data | mask) & bit) == 0) continue;
+            
+            for (int sy = 0; sy < rows_per_pixel; sy++) {
+                uint16 *p = out + (y * rows_per_pixel + sy) * out_stride + x * scale;
+                for (int sx = 0; sx < scale; sx++) {
+                    if (mask & bit) {
+                        p[sx] = (data & bit) ? 0x0000 : 0xFFFF;
+                    } else {
+                        p[sx] = ~p[sx];
+                    }
+                }
+            }
+        }
+    }
+}
+#endif
+
+#if !VIDEO_CURSOR_OVERLAY
+static inline bool cursorChangedSinceSample(void)
+{
+    return false;
+}
+#endif
+
+#if VIDEO_DEFERRED_DIRTY
+/*
+ *  Count the pending span bits over a tile's bytes
+ *  Spans are only set between folds, so a rise across a snapshot means a
+ *  write landed in the tile that its generation does not show yet.
+ */
+static int countTileSpans(int tile_x, int tile_y)
+{
+    uint32 bpr = current_bytes_per_row;
+    uint32 row_bytes = tile_width * bpr / mac_width;
+    uint32 offset = tile_y * tile_height * bpr + tile_x * row_bytes;
+    int count = 0;
+    
+    for (int row = 0; row < tile_height; row++, offset += bpr) {
+        uint32 first = offset >> VIDEO_DIRTY_SPAN_SHIFT;
+        uint32 last = (offset + row_bytes - 1) >> VIDEO_DIRTY_SPAN_SHIFT;
+        for (uint32 span = first; span <= last; span++) {
+            count += (__atomic_load_n(&video_dirty_spans[span >> 5], __ATOMIC_RELAXED) >> (span & 31)) & 1;
+        }
+    }
+    return count;
+}
+#endif
+
 /*
  *  Copy a single tile's source data from framebuffer to a snapshot buffer
  *  This creates a consistent snapshot of the tile to avoid race conditions
  *  when the CPU is writing to the framebuffer while we're rendering.
  *  
- *  For packed pixel modes, decodes to 8-bit indices in the snapshot buffer.
+ *  For packed pixel modes, the snapshot keeps the packed bytes (tile_width /
+ *  pixels-per-byte bytes per row).
  *  
  *  @param src_buffer     Mac framebuffer (may be packed or 8-bit)
- *  @param tile_x         Tile column index (0 to TILES_X-1)
- *  @param tile_y         Tile row index (0 to TILES_Y-1)
- *  @param snapshot       Output buffer (TILE_WIDTH * TILE_HEIGHT bytes, always 8-bit indices)
+ *  @param tile_x         Tile column index (0 to tiles_x-1)
+ *  @param tile_y         Tile row index (0 to tiles_y-1)
+ *  @param snapshot       Output buffer (up to tile_width * tile_height bytes)
  */
 static void snapshotTile(uint8 *src_buffer, int tile_x, int tile_y, uint8 *snapshot)
 {
-    int src_start_x = tile_x * TILE_WIDTH;
-    int src_start_y = tile_y * TILE_HEIGHT;
+    int src_start_x = tile_x * tile_width;
+    int src_start_y = tile_y * tile_height;
     
     // Get current depth and bytes per row (volatile, so copy locally)
     video_depth depth = current_depth;
@@ -689,207 +1370,868 @@ static void snapshotTile(uint8 *src_buffer, int tile_x, int tile_y, uint8 *snaps
     
     if (depth == VDEPTH_8BIT) {
         // 8-bit mode: direct copy, no decoding needed
-        for (int row = 0; row < TILE_HEIGHT; row++) {
+        for (int row = 0; row < tile_height; row++) {
             uint8 *src = src_buffer + (src_start_y + row) * bpr + src_start_x;
-            memcpy(dst, src, TILE_WIDTH);
-            dst += TILE_WIDTH;
+            memcpy(dst, src, tile_width);
+            dst += tile_width;
         }
     } else {
-        // Packed mode: need to decode pixels
-        // For each row, extract the tile's pixel range from the packed source
-        for (int row = 0; row < TILE_HEIGHT; row++) {
-            uint8 *src_row = src_buffer + (src_start_y + row) * bpr;
-            
-            // Decode TILE_WIDTH pixels starting at src_start_x
-            for (int x = 0; x < TILE_WIDTH; x++) {
-                int pixel_x = src_start_x + x;
-                
-                switch (depth) {
-                    case VDEPTH_1BIT: {
-                        int byte_idx = pixel_x / 8;
-                        int bit_idx = 7 - (pixel_x % 8);
-                        *dst++ = (src_row[byte_idx] >> bit_idx) & 0x01;
-                        break;
-                    }
-                    case VDEPTH_2BIT: {
-                        int byte_idx = pixel_x / 4;
-                        int shift = 6 - ((pixel_x % 4) * 2);
-                        *dst++ = (src_row[byte_idx] >> shift) & 0x03;
-                        break;
-                    }
-                    case VDEPTH_4BIT: {
-                        int byte_idx = pixel_x / 2;
-                        int shift = (pixel_x % 2 == 0) ? 4 : 0;
-                        *dst++ = (src_row[byte_idx] >> shift) & 0x0F;
-                        break;
-                    }
-                    default:
-                        *dst++ = src_row[pixel_x];
-                        break;
-                }
-            }
+        // Packed mode: copy the packed bytes as they are, the per-depth
+        // kernels (renderPackedTile()) decode straight to RGB565
+        // tile_width is a multiple of 8, so tile rows are byte aligned
+        int ppb = current_pixels_per_byte;
+        int row_bytes = tile_width / ppb;
+        for (int row = 0; row < tile_height; row++) {
+            uint8 *src = src_buffer + (src_start_y + row) * bpr + src_start_x / ppb;
+            memcpy(dst, src, row_bytes);
+            dst += row_bytes;
         }
     }
 }
 
 /*
- *  Render a tile from a contiguous snapshot buffer (not from framebuffer)
- *  This ensures we render from consistent data that won't change mid-render.
+ *  Copy a tile of the 16-bit (host RGB565) frame buffer in display byte order
+ *  Used as the snapshot in 2x mode and written straight into the output
+ *  buffer in 1:1 mode, where no other render stage is needed.
  *  
- *  @param snapshot        Tile snapshot buffer (TILE_WIDTH * TILE_HEIGHT bytes, contiguous)
- *  @param local_palette   Pre-copied palette for thread safety
- *  @param out_buffer      Output buffer for RGB565 pixels
+ *  @param src_buffer     Mac framebuffer (FLAYOUT_HOST_565, native-endian RGB565)
+ *  @param tile_x         Tile column index (0 to tiles_x-1)
+ *  @param tile_y         Tile row index (0 to tiles_y-1)
+ *  @param dst            Output (swap565, as M5GFX expects)
+ *  @param dst_stride     Output row length in pixels
  */
-static void renderTileFromSnapshot(uint8 *snapshot, uint16 *local_palette, uint16 *out_buffer)
+static void snapshotTile16(uint8 *src_buffer, int tile_x, int tile_y, uint16 *dst, int dst_stride)
 {
-    int tile_pixel_width = TILE_WIDTH * PIXEL_SCALE;  // 80 pixels
-    
-    uint8 *src = snapshot;
-    uint16 *out = out_buffer;
-    
-    // Process each row of the Mac tile
-    for (int row = 0; row < TILE_HEIGHT; row++) {
-        // Output row pointers (two rows for 2x vertical scaling)
-        uint16 *dst_row0 = out;
-        uint16 *dst_row1 = out + tile_pixel_width;
-        
-        // Process 4 pixels at a time for better memory bandwidth
-        int x = 0;
-        for (; x < TILE_WIDTH - 3; x += 4) {
-            // Read 4 source pixels at once (32-bit read)
-            uint32 src4 = *((uint32 *)src);
-            src += 4;
-            
-            // Convert each pixel through palette and write 2x2 scaled
-            uint16 c0 = local_palette[src4 & 0xFF];
-            uint16 c1 = local_palette[(src4 >> 8) & 0xFF];
-            uint16 c2 = local_palette[(src4 >> 16) & 0xFF];
-            uint16 c3 = local_palette[(src4 >> 24) & 0xFF];
-            
-            // Write to row 0 (2 pixels per source pixel)
-            dst_row0[0] = c0; dst_row0[1] = c0;
-            dst_row0[2] = c1; dst_row0[3] = c1;
-            dst_row0[4] = c2; dst_row0[5] = c2;
-            dst_row0[6] = c3; dst_row0[7] = c3;
-            
-            // Write to row 1 (duplicate of row 0)
-            dst_row1[0] = c0; dst_row1[1] = c0;
-            dst_row1[2] = c1; dst_row1[3] = c1;
-            dst_row1[4] = c2; dst_row1[5] = c2;
-            dst_row1[6] = c3; dst_row1[7] = c3;
-            
-            dst_row0 += 8;
-            dst_row1 += 8;
-        }
-        
-        // Handle remaining pixels (TILE_WIDTH=40 is divisible by 4, so this rarely runs)
-        for (; x < TILE_WIDTH; x++) {
-            uint16 c = local_palette[*src++];
-            dst_row0[0] = c; dst_row0[1] = c;
-            dst_row1[0] = c; dst_row1[1] = c;
-            dst_row0 += 2;
-            dst_row1 += 2;
+    uint32 bpr = current_bytes_per_row;
+    const uint8 *src = src_buffer + tile_y * tile_height * bpr + tile_x * tile_width * 2;
+    
+    for (int row = 0; row < tile_height; row++) {
+        const uint32 *s = (const uint32 *)src;
+        uint32 *d = (uint32 *)dst;
+        // Two pixels per word, byte-swap each half
+        for (int x = 0; x < tile_width / 2; x++) {
+            uint32 v = s[x];
+            d[x] = ((v & 0x00ff00ff) << 8) | ((v >> 8) & 0x00ff00ff);
         }
-        
-        // Move output pointer by 2 rows (2x vertical scaling)
-        out += tile_pixel_width * 2;
+        src += bpr;
+        dst += dst_stride;
     }
 }
 
-/*
- *  Render and push only dirty tiles to the display
- *  RACE-CONDITION FIX: Uses per-tile render lock and double-buffered DMA.
- *  
+// ============================================================================
+// Palette expansion kernels (8-bit indices -> 2x2 scaled RGB565)
+// ============================================================================
+
+// VIDEO_FAST_KERNEL=0 selects the original scalar kernel. The fast kernel
+// looks pixels up in a table of pre-doubled pairs (one 32-bit store writes
+// both horizontal copies); with VIDEO_USE_PIE the second display row is
+// copied from the first with 128-bit PIE loads/stores (needs a toolchain
+// with the Xesppie extension). VIDEO_KERNEL_BENCH times both at VideoInit.
+#ifndef VIDEO_FAST_KERNEL
+#define VIDEO_FAST_KERNEL 1
+#endif
+#ifndef VIDEO_USE_PIE
+#define VIDEO_USE_PIE 0
+#endif
+#ifndef VIDEO_KERNEL_BENCH
+#define VIDEO_KERNEL_BENCH 0
+#endif
+
+// Palette entries as horizontal pixel pairs (c | c << 16), rebuilt by the
+// video task whenever it refreshes its local palette copy
+DRAM_ATTR static uint32 palette_pairs[256];
+
+static void buildPalettePairs(const uint16 *pal)
+{
+    for (int i = 0; i < 256; i++) {
+        palette_pairs[i] = (uint32)pal[i] | ((uint32)pal[i] << 16);
+    }
+}
+
+// Packed-depth lookup: for every source byte, the 8/4/2 pixels it holds as
+// pre-doubled pairs (left pixel first); built for the current depth
+DRAM_ATTR static uint32 packed_lut[256][8] __attribute__((aligned(16)));
+static int packed_lut_depth = -1;
+
+static void buildPackedLUT(const uint16 *pal, video_depth depth)
+{
+    packed_lut_depth = depth;
+    int bits;
+    switch (depth) {
+        case VDEPTH_1BIT: bits = 1; break;
+        case VDEPTH_2BIT: bits = 2; break;
+        case VDEPTH_4BIT: bits = 4; break;
+        default: return;
+    }
+    int ppb = 8 / bits;
+    int mask = (1 << bits) - 1;
+    for (int b = 0; b < 256; b++) {
+        for (int k = 0; k < ppb; k++) {
+            uint16 c = pal[(b >> (8 - bits * (k + 1))) & mask];
+            packed_lut[b][k] = (uint32)c | ((uint32)c << 16);
+        }
+    }
+}
+
+/*
+ *  Scalar kernel: 4 source pixels per iteration, 16 16-bit stores
+ */
+static void expandRow2xScalar(const uint8 *src, const uint16 *pal, uint16 *dst_row0, uint16 *dst_row1, int width)
+{
+    int x = 0;
+    for (; x < width - 3; x += 4) {
+        // Read 4 source pixels at once (32-bit read)
+        uint32 src4 = *((const uint32 *)(src + x));
+        
+        // Convert each pixel through palette and write 2x2 scaled
+        uint16 c0 = pal[src4 & 0xFF];
+        uint16 c1 = pal[(src4 >> 8) & 0xFF];
+        uint16 c2 = pal[(src4 >> 16) & 0xFF];
+        uint16 c3 = pal[(src4 >> 24) & 0xFF];
+        
+        // Write to row 0 (2 pixels per source pixel)
+        dst_row0[0] = c0; dst_row0[1] = c0;
+        dst_row0[2] = c1; dst_row0[3] = c1;
+        dst_row0[4] = c2; dst_row0[5] = c2;
+        dst_row0[6] = c3; dst_row0[7] = c3;
+        
+        // Write to row 1 (duplicate of row 0)
+        dst_row1[0] = c0; dst_row1[1] = c0;
+        dst_row1[2] = c1; dst_row1[3] = c1;
+        dst_row1[4] = c2; dst_row1[5] = c2;
+        dst_row1[6] = c3; dst_row1[7] = c3;
+        
+        dst_row0 += 8;
+        dst_row1 += 8;
+    }
+    
+    // Handle remaining pixels (if width not divisible by 4)
+    for (; x < width; x++) {
+        uint16 c = pal[src[x]];
+        dst_row0[0] = c; dst_row0[1] = c;
+        dst_row1[0] = c; dst_row1[1] = c;
+        dst_row0 += 2;
+        dst_row1 += 2;
+    }
+}
+
+#if VIDEO_USE_PIE
+/*
+ *  Copy a display row with 128-bit PIE loads/stores
+ *  dst, src and bytes must all be multiples of 16
+ */
+static inline void copyRowPIE(uint16 *dst, const uint16 *src, int bytes)
+{
+    for (int n = bytes >> 5; n > 0; n--) {
+        asm volatile (
+            "esp.vld.128.ip q0, %0, 16\n"
+            "esp.vld.128.ip q1, %0, 16\n"
+            "esp.vst.128.ip q0, %1, 16\n"
+            "esp.vst.128.ip q1, %1, 16\n"
+            : "+r"(src), "+r"(dst) : : "memory");
+    }
+    if (bytes & 16) {
+        asm volatile (
+            "esp.vld.128.ip q0, %0, 16\n"
+            "esp.vst.128.ip q0, %1, 16\n"
+            : "+r"(src), "+r"(dst) : : "memory");
+    }
+}
+#endif
+
+/*
+ *  Fast kernel: one table load and one 32-bit store per source pixel and row
+ *  Output rows must be 4-byte aligned (the render buffers are 16-byte aligned)
+ */
+static void expandRow2xFast(const uint8 *src, uint16 *dst_row0, uint16 *dst_row1, int width)
+{
+    const uint32 *pairs = palette_pairs;
+    uint32 *d0 = (uint32 *)dst_row0;
+#if VIDEO_USE_PIE
+    // Row 1 is a vector copy of row 0 afterwards
+    const int row_stride = 0;
+#else
+    const int row_stride = dst_row1 - dst_row0;  // In uint16 units
+#endif
+    uint32 *d1 = (uint32 *)(dst_row0 + row_stride);
+    
+    int x = 0;
+    for (; x < width - 3; x += 4) {
+        uint32 src4 = *((const uint32 *)(src + x));
+        uint32 p0 = pairs[src4 & 0xFF];
+        uint32 p1 = pairs[(src4 >> 8) & 0xFF];
+        uint32 p2 = pairs[(src4 >> 16) & 0xFF];
+        uint32 p3 = pairs[src4 >> 24];
+        d0[0] = p0; d0[1] = p1; d0[2] = p2; d0[3] = p3;
+        if (row_stride) {
+            d1[0] = p0; d1[1] = p1; d1[2] = p2; d1[3] = p3;
+            d1 += 4;
+        }
+        d0 += 4;
+    }
+    for (; x < width; x++) {
+        uint32 p = pairs[src[x]];
+        *d0++ = p;
+        if (row_stride) *d1++ = p;
+    }
+    
+#if VIDEO_USE_PIE
+    int bytes = width * 2 * sizeof(uint16);
+    if (((((uintptr)dst_row0 | (uintptr)dst_row1) | bytes) & 15) == 0) {
+        copyRowPIE(dst_row1, dst_row0, bytes);
+    } else {
+        memcpy(dst_row1, dst_row0, bytes);
+    }
+#endif
+}
+
+/*
+ *  Expand one row of 8-bit indices into two 2x scaled display rows
+ *  pal must be the palette palette_pairs was last built from
+ */
+static inline void expandRow2x(const uint8 *src, const uint16 *pal, uint16 *dst_row0, uint16 *dst_row1, int width)
+{
+#if VIDEO_FAST_KERNEL
+    UNUSED(pal);
+    expandRow2xFast(src, dst_row0, dst_row1, width);
+#else
+    expandRow2xScalar(src, pal, dst_row0, dst_row1, width);
+#endif
+}
+
+/*
+ *  Convert one row of 8-bit indices 1:1 (1280x720 mode)
+ */
+static inline void lookupRow1x(const uint8 *src, const uint16 *pal, uint16 *dst, int width)
+{
+    for (int x = 0; x < width; x++) {
+        dst[x] = pal[src[x]];
+    }
+}
+
+/*
+ *  Widen one row of 16-bit pixels 2x, into one or two display rows
+ *  dst_row1 may be NULL (VIDEO_LINE_REPEAT)
+ */
+static inline void widenRow16(const uint16 *src, uint16 *dst_row0, uint16 *dst_row1, int width)
+{
+    uint32 *d0 = (uint32 *)dst_row0;
+    uint32 *d1 = (uint32 *)dst_row1;
+    for (int x = 0; x < width; x++) {
+        uint32 p = (uint32)src[x] | ((uint32)src[x] << 16);
+        d0[x] = p;
+        if (d1) d1[x] = p;
+    }
+}
+
+#if VIDEO_LINE_REPEAT
+/*
+ *  Expand one row of 8-bit indices into a single 2x wide display row
+ */
+static inline void widenRow2x(const uint8 *src, const uint16 *pal, uint16 *dst, int width)
+{
+#if VIDEO_FAST_KERNEL
+    UNUSED(pal);
+    const uint32 *pairs = palette_pairs;
+    uint32 *d = (uint32 *)dst;
+    for (int x = 0; x < width; x++) {
+        d[x] = pairs[src[x]];
+    }
+#else
+    for (int x = 0; x < width; x++) {
+        uint16 c = pal[src[x]];
+        dst[2 * x] = c;
+        dst[2 * x + 1] = c;
+    }
+#endif
+}
+#endif
+
+#if VIDEO_KERNEL_BENCH
+/*
+ *  Microbenchmark comparing the scalar and fast kernels on a full-screen
+ *  equivalent workload (MAC_SCREEN_HEIGHT rows), run once from VideoInit
+ */
+static void benchmarkRenderKernels(void)
+{
+    const int iterations = 20;
+    static uint8 src[MAC_SCREEN_WIDTH] __attribute__((aligned(16)));
+    uint16 pal[256];
+    
+    for (int i = 0; i < MAC_SCREEN_WIDTH; i++) {
+        src[i] = (uint8)(i * 37 + (i >> 3));
+    }
+    for (int i = 0; i < 256; i++) {
+        pal[i] = (uint16)(i * 0x0101 ^ 0x5a5a);
+    }
+    buildPalettePairs(pal);
+    
+    // Both kernels write into the two halves of the streaming buffers
+    uint16 *ref0 = streaming_row_buffer_a, *ref1 = ref0 + DISPLAY_WIDTH;
+    uint16 *out0 = streaming_row_buffer_b, *out1 = out0 + DISPLAY_WIDTH;
+    
+    uint32 t0 = micros();
+    for (int n = 0; n < iterations; n++) {
+        for (int y = 0; y < MAC_SCREEN_HEIGHT; y++) {
+            expandRow2xScalar(src, pal, ref0, ref1, MAC_SCREEN_WIDTH);
+        }
+    }
+    uint32 t1 = micros();
+    for (int n = 0; n < iterations; n++) {
+        for (int y = 0; y < MAC_SCREEN_HEIGHT; y++) {
+            expandRow2xFast(src, out0, out1, MAC_SCREEN_WIDTH);
+        }
+    }
+    uint32 t2 = micros();
+    
+    bool match = memcmp(ref0, out0, DISPLAY_WIDTH * 2 * sizeof(uint16)) == 0;
+    uint32 scalar_us = (t1 - t0) / iterations;
+    uint32 fast_us = (t2 - t1) / iterations;
+    Serial.printf("[VIDEO] Kernel bench (per frame): scalar %u us, fast%s %u us (%.2fx), output %s\n",
+                  scalar_us, VIDEO_USE_PIE ? "+PIE" : "", fast_us,
+                  fast_us ? (float)scalar_us / fast_us : 0.0f, match ? "identical" : "MISMATCH");
+}
+#endif
+
+/*
+ *  Render a packed-pixel tile snapshot (BITS = 1, 2 or 4) with packed_lut
+ *  One table load per source byte yields all of its pixels, already doubled
+ *  for 2x; 1:1 mode keeps the low half of each pair. The 1-bit case is
+ *  effectively a glyph blit (8 pixels per byte, two colours).
+ */
+template <int BITS>
+static void renderPackedTile(const uint8 *snapshot, uint16 *out, int out_stride, int scale, bool line_repeat)
+{
+    const int PPB = 8 / BITS;
+    const int ROW_BYTES = tile_width / PPB;
+    const uint8 *src = snapshot;
+    
+    for (int row = 0; row < tile_height; row++) {
+        if (scale == 1) {
+            uint16 *d = out;
+            for (int b = 0; b < ROW_BYTES; b++) {
+                const uint32 *e = packed_lut[src[b]];
+                for (int k = 0; k < PPB; k++) {
+                    *d++ = (uint16)e[k];
+                }
+            }
+            out += out_stride;
+        } else {
+            uint32 *d0 = (uint32 *)out;
+            uint32 *d1 = (uint32 *)(out + out_stride);
+            for (int b = 0; b < ROW_BYTES; b++) {
+                const uint32 *e = packed_lut[src[b]];
+                for (int k = 0; k < PPB; k++) {
+                    d0[k] = e[k];
+                    if (!line_repeat) d1[k] = e[k];
+                }
+                d0 += PPB;
+                d1 += PPB;
+            }
+            out += line_repeat ? out_stride : out_stride * 2;
+        }
+        src += ROW_BYTES;
+    }
+}
+
+/*
+ *  Render a tile from a contiguous snapshot buffer (not from framebuffer)
+ *  This ensures we render from consistent data that won't change mid-render.
+ *  
+ *  @param snapshot        Tile snapshot buffer (tile_width * tile_height pixels, contiguous;
+ *                         packed bytes, 8-bit indices, or swap565 in 16-bit mode)
+ *  @param local_palette   Pre-copied palette for thread safety
+ *  @param out_buffer      Output buffer for RGB565 pixels (tile's top-left pixel)
+ *  @param out_stride      Output buffer row length in pixels (span width)
+ *  @param line_repeat     2x mode only: write one widened row per source row
+ */
+static void renderTileFromSnapshot(uint8 *snapshot, uint16 *local_palette, uint16 *out_buffer, int out_stride, bool line_repeat)
+{
+    uint16 *out = out_buffer;
+    int row_step = line_repeat ? out_stride : out_stride * 2;
+    
+    if (current_depth == VDEPTH_16BIT) {
+        // Direct colour: already in display order, widen only
+        const uint16 *src = (const uint16 *)snapshot;
+        for (int row = 0; row < tile_height; row++) {
+            widenRow16(src, out, line_repeat ? NULL : out + out_stride, tile_width);
+            src += tile_width;
+            out += row_step;
+        }
+        return;
+    }
+    
+    // Packed depths: straight from packed bytes to RGB565, no decode pass
+    switch (current_depth) {
+        case VDEPTH_1BIT:
+            renderPackedTile<1>(snapshot, out, out_stride, pixel_scale, line_repeat);
+            return;
+        case VDEPTH_2BIT:
+            renderPackedTile<2>(snapshot, out, out_stride, pixel_scale, line_repeat);
+            return;
+        case VDEPTH_4BIT:
+            renderPackedTile<4>(snapshot, out, out_stride, pixel_scale, line_repeat);
+            return;
+        default:
+            break;
+    }
+    
+    uint8 *src = snapshot;
+    
+    // 1:1 mode: one palette lookup per pixel
+    if (pixel_scale == 1) {
+        for (int row = 0; row < tile_height; row++) {
+            lookupRow1x(src, local_palette, out, tile_width);
+            src += tile_width;
+            out += out_stride;
+        }
+        return;
+    }
+    
+    // Process each row of the Mac tile
+    for (int row = 0; row < tile_height; row++) {
+#if VIDEO_LINE_REPEAT
+        if (line_repeat) {
+            // One widened row; pushSpan() sends it twice
+            widenRow2x(src, local_palette, out, tile_width);
+            src += tile_width;
+            out += row_step;
+            continue;
+        }
+#endif
+        // Output row pointers (two rows for 2x vertical scaling)
+        expandRow2x(src, local_palette, out, out + out_stride, tile_width);
+        src += tile_width;
+        
+        // Move output pointer by 2 rows (2x vertical scaling)
+        out += row_step;
+    }
+}
+
+/*
+ *  Record which palette indices a tile snapshot (packed or 8-bit) uses
+ *  Runs of one index are common in UI content, so only changes are set.
+ */
+static void buildTileColourSet(const uint8 *snapshot, int tile_idx)
+{
+    uint32 used[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    int ppb = current_pixels_per_byte;
+    
+    if (ppb > 1) {
+        // Packed snapshot: at most 16 indices, all in used[0]
+        int bytes = tile_width * tile_height / ppb;
+        int bits = 8 / ppb;
+        uint32 mask = (1u << bits) - 1;
+        int last = -1;
+        for (int i = 0; i < bytes; i++) {
+            int b = snapshot[i];
+            if (b == last) continue;
+            last = b;
+            for (int k = 0; k < ppb; k++) {
+                used[0] |= 1u << ((b >> (k * bits)) & mask);
+            }
+        }
+        memcpy(tile_colours[tile_idx], used, sizeof(used));
+        return;
+    }
+    
+    int last = -1;
+    for (int i = 0; i < tile_width * tile_height; i++) {
+        int idx = snapshot[i];
+        if (idx == last) continue;
+        used[idx >> 5] |= 1u << (idx & 31);
+        last = idx;
+    }
+    memcpy(tile_colours[tile_idx], used, sizeof(used));
+}
+
+/*
+ *  Add the tiles that use any of the changed palette entries to dirty_tiles
+ *  Returns the number of tiles added
+ */
+static int markPaletteDirtyTiles(const uint32 *changed)
+{
+    if (current_depth == VDEPTH_16BIT) return 0;
+    
+    int added = 0;
+    int n = total_tiles;
+    for (int t = 0; t < n; t++) {
+        const uint32 *used = tile_colours[t];
+        uint32 hit = 0;
+        for (int w = 0; w < 8; w++) {
+            hit |= used[w] & changed[w];
+        }
+        uint32 bit = 1u << (t % 32);
+        if (hit && !(dirty_tiles[t / 32] & bit)) {
+            dirty_tiles[t / 32] |= bit;
+            added++;
+        }
+    }
+    return added;
+}
+
+#if VIDEO_TILE_HASH
+/*
+ *  Hash a tile snapshot: rows of row_bytes (a multiple of 4, word aligned)
+ *  stride_bytes apart, seeded with what else decides the tile's look
+ *  Two 32-bit multiply lanes, so a collision (a stale tile until its next
+ *  write) needs both to collide
+ */
+static uint64 hashTile(const uint8 *p, int row_bytes, int rows, int stride_bytes, uint32 seed)
+{
+    uint32 a = 2166136261u ^ seed;
+    uint32 b = 0x9e3779b9u + seed;
+    for (int row = 0; row < rows; row++) {
+        const uint32 *w = (const uint32 *)(p + row * stride_bytes);
+        for (int i = 0; i < row_bytes / 4; i++) {
+            a = (a ^ w[i]) * 16777619u;
+            b = (b + w[i]) * 0x85ebca6bu;
+            b ^= b >> 15;
+        }
+    }
+    return ((uint64)a << 32) | b;
+}
+
+/*
+ *  Hash tile (tx, ty) as snapshotAndRenderTile() copied it
+ */
+static uint64 hashTileSnapshot(int tx, int ty, const uint8 *snapshot, const uint16 *out, int out_stride)
+{
+    uint32 seed = tile_hash_epoch;
+#if VIDEO_CURSOR_OVERLAY
+    if (cursorInTile(tx, ty)) {
+        seed ^= (cursor_frame.seq + 1) * 0x9e3779b1u;
+    }
+#else
+    UNUSED(tx); UNUSED(ty);
+#endif
+    if (current_depth == VDEPTH_16BIT && pixel_scale == 1) {
+        return hashTile((const uint8 *)out, tile_width * 2, tile_height, out_stride * 2, seed);
+    }
+    int bytes = current_depth == VDEPTH_16BIT ? tile_width * 2 : tile_width / current_pixels_per_byte;
+    return hashTile(snapshot, bytes * tile_height, 1, 0, seed);
+}
+#endif
+
+/*
+ *  Snapshot one tile and render it into out (see renderAndPushDirtyTiles()
+ *  for the snapshot protocol)
+ *  In 16-bit 1:1 mode the snapshot is the output, so it is copied straight
+ *  into out.
+ *  Returns false if the tile looks as it was last shown (VIDEO_TILE_HASH),
+ *  in which case out is left as it was and the tile need not be pushed.
+ */
+static bool snapshotAndRenderTile(uint8 *src_buffer, uint16 *local_palette, int tx, int ty,
+                                  uint8 *snapshot, uint16 *out, int out_stride, bool line_repeat)
+{
+    int tile_idx = ty * tiles_x + tx;
+    uint32 tile_bit = 1u << (tile_idx % 32);
+    bool direct16 = (current_depth == VDEPTH_16BIT);
+    
+    // STEP 1: Read the tile's generation; every write it counts is visible
+    // (the marker bumps it after the write, with release ordering)
+    // STEP 2: Take a mini-snapshot of just this tile
+    // STEP 3: If the generation moved, a write landed mid-copy: copy again
+    uint32 gen;
+    bool clean;
+    int attempt = 0;
+    BENCH_STAGE_BEGIN(bench_snapshot);
+    for (;;) {
+        gen = tileGeneration(tile_idx);
+#if VIDEO_DEFERRED_DIRTY
+        int spans = countTileSpans(tx, ty);
+#endif
+        if (direct16 && pixel_scale == 1) {
+            snapshotTile16(src_buffer, tx, ty, out, out_stride);
+        } else if (direct16) {
+            snapshotTile16(src_buffer, tx, ty, (uint16 *)snapshot, tile_width);
+        } else {
+            snapshotTile(src_buffer, tx, ty, snapshot);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        clean = __atomic_load_n(&tile_generation[tile_idx], __ATOMIC_RELAXED) == gen;
+#if VIDEO_DEFERRED_DIRTY
+        // Writes not yet folded by VideoRefresh() only show as new span bits
+        clean = clean && countTileSpans(tx, ty) == spans;
+#endif
+        if (clean || attempt == VIDEO_SNAPSHOT_RETRIES) break;
+        attempt++;
+        perf_retry_count++;
+    }
+    BENCH_STAGE_END(BENCH_SNAPSHOT, bench_snapshot);
+    
+    if (clean) {
+        // The snapshot holds every write up to gen, so drop the redraw they
+        // queued for the next frame - unless the tile was written (or the
+        // cursor moved) since, which the re-check after the clear catches
+        __atomic_and_fetch(&write_dirty_tiles[tile_idx / 32], ~tile_bit, __ATOMIC_ACQ_REL);
+        if (tileGeneration(tile_idx) != gen || cursorChangedSinceSample()) {
+            __atomic_or_fetch(&write_dirty_tiles[tile_idx / 32], tile_bit, __ATOMIC_RELAXED);
+        }
+    } else {
+        // Still torn: show it, the tile stays dirty for the next frame
+        perf_torn_count++;
+        PerfAdd(perf_torn, 1);
+    }
+    
+#if VIDEO_TILE_HASH
+    // A torn copy is shown anyway, its hash is still what the tile shows
+    uint64 hash = hashTileSnapshot(tx, ty, snapshot, out, out_stride);
+    if (clean && hash == tile_hash[tile_idx]) {
+        perf_hash_skips++;
+        PerfAdd(perf_hash_skip, 1);
+        return false;
+    }
+    tile_hash[tile_idx] = hash;
+#endif
+    
+    BENCH_STAGE_BEGIN(bench_render);
+    if (!direct16 && tile_colours) {
+        buildTileColourSet(snapshot, tile_idx);
+    }
+    
+    // STEP 4: Render from the snapshot (not from the live framebuffer)
+    if (!(direct16 && pixel_scale == 1)) {
+        renderTileFromSnapshot(snapshot, local_palette, out, out_stride, line_repeat);
+    }
+    BENCH_STAGE_END(BENCH_RENDER, bench_render);
+    
+#if VIDEO_CURSOR_OVERLAY
+    // STEP 5: Overlay the cursor
+    compositeCursor(tx, ty, out, out_stride, line_repeat);
+#endif
+    return true;
+}
+
+/*
+ *  Start pushing a rendered span of 'tiles' horizontally adjacent tiles to
+ *  its display position as one async DMA transaction
+ *  With line_repeat each buffered row is sent twice; the address window
+ *  advances row by row, which gives the 2x vertical scaling
+ *  stride is the buffer's row length in pixels; a span cut short (see
+ *  renderAndPushDirtyTiles()) is wider than it and goes out row by row
+ */
+static void pushSpan(const uint16 *buffer, int x, int y, int tiles, int stride, bool line_repeat)
+{
+    int scale = pixel_scale;
+    int span_pixel_width = tile_width * scale * tiles;
+    int tile_pixel_height = tile_height * scale;
+    
+    M5.Display.setAddrWindow(x, y, span_pixel_width, tile_pixel_height);
+    if (line_repeat) {
+        for (int row = 0; row < tile_height; row++) {
+            const uint16 *line = buffer + row * stride;
+            M5.Display.writePixelsDMA(line, span_pixel_width);
+            M5.Display.writePixelsDMA(line, span_pixel_width);
+        }
+    } else if (stride != span_pixel_width) {
+        for (int row = 0; row < tile_pixel_height; row++) {
+            M5.Display.writePixelsDMA(buffer + row * stride, span_pixel_width);
+        }
+    } else {
+        M5.Display.writePixelsDMA(buffer, span_pixel_width * tile_pixel_height);
+    }
+}
+
+// Tile snapshot buffer (40x40 pixels, up to 2 bytes each); each tile is
+// snapshotted and rendered before the next one, so one is enough
+// In internal SRAM for fast access during partial updates
+DRAM_ATTR static uint8 tile_snapshot[TILE_MAX_PIXELS * MAC_MAX_BYTES_PER_PIXEL] __attribute__((aligned(16)));
+
+#if VIDEO_DIRECT_FB
+static uint16 *direct_fb = NULL;  // Scan-out framebuffer, NULL if unavailable
+
+/*
+ *  Return the DSI scan-out framebuffer (DISPLAY_WIDTH x DISPLAY_HEIGHT RGB565)
+ *  M5GFX keeps its DPI panel handle private, so the default returns NULL; a
+ *  board file that owns the handle can override it with
+ *  esp_lcd_dpi_panel_get_frame_buffer()
+ */
+extern "C" __attribute__((weak)) void *videoDirectFrameBuffer(void)
+{
+    return NULL;
+}
+
+/*
+ *  Write back the cache lines of a rectangle of direct_fb so the DSI DMA sees it
+ */
+static void writebackFrameBuffer(uint16 *start, int width, int rows)
+{
+#if HAS_ESP_CACHE
+    if (width == DISPLAY_WIDTH) {
+        // Full-width rectangle is contiguous
+        esp_cache_msync(start, width * rows * sizeof(uint16),
+                        ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
+        return;
+    }
+    for (int row = 0; row < rows; row++) {
+        esp_cache_msync(start + row * DISPLAY_WIDTH, width * sizeof(uint16),
+                        ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
+    }
+#else
+    UNUSED(start); UNUSED(width); UNUSED(rows);
+#endif
+}
+
+/*
+ *  Render dirty tiles straight into direct_fb
+ *  Same snapshot protocol as renderAndPushDirtyTiles(); each run
+ *  of adjacent dirty tiles is written back with one pass over its lines
+ */
+static void renderDirtyTilesDirect(uint8 *src_buffer, uint16 *local_palette)
+{
+    int ntx = tiles_x;
+    int nty = tiles_y;
+    int tile_pixel_width = tile_width * pixel_scale;
+    int tile_pixel_height = tile_height * pixel_scale;
+    int tiles_rendered = 0;
+    
+    for (int ty = 0; ty < nty; ty++) {
+        int tx = 0;
+        while (tx < ntx) {
+            if (!isTileDirty(ty * ntx + tx)) {
+                tx++;
+                continue;
+            }
+            
+            // A tile that is unchanged ends the run (and is not written back)
+            int span = 0;
+            int skipped = 0;
+            uint16 *span_out = direct_fb + ty * tile_pixel_height * DISPLAY_WIDTH + tx * tile_pixel_width;
+            while (tx + span < ntx && isTileDirty(ty * ntx + tx + span)) {
+                if (!snapshotAndRenderTile(src_buffer, local_palette, tx + span, ty, tile_snapshot,
+                                           span_out + span * tile_pixel_width, DISPLAY_WIDTH, false)) {
+                    skipped = 1;
+                    break;
+                }
+                span++;
+            }
+            
+            if (span > 0) {
+                writebackFrameBuffer(span_out, span * tile_pixel_width, tile_pixel_height);
+            }
+            tx += span + skipped;
+            
+            // Every 8 tiles, yield to let other tasks run
+            int before = tiles_rendered;
+            tiles_rendered += span;
+            if ((before >> 3) != (tiles_rendered >> 3)) {
+                taskYIELD();
+            }
+        }
+    }
+}
+#endif
+
+/*
+ *  Render and push only dirty tiles to the display
+ *  RACE-CONDITION FIX: Uses per-tile generation counters and double-buffered DMA.
+ *  
  *  This prevents visual glitches (especially around the mouse cursor) caused by
  *  the CPU writing to the framebuffer while we're reading it:
- *  1. Set tile_render_active before snapshot
- *  2. If CPU writes during snapshot, tile is re-marked dirty for next frame
+ *  1. Each tile is snapshotted seqlock-style against its write generation
+ *  2. If CPU writes during snapshot, the tile is copied again this frame
  *  3. Double-buffered output allows DMA overlap with rendering
  *  
- *  @param src_buffer     Mac framebuffer (8-bit indexed)
+ *  Runs of up to TILE_SPAN_MAX horizontally adjacent dirty tiles are merged
+ *  into one span, rendered side by side into a span buffer and pushed with a
+ *  single setAddrWindow/writePixelsDMA (scrolling and menu drags dirty long
+ *  runs, where per-transaction overhead dominated).
+ *  
+ *  @param src_buffer     Mac framebuffer (8-bit indexed, packed or 16-bit)
  *  @param local_palette  Pre-copied palette for thread safety
  */
 static void renderAndPushDirtyTiles(uint8 *src_buffer, uint16 *local_palette)
 {
-    // Double-buffered tile snapshot buffers (40x40 = 1600 bytes each)
-    // Static to avoid stack allocation on each call
-    // In internal SRAM for fast access during partial updates
-    DRAM_ATTR static uint8 tile_snapshot_a[TILE_WIDTH * TILE_HEIGHT];
-    DRAM_ATTR static uint8 tile_snapshot_b[TILE_WIDTH * TILE_HEIGHT];
+#if VIDEO_DIRECT_FB
+    if (direct_fb) {
+        renderDirtyTilesDirect(src_buffer, local_palette);
+        return;
+    }
+#endif
     
-    // Double-buffered RGB565 output buffers (80x80 = 12,800 bytes each)
+    // Double-buffered RGB565 span buffers, sized for the 2x mode (80x80 =
+    // 12,800 bytes per tile, or 80x40 = 6,400 bytes with VIDEO_LINE_REPEAT,
+    // times TILE_SPAN_MAX)
     // In internal SRAM for fast access during partial updates
-    DRAM_ATTR static uint16 tile_buffer_a[TILE_WIDTH * PIXEL_SCALE * TILE_HEIGHT * PIXEL_SCALE];
-    DRAM_ATTR static uint16 tile_buffer_b[TILE_WIDTH * PIXEL_SCALE * TILE_HEIGHT * PIXEL_SCALE];
+    DRAM_ATTR static uint16 span_buffer_a[TILE_BUFFER_PIXELS * TILE_SPAN_MAX] __attribute__((aligned(16)));
+    DRAM_ATTR static uint16 span_buffer_b[TILE_BUFFER_PIXELS * TILE_SPAN_MAX] __attribute__((aligned(16)));
     
     // Buffer pointers for double-buffering
-    uint8 *current_snapshot = tile_snapshot_a;
-    uint8 *next_snapshot = tile_snapshot_b;
-    uint16 *current_buffer = tile_buffer_a;
-    uint16 *next_buffer = tile_buffer_b;
-    
-    int tile_pixel_width = TILE_WIDTH * PIXEL_SCALE;
-    int tile_pixel_height = TILE_HEIGHT * PIXEL_SCALE;
+    uint16 *current_buffer = span_buffer_a;
+    uint16 *next_buffer = span_buffer_b;
+    
+    // Geometry is volatile (mode switches), use one copy for the whole frame
+    int ntx = tiles_x;
+    int nty = tiles_y;
+    int tile_pixel_width = tile_width * pixel_scale;
+    int tile_pixel_height = tile_height * pixel_scale;
+    bool line_repeat = VIDEO_LINE_REPEAT && pixel_scale == 2;
     int tiles_rendered = 0;
     bool dma_pending = false;
     
     M5.Display.startWrite();
     
-    for (int ty = 0; ty < TILES_Y; ty++) {
-        for (int tx = 0; tx < TILES_X; tx++) {
-            int tile_idx = ty * TILES_X + tx;
-            
+    for (int ty = 0; ty < nty; ty++) {
+        int tx = 0;
+        while (tx < ntx) {
             // Skip tiles that aren't dirty
-            if (!isTileDirty(tile_idx)) {
+            if (!isTileDirty(ty * ntx + tx)) {
+                tx++;
                 continue;
             }
             
-            // STEP 1: Mark tile as being rendered (prevents CPU from tearing)
-            setTileRenderActive(tile_idx);
-            
-            // STEP 2: Take a mini-snapshot of just this tile
-            // While render_active is set, CPU writes will re-mark tile dirty
-            snapshotTile(src_buffer, tx, ty, current_snapshot);
-            
-            // STEP 3: Clear render lock - snapshot is complete
-            // Any CPU writes after this point will be visible in next frame
-            clearTileRenderActive(tile_idx);
-            
-            // Memory barrier to ensure snapshot is complete before rendering
-            __sync_synchronize();
+            // Extend the span over the following dirty tiles
+            int span = 1;
+            while (span < TILE_SPAN_MAX && tx + span < ntx && isTileDirty(ty * ntx + tx + span)) {
+                span++;
+            }
+            int span_stride = tile_pixel_width * span;
             
-            // STEP 4: Render from the snapshot (not from the live framebuffer)
-            renderTileFromSnapshot(current_snapshot, local_palette, current_buffer);
+            // STEPS 1-4: snapshot each tile against its generation and render
+            // it into its column of the span; an unchanged tile cuts the span
+            // short and is not pushed
+            int skipped = 0;
+            for (int k = 0; k < span; k++) {
+                if (!snapshotAndRenderTile(src_buffer, local_palette, tx + k, ty, tile_snapshot,
+                                           current_buffer + k * tile_pixel_width, span_stride, line_repeat)) {
+                    span = k;
+                    skipped = 1;
+                    break;
+                }
+            }
+            if (span == 0) {
+                tx += skipped;
+                continue;
+            }
             
             // STEP 5: Wait for any pending DMA before using its buffer
             if (dma_pending) {
+                BENCH_STAGE_BEGIN(bench_wait);
                 M5.Display.waitDMA();
+                BENCH_STAGE_END(BENCH_WAIT, bench_wait);
                 dma_pending = false;
             }
             
-            // STEP 6: Push to display using async DMA
-            int dst_start_x = tx * tile_pixel_width;
-            int dst_start_y = ty * tile_pixel_height;
-            
-            M5.Display.setAddrWindow(dst_start_x, dst_start_y, tile_pixel_width, tile_pixel_height);
-            M5.Display.writePixelsDMA(current_buffer, tile_pixel_width * tile_pixel_height);
+            // STEP 6: Push the whole span using async DMA
+            BENCH_STAGE_BEGIN(bench_push);
+            pushSpan(current_buffer, tx * tile_pixel_width, ty * tile_pixel_height, span, span_stride, line_repeat);
+            BENCH_STAGE_END(BENCH_PUSH, bench_push);
             dma_pending = true;
             
-            // STEP 7: Swap buffers for next tile
-            // This allows rendering next tile while DMA pushes current
-            uint8 *tmp_snap = current_snapshot;
-            current_snapshot = next_snapshot;
-            next_snapshot = tmp_snap;
-            
+            // STEP 7: Swap buffers for next span
+            // This allows rendering next span while DMA pushes current
             uint16 *tmp_buf = current_buffer;
             current_buffer = next_buffer;
             next_buffer = tmp_buf;
             
-            tiles_rendered++;
+            tx += span + skipped;
             
             // Every 8 tiles, yield to let other tasks run
             // This prevents starvation during full-screen updates
-            if ((tiles_rendered & 0x07) == 0) {
+            int before = tiles_rendered;
+            tiles_rendered += span;
+            if ((before >> 3) != (tiles_rendered >> 3)) {
                 taskYIELD();
             }
         }
@@ -897,7 +2239,9 @@ static void renderAndPushDirtyTiles(uint8 *src_buffer, uint16 *local_palette)
     
     // Wait for final DMA to complete before ending write session
     if (dma_pending) {
+        BENCH_STAGE_BEGIN(bench_wait);
         M5.Display.waitDMA();
+        BENCH_STAGE_END(BENCH_WAIT, bench_wait);
     }
     
     M5.Display.endWrite();
@@ -920,6 +2264,9 @@ static void renderFrameStreaming(uint8 *src_buffer, uint16 *local_palette)
 {
     if (!src_buffer) return;
     
+    // Only handles the 640x360 indexed modes
+    if (pixel_scale != 2 || current_depth == VDEPTH_16BIT) return;
+    
     // Get current depth and bytes per row (volatile, so copy locally)
     video_depth depth = current_depth;
     uint32 bpr = current_bytes_per_row;
@@ -958,46 +2305,8 @@ static void renderFrameStreaming(uint8 *src_buffer, uint16 *local_palette)
                 pixel_row = decoded_row;
             }
             
-            // Output row pointers for the two scaled display rows
-            uint16 *dst_row0 = out;
-            uint16 *dst_row1 = out + DISPLAY_WIDTH;
-            
-            // Process 4 decoded pixels at a time for better memory bandwidth
-            int x = 0;
-            for (; x < MAC_SCREEN_WIDTH - 3; x += 4) {
-                // Read 4 decoded pixels at once (32-bit read from 8-bit indices)
-                uint32 src4 = *((uint32 *)(pixel_row + x));
-                
-                // Convert each pixel through palette and write 2x2 scaled
-                uint16 c0 = local_palette[src4 & 0xFF];
-                uint16 c1 = local_palette[(src4 >> 8) & 0xFF];
-                uint16 c2 = local_palette[(src4 >> 16) & 0xFF];
-                uint16 c3 = local_palette[(src4 >> 24) & 0xFF];
-                
-                // Write to row 0 (2 pixels per source pixel)
-                dst_row0[0] = c0; dst_row0[1] = c0;
-                dst_row0[2] = c1; dst_row0[3] = c1;
-                dst_row0[4] = c2; dst_row0[5] = c2;
-                dst_row0[6] = c3; dst_row0[7] = c3;
-                
-                // Write to row 1 (duplicate of row 0)
-                dst_row1[0] = c0; dst_row1[1] = c0;
-                dst_row1[2] = c1; dst_row1[3] = c1;
-                dst_row1[4] = c2; dst_row1[5] = c2;
-                dst_row1[6] = c3; dst_row1[7] = c3;
-                
-                dst_row0 += 8;
-                dst_row1 += 8;
-            }
-            
-            // Handle remaining pixels (if width not divisible by 4)
-            for (; x < MAC_SCREEN_WIDTH; x++) {
-                uint16 c = local_palette[pixel_row[x]];
-                dst_row0[0] = c; dst_row0[1] = c;
-                dst_row1[0] = c; dst_row1[1] = c;
-                dst_row0 += 2;
-                dst_row1 += 2;
-            }
+            // Convert and write the two scaled display rows
+            expandRow2x(pixel_row, local_palette, out, out + DISPLAY_WIDTH, MAC_SCREEN_WIDTH);
             
             // Move output pointer by 2 display rows (2x vertical scaling)
             out += DISPLAY_WIDTH * 2;
@@ -1016,7 +2325,7 @@ static void renderFrameStreaming(uint8 *src_buffer, uint16 *local_palette)
         
         // Start async DMA push of the just-rendered buffer (now in push_buffer)
         // 8 display rows * 1280 pixels = 10240 pixels per chunk
-        int display_y = mac_y * PIXEL_SCALE;
+        int display_y = mac_y * 2;
         M5.Display.setAddrWindow(0, display_y, DISPLAY_WIDTH, STREAMING_ROW_COUNT);
         M5.Display.writePixelsDMA(push_buffer, DISPLAY_WIDTH * STREAMING_ROW_COUNT);
         dma_pending = true;
@@ -1037,6 +2346,187 @@ static void renderFrameStreaming(uint8 *src_buffer, uint16 *local_palette)
     M5.Display.endWrite();
 }
 
+#if VIDEO_PIPELINE_BENCH
+#define BENCH_FRAMES        100     // Frames per pattern (p99 = second slowest)
+#define BENCH_CURSOR_SIZE   16
+
+enum { PATTERN_TILE, PATTERN_CURSOR, PATTERN_SCROLL, PATTERN_FULL, PATTERN_PALETTE, PATTERN_COUNT };
+static const char *const bench_pattern_names[PATTERN_COUNT] = {
+    "single tile", "cursor", "scroll strip", "full screen", "palette cycle"
+};
+
+/*
+ *  Store pixel (x, y) of the current depth
+ */
+static void benchPutPixel(int x, int y, uint8 value)
+{
+    uint8 *p = mac_frame_buffer + y * current_bytes_per_row;
+    int ppb = current_pixels_per_byte;
+    if (ppb == 1) {
+        p[x] = value;
+        return;
+    }
+    int bits = 8 / ppb;
+    int shift = 8 - bits * (x % ppb + 1);
+    uint8 mask = current_pixel_mask << shift;
+    p += x / ppb;
+    *p = (*p & ~mask) | ((value << shift) & mask);
+}
+
+/*
+ *  Mark the tiles a Mac pixel rectangle touches in dirty_tiles
+ */
+static void benchMarkRect(int x, int y, int w, int h)
+{
+    for (int ty = y / tile_height; ty <= (y + h - 1) / tile_height; ty++) {
+        for (int tx = x / tile_width; tx <= (x + w - 1) / tile_width; tx++) {
+            int t = ty * tiles_x + tx;
+            dirty_tiles[t / 32] |= 1u << (t % 32);
+        }
+    }
+}
+
+static int compareU32(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ *  Drive renderAndPushDirtyTiles() with reproducible dirty patterns at every
+ *  indexed depth of the 640x360 mode and print p50/p99 frame times with the
+ *  average time per frame of each stage, at the tile size the 640x360 mode
+ *  gets. Runs from VideoInit before the video task exists; leaves the frame
+ *  buffer and tile state as it found them.
+ */
+static void benchmarkVideoTiles(void)
+{
+    static const video_depth depths[] = { VDEPTH_1BIT, VDEPTH_2BIT, VDEPTH_4BIT, VDEPTH_8BIT };
+    static uint32 frame_us[BENCH_FRAMES];
+    uint16 pal[256];
+    uint32 mhz = ESP.getCpuFreqMHz();
+    
+    for (int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); d++) {
+        video_depth depth = depths[d];
+        updateVideoStateCache(depth, TrivialBytesPerRow(MAC_SCREEN_WIDTH, depth),
+                              MAC_SCREEN_WIDTH, MAC_SCREEN_HEIGHT);
+        if (d == 0) {
+            Serial.printf("[VIDEO BENCH] %d frames per pattern, %dx%d tiles, span %d, line repeat %d, direct fb %d\n",
+                          BENCH_FRAMES, tile_width, tile_height, TILE_SPAN_MAX, VIDEO_LINE_REPEAT, VIDEO_DIRECT_FB);
+        }
+        initDefaultPalette(depth);
+        memcpy(pal, palette_rgb565, sizeof(pal));
+        buildPalettePairs(pal);
+        buildPackedLUT(pal, depth);
+        
+        // Diagonal bands; in 8-bit the top two tile rows use entries 0-15
+        // (the ones the palette cycle rotates) and the rest 16-255
+        int colours = 1 << (1 << depth);
+        for (int y = 0; y < MAC_SCREEN_HEIGHT; y++) {
+            for (int x = 0; x < MAC_SCREEN_WIDTH; x++) {
+                int v = (x / 5 + y / 3) % colours;
+                if (depth == VDEPTH_8BIT) {
+                    v = y < tile_height * 2 ? v % 16 : 16 + v % 240;
+                }
+                benchPutPixel(x, y, v);
+            }
+        }
+        
+        for (int p = 0; p < PATTERN_COUNT; p++) {
+            memset(bench_stage_cycles, 0, sizeof(bench_stage_cycles));
+            uint32 tiles = 0;
+            
+            for (int f = 0; f < BENCH_FRAMES; f++) {
+                memset(dirty_tiles, 0, sizeof(dirty_tiles));
+                switch (p) {
+                    case PATTERN_TILE:
+                        benchMarkRect((f % tiles_x) * tile_width, (f / tiles_x % tiles_y) * tile_height,
+                                      tile_width, tile_height);
+                        break;
+                    case PATTERN_CURSOR:
+                        benchMarkRect(f * 7 % (MAC_SCREEN_WIDTH - BENCH_CURSOR_SIZE),
+                                      f * 5 % (MAC_SCREEN_HEIGHT - BENCH_CURSOR_SIZE),
+                                      BENCH_CURSOR_SIZE, BENCH_CURSOR_SIZE);
+                        break;
+                    case PATTERN_SCROLL:
+                        // A document window's content area scrolling
+                        benchMarkRect(80, 40, 480, 280);
+                        break;
+                    case PATTERN_FULL:
+                        benchMarkRect(0, 0, MAC_SCREEN_WIDTH, MAC_SCREEN_HEIGHT);
+                        break;
+                    case PATTERN_PALETTE: {
+                        // Rotate entries 1-15 as a palette animation would
+                        uint16 first = pal[1];
+                        memmove(&pal[1], &pal[2], 14 * sizeof(uint16));
+                        pal[15] = first;
+                        buildPalettePairs(pal);
+                        buildPackedLUT(pal, depth);
+                        uint32 delta[8] = { 0xfffe, 0, 0, 0, 0, 0, 0, 0 };
+                        if (tile_colours) {
+                            markPaletteDirtyTiles(delta);
+                        } else {
+                            benchMarkRect(0, 0, MAC_SCREEN_WIDTH, MAC_SCREEN_HEIGHT);
+                        }
+                        break;
+                    }
+                }
+                for (int i = 0; i < TILE_BITMAP_WORDS; i++) {
+                    tiles += __builtin_popcount(dirty_tiles[i]);
+                }
+                
+#if VIDEO_TILE_HASH
+                tile_hash_epoch++;  // Time the full path, not the content check
+#endif
+                uint32 t0 = micros();
+                renderAndPushDirtyTiles(mac_frame_buffer, pal);
+                frame_us[f] = micros() - t0;
+                vTaskDelay(1);  // Let the idle task run between frames
+            }
+            
+            qsort(frame_us, BENCH_FRAMES, sizeof(frame_us[0]), compareU32);
+            uint64 per_frame = (uint64)BENCH_FRAMES * mhz;
+            Serial.printf("[VIDEO BENCH] %d-bit %-13s tiles %3u  p50 %5u us  p99 %5u us  "
+                          "snapshot %4u  render %5u  push %4u  wait %5u us/frame\n",
+                          1 << depth, bench_pattern_names[p], tiles / BENCH_FRAMES,
+                          frame_us[BENCH_FRAMES / 2], frame_us[BENCH_FRAMES * 99 / 100],
+                          (uint32)(bench_stage_cycles[BENCH_SNAPSHOT] / per_frame),
+                          (uint32)(bench_stage_cycles[BENCH_RENDER] / per_frame),
+                          (uint32)(bench_stage_cycles[BENCH_PUSH] / per_frame),
+                          (uint32)(bench_stage_cycles[BENCH_WAIT] / per_frame));
+        }
+    }
+    
+    // Back to the state VideoInit() set up
+    memset(mac_frame_buffer, 0x80, frame_buffer_size);
+    memset(dirty_tiles, 0, sizeof(dirty_tiles));
+    memset(write_dirty_tiles, 0, sizeof(write_dirty_tiles));
+    memset(tile_generation, 0, sizeof(tile_generation));
+    if (tile_colours) {
+        memset(tile_colours, 0, MAX_TOTAL_TILES * sizeof(*tile_colours));
+    }
+    force_full_update = true;
+}
+
+/*
+ *  Run the pipeline benchmark (with VIDEO_TILE_GEOMETRY once per tile size)
+ */
+static void benchmarkVideoPipeline(void)
+{
+#if VIDEO_TILE_GEOMETRY
+    // Every tile size in turn, to choose "videotile" from
+    int saved_pref = tile_geometry_pref;
+    for (int g = 0; g < TILE_GEOMETRY_COUNT; g++) {
+        tile_geometry_pref = g;
+        benchmarkVideoTiles();
+    }
+    tile_geometry_pref = saved_pref;
+#else
+    benchmarkVideoTiles();
+#endif
+}
+#endif
+
 /*
  *  Stop the video rendering task
  */
@@ -1065,11 +2555,21 @@ static void reportVideoPerfStats(void)
         
         uint32_t total_frames = perf_full_count + perf_partial_count + perf_skip_count;
         if (total_frames > 0) {
-            Serial.printf("[VIDEO PERF] frames=%u (full=%u partial=%u skip=%u)\n",
-                          total_frames, perf_full_count, perf_partial_count, perf_skip_count);
-            Serial.printf("[VIDEO PERF] avg: detect=%uus render=%uus\n",
-                          perf_detect_us / (total_frames > 0 ? total_frames : 1),
-                          perf_render_us / (total_frames > 0 ? total_frames : 1));
+            LOG_PRINTF("[VIDEO PERF] frames=%u (full=%u partial=%u skip=%u)\n",
+                       total_frames, perf_full_count, perf_partial_count, perf_skip_count);
+            LOG_PRINTF("[VIDEO PERF] avg: detect=%uus render=%uus\n",
+                       perf_detect_us / (total_frames > 0 ? total_frames : 1),
+                       perf_render_us / (total_frames > 0 ? total_frames : 1));
+            LOG_PRINTF("[VIDEO PERF] pace: %ums (max %d FPS, budget %u KB/s)\n",
+                       video_frame_interval_ms, video_max_fps, video_budget_kbs);
+            uint32_t rendered = perf_full_count + perf_partial_count;
+            uint32_t retries_x100 = rendered ? perf_retry_count * 100 / rendered : 0;
+            LOG_PRINTF("[VIDEO PERF] snapshot retries=%u (%u.%02u/frame) torn=%u palette tiles=%u\n",
+                       perf_retry_count, retries_x100 / 100, retries_x100 % 100, perf_torn_count,
+                       perf_palette_tiles);
+#if VIDEO_TILE_HASH
+            LOG_PRINTF("[VIDEO PERF] unchanged tiles skipped=%u\n", perf_hash_skips);
+#endif
         }
         
         // Reset counters for next interval
@@ -1079,6 +2579,12 @@ static void reportVideoPerfStats(void)
         perf_partial_count = 0;
         perf_full_count = 0;
         perf_skip_count = 0;
+        perf_retry_count = 0;
+        perf_torn_count = 0;
+        perf_palette_tiles = 0;
+#if VIDEO_TILE_HASH
+        perf_hash_skips = 0;
+#endif
     }
 }
 
@@ -1088,7 +2594,8 @@ static void reportVideoPerfStats(void)
  *  Key optimizations over the old triple-buffer approach:
  *  1. NO frame snapshot copy - we read directly from mac_frame_buffer
  *  2. NO per-frame comparison - dirty tiles are marked at write time by memory.cpp
- *  3. Event-driven with timeout - wakes on notification OR after 67ms max
+ *  3. Event-driven with adaptive pacing - wakes only when tiles are dirty,
+ *     at a rate set by how much PSRAM traffic each frame costs
  *  
  *  This eliminates ~230KB memcpy per frame and expensive tile comparisons.
  *  Dirty tracking overhead is spread across actual CPU writes instead of
@@ -1119,83 +2626,162 @@ static void videoRenderTaskOptimized(void *param)
     // Initialize perf reporting timer
     perf_last_report_ms = millis();
     
-    // Minimum frame interval (42ms = ~24 FPS)
-    // 24fps is cinema standard and perceptually smooth
-    const TickType_t min_frame_ticks = pdMS_TO_TICKS(42);
+    // Adaptive pacing: the interval after each frame is set by the PSRAM
+    // traffic that frame cost (see nextFrameInterval()); with nothing dirty
+    // VideoRefresh() sends no signal and the task sleeps until the idle timeout
+    TickType_t frame_ticks = pdMS_TO_TICKS(1000 / video_max_fps);
     TickType_t last_frame_ticks = xTaskGetTickCount();
     
     while (video_task_running) {
         // Note: Watchdog is configured with 10s timeout and no panic,
         // so we don't need to reset it frequently
         
-        // Event-driven: wait for frame signal with timeout
-        // This replaces the old polling loop - task sleeps until signaled
-        // Max wait time ensures we still render periodically even if no signal
-        uint32_t notification = ulTaskNotifyTake(pdTRUE, min_frame_ticks);
-        
-        // Also check legacy frame_ready flag for compatibility
-        bool should_render = (notification > 0) || frame_ready;
+        // Event-driven: wait for frame signal, or the idle timeout as a backstop
+        TickType_t idle_ticks = pdMS_TO_TICKS(VIDEO_IDLE_TIMEOUT_MS);
+#if SCREEN_RECORD
+        if (screenrec_pending) {
+            idle_ticks = frame_ticks;   // Tiles wait for the recorder's ring
+        }
+#endif
+        uint32_t notification = ulTaskNotifyTake(pdTRUE, idle_ticks);
+        bool should_render = (notification > 0) || frame_ready || force_full_update;
         frame_ready = false;
         
-        // Rate limit: ensure minimum time between frames
-        TickType_t now = xTaskGetTickCount();
-        TickType_t elapsed = now - last_frame_ticks;
-        if (should_render && elapsed < min_frame_ticks) {
-            // Too soon - skip this frame signal, we'll render on next timeout
+        if (!should_render && !videoDirtyPending()) {
+#if SCREEN_RECORD
+            recordScreen(NULL);
+#endif
+            perf_skip_count++;
+            reportVideoPerfStats();
             continue;
         }
         
-        // Only render if we have something to render
-        if (!should_render && !force_full_update) {
-            // Timeout with nothing to do - check for write-dirty tiles anyway
-            // This handles cases where writes happened but no explicit signal
+        // Pace: if the last frame was recent, sleep out the rest of its
+        // interval; writes landing meanwhile are folded into this frame
+        TickType_t elapsed = xTaskGetTickCount() - last_frame_ticks;
+        TickType_t pace_ticks = frame_ticks;
+#if VIDEO_VBL_SYNC
+        // The wait for the VBL below makes up the last tick of the interval
+        const TickType_t vbl_ticks = pdMS_TO_TICKS(VIDEO_VBL_PERIOD_MS);
+        pace_ticks = pace_ticks > vbl_ticks ? pace_ticks - vbl_ticks : 0;
+#endif
+        if (elapsed < pace_ticks) {
+            vTaskDelay(pace_ticks - elapsed);
         }
+#if VIDEO_VBL_SYNC
+        if (vbl_sem) {
+            xSemaphoreTake(vbl_sem, 0);     // Drop a VBL given while pacing
+            xSemaphoreTake(vbl_sem, pdMS_TO_TICKS(VIDEO_VBL_WAIT_MS));
+        }
+#endif
+        TickType_t now = xTaskGetTickCount();
         
         uint32_t t0, t1;
         
         // Take a snapshot of the palette only if it changed (thread-safe)
         // This avoids 512-byte memcpy and spinlock contention on every frame
+        uint32 palette_delta[8];
+        bool have_palette_delta = false;
         if (palette_changed) {
             portENTER_CRITICAL(&frame_spinlock);
             memcpy(local_palette, palette_rgb565, 256 * sizeof(uint16));
+            memcpy(palette_delta, palette_changed_set, sizeof(palette_delta));
+            memset(palette_changed_set, 0, sizeof(palette_changed_set));
             palette_changed = false;
             portEXIT_CRITICAL(&frame_spinlock);
+            buildPalettePairs(local_palette);
+            buildPackedLUT(local_palette, current_depth);
+            have_palette_delta = true;
+#if VIDEO_TILE_HASH
+            // Same indices, other colours: nothing matches its old hash
+            tile_hash_epoch++;
+#endif
+        } else if (packed_lut_depth != current_depth) {
+            buildPackedLUT(local_palette, current_depth);
         }
         
         // Collect dirty tiles from write-time tracking
         t0 = micros();
         dirty_tile_count = collectWriteDirtyTiles();
+#if VIDEO_CURSOR_OVERLAY
+        sampleCursor();  // After the collect, see video_cursor_update()
+#endif
         t1 = micros();
         perf_detect_us += (t1 - t0);
+        uint32_t frame_us = t1 - t0;
+#if BOOT_TIMELINE
+        bool mac_drew = dirty_tile_count > 0;
+#endif
         
-        // If force_full_update is set (palette change, first frame), mark ALL tiles dirty
+        // If force_full_update is set (mode switch, first frame), mark ALL tiles dirty
         // This ensures we always use tile mode (faster than streaming mode)
         if (force_full_update) {
             // Mark all tiles as dirty
-            for (int i = 0; i < (TOTAL_TILES + 31) / 32; i++) {
+            for (int i = 0; i < TILE_BITMAP_WORDS; i++) {
                 dirty_tiles[i] = 0xFFFFFFFF;
             }
-            dirty_tile_count = TOTAL_TILES;
+            dirty_tile_count = total_tiles;
             force_full_update = false;
             perf_full_count++;
+#if VIDEO_TILE_HASH
+            tile_hash_epoch++;
+#endif
+        } else if (have_palette_delta && tile_colours) {
+            // Palette animation: redraw only the tiles showing changed entries
+            int added = markPaletteDirtyTiles(palette_delta);
+            dirty_tile_count += added;
+            perf_palette_tiles += added;
         }
+#if VNC_SERVER
+        for (int i = 0; i < TILE_BITMAP_WORDS; i++) {
+            if (dirty_tiles[i]) {
+                __atomic_or_fetch(&remote_tiles[i], dirty_tiles[i], __ATOMIC_RELAXED);
+            }
+        }
+#endif
+#if SCREEN_RECORD
+        recordScreen(dirty_tiles);
+#endif
         
         // RENDER - always use tile mode (faster than streaming even for full screen)
         if (dirty_tile_count > 0) {
             // Render and push only dirty tiles
             t0 = micros();
+#if POWER_GOVERNOR
+            PowerBusyBegin();
+#endif
+#if VIDEO_PAGE_FLIP
+            renderAndPushDirtyTiles(mac_frame_buffer + video_page_offset, local_palette);
+#else
             renderAndPushDirtyTiles(mac_frame_buffer, local_palette);
+#endif
+#if POWER_GOVERNOR
+            PowerBusyEnd();
+#endif
             t1 = micros();
             perf_render_us += (t1 - t0);
             
             perf_partial_count++;
+            PerfAdd(perf_frames, 1);
+            PerfAdd(perf_tiles, dirty_tile_count);
+            PerfRecord(perf_frame_hist, frame_us + (t1 - t0));
+#if VIDEO_VBL_SYNC
+            PerfRecord(perf_vbl_hist, t1 - vbl_us);
+#endif
         } else {
             // No tiles dirty, nothing to do!
             perf_skip_count++;
         }
         
         perf_frame_count++;
+#if BOOT_TIMELINE
+        // The first frame with something the Mac drew
+        if (mac_drew) {
+            BootMark(BOOT_PHASE_FRAME);
+        }
+#endif
         last_frame_ticks = now;
+        frame_ticks = pdMS_TO_TICKS(nextFrameInterval(dirty_tile_count));
         
         // Report performance stats periodically
         reportVideoPerfStats();
@@ -1214,22 +2800,90 @@ bool VideoInit(bool classic)
     
     UNUSED(classic);
     
+    perf_frames = PerfCounter("video.frames");
+    perf_tiles = PerfCounter("video.tiles");
+    perf_torn = PerfCounter("video.torn");
+#if VIDEO_TILE_HASH
+    perf_hash_skip = PerfCounter("video.hash_skips");
+#endif
+    perf_frame_hist = PerfHistogram("video.frame_us");
+#if VIDEO_VBL_SYNC
+    perf_vbl_hist = PerfHistogram("video.vbl_us");
+    if (vbl_sem == NULL) {
+        vbl_sem = xSemaphoreCreateBinary();
+    }
+#endif
+    
+    // Frame pacing limits from prefs (0 = default)
+    video_max_fps = PrefsFindInt32("videofps");
+    if (video_max_fps <= 0) {
+        video_max_fps = VIDEO_DEFAULT_MAX_FPS;
+    } else if (video_max_fps < VIDEO_MIN_FPS) {
+        video_max_fps = VIDEO_MIN_FPS;
+    }
+    video_budget_kbs = PrefsFindInt32("videobudget");
+    if (video_budget_kbs == 0) {
+        video_budget_kbs = VIDEO_DEFAULT_BUDGET_KBS;
+    }
+#if VIDEO_TILE_GEOMETRY
+    // Tile size ("WxH" from tile_geometries[], default auto)
+    const char *tile_pref = PrefsFindString("videotile");
+    tile_geometry_pref = -1;
+    if (tile_pref && strcmp(tile_pref, "auto") != 0) {
+        int w = 0, h = 0;
+        sscanf(tile_pref, "%dx%d", &w, &h);
+        for (int g = 0; g < TILE_GEOMETRY_COUNT; g++) {
+            if (tile_geometries[g].width == w && tile_geometries[g].height == h) {
+                tile_geometry_pref = g;
+            }
+        }
+        if (tile_geometry_pref < 0) {
+            Serial.printf("[VIDEO] videotile: no %s tiles, choosing per mode\n", tile_pref);
+        }
+    }
+#endif
+    Serial.printf("[VIDEO] Frame pacing: up to %d FPS, PSRAM budget %u KB/s\n",
+                  video_max_fps, video_budget_kbs);
+    
+#if VIDEO_PORTRAIT
+    // Native panel orientation; set before InputInit() so touch follows it
+    video_portrait = PrefsFindBool("portrait");
+    if (video_portrait) {
+        M5.Display.setRotation(0);
+    }
+#endif
+    
     // Get display dimensions
     display_width = M5.Display.width();
     display_height = M5.Display.height();
     Serial.printf("[VIDEO] Display size: %dx%d\n", display_width, display_height);
     
     // Verify display size matches our expectations
-    if (display_width != DISPLAY_WIDTH || display_height != DISPLAY_HEIGHT) {
+    int expect_width = video_portrait ? DISPLAY_HEIGHT : DISPLAY_WIDTH;
+    int expect_height = video_portrait ? DISPLAY_WIDTH : DISPLAY_HEIGHT;
+    if (display_width != expect_width || display_height != expect_height) {
         Serial.printf("[VIDEO] WARNING: Expected %dx%d display, got %dx%d\n", 
-                      DISPLAY_WIDTH, DISPLAY_HEIGHT, display_width, display_height);
+                      expect_width, expect_height, display_width, display_height);
     }
     
-    // Allocate Mac frame buffer in PSRAM
-    // For 640x360 @ 8-bit = 230,400 bytes
-    frame_buffer_size = MAC_SCREEN_WIDTH * MAC_SCREEN_HEIGHT;
-    
-    mac_frame_buffer = (uint8 *)ps_malloc(frame_buffer_size);
+    // Allocate Mac frame buffer in PSRAM, sized for the largest mode
+    // 1280x720 @ 16-bit = 1,843,200 bytes (640x360 @ 8-bit uses 230,400)
+    frame_buffer_size = MAC_MAX_WIDTH * MAC_MAX_HEIGHT * MAC_MAX_BYTES_PER_PIXEL;
+    
+#if VIDEO_PAGE_FLIP
+    // The second page directly behind the first, so one frame bank mapping
+    // and MacFrameBaseHost cover both
+    video_page_stride = (frame_buffer_size + 0xffff) & ~0xffff;
+    if (MemPlanGrant("videopage", video_page_stride, video_page_stride)) {
+        mac_frame_buffer = (uint8 *)MemPlanAlloc("framebuffer", 2 * video_page_stride, MALLOC_CAP_SPIRAM);
+        MemPlanRelease("videopage");    // Taken up by "framebuffer"
+        if (mac_frame_buffer) {
+            video_pages = 2;
+        }
+    }
+    if (!mac_frame_buffer)
+#endif
+    mac_frame_buffer = (uint8 *)MemPlanAlloc("framebuffer", frame_buffer_size, MALLOC_CAP_SPIRAM);
     if (!mac_frame_buffer) {
         Serial.println("[VIDEO] ERROR: Failed to allocate Mac frame buffer in PSRAM!");
         return false;
@@ -1239,29 +2893,76 @@ bool VideoInit(bool classic)
     
     // Clear frame buffer to gray
     memset(mac_frame_buffer, 0x80, frame_buffer_size);
+#if VIDEO_PAGE_FLIP
+    if (video_pages > 1) {
+        memset(mac_frame_buffer + video_page_stride, 0x80, frame_buffer_size);
+        Serial.printf("[VIDEO] Second page at %p for page flipping\n", mac_frame_buffer + video_page_stride);
+    }
+#endif
+    
+    // Per-tile palette index sets; without them palette changes redraw everything
+    tile_colours = (uint32 (*)[8])MemPlanAlloc("tilecolours", MAX_TOTAL_TILES * sizeof(*tile_colours),
+                                               MALLOC_CAP_SPIRAM);
+    if (tile_colours) {
+        memset(tile_colours, 0, MAX_TOTAL_TILES * sizeof(*tile_colours));
+    } else {
+        Serial.println("[VIDEO] WARNING: No memory for tile colour sets, palette changes redraw the full screen");
+    }
     
-    // Initialize dirty tracking and render lock
+    // Initialize dirty tracking and tile generations
     memset(dirty_tiles, 0, sizeof(dirty_tiles));
     memset(write_dirty_tiles, 0, sizeof(write_dirty_tiles));
-    memset(tile_render_active, 0, sizeof(tile_render_active));
+#if VIDEO_DEFERRED_DIRTY
+    memset(video_dirty_spans, 0, sizeof(video_dirty_spans));
+    memset(video_dirty_summary, 0, sizeof(video_dirty_summary));
+#endif
+    memset(tile_generation, 0, sizeof(tile_generation));
     force_full_update = true;  // Force full update on first frame
     
+#if VIDEO_KERNEL_BENCH
+    // Uses the streaming buffers, so run before they are needed
+    benchmarkRenderKernels();
+#endif
+    
     // Clear display to dark gray using streaming row buffer
     uint16 gray565 = rgb888_to_rgb565(64, 64, 64);
     for (int i = 0; i < DISPLAY_WIDTH * STREAMING_ROW_COUNT; i++) {
         streaming_row_buffer_a[i] = gray565;
     }
     M5.Display.startWrite();
-    for (int y = 0; y < DISPLAY_HEIGHT; y += STREAMING_ROW_COUNT) {
-        M5.Display.setAddrWindow(0, y, DISPLAY_WIDTH, STREAMING_ROW_COUNT);
-        M5.Display.writePixels(streaming_row_buffer_a, DISPLAY_WIDTH * STREAMING_ROW_COUNT);
+    for (int y = 0; y < display_height; y += STREAMING_ROW_COUNT) {
+        M5.Display.setAddrWindow(0, y, display_width, STREAMING_ROW_COUNT);
+        M5.Display.writePixels(streaming_row_buffer_a, display_width * STREAMING_ROW_COUNT);
     }
     M5.Display.endWrite();
     Serial.println("[VIDEO] Initial screen cleared");
     
+#if VIDEO_DIRECT_FB
+    // Tiles are written at DISPLAY_WIDTH stride, so landscape only
+    direct_fb = video_portrait ? NULL : (uint16 *)videoDirectFrameBuffer();
+    if (direct_fb) {
+        Serial.printf("[VIDEO] Rendering directly into DSI framebuffer at %p\n", direct_fb);
+    } else {
+        Serial.println("[VIDEO] No direct framebuffer available, using M5GFX transfers");
+    }
+#endif
+    
+#if VIDEO_PIPELINE_BENCH
+    // Needs the display and the frame buffer, and must finish before the video task starts
+    // (patterns are drawn for the landscape 640x360 mode)
+    if (!video_portrait) {
+        benchmarkVideoPipeline();
+    }
+#endif
+    
     // Set up Mac frame buffer pointers
     MacFrameBaseHost = mac_frame_buffer;
     MacFrameSize = frame_buffer_size;
+#if VIDEO_PAGE_FLIP
+    if (video_pages > 1) {
+        MacFrameSize = video_pages * video_page_stride;
+    }
+#endif
     MacFrameLayout = FLAYOUT_DIRECT;
     
     // Initialize default palette for 8-bit mode (256 colors)
@@ -1272,43 +2973,50 @@ bool VideoInit(bool classic)
     // Create video mode vector with all supported depths
     // Per Basilisk II rules: lowest depth must be available in all resolutions,
     // and if a resolution has a depth, it must have all lower depths too.
-    // We support 1/2/4/8 bit depths at 640x360.
+    // We support 1/2/4/8-bit indexed and 16-bit direct colour at 640x360
+    // (2x scaled) and 1280x720 (1:1), or 360x640 and 720x1280 in portrait.
+    const struct {
+        int x, y;
+        uint32 id;
+    } resolutions[] = {
+        { video_portrait ? MAC_SCREEN_HEIGHT : MAC_SCREEN_WIDTH,
+          video_portrait ? MAC_SCREEN_WIDTH : MAC_SCREEN_HEIGHT, 0x80 },
+        { video_portrait ? MAC_MAX_HEIGHT : MAC_MAX_WIDTH,
+          video_portrait ? MAC_MAX_WIDTH : MAC_MAX_HEIGHT, 0x81 },
+    };
+    static const video_depth depths[] = {
+        VDEPTH_1BIT, VDEPTH_2BIT, VDEPTH_4BIT, VDEPTH_8BIT, VDEPTH_16BIT
+    };
+    
     vector<video_mode> modes;
     video_mode mode;
-    mode.x = MAC_SCREEN_WIDTH;
-    mode.y = MAC_SCREEN_HEIGHT;
-    mode.resolution_id = 0x80;
     mode.user_data = 0;
+    for (int r = 0; r < (int)(sizeof(resolutions) / sizeof(resolutions[0])); r++) {
+        mode.x = resolutions[r].x;
+        mode.y = resolutions[r].y;
+        mode.resolution_id = resolutions[r].id;
+        for (int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); d++) {
+            mode.depth = depths[d];
+            mode.bytes_per_row = TrivialBytesPerRow(mode.x, mode.depth);
+            modes.push_back(mode);
+            Serial.printf("[VIDEO] Added mode: %dx%d, %d-bit, %d bytes/row\n",
+                          mode.x, mode.y, 1 << mode.depth, mode.bytes_per_row);
+        }
+    }
     
-    // Add 1-bit mode (black and white)
-    mode.depth = VDEPTH_1BIT;
-    mode.bytes_per_row = TrivialBytesPerRow(MAC_SCREEN_WIDTH, VDEPTH_1BIT);  // 80 bytes
-    modes.push_back(mode);
-    Serial.printf("[VIDEO] Added mode: 1-bit, %d bytes/row\n", mode.bytes_per_row);
-    
-    // Add 2-bit mode (4 colors)
-    mode.depth = VDEPTH_2BIT;
-    mode.bytes_per_row = TrivialBytesPerRow(MAC_SCREEN_WIDTH, VDEPTH_2BIT);  // 160 bytes
-    modes.push_back(mode);
-    Serial.printf("[VIDEO] Added mode: 2-bit, %d bytes/row\n", mode.bytes_per_row);
-    
-    // Add 4-bit mode (16 colors)
-    mode.depth = VDEPTH_4BIT;
-    mode.bytes_per_row = TrivialBytesPerRow(MAC_SCREEN_WIDTH, VDEPTH_4BIT);  // 320 bytes
-    modes.push_back(mode);
-    Serial.printf("[VIDEO] Added mode: 4-bit, %d bytes/row\n", mode.bytes_per_row);
-    
-    // Add 8-bit mode (256 colors) - this is our default
+    // Default: 640x360 (360x640 in portrait), 8-bit
+    mode.x = resolutions[0].x;
+    mode.y = resolutions[0].y;
+    mode.resolution_id = 0x80;
     mode.depth = VDEPTH_8BIT;
-    mode.bytes_per_row = TrivialBytesPerRow(MAC_SCREEN_WIDTH, VDEPTH_8BIT);  // 640 bytes
-    modes.push_back(mode);
-    Serial.printf("[VIDEO] Added mode: 8-bit, %d bytes/row\n", mode.bytes_per_row);
+    mode.bytes_per_row = TrivialBytesPerRow(mode.x, VDEPTH_8BIT);  // 640 bytes
     
     // Store current mode info (8-bit default)
     current_mode = mode;
     
     // Initialize the video state cache for 8-bit mode
-    updateVideoStateCache(VDEPTH_8BIT, mode.bytes_per_row);
+    updateVideoStateCache(VDEPTH_8BIT, mode.bytes_per_row, mode.x, mode.y);
+    InputSetScreenSize(mode.x, mode.y);
     
     // Create monitor descriptor with 8-bit as default depth
     the_monitor = new ESP32_monitor_desc(modes, VDEPTH_8BIT, 0x80);
@@ -1317,8 +3025,9 @@ bool VideoInit(bool classic)
     // Set Mac frame buffer base address
     the_monitor->set_mac_frame_base(MacFrameBaseMac);
     
-    // Start video rendering task on Core 0
+    // Start video rendering task on Core 0 (or as placed by "taskcores")
     // Use the optimized version that does render + push
+    int video_core = PrefsFindTaskCore("video", VIDEO_TASK_CORE);
     video_task_running = true;
     BaseType_t result = xTaskCreatePinnedToCore(
         videoRenderTaskOptimized,
@@ -1327,19 +3036,19 @@ bool VideoInit(bool classic)
         NULL,
         VIDEO_TASK_PRIORITY,
         &video_task_handle,
-        VIDEO_TASK_CORE
+        video_core
     );
     
     if (result != pdPASS) {
         Serial.println("[VIDEO] ERROR: Failed to start video task!");
         // Continue anyway - will fall back to synchronous refresh
     } else {
-        Serial.printf("[VIDEO] Video task created on Core %d\n", VIDEO_TASK_CORE);
+        Serial.printf("[VIDEO] Video task created on Core %d\n", video_core);
     }
     
     Serial.printf("[VIDEO] Mac frame base: 0x%08X\n", MacFrameBaseMac);
-    Serial.printf("[VIDEO] Dirty tracking: %dx%d tiles (%d total), threshold %d%%\n", 
-                  TILES_X, TILES_Y, TOTAL_TILES, DIRTY_THRESHOLD_PERCENT);
+    Serial.printf("[VIDEO] Dirty tracking: %dx%d tiles (%d total, up to %d), threshold %d%%\n", 
+                  (int)tiles_x, (int)tiles_y, (int)total_tiles, MAX_TOTAL_TILES, DIRTY_THRESHOLD_PERCENT);
     Serial.println("[VIDEO] VideoInit complete (with dirty tile tracking)");
     
     return true;
@@ -1355,16 +3064,21 @@ void VideoExit(void)
     // Stop video task first
     stopVideoTask();
     
-    // Clear dirty tracking and render lock (safety for potential re-init)
+    // Clear dirty tracking and tile generations (safety for potential re-init)
     memset(dirty_tiles, 0, sizeof(dirty_tiles));
     memset(write_dirty_tiles, 0, sizeof(write_dirty_tiles));
-    memset(tile_render_active, 0, sizeof(tile_render_active));
+    memset(tile_generation, 0, sizeof(tile_generation));
     
     if (mac_frame_buffer) {
         free(mac_frame_buffer);
         mac_frame_buffer = NULL;
     }
     
+    if (tile_colours) {
+        free(tile_colours);
+        tile_colours = NULL;
+    }
+    
     // Clear monitors vector
     VideoMonitors.clear();
     
@@ -1406,8 +3120,16 @@ void VideoRefresh(void)
         return;
     }
     
-    // Signal video task that a new frame is ready
-    VideoSignalFrameReady();
+#if VIDEO_DEFERRED_DIRTY
+    // Publish the CPU writes since the last refresh to the tile bitmap
+    VideoFlushDirtySpans();
+#endif
+    
+    // Signal video task only if there is something to draw, so an idle
+    // screen costs no frames at all
+    if (force_full_update || videoDirtyPending()) {
+        VideoSignalFrameReady();
+    }
 }
 
 /*
@@ -1425,6 +3147,14 @@ void VideoInterrupt(void)
 {
     // Trigger ADB interrupt for mouse/keyboard updates
     SetInterruptFlag(INTFLAG_ADB);
+    
+#if VIDEO_VBL_SYNC
+    // Start of a Mac frame: let the video task take the last one
+    vbl_us = micros();
+    if (vbl_sem) {
+        xSemaphoreGive(vbl_sem);
+    }
+#endif
 }
 
 /*
@@ -0,0 +1,937 @@
+/*
+ *  vnc_esp32.cpp - Remote screen and input over VNC (RFB)
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  With VNC_SERVER the Mac screen is served to one VNC viewer at a time on
+ *  a TCP port ("vncport", 5900 by default) once Wi-Fi is up, and the
+ *  viewer's pointer and keys go into the ADB queue like the USB devices'.
+ *  RFB 3.3 to 3.8 without authentication, so only for trusted networks.
+ *
+ *  Updates are made of the 40x40 tiles the video task found dirty (see
+ *  VideoRemoteTake()), so a static screen sends nothing. The server's
+ *  pixel format is 8-bit colour-mapped: in the indexed modes the frame
+ *  buffer's own indices go out, with the Mac palette as SetColourMapEntries
+ *  whenever it changes, and 16-bit frames are sent as RGB332. Viewers that
+ *  ask for true colour get palette entries looked up per pixel. Rects are
+ *  Hextile if the viewer takes it (solid and two-colour 16x16 subtiles, most
+ *  of a Mac desktop, shrink to a few bytes), else Raw.
+ */
+
+#include "sysdeps.h"
+
+#include "vnc_esp32.h"
+
+#if VNC_SERVER
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#include "prefs.h"
+#include "adb.h"
+#include "video.h"
+#include "perf_esp32.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+#define VNC_UPDATE_MS           40      // At most 25 updates a second
+#define VNC_CLIENT_TIMEOUT_S    30      // A message or send stalled this long ends the session
+#define VNC_OUT_SIZE            8192    // Send buffer
+
+#define VNC_TASK_STACK_SIZE     6144
+#define VNC_TASK_PRIORITY       1
+#define VNC_TASK_CORE           0
+
+#define HEXTILE_SIZE            16
+
+// Client to server messages
+enum {
+    RFB_SET_PIXEL_FORMAT = 0,
+    RFB_SET_ENCODINGS = 2,
+    RFB_UPDATE_REQUEST = 3,
+    RFB_KEY_EVENT = 4,
+    RFB_POINTER_EVENT = 5,
+    RFB_CLIENT_CUT_TEXT = 6
+};
+
+// Server to client messages
+enum {
+    RFB_FRAMEBUFFER_UPDATE = 0,
+    RFB_SET_COLOUR_MAP = 1
+};
+
+enum {
+    RFB_SECURITY_NONE = 1,
+    RFB_ENC_RAW = 0,
+    RFB_ENC_HEXTILE = 5,
+    RFB_ENC_DESKTOP_SIZE = -223
+};
+
+// Hextile subencoding flags
+enum {
+    HEX_RAW = 1,
+    HEX_BACKGROUND = 2,
+    HEX_FOREGROUND = 4,
+    HEX_ANY_SUBRECTS = 8
+};
+
+struct rfb_format {
+    uint8 bpp;                  // 8, 16 or 32
+    uint8 depth;
+    bool big_endian;
+    bool true_colour;
+    uint16 max[3];              // Red, green, blue
+    uint8 shift[3];
+};
+
+struct vnc_client {
+    int sock;
+    bool ok;                    // Cleared on the first failed send
+    rfb_format format;
+    bool hextile;
+    bool desktop_size;
+    bool update_requested;
+    bool full;                  // Send the whole screen with the next update
+    int width, height;          // Size the viewer knows
+    uint8 buttons;              // Pointer button mask last seen
+    bool lut_valid;
+    int lut_depth;              // Frame depth lut was built for
+    uint8 palette[256 * 3];     // Palette lut was built from
+    uint32 lut[256];            // Viewer pixel of each palette index
+    uint32 hex_bg, hex_fg;      // Hextile colours carried over to the next subtile
+    bool hex_bg_valid, hex_fg_valid;
+    uint32 tiles[VNC_TILE_WORDS];   // Dirty, not sent yet
+    uint8 *out;
+    int out_len;
+};
+
+// The 8-bit colour-mapped format of ServerInit
+static const rfb_format server_format = {8, 8, false, false, {0, 0, 0}, {0, 0, 0}};
+
+static vnc_client client;
+static vnc_frame frame;                 // Filled by VideoRemoteTake(), VNC task only
+
+static int listen_socket = -1;
+static TaskHandle_t vnc_task_handle = NULL;
+static volatile bool vnc_task_running = false;
+
+static perf_counter *perf_vnc_bytes = NULL;     // "vnc.bytes", sent to viewers
+static perf_counter *perf_vnc_tiles = NULL;     // "vnc.tiles", dirty tiles sent
+
+// ADB keycode of the X keysyms 0x20..0x7e (US layout, shifted symbols on their key)
+static const uint8 ascii_to_adb[95] = {
+    0x31, 0x12, 0x27, 0x14, 0x15, 0x17, 0x1a, 0x27,     //   ! " # $ % & '
+    0x19, 0x1d, 0x1c, 0x18, 0x2b, 0x1b, 0x2f, 0x2c,     // ( ) * + , - . /
+    0x1d, 0x12, 0x13, 0x14, 0x15, 0x17, 0x16, 0x1a,     // 0 1 2 3 4 5 6 7
+    0x1c, 0x19, 0x29, 0x29, 0x2b, 0x18, 0x2f, 0x2c,     // 8 9 : ; < = > ?
+    0x13, 0x00, 0x0b, 0x08, 0x02, 0x0e, 0x03, 0x05,     // @ A B C D E F G
+    0x04, 0x22, 0x26, 0x28, 0x25, 0x2e, 0x2d, 0x1f,     // H I J K L M N O
+    0x23, 0x0c, 0x0f, 0x01, 0x11, 0x20, 0x09, 0x0d,     // P Q R S T U V W
+    0x07, 0x10, 0x06, 0x21, 0x2a, 0x1e, 0x16, 0x1b,     // X Y Z [ \ ] ^ _
+    0x0a, 0x00, 0x0b, 0x08, 0x02, 0x0e, 0x03, 0x05,     // ` a b c d e f g
+    0x04, 0x22, 0x26, 0x28, 0x25, 0x2e, 0x2d, 0x1f,     // h i j k l m n o
+    0x23, 0x0c, 0x0f, 0x01, 0x11, 0x20, 0x09, 0x0d,     // p q r s t u v w
+    0x07, 0x10, 0x06, 0x21, 0x2a, 0x1e, 0x0a            // x y z { | } ~
+};
+
+// ADB keycode of the X function keysyms
+static const struct {
+    uint16 keysym;
+    uint8 code;
+} function_keys[] = {
+    {0xff08, 0x33}, {0xff09, 0x30}, {0xff0d, 0x24}, {0xff1b, 0x35},     // BackSpace Tab Return Escape
+    {0xffff, 0x75}, {0xff50, 0x73}, {0xff51, 0x3b}, {0xff52, 0x3e},     // Delete Home Left Up
+    {0xff53, 0x3c}, {0xff54, 0x3d}, {0xff55, 0x74}, {0xff56, 0x79},     // Right Down Prior Next
+    {0xff57, 0x77}, {0xff63, 0x72}, {0xff8d, 0x4c},                     // End Insert (Help) KP_Enter
+    {0xffbe, 0x7a}, {0xffbf, 0x78}, {0xffc0, 0x63}, {0xffc1, 0x76},     // F1-F4
+    {0xffc2, 0x60}, {0xffc3, 0x61}, {0xffc4, 0x62}, {0xffc5, 0x64},     // F5-F8
+    {0xffc6, 0x65}, {0xffc7, 0x6d}, {0xffc8, 0x67}, {0xffc9, 0x6f},     // F9-F12
+    {0xffe1, 0x38}, {0xffe2, 0x38}, {0xffe3, 0x36}, {0xffe4, 0x36},     // Shift Control
+    {0xffe5, 0x39}, {0xffe7, 0x3a}, {0xffe8, 0x3a}, {0xffe9, 0x3a},     // Caps_Lock Meta Alt
+    {0xffea, 0x3a}, {0xffeb, 0x37}, {0xffec, 0x37}                      // Super (Command)
+};
+
+// ADB button of the RFB pointer buttons 1, 2, 3 (left, middle, right)
+static const uint8 adb_button[3] = {0, 2, 1};
+
+static int keysym_to_adb(uint32 keysym)
+{
+    if (keysym >= 0x20 && keysym <= 0x7e) {
+        return ascii_to_adb[keysym - 0x20];
+    }
+    for (size_t i = 0; i < sizeof(function_keys) / sizeof(function_keys[0]); i++) {
+        if (function_keys[i].keysym == keysym) {
+            return function_keys[i].code;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ *  Socket and send buffer helpers
+ */
+
+static bool send_all(int sock, const void *data, int length)
+{
+    const uint8 *p = (const uint8 *)data;
+    while (length > 0) {
+        int n = send(sock, p, length, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int sock, void *data, int length)
+{
+    uint8 *p = (uint8 *)data;
+    while (length > 0) {
+        int n = recv(sock, p, length, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static void out_flush(vnc_client &c)
+{
+    if (c.ok && c.out_len > 0) {
+        c.ok = send_all(c.sock, c.out, c.out_len);
+        PerfAdd(perf_vnc_bytes, c.out_len);
+    }
+    c.out_len = 0;
+}
+
+static inline void out_u8(vnc_client &c, uint32 v)
+{
+    if (c.out_len == VNC_OUT_SIZE) {
+        out_flush(c);
+    }
+    c.out[c.out_len++] = v;
+}
+
+static void out_u16(vnc_client &c, uint32 v)
+{
+    out_u8(c, v >> 8);
+    out_u8(c, v);
+}
+
+static void out_u32(vnc_client &c, uint32 v)
+{
+    out_u16(c, v >> 16);
+    out_u16(c, v);
+}
+
+static inline void out_pixel(vnc_client &c, uint32 v)
+{
+    switch (c.format.bpp) {
+        case 8:
+            out_u8(c, v);
+            break;
+        case 16:
+            if (c.format.big_endian) {
+                out_u16(c, v);
+            } else {
+                out_u8(c, v);
+                out_u8(c, v >> 8);
+            }
+            break;
+        default:
+            if (c.format.big_endian) {
+                out_u32(c, v);
+            } else {
+                out_u8(c, v);
+                out_u8(c, v >> 8);
+                out_u8(c, v >> 16);
+                out_u8(c, v >> 24);
+            }
+            break;
+    }
+}
+
+
+/*
+ *  Pixels in the viewer's format
+ */
+
+static inline uint32 true_colour_pixel(const rfb_format &f, uint32 r, uint32 g, uint32 b)
+{
+    return (((r * (f.max[0] + 1)) >> 8) << f.shift[0]) |
+           (((g * (f.max[1] + 1)) >> 8) << f.shift[1]) |
+           (((b * (f.max[2] + 1)) >> 8) << f.shift[2]);
+}
+
+// Host RGB565 of the 16-bit frame bank to the viewer's pixel
+static inline uint32 rgb565_pixel(const vnc_client &c, uint16 v)
+{
+    uint32 r = (v >> 8) & 0xf8;
+    uint32 g = (v >> 3) & 0xfc;
+    uint32 b = (v << 3) & 0xf8;
+    if (!c.format.true_colour) {
+        return (r & 0xe0) | ((g >> 3) & 0x1c) | (b >> 6);     // RGB332 colour map
+    }
+    return true_colour_pixel(c.format, r | (r >> 5), g | (g >> 6), b | (b >> 5));
+}
+
+// One row of w pixels at (x, y)
+static void read_pixels(const vnc_client &c, int x, int y, int w, uint32 *dst)
+{
+    const uint8 *row = frame.pixels + y * frame.bytes_per_row;
+    if (frame.depth == VDEPTH_16BIT) {
+        const uint16 *p = (const uint16 *)row + x;
+        for (int i = 0; i < w; i++) {
+            dst[i] = rgb565_pixel(c, p[i]);
+        }
+    } else if (frame.depth == VDEPTH_8BIT) {
+        const uint8 *p = row + x;
+        for (int i = 0; i < w; i++) {
+            dst[i] = c.lut[p[i]];
+        }
+    } else {
+        // 1, 2 or 4 bits, MSB first
+        int bits = 1 << frame.depth;
+        int mask = (1 << bits) - 1;
+        for (int i = 0; i < w; i++) {
+            int bit = (x + i) * bits;
+            dst[i] = c.lut[(row[bit >> 3] >> (8 - bits - (bit & 7))) & mask];
+        }
+    }
+}
+
+/*
+ *  Bring the viewer's colours up to date with the frame; a colour-mapped
+ *  viewer gets the new map here, a true-colour one the tiles the video task
+ *  marked for the changed entries
+ */
+static void update_colours(vnc_client &c)
+{
+    bool indexed = frame.depth <= VDEPTH_8BIT;
+    if (c.lut_valid && c.lut_depth == frame.depth &&
+        (!indexed || memcmp(c.palette, frame.palette, sizeof(c.palette)) == 0)) {
+        return;
+    }
+    c.lut_valid = true;
+    c.lut_depth = frame.depth;
+    memcpy(c.palette, frame.palette, sizeof(c.palette));
+    for (int i = 0; i < 256; i++) {
+        c.lut[i] = c.format.true_colour ?
+            true_colour_pixel(c.format, c.palette[i * 3], c.palette[i * 3 + 1], c.palette[i * 3 + 2]) : i;
+    }
+    if (c.format.true_colour) {
+        return;
+    }
+
+    out_u8(c, RFB_SET_COLOUR_MAP);
+    out_u8(c, 0);
+    out_u16(c, 0);              // First colour
+    out_u16(c, 256);
+    for (int i = 0; i < 256; i++) {
+        uint32 r, g, b;
+        if (indexed) {
+            r = c.palette[i * 3];
+            g = c.palette[i * 3 + 1];
+            b = c.palette[i * 3 + 2];
+        } else {
+            r = (i & 0xe0) * 255 / 0xe0;
+            g = (i & 0x1c) * 255 / 0x1c;
+            b = (i & 0x03) * 255 / 0x03;
+        }
+        out_u16(c, r * 257);
+        out_u16(c, g * 257);
+        out_u16(c, b * 257);
+    }
+}
+
+
+/*
+ *  Rect encoders
+ */
+
+static void out_rect_header(vnc_client &c, int x, int y, int w, int h, int32 encoding)
+{
+    out_u16(c, x);
+    out_u16(c, y);
+    out_u16(c, w);
+    out_u16(c, h);
+    out_u32(c, (uint32)encoding);
+}
+
+static void send_raw(vnc_client &c, int x, int y, int w, int h)
+{
+    uint32 px[256];
+    for (int row = 0; row < h; row++) {
+        for (int i = 0; i < w; i += 256) {
+            int n = w - i < 256 ? w - i : 256;
+            read_pixels(c, x + i, y + row, n, px);
+            for (int j = 0; j < n; j++) {
+                out_pixel(c, px[j]);
+            }
+        }
+    }
+}
+
+// One Hextile subtile; solid and two-colour ones as subrects, others raw
+static void send_hextile_subtile(vnc_client &c, int x, int y, int w, int h)
+{
+    uint32 px[HEXTILE_SIZE * HEXTILE_SIZE];
+    for (int row = 0; row < h; row++) {
+        read_pixels(c, x, y + row, w, px + row * w);
+    }
+    int n = w * h;
+    int bytes_per_pixel = c.format.bpp / 8;
+
+    uint32 bg = px[0], fg = 0;
+    int bg_count = 0, fg_count = 0;
+    bool raw = false;
+    for (int i = 0; i < n && !raw; i++) {
+        if (px[i] == bg) {
+            bg_count++;
+        } else if (fg_count == 0 || px[i] == fg) {
+            fg = px[i];
+            fg_count++;
+        } else {
+            raw = true;
+        }
+    }
+    if (fg_count > bg_count) {
+        uint32 t = bg;
+        bg = fg;
+        fg = t;
+    }
+
+    // Foreground subrects, each grown right and then down
+    uint8 subrects[HEXTILE_SIZE * HEXTILE_SIZE];
+    int nsub = 0;
+    if (!raw && fg_count > 0) {
+        bool done[HEXTILE_SIZE * HEXTILE_SIZE];
+        memset(done, 0, n);
+        for (int sy = 0; sy < h && !raw; sy++) {
+            for (int sx = 0; sx < w; sx++) {
+                int i = sy * w + sx;
+                if (px[i] != fg || done[i]) {
+                    continue;
+                }
+                int sw = 1;
+                while (sx + sw < w && px[i + sw] == fg && !done[i + sw]) {
+                    sw++;
+                }
+                int sh = 1;
+                for (bool grow = true; grow && sy + sh < h; ) {
+                    for (int k = 0; k < sw; k++) {
+                        int j = (sy + sh) * w + sx + k;
+                        if (px[j] != fg || done[j]) {
+                            grow = false;
+                            break;
+                        }
+                    }
+                    if (grow) {
+                        sh++;
+                    }
+                }
+                for (int yy = 0; yy < sh; yy++) {
+                    memset(done + (sy + yy) * w + sx, 1, sw);
+                }
+                if ((nsub + 1) * 2 + bytes_per_pixel >= n * bytes_per_pixel) {
+                    raw = true;
+                    break;
+                }
+                subrects[nsub * 2] = (sx << 4) | sy;
+                subrects[nsub * 2 + 1] = ((sw - 1) << 4) | (sh - 1);
+                nsub++;
+            }
+        }
+    }
+
+    if (raw) {
+        out_u8(c, HEX_RAW);
+        for (int i = 0; i < n; i++) {
+            out_pixel(c, px[i]);
+        }
+        c.hex_bg_valid = c.hex_fg_valid = false;
+        return;
+    }
+
+    uint8 flags = 0;
+    if (!c.hex_bg_valid || bg != c.hex_bg) {
+        flags |= HEX_BACKGROUND;
+    }
+    if (nsub > 0) {
+        flags |= HEX_ANY_SUBRECTS;
+        if (!c.hex_fg_valid || fg != c.hex_fg) {
+            flags |= HEX_FOREGROUND;
+        }
+    }
+    out_u8(c, flags);
+    if (flags & HEX_BACKGROUND) {
+        out_pixel(c, bg);
+        c.hex_bg = bg;
+        c.hex_bg_valid = true;
+    }
+    if (flags & HEX_FOREGROUND) {
+        out_pixel(c, fg);
+        c.hex_fg = fg;
+        c.hex_fg_valid = true;
+    }
+    if (nsub > 0) {
+        out_u8(c, nsub);
+        for (int i = 0; i < nsub * 2; i++) {
+            out_u8(c, subrects[i]);
+        }
+    }
+}
+
+static void send_rect(vnc_client &c, int x, int y, int w, int h)
+{
+    if (!c.hextile) {
+        out_rect_header(c, x, y, w, h, RFB_ENC_RAW);
+        send_raw(c, x, y, w, h);
+        return;
+    }
+    out_rect_header(c, x, y, w, h, RFB_ENC_HEXTILE);
+    c.hex_bg_valid = c.hex_fg_valid = false;
+    for (int ty = 0; ty < h; ty += HEXTILE_SIZE) {
+        for (int tx = 0; tx < w; tx += HEXTILE_SIZE) {
+            send_hextile_subtile(c, x + tx, y + ty,
+                                 w - tx < HEXTILE_SIZE ? w - tx : HEXTILE_SIZE,
+                                 h - ty < HEXTILE_SIZE ? h - ty : HEXTILE_SIZE);
+        }
+    }
+}
+
+
+/*
+ *  Framebuffer updates
+ */
+
+static inline bool tile_dirty(const vnc_client &c, int tile)
+{
+    return (c.tiles[tile / 32] >> (tile % 32)) & 1;
+}
+
+// Horizontal runs of dirty tiles, each sent as one rect; returns the run count
+static int dirty_runs(vnc_client &c, bool send)
+{
+    int runs = 0;
+    for (int ty = 0; ty < frame.tiles_y; ty++) {
+        for (int tx = 0; tx < frame.tiles_x; ) {
+            if (!tile_dirty(c, ty * frame.tiles_x + tx)) {
+                tx++;
+                continue;
+            }
+            int len = 1;
+            while (tx + len < frame.tiles_x && tile_dirty(c, ty * frame.tiles_x + tx + len)) {
+                len++;
+            }
+            if (send) {
+                send_rect(c, tx * frame.tile_width, ty * frame.tile_height,
+                          len * frame.tile_width, frame.tile_height);
+                PerfAdd(perf_vnc_tiles, len);
+            }
+            runs++;
+            tx += len;
+        }
+    }
+    return runs;
+}
+
+/*
+ *  Answer the viewer's update request if anything changed; returns
+ *  false while there is nothing to send
+ */
+static bool send_update(vnc_client &c)
+{
+    uint32 taken[VNC_TILE_WORDS];
+    VideoRemoteTake(frame, taken);
+    for (int i = 0; i < VNC_TILE_WORDS; i++) {
+        c.tiles[i] |= taken[i];
+    }
+
+    if (frame.width != c.width || frame.height != c.height) {
+        if (!c.desktop_size) {
+            Serial.println("[VNC] Screen size changed, viewer without DesktopSize disconnected");
+            c.ok = false;
+            return false;
+        }
+        c.width = frame.width;
+        c.height = frame.height;
+        c.full = true;
+        out_u8(c, RFB_FRAMEBUFFER_UPDATE);
+        out_u8(c, 0);
+        out_u16(c, 1);
+        out_rect_header(c, 0, 0, c.width, c.height, RFB_ENC_DESKTOP_SIZE);
+        out_flush(c);
+        return true;
+    }
+
+    update_colours(c);
+
+    int rects = c.full ? 1 : dirty_runs(c, false);
+    if (rects == 0) {
+        out_flush(c);
+        return false;
+    }
+    out_u8(c, RFB_FRAMEBUFFER_UPDATE);
+    out_u8(c, 0);
+    out_u16(c, rects);
+    if (c.full) {
+        send_rect(c, 0, 0, c.width, c.height);
+        PerfAdd(perf_vnc_tiles, frame.tiles_x * frame.tiles_y);
+    } else {
+        dirty_runs(c, true);
+    }
+    out_flush(c);
+    memset(c.tiles, 0, sizeof(c.tiles));
+    c.full = false;
+    return true;
+}
+
+
+/*
+ *  Viewer messages
+ */
+
+static void pointer_event(vnc_client &c, uint8 mask, int x, int y)
+{
+    ADBSetRelMouseMode(false);
+    ADBMouseMoved(x, y);
+    for (int i = 0; i < 3; i++) {
+        uint8 bit = 1 << i;
+        if ((mask ^ c.buttons) & bit) {
+            if (mask & bit) {
+                ADBMouseDown(adb_button[i]);
+            } else {
+                ADBMouseUp(adb_button[i]);
+            }
+        }
+    }
+    c.buttons = mask;
+}
+
+static bool handle_message(vnc_client &c)
+{
+    uint8 type;
+    if (!recv_all(c.sock, &type, 1)) {
+        return false;
+    }
+    uint8 msg[19];
+    switch (type) {
+        case RFB_SET_PIXEL_FORMAT: {
+            if (!recv_all(c.sock, msg, 19)) {
+                return false;
+            }
+            const uint8 *pf = msg + 3;
+            if (pf[0] != 8 && pf[0] != 16 && pf[0] != 32) {
+                Serial.printf("[VNC] Viewer asked for %d bits per pixel, not supported\n", pf[0]);
+                return false;
+            }
+            c.format.bpp = pf[0];
+            c.format.depth = pf[1];
+            c.format.big_endian = pf[2] != 0;
+            c.format.true_colour = pf[3] != 0;
+            for (int i = 0; i < 3; i++) {
+                c.format.max[i] = (pf[4 + i * 2] << 8) | pf[5 + i * 2];
+                c.format.shift[i] = pf[10 + i];
+            }
+            c.lut_valid = false;
+            c.full = true;
+            break;
+        }
+        case RFB_SET_ENCODINGS: {
+            if (!recv_all(c.sock, msg, 3)) {
+                return false;
+            }
+            int count = (msg[1] << 8) | msg[2];
+            c.hextile = false;
+            c.desktop_size = false;
+            for (int i = 0; i < count; i++) {
+                if (!recv_all(c.sock, msg, 4)) {
+                    return false;
+                }
+                int32 encoding = (int32)((msg[0] << 24) | (msg[1] << 16) | (msg[2] << 8) | msg[3]);
+                if (encoding == RFB_ENC_HEXTILE) {
+                    c.hextile = true;
+                } else if (encoding == RFB_ENC_DESKTOP_SIZE) {
+                    c.desktop_size = true;
+                }
+            }
+            D(bug("[VNC] encodings: hextile %d, desktop size %d\n", c.hextile, c.desktop_size));
+            break;
+        }
+        case RFB_UPDATE_REQUEST:
+            if (!recv_all(c.sock, msg, 9)) {
+                return false;
+            }
+            // Dirty tiles anywhere on the screen are sent, not just in the asked-for area
+            c.update_requested = true;
+            if (msg[0] == 0) {
+                c.full = true;
+            }
+            break;
+        case RFB_KEY_EVENT: {
+            if (!recv_all(c.sock, msg, 7)) {
+                return false;
+            }
+            uint32 keysym = (msg[3] << 24) | (msg[4] << 16) | (msg[5] << 8) | msg[6];
+            int code = keysym_to_adb(keysym);
+            if (code >= 0) {
+                if (msg[0]) {
+                    ADBKeyDown(code);
+                } else {
+                    ADBKeyUp(code);
+                }
+            }
+            break;
+        }
+        case RFB_POINTER_EVENT:
+            if (!recv_all(c.sock, msg, 5)) {
+                return false;
+            }
+            pointer_event(c, msg[0], (msg[1] << 8) | msg[2], (msg[3] << 8) | msg[4]);
+            break;
+        case RFB_CLIENT_CUT_TEXT: {
+            // The clipboard bridge (clip_esp32.cpp) carries the clipboard
+            if (!recv_all(c.sock, msg, 7)) {
+                return false;
+            }
+            uint32 length = (msg[3] << 24) | (msg[4] << 16) | (msg[5] << 8) | msg[6];
+            while (length > 0) {
+                int n = length < sizeof(msg) ? length : sizeof(msg);
+                if (!recv_all(c.sock, msg, n)) {
+                    return false;
+                }
+                length -= n;
+            }
+            break;
+        }
+        default:
+            Serial.printf("[VNC] Unknown message type %d from viewer\n", type);
+            return false;
+    }
+    return true;
+}
+
+// Version, no security, ClientInit and ServerInit
+static bool handshake(vnc_client &c)
+{
+    char version[13];
+    if (!send_all(c.sock, "RFB 003.008\n", 12) || !recv_all(c.sock, version, 12)) {
+        return false;
+    }
+    version[12] = 0;
+    int major = 0, minor = 0;
+    if (sscanf(version, "RFB %3d.%3d", &major, &minor) != 2 || major != 3) {
+        return false;
+    }
+    uint8 msg[4];
+    if (minor >= 7) {
+        static const uint8 types[2] = {1, RFB_SECURITY_NONE};
+        if (!send_all(c.sock, types, sizeof(types)) || !recv_all(c.sock, msg, 1) || msg[0] != RFB_SECURITY_NONE) {
+            return false;
+        }
+        static const uint8 result_ok[4] = {0, 0, 0, 0};
+        if (minor >= 8 && !send_all(c.sock, result_ok, sizeof(result_ok))) {
+            return false;
+        }
+    } else {
+        static const uint8 type_none[4] = {0, 0, 0, RFB_SECURITY_NONE};
+        if (!send_all(c.sock, type_none, sizeof(type_none))) {
+            return false;
+        }
+    }
+    if (!recv_all(c.sock, msg, 1)) {       // Shared flag; there is one viewer at a time anyway
+        return false;
+    }
+
+    uint32 taken[VNC_TILE_WORDS];
+    VideoRemoteTake(frame, taken);
+    c.width = frame.width;
+    c.height = frame.height;
+    static const char name[] = "BasiliskII";
+    const rfb_format &f = server_format;
+    out_u16(c, c.width);
+    out_u16(c, c.height);
+    out_u8(c, f.bpp);
+    out_u8(c, f.depth);
+    out_u8(c, f.big_endian);
+    out_u8(c, f.true_colour);
+    for (int i = 0; i < 3; i++) {
+        out_u16(c, f.max[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        out_u8(c, f.shift[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        out_u8(c, 0);
+    }
+    out_u32(c, sizeof(name) - 1);
+    for (size_t i = 0; i < sizeof(name) - 1; i++) {
+        out_u8(c, name[i]);
+    }
+    out_flush(c);
+    return c.ok;
+}
+
+static void serve_client(vnc_client &c)
+{
+    if (!handshake(c)) {
+        return;
+    }
+    Serial.printf("[VNC] Viewer connected, %dx%d\n", c.width, c.height);
+
+    uint32 last_update_ms = 0;
+    while (vnc_task_running && c.ok) {
+        // Messages first, then an update once per VNC_UPDATE_MS
+        uint32 now = millis();
+        uint32 wait_ms = VNC_UPDATE_MS;
+        if (c.update_requested && now - last_update_ms < VNC_UPDATE_MS) {
+            wait_ms = VNC_UPDATE_MS - (now - last_update_ms);
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(c.sock, &fds);
+        struct timeval tv = {0, (long)wait_ms * 1000};
+        int ready = select(c.sock + 1, &fds, NULL, NULL, &tv);
+        if (ready < 0) {
+            break;
+        }
+        if (ready > 0 && !handle_message(c)) {
+            break;
+        }
+        now = millis();
+        if (c.update_requested && now - last_update_ms >= VNC_UPDATE_MS) {
+            if (send_update(c)) {
+                c.update_requested = false;
+                last_update_ms = now;
+            }
+        }
+    }
+
+    // Let go of any button the viewer still held down
+    for (int i = 0; i < 3; i++) {
+        if (c.buttons & (1 << i)) {
+            ADBMouseUp(adb_button[i]);
+        }
+    }
+    Serial.println("[VNC] Viewer disconnected");
+}
+
+static void vncTask(void *param)
+{
+    UNUSED(param);
+
+    while (vnc_task_running) {
+        int sock = accept(listen_socket, NULL, NULL);
+        if (sock < 0) {
+            if (vnc_task_running) {
+                vTaskDelay(pdMS_TO_TICKS(100));
+            }
+            continue;
+        }
+        struct timeval tv = {VNC_CLIENT_TIMEOUT_S, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        uint8 *out = client.out;
+        memset(&client, 0, sizeof(client));
+        client.sock = sock;
+        client.ok = true;
+        client.format = server_format;
+        client.full = true;
+        client.out = out;
+        serve_client(client);
+        close(sock);
+    }
+
+    vTaskDelete(NULL);
+}
+
+
+/*
+ *  Initialization
+ */
+
+void VNCInit(void)
+{
+    int port = PrefsFindInt32("vncport");
+    if (port <= 0) {
+        return;
+    }
+    if (WiFi.status() != WL_CONNECTED) {
+        D(bug("[VNC] no Wi-Fi, VNC server off\n"));
+        return;
+    }
+
+    client.out = (uint8 *)malloc(VNC_OUT_SIZE);
+    if (client.out == NULL) {
+        Serial.println("[VNC] WARNING: no send buffer, VNC server off");
+        return;
+    }
+    perf_vnc_bytes = PerfCounter("vnc.bytes");
+    perf_vnc_tiles = PerfCounter("vnc.tiles");
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) {
+        Serial.println("[VNC] WARNING: no TCP socket, VNC server off");
+        return;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    int on = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listen_socket, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listen_socket, 1) < 0) {
+        Serial.printf("[VNC] WARNING: can't listen on TCP port %d, VNC server off\n", port);
+        close(listen_socket);
+        listen_socket = -1;
+        return;
+    }
+
+    vnc_task_running = true;
+    if (xTaskCreatePinnedToCore(vncTask, "VNCTask", VNC_TASK_STACK_SIZE, NULL,
+                                VNC_TASK_PRIORITY, &vnc_task_handle,
+                                PrefsFindTaskCore("vnc", VNC_TASK_CORE)) != pdPASS) {
+        Serial.println("[VNC] WARNING: VNC task not started, VNC server off");
+        vnc_task_running = false;
+        close(listen_socket);
+        listen_socket = -1;
+        return;
+    }
+
+    Serial.printf("[VNC] Screen on %s, TCP port %d\n", WiFi.localIP().toString().c_str(), port);
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void VNCExit(void)
+{
+    if (vnc_task_running) {
+        vnc_task_running = false;
+        shutdown(listen_socket, SHUT_RDWR);     // Ends the accept() in the task
+        vTaskDelay(pdMS_TO_TICKS(50));
+        vnc_task_handle = NULL;
+    }
+    if (listen_socket >= 0) {
+        close(listen_socket);
+        listen_socket = -1;
+    }
+}
+
+#endif // VNC_SERVER
@@ -0,0 +1,44 @@
+/*
+ *  vnc_esp32.h - Remote screen and input over VNC (RFB)
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef VNC_ESP32_H
+#define VNC_ESP32_H
+
+#ifndef VNC_SERVER
+#define VNC_SERVER 0
+#endif
+
+#if VNC_SERVER
+
+// Words of the tile bitmap for the largest mode (32x18 tiles at 1280x720,
+// 80x40 with VIDEO_TILE_GEOMETRY)
+#if VIDEO_TILE_GEOMETRY
+#define VNC_TILE_WORDS  100
+#else
+#define VNC_TILE_WORDS  18
+#endif
+
+// The shown frame, as the video driver hands it to the server
+struct vnc_frame {
+    const uint8 *pixels;        // Shown page of the Mac frame buffer
+    uint32 bytes_per_row;
+    int width, height;          // Mac pixels
+    int depth;                  // video_depth; VDEPTH_16BIT is host RGB565
+    int tile_width, tile_height;
+    int tiles_x, tiles_y;
+    uint8 palette[256 * 3];     // RGB888, indexed modes
+};
+
+// Fill in the shown frame and take the tiles the video task found changed
+// since the last call (video_esp32.cpp)
+extern void VideoRemoteTake(vnc_frame &f, uint32 *tiles);
+
+extern void VNCInit(void);
+extern void VNCExit(void);
+
+#endif
+
+#endif // VNC_ESP32_H
@@ -2,12 +2,27 @@
  *  xpram_esp32.cpp - XPRAM handling for ESP32
  *
  *  BasiliskII ESP32 Port
+ *
+ *  Mac OS writes XPRAM one byte at a time through emul_op.cpp, and power
+ *  is usually cut instead of quitting, so XPRAM has to reach the card
+ *  while the Mac runs. A writer task on Core 0 compares XPRAM with the
+ *  last saved copy every XPRAM_POLL_MS and saves it once it has stopped
+ *  changing for XPRAM_QUIET_MS. The file is created at its full size at
+ *  boot and its sector mapped (sd_esp32.h), so a save is a single sector
+ *  write without FAT updates; in SPI mode the file is rewritten instead.
  */
 
 #include "sysdeps.h"
 #include "xpram.h"
+#include "prefs.h"
+
+#include "sd_esp32.h"
+#include "log_esp32.h"
+#include "esp_heap_caps.h"
 
-#include <SD.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #define DEBUG 1
 #include "debug.h"
@@ -15,6 +30,132 @@
 // XPRAM file on SD card
 const char XPRAM_FILE_PATH[] = "/BasiliskII_XPRAM";
 
+#define XPRAM_POLL_MS           250         // How often the writer looks for changes
+#define XPRAM_QUIET_MS          1000        // Unchanged this long before it is saved
+#define XPRAM_SECTOR_SIZE       512
+#define XPRAM_TASK_STACK_SIZE   3072
+#define XPRAM_TASK_PRIORITY     1
+#define XPRAM_TASK_CORE         0
+
+static uint8 *xpram_saved = NULL;           // What the card holds
+static uint8 *xpram_sector = NULL;          // Sector buffer (DMA-capable), XPRAM first
+static sd_extent_map *xpram_map = NULL;     // Sector of the file, NULL = write the file
+static SemaphoreHandle_t xpram_lock = NULL; // Serialises saves (writer task, SaveXPRAM, ZapPRAM)
+static TaskHandle_t xpram_task_handle = NULL;
+
+/*
+ *  Write data to the card (xpram_lock held)
+ */
+static bool write_xpram(const uint8 *data)
+{
+    if (xpram_map) {
+        memcpy(xpram_sector, data, XPRAM_SIZE);
+        if (SDExtentWrite(xpram_map, xpram_sector, 0, XPRAM_SECTOR_SIZE)) {
+            return true;
+        }
+        Serial.println("[XPRAM] WARNING: sector write failed, rewriting the file");
+        SDExtentMapFree(xpram_map);
+        xpram_map = NULL;
+    }
+    
+    File f = SDCardFS().open(XPRAM_FILE_PATH, FILE_WRITE);
+    if (!f) {
+        Serial.printf("[XPRAM] ERROR: Cannot write to %s\n", XPRAM_FILE_PATH);
+        return false;
+    }
+    size_t bytes_written = f.write(data, XPRAM_SIZE);
+    f.close();
+    return bytes_written == XPRAM_SIZE;
+}
+
+/*
+ *  Save data if it differs from what the card holds (takes xpram_lock)
+ */
+static bool save_if_changed(const uint8 *data)
+{
+    bool saved = false;
+    xSemaphoreTake(xpram_lock, portMAX_DELAY);
+    if (memcmp(data, xpram_saved, XPRAM_SIZE) != 0 && write_xpram(data)) {
+        memcpy(xpram_saved, data, XPRAM_SIZE);
+        saved = true;
+    }
+    xSemaphoreGive(xpram_lock);
+    return saved;
+}
+
+/*
+ *  Writer task: save XPRAM once Mac OS has stopped changing it
+ */
+static void xpramTask(void *param)
+{
+    UNUSED(param);
+    uint8 seen[XPRAM_SIZE];         // XPRAM as of the last poll
+    uint32 changed_ms = 0;
+    bool pending = false;
+    memcpy(seen, xpram_saved, XPRAM_SIZE);
+    
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(XPRAM_POLL_MS));
+        uint32 now = millis();
+        if (memcmp(XPRAM, seen, XPRAM_SIZE) != 0) {
+            memcpy(seen, XPRAM, XPRAM_SIZE);
+            changed_ms = now;
+            pending = true;
+        } else if (pending && now - changed_ms >= XPRAM_QUIET_MS) {
+            pending = false;
+            if (save_if_changed(seen)) {
+                D(bug("[XPRAM] Saved after %u ms quiet\n", (unsigned)(now - changed_ms)));
+            }
+        }
+    }
+}
+
+/*
+ *  Create the file at its full size and map its sector, then start the
+ *  writer (once, from LoadXPRAM)
+ */
+static void start_writer(bool file_ok)
+{
+    if (xpram_lock == NULL) {
+        xpram_lock = xSemaphoreCreateMutex();
+        xpram_saved = (uint8 *)malloc(XPRAM_SIZE);
+        xpram_sector = (uint8 *)heap_caps_aligned_alloc(64, XPRAM_SECTOR_SIZE,
+                                                       MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (xpram_sector) {
+            memset(xpram_sector, 0, XPRAM_SECTOR_SIZE);
+        }
+    }
+    if (xpram_lock == NULL || xpram_saved == NULL || xpram_sector == NULL) {
+        Serial.println("[XPRAM] WARNING: no memory for the writer, XPRAM is saved on exit only");
+        return;
+    }
+    
+    memcpy(xpram_saved, XPRAM, XPRAM_SIZE);
+    if (!file_ok) {
+        xSemaphoreTake(xpram_lock, portMAX_DELAY);
+        write_xpram(XPRAM);
+        xSemaphoreGive(xpram_lock);
+    }
+    if (xpram_map == NULL) {
+        xpram_map = SDExtentMapBuild(XPRAM_FILE_PATH);
+        if (xpram_map && !SDExtentCovers(xpram_map, 0, XPRAM_SECTOR_SIZE)) {
+            SDExtentMapFree(xpram_map);
+            xpram_map = NULL;
+        }
+    }
+    
+    if (xpram_task_handle == NULL &&
+        xTaskCreatePinnedToCore(xpramTask, "XPRAMTask", XPRAM_TASK_STACK_SIZE, NULL,
+                                XPRAM_TASK_PRIORITY, &xpram_task_handle,
+                                PrefsFindTaskCore("xpram", XPRAM_TASK_CORE)) != pdPASS) {
+        xpram_task_handle = NULL;
+        Serial.println("[XPRAM] WARNING: writer task not started, XPRAM is saved on exit only");
+        return;
+    }
+    Serial.printf("[XPRAM] Saved %u ms after the last change (%s)\n", XPRAM_QUIET_MS,
+                  xpram_map ? "sector write" : "file rewrite");
+}
+
 /*
  *  Load XPRAM from SD card
  */
@@ -34,35 +175,44 @@ void LoadXPRAM(const char *vmdir)
     memset(XPRAM, 0, XPRAM_SIZE);
     
     // Try to load from SD card
-    File f = SD.open(XPRAM_FILE_PATH, FILE_READ);
+    bool file_ok = false;
+    File f = SDCardFS().open(XPRAM_FILE_PATH, FILE_READ);
     if (f) {
         size_t bytes_read = f.read(XPRAM, XPRAM_SIZE);
         f.close();
+        file_ok = bytes_read == XPRAM_SIZE;
         Serial.printf("[XPRAM] Loaded %d bytes from %s\n", bytes_read, XPRAM_FILE_PATH);
     } else {
         Serial.println("[XPRAM] No saved XPRAM found, using defaults");
     }
+    
+    start_writer(file_ok);
 }
 
 /*
- *  Save XPRAM to SD card
+ *  Save XPRAM to SD card (only if it changed since the writer's last save)
  */
 void SaveXPRAM(void)
 {
-    Serial.println("[XPRAM] Saving XPRAM...");
-    
     if (XPRAM == NULL) {
-        Serial.println("[XPRAM] ERROR: XPRAM not allocated");
+        LOG_PRINTF("[XPRAM] ERROR: XPRAM not allocated\n");
         return;
     }
     
-    File f = SD.open(XPRAM_FILE_PATH, FILE_WRITE);
-    if (f) {
-        size_t bytes_written = f.write(XPRAM, XPRAM_SIZE);
-        f.close();
-        Serial.printf("[XPRAM] Saved %d bytes to %s\n", bytes_written, XPRAM_FILE_PATH);
-    } else {
-        Serial.printf("[XPRAM] ERROR: Cannot write to %s\n", XPRAM_FILE_PATH);
+    if (xpram_lock == NULL) {
+        File f = SDCardFS().open(XPRAM_FILE_PATH, FILE_WRITE);
+        if (f) {
+            size_t bytes_written = f.write(XPRAM, XPRAM_SIZE);
+            f.close();
+            LOG_PRINTF("[XPRAM] Saved %d bytes to %s\n", bytes_written, XPRAM_FILE_PATH);
+        } else {
+            LOG_PRINTF("[XPRAM] ERROR: Cannot write to %s\n", XPRAM_FILE_PATH);
+        }
+        return;
+    }
+    
+    if (save_if_changed(XPRAM)) {
+        LOG_PRINTF("[XPRAM] Saved to %s\n", XPRAM_FILE_PATH);
     }
 }
 
@@ -73,8 +223,21 @@ void ZapPRAM(void)
 {
     Serial.println("[XPRAM] Zapping PRAM...");
     
+    if (xpram_lock) {
+        xSemaphoreTake(xpram_lock, portMAX_DELAY);
+    }
     if (XPRAM != NULL) {
         memset(XPRAM, 0, XPRAM_SIZE);
     }
-    SD.remove(XPRAM_FILE_PATH);
+    
+    // The sector goes with the file; the writer rewrites the file if needed
+    SDExtentMapFree(xpram_map);
+    xpram_map = NULL;
+    SDCardFS().remove(XPRAM_FILE_PATH);
+    if (xpram_saved) {
+        memset(xpram_saved, 0, XPRAM_SIZE);
+    }
+    if (xpram_lock) {
+        xSemaphoreGive(xpram_lock);
+    }
 }
@@ -8,21 +8,16 @@
 #include <Arduino.h>
 #include <M5Unified.h>
 #include <M5GFX.h>
-#include <SPI.h>
-#include <SD.h>
 
 #include "boot_gui.h"
-
-// M5Stack Tab5 SD Card SPI pins (ESP32-P4)
-#define SD_SPI_SCK   43
-#define SD_SPI_MOSI  44
-#define SD_SPI_MISO  39
-#define SD_SPI_CS    42
+#include "sd_esp32.h"
+#include "boot_timeline_esp32.h"
 
 // Forward declarations for BasiliskII functions
 extern void basilisk_setup(void);
 extern void basilisk_loop(void);
 extern bool basilisk_is_running(void);
+extern bool basilisk_was_suspended(void);
 
 // ============================================================================
 // Display Functions
@@ -57,32 +52,41 @@ void showErrorScreen(const char* error) {
     M5.Display.drawString(error, centerX, 160);
 }
 
+void showSuspendedScreen() {
+    M5.Display.fillScreen(TFT_BLACK);
+    M5.Display.setTextColor(TFT_WHITE);
+    M5.Display.setTextSize(2);
+    
+    int centerX = M5.Display.width() / 2;
+    int centerY = M5.Display.height() / 2;
+    
+    M5.Display.setTextDatum(MC_DATUM);
+    M5.Display.drawString("Macintosh suspended", centerX, centerY - 20);
+    M5.Display.setTextSize(1);
+    M5.Display.drawString("It is safe to switch off. The next start resumes where you left off.", centerX, centerY + 30);
+}
+
 // ============================================================================
 // SD Card Initialization
 // ============================================================================
 
 bool initSDCard() {
     Serial.println("[MAIN] Initializing SD card...");
-    Serial.printf("[MAIN] SD pins: SCK=%d, MOSI=%d, MISO=%d, CS=%d\n", 
-                  SD_SPI_SCK, SD_SPI_MOSI, SD_SPI_MISO, SD_SPI_CS);
     
-    // Initialize SPI with Tab5 SD card pins
-    SPI.begin(SD_SPI_SCK, SD_SPI_MISO, SD_SPI_MOSI, SD_SPI_CS);
-    
-    // Try to initialize SD card with explicit CS pin
-    if (!SD.begin(SD_SPI_CS, SPI, 25000000)) {
+    // SDMMC 4-bit first, SPI fallback (sd_esp32.cpp)
+    if (!SDCardBegin()) {
         Serial.println("[MAIN] ERROR: SD card initialization failed!");
         Serial.println("[MAIN] Make sure SD card is inserted and formatted as FAT32");
         return false;
     }
     
-    uint64_t cardSize = SD.cardSize() / (1024 * 1024);
+    uint64_t cardSize = SDCardSize() / (1024 * 1024);
     Serial.printf("[MAIN] SD card initialized: %lluMB\n", cardSize);
     
     // Check for required files
-    bool hasROM = SD.exists("/Q650.ROM");
-    bool hasDisk = SD.exists("/Macintosh.dsk");
-    bool hasFloppy = SD.exists("/DiskTools1.img");
+    bool hasROM = SDCardFS().exists("/Q650.ROM");
+    bool hasDisk = SDCardFS().exists("/Macintosh.dsk");
+    bool hasFloppy = SDCardFS().exists("/DiskTools1.img");
     
     Serial.printf("[MAIN] Q650.ROM: %s\n", hasROM ? "found" : "MISSING");
     Serial.printf("[MAIN] Macintosh.dsk: %s\n", hasDisk ? "found" : "MISSING");
@@ -109,6 +113,11 @@ void setup() {
     Serial.begin(115200);
     delay(500);
     
+#if BOOT_TIMELINE
+    // Reports a start that didn't get to the Finder, then times this one
+    BootTimelineInit();
+#endif
+    
     Serial.println("\n\n========================================");
     Serial.println("  BasiliskII ESP32 - Macintosh Emulator");
     Serial.println("  M5Stack Tab5 Edition");
@@ -128,7 +137,14 @@ void setup() {
     Serial.printf("[MAIN] CPU Freq: %d MHz\n", ESP.getCpuFreqMHz());
     
     // Initialize SD card
-    if (!initSDCard()) {
+#if BOOT_TIMELINE
+    BootPhaseBegin(BOOT_PHASE_SD);
+#endif
+    bool sd_ok = initSDCard();
+#if BOOT_TIMELINE
+    BootPhaseEnd(BOOT_PHASE_SD);
+#endif
+    if (!sd_ok) {
         showErrorScreen("SD card or ROM file not found");
         Serial.println("[MAIN] Halting - SD card initialization failed");
         while (1) {
@@ -146,7 +162,13 @@ void setup() {
     }
     
     // Run the boot GUI (countdown + optional settings screen)
+#if BOOT_TIMELINE
+    BootPhaseBegin(BOOT_PHASE_GUI);
+#endif
     BootGUI_Run();
+#if BOOT_TIMELINE
+    BootPhaseEnd(BOOT_PHASE_GUI);
+#endif
     
     // Launch BasiliskII emulator
     Serial.println("[MAIN] Starting BasiliskII emulator...");
@@ -154,6 +176,9 @@ void setup() {
     
     // If we get here, emulator has exited
     Serial.println("[MAIN] Emulator exited");
+    if (basilisk_was_suspended()) {
+        showSuspendedScreen();
+    }
 }
 
 // ============================================================================
@@ -55,6 +55,35 @@ static int using_prefetch;
 static int using_exception_3;
 static int cpu_level;
 
+/* Set by --threaded: straight-line handlers end with cpuop_chain() so they
+ * fetch and call the next handler themselves instead of returning to
+ * m68k_do_execute().  */
+static int threaded_dispatch;
+
+/* Set by --lazy-flags: logical, ADD, SUB and CMP handlers record their
+ * operands instead of computing C/Z/N/V (see FLAGS_SET_LAZY in m68k.h).
+ * lazy_flags_now is cleared while regenerating a handler that must stay
+ * eager.  */
+static int lazy_flags;
+static int lazy_flags_now;
+
+/* Set by --fuse-bcc (with --threaded and --lazy-flags): handlers that leave
+ * lazy flags behind end with cpuop_chain_bcc(), which runs a following Bcc
+ * straight from the recorded operands (m68k_fused_bcc() in newcpu.cpp)
+ * instead of dispatching it and materializing C/Z/N/V first.  */
+static int fuse_bcc;
+
+/* Set by --cycles: every handler adds an estimate of its 68040 cycle count
+ * through cpuop_cycles() (see USE_CYCLE_STATS in newcpu.h).  */
+static int cycle_estimates;
+
+/* Set by --hot-profile: handlers covering the most executed opcodes in a
+ * dump_counts() profile get CPUOP_HOT (IRAM_ATTR on ESP32), the rest stay
+ * in flash.  --hot-count limits how many handlers are promoted.  */
+static const char *hot_profile_name;
+static int hot_count = 256;
+static unsigned char *hot_opcode;
+
 /* For the current opcode, the next lower level that will have different code.
  * Initialized to -1 for each opcode. If it remains unchanged, indicates we
  * are done with that opcode.  */
@@ -65,6 +94,19 @@ static int *opcode_next_clev;
 static int *opcode_last_postfix;
 static unsigned long *counts;
 
+/* Most executed handler first; ties keep opcode order  */
+static int compare_handler_counts (const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    if (counts[x] != counts[y])
+	return counts[x] < counts[y] ? 1 : -1;
+    return x - y;
+}
+
+/* Order the handlers by the profile (--hot-profile, else frequent.68k), so
+ * the busiest ones end up next to each other in cpuemu.cpp.  Counts of
+ * opcodes that share a handler are added to it; a profile may list any
+ * opcode word, in any order.  */
 static void read_counts (void)
 {
     FILE *file;
@@ -73,31 +115,78 @@ static void read_counts (void)
     int nr = 0;
     memset (counts, 0, 65536 * sizeof *counts);
 
-    file = fopen ("frequent.68k", "r");
+    file = fopen (hot_profile_name ? hot_profile_name : "frequent.68k", "r");
     if (file) {
 	fscanf (file, "Total: %lu\n", &total);
-	while (fscanf (file, "%lx: %lu %s\n", &opcode, &count, name) == 3) {
-	    opcode_next_clev[nr] = 4;
-	    opcode_last_postfix[nr] = -1;
-	    opcode_map[nr++] = opcode;
-	    counts[opcode] = count;
+	while (fscanf (file, "%lx: %lu %19s\n", &opcode, &count, name) == 3) {
+	    long handler;
+	    if (opcode > 0xffff || table68k[opcode].mnemo == i_ILLG)
+		continue;
+	    handler = table68k[opcode].handler;
+	    counts[handler == -1 ? opcode : handler] += count;
 	}
 	fclose (file);
     }
-    if (nr == nr_cpuop_funcs)
-	return;
     for (opcode = 0; opcode < 0x10000; opcode++) {
-	if (table68k[opcode].handler == -1 && table68k[opcode].mnemo != i_ILLG
-	    && counts[opcode] == 0)
-	{
+	if (table68k[opcode].handler == -1 && table68k[opcode].mnemo != i_ILLG) {
 	    opcode_next_clev[nr] = 4;
 	    opcode_last_postfix[nr] = -1;
 	    opcode_map[nr++] = opcode;
-	    counts[opcode] = count;
 	}
     }
     if (nr != nr_cpuop_funcs)
 	abort ();
+    qsort (opcode_map, nr, sizeof *opcode_map, compare_handler_counts);
+}
+
+/* Rank handlers by the summed counts of all opcodes they serve; must run
+ * after do_merges() so that table68k[].handler is valid.  */
+static void read_hot_profile (void)
+{
+    FILE *file;
+    unsigned long opcode, count, total;
+    unsigned long *handler_counts;
+    char name[20];
+    int n;
+
+    hot_opcode = (unsigned char *) calloc (65536, 1);
+    if (hot_profile_name == NULL)
+	return;
+
+    file = fopen (hot_profile_name, "r");
+    if (file == NULL) {
+	fprintf (stderr, "gencpu: cannot open profile %s\n", hot_profile_name);
+	exit (1);
+    }
+
+    handler_counts = (unsigned long *) calloc (65536, sizeof (unsigned long));
+    fscanf (file, "Total: %lu\n", &total);
+    while (fscanf (file, "%lx: %lu %s\n", &opcode, &count, name) == 3) {
+	long handler;
+	if (opcode > 0xffff || table68k[opcode].mnemo == i_ILLG)
+	    continue;
+	handler = table68k[opcode].handler;
+	if (handler == -1)
+	    handler = opcode;
+	handler_counts[handler] += count;
+    }
+    fclose (file);
+
+    for (n = 0; n < hot_count; n++) {
+	long best = -1;
+	for (opcode = 0; opcode < 65536; opcode++) {
+	    if (hot_opcode[opcode] || handler_counts[opcode] == 0)
+		continue;
+	    if (best < 0 || handler_counts[opcode] > handler_counts[best])
+		best = opcode;
+	}
+	if (best < 0)
+	    break;
+	hot_opcode[best] = 1;
+    }
+    free (handler_counts);
+
+    fprintf (stderr, "gencpu: %d hot handlers from %s\n", n, hot_profile_name);
 }
 
 static char endlabelstr[80];
@@ -321,7 +410,7 @@ static void genamode (amodes mode, char *reg, wordsizes size, char *name, int ge
 		next_cpu_level = 1;
 	    sync_m68k_pc ();
 	    start_brace ();
-	    printf ("\tuaecptr %sa = get_disp_ea_020(m68k_areg(regs, %s), next_iword());\n", name, reg);
+	    printf ("\tuaecptr %sa = get_disp_ea_020_inline(m68k_areg(regs, %s), next_iword());\n", name, reg);
 	} else
 	    printf ("\tuaecptr %sa = get_disp_ea_000(m68k_areg(regs, %s), %s);\n", name, reg, gen_nextiword ());
 
@@ -337,7 +426,7 @@ static void genamode (amodes mode, char *reg, wordsizes size, char *name, int ge
 	    sync_m68k_pc ();
 	    start_brace ();
 	    printf ("\tuaecptr tmppc = m68k_getpc();\n");
-	    printf ("\tuaecptr %sa = get_disp_ea_020(tmppc, next_iword());\n", name);
+	    printf ("\tuaecptr %sa = get_disp_ea_020_inline(tmppc, next_iword());\n", name);
 	} else {
 	    printf ("\tuaecptr tmppc = m68k_getpc() + %d;\n", m68k_pc_offset);
 	    printf ("\tuaecptr %sa = get_disp_ea_000(tmppc, %s);\n", name, gen_nextiword ());
@@ -524,25 +613,42 @@ static void genastore (char *from, amodes mode, char *reg, wordsizes size, char
     }
 }
 
+/* MOVEM checks the whole transfer once: when the 16 registers' worth of
+ * memory from the effective address is in RAM (or ROM for loads), the
+ * registers go straight to and from host memory; anything else (I/O, the
+ * frame buffer, the edges of RAM) takes the bank path.  A fixed window
+ * saves counting the mask.  */
 static void genmovemel (uae_u16 opcode)
 {
-    char getcode[100];
+    char getcode[100], hostcode[100];
     int size = table68k[opcode].size == sz_long ? 4 : 2;
 
     if (table68k[opcode].size == sz_long) {
 	strcpy (getcode, "get_long(srca)");
+	strcpy (hostcode, "do_get_mem_long((uae_u32 *)host)");
     } else {
 	strcpy (getcode, "(uae_s32)(uae_s16)get_word(srca)");
+	strcpy (hostcode, "(uae_s32)(uae_s16)do_get_mem_word((uae_u16 *)host)");
     }
 
     printf ("\tuae_u16 mask = %s;\n", gen_nextiword ());
     printf ("\tunsigned int dmask = mask & 0xff, amask = (mask >> 8) & 0xff;\n");
     genamode (table68k[opcode].dmode, "dstreg", table68k[opcode].size, "src", 2, 1);
     start_brace ();
+    printf ("\tuae_u8 *host = ram_read_range(srca, %d);\n", 16 * size);
+    printf ("\tif (host) {\n");
+    printf ("\tuae_u8 *start = host;\n");
+    printf ("\twhile (dmask) { m68k_dreg(regs, movem_index1[dmask]) = %s; host += %d; dmask = movem_next[dmask]; }\n",
+	    hostcode, size);
+    printf ("\twhile (amask) { m68k_areg(regs, movem_index1[amask]) = %s; host += %d; amask = movem_next[amask]; }\n",
+	    hostcode, size);
+    printf ("\tsrca += host - start;\n");
+    printf ("\t} else {\n");
     printf ("\twhile (dmask) { m68k_dreg(regs, movem_index1[dmask]) = %s; srca += %d; dmask = movem_next[dmask]; }\n",
 	    getcode, size);
     printf ("\twhile (amask) { m68k_areg(regs, movem_index1[amask]) = %s; srca += %d; amask = movem_next[amask]; }\n",
 	    getcode, size);
+    printf ("\t}\n");
 
     if (table68k[opcode].dmode == Aipi)
 	printf ("\tm68k_areg(regs, dstreg) = srca;\n");
@@ -550,12 +656,14 @@ static void genmovemel (uae_u16 opcode)
 
 static void genmovemle (uae_u16 opcode)
 {
-    char putcode[100];
+    char putcode[100], hostcode[100];
     int size = table68k[opcode].size == sz_long ? 4 : 2;
     if (table68k[opcode].size == sz_long) {
 	strcpy (putcode, "put_long(srca,");
+	strcpy (hostcode, "do_put_mem_long((uae_u32 *)host,");
     } else {
 	strcpy (putcode, "put_word(srca,");
+	strcpy (hostcode, "do_put_mem_word((uae_u16 *)host,");
     }
 
     printf ("\tuae_u16 mask = %s;\n", gen_nextiword ());
@@ -566,20 +674,54 @@ static void genmovemle (uae_u16 opcode)
     start_brace ();
     if (table68k[opcode].dmode == Apdi) {
 	printf ("\tuae_u16 amask = mask & 0xff, dmask = (mask >> 8) & 0xff;\n");
+	printf ("\tuae_u8 *host = ram_write_range(srca - %d, %d);\n", 16 * size, 16 * size);
+	printf ("\tif (host) {\n");
+	printf ("\tuae_u8 *end = host += %d;\n", 16 * size);
+	printf ("\twhile (amask) { host -= %d; %s m68k_areg(regs, movem_index2[amask])); amask = movem_next[amask]; }\n",
+		size, hostcode);
+	printf ("\twhile (dmask) { host -= %d; %s m68k_dreg(regs, movem_index2[dmask])); dmask = movem_next[dmask]; }\n",
+		size, hostcode);
+	printf ("\tsrca -= end - host;\n");
+	printf ("\t} else {\n");
 	printf ("\twhile (amask) { srca -= %d; %s m68k_areg(regs, movem_index2[amask])); amask = movem_next[amask]; }\n",
 		size, putcode);
 	printf ("\twhile (dmask) { srca -= %d; %s m68k_dreg(regs, movem_index2[dmask])); dmask = movem_next[dmask]; }\n",
 		size, putcode);
+	printf ("\t}\n");
 	printf ("\tm68k_areg(regs, dstreg) = srca;\n");
     } else {
 	printf ("\tuae_u16 dmask = mask & 0xff, amask = (mask >> 8) & 0xff;\n");
+	printf ("\tuae_u8 *host = ram_write_range(srca, %d);\n", 16 * size);
+	printf ("\tif (host) {\n");
+	printf ("\twhile (dmask) { %s m68k_dreg(regs, movem_index1[dmask])); host += %d; dmask = movem_next[dmask]; }\n",
+		hostcode, size);
+	printf ("\twhile (amask) { %s m68k_areg(regs, movem_index1[amask])); host += %d; amask = movem_next[amask]; }\n",
+		hostcode, size);
+	printf ("\t} else {\n");
 	printf ("\twhile (dmask) { %s m68k_dreg(regs, movem_index1[dmask])); srca += %d; dmask = movem_next[dmask]; }\n",
 		putcode, size);
 	printf ("\twhile (amask) { %s m68k_areg(regs, movem_index1[amask])); srca += %d; amask = movem_next[amask]; }\n",
 		putcode, size);
+	printf ("\t}\n");
     }
 }
 
+/* MOVE16 moves one aligned 16-byte line, which a memmove does when both
+ * ends are in RAM (a line never crosses a bank)  */
+static void genmove16 (const char *src, const char *dst)
+{
+    printf ("\t{ uae_u8 *from = ram_read_range(%s, 16);\n", src);
+    printf ("\tuae_u8 *to = from ? ram_write_range(%s, 16) : NULL;\n", dst);
+    printf ("\tif (to)\n");
+    printf ("\t\tmemmove(to, from, 16);\n");
+    printf ("\telse {\n");
+    printf ("\tput_long(%s, get_long(%s));\n", dst, src);
+    printf ("\tput_long(%s+4, get_long(%s+4));\n", dst, src);
+    printf ("\tput_long(%s+8, get_long(%s+8));\n", dst, src);
+    printf ("\tput_long(%s+12, get_long(%s+12));\n", dst, src);
+    printf ("\t} }\n");
+}
+
 static void duplicate_carry (void)
 {
     printf ("\tCOPY_CARRY;\n");
@@ -590,6 +732,41 @@ typedef enum {
     flag_av, flag_sv
 } flagtypes;
 
+/* Record the operation for m68k_flags_materialize(); X is still set here as
+ * the carry of ADD/SUB.  Returns 0 for flag types that stay eager.  */
+static int genflags_lazy (flagtypes type, wordsizes size, char *value, char *src, char *dst,
+			  char *udstr, char *usstr, char *undstr)
+{
+    const char *sz;
+
+    switch (size) {
+     case sz_byte: sz = "FLAGS_LAZY_B"; break;
+     case sz_word: sz = "FLAGS_LAZY_W"; break;
+     case sz_long: sz = "FLAGS_LAZY_L"; break;
+     default: abort ();
+    }
+
+    switch (type) {
+     case flag_logical:
+	printf ("\tFLAGS_SET_LAZY_RES (FLAGS_LAZY_LOGICAL | %s, (uae_u32)(%s));\n", sz, value);
+	return 1;
+     case flag_add:
+	printf ("\tSET_XFLG (%s < %s);\n", undstr, usstr);
+	printf ("\tFLAGS_SET_LAZY (FLAGS_LAZY_ADD | %s, (uae_u32)(%s), (uae_u32)(%s), %s);\n",
+		sz, src, dst, value);
+	return 1;
+     case flag_sub:
+	printf ("\tSET_XFLG (%s > %s);\n", usstr, udstr);
+	/* fall through */
+     case flag_cmp:
+	printf ("\tFLAGS_SET_LAZY (FLAGS_LAZY_SUB | %s, (uae_u32)(%s), (uae_u32)(%s), %s);\n",
+		sz, src, dst, value);
+	return 1;
+     default:
+	return 0;
+    }
+}
+
 static void genflags_normal (flagtypes type, wordsizes size, char *value, char *src, char *dst)
 {
     char vstr[100], sstr[100], dstr[100];
@@ -659,6 +836,10 @@ static void genflags_normal (flagtypes type, wordsizes size, char *value, char *
 	break;
     }
 
+    if (lazy_flags_now && genflags_lazy (type, size, value, src, dst,
+					 udstr, usstr, undstr))
+	return;
+
     switch (type) {
      case flag_logical_noclobber:
      case flag_logical:
@@ -1393,6 +1574,11 @@ static void gen_opcode (unsigned long int opcode)
 	genamode (curi->dmode, "dstreg", curi->size, "offs", 1, 0);
 
 	printf ("\tif (!cctrue(%d)) {\n", curi->cc);
+	/* DBcc does not change the flags, so one branching to itself runs
+	 * until Dn is used up: take all but the last pass at once */
+	printf ("#if DBCC_FAST_FORWARD\n");
+	printf ("\tif (offs == -2 && src != 0) { m68k_dbcc_skip((uae_u16)src); src = 0; }\n");
+	printf ("#endif\n");
 	genastore ("(src-1)", curi->smode, "srcreg", curi->size, "src");
 
 	printf ("\t\tif (src) {\n");
@@ -2204,10 +2390,7 @@ static void gen_opcode (unsigned long int opcode)
 		printf ("\tuaecptr mems = m68k_areg(regs, srcreg) & ~15, memd;\n");
 		printf ("\tdstreg = (%s >> 12) & 7;\n", gen_nextiword());
 		printf ("\tmemd = m68k_areg(regs, dstreg) & ~15;\n");
-		printf ("\tput_long(memd, get_long(mems));\n");
-		printf ("\tput_long(memd+4, get_long(mems+4));\n");
-		printf ("\tput_long(memd+8, get_long(mems+8));\n");
-		printf ("\tput_long(memd+12, get_long(mems+12));\n");
+		genmove16 ("mems", "memd");
 		printf ("\tif (srcreg != dstreg)\n");
 		printf ("\tm68k_areg(regs, srcreg) += 16;\n");
 		printf ("\tm68k_areg(regs, dstreg) += 16;\n");
@@ -2218,10 +2401,7 @@ static void gen_opcode (unsigned long int opcode)
 		genamode (curi->dmode, "dstreg", curi->size, "memd", 0, 2);
 		printf ("\tmemsa &= ~15;\n");
 		printf ("\tmemda &= ~15;\n");
-		printf ("\tput_long(memda, get_long(memsa));\n");
-		printf ("\tput_long(memda+4, get_long(memsa+4));\n");
-		printf ("\tput_long(memda+8, get_long(memsa+8));\n");
-		printf ("\tput_long(memda+12, get_long(memsa+12));\n");
+		genmove16 ("memsa", "memda");
 		if ((opcode & 0xfff8) == 0xf600)
 		printf ("\tm68k_areg(regs, srcreg) += 16;\n");
 		else if ((opcode & 0xfff8) == 0xf608)
@@ -2268,7 +2448,15 @@ static void generate_includes (FILE * f)
 	
 	fprintf (f, "#define SET_CFLG_ALWAYS(x) SET_CFLG(x)\n");
 	fprintf (f, "#define SET_NFLG_ALWAYS(x) SET_NFLG(x)\n");
+	/* CPUFUNC_VARIANT renames the 68040 handlers and table for the
+	   fixed-layout copies in cpuemu_ram*.cpp and cpuemu_a24.cpp */
+	fprintf (f, "#ifdef CPUFUNC_VARIANT\n");
+	fprintf (f, "#define CPUFUNC_FF(x) CPUFUNC_VARIANT(x)\n");
+	fprintf (f, "#define CPUTBL_CONST const\n");
+	fprintf (f, "#else\n");
 	fprintf (f, "#define CPUFUNC_FF(x) x##_ff\n");
+	fprintf (f, "#define CPUTBL_CONST\n");
+	fprintf (f, "#endif\n");
 	fprintf (f, "#define CPUFUNC_NF(x) x##_nf\n");
 	fprintf (f, "#define CPUFUNC(x) CPUFUNC_FF(x)\n");
 	
@@ -2279,9 +2467,175 @@ static void generate_includes (FILE * f)
 
 static int postfix;
 
+/* RAM sizes offered by the boot GUI, each gets a cpuemu_ram<n>m.cpp */
+static const int fixed_ram_mb[] = { 4, 8, 12, 16 };
+
+/* Instructions that can never change the PC non-sequentially, raise an
+ * exception, touch the SR/interrupt mask or call back into the emulator.
+ * Only these may chain to the next handler in threaded mode; everything
+ * else returns so that m68k_do_execute() gets to check the special flags. */
+static int opcode_can_chain (long int opcode)
+{
+    switch (table68k[opcode].mnemo) {
+     case i_OR: case i_AND: case i_EOR:
+     case i_SUB: case i_SUBA: case i_SUBX: case i_SBCD:
+     case i_ADD: case i_ADDA: case i_ADDX: case i_ABCD:
+     case i_NEG: case i_NEGX: case i_NBCD: case i_CLR: case i_NOT: case i_TST:
+     case i_BTST: case i_BCHG: case i_BCLR: case i_BSET:
+     case i_CMP: case i_CMPM: case i_CMPA:
+     case i_MVPRM: case i_MVPMR: case i_MOVE: case i_MOVEA:
+     case i_SWAP: case i_EXG: case i_EXT: case i_MVMEL: case i_MVMLE:
+     case i_NOP: case i_LINK: case i_UNLK:
+     case i_LEA: case i_PEA: case i_Scc:
+     case i_MULU: case i_MULS:
+     case i_ASR: case i_ASL: case i_LSR: case i_LSL:
+     case i_ROL: case i_ROR: case i_ROXL: case i_ROXR:
+     case i_ASRW: case i_ASLW: case i_LSRW: case i_LSLW:
+     case i_ROLW: case i_RORW: case i_ROXLW: case i_ROXRW:
+     case i_TAS: case i_PACK: case i_UNPK:
+	return 1;
+     default:
+	return 0;
+    }
+}
+
+/* Extra cycles for an effective address on the 68040, assuming cache hits */
+static int ea_cycles_68040 (amodes mode)
+{
+    switch (mode) {
+     case Aind: case Aipi: case Apdi:
+     case Ad16: case absw: case absl: case PC16:
+	return 1;
+     case Ad8r: case PC8r:
+	return 3;
+     default:
+	return 0;
+    }
+}
+
+/* Rough 68040 timing per opcode family (MC68040 UM, chapter 10), used for
+ * MHz-equivalent statistics, not for cycle-exact emulation.  */
+static int cycles_68040 (long int opcode)
+{
+    struct instr *curi = table68k + opcode;
+    int base, ea = 0;
+
+    if (curi->suse)
+	ea += ea_cycles_68040 ((amodes) curi->smode);
+    if (curi->duse)
+	ea += ea_cycles_68040 ((amodes) curi->dmode);
+
+    switch (curi->mnemo) {
+     case i_EMULOP_RETURN: case i_EMULOP:
+	return 0;
+     case i_SBCD: case i_ABCD: case i_NBCD: case i_PACK: case i_UNPK:
+	base = 4; break;
+     case i_ASR: case i_ASL: case i_LSR: case i_LSL: case i_ROL: case i_ROR:
+     case i_ROXL: case i_ROXR: case i_ASRW: case i_ASLW: case i_LSRW: case i_LSLW:
+     case i_ROLW: case i_RORW: case i_ROXLW: case i_ROXRW:
+     case i_BCHG: case i_BCLR: case i_BSET: case i_Bcc: case i_LINK: case i_UNLK:
+     case i_PEA: case i_RTS: case i_JMP:
+	base = 2; break;
+     case i_BSR: case i_JSR: case i_DBcc: case i_RTD: case i_RTR: case i_TAS:
+     case i_CHK: case i_MVPRM: case i_MVPMR:
+	base = 3; break;
+     case i_MVSR2: case i_MV2SR: case i_ORSR: case i_ANDSR: case i_EORSR:
+     case i_MVR2USP: case i_MVUSP2R: case i_MOVES: case i_MOVE16: case i_MMUOP:
+     case i_CINVL: case i_CINVP: case i_CINVA: case i_CPUSHL: case i_CPUSHP: case i_CPUSHA:
+	base = 4; break;
+     case i_BFTST: case i_BFEXTU: case i_BFCHG: case i_BFEXTS: case i_BFCLR:
+     case i_BFFFO: case i_BFSET: case i_BFINS: case i_CHK2: case i_MOVEC2: case i_MOVE2C:
+	base = 8; break;
+     case i_MVMEL: case i_MVMLE:
+	base = 8; break;	/* plus one per register, not known here */
+     case i_CAS: case i_FPP: case i_FDBcc: case i_FScc: case i_FTRAPcc: case i_FBcc:
+	base = 10; break;
+     case i_RTE: case i_STOP:
+	base = 12; break;
+     case i_MULU: case i_MULS:
+	base = 16; break;
+     case i_TRAP: case i_TRAPV: case i_TRAPcc: case i_BKPT: case i_ILLG:
+	base = 16; break;
+     case i_CAS2: case i_MULL: case i_FSAVE: case i_FRESTORE:
+	base = 20; break;
+     case i_DIVU: case i_DIVS:
+	base = 27; break;
+     case i_DIVL:
+	base = 44; break;
+     case i_RESET:
+	base = 520; break;
+     default:
+	/* MOVE, ALU ops, LEA, Scc, NOP, ... */
+	base = 1; break;
+    }
+    return base + ea;
+}
+
+/* Anything in a handler body that reads C/Z/N/V or writes only part of them */
+static const char *const eager_flag_uses[] = {
+    "SET_CFLG", "SET_ZFLG", "SET_NFLG", "SET_VFLG",
+    "GET_CFLG", "GET_ZFLG", "GET_NFLG", "GET_VFLG",
+    "CZNV", "COPY_CARRY", "cctrue", "m68k_divl", "m68k_mull", NULL
+};
+
+static char *gen_opcode_to_string (long int opcode)
+{
+    FILE *saved = stdout;
+    char *text;
+    size_t len;
+
+    fflush (stdout);
+    stdout = open_memstream (&text, &len);
+    if (stdout == NULL)
+	abort ();
+    gen_opcode (opcode);
+    fclose (stdout);
+    stdout = saved;
+    return text;
+}
+
+/* Generate the handler body into a buffer first.  Handlers that touch the
+ * flags eagerly start with FLAGS_SYNC(); a handler that does so after it
+ * recorded lazy flags (CAS, CHK2, ...) is regenerated without lazy flags.  */
+static int gen_opcode_lazy (long int opcode)
+{
+    int saved_need_endlabel = need_endlabel;
+    const char *const *tok;
+    const char *lazy, *p;
+    int eager = 0, conflict = 0;
+    char *text;
+
+    lazy_flags_now = 1;
+    text = gen_opcode_to_string (opcode);
+    lazy = strstr (text, "FLAGS_SET_LAZY");
+    for (tok = eager_flag_uses; *tok; tok++) {
+	for (p = strstr (text, *tok); p != NULL; p = strstr (p + 1, *tok)) {
+	    eager = 1;
+	    if (lazy != NULL && p > lazy)
+		conflict = 1;
+	}
+    }
+    if (conflict) {
+	free (text);
+	need_endlabel = saved_need_endlabel;
+	next_cpu_level = -1;
+	lazy_flags_now = 0;
+	text = gen_opcode_to_string (opcode);
+    }
+    lazy_flags_now = 0;
+
+    if (eager)
+	printf ("\tFLAGS_SYNC();\n");
+    fputs (text, stdout);
+    lazy = strstr (text, "FLAGS_SET_LAZY");
+    free (text);
+    return lazy != NULL;
+}
+
 static void generate_one_opcode (int rp)
 {
     uae_u16 smsk, dmsk;
+    int sets_lazy = 0;
     long int opcode = opcode_map[rp];
     const char *opcode_str;
 
@@ -2321,8 +2675,12 @@ static void generate_one_opcode (int rp)
 	if (table68k[opcode].flagdead == 0)
 	printf ("#ifndef NOFLAGS\n");
 
-	printf ("void REGPARAM2 CPUFUNC(op_%lx_%d)(uae_u32 opcode) /* %s */\n{\n", opcode, postfix, opcode_str);
+	/* Only the 68040 table (postfix 0) is used by the ESP32 build */
+	printf ("void REGPARAM2 %sCPUFUNC(op_%lx_%d)(uae_u32 opcode) /* %s */\n{\n",
+		(postfix == 0 && hot_opcode[opcode]) ? "CPUOP_HOT " : "", opcode, postfix, opcode_str);
 	printf ("\tcpuop_begin();\n");
+	if (cycle_estimates)
+	printf ("\tcpuop_cycles(%d);\n", cycles_68040 (opcode));
 
     switch (table68k[opcode].stype) {
      case 0: smsk = 7; break;
@@ -2440,9 +2798,17 @@ static void generate_one_opcode (int rp)
     need_endlabel = 0;
     endlabelno++;
     sprintf (endlabelstr, "endlabel%d", endlabelno);
-    gen_opcode (opcode);
+    if (lazy_flags)
+	sets_lazy = gen_opcode_lazy (opcode);
+    else
+	gen_opcode (opcode);
     if (need_endlabel)
 	printf ("%s: ;\n", endlabelstr);
+	if (threaded_dispatch && opcode_can_chain (opcode) && fuse_bcc && sets_lazy)
+	printf ("\tcpuop_chain_bcc();\n");
+	else if (threaded_dispatch && opcode_can_chain (opcode))
+	printf ("\tcpuop_chain();\n");
+	else
 	printf ("\tcpuop_end();\n");
     printf ("}\n");
 	if (table68k[opcode].flagdead == 0)
@@ -2473,7 +2839,12 @@ static void generate_func (void)
 		opcode_next_clev[rp] = 0;
 	}
 	postfix = i;
-	fprintf (stblfile, "struct cputbl CPUFUNC(op_smalltbl_%d)[] = {\n", postfix);
+	/* The fixed-layout copies only need the 68040 table */
+	if (postfix != 0) {
+	    fprintf (stblfile, "#ifndef CPUFUNC_VARIANT\n");
+	    printf ("\n#ifndef CPUFUNC_VARIANT\n");
+	}
+	fprintf (stblfile, "CPUTBL_CONST struct cputbl CPUFUNC(op_smalltbl_%d)[] = {\n", postfix);
 
 	/* Disable spurious warnings. */
 	printf ("\n"
@@ -2508,14 +2879,40 @@ static void generate_func (void)
 	}
 
 	fprintf (stblfile, "{ 0, 0, 0 }};\n");
+	if (postfix != 0) {
+	    fprintf (stblfile, "#endif\n");
+	    printf ("#endif /* CPUFUNC_VARIANT */\n");
+	}
     }
 }
 
 int main (int argc, char **argv)
 {
     FILE *out;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+	if (strcmp (argv[i], "--threaded") == 0)
+	    threaded_dispatch = 1;
+	else if (strcmp (argv[i], "--lazy-flags") == 0)
+	    lazy_flags = 1;
+	else if (strcmp (argv[i], "--fuse-bcc") == 0)
+	    fuse_bcc = 1;
+	else if (strcmp (argv[i], "--cycles") == 0)
+	    cycle_estimates = 1;
+	else if (strcmp (argv[i], "--hot-profile") == 0 && i + 1 < argc)
+	    hot_profile_name = argv[++i];
+	else if (strcmp (argv[i], "--hot-count") == 0 && i + 1 < argc)
+	    hot_count = atoi (argv[++i]);
+	else {
+	    fprintf (stderr, "usage: %s [--threaded] [--lazy-flags] [--fuse-bcc] [--cycles] [--hot-profile file] [--hot-count n]\n", argv[0]);
+	    return 1;
+	}
+    }
+
     read_table68k ();
     do_merges ();
+    read_hot_profile ();
 
     opcode_map = (int *) malloc (sizeof (int) * nr_cpuop_funcs);
     opcode_last_postfix = (int *) malloc (sizeof (int) * nr_cpuop_funcs);
@@ -2554,5 +2951,31 @@ int main (int argc, char **argv)
     printf ("#include \"cpuemu.cpp\"\n");
     fflush (out);
 
+    /* 68040 handlers with the RAM size and ROM location compiled in, one
+     * file per supported RAM size (see MEM_FIXED_RAMSIZE in memory.h).  */
+    for (i = 0; i < (int) (sizeof fixed_ram_mb / sizeof fixed_ram_mb[0]); i++) {
+	char name[32];
+	sprintf (name, "cpuemu_ram%dm.cpp", fixed_ram_mb[i]);
+	out = freopen (name, "w", stdout);
+	printf ("#if USE_FIXED_RAM_ACCESSORS\n");
+	printf ("#define MEM_FIXED_RAMSIZE 0x%08x\n", fixed_ram_mb[i] << 20);
+	printf ("#define CPUFUNC_VARIANT(x) x##_ram%dm\n", fixed_ram_mb[i]);
+	printf ("#include \"cpuemu.cpp\"\n");
+	printf ("#include \"cpustbl.cpp\"\n");
+	printf ("#endif\n");
+	fflush (out);
+    }
+
+    /* 68040 handlers that drop the top address byte before the RAM and ROM
+     * checks, for 24-bit addressing (see MEM_ADDR_24BIT in memory.h).  */
+    out = freopen ("cpuemu_a24.cpp", "w", stdout);
+    printf ("#if USE_24BIT_ACCESSORS\n");
+    printf ("#define MEM_ADDR_24BIT 1\n");
+    printf ("#define CPUFUNC_VARIANT(x) x##_a24\n");
+    printf ("#include \"cpuemu.cpp\"\n");
+    printf ("#include \"cpustbl.cpp\"\n");
+    printf ("#endif\n");
+    fflush (out);
+
     return 0;
 }
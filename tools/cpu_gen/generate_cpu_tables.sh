@@ -31,17 +31,31 @@ cc -I. -I"$OUTPUT_DIR" -o gencpu gencpu.c readcpu.cpp "$OUTPUT_DIR/cpudefs.cpp"
 echo "  Done."
 
 # Step 4: Generate CPU emulation files
+# --threaded makes straight-line handlers dispatch the next opcode themselves
+# (used when USE_THREADED_DISPATCH=1, harmless otherwise)
+# --lazy-flags records ALU results and computes CZNV only when read (needs
+# -DUSE_LAZY_FLAGS=1)
+# --fuse-bcc lets those handlers run a following Bcc from the recorded flags
+# (needs both of the above)
+# --cycles adds per-handler 68040 cycle estimates (counted with USE_CYCLE_STATS=1)
+# HOT_PROFILE=<file> (dump_counts() format, e.g. /opcodes.68k from an
+# OPCODE_STATS=1 build) writes the handlers out most executed first and
+# places the busiest in IRAM; HOT_COUNT sets how many (default 256)
+GENCPU_ARGS="--threaded --lazy-flags --fuse-bcc --cycles"
+if [ -n "$HOT_PROFILE" ]; then
+    GENCPU_ARGS="$GENCPU_ARGS --hot-profile $(cd "$(dirname "$HOT_PROFILE")" && pwd)/$(basename "$HOT_PROFILE") --hot-count ${HOT_COUNT:-256}"
+fi
 echo ""
 echo "Step 4: Generating CPU emulation files..."
 cd "$OUTPUT_DIR"
-"$SCRIPT_DIR/gencpu"
+"$SCRIPT_DIR/gencpu" $GENCPU_ARGS
 echo "  Done."
 
 # Step 5: Add ESP32 PSRAM attributes to large tables
 echo ""
 echo "Step 5: Adding PSRAM attributes for ESP32..."
 # Add PSRAM attribute to cpustbl.cpp tables
-sed -i '' 's/^struct cputbl CPUFUNC/EXT_RAM_ATTR struct cputbl CPUFUNC/g' cpustbl.cpp
+sed -i '' 's/^CPUTBL_CONST struct cputbl CPUFUNC/EXT_RAM_ATTR CPUTBL_CONST struct cputbl CPUFUNC/g' cpustbl.cpp
 # Add the ESP32 attribute definition at the top of cpustbl.cpp
 sed -i '' '1i\
 #ifdef ARDUINO\
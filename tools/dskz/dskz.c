@@ -0,0 +1,352 @@
+/*
+ *  dskz.c - Convert disk images to and from the chunked .dskz format
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Build:  cc -O2 -o dskz dskz.c
+ *
+ *  Usage:  dskz pack [-c chunk_kb] [-r reserve_mb] in.dsk out.dskz
+ *          dskz unpack in.dskz out.dsk
+ *          dskz info in.dskz
+ *
+ *  All-zero chunks are not stored, the rest are LZ4-compressed unless
+ *  that saves less than 1/16 of the chunk. The reserve preallocates room
+ *  for copy-on-write chunks so early writes by Mac OS don't grow the file
+ *  (which costs it its direct card access, see sd_esp32.cpp).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../../src/basilisk/dskz_format.h"
+
+#define DEFAULT_CHUNK_KB    64
+#define HASH_BITS           14
+#define MIN_MATCH           4
+#define LAST_LITERALS       5       // LZ4: block ends with >= 5 literals
+#define MF_LIMIT            12      // LZ4: no match starts in the last 12 bytes
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "dskz: %s\n", msg);
+    exit(1);
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ *  Greedy LZ4 block compressor; dst needs lz4_bound(n) bytes
+ */
+static size_t lz4_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+    static uint32_t table[1 << HASH_BITS];     // Position + 1, 0 = empty
+    const uint8_t *ip = src, *anchor = src, *iend = src + n;
+    uint8_t *op = dst;
+
+    memset(table, 0, sizeof(table));
+    if (n > MF_LIMIT) {
+        const uint8_t *mflimit = iend - MF_LIMIT;
+        const uint8_t *matchlimit = iend - LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            uint32_t cand = table[h];
+            table[h] = (uint32_t)(ip - src) + 1;
+            if (cand == 0 || (size_t)(ip - src) + 1 - cand > 65535 || read32(src + cand - 1) != seq) {
+                ip++;
+                continue;
+            }
+            const uint8_t *ref = src + cand - 1;
+            const uint8_t *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = ip - anchor, mlen = (mp - ip) - MIN_MATCH;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t off = ip - ref;
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = put_length(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    // Trailing literals
+    size_t lit = iend - anchor;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static int all_zero(const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (p[i]) return 0;
+    }
+    return 1;
+}
+
+static uint64_t align512(uint64_t v)
+{
+    return (v + 511) & ~(uint64_t)511;
+}
+
+static void write_at(FILE *f, uint64_t offset, const void *buf, size_t len)
+{
+    if (fseeko(f, (off_t)offset, SEEK_SET) != 0 || fwrite(buf, 1, len, f) != len) {
+        die("write failed");
+    }
+}
+
+static void read_at(FILE *f, uint64_t offset, void *buf, size_t len)
+{
+    if (fseeko(f, (off_t)offset, SEEK_SET) != 0 || fread(buf, 1, len, f) != len) {
+        die("read failed (truncated image?)");
+    }
+}
+
+/*
+ *  Read and check a .dskz header and index
+ */
+static struct dskz_chunk *load_index(FILE *f, struct dskz_header *hdr)
+{
+    read_at(f, 0, hdr, sizeof(*hdr));
+    if (memcmp(hdr->magic, DSKZ_MAGIC, sizeof(hdr->magic)) != 0) die("not a .dskz image");
+    if (hdr->version != DSKZ_VERSION) die("unsupported .dskz version");
+    uint32_t cs = hdr->chunk_size;
+    if (cs < DSKZ_MIN_CHUNK || cs > DSKZ_MAX_CHUNK || (cs & (cs - 1)) ||
+        hdr->chunk_count != (hdr->logical_size + cs - 1) / cs) {
+        die("bad header");
+    }
+    struct dskz_chunk *index = malloc((size_t)hdr->chunk_count * sizeof(*index) + 1);
+    if (!index) die("out of memory");
+    read_at(f, hdr->index_offset, index, (size_t)hdr->chunk_count * sizeof(*index));
+    return index;
+}
+
+static int pack(const char *in_path, const char *out_path, uint32_t chunk_size, uint64_t reserve)
+{
+    FILE *in = fopen(in_path, "rb");
+    if (!in) die("cannot open input");
+    fseeko(in, 0, SEEK_END);
+    uint64_t size = (uint64_t)ftello(in);
+    fseeko(in, 0, SEEK_SET);
+    if (size == 0) die("input is empty");
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out) die("cannot create output");
+
+    struct dskz_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DSKZ_MAGIC, sizeof(hdr.magic));
+    hdr.version = DSKZ_VERSION;
+    hdr.chunk_size = chunk_size;
+    hdr.logical_size = size;
+    hdr.chunk_count = (uint32_t)((size + chunk_size - 1) / chunk_size);
+    hdr.index_offset = DSKZ_HEADER_SIZE;
+
+    struct dskz_chunk *index = calloc(hdr.chunk_count, sizeof(*index));
+    uint8_t *chunk = malloc(chunk_size);
+    uint8_t *packed = malloc(lz4_bound(chunk_size));
+    if (!index || !chunk || !packed) die("out of memory");
+
+    uint64_t pos = align512(hdr.index_offset + (uint64_t)hdr.chunk_count * sizeof(*index));
+    uint32_t counts[3] = {0, 0, 0};
+    for (uint32_t i = 0; i < hdr.chunk_count; i++) {
+        size_t got = fread(chunk, 1, chunk_size, in);
+        if (got == 0) die("read failed");
+        memset(chunk + got, 0, chunk_size - got);
+
+        if (all_zero(chunk, chunk_size)) {
+            index[i].type = DSKZ_CHUNK_ZERO;
+        } else {
+            size_t n = lz4_compress(chunk, chunk_size, packed);
+            if (n < chunk_size - chunk_size / 16) {
+                index[i].type = DSKZ_CHUNK_LZ4;
+                index[i].offset = pos;
+                index[i].length = (uint32_t)n;
+                write_at(out, pos, packed, n);
+                pos += n;
+            } else {
+                // Raw chunks sector-aligned for direct card access
+                pos = align512(pos);
+                index[i].type = DSKZ_CHUNK_RAW;
+                index[i].offset = pos;
+                index[i].length = chunk_size;
+                write_at(out, pos, chunk, chunk_size);
+                pos += chunk_size;
+            }
+        }
+        counts[index[i].type]++;
+    }
+
+    hdr.log_end = align512(pos);
+    write_at(out, 0, &hdr, sizeof(hdr));
+    write_at(out, hdr.index_offset, index, (size_t)hdr.chunk_count * sizeof(*index));
+    uint64_t file_size = hdr.log_end + reserve;
+    if (file_size > pos) {
+        // Pad so the reserve (and the log alignment) is allocated
+        static const uint8_t zero[4096];
+        for (uint64_t p = pos; p < file_size; ) {
+            size_t n = file_size - p > sizeof(zero) ? sizeof(zero) : (size_t)(file_size - p);
+            write_at(out, p, zero, n);
+            p += n;
+        }
+    }
+    if (fclose(out) != 0) die("write failed");
+    fclose(in);
+
+    printf("%s: %llu KB in %u x %u KB chunks (%u zero, %u raw, %u lz4), %llu KB stored (%.1f%%)\n",
+           out_path, (unsigned long long)(size / 1024), hdr.chunk_count, chunk_size / 1024,
+           counts[DSKZ_CHUNK_ZERO], counts[DSKZ_CHUNK_RAW], counts[DSKZ_CHUNK_LZ4],
+           (unsigned long long)(file_size / 1024), 100.0 * file_size / size);
+    free(index);
+    free(chunk);
+    free(packed);
+    return 0;
+}
+
+static int unpack(const char *in_path, const char *out_path)
+{
+    FILE *in = fopen(in_path, "rb");
+    if (!in) die("cannot open input");
+    struct dskz_header hdr;
+    struct dskz_chunk *index = load_index(in, &hdr);
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out) die("cannot create output");
+    uint32_t cs = hdr.chunk_size;
+    uint8_t *chunk = malloc(cs), *stored = malloc(cs);
+    if (!chunk || !stored) die("out of memory");
+
+    for (uint32_t i = 0; i < hdr.chunk_count; i++) {
+        const struct dskz_chunk *c = &index[i];
+        switch (c->type) {
+            case DSKZ_CHUNK_ZERO:
+                memset(chunk, 0, cs);
+                break;
+            case DSKZ_CHUNK_RAW:
+                read_at(in, c->offset, chunk, cs);
+                break;
+            case DSKZ_CHUNK_LZ4: {
+                if (c->length == 0 || c->length > cs) die("bad index entry");
+                read_at(in, c->offset, stored, c->length);
+                int n = dskz_lz4_decompress(stored, (int)c->length, chunk, (int)cs);
+                if (n < 0) die("corrupt chunk");
+                memset(chunk + n, 0, cs - n);
+                break;
+            }
+            default:
+                die("bad index entry");
+        }
+        uint64_t left = hdr.logical_size - (uint64_t)i * cs;
+        size_t n = left < cs ? (size_t)left : cs;
+        if (fwrite(chunk, 1, n, out) != n) die("write failed");
+    }
+    if (fclose(out) != 0) die("write failed");
+    fclose(in);
+    free(index);
+    free(chunk);
+    free(stored);
+    return 0;
+}
+
+static int info(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) die("cannot open input");
+    struct dskz_header hdr;
+    struct dskz_chunk *index = load_index(f, &hdr);
+    fseeko(f, 0, SEEK_END);
+    uint64_t file_size = (uint64_t)ftello(f);
+    fclose(f);
+
+    uint32_t counts[3] = {0, 0, 0};
+    uint64_t stored = 0;
+    for (uint32_t i = 0; i < hdr.chunk_count; i++) {
+        if (index[i].type > DSKZ_CHUNK_LZ4) die("bad index entry");
+        counts[index[i].type]++;
+        stored += index[i].type == DSKZ_CHUNK_ZERO ? 0 : index[i].length;
+    }
+    printf("disk:     %llu KB\n", (unsigned long long)(hdr.logical_size / 1024));
+    printf("chunks:   %u x %u KB (%u zero, %u raw, %u lz4)\n", hdr.chunk_count, hdr.chunk_size / 1024,
+           counts[DSKZ_CHUNK_ZERO], counts[DSKZ_CHUNK_RAW], counts[DSKZ_CHUNK_LZ4]);
+    printf("stored:   %llu KB\n", (unsigned long long)(stored / 1024));
+    printf("log end:  %llu, file %llu bytes (%llu KB free for copy-on-write)\n",
+           (unsigned long long)hdr.log_end, (unsigned long long)file_size,
+           (unsigned long long)(file_size > hdr.log_end ? (file_size - hdr.log_end) / 1024 : 0));
+    free(index);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: dskz pack [-c chunk_kb] [-r reserve_mb] in.dsk out.dskz\n"
+            "       dskz unpack in.dskz out.dsk\n"
+            "       dskz info in.dskz\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) usage();
+
+    if (strcmp(argv[1], "pack") == 0) {
+        uint32_t chunk_kb = DEFAULT_CHUNK_KB;
+        uint64_t reserve_mb = 0;
+        int i = 2;
+        for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+            if (strcmp(argv[i], "-c") == 0) {
+                chunk_kb = (uint32_t)strtoul(argv[i + 1], NULL, 0);
+            } else if (strcmp(argv[i], "-r") == 0) {
+                reserve_mb = strtoull(argv[i + 1], NULL, 0);
+            } else {
+                usage();
+            }
+        }
+        if (argc - i != 2) usage();
+        uint32_t cs = chunk_kb * 1024;
+        if (cs < DSKZ_MIN_CHUNK || cs > DSKZ_MAX_CHUNK || (cs & (cs - 1))) {
+            die("chunk size must be a power of 2 from 4 to 1024 KB");
+        }
+        return pack(argv[i], argv[i + 1], cs, reserve_mb * 1024 * 1024);
+    }
+    if (strcmp(argv[1], "unpack") == 0 && argc == 4) return unpack(argv[2], argv[3]);
+    if (strcmp(argv[1], "info") == 0 && argc == 3) return info(argv[2]);
+    usage();
+    return 2;
+}
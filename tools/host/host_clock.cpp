@@ -0,0 +1,228 @@
+/*
+ *  host_clock.cpp - Virtual clock, esp_timer and Serial for the host build
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Time on the host build is not the host's: the clock only moves when
+ *  main_host.cpp advances it for the instructions the 68k has executed
+ *  (at the "--mips" rate), when idle_wait() skips to the next timer, and
+ *  in delay(). esp_timer callbacks fire synchronously as the clock passes
+ *  their deadlines, so two runs with the same ROM, disk and options go
+ *  through exactly the same interrupts at the same instructions.
+ */
+
+#include "sysdeps.h"
+#include "host_clock.h"
+
+#include "esp_timer.h"
+
+#include <vector>
+#include <algorithm>
+
+HostSerial Serial;
+HostESP ESP;
+
+struct host_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    uint64 deadline;        // Virtual time it fires at
+    uint64 period;          // 0 = one-shot
+    bool armed;
+};
+
+static uint64 clock_us = 0;                     // Virtual time since start [us]
+static std::vector<host_timer *> timers;        // All created timers
+static bool firing = false;                     // Inside HostClockAdvance()'s callbacks
+
+/*
+ *  Serial: stdout, unless --quiet
+ */
+int HostSerial::printf(const char *format, ...)
+{
+    if (quiet) {
+        return 0;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+}
+
+size_t HostSerial::print(const char *s)
+{
+    return quiet ? 0 : fputs(s, stdout) >= 0 ? strlen(s) : 0;
+}
+
+size_t HostSerial::print(int n)
+{
+    return printf("%d", n);
+}
+
+size_t HostSerial::println(const char *s)
+{
+    return printf("%s\n", s);
+}
+
+size_t HostSerial::println(int n)
+{
+    return printf("%d\n", n);
+}
+
+void HostSerial::flush(void)
+{
+    fflush(stdout);
+}
+
+/*
+ *  Fire the timers that are due, earliest first
+ */
+static void fire_due_timers(void)
+{
+    if (firing) {
+        return;     // A callback that delays doesn't recurse into the others
+    }
+    firing = true;
+    for (;;) {
+        host_timer *next = NULL;
+        for (host_timer *t : timers) {
+            if (t->armed && t->deadline <= clock_us && (!next || t->deadline < next->deadline)) {
+                next = t;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        if (next->period) {
+            next->deadline += next->period;
+            if (next->deadline <= clock_us) {
+                next->deadline = clock_us + next->period;   // Late periodic events are dropped
+            }
+        } else {
+            next->armed = false;
+        }
+        next->callback(next->arg);
+    }
+    firing = false;
+}
+
+uint64 HostClockNow(void)
+{
+    return clock_us;
+}
+
+void HostClockAdvance(uint64 us)
+{
+    clock_us += us;
+    fire_due_timers();
+}
+
+bool HostClockNextDeadline(uint64 &when)
+{
+    bool found = false;
+    for (host_timer *t : timers) {
+        if (t->armed && (!found || t->deadline < when)) {
+            when = t->deadline;
+            found = true;
+        }
+    }
+    return found;
+}
+
+uint64 HostClockSkipToNextTimer(uint64 max_us)
+{
+    uint64 when;
+    uint64 skip = max_us;
+    if (HostClockNextDeadline(when)) {
+        skip = when > clock_us ? std::min(when - clock_us, max_us) : 0;
+    }
+    HostClockAdvance(skip);
+    return skip;
+}
+
+/*
+ *  Arduino timing
+ */
+uint32_t millis(void)
+{
+    return (uint32_t)(clock_us / 1000);
+}
+
+uint32_t micros(void)
+{
+    return (uint32_t)clock_us;
+}
+
+void delay(uint32_t ms)
+{
+    HostClockAdvance((uint64)ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    HostClockAdvance(us);
+}
+
+/*
+ *  esp_timer
+ */
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    if (!args || !args->callback || !out_handle) {
+        return ESP_FAIL;
+    }
+    host_timer *t = new host_timer;
+    t->callback = args->callback;
+    t->arg = args->arg;
+    t->name = args->name;
+    t->deadline = 0;
+    t->period = 0;
+    t->armed = false;
+    timers.push_back(t);
+    *out_handle = t;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer->armed) {
+        return ESP_FAIL;    // As on the ESP32: stop it first
+    }
+    timer->deadline = clock_us + timeout_us;
+    timer->period = 0;
+    timer->armed = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    if (timer->armed || period_us == 0) {
+        return ESP_FAIL;
+    }
+    timer->deadline = clock_us + period_us;
+    timer->period = period_us;
+    timer->armed = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer->armed) {
+        return ESP_FAIL;
+    }
+    timer->armed = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    timers.erase(std::remove(timers.begin(), timers.end(), timer), timers.end());
+    delete timer;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t)clock_us;
+}
@@ -0,0 +1,23 @@
+/*
+ *  host_clock.h - Virtual clock of the host build
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef HOST_CLOCK_H
+#define HOST_CLOCK_H
+
+// Virtual time since start [us]
+extern uint64 HostClockNow(void);
+
+// Move the clock on and fire the esp_timers that came due
+extern void HostClockAdvance(uint64 us);
+
+// Deadline of the earliest armed esp_timer; false if none is armed
+extern bool HostClockNextDeadline(uint64 &when);
+
+// Move the clock to the next esp_timer deadline, at most max_us; returns
+// how far it moved
+extern uint64 HostClockSkipToNextTimer(uint64 max_us);
+
+#endif /* HOST_CLOCK_H */
@@ -0,0 +1,511 @@
+/*
+ *  main_host.cpp - Headless host (Linux) build of the emulator core
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Runs the same 68k core, FPU, memory banks and Basilisk II drivers as
+ *  the device, on a virtual clock (host_clock.cpp): every quantum of
+ *  executed instructions moves time on by quantum / "--mips", the 60Hz
+ *  and 1Hz interrupts and the Time Manager fire from esp_timers on that
+ *  clock, and idle_wait() skips ahead to the next one. A run is therefore
+ *  repeatable to the instruction, and is stopped after "--ms" of Mac time.
+ *  At the end it prints what was executed, how fast the host ran it, and
+ *  a hash of the screen and of Mac RAM to compare against another build.
+ *  "--bench" instead runs the 68k microbenchmarks (cpu_bench.cpp), which
+ *  need no ROM, and exits. "--record" logs the 68k's inputs and "--replay"
+ *  runs a log through again, one from the device too (replay_esp32.cpp);
+ *  a replay stops where the log does.
+ *
+ *  Usage:  basilisk_host --rom <file> [--disk <file>]... [--cdrom <file>]
+ *                        [--ram <MB>] [--ms <Mac ms>] [--mips <rate>]
+ *                        [--readonly] [--xpram <file>] [--screenshot <file.ppm>]
+ *                        [--record <file> | --replay <file>] [--quiet]
+ *          basilisk_host --bench
+ */
+
+#include "sysdeps.h"
+
+#include "cpu_emulation.h"
+#include "sys.h"
+#include "xpram.h"
+#include "timer.h"
+#include "video.h"
+#include "prefs.h"
+#include "main.h"
+#include "user_strings.h"
+#include "rom_patches.h"
+#include "m68k.h"
+#include "memory.h"
+#include "readcpu.h"
+#include "newcpu.h"
+#include "cpu_bench.h"
+#include "replay_esp32.h"
+
+#include "esp_timer.h"
+#include "host_clock.h"
+#include "video_host.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+// ROM file size limits
+const uint32 ROM_MIN_SIZE = 64 * 1024;    // 64KB minimum
+const uint32 ROM_MAX_SIZE = 1024 * 1024;  // 1MB maximum
+
+// Memory pointers (declared in basilisk_glue.cpp)
+extern uint32 RAMBaseMac;
+extern uint8 *RAMBaseHost;
+extern uint32 RAMSize;
+extern uint32 ROMBaseMac;
+extern uint8 *ROMBaseHost;
+extern uint32 ROMSize;
+
+extern bool quit_program;
+
+// CPU and FPU type
+int CPUType = 4;           // 68040
+bool CPUIs68060 = false;
+int FPUType = 1;           // 68881
+bool TwentyFourBitAddressing = false;
+
+// Interrupt flags
+uint32 InterruptFlags = 0;
+
+// Instructions per quantum and per batch; the quantum is set from --mips so
+// that it spans CPU_IRQ_LATENCY_US of Mac time, what the device's
+// scheduler aims for while the Mac is busy
+int32 emulated_ticks = 40000;
+static int32 emulated_ticks_quantum = 40000;
+int32 exec_batch_size = 32;
+
+#ifndef CPU_IRQ_LATENCY_US
+#define CPU_IRQ_LATENCY_US      2000
+#endif
+#define DEFAULT_MIPS            20          // Virtual 68k speed, about the device's
+#define IDLE_WAIT_MAX_US        20000       // As timer_esp32.cpp's IDLE_WAIT_MAX_MS
+#define TICK_PERIOD_US          16625       // 60.15Hz, as on the real Mac
+
+static uint32 run_mips = DEFAULT_MIPS;
+static uint64 run_until_us = 30000000;      // --ms
+static uint64 total_instructions = 0;
+static uint64 instruction_remainder = 0;    // Instructions not yet turned into clock time
+static uint64 idle_total_us = 0;            // Virtual time skipped in idle_wait()
+static uint64 next_1hz_us = 1000000;
+static esp_timer_handle_t tick_timer = NULL;
+static bool quit_requested = false;         // Mac OS shut down (QuitEmulator)
+
+/*
+ *  Stop the 68k at the end of the current instruction batch
+ */
+static void stop_cpu(void)
+{
+    quit_program = true;
+    SPCFLAGS_SET(SPCFLAG_BRK);
+}
+
+/*
+ *  Called every emulated_ticks_quantum instructions: move the clock on for
+ *  them, which fires the interrupts that came due
+ */
+void cpu_do_check_ticks(void)
+{
+    // The CPU loop subtracts whole batches, the overshoot was executed too
+    int32 executed = emulated_ticks_quantum - emulated_ticks;
+    total_instructions += executed;
+    
+    instruction_remainder += executed;
+    uint64 us = instruction_remainder / run_mips;
+    instruction_remainder -= us * run_mips;
+    HostClockAdvance(us);
+    
+    if (HostClockNow() >= run_until_us || ReplayFinished()) {
+        stop_cpu();
+    }
+    emulated_ticks = emulated_ticks_quantum;
+}
+
+/*
+ *  Set/clear interrupt flags (one thread, the timers fire on it)
+ */
+void SetInterruptFlag(uint32 flag)
+{
+    if (ReplayHold(flag)) {
+        return;
+    }
+    InterruptFlags |= flag;
+}
+
+void ClearInterruptFlag(uint32 flag)
+{
+    InterruptFlags &= ~flag;
+}
+
+/*
+ *  60Hz tick timer, and the 1Hz interrupt every 60th-ish tick
+ */
+static void tick_timer_callback(void *arg)
+{
+    UNUSED(arg);
+    SetInterruptFlag(INTFLAG_60HZ);
+    SetInterruptFlag(INTFLAG_ADB);
+    TriggerInterrupt();
+    
+    uint64 now = HostClockNow();
+    if (now >= next_1hz_us) {
+        next_1hz_us += 1000000;
+        SetInterruptFlag(INTFLAG_1HZ);
+        TriggerInterrupt();
+    }
+}
+
+/*
+ *  Time Manager host side (timer_esp32.cpp on the device)
+ */
+uint64 GetTicks_usec(void)
+{
+    return HostClockNow();
+}
+
+void Delay_usec(uint64 usec)
+{
+    HostClockAdvance(usec);
+}
+
+// Mac OS is idle: skip to the next timer instead of sleeping
+void idle_wait(void)
+{
+    if (InterruptFlags || replay_mode == REPLAY_PLAY) {
+        return;
+    }
+    idle_total_us += HostClockSkipToNextTimer(IDLE_WAIT_MAX_US);
+    if (HostClockNow() >= run_until_us) {
+        stop_cpu();
+    }
+}
+
+// Stopped with the pending interrupt masked: the same, flags or not
+void idle_wait_masked(void)
+{
+    if (replay_mode == REPLAY_PLAY) {
+        return;
+    }
+    idle_total_us += HostClockSkipToNextTimer(IDLE_WAIT_MAX_US);
+    if (HostClockNow() >= run_until_us) {
+        stop_cpu();
+    }
+}
+
+void idle_resume(void)
+{
+}
+
+uint64 idle_time_usec(void)
+{
+    return idle_total_us;
+}
+
+/*
+ *  Mutex functions (no threads)
+ */
+B2_mutex *B2_create_mutex(void)
+{
+    return new B2_mutex;
+}
+
+void B2_lock_mutex(B2_mutex *mutex)
+{
+    UNUSED(mutex);
+}
+
+void B2_unlock_mutex(B2_mutex *mutex)
+{
+    UNUSED(mutex);
+}
+
+void B2_delete_mutex(B2_mutex *mutex)
+{
+    delete mutex;
+}
+
+void FlushCodeCache(void *start, uint32 size)
+{
+    UNUSED(start);
+    UNUSED(size);
+}
+
+/*
+ *  Alerts go to stderr, so --quiet keeps them
+ */
+void ErrorAlert(const char *text)
+{
+    fprintf(stderr, "[ERROR] %s\n", text);
+}
+
+void WarningAlert(const char *text)
+{
+    fprintf(stderr, "[WARNING] %s\n", text);
+}
+
+bool ChoiceAlert(const char *text, const char *pos, const char *neg)
+{
+    fprintf(stderr, "[CHOICE] %s (%s/%s)\n", text, pos, neg);
+    return true;
+}
+
+/*
+ *  Mac OS shut down
+ */
+void QuitEmulator(void)
+{
+    Serial.println("[MAIN] QuitEmulator called");
+    quit_requested = true;
+    stop_cpu();
+}
+
+/*
+ *  Load the ROM file
+ */
+static bool LoadROM(const char *rom_path)
+{
+    FILE *f = fopen(rom_path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open ROM file %s\n", rom_path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long rom_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (rom_size < (long)ROM_MIN_SIZE || rom_size > (long)ROM_MAX_SIZE) {
+        fprintf(stderr, "Invalid ROM size %ld (expected %u-%u bytes)\n", rom_size, ROM_MIN_SIZE, ROM_MAX_SIZE);
+        fclose(f);
+        return false;
+    }
+    
+    // Round up to nearest 64KB
+    ROMSize = (rom_size + 0xFFFF) & ~0xFFFF;
+    ROMBaseHost = (uint8 *)calloc(1, ROMSize);
+    bool ok = ROMBaseHost && fread(ROMBaseHost, 1, rom_size, f) == (size_t)rom_size;
+    fclose(f);
+    return ok;
+}
+
+/*
+ *  FNV-1a, for the end-of-run hashes
+ */
+static uint64 hash_bytes(const uint8 *p, size_t n)
+{
+    uint64 h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ *  Write the Mac screen as a binary PPM
+ */
+static bool write_screenshot(const char *path)
+{
+    vector<uint8> rgb;
+    int width, height;
+    if (!HostVideoGetScreen(rgb, width, height)) {
+        return false;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    fwrite(rgb.data(), 1, rgb.size(), f);
+    fclose(f);
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: basilisk_host --rom <file> [--disk <file>]... [--cdrom <file>]\n"
+            "                     [--ram <MB>] [--ms <Mac ms to run>] [--mips <virtual MIPS>]\n"
+            "                     [--readonly] [--xpram <file>] [--screenshot <file.ppm>]\n"
+            "                     [--record <file> | --replay <file>] [--quiet]\n"
+            "       basilisk_host --bench\n");
+    exit(2);
+}
+
+/*
+ *  --bench: the 68k microbenchmarks on a blank ROM, nothing else initialized
+ */
+static int run_bench(void)
+{
+    int prefs_argc = 0;
+    char *prefs_argv_data[] = { NULL };
+    char **prefs_argv = prefs_argv_data;
+    PrefsInit(NULL, prefs_argc, prefs_argv);
+    
+    RAMSize = 8 * 1024 * 1024;
+    RAMBaseHost = (uint8 *)calloc(1, RAMSize);
+    ROMSize = ROM_MAX_SIZE;
+    ROMBaseHost = (uint8 *)calloc(1, ROMSize);
+    if (!RAMBaseHost || !ROMBaseHost) {
+        return 1;
+    }
+    ROMVersion = ROM_VERSION_32;
+    run_until_us = ~(uint64)0;          // The virtual clock never stops the 68k here
+    if (!Init680x0()) {
+        fprintf(stderr, "Init680x0() failed\n");
+        return 1;
+    }
+    CPUBenchRun();
+    Exit680x0();
+    PrefsExit();
+    return 0;
+}
+
+static double wall_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    const char *rom_path = NULL;
+    const char *screenshot_path = NULL;
+    vector<const char *> disks;
+    vector<const char *> cdroms;
+    int ram_mb = 8;
+    bool read_only = false;
+    const char *xpram_path = NULL;
+    const char *replay = NULL;
+    const char *replay_path = NULL;
+    bool run_ms_set = false;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--quiet") == 0) {
+            Serial.quiet = true;
+            continue;
+        }
+        if (strcmp(arg, "--bench") == 0) {
+            return run_bench();
+        }
+        if (strcmp(arg, "--readonly") == 0) {
+            read_only = true;
+            continue;
+        }
+        if (!value) {
+            usage();
+        }
+        i++;
+        if (strcmp(arg, "--rom") == 0) {
+            rom_path = value;
+        } else if (strcmp(arg, "--disk") == 0) {
+            disks.push_back(value);
+        } else if (strcmp(arg, "--cdrom") == 0) {
+            cdroms.push_back(value);
+        } else if (strcmp(arg, "--ram") == 0) {
+            ram_mb = atoi(value);
+        } else if (strcmp(arg, "--ms") == 0) {
+            run_until_us = strtoull(value, NULL, 10) * 1000;
+            run_ms_set = true;
+        } else if (strcmp(arg, "--record") == 0 || strcmp(arg, "--replay") == 0) {
+            replay = strcmp(arg, "--record") == 0 ? "record" : "play";
+            replay_path = value;
+        } else if (strcmp(arg, "--mips") == 0) {
+            run_mips = atoi(value);
+        } else if (strcmp(arg, "--xpram") == 0) {
+            xpram_path = value;
+        } else if (strcmp(arg, "--screenshot") == 0) {
+            screenshot_path = value;
+        } else {
+            usage();
+        }
+    }
+    if (!rom_path || ram_mb < 1 || ram_mb > 1024 || run_mips < 1) {
+        usage();
+    }
+    
+    // PrefsInit() sets the device's defaults (prefs_host.cpp), the command line goes on top
+    int prefs_argc = 0;
+    char *prefs_argv_data[] = { NULL };
+    char **prefs_argv = prefs_argv_data;
+    PrefsInit(NULL, prefs_argc, prefs_argv);
+    PrefsReplaceInt32("ramsize", ram_mb * 1024 * 1024);
+    PrefsReplaceBool("hostreadonly", read_only);
+    PrefsRemoveItem("disk");
+    for (const char *disk : disks) {
+        PrefsAddString("disk", disk);
+    }
+    if (!cdroms.empty()) {
+        PrefsReplaceBool("nocdrom", false);
+        for (const char *cdrom : cdroms) {
+            PrefsAddString("cdrom", cdrom);
+        }
+    }
+    if (xpram_path) {
+        PrefsReplaceString("xpram", xpram_path);
+    }
+    if (replay) {
+        PrefsReplaceString("replay", replay);
+        PrefsReplaceString("replayfile", replay_path);
+        if (strcmp(replay, "play") == 0 && !run_ms_set) {
+            run_until_us = ~(uint64)0;      // The log says when to stop
+        }
+    }
+    
+    SysInit();
+    
+    RAMSize = ram_mb * 1024 * 1024;
+    RAMBaseHost = (uint8 *)calloc(1, RAMSize);
+    if (!RAMBaseHost || !LoadROM(rom_path)) {
+        return 1;
+    }
+    if (!InitAll(NULL)) {
+        fprintf(stderr, "InitAll() failed\n");
+        return 1;
+    }
+    
+    esp_timer_create_args_t args = {};
+    args.callback = tick_timer_callback;
+    args.name = "tick60hz";
+    esp_timer_create(&args, &tick_timer);
+    esp_timer_start_periodic(tick_timer, TICK_PERIOD_US);
+    next_1hz_us = HostClockNow() + 1000000;
+    
+    emulated_ticks_quantum = (int32)((uint64)run_mips * CPU_IRQ_LATENCY_US);
+    emulated_ticks = emulated_ticks_quantum;
+    
+    ReplayInit();
+    double start = wall_seconds();
+    Start680x0();
+    double elapsed = wall_seconds() - start;
+    ReplayFinish();
+    
+    vector<uint8> rgb;
+    int width = 0, height = 0;
+    HostVideoGetScreen(rgb, width, height);
+    uint64 mac_ms = HostClockNow() / 1000;
+    printf("[HOST] %s after %llu ms Mac time (%llu ms idle)\n",
+           quit_requested ? "Mac OS shut down" : "stopped",
+           (unsigned long long)mac_ms, (unsigned long long)(idle_total_us / 1000));
+    printf("[HOST] %llu instructions in %.3f s host time (%.2f MIPS)\n",
+           (unsigned long long)total_instructions, elapsed,
+           elapsed > 0 ? total_instructions / elapsed / 1e6 : 0.0);
+    printf("[HOST] screen %dx%d hash %016llx, RAM hash %016llx, %llu frame buffer bytes written\n",
+           width, height, (unsigned long long)hash_bytes(rgb.data(), rgb.size()),
+           (unsigned long long)hash_bytes(RAMBaseHost, RAMSize),
+           (unsigned long long)HostVideoDirtyBytes());
+    
+    if (screenshot_path && !write_screenshot(screenshot_path)) {
+        fprintf(stderr, "Cannot write %s\n", screenshot_path);
+    }
+    
+    esp_timer_stop(tick_timer);
+    esp_timer_delete(tick_timer);
+    ExitAll();
+    SysExit();
+    PrefsExit();
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ *  prefs_host.cpp - Preferences for the host build
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The same machine as LoadPrefs() in prefs_esp32.cpp sets up (Quadra 900
+ *  model ID, 68040, 640x360, idle wait on), so a run on the host goes
+ *  through the boot the device does; main_host.cpp then puts in the ROM,
+ *  disks and RAM size from its command line.
+ */
+
+#include "sysdeps.h"
+#include "prefs.h"
+
+// Platform-specific preferences items
+prefs_desc platform_prefs_items[] = {
+    {"idlewait", TYPE_BOOLEAN, false, "sleep the CPU core while Mac OS is idle"},
+    {"nativebeep", TYPE_BOOLEAN, false, "play SysBeep() from a built-in sound instead of the alert sound"},
+    {"gfxaccel", TYPE_BOOLEAN, false, "run simple CopyBits()/FillRect()/EraseRect() calls on the screen natively"},
+    {"hostreadonly", TYPE_BOOLEAN, false, "open every disk image read-only"},
+    {"replay", TYPE_STRING, false, "\"record\" the 68k's inputs to replayfile or \"play\" them back"},
+    {"replayfile", TYPE_STRING, false, "input log (--record, --replay)"},
+    {NULL, TYPE_END, false, NULL}  // End marker
+};
+
+/*
+ *  Set the device's defaults
+ */
+void LoadPrefs(const char *vmdir)
+{
+    UNUSED(vmdir);
+    
+    PrefsReplaceInt32("modelid", 14);
+    PrefsReplaceInt32("cpu", 4);
+    PrefsReplaceBool("fpu", false);
+    PrefsReplaceInt32("ramsize", 8 * 1024 * 1024);
+    PrefsReplaceString("screen", "win/640/360");
+    PrefsReplaceBool("nosound", true);
+    PrefsReplaceBool("nativebeep", false);
+    PrefsReplaceBool("gfxaccel", true);
+    PrefsReplaceBool("nocdrom", true);
+    PrefsReplaceBool("nogui", true);
+    PrefsReplaceInt32("bootdrive", 0);
+    PrefsReplaceInt32("bootdriver", 0);
+    PrefsReplaceBool("idlewait", true);
+    PrefsReplaceInt32("frameskip", 4);
+}
+
+void AddPlatformPrefsDefaults(void)
+{
+    // Defaults are set in LoadPrefs
+}
@@ -0,0 +1,62 @@
+/*
+ *  Arduino.h - The part of the Arduino core the emulator core uses, on POSIX
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Serial goes to stdout. millis()/micros() and esp_timer run on the
+ *  host build's virtual clock (host_clock.cpp), so a run does the same
+ *  thing however fast the host is.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <assert.h>
+#include <arpa/inet.h>     // htons() and co., as lwIP provides them on the ESP32
+
+#include "esp_attr.h"
+
+class HostSerial {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t print(const char *s);
+    size_t print(int n);
+    size_t println(const char *s = "");
+    size_t println(int n);
+    void flush(void);
+    bool quiet = false;             // --quiet: drop the log, keep the report
+};
+
+extern HostSerial Serial;
+
+class HostESP {
+public:
+    uint32_t getFreeHeap(void) { return 0; }
+    uint32_t getFreePsram(void) { return 0; }
+    uint32_t getPsramSize(void) { return 0; }
+    uint32_t getCpuFreqMHz(void) { return 0; }
+    void restart(void) { exit(0); }
+};
+
+extern HostESP ESP;
+
+// Virtual clock (host_clock.cpp)
+extern uint32_t millis(void);
+extern uint32_t micros(void);
+extern void delay(uint32_t ms);
+extern void delayMicroseconds(uint32_t us);
+
+#define ps_malloc(size) malloc(size)
+#define ps_calloc(n, size) calloc(n, size)
+
+#endif /* HOST_ARDUINO_H */
@@ -0,0 +1,17 @@
+/*
+ *  esp_attr.h - Placement attributes, which mean nothing on the host
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define EXT_RAM_BSS_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define NOINLINE_ATTR __attribute__((noinline))
+
+#endif /* HOST_ESP_ATTR_H */
@@ -0,0 +1,44 @@
+/*
+ *  esp_timer.h - esp_timer on the host build's virtual clock
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Timers don't run on a thread of their own: HostClockAdvance() (called
+ *  between CPU quanta and from idle_wait()) fires every timer whose
+ *  deadline the virtual clock has passed, in deadline order.
+ */
+
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+#define ESP_OK      0
+#define ESP_FAIL    -1
+
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+    ESP_TIMER_ISR
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+typedef struct host_timer *esp_timer_handle_t;
+
+extern esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle);
+extern esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+extern esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us);
+extern esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+extern esp_err_t esp_timer_delete(esp_timer_handle_t timer);
+extern int64_t esp_timer_get_time(void);
+
+#endif /* HOST_ESP_TIMER_H */
@@ -0,0 +1,321 @@
+/*
+ *  sys_host.cpp - Disk image access for the host build
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Plain POSIX files, read and written synchronously with pread() and
+ *  pwrite(); .dskz images go through the same backend as on the ESP32
+ *  (dskz_esp32.cpp). There is no cache, repair or overlay here: the host
+ *  build is for the emulator core, and a run that writes to its disk
+ *  image changes the next run, so regression runs open them read-only
+ *  ("--readonly") or use a copy.
+ */
+
+#include "sysdeps.h"
+#include "main.h"
+#include "prefs.h"
+#include "sys.h"
+#include "dskz_esp32.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DEBUG 0
+#include "debug.h"
+
+struct disk_file {
+    char *path;
+    int fd;
+    bool read_only;
+    bool is_cdrom;
+    bool is_floppy;
+    loff_t size;                // Size of the disk (of the image with .dskz)
+    dskz_image *dskz;           // NULL = plain image
+};
+
+/*
+ *  Initialization
+ */
+void SysInit(void)
+{
+}
+
+void SysExit(void)
+{
+}
+
+// Drives come from the command line (main_host.cpp), there are no others
+void SysAddFloppyPrefs(void)
+{
+}
+
+void SysAddDiskPrefs(void)
+{
+}
+
+void SysAddCDROMPrefs(void)
+{
+}
+
+void SysAddSerialPrefs(void)
+{
+}
+
+/*
+ *  .dskz backing: the image file
+ */
+static size_t dskz_backing_read(void *ctx, uint8 *dst, uint64 offset, size_t length)
+{
+    disk_file *fh = (disk_file *)ctx;
+    ssize_t n = pread(fh->fd, dst, length, (off_t)offset);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static size_t dskz_backing_write(void *ctx, const uint8 *src, uint64 offset, size_t length)
+{
+    disk_file *fh = (disk_file *)ctx;
+    ssize_t n = pwrite(fh->fd, src, length, (off_t)offset);
+    return n > 0 ? (size_t)n : 0;
+}
+
+/*
+ *  Open a disk image
+ */
+void *Sys_open(const char *name, bool read_only, bool is_cdrom)
+{
+    if (!name || !*name) {
+        return NULL;
+    }
+    
+    bool iso = strstr(name, ".iso") != NULL || strstr(name, ".ISO") != NULL;
+    read_only = read_only || is_cdrom || iso || PrefsFindBool("hostreadonly");
+    
+    int fd = open(name, read_only ? O_RDONLY : O_RDWR);
+    if (fd < 0 && !read_only) {
+        fd = open(name, O_RDONLY);
+        read_only = true;
+    }
+    if (fd < 0) {
+        Serial.printf("[SYS] Cannot open %s\n", name);
+        return NULL;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    disk_file *fh = new disk_file;
+    fh->path = strdup(name);
+    fh->fd = fd;
+    fh->read_only = read_only;
+    fh->is_cdrom = is_cdrom;
+    fh->is_floppy = strstr(name, ".img") != NULL || strstr(name, ".IMG") != NULL;
+    fh->size = st.st_size;
+    
+    dskz_backing backing = { dskz_backing_read, dskz_backing_write, fh };
+    bool is_dskz;
+    fh->dskz = DSKZOpen(&backing, st.st_size, fh->read_only, &is_dskz);
+    if (is_dskz && !fh->dskz) {
+        Serial.printf("[SYS] ERROR: %s is not a usable .dskz image\n", name);
+        close(fd);
+        free(fh->path);
+        delete fh;
+        return NULL;
+    }
+    if (fh->dskz) {
+        fh->size = DSKZSize(fh->dskz);
+    }
+    
+    Serial.printf("[SYS] Opened %s (%lld KB, ro=%d)\n",
+                  name, (long long)(fh->size / 1024), fh->read_only);
+    return fh;
+}
+
+/*
+ *  Close a disk image
+ */
+void Sys_close(void *arg)
+{
+    disk_file *fh = (disk_file *)arg;
+    if (!fh) {
+        return;
+    }
+    if (fh->dskz) {
+        DSKZClose(fh->dskz);
+    }
+    close(fh->fd);
+    free(fh->path);
+    delete fh;
+}
+
+/*
+ *  Read/write "length" bytes at "offset"; returns the count transferred
+ */
+size_t Sys_read(void *arg, void *buffer, loff_t offset, size_t length)
+{
+    disk_file *fh = (disk_file *)arg;
+    if (!fh || offset < 0 || offset >= fh->size) {
+        return 0;
+    }
+    if ((loff_t)length > fh->size - offset) {
+        length = fh->size - offset;
+    }
+    if (fh->dskz) {
+        return DSKZRead(fh->dskz, (uint8 *)buffer, offset, length);
+    }
+    ssize_t n = pread(fh->fd, buffer, length, offset);
+    return n > 0 ? (size_t)n : 0;
+}
+
+size_t Sys_write(void *arg, void *buffer, loff_t offset, size_t length)
+{
+    disk_file *fh = (disk_file *)arg;
+    if (!fh || fh->read_only || offset < 0 || offset >= fh->size) {
+        return 0;
+    }
+    if ((loff_t)length > fh->size - offset) {
+        length = fh->size - offset;
+    }
+    if (fh->dskz) {
+        return DSKZWrite(fh->dskz, (const uint8 *)buffer, offset, length);
+    }
+    ssize_t n = pwrite(fh->fd, buffer, length, offset);
+    return n > 0 ? (size_t)n : 0;
+}
+
+loff_t SysGetFileSize(void *arg)
+{
+    disk_file *fh = (disk_file *)arg;
+    return fh ? fh->size : 0;
+}
+
+/*
+ *  Removable media: images stay inserted
+ */
+void SysEject(void *arg)
+{
+    UNUSED(arg);
+}
+
+bool SysFormat(void *arg)
+{
+    UNUSED(arg);
+    return false;
+}
+
+bool SysIsReadOnly(void *arg)
+{
+    disk_file *fh = (disk_file *)arg;
+    return fh ? fh->read_only : true;
+}
+
+bool SysIsFixedDisk(void *arg)
+{
+    disk_file *fh = (disk_file *)arg;
+    return fh ? !fh->is_cdrom && !fh->is_floppy : false;
+}
+
+bool SysIsDiskInserted(void *arg)
+{
+    return arg != NULL;
+}
+
+void SysPreventRemoval(void *arg)
+{
+    UNUSED(arg);
+}
+
+void SysAllowRemoval(void *arg)
+{
+    UNUSED(arg);
+}
+
+/*
+ *  CD audio: not on the host build
+ */
+bool SysCDReadTOC(void *arg, uint8 *toc)
+{
+    UNUSED(arg);
+    UNUSED(toc);
+    return false;
+}
+
+bool SysCDGetPosition(void *arg, uint8 *pos)
+{
+    UNUSED(arg);
+    UNUSED(pos);
+    return false;
+}
+
+bool SysCDPlay(void *arg, uint8 start_m, uint8 start_s, uint8 start_f, uint8 end_m, uint8 end_s, uint8 end_f)
+{
+    UNUSED(arg);
+    UNUSED(start_m); UNUSED(start_s); UNUSED(start_f);
+    UNUSED(end_m); UNUSED(end_s); UNUSED(end_f);
+    return false;
+}
+
+bool SysCDPause(void *arg)
+{
+    UNUSED(arg);
+    return false;
+}
+
+bool SysCDResume(void *arg)
+{
+    UNUSED(arg);
+    return false;
+}
+
+bool SysCDStop(void *arg, uint8 lead_out_m, uint8 lead_out_s, uint8 lead_out_f)
+{
+    UNUSED(arg);
+    UNUSED(lead_out_m); UNUSED(lead_out_s); UNUSED(lead_out_f);
+    return false;
+}
+
+bool SysCDScan(void *arg, uint8 start_m, uint8 start_s, uint8 start_f, bool reverse)
+{
+    UNUSED(arg);
+    UNUSED(start_m); UNUSED(start_s); UNUSED(start_f);
+    UNUSED(reverse);
+    return false;
+}
+
+void SysCDSetVolume(void *arg, uint8 left, uint8 right)
+{
+    UNUSED(arg);
+    UNUSED(left);
+    UNUSED(right);
+}
+
+void SysCDGetVolume(void *arg, uint8 &left, uint8 &right)
+{
+    UNUSED(arg);
+    left = right = 0;
+}
+
+/*
+ *  No media catalog on the host, find_hfs_partition() always searches
+ */
+int Sys_hfs_partition_block(void *arg)
+{
+    UNUSED(arg);
+    return -1;
+}
+
+void Sys_set_hfs_partition_block(void *arg, int block)
+{
+    UNUSED(arg);
+    UNUSED(block);
+}
+
+// No block cache on the host
+void Sys_set_hfs_volume(void *arg, loff_t start)
+{
+    UNUSED(arg);
+    UNUSED(start);
+}
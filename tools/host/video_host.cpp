@@ -0,0 +1,271 @@
+/*
+ *  video_host.cpp - Headless video for the host build
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  The modes, frame buffer layout and default palettes are the ones
+ *  video_esp32.cpp offers (640x360 and 1280x720, 1 to 16 bit, 16 bit in
+ *  the host-565 frame bank), so Mac OS sees the same screen; nothing is
+ *  displayed. main_host.cpp writes the screen to a PPM file and hashes it
+ *  for regression runs.
+ */
+
+#include "sysdeps.h"
+#include "cpu_emulation.h"
+#include "main.h"
+#include "prefs.h"
+#include "video.h"
+#include "video_host.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+// Screen sizes, as on the device
+#define MAC_SCREEN_WIDTH        640
+#define MAC_SCREEN_HEIGHT       360
+#define MAC_MAX_WIDTH           1280
+#define MAC_MAX_HEIGHT          720
+#define MAC_MAX_BYTES_PER_PIXEL 2
+
+// Frame buffer pointers (defined in basilisk_glue.cpp)
+extern uint8 *MacFrameBaseHost;
+extern uint32 MacFrameSize;
+extern int MacFrameLayout;
+
+static uint8 *mac_frame_buffer = NULL;
+static uint32 frame_buffer_size = 0;
+static uint8 screen_palette[256 * 3];       // Current CLUT, RGB888
+static uint64 dirty_bytes = 0;              // Frame buffer bytes written since start
+
+class host_monitor_desc : public monitor_desc {
+public:
+    host_monitor_desc(const vector<video_mode> &available_modes, video_depth default_depth, uint32 default_id)
+        : monitor_desc(available_modes, default_depth, default_id) {}
+
+    virtual void switch_to_current_mode(void);
+    virtual void set_palette(uint8 *pal, int num);
+    virtual void set_gamma(uint8 *gamma, int num);
+};
+
+static host_monitor_desc *the_monitor = NULL;
+
+/*
+ *  Default palettes (video_esp32.cpp's initDefaultPalette())
+ */
+static void set_rgb(int i, uint8 r, uint8 g, uint8 b)
+{
+    screen_palette[i * 3 + 0] = r;
+    screen_palette[i * 3 + 1] = g;
+    screen_palette[i * 3 + 2] = b;
+}
+
+static void initDefaultPalette(video_depth depth)
+{
+    switch (depth) {
+        case VDEPTH_1BIT:
+            set_rgb(0, 255, 255, 255);
+            set_rgb(1, 0, 0, 0);
+            break;
+        case VDEPTH_2BIT:
+            set_rgb(0, 255, 255, 255);
+            set_rgb(1, 170, 170, 170);
+            set_rgb(2, 85, 85, 85);
+            set_rgb(3, 0, 0, 0);
+            break;
+        case VDEPTH_4BIT: {
+            static const uint8 mac16[16][3] = {
+                {255, 255, 255}, {255, 255, 0}, {255, 102, 0}, {221, 0, 0},
+                {255, 0, 153}, {51, 0, 153}, {0, 0, 204}, {0, 153, 255},
+                {0, 170, 0}, {0, 102, 0}, {102, 51, 0}, {153, 102, 51},
+                {187, 187, 187}, {136, 136, 136}, {68, 68, 68}, {0, 0, 0}
+            };
+            for (int i = 0; i < 16; i++) {
+                set_rgb(i, mac16[i][0], mac16[i][1], mac16[i][2]);
+            }
+            break;
+        }
+        case VDEPTH_8BIT:
+        default: {
+            int idx = 0;
+            for (int r = 0; r < 6; r++) {
+                for (int g = 0; g < 6; g++) {
+                    for (int b = 0; b < 6; b++) {
+                        set_rgb(idx++, r * 51, g * 51, b * 51);
+                    }
+                }
+            }
+            for (int i = 0; i < 40; i++) {
+                uint8 gray = (i * 255) / 39;
+                set_rgb(idx++, gray, gray, gray);
+            }
+            break;
+        }
+    }
+}
+
+void host_monitor_desc::switch_to_current_mode(void)
+{
+    const video_mode &mode = get_current_mode();
+    D(bug("[VIDEO] switch_to_current_mode: %dx%d, depth=%d, bpr=%d\n",
+          mode.x, mode.y, mode.depth, mode.bytes_per_row));
+    
+    int layout = (mode.depth == VDEPTH_16BIT) ? FLAYOUT_HOST_565 : FLAYOUT_DIRECT;
+    if (layout != MacFrameLayout) {
+        MacFrameLayout = layout;
+        InitFrameBufferMapping();
+    }
+    initDefaultPalette(mode.depth);
+    set_mac_frame_base(MacFrameBaseMac);
+}
+
+void host_monitor_desc::set_palette(uint8 *pal, int num)
+{
+    if (num > 256) {
+        num = 256;
+    }
+    memcpy(screen_palette, pal, num * 3);
+}
+
+void host_monitor_desc::set_gamma(uint8 *gamma, int num)
+{
+    UNUSED(gamma);
+    UNUSED(num);
+}
+
+/*
+ *  Initialization
+ */
+bool VideoInit(bool classic)
+{
+    UNUSED(classic);
+    
+    frame_buffer_size = MAC_MAX_WIDTH * MAC_MAX_HEIGHT * MAC_MAX_BYTES_PER_PIXEL;
+    mac_frame_buffer = (uint8 *)malloc(frame_buffer_size);
+    if (!mac_frame_buffer) {
+        return false;
+    }
+    memset(mac_frame_buffer, 0x80, frame_buffer_size);
+    
+    MacFrameBaseHost = mac_frame_buffer;
+    MacFrameSize = frame_buffer_size;
+    MacFrameLayout = FLAYOUT_DIRECT;
+    initDefaultPalette(VDEPTH_8BIT);
+    
+    static const struct {
+        int x, y;
+        uint32 id;
+    } resolutions[] = {
+        { MAC_SCREEN_WIDTH, MAC_SCREEN_HEIGHT, 0x80 },
+        { MAC_MAX_WIDTH, MAC_MAX_HEIGHT, 0x81 },
+    };
+    static const video_depth depths[] = {
+        VDEPTH_1BIT, VDEPTH_2BIT, VDEPTH_4BIT, VDEPTH_8BIT, VDEPTH_16BIT
+    };
+    
+    vector<video_mode> modes;
+    video_mode mode;
+    mode.user_data = 0;
+    for (int r = 0; r < (int)(sizeof(resolutions) / sizeof(resolutions[0])); r++) {
+        mode.x = resolutions[r].x;
+        mode.y = resolutions[r].y;
+        mode.resolution_id = resolutions[r].id;
+        for (int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); d++) {
+            mode.depth = depths[d];
+            mode.bytes_per_row = TrivialBytesPerRow(mode.x, mode.depth);
+            modes.push_back(mode);
+        }
+    }
+    
+    the_monitor = new host_monitor_desc(modes, VDEPTH_8BIT, 0x80);
+    VideoMonitors.push_back(the_monitor);
+    the_monitor->set_mac_frame_base(MacFrameBaseMac);
+    return true;
+}
+
+void VideoExit(void)
+{
+    VideoMonitors.clear();
+    delete the_monitor;
+    the_monitor = NULL;
+    free(mac_frame_buffer);
+    mac_frame_buffer = NULL;
+}
+
+/*
+ *  Frame buffer write tracking (memory.cpp's frame banks): counted only
+ */
+void VideoMarkDirtyOffset(uint32 offset)
+{
+    UNUSED(offset);
+    dirty_bytes++;
+}
+
+void VideoMarkDirtyRange(uint32 offset, uint32 size)
+{
+    UNUSED(offset);
+    dirty_bytes += size;
+}
+
+void VideoMarkDirtyRect(uint32 offset, uint32 width, uint32 rows)
+{
+    UNUSED(offset);
+    dirty_bytes += width * rows;
+}
+
+void VideoRefresh(void)
+{
+}
+
+void VideoQuitFullScreen(void)
+{
+}
+
+/*
+ *  Video interrupt handler (60Hz)
+ */
+void VideoInterrupt(void)
+{
+    // Trigger ADB interrupt for mouse/keyboard updates
+    SetInterruptFlag(INTFLAG_ADB);
+}
+
+/*
+ *  Screen as RGB888 rows; false before VideoInit()
+ */
+bool HostVideoGetScreen(vector<uint8> &rgb, int &width, int &height)
+{
+    if (!the_monitor || !mac_frame_buffer) {
+        return false;
+    }
+    const video_mode &mode = the_monitor->get_current_mode();
+    width = mode.x;
+    height = mode.y;
+    rgb.resize((size_t)width * height * 3);
+    
+    uint8 *out = rgb.data();
+    for (int y = 0; y < height; y++) {
+        const uint8 *row = mac_frame_buffer + (size_t)y * mode.bytes_per_row;
+        for (int x = 0; x < width; x++) {
+            if (mode.depth == VDEPTH_16BIT) {
+                uint16 p = ((const uint16 *)row)[x];   // Host-order RGB565
+                *out++ = ((p >> 11) & 0x1f) * 255 / 31;
+                *out++ = ((p >> 5) & 0x3f) * 255 / 63;
+                *out++ = (p & 0x1f) * 255 / 31;
+                continue;
+            }
+            int bits = 1 << mode.depth;             // 1, 2, 4 or 8
+            int per_byte = 8 / bits;
+            int shift = (per_byte - 1 - x % per_byte) * bits;
+            int index = (row[x / per_byte] >> shift) & ((1 << bits) - 1);
+            *out++ = screen_palette[index * 3 + 0];
+            *out++ = screen_palette[index * 3 + 1];
+            *out++ = screen_palette[index * 3 + 2];
+        }
+    }
+    return true;
+}
+
+uint64 HostVideoDirtyBytes(void)
+{
+    return dirty_bytes;
+}
@@ -0,0 +1,16 @@
+/*
+ *  video_host.h - Headless video of the host build
+ *
+ *  BasiliskII ESP32 Port
+ */
+
+#ifndef VIDEO_HOST_H
+#define VIDEO_HOST_H
+
+// The Mac screen as RGB888 rows; false before VideoInit()
+extern bool HostVideoGetScreen(vector<uint8> &rgb, int &width, int &height);
+
+// Frame buffer bytes the 68k has written since start
+extern uint64 HostVideoDirtyBytes(void);
+
+#endif /* VIDEO_HOST_H */
@@ -0,0 +1,61 @@
+/*
+ *  xpram_host.cpp - XPRAM for the host build
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  XPRAM starts out zeroed, as on a device without /BasiliskII_XPRAM, so
+ *  every run boots the same. With "--xpram <file>" it is loaded from and
+ *  saved back to that file instead.
+ */
+
+#include "sysdeps.h"
+#include "xpram.h"
+#include "prefs.h"
+
+/*
+ *  Load XPRAM from the --xpram file, if there is one
+ */
+void LoadXPRAM(const char *vmdir)
+{
+    UNUSED(vmdir);
+    
+    const char *path = PrefsFindString("xpram");
+    if (!path) {
+        return;
+    }
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        size_t bytes_read = fread(XPRAM, 1, XPRAM_SIZE, f);
+        fclose(f);
+        Serial.printf("[XPRAM] Loaded %d bytes from %s\n", (int)bytes_read, path);
+    }
+}
+
+/*
+ *  Save XPRAM to the --xpram file, if there is one
+ */
+void SaveXPRAM(void)
+{
+    const char *path = PrefsFindString("xpram");
+    if (!path || XPRAM == NULL) {
+        return;
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        Serial.printf("[XPRAM] ERROR: Cannot write to %s\n", path);
+        return;
+    }
+    fwrite(XPRAM, 1, XPRAM_SIZE, f);
+    fclose(f);
+}
+
+/*
+ *  Delete the XPRAM file
+ */
+void ZapPRAM(void)
+{
+    const char *path = PrefsFindString("xpram");
+    if (path) {
+        remove(path);
+    }
+}
@@ -0,0 +1,493 @@
+/*
+ *  screenrec.c - Convert screen recordings (.rec) to GIF or raw video
+ *
+ *  BasiliskII ESP32 Port
+ *
+ *  Build:  cc -O2 -o screenrec screenrec.c
+ *
+ *  Usage:  screenrec info in.rec
+ *          screenrec gif in.rec out.gif
+ *          screenrec raw [-r fps] in.rec > frames.rgb
+ *
+ *  gif writes the changed rectangle of the screen every 20 ms or more,
+ *  with the recorded timing. raw writes RGB24 frames at a fixed rate (30
+ *  by default) of the size printed on stderr, for ffmpeg:
+ *
+ *    screenrec raw in.rec | ffmpeg -f rawvideo -pixel_format rgb24 \
+ *        -video_size 640x480 -framerate 30 -i - out.mp4
+ *
+ *  16-bit frames are reduced to RGB332 in GIFs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../../src/basilisk/screenrec_format.h"
+#include "../../src/basilisk/dskz_format.h"     // dskz_lz4_decompress()
+
+#define GIF_MIN_DELAY_MS    20
+#define GIF_HASH_SIZE       5003
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "screenrec: %s\n", msg);
+    exit(1);
+}
+
+/*
+ *  Reader: applies the records to the screen as the Mac had it
+ */
+struct screen {
+    FILE *f;
+    struct screenrec_mode mode;
+    uint32_t bytes_per_row;         // Of fb
+    uint8_t *fb;                    // The frame buffer, in the recorded layout
+    uint8_t palette[256 * 3];
+    struct screenrec_record r;     // Last read
+    uint8_t *record;
+    uint32_t record_cap;
+    int x0, y0, x1, y1;             // Changed by the last record, x1 = 0: nothing
+    uint32_t frames, palettes, modes;
+};
+
+static void screen_open(struct screen *s, const char *path)
+{
+    memset(s, 0, sizeof(*s));
+    s->f = fopen(path, "rb");
+    if (!s->f) die("can't open the recording");
+    struct screenrec_header h;
+    if (fread(&h, sizeof(h), 1, s->f) != 1 || memcmp(h.magic, SCREENREC_MAGIC, 8) != 0)
+        die("not a screen recording");
+    if (h.version != SCREENREC_VERSION) die("unsupported recording version");
+}
+
+static void mark(struct screen *s, int x0, int y0, int x1, int y1)
+{
+    if (s->x1 == 0) {
+        s->x0 = x0; s->y0 = y0; s->x1 = x1; s->y1 = y1;
+        return;
+    }
+    if (x0 < s->x0) s->x0 = x0;
+    if (y0 < s->y0) s->y0 = y0;
+    if (x1 > s->x1) s->x1 = x1;
+    if (y1 > s->y1) s->y1 = y1;
+}
+
+static void apply_frame(struct screen *s, const uint8_t *p, const uint8_t *end)
+{
+    const struct screenrec_mode *m = &s->mode;
+    if (!s->fb) die("frame before the screen mode");
+    int tiles = m->tiles_x * m->tiles_y;
+    int words = (tiles + 31) / 32;
+    uint32_t row_bytes = m->tile_width * m->depth / 8;
+    uint32_t tile_bytes = row_bytes * m->tile_height;
+    const uint8_t *q = p + words * 4;
+    uint8_t tile[64 * 36 * 2];
+    if (tile_bytes > sizeof(tile) || q > end) die("corrupt frame record");
+
+    for (int t = 0; t < tiles; t++) {
+        uint32_t word;
+        memcpy(&word, p + (t >> 5) * 4, 4);
+        if (!(word & (1u << (t & 31)))) continue;
+        if (end - q < 2) die("corrupt frame record");
+        uint32_t len = q[0] | (q[1] << 8);
+        q += 2;
+        const uint8_t *src = tile;
+        if (len & SCREENREC_TILE_RAW) {
+            len &= ~SCREENREC_TILE_RAW;
+            if (len != tile_bytes || (uint32_t)(end - q) < len) die("corrupt frame record");
+            src = q;
+        } else if ((uint32_t)(end - q) < len ||
+                   dskz_lz4_decompress(q, len, tile, sizeof(tile)) != (int)tile_bytes) {
+            die("corrupt tile");
+        }
+        q += len;
+
+        int tx = t % m->tiles_x, ty = t / m->tiles_x;
+        uint8_t *dst = s->fb + (size_t)ty * m->tile_height * s->bytes_per_row + tx * row_bytes;
+        for (int y = 0; y < m->tile_height; y++) {
+            memcpy(dst + (size_t)y * s->bytes_per_row, src + y * row_bytes, row_bytes);
+        }
+        mark(s, tx * m->tile_width, ty * m->tile_height,
+             (tx + 1) * m->tile_width, (ty + 1) * m->tile_height);
+    }
+    s->frames++;
+}
+
+// Read the next record; 0 at the end of the file, else its time in t
+static int screen_read(struct screen *s, uint32_t *t)
+{
+    if (fread(&s->r, sizeof(s->r), 1, s->f) != 1) return 0;
+    if (s->r.size < sizeof(s->r)) die("corrupt record");
+    uint32_t n = s->r.size - sizeof(s->r);
+    if (n > s->record_cap) {
+        s->record = realloc(s->record, n);
+        if (!s->record) die("out of memory");
+        s->record_cap = n;
+    }
+    if (fread(s->record, 1, n, s->f) != n) die("truncated recording");
+    *t = s->r.time_ms;
+    return 1;
+}
+
+// Apply the record read to the screen
+static void screen_apply(struct screen *s)
+{
+    const uint8_t *p = s->record;
+    uint32_t n = s->r.size - sizeof(s->r);
+    switch (s->r.type) {
+    case SCREENREC_MODE:
+        if (n < sizeof(s->mode)) die("corrupt mode record");
+        memcpy(&s->mode, p, sizeof(s->mode));
+        if (s->mode.depth != 1 && s->mode.depth != 2 && s->mode.depth != 4 &&
+            s->mode.depth != 8 && s->mode.depth != 16) die("unsupported depth");
+        if (s->mode.tile_width * s->mode.tiles_x > s->mode.width ||
+            s->mode.tile_height * s->mode.tiles_y > s->mode.height) die("corrupt mode record");
+        s->bytes_per_row = s->mode.width * s->mode.depth / 8;
+        free(s->fb);
+        s->fb = calloc(s->bytes_per_row, s->mode.height);
+        if (!s->fb) die("out of memory");
+        mark(s, 0, 0, s->mode.width, s->mode.height);
+        s->modes++;
+        break;
+    case SCREENREC_PALETTE: {
+        if (n < 4) die("corrupt palette record");
+        uint32_t first = p[0] | (p[1] << 8), count = p[2] | (p[3] << 8);
+        if (first + count > 256 || 4 + count * 3 > n) die("corrupt palette record");
+        memcpy(s->palette + first * 3, p + 4, count * 3);
+        if (s->fb) mark(s, 0, 0, s->mode.width, s->mode.height);
+        s->palettes++;
+        break;
+    }
+    case SCREENREC_FRAME:
+        apply_frame(s, p, p + n);
+        break;
+    default:
+        break;      // Newer record types
+    }
+}
+
+// Read and apply the next record
+static int screen_next(struct screen *s, uint32_t *t)
+{
+    if (!screen_read(s, t)) return 0;
+    screen_apply(s);
+    return 1;
+}
+
+// Pixel x of row y: palette index, or RGB332 of a 16-bit pixel
+static uint8_t screen_index(const struct screen *s, int x, int y)
+{
+    const uint8_t *row = s->fb + (size_t)y * s->bytes_per_row;
+    int d = s->mode.depth;
+    if (d == 16) {
+        uint16_t c = row[x * 2] | (row[x * 2 + 1] << 8);
+        return ((c >> 8) & 0xe0) | ((c >> 6) & 0x1c) | ((c >> 3) & 0x03);
+    }
+    if (d == 8) return row[x];
+    int per_byte = 8 / d;
+    int shift = 8 - d - (x % per_byte) * d;
+    return (row[x / per_byte] >> shift) & ((1 << d) - 1);
+}
+
+static void screen_rgb(const struct screen *s, int x, int y, uint8_t *rgb)
+{
+    if (s->mode.depth == 16) {
+        const uint8_t *p = s->fb + (size_t)y * s->bytes_per_row + x * 2;
+        uint16_t c = p[0] | (p[1] << 8);
+        uint8_t r = (c >> 8) & 0xf8, g = (c >> 3) & 0xfc, b = (c << 3) & 0xf8;
+        rgb[0] = r | (r >> 5);
+        rgb[1] = g | (g >> 6);
+        rgb[2] = b | (b >> 5);
+        return;
+    }
+    memcpy(rgb, s->palette + screen_index(s, x, y) * 3, 3);
+}
+
+/*
+ *  info
+ */
+static int cmd_info(const char *path)
+{
+    struct screen s;
+    uint32_t t = 0, last = 0;
+    screen_open(&s, path);
+    while (screen_next(&s, &t)) {
+        last = t;
+    }
+    printf("Screen:    %ux%u, %u bits, %ux%u tiles of %ux%u\n", s.mode.width, s.mode.height,
+           s.mode.depth, s.mode.tiles_x, s.mode.tiles_y, s.mode.tile_width, s.mode.tile_height);
+    printf("Length:    %u.%03u s\n", last / 1000, last % 1000);
+    printf("Records:   %u frames, %u palettes, %u modes\n", s.frames, s.palettes, s.modes);
+    return 0;
+}
+
+/*
+ *  gif
+ */
+struct gif_bits {
+    FILE *f;
+    uint8_t block[255];
+    int len;
+    uint32_t acc;
+    int nbits;
+};
+
+static void gif_byte(struct gif_bits *b, uint8_t v)
+{
+    b->block[b->len++] = v;
+    if (b->len == 255) {
+        fputc(255, b->f);
+        fwrite(b->block, 1, 255, b->f);
+        b->len = 0;
+    }
+}
+
+static void gif_code(struct gif_bits *b, int code, int size)
+{
+    b->acc |= (uint32_t)code << b->nbits;
+    b->nbits += size;
+    while (b->nbits >= 8) {
+        gif_byte(b, b->acc & 0xff);
+        b->acc >>= 8;
+        b->nbits -= 8;
+    }
+}
+
+// LZW image data of n 8-bit pixels
+static void gif_pixels(FILE *f, const uint8_t *px, size_t n)
+{
+    static int32_t keys[GIF_HASH_SIZE];
+    static uint16_t codes[GIF_HASH_SIZE];
+    struct gif_bits b = { f, { 0 }, 0, 0, 0 };
+    int size = 9, next = 258;
+
+    fputc(8, f);
+    memset(keys, 0xff, sizeof(keys));
+    gif_code(&b, 256, size);
+    int prefix = px[0];
+    for (size_t i = 1; i < n; i++) {
+        int32_t key = (prefix << 8) | px[i];
+        uint32_t h = ((uint32_t)key * 2654435761u) % GIF_HASH_SIZE;
+        while (keys[h] != -1 && keys[h] != key) {
+            h = (h + 1) % GIF_HASH_SIZE;
+        }
+        if (keys[h] == key) {
+            prefix = codes[h];
+            continue;
+        }
+        gif_code(&b, prefix, size);
+        if (next < 4096) {
+            if (next == (1 << size)) size++;
+            keys[h] = key;
+            codes[h] = next++;
+        } else {
+            gif_code(&b, 256, size);
+            memset(keys, 0xff, sizeof(keys));
+            size = 9;
+            next = 258;
+        }
+        prefix = px[i];
+    }
+    gif_code(&b, prefix, size);
+    gif_code(&b, 257, size);
+    if (b.nbits > 0) gif_byte(&b, b.acc & 0xff);
+    if (b.len > 0) {
+        fputc(b.len, f);
+        fwrite(b.block, 1, b.len, f);
+    }
+    fputc(0, f);
+}
+
+static void put16(FILE *f, unsigned v)
+{
+    fputc(v & 0xff, f);
+    fputc(v >> 8, f);
+}
+
+// One image: the rectangle, with its own colour table
+struct gif_image {
+    int x, y, w, h;
+    uint8_t palette[256 * 3];
+    uint8_t *px;
+    uint32_t time_ms;
+};
+
+static void gif_write_image(FILE *f, const struct gif_image *img, uint32_t delay_ms)
+{
+    fputc(0x21, f);                 // Graphic control extension
+    fputc(0xf9, f);
+    fputc(4, f);
+    fputc(0, f);
+    put16(f, (delay_ms + 5) / 10);
+    fputc(0, f);
+    fputc(0, f);
+
+    fputc(0x2c, f);                 // Image descriptor, local colour table
+    put16(f, img->x);
+    put16(f, img->y);
+    put16(f, img->w);
+    put16(f, img->h);
+    fputc(0x87, f);
+    fwrite(img->palette, 1, sizeof(img->palette), f);
+    gif_pixels(f, img->px, (size_t)img->w * img->h);
+}
+
+static void gif_take(struct screen *s, struct gif_image *img, uint32_t t)
+{
+    img->x = s->x0;
+    img->y = s->y0;
+    img->w = s->x1 - s->x0;
+    img->h = s->y1 - s->y0;
+    img->time_ms = t;
+    if (s->mode.depth == 16) {
+        for (int i = 0; i < 256; i++) {
+            uint8_t r = i & 0xe0, g = (i << 3) & 0xe0, b = (i << 6) & 0xc0;
+            img->palette[i * 3 + 0] = r | (r >> 3) | (r >> 6);
+            img->palette[i * 3 + 1] = g | (g >> 3) | (g >> 6);
+            img->palette[i * 3 + 2] = b | (b >> 2) | (b >> 4) | (b >> 6);
+        }
+    } else {
+        memcpy(img->palette, s->palette, sizeof(img->palette));
+    }
+    uint8_t *p = img->px;
+    for (int y = img->y; y < img->y + img->h; y++) {
+        for (int x = img->x; x < img->x + img->w; x++) {
+            *p++ = screen_index(s, x, y);
+        }
+    }
+    s->x1 = 0;
+}
+
+static int cmd_gif(const char *in, const char *out)
+{
+    struct screen s;
+    struct gif_image img;
+    uint32_t t = 0, state_time = 0;
+    int have_image = 0, width = 0, height = 0;
+
+    // The logical screen is the largest mode
+    screen_open(&s, in);
+    while (screen_next(&s, &t)) {
+        if (s.mode.width > width) width = s.mode.width;
+        if (s.mode.height > height) height = s.mode.height;
+    }
+    fclose(s.f);
+    free(s.fb);
+    free(s.record);
+    if (width == 0) die("no screen mode in the recording");
+    img.px = malloc((size_t)width * height);
+    if (!img.px) die("out of memory");
+
+    FILE *f = fopen(out, "wb");
+    if (!f) die("can't create the GIF");
+    fwrite("GIF89a", 1, 6, f);
+    put16(f, width);
+    put16(f, height);
+    fputc(0, f);                    // No global colour table
+    fputc(0, f);
+    fputc(0, f);
+    fwrite("\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 1, 19, f);   // Loop forever
+
+    // Take the changed rectangle once all the records of its time are in
+    // and it is at least GIF_MIN_DELAY_MS after the last image; write each
+    // image once the time of the one after it is known
+    screen_open(&s, in);
+    uint32_t frames = 0;
+    for (;;) {
+        int more = screen_read(&s, &t);
+        if (s.x1 != 0 && (!more || t > state_time) &&
+            (!have_image || state_time >= img.time_ms + GIF_MIN_DELAY_MS || !more)) {
+            if (have_image) {
+                gif_write_image(f, &img, state_time - img.time_ms);
+                frames++;
+            }
+            gif_take(&s, &img, state_time);
+            have_image = 1;
+        }
+        if (!more) break;
+        screen_apply(&s);
+        state_time = t;
+    }
+    if (have_image) {
+        gif_write_image(f, &img, 1000);
+        frames++;
+    }
+    fputc(0x3b, f);
+    if (fclose(f) != 0) die("can't write the GIF");
+    fprintf(stderr, "%ux%u, %u images, %u.%03u s\n", width, height, frames,
+            state_time / 1000, state_time % 1000);
+    fclose(s.f);
+    return 0;
+}
+
+/*
+ *  raw
+ */
+static void raw_write(struct screen *s, uint8_t *rgb, int width, int height)
+{
+    memset(rgb, 0, (size_t)width * height * 3);
+    if (s->fb) {
+        for (int y = 0; y < s->mode.height; y++) {
+            for (int x = 0; x < s->mode.width; x++) {
+                screen_rgb(s, x, y, rgb + ((size_t)y * width + x) * 3);
+            }
+        }
+    }
+    if (fwrite(rgb, 3, (size_t)width * height, stdout) != (size_t)width * height) die("can't write the frames");
+}
+
+static int cmd_raw(const char *in, int fps)
+{
+    struct screen s;
+    uint32_t t = 0;
+    int width = 0, height = 0;
+
+    screen_open(&s, in);
+    while (screen_next(&s, &t)) {
+        if (s.mode.width > width) width = s.mode.width;
+        if (s.mode.height > height) height = s.mode.height;
+    }
+    fclose(s.f);
+    free(s.fb);
+    free(s.record);
+    if (width == 0) die("no screen mode in the recording");
+    uint8_t *rgb = malloc((size_t)width * height * 3);
+    if (!rgb) die("out of memory");
+
+    // Frame n shows the records up to n / fps seconds
+    screen_open(&s, in);
+    uint64_t n = 0;
+    while (screen_read(&s, &t)) {
+        while (n * 1000 / fps < t) {
+            raw_write(&s, rgb, width, height);
+            n++;
+        }
+        screen_apply(&s);
+    }
+    raw_write(&s, rgb, width, height);
+    n++;
+    fprintf(stderr, "%dx%d, %llu frames at %d fps\n", width, height, (unsigned long long)n, fps);
+    fclose(s.f);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "info") == 0) return cmd_info(argv[2]);
+    if (argc == 4 && strcmp(argv[1], "gif") == 0) return cmd_gif(argv[2], argv[3]);
+    if (argc >= 3 && strcmp(argv[1], "raw") == 0) {
+        int fps = 30, i = 2;
+        if (argc == 5 && strcmp(argv[2], "-r") == 0) {
+            fps = atoi(argv[3]);
+            i = 4;
+        }
+        if (fps > 0 && i == argc - 1) return cmd_raw(argv[i], fps);
+    }
+    fprintf(stderr, "usage: screenrec info in.rec\n"
+                    "       screenrec gif in.rec out.gif\n"
+                    "       screenrec raw [-r fps] in.rec > frames.rgb\n");
+    return 1;
+}